@@ -0,0 +1,115 @@
+/*
+ * DFU host for the DFU class driver tests.
+ */
+#include <string.h>
+#include "dfu_host.h"
+#include "msc_harness.h"
+
+/* class handler dispatch of the core, not in a header */
+extern ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event);
+
+ErrorCode_t dfu_host_init(USBD_DFU_INIT_PARAM_T *param, uint32_t init_state)
+{
+	ErrorCode_t ret;
+
+	ret = msc_harness_init_core(USB_HIGH_SPEED, 1);
+	if (ret != LPC_OK) {
+		return ret;
+	}
+	msc_core.config_value = 1;
+	return mwDFU_init(&msc_core, param, init_state);
+}
+
+/* drop what the last request queued on EP0 */
+static void dfu_ep0_drain(void)
+{
+	fake_ep[0].head = fake_ep[0].count = 0;
+	fake_ep[1].head = fake_ep[1].count = 0;
+}
+
+static ErrorCode_t dfu_setup(uint8_t dir_in, uint8_t req, uint16_t value, uint16_t len)
+{
+	dfu_ep0_drain();
+	memset(&msc_core.SetupPacket, 0, sizeof(msc_core.SetupPacket));
+	msc_core.SetupPacket.bmRequestType.B = dir_in ? 0xA1 : 0x21;
+	msc_core.SetupPacket.bRequest = req;
+	msc_core.SetupPacket.wValue.W = value;
+	msc_core.SetupPacket.wIndex.W = 0;
+	msc_core.SetupPacket.wLength = len;
+	msc_core.EP0Data.Count = len;
+	return USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_SETUP);
+}
+
+ErrorCode_t dfu_dnload(uint16_t block, const uint8_t *data, uint16_t len)
+{
+	ErrorCode_t ret;
+
+	ret = dfu_setup(0, USB_REQ_DFU_DNLOAD, block, len);
+	if ((ret == LPC_OK) && (len != 0)) {
+		memcpy(msc_core.EP0Data.pData, data, len);
+		msc_core.EP0Data.pData += len;
+		msc_core.EP0Data.Count = 0;
+		ret = USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_OUT);
+	}
+	dfu_ep0_drain();
+	return ret;
+}
+
+int32_t dfu_upload(uint16_t block, uint8_t *data, uint16_t len)
+{
+	uint32_t max_packet = ((USB_DEVICE_DESCRIPTOR *) msc_core.device_desc)->bMaxPacketSize0;
+	FAKE_XFER_T *xfer;
+	uint32_t got = 0, n;
+
+	if (dfu_setup(1, USB_REQ_DFU_UPLOAD, block, len) != LPC_OK) {
+		dfu_ep0_drain();
+		return -1;
+	}
+	while ((xfer = fake_hw_peek(0x80)) != 0) {
+		n = xfer->len;
+		if (n > len - got) {
+			n = len - got;
+		}
+		memcpy(&data[got], xfer->data, n);
+		got += n;
+		fake_hw_complete_in(&msc_core, 0x80);
+		if ((got == len) || (n % max_packet) || (n == 0)) {
+			/* the host goes on to the status stage */
+			break;
+		}
+	}
+	dfu_ep0_drain();
+	return got;
+}
+
+ErrorCode_t dfu_getstatus(DFU_STATUS_T *status)
+{
+	FAKE_XFER_T *xfer;
+	ErrorCode_t ret;
+
+	memset(status, 0, sizeof(*status));
+	ret = dfu_setup(1, USB_REQ_DFU_GETSTATUS, 0, DFU_GET_STATUS_SIZE);
+	xfer = fake_hw_peek(0x80);
+	if ((ret == LPC_OK) && xfer && (xfer->len == DFU_GET_STATUS_SIZE)) {
+		memcpy(status, xfer->data, DFU_GET_STATUS_SIZE);
+	}
+	else if (ret == LPC_OK) {
+		ret = ERR_FAILED;
+	}
+	dfu_ep0_drain();
+	return ret;
+}
+
+uint32_t dfu_poll_timeout(const DFU_STATUS_T *status)
+{
+	return status->bwPollTimeout[0] | (status->bwPollTimeout[1] << 8) | (status->bwPollTimeout[2] << 16);
+}
+
+ErrorCode_t dfu_request(uint8_t req, uint16_t value)
+{
+	ErrorCode_t ret;
+
+	ret = dfu_setup(0, req, value, 0);
+	dfu_ep0_drain();
+	return ret;
+}
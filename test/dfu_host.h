@@ -0,0 +1,37 @@
+/*
+ * DFU host for the DFU class driver tests.
+ *
+ * Sends DFU class requests the way dfu-util does, through the class handlers
+ * of the core on the fake controller: SETUP, the data stage on EP0 and the
+ * status stage. Replies on EP0 are copied out and the EP0 queues emptied, so
+ * any number of requests can follow each other.
+ */
+#ifndef __DFU_HOST_H_
+#define __DFU_HOST_H_
+
+#include "fake_hw.h"
+#include "mw_usbd_dfu.h"
+#include "mw_usbd_dfuuser.h"
+
+/* Core init on the msc_ram descriptors and DFU init on intf_desc; the
+   DFU function gets the whole EP0 handler chain to itself. */
+ErrorCode_t dfu_host_init(USBD_DFU_INIT_PARAM_T *param, uint32_t init_state);
+
+/* DNLOAD of len bytes as block; len 0 ends the download */
+ErrorCode_t dfu_dnload(uint16_t block, const uint8_t *data, uint16_t len);
+
+/* UPLOAD of up to len bytes as block into data: each transfer queued on
+   EP0 IN is copied and completed until the host has len bytes or a short
+   packet. Returns the bytes received, or -1 when the request stalls. */
+int32_t dfu_upload(uint16_t block, uint8_t *data, uint16_t len);
+
+/* GETSTATUS; the reply is copied to status */
+ErrorCode_t dfu_getstatus(DFU_STATUS_T *status);
+
+/* bwPollTimeout of a GETSTATUS reply in ms */
+uint32_t dfu_poll_timeout(const DFU_STATUS_T *status);
+
+/* a request without data stage: CLRSTATUS, ABORT, DETACH */
+ErrorCode_t dfu_request(uint8_t req, uint16_t value);
+
+#endif /* __DFU_HOST_H_ */
@@ -0,0 +1,197 @@
+/*
+ * Fake USBD_HW_API_T for the host tests.
+ */
+#include <string.h>
+#include "fake_hw.h"
+
+FAKE_EP_T fake_ep[2 * USB_MAX_EP_NUM];
+uint32_t fake_frame;
+
+/* length of the transfer retired last, reported by GetXferLen */
+static uint32_t fake_done_len[2 * USB_MAX_EP_NUM];
+
+static void fake_push(uint32_t ep_addr, uint8_t *pData, uint32_t len)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(ep_addr)];
+
+	if (ep->count < FAKE_HW_MAX_QUEUED) {
+		ep->queue[(ep->head + ep->count) % FAKE_HW_MAX_QUEUED].data = pData;
+		ep->queue[(ep->head + ep->count) % FAKE_HW_MAX_QUEUED].len = len;
+		ep->count++;
+		if (ep->count > ep->max_queued) {
+			ep->max_queued = ep->count;
+		}
+	}
+}
+
+static void fake_pop(FAKE_EP_T *ep)
+{
+	ep->head = (ep->head + 1) % FAKE_HW_MAX_QUEUED;
+	ep->count--;
+}
+
+static uint32_t fake_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(EPNum | 0x80)];
+
+	if (ep->count >= FAKE_HW_MAX_QUEUED) {
+		return 0;
+	}
+	fake_push(EPNum | 0x80, pData, cnt);
+	ep->xfers++;
+	ep->bytes += cnt;
+	return cnt;
+}
+
+static uint32_t fake_ReadReqEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t len)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(EPNum & 0x0F)];
+
+	if (ep->count >= FAKE_HW_MAX_QUEUED) {
+		return 0;
+	}
+	fake_push(EPNum & 0x0F, pData, len);
+	return len;
+}
+
+static uint32_t fake_ReadEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData)
+{
+	return fake_ep[fake_ep_index(EPNum & 0x0F)].rx_len;
+}
+
+static uint32_t fake_ReadSetupPkt(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pData)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+
+	/* fake_hw_setup() stored the packet already */
+	memcpy(pData, &pCtrl->SetupPacket, sizeof(USB_SETUP_PACKET));
+	return sizeof(USB_SETUP_PACKET);
+}
+
+static void fake_SetStallEP(USBD_HANDLE_T hUsb, uint32_t EPNum)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(EPNum)];
+
+	ep->stalled = 1;
+	ep->stalls++;
+}
+
+static void fake_ClrStallEP(USBD_HANDLE_T hUsb, uint32_t EPNum)
+{
+	fake_ep[fake_ep_index(EPNum)].stalled = 0;
+}
+
+static void fake_ResetEP(USBD_HANDLE_T hUsb, uint32_t EPNum)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(EPNum)];
+
+	ep->head = 0;
+	ep->count = 0;
+}
+
+static uint32_t fake_GetFrameNumber(USBD_HANDLE_T hUsb)
+{
+	return fake_frame;
+}
+
+static uint32_t fake_GetXferLen(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pStatus)
+{
+	if (pStatus) {
+		*pStatus = 0;
+	}
+	return fake_done_len[fake_ep_index(EPNum)];
+}
+
+static void fake_EpNop(USBD_HANDLE_T hUsb, uint32_t EPNum)
+{}
+
+static void fake_ConfigEP(USBD_HANDLE_T hUsb, USB_ENDPOINT_DESCRIPTOR *pEPD)
+{}
+
+static ErrorCode_t fake_SetTestMode(USBD_HANDLE_T hUsb, uint8_t mode)
+{
+	return LPC_OK;
+}
+
+const USBD_HW_API_T fake_hw_api = {
+	.SetAddress = fake_EpNop,
+	.Configure = fake_EpNop,
+	.WakeUpCfg = fake_EpNop,
+	.ConfigEP = fake_ConfigEP,
+	.DirCtrlEP = fake_EpNop,
+	.EnableEP = fake_EpNop,
+	.DisableEP = fake_EpNop,
+	.ResetEP = fake_ResetEP,
+	.SetStallEP = fake_SetStallEP,
+	.ClrStallEP = fake_ClrStallEP,
+	.SetTestMode = fake_SetTestMode,
+	.ReadEP = fake_ReadEP,
+	.ReadReqEP = fake_ReadReqEP,
+	.ReadSetupPkt = fake_ReadSetupPkt,
+	.WriteEP = fake_WriteEP,
+	.GetFrameNumber = fake_GetFrameNumber,
+	.GetXferLen = fake_GetXferLen,
+};
+
+void fake_hw_reset(void)
+{
+	memset(fake_ep, 0, sizeof(fake_ep));
+	memset(fake_done_len, 0, sizeof(fake_done_len));
+	fake_frame = 0;
+}
+
+FAKE_XFER_T *fake_hw_peek(uint32_t ep_addr)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(ep_addr)];
+
+	return ep->count ? &ep->queue[ep->head] : 0;
+}
+
+ErrorCode_t fake_hw_event(USB_CORE_CTRL_T *pCtrl, uint32_t ep_addr, uint32_t event)
+{
+	uint32_t n = fake_ep_index(ep_addr);
+
+	if (pCtrl->ep_event_hdlr[n] == 0) {
+		return ERR_FAILED;
+	}
+	return pCtrl->ep_event_hdlr[n](pCtrl, pCtrl->ep_hdlr_data[n], event);
+}
+
+ErrorCode_t fake_hw_complete_in(USB_CORE_CTRL_T *pCtrl, uint32_t ep_addr)
+{
+	uint32_t n = fake_ep_index(ep_addr | 0x80);
+	FAKE_EP_T *ep = &fake_ep[n];
+
+	if (ep->count == 0) {
+		return ERR_FAILED;
+	}
+	fake_done_len[n] = ep->queue[ep->head].len;
+	fake_pop(ep);
+	return fake_hw_event(pCtrl, ep_addr | 0x80, USB_EVT_IN);
+}
+
+uint32_t fake_hw_host_out(USB_CORE_CTRL_T *pCtrl, uint32_t ep_addr, const uint8_t *data, uint32_t len)
+{
+	uint32_t n = fake_ep_index(ep_addr & 0x0F);
+	FAKE_EP_T *ep = &fake_ep[n];
+	FAKE_XFER_T xfer;
+
+	if (ep->count == 0) {
+		fake_hw_event(pCtrl, ep_addr & 0x0F, USB_EVT_OUT_NAK);
+		if (ep->count == 0) {
+			return 0;
+		}
+	}
+	xfer = ep->queue[ep->head];
+	fake_pop(ep);
+	if (len > xfer.len) {
+		len = xfer.len;
+	}
+	memcpy(xfer.data, data, len);
+	ep->rx_len = len;
+	ep->xfers++;
+	ep->bytes += len;
+	fake_done_len[n] = len;
+	fake_hw_event(pCtrl, ep_addr & 0x0F, USB_EVT_OUT);
+	return len;
+}
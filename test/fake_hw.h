@@ -0,0 +1,63 @@
+/*
+ * Fake USBD_HW_API_T for the host tests.
+ *
+ * The fake controller records what the class drivers queue on each endpoint
+ * and lets the test complete those transfers one at a time, calling the
+ * endpoint handlers the way hwUSB_ISR does on the target.
+ */
+#ifndef __FAKE_HW_H_
+#define __FAKE_HW_H_
+
+#include "mw_usbd.h"
+#include "mw_usbd_core.h"
+#include "mw_usbd_hw.h"
+
+#define FAKE_HW_MAX_QUEUED  16
+
+typedef struct {
+	uint8_t *data;
+	uint32_t len;
+} FAKE_XFER_T;
+
+typedef struct {
+	/* transfers queued by WriteEP (IN) or ReadReqEP (OUT), oldest first */
+	FAKE_XFER_T queue[FAKE_HW_MAX_QUEUED];
+	uint32_t head;
+	uint32_t count;
+	/* length reported by the next ReadEP */
+	uint32_t rx_len;
+	uint32_t stalled;
+	/* statistics */
+	uint32_t xfers;
+	uint32_t bytes;
+	uint32_t max_queued;
+	uint32_t stalls;
+} FAKE_EP_T;
+
+extern const USBD_HW_API_T fake_hw_api;
+extern FAKE_EP_T fake_ep[2 * USB_MAX_EP_NUM];
+extern uint32_t fake_frame;
+
+/* endpoint address to the fake_ep[] / ep_event_hdlr[] index */
+static inline uint32_t fake_ep_index(uint32_t ep_addr)
+{
+	return ((ep_addr & 0x0F) << 1) + ((ep_addr & 0x80) ? 1 : 0);
+}
+
+void fake_hw_reset(void);
+
+/* oldest transfer queued on an endpoint, 0 if none */
+FAKE_XFER_T *fake_hw_peek(uint32_t ep_addr);
+
+/* retire the oldest IN transfer and raise USB_EVT_IN */
+ErrorCode_t fake_hw_complete_in(USB_CORE_CTRL_T *pCtrl, uint32_t ep_addr);
+
+/* host sends len bytes: raise USB_EVT_OUT_NAK when nothing is primed, then
+   copy into the primed buffer and raise USB_EVT_OUT. Returns the number of
+   bytes accepted, 0 when the endpoint never primed. */
+uint32_t fake_hw_host_out(USB_CORE_CTRL_T *pCtrl, uint32_t ep_addr, const uint8_t *data, uint32_t len);
+
+/* raise an event on an endpoint handler */
+ErrorCode_t fake_hw_event(USB_CORE_CTRL_T *pCtrl, uint32_t ep_addr, uint32_t event);
+
+#endif /* __FAKE_HW_H_ */
@@ -0,0 +1,182 @@
+/*
+ * IP9028 register block model for the controller driver tests.
+ */
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ip9028_model.h"
+#include "app_usbd_cfg.h"
+
+USB_OTG_REGS_T ip9028_regs;
+
+static uint8_t ip9028_pool[64 * 1024] __attribute__((aligned(2048)));
+static DQH_T *ip9028_ep_qh;
+static DTD_T *ip9028_ep_td;
+static uint32_t ip9028_depth;
+static uint32_t ip9028_num_ep;
+/* dTD the controller works on, per ENDPTxxx bit */
+static DTD_T *ip9028_cur[32];
+static volatile int ip9028_init_done;
+static volatile int ip9028_isr_done;
+
+static void *ip9028_reset_thread(void *arg)
+{
+	while (!ip9028_init_done) {
+		ip9028_regs.usbcmd &= ~USBCMD_RST;
+		ip9028_regs.endptprime = 0;
+		ip9028_regs.endptflush = 0;
+	}
+	return 0;
+}
+
+ErrorCode_t ip9028_model_init(USBD_HANDLE_T *phUsb, uint32_t max_num_ep, uint32_t dtd_pool_depth)
+{
+	USBD_API_INIT_PARAM_T param;
+	USB_CORE_DESCS_T desc;
+	pthread_t thread;
+	ErrorCode_t ret;
+
+	memset((void *) &ip9028_regs, 0, sizeof(ip9028_regs));
+	memset(ip9028_pool, 0, sizeof(ip9028_pool));
+	memset(ip9028_cur, 0, sizeof(ip9028_cur));
+
+	memset(&param, 0, sizeof(param));
+	param.usb_reg_base = (uint32_t) &ip9028_regs;
+	param.mem_base = (uint32_t) ip9028_pool;
+	param.mem_size = sizeof(ip9028_pool);
+	param.max_num_ep = max_num_ep;
+	param.dtd_pool_depth = dtd_pool_depth;
+	memset(&desc, 0, sizeof(desc));
+	desc.device_desc = (uint8_t *) USB_DeviceDescriptor;
+	desc.string_desc = (uint8_t *) USB_StringDescriptor;
+	desc.high_speed_desc = USB_HsConfigDescriptor;
+	desc.full_speed_desc = USB_FsConfigDescriptor;
+	desc.device_qualifier = (uint8_t *) USB_DeviceQualifier;
+
+	ip9028_init_done = 0;
+	pthread_create(&thread, 0, ip9028_reset_thread, 0);
+	ret = hwUSB_Init(phUsb, &desc, &param);
+	ip9028_init_done = 1;
+	pthread_join(thread, 0);
+
+	/* same layout as hwUSB_Init */
+	ip9028_ep_qh = (DQH_T *) ip9028_pool;
+	ip9028_ep_td = (DTD_T *) (ip9028_pool + 2 * max_num_ep * sizeof(DQH_T));
+	ip9028_depth = dtd_pool_depth ? dtd_pool_depth : 1;
+	ip9028_num_ep = max_num_ep;
+	return ret;
+}
+
+static uint32_t ip9028_index(uint32_t ep_addr)
+{
+	return ((ep_addr & 0x0F) << 1) + ((ep_addr & 0x80) ? 1 : 0);
+}
+
+DQH_T *ip9028_qh(uint32_t ep_addr)
+{
+	return &ip9028_ep_qh[ip9028_index(ep_addr)];
+}
+
+DTD_T *ip9028_td(uint32_t ep_addr, uint32_t slot)
+{
+	return &ip9028_ep_td[ip9028_index(ep_addr) * ip9028_depth + slot];
+}
+
+uint32_t ip9028_model_take_primes(void)
+{
+	uint32_t prime = ip9028_regs.endptprime;
+	uint32_t n, edpt;
+
+	for (n = 0; n < 32; n++) {
+		if (prime & _BIT(n)) {
+			edpt = ((n & 0x0F) << 1) + ((n >= 16) ? 1 : 0);
+			ip9028_cur[n] = (DTD_T *) ip9028_ep_qh[edpt].next_dTD;
+			ip9028_regs.endptstatus |= _BIT(n);
+		}
+	}
+	ip9028_regs.endptprime = 0;
+	return prime;
+}
+
+void ip9028_model_drop_prime(uint32_t ep_addr)
+{
+	ip9028_regs.endptprime &= ~_BIT(ip9028_bit(ep_addr));
+}
+
+uint32_t ip9028_model_run(uint32_t ep_addr, uint32_t max_dtds, uint32_t rx_len, uint32_t stop)
+{
+	uint32_t n = ip9028_bit(ep_addr);
+	uint32_t done = 0, len;
+	DTD_T *td = ip9028_cur[n];
+
+	if (!(ip9028_regs.endptstatus & _BIT(n))) {
+		return 0;
+	}
+	while (td && (done < max_dtds) && (td->total_bytes & TD_STATUS_ACTIVE)) {
+		/* bytes left in the dTD */
+		len = (td->total_bytes >> 16) & 0x7FFF;
+		if (!(ep_addr & 0x80)) {
+			len = (rx_len < len) ? (len - rx_len) : 0;
+		}
+		else {
+			len = 0;
+		}
+		td->total_bytes = (td->total_bytes & ~(0x7FFF0000 | TD_STATUS_ACTIVE)) | (len << 16);
+		if (td->total_bytes & TD_IOC) {
+			ip9028_regs.endptcomplete |= _BIT(n);
+		}
+		done++;
+		td = (td->next_dTD & TD_NEXT_TERMINATE) ? 0 : (DTD_T *) td->next_dTD;
+	}
+	ip9028_cur[n] = td;
+	if (!td || stop) {
+		/* end of the list: the endpoint goes idle */
+		ip9028_cur[n] = 0;
+		ip9028_regs.endptstatus &= ~_BIT(n);
+	}
+	return done;
+}
+
+void ip9028_model_isr(USBD_HANDLE_T hUsb, uint32_t usbsts)
+{
+	if (ip9028_regs.endptcomplete) {
+		usbsts |= USBSTS_UI;
+	}
+	ip9028_regs.usbsts = usbsts;
+	hwUSB_ISR(hUsb);
+	/* write-1-to-clear registers the driver acknowledged */
+	ip9028_regs.usbsts = 0;
+	ip9028_regs.endptcomplete = 0;
+	ip9028_regs.endptnak = 0;
+	ip9028_regs.endptsetupstat = 0;
+	ip9028_regs.endptflush = 0;
+}
+
+static void *ip9028_setup_thread(void *arg)
+{
+	/* hwUSB_CaptureEvents enables the EP0 NAK interrupts before it takes
+	   the packet, then writes ENDPTSETUPSTAT back until it reads 0. A
+	   plain memory cell keeps the written back bits: clear it until the
+	   ISR has returned. */
+	while ((ip9028_regs.endptnaken & 0x00010001) != 0x00010001) {
+	}
+	usleep(20000);
+	while (!ip9028_isr_done) {
+		ip9028_regs.endptsetupstat = 0;
+	}
+	return 0;
+}
+
+void ip9028_model_isr_setup(USBD_HANDLE_T hUsb, const USB_SETUP_PACKET *pkt)
+{
+	pthread_t thread;
+
+	memcpy((void *) ip9028_ep_qh[0].setup, pkt, sizeof(USB_SETUP_PACKET));
+	ip9028_regs.endptnaken &= ~0x00010001;
+	ip9028_regs.endptsetupstat = _BIT(0);
+	ip9028_isr_done = 0;
+	pthread_create(&thread, 0, ip9028_setup_thread, 0);
+	ip9028_model_isr(hUsb, USBSTS_UI);
+	ip9028_isr_done = 1;
+	pthread_join(thread, 0);
+}
@@ -0,0 +1,55 @@
+/*
+ * IP9028 register block model for the controller driver tests.
+ *
+ * The driver runs against a static USB_OTG_REGS_T. The test plays the part
+ * of the controller between driver calls: it takes primes, walks the dTD
+ * lists the driver built and raises completion interrupts. Write-1-to-clear
+ * registers are cleared by the model after each interrupt.
+ */
+#ifndef __IP9028_MODEL_H_
+#define __IP9028_MODEL_H_
+
+#include "mw_usbd.h"
+#include "mw_usbd_core.h"
+#include "mw_usbd_hw.h"
+#include "hw_usbd_ip9028.h"
+
+extern USB_OTG_REGS_T ip9028_regs;
+
+/* ENDPTxxx bit of an endpoint address, eg. 0x81 -> 17 */
+static inline uint32_t ip9028_bit(uint32_t ep_addr)
+{
+	return (ep_addr & 0x0F) + ((ep_addr & 0x80) ? 16 : 0);
+}
+
+/* hwUSB_Init on the model, with the msc_ram descriptors. A helper thread
+   completes the controller reset and the flushes the driver waits for. */
+ErrorCode_t ip9028_model_init(USBD_HANDLE_T *phUsb, uint32_t max_num_ep, uint32_t dtd_pool_depth);
+
+/* dQH and dTD slot of an endpoint, as laid out by hwUSB_Init */
+DQH_T *ip9028_qh(uint32_t ep_addr);
+DTD_T *ip9028_td(uint32_t ep_addr, uint32_t slot);
+
+/* controller accepts the pending primes: ENDPTPRIME bits move to
+   ENDPTSTATUS and the endpoints start at the dQH next_dTD */
+uint32_t ip9028_model_take_primes(void);
+
+/* controller drops a pending prime without starting the endpoint */
+void ip9028_model_drop_prime(uint32_t ep_addr);
+
+/* controller finishes up to max_dtds active dTDs of a running endpoint.
+   OUT dTDs receive rx_len bytes each (clipped to the dTD). With stop set
+   the endpoint goes idle after the last one even if it is linked to more
+   dTDs, as when the link was made too late. Returns the number done. */
+uint32_t ip9028_model_run(uint32_t ep_addr, uint32_t max_dtds, uint32_t rx_len, uint32_t stop);
+
+/* raise the interrupt for the given USBSTS bits (UI is added when dTDs
+   completed) and call hwUSB_ISR */
+void ip9028_model_isr(USBD_HANDLE_T hUsb, uint32_t usbsts);
+
+/* receive a setup packet on EP0 and raise the interrupt. ENDPTSETUPSTAT
+   is write-1-to-clear on the controller; a helper thread clears it once
+   the driver has had time to take the packet. */
+void ip9028_model_isr_setup(USBD_HANDLE_T hUsb, const USB_SETUP_PACKET *pkt);
+
+#endif /* __IP9028_MODEL_H_ */
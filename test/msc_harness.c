@@ -0,0 +1,207 @@
+/*
+ * Bulk-only transport host for the MSC class driver tests.
+ */
+#include <string.h>
+#include "msc_harness.h"
+#include "app_usbd_cfg.h"
+
+#define MSC_HARNESS_POOL_SIZE   (512 * 1024)
+/* bound on handler calls per command, catches a stuck state machine */
+#define MSC_HARNESS_MAX_EVENTS  100000
+
+USB_CORE_CTRL_T msc_core;
+static USB_MSC_CTRL_T *msc_ctrl;
+static uint8_t msc_pool[MSC_HARNESS_POOL_SIZE] __attribute__((aligned(2048)));
+static uint32_t msc_tag;
+
+ErrorCode_t msc_harness_init_core(uint32_t speed, uint32_t dtd_pool_depth)
+{
+	USB_CORE_DESCS_T desc;
+	USBD_API_INIT_PARAM_T usb_param;
+	ErrorCode_t ret;
+
+	memset(&usb_param, 0, sizeof(usb_param));
+	usb_param.max_num_ep = 2;
+	usb_param.dtd_pool_depth = dtd_pool_depth;
+	memset(&desc, 0, sizeof(desc));
+	desc.device_desc = (uint8_t *) USB_DeviceDescriptor;
+	desc.string_desc = (uint8_t *) USB_StringDescriptor;
+	desc.high_speed_desc = USB_HsConfigDescriptor;
+	desc.full_speed_desc = USB_FsConfigDescriptor;
+	desc.device_qualifier = (uint8_t *) USB_DeviceQualifier;
+
+	fake_hw_reset();
+	ret = mwUSB_InitCore(&msc_core, &desc, &usb_param);
+	if (ret != LPC_OK) {
+		return ret;
+	}
+	msc_core.hw_api = &fake_hw_api;
+	msc_core.device_speed = speed;
+	return LPC_OK;
+}
+
+void msc_harness_set_ctrl(USB_MSC_CTRL_T *ctrl)
+{
+	msc_ctrl = ctrl;
+	msc_tag = 0;
+}
+
+ErrorCode_t msc_harness_init(USBD_MSC_INIT_PARAM_T *param, uint32_t speed, uint32_t dtd_pool_depth)
+{
+	ErrorCode_t ret;
+
+	ret = msc_harness_init_core(speed, dtd_pool_depth);
+	if (ret != LPC_OK) {
+		return ret;
+	}
+	if (param->mem_base == 0) {
+		memset(msc_pool, 0, sizeof(msc_pool));
+		param->mem_base = (uint32_t) msc_pool;
+		param->mem_size = sizeof(msc_pool);
+	}
+	if (param->intf_desc == 0) {
+		param->intf_desc = (uint8_t *) mwUSB_FindIntfDesc(&msc_core, USB_HIGH_SPEED, USB_DEVICE_CLASS_STORAGE);
+	}
+	msc_harness_set_ctrl((USB_MSC_CTRL_T *) param->mem_base);
+	return mwMSC_init(&msc_core, param);
+}
+
+USB_MSC_CTRL_T *msc_harness_ctrl(void)
+{
+	return msc_ctrl;
+}
+
+int msc_cmd(uint8_t lun, const uint8_t *cb, uint8_t cb_len, uint8_t dir_in, uint8_t *data, uint32_t data_len,
+			MSC_RESULT_T *res)
+{
+	MSC_CBW cbw;
+	MSC_CSW csw;
+	FAKE_XFER_T *xfer;
+	uint32_t moved = 0, n, events;
+	uint32_t stalls = fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].stalls +
+					  fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].stalls;
+	uint32_t in_xfers = fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].xfers;
+
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.dSignature = MSC_CBW_Signature;
+	cbw.dTag = ++msc_tag;
+	cbw.dDataLength = data_len;
+	cbw.bmFlags = dir_in ? 0x80 : 0x00;
+	cbw.bLUN = lun;
+	cbw.bCBLength = cb_len;
+	memcpy(cbw.CB, cb, cb_len);
+
+	if (fake_hw_host_out(&msc_core, MSC_HARNESS_OUT_EP, (uint8_t *) &cbw, sizeof(cbw)) != sizeof(cbw)) {
+		return -1;
+	}
+
+	for (events = 0; events < MSC_HARNESS_MAX_EVENTS; events++) {
+		xfer = fake_hw_peek(MSC_HARNESS_IN_EP);
+		if (xfer && (xfer->data == (uint8_t *) &msc_ctrl->CSW)) {
+			/* status stage */
+			memcpy(&csw, xfer->data, sizeof(csw));
+			fake_hw_complete_in(&msc_core, MSC_HARNESS_IN_EP);
+			fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].stalled = 0;
+			fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].stalled = 0;
+			if (res) {
+				res->status = csw.bStatus;
+				res->residue = csw.dDataResidue;
+				res->data_len = moved;
+				res->in_xfers = fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].xfers - in_xfers - 1;
+				res->stalls = fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].stalls +
+							  fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].stalls - stalls;
+			}
+			if ((csw.dSignature != MSC_CSW_Signature) || (csw.dTag != cbw.dTag) ||
+				(xfer->len != sizeof(MSC_CSW))) {
+				return -2;
+			}
+			return 0;
+		}
+		else if (xfer) {
+			/* device to host data */
+			if (!dir_in || (moved + xfer->len > data_len)) {
+				return -3;
+			}
+			memcpy(data + moved, xfer->data, xfer->len);
+			moved += xfer->len;
+			fake_hw_complete_in(&msc_core, MSC_HARNESS_IN_EP);
+		}
+		else if (!dir_in && (moved < data_len)) {
+			/* host to device data */
+			n = fake_hw_host_out(&msc_core, MSC_HARNESS_OUT_EP, data + moved, data_len - moved);
+			if (n == 0) {
+				return -4;
+			}
+			moved += n;
+		}
+		else {
+			/* neither a data stage nor a CSW pending */
+			return -5;
+		}
+	}
+	return -6;
+}
+
+int msc_rw(uint8_t lun, uint8_t opcode, uint64_t lba, uint32_t blocks, uint32_t block_size, uint8_t *data,
+		   MSC_RESULT_T *res)
+{
+	uint8_t cb[16];
+	uint8_t cb_len;
+	uint8_t dir_in = (opcode == SCSI_READ10) || (opcode == SCSI_READ12) || (opcode == SCSI_READ16);
+
+	memset(cb, 0, sizeof(cb));
+	cb[0] = opcode;
+	switch (opcode) {
+	case SCSI_READ10:
+	case SCSI_WRITE10:
+		msc_put_be(&cb[2], lba, 4);
+		msc_put_be(&cb[7], blocks, 2);
+		cb_len = 10;
+		break;
+
+	case SCSI_READ12:
+	case SCSI_WRITE12:
+		msc_put_be(&cb[2], lba, 4);
+		msc_put_be(&cb[6], blocks, 4);
+		cb_len = 12;
+		break;
+
+	default:
+		msc_put_be(&cb[2], lba, 8);
+		msc_put_be(&cb[10], blocks, 4);
+		cb_len = 16;
+		break;
+	}
+	return msc_cmd(lun, cb, cb_len, dir_in, data, blocks * block_size, res);
+}
+
+uint32_t msc_sense(uint8_t lun)
+{
+	uint8_t cb[6] = {SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0};
+	uint8_t sense[18];
+	MSC_RESULT_T res;
+
+	memset(sense, 0, sizeof(sense));
+	if ((msc_cmd(lun, cb, sizeof(cb), 1, sense, sizeof(sense), &res) != 0) || (res.status != CSW_CMD_PASSED)) {
+		return 0xFFFFFFFF;
+	}
+	return ((sense[2] & 0x0F) << 16) | (sense[12] << 8) | sense[13];
+}
+
+void msc_put_be(uint8_t *p, uint64_t v, uint32_t bytes)
+{
+	while (bytes--) {
+		p[bytes] = (uint8_t) v;
+		v >>= 8;
+	}
+}
+
+uint64_t msc_get_be(const uint8_t *p, uint32_t bytes)
+{
+	uint64_t v = 0;
+
+	while (bytes--) {
+		v = (v << 8) | *p++;
+	}
+	return v;
+}
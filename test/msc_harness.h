@@ -0,0 +1,57 @@
+/*
+ * Bulk-only transport host for the MSC class driver tests.
+ *
+ * Brings up the core with the msc_ram descriptors on the fake controller,
+ * initializes the MSC function and runs SCSI commands through the real
+ * endpoint handlers: CBW on the bulk OUT endpoint, data in either direction,
+ * CSW on the bulk IN endpoint.
+ */
+#ifndef __MSC_HARNESS_H_
+#define __MSC_HARNESS_H_
+
+#include "fake_hw.h"
+#include "mw_usbd_msc.h"
+#include "mw_usbd_mscuser.h"
+
+#define MSC_HARNESS_IN_EP   0x81
+#define MSC_HARNESS_OUT_EP  0x01
+
+typedef struct {
+	uint8_t status;			/* CSW bStatus */
+	uint32_t residue;		/* CSW dDataResidue */
+	uint32_t data_len;		/* bytes moved in the data stage */
+	uint32_t in_xfers;		/* data transfers queued on the IN endpoint */
+	uint32_t stalls;		/* endpoint halts during the command */
+} MSC_RESULT_T;
+
+extern USB_CORE_CTRL_T msc_core;
+
+/* Core and MSC init; param->mem_base/mem_size are filled in from a static
+   pool when 0 and param->intf_desc from the high speed configuration. */
+ErrorCode_t msc_harness_init(USBD_MSC_INIT_PARAM_T *param, uint32_t speed, uint32_t dtd_pool_depth);
+
+/* Core init only, for applications which initialize the MSC function
+   themselves. Call msc_harness_set_ctrl() with the memory they passed to
+   mwMSC_init() before running commands. */
+ErrorCode_t msc_harness_init_core(uint32_t speed, uint32_t dtd_pool_depth);
+void msc_harness_set_ctrl(USB_MSC_CTRL_T *ctrl);
+
+USB_MSC_CTRL_T *msc_harness_ctrl(void);
+
+/* Runs one command. data is the data stage buffer of data_len bytes, read
+   from for host to device and written to for device to host commands.
+   Returns 0 when the transport completed with a valid CSW. */
+int msc_cmd(uint8_t lun, const uint8_t *cb, uint8_t cb_len, uint8_t dir_in, uint8_t *data, uint32_t data_len,
+			MSC_RESULT_T *res);
+
+/* READ/WRITE with the 10, 12 or 16 byte CDB */
+int msc_rw(uint8_t lun, uint8_t opcode, uint64_t lba, uint32_t blocks, uint32_t block_size, uint8_t *data,
+		   MSC_RESULT_T *res);
+
+/* REQUEST SENSE: returns (sense key << 16) | (ASC << 8) | ASCQ */
+uint32_t msc_sense(uint8_t lun);
+
+void msc_put_be(uint8_t *p, uint64_t v, uint32_t bytes);
+uint64_t msc_get_be(const uint8_t *p, uint32_t bytes);
+
+#endif /* __MSC_HARNESS_H_ */
@@ -0,0 +1,34 @@
+/*
+ * Host stand-in for the LPC chip library: only what the example
+ * applications built by the tests use.
+ */
+#ifndef __CHIP_H_
+#define __CHIP_H_
+
+#include <stdint.h>
+#include "lpc_types.h"
+
+typedef enum {
+	USB0_IRQn = 8,
+} IRQn_Type;
+
+#define __NVIC_PRIO_BITS    3
+#define LPC_USB0_BASE       0x40006000
+
+/* interrupt masking has no effect on the host */
+static inline uint32_t NVIC_GetPriority(IRQn_Type irq)
+{
+	return 0;
+}
+
+static inline uint32_t __get_BASEPRI(void)
+{
+	return 0;
+}
+
+static inline void __set_BASEPRI(uint32_t basepri)
+{
+	(void) basepri;
+}
+
+#endif /* __CHIP_H_ */
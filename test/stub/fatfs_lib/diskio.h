@@ -0,0 +1,31 @@
+/*
+ * Host stand-in for the FatFs disk I/O interface. The tests implement the
+ * functions on top of a file.
+ */
+#ifndef __DISKIO_H_
+#define __DISKIO_H_
+
+#include <stdint.h>
+
+typedef uint8_t BYTE;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+
+typedef enum {
+	RES_OK = 0,
+	RES_ERROR,
+	RES_WRPRT,
+	RES_NOTRDY,
+	RES_PARERR
+} DRESULT;
+
+#define CTRL_SYNC           0
+#define GET_SECTOR_COUNT    1
+#define GET_SECTOR_SIZE     2
+#define GET_BLOCK_SIZE      3
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff);
+
+#endif /* __DISKIO_H_ */
@@ -0,0 +1,15 @@
+/*
+ * Host build settings for the SD card example, force-included after
+ * host_usbd.h into its translation units.
+ */
+#ifndef __HOST_SDCARD_H_
+#define __HOST_SDCARD_H_
+
+#include <stdint.h>
+
+/* the second read-ahead window lives at a fixed AHB SRAM address on the
+   target, the test provides the memory */
+extern uint8_t host_sd_win1[];
+#define MSC_SD_CACHE_WIN1_BASE      host_sd_win1
+
+#endif /* __HOST_SDCARD_H_ */
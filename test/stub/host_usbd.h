@@ -0,0 +1,16 @@
+/*
+ * Host build settings for the USB middleware, force-included into every
+ * translation unit of the test build.
+ */
+#ifndef __HOST_USBD_H_
+#define __HOST_USBD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* There is no PRIMASK on the host: the tests drive the ISR and the thread
+   level code from the same thread, so masking is a no-op. */
+#define USB_IRQ_SAVE()            0U
+#define USB_IRQ_RESTORE(m)        ((void) (m))
+
+#endif /* __HOST_USBD_H_ */
@@ -0,0 +1,29 @@
+/*
+ * Host stand-in for the chip library lpc_types.h.
+ */
+#ifndef __LPC_TYPES_H_
+#define __LPC_TYPES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* as defined by the CMSIS headers for GCC */
+#ifndef __packed
+#define __packed __attribute__((packed))
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#define TRUE  (!FALSE)
+#endif
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, IntStatus, SetState;
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+typedef enum {ERROR = 0, SUCCESS = !ERROR} Status;
+
+#define INLINE inline
+#define STATIC static
+#define EXTERN extern
+
+#endif /* __LPC_TYPES_H_ */
@@ -0,0 +1,8 @@
+/*
+ * Host stand-in for the mcu_sdcard library. The translate layer only goes
+ * through the FatFs disk I/O interface.
+ */
+#ifndef __SDCARD_H_
+#define __SDCARD_H_
+
+#endif /* __SDCARD_H_ */
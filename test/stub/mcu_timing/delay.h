@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the mcu_timing library. The tests implement the
+ * functions on a clock they advance themselves.
+ */
+#ifndef __DELAY_H_
+#define __DELAY_H_
+
+#include <stdint.h>
+
+uint64_t delay_get_timestamp(void);
+uint64_t delay_calc_time_us(uint64_t start, uint64_t end);
+
+#endif /* __DELAY_H_ */
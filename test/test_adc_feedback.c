@@ -0,0 +1,684 @@
+/*
+ * Isochronous audio streaming with explicit feedback (user-025).
+ *
+ * The mwADC speaker function on the fake controller. Step by step: the
+ * parameter checks, the ring of ISO OUT transfers queued when the stream
+ * starts and refilled on each completion, the FIFO that only plays once
+ * half full, packets flagged by the controller dropped and counted,
+ * overruns and underruns, the feedback value in 10.14 at full speed and
+ * 16.16 at high speed following the rate the codec plays at and clamped to
+ * 1/8 of nominal, and the sampling frequency and AudioControl requests.
+ * Then minutes of (micro)frames with the SOF and codec clocks apart: with
+ * the host following the feedback the FIFO must neither run dry nor
+ * overflow and every sample sent must be played in order, except those of
+ * flagged packets; without feedback the FIFO overflows. The error of the
+ * mean feedback against the true codec rate is printed along with the
+ * device time per packet.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fake_hw.h"
+#include "msc_harness.h"
+#include "mw_usbd_audio.h"
+#include "mw_usbd_adcuser.h"
+#include "test_util.h"
+
+/* class handler dispatch of the core and the stream switch of the driver,
+   not in a header */
+extern ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event);
+extern void mwADC_SetActive(USB_ADC_CTRL_T *pAdc, uint32_t on);
+
+#define ADC_OUT_EP          0x01
+#define ADC_FB_EP           0x81
+#define SAMPLE_RATE         48000
+#define FRAME_SIZE          4			/* 16 bit stereo */
+#define FIFO_SIZE           2048
+#define HALF                (FIFO_SIZE / FRAME_SIZE / 2)
+#define FS_MAX_PACKET       200
+#define HS_MAX_PACKET       32
+#define RING_DEPTH          8
+#define MAX_RATE            48000
+#define MUTE_UNIT           2
+#define NOMINAL             (48 << 16)
+#define BENCH_PACKETS       2000000
+
+/* AudioControl interface 0, AudioStreaming interface 1 alternate 1 with an
+   asynchronous ISO OUT endpoint and its feedback endpoint */
+#define AS_INTF_OFS         9
+#define OUT_EP_OFS          36
+static uint8_t adc_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, USB_DEVICE_CLASS_AUDIO, AUDIO_SUBCLASS_AUDIOCONTROL, 0, 0,
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 1, 1, 2, USB_DEVICE_CLASS_AUDIO, AUDIO_SUBCLASS_AUDIOSTREAMING, 0, 0,
+	7, AUDIO_INTERFACE_DESCRIPTOR_TYPE, AUDIO_STREAMING_GENERAL, 1, 1, 1, 0,
+	11, AUDIO_INTERFACE_DESCRIPTOR_TYPE, AUDIO_STREAMING_FORMAT_TYPE, AUDIO_FORMAT_TYPE_I, 2, 2, 16, 1,
+	SAMPLE_RATE & 0xFF, (SAMPLE_RATE >> 8) & 0xFF, SAMPLE_RATE >> 16,
+	9, USB_ENDPOINT_DESCRIPTOR_TYPE, ADC_OUT_EP, 0x05, FS_MAX_PACKET, 0, 1, 0, ADC_FB_EP,
+	7, AUDIO_ENDPOINT_DESCRIPTOR_TYPE, AUDIO_ENDPOINT_GENERAL, 0x01, 0, 0, 0,
+	9, USB_ENDPOINT_DESCRIPTOR_TYPE, ADC_FB_EP, 0x11, 3, 0, 1, 3, 0,
+};
+static uint8_t adc_hs_out_ep[] = {
+	9, USB_ENDPOINT_DESCRIPTOR_TYPE, ADC_OUT_EP, 0x05, HS_MAX_PACKET, 0, 1, 0, ADC_FB_EP,
+};
+static uint8_t adc_mem[32768] __attribute__((aligned(4)));
+static USB_ADC_CTRL_T *adc;
+static USBD_HW_API_T adc_hw;
+
+/* status the controller reports with the next ISO OUT packet */
+static uint32_t xfer_status;
+static uint32_t stream_on, stream_calls, set_rate, mute;
+
+/* host side: the sequence number of each audio frame is its sample data */
+static uint32_t host_seq, codec_seq, codec_started, gaps;
+static uint8_t pkt[FS_MAX_PACKET], out[4096];
+
+static uint32_t err_GetXferLen(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pStatus)
+{
+	uint32_t n = fake_hw_api.GetXferLen(hUsb, EPNum, pStatus);
+
+	if (pStatus) {
+		*pStatus = xfer_status;
+	}
+	return n;
+}
+
+static ErrorCode_t control_req(USBD_HANDLE_T hAdc, USB_SETUP_PACKET *pSetup, uint8_t *buffer, uint16_t length)
+{
+	if ((pSetup->wIndex.WB.H != MUTE_UNIT) || (pSetup->wValue.WB.H != AUDIO_MUTE_CONTROL) || (length != 1)) {
+		return ERR_USBD_STALL;
+	}
+	if (pSetup->bRequest == AUDIO_REQUEST_GET_CUR) {
+		buffer[0] = mute;
+		return LPC_OK;
+	}
+	if (pSetup->bRequest == AUDIO_REQUEST_SET_CUR) {
+		mute = buffer[0];
+		return LPC_OK;
+	}
+	return ERR_USBD_STALL;
+}
+
+static ErrorCode_t sample_rate(USBD_HANDLE_T hAdc, uint32_t rate)
+{
+	if (rate > MAX_RATE) {
+		return ERR_USBD_STALL;
+	}
+	set_rate = rate;
+	return LPC_OK;
+}
+
+static void stream(USBD_HANDLE_T hAdc, uint32_t on)
+{
+	stream_on = on;
+	stream_calls++;
+}
+
+static void default_param(USBD_ADC_INIT_PARAM_T *param)
+{
+	memset(param, 0, sizeof(*param));
+	param->ac_intf_desc = adc_desc;
+	param->as_intf_desc = &adc_desc[AS_INTF_OFS];
+	param->SampleRate = SAMPLE_RATE;
+	param->FrameSize = FRAME_SIZE;
+	param->FifoSize = FIFO_SIZE;
+	param->MaxXferSize = FS_MAX_PACKET;
+	param->RingDepth = RING_DEPTH;
+	param->ADC_ControlReq = control_req;
+	param->ADC_SetSampleRate = sample_rate;
+	param->ADC_Stream = stream;
+}
+
+static ErrorCode_t init_adc(USBD_ADC_INIT_PARAM_T *param, uint32_t speed)
+{
+	USBD_HANDLE_T hAdc = 0;
+	ErrorCode_t ret;
+
+	CHECK_EQ(msc_harness_init_core(speed, RING_DEPTH), LPC_OK);
+	msc_core.config_value = 1;
+	/* the streaming endpoints stand in for the MSC ones the core indexed,
+	   so the driver finds their wMaxPacketSize at each speed */
+	msc_core.desc_idx[USB_FULL_SPEED].ep[fake_ep_index(ADC_OUT_EP)] = (USB_ENDPOINT_DESCRIPTOR *) &adc_desc[OUT_EP_OFS];
+	msc_core.desc_idx[USB_HIGH_SPEED].ep[fake_ep_index(ADC_OUT_EP)] = (USB_ENDPOINT_DESCRIPTOR *) adc_hs_out_ep;
+	adc_hw = fake_hw_api;
+	adc_hw.GetXferLen = err_GetXferLen;
+	msc_core.hw_api = &adc_hw;
+
+	param->mem_base = (uint32_t) adc_mem;
+	param->mem_size = sizeof(adc_mem);
+	ret = mwADC_init(&msc_core, param, &hAdc);
+	adc = (USB_ADC_CTRL_T *) hAdc;
+	xfer_status = 0;
+	stream_on = stream_calls = set_rate = mute = 0;
+	host_seq = codec_seq = codec_started = gaps = 0;
+	return ret;
+}
+
+static void start_adc(uint32_t speed, uint32_t fifo_size)
+{
+	USBD_ADC_INIT_PARAM_T param;
+
+	default_param(&param);
+	param.FifoSize = fifo_size;
+	CHECK_EQ(init_adc(&param, speed), LPC_OK);
+	mwADC_SetActive(adc, 1);
+}
+
+/* one ISO OUT packet of frames audio frames; returns the bytes the
+   controller took, 0 when no transfer was queued */
+static uint32_t host_send(uint32_t frames)
+{
+	uint32_t i;
+
+	for (i = 0; i < frames; i++) {
+		memcpy(&pkt[i * FRAME_SIZE], &host_seq, FRAME_SIZE);
+		host_seq++;
+	}
+	return fake_hw_host_out(&msc_core, ADC_OUT_EP, pkt, frames * FRAME_SIZE);
+}
+
+/* codec DMA block of frames audio frames; counts the breaks in the
+   sequence and returns the bytes taken from the FIFO */
+static uint32_t codec_read(uint32_t frames)
+{
+	uint32_t got, i, seq;
+
+	got = mwADC_ReadSamples(adc, out, frames * FRAME_SIZE);
+	for (i = 0; i < got; i += FRAME_SIZE) {
+		memcpy(&seq, &out[i], FRAME_SIZE);
+		if (codec_started && (seq != codec_seq)) {
+			gaps++;
+		}
+		codec_started = 1;
+		codec_seq = seq + 1;
+	}
+	return got;
+}
+
+/* host polls the feedback endpoint: returns the value as sent, 10.14 or
+   16.16, 0 when nothing was queued */
+static uint32_t host_feedback(uint32_t *len)
+{
+	FAKE_XFER_T *xfer = fake_hw_peek(ADC_FB_EP);
+	uint32_t v = 0;
+
+	if (xfer == 0) {
+		return 0;
+	}
+	if (len) {
+		*len = xfer->len;
+	}
+	memcpy(&v, xfer->data, (xfer->len <= 4) ? xfer->len : 4);
+	fake_hw_complete_in(&msc_core, ADC_FB_EP);
+	return v;
+}
+
+static uint32_t stats_level(void)
+{
+	USBD_ADC_STATS_T st;
+
+	mwADC_GetStats(adc, &st, 0);
+	return st.level;
+}
+
+static uint32_t stats_feedback(void)
+{
+	USBD_ADC_STATS_T st;
+
+	mwADC_GetStats(adc, &st, 0);
+	return st.feedback;
+}
+
+static ErrorCode_t adc_setup(uint8_t type, uint8_t req, uint16_t value, uint16_t index, uint16_t len)
+{
+	fake_ep[0].head = fake_ep[0].count = 0;
+	fake_ep[1].head = fake_ep[1].count = 0;
+	memset(&msc_core.SetupPacket, 0, sizeof(msc_core.SetupPacket));
+	msc_core.SetupPacket.bmRequestType.B = type;
+	msc_core.SetupPacket.bRequest = req;
+	msc_core.SetupPacket.wValue.W = value;
+	msc_core.SetupPacket.wIndex.W = index;
+	msc_core.SetupPacket.wLength = len;
+	msc_core.EP0Data.Count = len;
+	return USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_SETUP);
+}
+
+/* SET request with its data stage */
+static ErrorCode_t adc_set(uint8_t type, uint16_t value, uint16_t index, const uint8_t *data, uint16_t len)
+{
+	ErrorCode_t ret = adc_setup(type, AUDIO_REQUEST_SET_CUR, value, index, len);
+
+	if (ret == LPC_OK) {
+		memcpy(msc_core.EP0Buf, data, len);
+		ret = USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_OUT);
+	}
+	return ret;
+}
+
+static void test_params(void)
+{
+	USBD_ADC_INIT_PARAM_T param;
+
+	default_param(&param);
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), LPC_OK);
+	CHECK(sizeof(adc_mem) - param.mem_size <= mwADC_GetMemSize(&param));
+	CHECK_EQ(adc->epout_num, ADC_OUT_EP);
+	CHECK_EQ(adc->epfb_num, ADC_FB_EP);
+	CHECK_EQ(adc->as_alt, 1);
+
+	/* FIFO not a power of 2, or less than 2 ms of audio */
+	default_param(&param);
+	param.FifoSize = 1536;
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), ERR_API_INVALID_PARAM2);
+	param.FifoSize = 256;
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), ERR_API_INVALID_PARAM2);
+	default_param(&param);
+	param.FrameSize = 0;
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), ERR_API_INVALID_PARAM2);
+	/* the ISO OUT packet does not fit a ring slot */
+	default_param(&param);
+	param.MaxXferSize = FS_MAX_PACKET / 2;
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), ERR_USBD_BAD_EP_DESC);
+	/* AudioControl interface where the streaming one is expected */
+	default_param(&param);
+	param.as_intf_desc = adc_desc;
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), ERR_USBD_BAD_INTF_DESC);
+	default_param(&param);
+	param.ac_intf_desc = &adc_desc[AS_INTF_OFS];
+	CHECK_EQ(init_adc(&param, USB_FULL_SPEED), ERR_USBD_BAD_INTF_DESC);
+}
+
+/* the ring is queued when the stream starts, one (micro)frame per slot,
+   together with the first feedback value */
+static void test_start(uint32_t speed)
+{
+	uint32_t i, len = 0, max_packet = (speed == USB_HIGH_SPEED) ? HS_MAX_PACKET : FS_MAX_PACKET;
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(ADC_OUT_EP)];
+
+	start_adc(speed, FIFO_SIZE);
+	CHECK_EQ(stream_on, 1);
+	CHECK_EQ(stream_calls, 1);
+	CHECK_EQ(ep->count, RING_DEPTH);
+	for (i = 0; i < ep->count; i++) {
+		CHECK_EQ(ep->queue[(ep->head + i) % FAKE_HW_MAX_QUEUED].len, max_packet);
+	}
+	/* empty FIFO: 256 audio frames short of half full ask for one sample
+	   per ms more */
+	CHECK_EQ(stats_feedback(), NOMINAL + (1 << 16));
+	if (speed == USB_HIGH_SPEED) {
+		CHECK_EQ(host_feedback(&len), (NOMINAL + (1 << 16)) >> 3);
+		CHECK_EQ(len, 4);
+	}
+	else {
+		CHECK_EQ(host_feedback(&len), (NOMINAL + (1 << 16)) >> 2);
+		CHECK_EQ(len, 3);
+	}
+	/* each completion queues the next value */
+	CHECK_EQ(fake_ep[fake_ep_index(ADC_FB_EP)].count, 1);
+
+	/* bus reset stops the stream, packets are no longer taken */
+	USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_RESET);
+	CHECK_EQ(stream_on, 0);
+	CHECK_EQ(stream_calls, 2);
+	host_send(48);
+	CHECK_EQ(stats_level(), 0);
+	CHECK_EQ(ep->count, RING_DEPTH - 1);
+	CHECK_EQ(codec_read(48), 0);
+}
+
+static void test_fifo(void)
+{
+	FAKE_EP_T *ep = &fake_ep[fake_ep_index(ADC_OUT_EP)];
+	USBD_ADC_STATS_T st;
+	uint32_t i;
+
+	start_adc(USB_FULL_SPEED, FIFO_SIZE);
+
+	/* silence until half full */
+	memset(out, 0xAA, sizeof(out));
+	CHECK_EQ(codec_read(48), 0);
+	CHECK_EQ(out[0], 0);
+	CHECK_EQ(out[48 * FRAME_SIZE - 1], 0);
+	for (i = 0; i < 5; i++) {
+		CHECK_EQ(host_send(50), 50 * FRAME_SIZE);
+	}
+	CHECK_EQ(codec_read(48), 0);
+	CHECK_EQ(host_send(50), 50 * FRAME_SIZE);
+	CHECK_EQ(codec_read(48), 48 * FRAME_SIZE);
+	CHECK_EQ(codec_seq, 48);
+	/* each slot is queued again from its completion */
+	CHECK_EQ(ep->count, RING_DEPTH);
+
+	/* a flagged packet is dropped, its slot queued again */
+	xfer_status = USBD_XFER_ERR_XACT;
+	host_send(50);
+	xfer_status = 0;
+	CHECK_EQ(stats_level(), 300 - 48);
+	CHECK_EQ(ep->count, RING_DEPTH);
+	host_send(50);
+	CHECK_EQ(codec_read(252 + 50), 302 * FRAME_SIZE);
+	CHECK_EQ(gaps, 1);
+	mwADC_GetStats(adc, &st, 0);
+	CHECK_EQ(st.packets, 8);
+	CHECK_EQ(st.errors, 1);
+	CHECK_EQ(st.underruns, 0);
+
+	/* underrun: what is there, then silence until half full again */
+	host_send(50);
+	memset(out, 0xAA, sizeof(out));
+	CHECK_EQ(codec_read(100), 50 * FRAME_SIZE);
+	CHECK_EQ(out[50 * FRAME_SIZE], 0);
+	CHECK_EQ(out[100 * FRAME_SIZE - 1], 0);
+	host_send(50);
+	CHECK_EQ(codec_read(10), 0);
+	mwADC_GetStats(adc, &st, 0);
+	CHECK_EQ(st.underruns, 1);
+	CHECK_EQ(st.level, 50);
+
+	/* overrun: the FIFO takes 512 audio frames, the rest is dropped */
+	for (i = 0; i < 10; i++) {
+		host_send(50);
+	}
+	mwADC_GetStats(adc, &st, 1);
+	CHECK_EQ(st.level, HALF * 2);
+	CHECK_EQ(st.overruns, 38 * FRAME_SIZE);
+	mwADC_GetStats(adc, &st, 0);
+	CHECK_EQ(st.packets, 0);
+	CHECK_EQ(st.overruns, 0);
+	CHECK_EQ(st.underruns, 0);
+}
+
+/* 48.5 audio frames per ms with the FIFO held at half full */
+static void test_feedback_rate(void)
+{
+	uint32_t i;
+
+	start_adc(USB_FULL_SPEED, FIFO_SIZE);
+	host_feedback(0);
+	for (i = 0; i < HALF / 32; i++) {
+		host_send(32);
+	}
+	CHECK_EQ(codec_read(0), 0);
+
+	for (i = 0; i < 512; i++) {
+		fake_frame = (fake_frame + 1) & 0x7FF;
+		host_send(48);
+		fake_frame = (fake_frame + 1) & 0x7FF;
+		host_send(49);
+		codec_read(97);
+		if ((i % 4) == 3) {
+			host_feedback(0);
+			/* nominal until 1024 frames are counted */
+			CHECK_EQ(stats_feedback(), (i < 511) ? NOMINAL : (NOMINAL + (1 << 15)));
+		}
+	}
+	CHECK_EQ(host_feedback(0), (NOMINAL + (1 << 15)) >> 2);
+	CHECK_EQ(gaps, 0);
+
+	/* the codec stopped: no rate from that window, which spans the wrap
+	   of the 11 bit frame number */
+	for (i = 0; i < 1024; i += 8) {
+		fake_frame = (fake_frame + 8) & 0x7FF;
+		host_feedback(0);
+	}
+	CHECK_EQ(fake_frame, 0);
+	CHECK_EQ(stats_feedback(), NOMINAL + (1 << 15));
+}
+
+/* 8 samples per ms off half full, clamped to 6 */
+static void test_feedback_clamp(uint32_t speed)
+{
+	uint32_t i, shift = (speed == USB_HIGH_SPEED) ? 3 : 2;
+	uint32_t frames = (speed == USB_HIGH_SPEED) ? HS_MAX_PACKET / FRAME_SIZE : 50;
+
+	start_adc(speed, 16384);
+	CHECK_EQ(stats_feedback(), NOMINAL + (NOMINAL >> 3));
+	CHECK_EQ(host_feedback(0), (NOMINAL + (NOMINAL >> 3)) >> shift);
+	for (i = 0; i < 16384 / FRAME_SIZE / frames + 1; i++) {
+		host_send(frames);
+	}
+	CHECK_EQ(stats_level(), 16384 / FRAME_SIZE);
+	host_feedback(0);
+	CHECK_EQ(stats_feedback(), NOMINAL - (NOMINAL >> 3));
+	CHECK_EQ(host_feedback(0), (NOMINAL - (NOMINAL >> 3)) >> shift);
+}
+
+static void test_requests(void)
+{
+	static const uint8_t r44k1[3] = {0x44, 0xAC, 0x00}, r96k[3] = {0x00, 0x77, 0x01}, r500[3] = {0xF4, 0x01, 0x00};
+	static const uint8_t on = 1;
+	uint32_t stalls;
+	FAKE_XFER_T *xfer;
+
+	start_adc(USB_FULL_SPEED, FIFO_SIZE);
+	stalls = fake_ep[1].stalls;
+
+	/* sampling frequency of the ISO OUT endpoint */
+	CHECK_EQ(adc_set(0x22, AUDIO_CONTROL_SAMPLING_FREQ << 8, ADC_OUT_EP, r44k1, 3), LPC_OK);
+	CHECK_EQ(set_rate, 44100);
+	CHECK_EQ(adc->SampleRate, 44100);
+	CHECK_EQ(adc->fb_nominal, (44 << 16) + (100 << 16) / 1000);
+	CHECK_EQ(fake_ep[1].count, 1);				/* status stage */
+	CHECK_EQ(adc_setup(0xA2, AUDIO_REQUEST_GET_CUR, AUDIO_CONTROL_SAMPLING_FREQ << 8, ADC_OUT_EP, 3), LPC_OK);
+	xfer = fake_hw_peek(0x80);
+	CHECK(xfer != 0);
+	if (xfer) {
+		CHECK_EQ(xfer->len, 3);
+		CHECK(memcmp(xfer->data, r44k1, 3) == 0);
+	}
+	CHECK_EQ(fake_ep[1].stalls, stalls);
+
+	/* refused by the application, below 1 kHz, wrong length, GET_MAX */
+	CHECK_EQ(adc_set(0x22, AUDIO_CONTROL_SAMPLING_FREQ << 8, ADC_OUT_EP, r96k, 3), ERR_USBD_STALL);
+	CHECK_EQ(adc_set(0x22, AUDIO_CONTROL_SAMPLING_FREQ << 8, ADC_OUT_EP, r500, 3), ERR_USBD_STALL);
+	CHECK_EQ(adc_set(0x22, AUDIO_CONTROL_SAMPLING_FREQ << 8, ADC_OUT_EP, r44k1, 2), ERR_USBD_STALL);
+	CHECK_EQ(adc_setup(0xA2, AUDIO_REQUEST_GET_MAX, AUDIO_CONTROL_SAMPLING_FREQ << 8, ADC_OUT_EP, 3),
+			 ERR_USBD_STALL);
+	CHECK_EQ(adc->SampleRate, 44100);
+	CHECK_EQ(fake_ep[1].stalls, stalls + 4);
+	/* another endpoint is not ours */
+	CHECK_EQ(adc_setup(0xA2, AUDIO_REQUEST_GET_CUR, AUDIO_CONTROL_SAMPLING_FREQ << 8, 0x02, 3),
+			 ERR_USBD_UNHANDLED);
+
+	/* AudioControl requests go to the application */
+	CHECK_EQ(adc_set(0x21, AUDIO_MUTE_CONTROL << 8, MUTE_UNIT << 8, &on, 1), LPC_OK);
+	CHECK_EQ(mute, 1);
+	CHECK_EQ(adc_setup(0xA1, AUDIO_REQUEST_GET_CUR, AUDIO_MUTE_CONTROL << 8, MUTE_UNIT << 8, 1), LPC_OK);
+	xfer = fake_hw_peek(0x80);
+	CHECK(xfer && (xfer->len == 1) && (xfer->data[0] == 1));
+	CHECK_EQ(adc_setup(0xA1, AUDIO_REQUEST_GET_CUR, AUDIO_VOLUME_CONTROL << 8, MUTE_UNIT << 8, 2),
+			 ERR_USBD_STALL);
+	adc->ADC_ControlReq = 0;
+	CHECK_EQ(adc_setup(0xA1, AUDIO_REQUEST_GET_CUR, AUDIO_MUTE_CONTROL << 8, MUTE_UNIT << 8, 1), ERR_USBD_STALL);
+}
+
+typedef struct {
+	const char *name;
+	uint32_t speed;
+	int32_t host_ppm;			/* SOF clock */
+	int32_t codec_ppm;			/* codec clock */
+	int32_t wander_ppm;			/* triangle on the SOF clock, 100 s period */
+	int32_t step_ppm;			/* codec clock step halfway */
+	uint32_t block;				/* audio frames per codec DMA block */
+	uint32_t feedback;			/* host follows the feedback endpoint */
+	uint32_t err_every;			/* one packet in err_every flagged, 0 for none */
+	uint32_t retire;			/* an unpolled feedback transfer is retired each frame */
+	uint32_t secs;
+} SIM_CASE_T;
+
+typedef struct {
+	USBD_ADC_STATS_T st;
+	uint32_t flagged, lost, level_min, level_max;
+	double ppm;
+} SIM_RESULT_T;
+
+static double triangle(double t)
+{
+	double p = (t - 100.0 * (uint32_t) (t / 100.0)) / 25.0;
+
+	return (p < 1) ? p : ((p < 3) ? (2 - p) : (p - 4));
+}
+
+static void simulate(const SIM_CASE_T *c, SIM_RESULT_T *res)
+{
+	uint32_t upf = (c->speed == USB_HIGH_SPEED) ? 8 : 1;
+	uint32_t max_frames = ((c->speed == USB_HIGH_SPEED) ? HS_MAX_PACKET : FS_MAX_PACKET) / FRAME_SIZE;
+	uint32_t total = c->secs * 1000 * upf, uf, n, v, packets = 0;
+	double t = 0, t_codec = 0, t_next, dh, dc, tuf, fs;
+	double host_fb = 48.0 / upf, host_acc = 0, fb_sum = 0, true_sum = 0;
+	uint32_t fb_cnt = 0, level;
+	USBD_ADC_STATS_T st;
+
+	start_adc(c->speed, FIFO_SIZE);
+	srand(25);
+	memset(res, 0, sizeof(*res));
+	res->level_min = ~0U;
+	for (uf = 0; uf < total; uf++) {
+		dh = (c->host_ppm + c->wander_ppm * triangle(t)) * 1e-6;
+		dc = (c->codec_ppm + ((uf >= total / 2) ? c->step_ppm : 0)) * 1e-6;
+		tuf = 1e-3 / upf * (1 + dh) + (rand() % 21 - 10) * 1e-9;
+		fs = SAMPLE_RATE * (1 + dc);
+
+		/* SOF: one packet at the rate the host believes in */
+		if ((uf % upf) == 0) {
+			fake_frame = (fake_frame + 1) & 0x7FF;
+		}
+		host_acc += c->feedback ? host_fb : (48.0 / upf);
+		n = (uint32_t) host_acc;
+		host_acc -= n;
+		if (n > max_frames) {
+			n = max_frames;
+		}
+		xfer_status = (c->err_every && ((++packets % c->err_every) == 0)) ? USBD_XFER_ERR_XACT : 0;
+		res->flagged += (xfer_status != 0);
+		if (host_send(n) == 0) {
+			res->lost++;
+		}
+
+		/* feedback polled every 8 frames at full speed (bRefresh 3) and
+		   every 8 microframes at high speed */
+		if ((uf % 8) == 4) {
+			v = host_feedback(0);
+			host_fb = (c->speed == USB_HIGH_SPEED) ? (v / 65536.0) : (v / 16384.0);
+		}
+		else if (c->retire && ((uf % upf) == upf - 1)) {
+			fake_hw_complete_in(&msc_core, ADC_FB_EP);
+		}
+
+		/* codec DMA blocks due before the next SOF */
+		t_next = t + tuf;
+		while (t_codec < t_next) {
+			codec_read(c->block);
+			t_codec += c->block / fs;
+		}
+		t = t_next;
+
+		if ((t > 20) && ((uf % upf) == 0)) {
+			mwADC_GetStats(adc, &st, 0);
+			level = st.level;
+			if (level < res->level_min) {
+				res->level_min = level;
+			}
+			if (level > res->level_max) {
+				res->level_max = level;
+			}
+			fb_sum += st.feedback / 65536.0;
+			true_sum += fs * tuf * upf;
+			fb_cnt++;
+		}
+	}
+	xfer_status = 0;
+	mwADC_GetStats(adc, &res->st, 0);
+	res->ppm = (fb_sum / true_sum - 1) * 1e6;
+}
+
+static void test_drift(void)
+{
+	static const SIM_CASE_T cases[] = {
+		{"no feedback, +300/-400 ppm", USB_FULL_SPEED, 300, -400, 0, 0, 48, 0, 0, 0, 120},
+		{"+300/-400 ppm", USB_FULL_SPEED, 300, -400, 0, 0, 48, 1, 0, 0, 300},
+		{"-500/+500 ppm, 100 ppm wander", USB_FULL_SPEED, -500, 500, 100, 0, 48, 1, 0, 0, 300},
+		{"+700 ppm step, 96 frame DMA", USB_FULL_SPEED, 0, 0, 50, 700, 96, 1, 0, 0, 300},
+		{"1 in 997 flagged, fb retired", USB_FULL_SPEED, 300, -400, 50, 0, 48, 1, 997, 1, 300},
+		{"+300/-400 ppm", USB_HIGH_SPEED, 300, -400, 0, 0, 48, 1, 0, 0, 120},
+		{"-500/+500, step, 1 in 997 flagged", USB_HIGH_SPEED, -500, 500, 100, 700, 48, 1, 997, 1, 120},
+	};
+	SIM_RESULT_T res;
+	double expect;
+	uint32_t i;
+
+	printf("SOF/codec clock drift:\n");
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		simulate(&cases[i], &res);
+		printf("  %s %-34s under %u over %5u flagged %3u gaps %3u level %3u..%3u",
+			   (cases[i].speed == USB_HIGH_SPEED) ? "HS" : "FS", cases[i].name, res.st.underruns,
+			   res.st.overruns, res.flagged, gaps, res.level_min, res.level_max);
+		if (cases[i].feedback) {
+			printf(" fb error %+7.1f ppm", res.ppm);
+		}
+		printf("\n");
+		CHECK_EQ(res.lost, 0);
+		CHECK_EQ(res.st.errors, res.flagged);
+		if (cases[i].feedback) {
+			CHECK_EQ(res.st.underruns, 0);
+			CHECK_EQ(res.st.overruns, 0);
+			/* only the flagged packets are missing */
+			CHECK_EQ(gaps, res.flagged);
+			/* at least an eighth of the FIFO from either end */
+			CHECK(res.level_min > HALF / 4);
+			CHECK(res.level_max < HALF * 7 / 4);
+			/* the host must make up for the dropped packets */
+			expect = cases[i].err_every ? (1e6 / (cases[i].err_every - 1)) : 0;
+			CHECK((res.ppm > expect - 10) && (res.ppm < expect + 10));
+		}
+		else {
+			CHECK(res.st.overruns > 0);
+			CHECK(gaps > 0);
+		}
+	}
+}
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+static void bench(void)
+{
+	struct timespec t0, t1, t2;
+	uint32_t i;
+
+	start_adc(USB_FULL_SPEED, FIFO_SIZE);
+	for (i = 0; i < HALF / 32; i++) {
+		host_send(32);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		host_send(48);
+		mwADC_ReadSamples(adc, out, 48 * FRAME_SIZE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		fake_frame++;
+		fake_hw_complete_in(&msc_core, ADC_FB_EP);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	CHECK_EQ(stats_level(), HALF);
+	printf("device time per 48 frame packet on the host:\n");
+	printf("  ISO OUT completion + ReadSamples %6.0f ns\n", elapsed_ns(&t0, &t1) / BENCH_PACKETS);
+	printf("  feedback completion              %6.0f ns\n", elapsed_ns(&t1, &t2) / BENCH_PACKETS);
+}
+
+int main(void)
+{
+	test_params();
+	test_start(USB_FULL_SPEED);
+	test_start(USB_HIGH_SPEED);
+	test_fifo();
+	test_feedback_rate();
+	test_feedback_clamp(USB_FULL_SPEED);
+	test_feedback_clamp(USB_HIGH_SPEED);
+	test_requests();
+	test_drift();
+	bench();
+	return TEST_DONE();
+}
@@ -0,0 +1,421 @@
+/*
+ * CDC-ACM bulk data path (user-019).
+ *
+ * Step by step on the fake controller: transfer sizes up to the ring wrap
+ * point and CDC_MAX_XFER_SIZE, the ZLP after a transfer of whole packets,
+ * receive priming, the bounce buffer, a full receive ring parking the OUT
+ * endpoint, bus reset and the pool size check. Then main loop and
+ * interrupt together: a SIGALRM handler plays the controller and completes
+ * transfers while the main loop calls WriteData()/ReadData(), at high and
+ * full speed, and every byte must arrive once and in order. Last, the
+ * throughput of the copy path is printed.
+ */
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "fake_hw.h"
+#include "msc_harness.h"
+#include "mw_usbd_cdc.h"
+#include "mw_usbd_cdcuser.h"
+#include "test_util.h"
+
+/* class handler dispatch of the core, not in a header */
+extern ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event);
+
+#define CDC_IN_EP           0x81
+#define CDC_OUT_EP          0x01
+#define TX_RING             32768
+#define RX_RING             4096
+
+/* control interface 0 with an interrupt IN endpoint, data interface 1 */
+static uint8_t cdc_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, CDC_COMMUNICATION_INTERFACE_CLASS, CDC_ABSTRACT_CONTROL_MODEL, 0, 0,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, 0x82, USB_ENDPOINT_TYPE_INTERRUPT, 16, 0, 2,
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 1, 0, 2, CDC_DATA_INTERFACE_CLASS, 0, 0, 0,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, CDC_IN_EP, USB_ENDPOINT_TYPE_BULK, 0x00, 0x02, 0,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, CDC_OUT_EP, USB_ENDPOINT_TYPE_BULK, 0x00, 0x02, 0,
+};
+static uint8_t cdc_mem[TX_RING + RX_RING + 4096] __attribute__((aligned(4)));
+static uint8_t host_buf[64 * 1024], dev_buf[64 * 1024];
+static USBD_HANDLE_T hCdc;
+
+static ErrorCode_t init_cdc(uint32_t speed, uint32_t tx_size, uint32_t rx_size, uint32_t mem_size)
+{
+	USBD_CDC_INIT_PARAM_T param;
+	ErrorCode_t ret;
+
+	CHECK_EQ(msc_harness_init_core(speed, 1), LPC_OK);
+	/* the CDC endpoints go up to 0x82 */
+	msc_core.max_num_ep = USB_MAX_EP_NUM;
+	msc_core.config_value = 1;
+
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) cdc_mem;
+	param.mem_size = mem_size;
+	param.cif_intf_desc = cdc_desc;
+	param.dif_intf_desc = &cdc_desc[16];
+	param.tx_buf_size = tx_size;
+	param.rx_buf_size = rx_size;
+	ret = mwCDC_init(&msc_core, &param, &hCdc);
+	if (ret == LPC_OK) {
+		/* the pool is used within the size GetMemSize() asked for */
+		CHECK(mem_size - param.mem_size <= mwCDC_GetMemSize(&param));
+	}
+	return ret;
+}
+
+static void fill(uint8_t *buf, uint32_t len, uint8_t seq)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = seq++;
+	}
+}
+
+/* retires the queued IN transfer, returns its length or ~0 if none */
+static uint32_t take_in(uint8_t *dst)
+{
+	FAKE_XFER_T *xfer = fake_hw_peek(CDC_IN_EP);
+	uint32_t len;
+
+	if (xfer == 0) {
+		return ~0U;
+	}
+	len = xfer->len;
+	memcpy(dst, xfer->data, len);
+	CHECK_EQ(fake_hw_complete_in(&msc_core, CDC_IN_EP), LPC_OK);
+	return len;
+}
+
+static void test_in(void)
+{
+	uint32_t len, total;
+
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, TX_RING, RX_RING, sizeof(cdc_mem)), LPC_OK);
+
+	/* nothing is sent before SET_CONFIGURATION */
+	msc_core.config_value = 0;
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 100), 0);
+	msc_core.config_value = 1;
+
+	/* the first write starts the endpoint, the next ones wait for it */
+	fill(host_buf, 3000, 0);
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 100), 100);
+	CHECK_EQ(mwCDC_WriteData(hCdc, &host_buf[100], 2900), 2900);
+	CHECK_EQ(fake_ep[fake_ep_index(CDC_IN_EP)].count, 1);
+	CHECK_EQ(take_in(dev_buf), 100);
+	/* everything written meanwhile goes in one transfer */
+	CHECK_EQ(take_in(&dev_buf[100]), 2900);
+	CHECK(memcmp(dev_buf, host_buf, 3000) == 0);
+	/* not a multiple of the packet size, no ZLP */
+	CHECK_EQ(take_in(dev_buf), ~0U);
+
+	/* whole packets: a ZLP ends the transfer */
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 1024), 1024);
+	CHECK_EQ(take_in(dev_buf), 1024);
+	CHECK_EQ(take_in(dev_buf), 0);
+	CHECK_EQ(take_in(dev_buf), ~0U);
+	/* no ZLP while more data follows */
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 512), 512);
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 10), 10);
+	CHECK_EQ(take_in(dev_buf), 512);
+	CHECK_EQ(take_in(dev_buf), 10);
+	CHECK_EQ(take_in(dev_buf), ~0U);
+
+	/* a full ring takes what fits; transfers stop at the wrap point and at
+	   CDC_MAX_XFER_SIZE */
+	fill(host_buf, sizeof(host_buf), 7);
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 1), 1);
+	CHECK_EQ(mwCDC_WriteData(hCdc, &host_buf[1], 40000), TX_RING - 1);
+	total = 0;
+	while ((len = take_in(&dev_buf[total])) != ~0U) {
+		CHECK(len <= CDC_MAX_XFER_SIZE);
+		CHECK(((3000 + 1024 + 522 + total) % TX_RING) + len <= TX_RING);
+		total += len;
+	}
+	CHECK_EQ(total, TX_RING);
+	CHECK(memcmp(dev_buf, host_buf, TX_RING) == 0);
+}
+
+/* host sends len bytes as packets of up to pkt bytes, returns bytes taken */
+static uint32_t host_send(const uint8_t *data, uint32_t len, uint32_t pkt)
+{
+	uint32_t sent = 0, n, got;
+
+	while (sent < len) {
+		n = (len - sent < pkt) ? len - sent : pkt;
+		got = fake_hw_host_out(&msc_core, CDC_OUT_EP, &data[sent], n);
+		sent += got;
+		if (got < n) {
+			break;
+		}
+	}
+	return sent;
+}
+
+static void test_out(void)
+{
+	FAKE_XFER_T *xfer;
+	uint32_t got;
+
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, TX_RING, RX_RING, sizeof(cdc_mem)), LPC_OK);
+	fill(host_buf, sizeof(host_buf), 3);
+
+	/* primed on the first NAK with the whole ring */
+	CHECK_EQ(host_send(host_buf, 100, 512), 100);
+	xfer = fake_hw_peek(CDC_OUT_EP);
+	CHECK(xfer != 0);
+	/* a short packet ends the transfer, the next one takes whole packets */
+	CHECK_EQ(xfer ? xfer->len : 0, (RX_RING - 100) & ~511);
+	CHECK_EQ(mwCDC_ReadData(hCdc, dev_buf, sizeof(dev_buf)), 100);
+	CHECK(memcmp(dev_buf, host_buf, 100) == 0);
+	CHECK_EQ(mwCDC_ReadData(hCdc, dev_buf, sizeof(dev_buf)), 0);
+
+	/* less than a packet before the wrap point: the packet straddling it
+	   goes through the bounce buffer */
+	got = host_send(&host_buf[100], 7 * 512, 512);
+	CHECK_EQ(got, 7 * 512);
+	xfer = fake_hw_peek(CDC_OUT_EP);
+	CHECK(xfer && (xfer->data == ((USB_CDC_CTRL_T *) hCdc)->rx_bounce));
+	CHECK_EQ(xfer ? xfer->len : 0, 512);
+
+	/* fill the ring: less than a packet free parks the endpoint */
+	got += host_send(&host_buf[100 + got], 8192, 512);
+	CHECK_EQ(got, RX_RING);
+	CHECK(fake_hw_peek(CDC_OUT_EP) == 0);
+	CHECK_EQ(host_send(&host_buf[100 + got], 512, 512), 0);
+
+	/* reading makes room and primes again */
+	CHECK_EQ(mwCDC_ReadData(hCdc, dev_buf, 1000), 1000);
+	CHECK(fake_hw_peek(CDC_OUT_EP) != 0);
+	CHECK_EQ(host_send(&host_buf[100 + got], 512, 512), 512);
+	CHECK_EQ(mwCDC_ReadData(hCdc, &dev_buf[1000], sizeof(dev_buf)), got - 1000 + 512);
+	CHECK(memcmp(dev_buf, &host_buf[100], got + 512) == 0);
+}
+
+static void test_reset(void)
+{
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, TX_RING, RX_RING, sizeof(cdc_mem)), LPC_OK);
+	fill(host_buf, 5000, 0);
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 5000), 5000);
+	CHECK_EQ(host_send(host_buf, 300, 512), 300);
+
+	/* unsent data is dropped, received data stays */
+	USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_RESET);
+	fake_hw_reset();
+	CHECK_EQ(mwCDC_ReadData(hCdc, dev_buf, sizeof(dev_buf)), 300);
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 20), 20);
+	CHECK_EQ(take_in(dev_buf), 20);
+	CHECK_EQ(take_in(dev_buf), ~0U);
+	CHECK_EQ(host_send(host_buf, 64, 512), 64);
+}
+
+static void test_init(void)
+{
+	USBD_CDC_INIT_PARAM_T param;
+
+	memset(&param, 0, sizeof(param));
+	param.tx_buf_size = TX_RING;
+	param.rx_buf_size = RX_RING;
+	/* a pool one word too small */
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, TX_RING, RX_RING, mwCDC_GetMemSize(&param) - 4), ERR_USBD_BAD_MEM_BUF);
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, TX_RING, RX_RING, mwCDC_GetMemSize(&param)), LPC_OK);
+	/* rings must be powers of 2 and hold a packet */
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, 3000, RX_RING, sizeof(cdc_mem)), ERR_API_INVALID_PARAM2);
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, TX_RING, 256, sizeof(cdc_mem)), ERR_API_INVALID_PARAM2);
+	/* without rings the data path is off */
+	CHECK_EQ(init_cdc(USB_HIGH_SPEED, 0, 0, sizeof(cdc_mem)), LPC_OK);
+	CHECK_EQ(mwCDC_WriteData(hCdc, host_buf, 10), 0);
+	CHECK_EQ(mwCDC_ReadData(hCdc, dev_buf, 10), 0);
+}
+
+/*
+ * Interrupt driven run. The controller model below is used from the signal
+ * handler, so it only keeps one transfer per direction in volatile state
+ * instead of the fake controller queues.
+ */
+static volatile uint32_t in_busy, out_busy, dbl_queued, data_errors;
+static uint8_t *volatile in_data, *volatile out_data;
+static volatile uint32_t in_len, out_len, out_got;
+static volatile uint32_t in_xfers, in_zlps, out_xfers;
+static volatile uint64_t in_bytes, out_left;
+static uint8_t in_seq, out_seq;
+static uint32_t lcg = 1;
+static USBD_HW_API_T async_hw;
+
+static uint32_t async_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt)
+{
+	if (in_busy) {
+		dbl_queued++;
+	}
+	in_data = pData;
+	in_len = cnt;
+	in_busy = 1;
+	return cnt;
+}
+
+static uint32_t async_ReadReqEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t len)
+{
+	if (out_busy) {
+		dbl_queued++;
+	}
+	out_data = pData;
+	out_len = len;
+	out_busy = 1;
+	return len;
+}
+
+static uint32_t async_ReadEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData)
+{
+	return out_got;
+}
+
+static void async_isr(void)
+{
+	uint32_t i, n;
+
+	if (in_busy) {
+		in_busy = 0;
+		for (i = 0; i < in_len; i++) {
+			if (in_data[i] != in_seq++) {
+				data_errors++;
+				break;
+			}
+		}
+		in_bytes += in_len;
+		in_xfers++;
+		in_zlps += (in_len == 0);
+		fake_hw_event(&msc_core, CDC_IN_EP, USB_EVT_IN);
+	}
+	if (out_busy) {
+		n = out_len;
+		if (n > out_left) {
+			n = out_left;
+		}
+		/* now and then the host ends with a short packet */
+		lcg = lcg * 1103515245 + 12345;
+		if ((((lcg >> 16) & 7) == 0) && (n > 1)) {
+			n = 1 + (lcg >> 8) % n;
+		}
+		for (i = 0; i < n; i++) {
+			out_data[i] = out_seq++;
+		}
+		out_left -= n;
+		out_got = n;
+		out_busy = 0;
+		out_xfers++;
+		fake_hw_event(&msc_core, CDC_OUT_EP, USB_EVT_OUT);
+	}
+	else if (out_left > 0) {
+		fake_hw_event(&msc_core, CDC_OUT_EP, USB_EVT_OUT_NAK);
+	}
+}
+
+static void async_signal(int sig)
+{
+	async_isr();
+}
+
+static void async_start(uint32_t speed, uint64_t out_total)
+{
+	CHECK_EQ(init_cdc(speed, TX_RING, RX_RING, sizeof(cdc_mem)), LPC_OK);
+	async_hw = fake_hw_api;
+	async_hw.WriteEP = async_WriteEP;
+	async_hw.ReadReqEP = async_ReadReqEP;
+	async_hw.ReadEP = async_ReadEP;
+	msc_core.hw_api = &async_hw;
+	in_busy = out_busy = 0;
+	in_bytes = in_xfers = in_zlps = out_xfers = 0;
+	dbl_queued = data_errors = 0;
+	in_seq = out_seq = 0;
+	out_left = out_total;
+}
+
+static void test_async(uint32_t speed, uint64_t in_total, uint64_t out_total)
+{
+	struct itimerval timer = {{0, 50}, {0, 50}};
+	uint64_t sent = 0, rcvd = 0;
+	uint8_t seq = 0, rseq = 0;
+	uint32_t i, n, got;
+
+	async_start(speed, out_total);
+	signal(SIGALRM, async_signal);
+	setitimer(ITIMER_REAL, &timer, 0);
+
+	while ((sent < in_total) || (rcvd < out_total)) {
+		if (sent < in_total) {
+			n = 1 + (rand() % 20000);
+			if (n > in_total - sent) {
+				n = in_total - sent;
+			}
+			fill(host_buf, n, seq);
+			n = mwCDC_WriteData(hCdc, host_buf, n);
+			seq += n;
+			sent += n;
+		}
+		got = mwCDC_ReadData(hCdc, dev_buf, 1 + (rand() % 20000));
+		for (i = 0; i < got; i++) {
+			if (dev_buf[i] != rseq++) {
+				data_errors++;
+				break;
+			}
+		}
+		rcvd += got;
+	}
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, 0);
+	signal(SIGALRM, SIG_DFL);
+	/* drain the last transfers and the ZLP */
+	while (in_busy) {
+		async_isr();
+	}
+
+	CHECK_EQ(in_bytes, in_total);
+	CHECK_EQ(rcvd, out_total);
+	CHECK_EQ(data_errors, 0);
+	CHECK_EQ(dbl_queued, 0);
+	printf("%s speed: IN %u transfers, %.0f bytes each, %u ZLPs; OUT %u transfers\n",
+		   (speed == USB_HIGH_SPEED) ? "high" : "full", in_xfers, (double) in_bytes / in_xfers, in_zlps, out_xfers);
+}
+
+/* copy path only, completions inline; printed, not checked */
+static void bench(void)
+{
+	struct timespec t0, t1;
+	uint64_t total = 256 << 20, sent = 0, rcvd = 0;
+	uint8_t seq = 0;
+	double s;
+
+	async_start(USB_HIGH_SPEED, total);
+	fill(host_buf, sizeof(host_buf), 0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (sent < total) {
+		sent += mwCDC_WriteData(hCdc, &host_buf[seq], CDC_MAX_XFER_SIZE);
+		seq = (uint8_t) sent;
+		async_isr();
+		async_isr();
+		rcvd += mwCDC_ReadData(hCdc, dev_buf, 2048);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	CHECK_EQ(data_errors, 0);
+	printf("copy path: %.0f MB/s per direction, IN %.0f bytes per transfer\n",
+		   total / s / 1e6, (double) in_bytes / in_xfers);
+}
+
+int main(void)
+{
+	srand(19);
+	test_init();
+	test_in();
+	test_out();
+	test_reset();
+	test_async(USB_HIGH_SPEED, 4 << 20, 2 << 20);
+	test_async(USB_FULL_SPEED, 2 << 20, 1 << 20);
+	bench();
+	return TEST_DONE();
+}
@@ -0,0 +1,393 @@
+/*
+ * Pipelined DFU download (user-022).
+ *
+ * Step by step on the fake controller, with the frame counter moved by the
+ * flash model: blocks handed to Program() in receive order, dfuDNLOAD_IDLE
+ * with a zero bwPollTimeout while a buffer is free, dfuDNBUSY with the time
+ * left on the block being written, manifestation waiting for the last
+ * blocks, a DFU_Write() error latched for the next GETSTATUS, and a host
+ * sending on dfuDNBUSY stalled. Then a dfu-util like
+ * host downloads an image in real time against a flash model, while a
+ * second thread plays the main loop calling Program(): the time and the
+ * GETSTATUS requests are printed for the synchronous download with a fixed
+ * and a zero bwPollTimeout and for the pipelined one.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dfu_host.h"
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define XFER_SIZE           4096
+#define SECTOR_SIZE         8192
+#define IMAGE_SIZE          (128 * 1024)
+#define NUM_BLOCKS          (IMAGE_SIZE / XFER_SIZE)
+#define WRITE_FRAMES        7
+
+static uint8_t dfu_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, USB_DEVICE_CLASS_APP, USB_DFU_SUBCLASS, 2, 0,
+	9, USB_DFU_DESCRIPTOR_TYPE, USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL,
+	0xFF, 0, XFER_SIZE & 0xFF, XFER_SIZE >> 8, 0x10, 0x01,
+};
+static uint8_t dfu_mem[3 * XFER_SIZE + 4096] __attribute__((aligned(4)));
+static uint8_t image[IMAGE_SIZE], flash[IMAGE_SIZE];
+static USBD_HANDLE_T hDfu;
+
+/* flash model */
+static uint32_t next_block, write_calls, zero_copy_calls, done_calls, order_errors;
+static uint32_t fail_block = ~0U, poll_ms;
+static uint8_t realtime, status_in_write;
+static DFU_STATUS_T mid_write;
+static double erase_ms, prog_ms_per_512;
+static pthread_t write_thread;
+static uint32_t wrong_thread;
+
+static struct timespec t_start;
+
+static double now_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - t_start.tv_sec) * 1e3 + (t.tv_nsec - t_start.tv_nsec) / 1e6;
+}
+
+static void sleep_ms(double ms)
+{
+	double end = now_ms() + ms;
+	struct timespec ts = {0, (long) (ms * 0.9e6)};
+
+	if (ms <= 0) {
+		return;
+	}
+	if (ms > 0.2) {
+		nanosleep(&ts, 0);
+	}
+	while (now_ms() < end) {
+	}
+}
+
+/* the IP9028 frame counter, 1 ms frames */
+static uint32_t rt_GetFrameNumber(USBD_HANDLE_T hUsb)
+{
+	return ((uint32_t) now_ms()) & 0x7FF;
+}
+
+static uint8_t flash_write(uint32_t block, uint8_t * *src, uint32_t len, uint8_t *bwPollTimeout)
+{
+	if (len == 0) {
+		zero_copy_calls++;
+		return DFU_STATUS_OK;
+	}
+	write_calls++;
+	if (block != next_block++) {
+		order_errors++;
+	}
+	if (!pthread_equal(pthread_self(), write_thread)) {
+		wrong_thread++;
+	}
+	if (realtime) {
+		sleep_ms(len / 512.0 * prog_ms_per_512 + (((block * XFER_SIZE) % SECTOR_SIZE) ? 0 : erase_ms));
+	}
+	else if (status_in_write) {
+		/* the host asks for the status while the block is being written */
+		fake_frame += 3;
+		CHECK_EQ(dfu_getstatus(&mid_write), LPC_OK);
+		fake_frame += WRITE_FRAMES - 3;
+	}
+	else {
+		fake_frame += WRITE_FRAMES;
+	}
+	if ((block + 1) * XFER_SIZE <= IMAGE_SIZE) {
+		memcpy(&flash[block * XFER_SIZE], *src, len);
+	}
+	bwPollTimeout[0] = poll_ms & 0xFF;
+	bwPollTimeout[1] = (poll_ms >> 8) & 0xFF;
+	bwPollTimeout[2] = 0;
+	return (block == fail_block) ? DFU_STATUS_errWRITE : DFU_STATUS_OK;
+}
+
+static uint32_t flash_read(uint32_t block, uint8_t * *dst, uint32_t len)
+{
+	return 0;
+}
+
+static void flash_done(void)
+{
+	done_calls++;
+}
+
+static ErrorCode_t init_dfu(uint32_t pipelined, uint32_t mem_size)
+{
+	USBD_DFU_INIT_PARAM_T param;
+	ErrorCode_t ret;
+
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) dfu_mem;
+	param.mem_size = mem_size;
+	param.wTransferSize = XFER_SIZE;
+	param.intf_desc = dfu_desc;
+	param.DFU_Write = flash_write;
+	param.DFU_Read = flash_read;
+	param.DFU_Done = flash_done;
+	param.pipelined = pipelined;
+	ret = dfu_host_init(&param, DFU_STATE_dfuIDLE);
+	if (ret == LPC_OK) {
+		/* the pool is used within the size GetMemSize() asked for */
+		CHECK(mem_size - param.mem_size <= mwDFU_GetMemSize(&param));
+		hDfu = param.hDfu;
+	}
+	memset(flash, 0xFF, sizeof(flash));
+	next_block = write_calls = zero_copy_calls = done_calls = order_errors = wrong_thread = 0;
+	fail_block = ~0U;
+	write_thread = pthread_self();
+	return ret;
+}
+
+static void expect_status(uint8_t state, uint8_t status, uint32_t poll)
+{
+	DFU_STATUS_T s;
+
+	CHECK_EQ(dfu_getstatus(&s), LPC_OK);
+	CHECK_EQ(s.bState, state);
+	CHECK_EQ(s.bStatus, status);
+	CHECK_EQ(dfu_poll_timeout(&s), poll);
+}
+
+static void test_init(void)
+{
+	USBD_DFU_INIT_PARAM_T param;
+
+	memset(&param, 0, sizeof(param));
+	param.wTransferSize = XFER_SIZE;
+	param.pipelined = 1;
+	/* the second buffer is counted */
+	CHECK(mwDFU_GetMemSize(&param) >= 2 * XFER_SIZE);
+	CHECK_EQ(init_dfu(1, mwDFU_GetMemSize(&param) - 4), ERR_USBD_BAD_MEM_BUF);
+	CHECK_EQ(init_dfu(1, mwDFU_GetMemSize(&param)), LPC_OK);
+}
+
+/* without pipelined nothing changed: written in the interrupt */
+static void test_sync(void)
+{
+	CHECK_EQ(init_dfu(0, sizeof(dfu_mem)), LPC_OK);
+	poll_ms = 28;
+	CHECK_EQ(dfu_dnload(0, image, XFER_SIZE), LPC_OK);
+	CHECK_EQ(zero_copy_calls, 1);
+	CHECK_EQ(write_calls, 1);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 28);
+	mwDFU_Program(hDfu);
+	CHECK_EQ(write_calls, 1);
+	CHECK_EQ(dfu_dnload(1, &image[XFER_SIZE], XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 28);
+	CHECK_EQ(dfu_dnload(2, 0, 0), LPC_OK);
+	/* bwPollTimeout is left from the last block */
+	expect_status(DFU_STATE_dfuIDLE, DFU_STATUS_OK, 28);
+	CHECK_EQ(done_calls, 1);
+	CHECK(memcmp(flash, image, 2 * XFER_SIZE) == 0);
+}
+
+static void test_pipe(void)
+{
+	CHECK_EQ(init_dfu(1, sizeof(dfu_mem)), LPC_OK);
+	poll_ms = 28;
+	fake_frame = 100;
+
+	/* a free buffer: the next block straight away, nothing written yet */
+	CHECK_EQ(dfu_dnload(0, image, XFER_SIZE), LPC_OK);
+	CHECK_EQ(write_calls + zero_copy_calls, 0);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	/* both in use: busy, no estimate yet */
+	CHECK_EQ(dfu_dnload(1, &image[XFER_SIZE], XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNBUSY, DFU_STATUS_OK, 1);
+
+	/* the main loop writes the oldest block; the write took 8 frames */
+	mwDFU_Program(hDfu);
+	CHECK_EQ(write_calls, 1);
+	CHECK_EQ(((USBD_DFU_CTRL_T *) hDfu)->prog_time, WRITE_FRAMES + 1);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	CHECK_EQ(dfu_dnload(2, &image[2 * XFER_SIZE], XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNBUSY, DFU_STATUS_OK, WRITE_FRAMES + 1);
+
+	/* asked 3 frames into the next write: 5 frames left */
+	status_in_write = 1;
+	mwDFU_Program(hDfu);
+	status_in_write = 0;
+	CHECK_EQ(mid_write.bState, DFU_STATE_dfuDNBUSY);
+	CHECK_EQ(dfu_poll_timeout(&mid_write), WRITE_FRAMES + 1 - 3);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	/* nothing to write */
+	mwDFU_Program(hDfu);
+	mwDFU_Program(hDfu);
+	CHECK_EQ(write_calls, 3);
+
+	/* the end of the download waits for the last blocks */
+	CHECK_EQ(dfu_dnload(3, &image[3 * XFER_SIZE], XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	CHECK_EQ(dfu_dnload(4, 0, 0), LPC_OK);
+	expect_status(DFU_STATE_dfuMANIFEST, DFU_STATUS_OK, WRITE_FRAMES + 1);
+	CHECK_EQ(done_calls, 0);
+	mwDFU_Program(hDfu);
+	expect_status(DFU_STATE_dfuIDLE, DFU_STATUS_OK, 0);
+	CHECK_EQ(done_calls, 1);
+	CHECK_EQ(write_calls, 4);
+	CHECK_EQ(order_errors, 0);
+	CHECK(memcmp(flash, image, 4 * XFER_SIZE) == 0);
+}
+
+static void test_pipe_errors(void)
+{
+	/* a DFU_Write() error stalls the next block, or is reported by the
+	   GETSTATUS the host sends while both buffers are in use */
+	CHECK_EQ(init_dfu(1, sizeof(dfu_mem)), LPC_OK);
+	fail_block = 1;
+	CHECK_EQ(dfu_dnload(0, image, XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	mwDFU_Program(hDfu);
+	CHECK_EQ(dfu_dnload(1, &image[XFER_SIZE], XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	mwDFU_Program(hDfu);
+	CHECK_EQ(dfu_dnload(2, &image[2 * XFER_SIZE], XFER_SIZE), ERR_USBD_STALL);
+	expect_status(DFU_STATE_dfuERROR, DFU_STATUS_errWRITE, 0);
+	CHECK_EQ(dfu_request(USB_REQ_DFU_CLRSTATUS, 0), LPC_OK);
+	expect_status(DFU_STATE_dfuIDLE, DFU_STATUS_OK, 0);
+
+	CHECK_EQ(init_dfu(1, sizeof(dfu_mem)), LPC_OK);
+	fail_block = 0;
+	CHECK_EQ(dfu_dnload(0, image, XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	CHECK_EQ(dfu_dnload(1, &image[XFER_SIZE], XFER_SIZE), LPC_OK);
+	mwDFU_Program(hDfu);
+	expect_status(DFU_STATE_dfuERROR, DFU_STATUS_errWRITE, 0);
+	CHECK_EQ(dfu_request(USB_REQ_DFU_CLRSTATUS, 0), LPC_OK);
+	expect_status(DFU_STATE_dfuIDLE, DFU_STATUS_OK, 0);
+
+	/* and at the end of the download, instead of DFU_Done() */
+	CHECK_EQ(init_dfu(1, sizeof(dfu_mem)), LPC_OK);
+	fail_block = 0;
+	CHECK_EQ(dfu_dnload(0, image, XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	CHECK_EQ(dfu_dnload(1, 0, 0), LPC_OK);
+	mwDFU_Program(hDfu);
+	expect_status(DFU_STATE_dfuERROR, DFU_STATUS_errWRITE, 0);
+	CHECK_EQ(done_calls, 0);
+
+	/* a host that does not wait for a free buffer */
+	CHECK_EQ(init_dfu(1, sizeof(dfu_mem)), LPC_OK);
+	CHECK_EQ(dfu_dnload(0, image, XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNLOAD_IDLE, DFU_STATUS_OK, 0);
+	CHECK_EQ(dfu_dnload(1, &image[XFER_SIZE], XFER_SIZE), LPC_OK);
+	expect_status(DFU_STATE_dfuDNBUSY, DFU_STATUS_OK, 1);
+	CHECK_EQ(dfu_dnload(2, &image[2 * XFER_SIZE], XFER_SIZE), ERR_USBD_STALL);
+	expect_status(DFU_STATE_dfuERROR, DFU_STATUS_OK, 0);
+	CHECK_EQ(write_calls, 0);
+}
+
+/*
+ * Real time download. The host sleeps for the data stage and for every
+ * bwPollTimeout; the flash model sleeps for the erase and program times.
+ */
+static volatile uint32_t running;
+static USBD_HW_API_T rt_hw;
+
+static void *main_loop(void *arg)
+{
+	while (running) {
+		mwDFU_Program(hDfu);
+	}
+	return 0;
+}
+
+static void download(const char *name, uint32_t pipelined, uint32_t poll, double xfer_ms)
+{
+	pthread_t thread;
+	DFU_STATUS_T s;
+	uint32_t b, polls = 0, busy = 0, errors = 0;
+	uint16_t len;
+	double t0, elapsed, slept = 0;
+
+	CHECK_EQ(init_dfu(pipelined, sizeof(dfu_mem)), LPC_OK);
+	rt_hw = fake_hw_api;
+	rt_hw.GetFrameNumber = rt_GetFrameNumber;
+	msc_core.hw_api = &rt_hw;
+	poll_ms = poll;
+	realtime = 1;
+	running = 1;
+	if (pipelined) {
+		pthread_create(&thread, 0, main_loop, 0);
+		write_thread = thread;
+	}
+
+	t0 = now_ms();
+	for (b = 0; b <= NUM_BLOCKS; b++) {
+		len = (b < NUM_BLOCKS) ? XFER_SIZE : 0;
+		if (len) {
+			sleep_ms(xfer_ms);
+		}
+		if (dfu_dnload(b, &image[b * XFER_SIZE], len) != LPC_OK) {
+			errors++;
+			break;
+		}
+		for (;;) {
+			/* a GETSTATUS takes a microframe or so */
+			sleep_ms(0.125);
+			if ((dfu_getstatus(&s) != LPC_OK) || (s.bStatus != DFU_STATUS_OK)) {
+				errors++;
+				break;
+			}
+			polls++;
+			sleep_ms(dfu_poll_timeout(&s));
+			slept += dfu_poll_timeout(&s);
+			if ((s.bState != DFU_STATE_dfuDNBUSY) && (s.bState != DFU_STATE_dfuMANIFEST)) {
+				break;
+			}
+			busy++;
+		}
+	}
+	elapsed = now_ms() - t0;
+
+	running = 0;
+	if (pipelined) {
+		pthread_join(thread, 0);
+	}
+	realtime = 0;
+
+	CHECK_EQ(errors, 0);
+	CHECK_EQ(order_errors, 0);
+	CHECK_EQ(wrong_thread, 0);
+	CHECK_EQ(write_calls, NUM_BLOCKS);
+	CHECK_EQ(done_calls, 1);
+	CHECK(memcmp(flash, image, IMAGE_SIZE) == 0);
+	printf("%-24s %5.0f ms %5.0f KB/s, %3u GETSTATUS (%3u busy), host slept %4.0f ms\n",
+		   name, elapsed, IMAGE_SIZE / 1024.0 / (elapsed / 1e3), polls, busy, slept);
+}
+
+int main(void)
+{
+	uint32_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	srand(22);
+	for (i = 0; i < IMAGE_SIZE; i++) {
+		image[i] = rand();
+	}
+
+	test_init();
+	test_sync();
+	test_pipe();
+	test_pipe_errors();
+
+	/* erase per 8 KB sector, program per 512 B; the flash alone takes
+	   (20 + 2 * 8) ms per 8 KB */
+	erase_ms = 20;
+	prog_ms_per_512 = 1.0;
+	printf("%u KB image, %u byte blocks, flash bound %.0f KB/s\n", IMAGE_SIZE / 1024, XFER_SIZE,
+		   8.0 / ((erase_ms + 16 * prog_ms_per_512) / 1e3));
+	/* a 4 KB data stage takes about 3.5 ms at full speed, 64 byte packets */
+	download("synchronous, poll 28 ms", 0, 28, 3.5);
+	download("synchronous, poll 0", 0, 0, 3.5);
+	download("pipelined", 1, 0, 3.5);
+	return TEST_DONE();
+}
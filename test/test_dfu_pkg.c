@@ -0,0 +1,396 @@
+/*
+ * DFU package round trip (user-023).
+ *
+ * Packages made by tools/dfupack from a firmware-like image and from a next
+ * version of it (code moved by an insertion, pointers shifted behind it, a
+ * few patched bytes) are downloaded block by block through the DFU class
+ * driver, synchronously and pipelined, and the image DFU_Write() gets must
+ * match byte for byte: stored, LZ with 256 B to 4 KB windows, delta, and
+ * delta plus LZ. A plain image still goes through with the decoder on, and
+ * truncated, corrupted and unsupported packages fail with their status and
+ * without DFU_Done(). The package sizes and host decode speeds are printed.
+ *
+ * With three arguments, image base package, the package made by the
+ * dfupack command line tool is downloaded instead and checked against the
+ * image.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dfu_host.h"
+#include "dfu_pkg.h"
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define XFER_SIZE           2048
+#define IMAGE_SIZE          (192 * 1024 + 777)
+
+static uint8_t dfu_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, USB_DEVICE_CLASS_APP, USB_DFU_SUBCLASS, 2, 0,
+	9, USB_DFU_DESCRIPTOR_TYPE, USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL,
+	0xFF, 0, XFER_SIZE & 0xFF, XFER_SIZE >> 8, 0x10, 0x01,
+};
+static uint8_t dfu_mem[DFU_PKG_WIN_MAX + 4 * XFER_SIZE + 1024] __attribute__((aligned(4)));
+static USBD_HANDLE_T hDfu;
+static uint32_t pipelined;
+
+/* flash model */
+static uint8_t *flash;
+static uint32_t flash_size, next_block, write_calls, short_blocks, done_calls, order_errors, written;
+
+static uint8_t flash_write(uint32_t block, uint8_t * *src, uint32_t len, uint8_t *bwPollTimeout)
+{
+	if (len == 0) {
+		return DFU_STATUS_OK;
+	}
+	write_calls++;
+	if (block != next_block++) {
+		order_errors++;
+	}
+	if (len < XFER_SIZE) {
+		short_blocks++;
+	}
+	if (block * XFER_SIZE + len > flash_size) {
+		return DFU_STATUS_errADDRESS;
+	}
+	memcpy(&flash[block * XFER_SIZE], *src, len);
+	written += len;
+	bwPollTimeout[0] = bwPollTimeout[1] = bwPollTimeout[2] = 0;
+	return DFU_STATUS_OK;
+}
+
+static uint32_t flash_read(uint32_t block, uint8_t * *dst, uint32_t len)
+{
+	return 0;
+}
+
+static void flash_done(void)
+{
+	done_calls++;
+}
+
+static uint32_t init_dfu(uint32_t window_size, const uint8_t *base, uint32_t base_size)
+{
+	USBD_DFU_INIT_PARAM_T param;
+
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) dfu_mem;
+	param.mem_size = sizeof(dfu_mem);
+	param.wTransferSize = XFER_SIZE;
+	param.intf_desc = dfu_desc;
+	param.DFU_Write = flash_write;
+	param.DFU_Read = flash_read;
+	param.DFU_Done = flash_done;
+	param.pipelined = pipelined;
+	param.window_size = window_size;
+	param.base_image = base;
+	param.base_size = base_size;
+	CHECK_EQ(dfu_host_init(&param, DFU_STATE_dfuIDLE), LPC_OK);
+	hDfu = param.hDfu;
+	return mwDFU_GetMemSize(&param);
+}
+
+/* the status of a failed request; clears it for the next download */
+static uint8_t dfu_error(void)
+{
+	DFU_STATUS_T s;
+
+	dfu_getstatus(&s);
+	dfu_request(USB_REQ_DFU_CLRSTATUS, 0);
+	return s.bStatus ? s.bStatus : DFU_STATUS_errUNKNOWN;
+}
+
+/* download the way dfu-util does; returns the final bStatus */
+static uint8_t download(const uint8_t *data, uint32_t size)
+{
+	uint32_t b, num_blocks = (size + XFER_SIZE - 1) / XFER_SIZE;
+	uint16_t len;
+	DFU_STATUS_T s;
+
+	memset(flash, 0xFF, flash_size);
+	next_block = write_calls = short_blocks = done_calls = order_errors = written = 0;
+	for (b = 0; b <= num_blocks; b++) {
+		len = (b < num_blocks) ? ((b == num_blocks - 1) ? size - b * XFER_SIZE : XFER_SIZE) : 0;
+		if (dfu_dnload(b, &data[b * XFER_SIZE], len) != LPC_OK) {
+			return dfu_error();
+		}
+		if (pipelined && (b & 1)) {
+			/* the main loop got to it before the host asked */
+			mwDFU_Program(hDfu);
+		}
+		for (;;) {
+			if (dfu_getstatus(&s) != LPC_OK) {
+				return dfu_error();
+			}
+			if (s.bStatus != DFU_STATUS_OK) {
+				dfu_request(USB_REQ_DFU_CLRSTATUS, 0);
+				return s.bStatus;
+			}
+			if ((s.bState != DFU_STATE_dfuDNBUSY) && (s.bState != DFU_STATE_dfuMANIFEST)) {
+				break;
+			}
+			mwDFU_Program(hDfu);
+		}
+	}
+	return DFU_STATUS_OK;
+}
+
+/* a download which wrote image, in order, and finished once */
+static uint32_t check_image(const uint8_t *image, uint32_t size)
+{
+	uint32_t errors = test_failures;
+
+	CHECK_EQ(done_calls, 1);
+	CHECK_EQ(order_errors, 0);
+	CHECK_EQ(written, size);
+	CHECK_EQ(write_calls, (size + XFER_SIZE - 1) / XFER_SIZE);
+	CHECK_EQ(short_blocks, (size % XFER_SIZE) ? 1 : 0);
+	CHECK(memcmp(flash, image, size) == 0);
+	return errors == (uint32_t) test_failures;
+}
+
+static uint32_t seed = 23;
+
+static uint32_t rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* thumb-like code from a small set of idioms, literal pools with pointers
+   into the image, strings and zero padding */
+static void make_image(uint8_t *out, uint32_t size)
+{
+	static const char str[] = "USB DFU firmware update error: %d\n";
+	static uint8_t idiom[64][24];
+	static uint32_t idiom_len[64];
+	uint32_t i, k, r, d, v;
+
+	for (i = 0; i < 64; i++) {
+		idiom_len[i] = 4 + 2 * (rnd() % 10);
+		for (k = 0; k < 24; k++) {
+			idiom[i][k] = rnd();
+		}
+	}
+	i = 0;
+	while (i < size) {
+		r = rnd() % 100;
+		if (r < 70) {
+			for (k = 4 + rnd() % 30; (k != 0) && (i + 24 <= size); k--) {
+				d = rnd() % 64;
+				d = d * d / 64;
+				memcpy(&out[i], idiom[d], idiom_len[d]);
+				if (rnd() % 4 == 0) {
+					out[i + rnd() % idiom_len[d]] = rnd();
+				}
+				i += idiom_len[d];
+			}
+		}
+		else if (r < 85) {
+			for (k = 1 + rnd() % 8; (k != 0) && (i + 4 <= size); k--) {
+				v = (rnd() % 4) ? 0x1A000000 + (rnd() % size & ~3) : rnd();
+				memcpy(&out[i], &v, 4);
+				i += 4;
+			}
+		}
+		else if (r < 95) {
+			for (k = 0; (k < sizeof(str) - 1) && (i < size); k++) {
+				out[i++] = str[k];
+			}
+		}
+		else {
+			for (k = rnd() % 64; (k != 0) && (i < size); k--) {
+				out[i++] = 0;
+			}
+		}
+	}
+}
+
+/* the next version: 300 bytes inserted at a third, moving the code behind
+   and the pointers to it, 120 bytes deleted at two thirds, 40 bytes
+   patched and a table appended */
+static uint32_t make_update(uint8_t *out, const uint8_t *in, uint32_t size)
+{
+	static const char table[] = "appended feature table";
+	uint32_t ins = size / 3, ins_len = 300, del = 2 * size / 3, del_len = 120;
+	uint32_t i, k, n = 0, v;
+
+	for (i = 0; i < size; i++) {
+		if (i == ins) {
+			for (k = 0; k < ins_len; k++) {
+				out[n++] = rnd();
+			}
+		}
+		if ((i < del) || (i >= del + del_len)) {
+			out[n++] = in[i];
+		}
+	}
+	for (i = 0; i + 4 <= n; i += 4) {
+		memcpy(&v, &out[i], 4);
+		if ((v >= 0x1A000000 + ins) && (v < 0x1A000000 + size)) {
+			v += ins_len;
+			memcpy(&out[i], &v, 4);
+		}
+	}
+	for (i = 0; i < 40; i++) {
+		out[rnd() % n] ^= 1 + rnd() % 255;
+	}
+	memcpy(&out[n], table, sizeof(table) - 1);
+	return n + sizeof(table) - 1;
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static const struct {
+	uint8_t flags, win_bits, len_bits;
+	uint32_t window_size;
+	const char *name;
+} configs[] = {
+	{0, 0, 0, 256, "stored"},
+	{DFU_PKG_LZ, 8, 4, 256, "LZ, 256 B window"},
+	{DFU_PKG_LZ, 10, 4, 1024, "LZ, 1 KB window"},
+	{DFU_PKG_LZ, 12, 4, 4096, "LZ, 4 KB window"},
+	{DFU_PKG_LZ, 12, 6, 4096, "LZ, 4 KB, 6 length bits"},
+	{DFU_PKG_DELTA, 0, 0, 256, "delta"},
+	{DFU_PKG_DELTA | DFU_PKG_LZ, 10, 4, 1024, "delta + LZ, 1 KB"},
+	{DFU_PKG_DELTA | DFU_PKG_LZ, 12, 6, 4096, "delta + LZ, 4 KB"},
+};
+
+static void test_round_trip(const uint8_t *image, uint32_t size, const uint8_t *base, uint32_t base_size)
+{
+	DFU_PKG_BUF_T pkg;
+	uint32_t c, r, mem;
+	double t, best;
+
+	for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+		CHECK_EQ(dfu_pkg_build(&pkg, image, size, base, base_size, configs[c].flags,
+							   configs[c].win_bits, configs[c].len_bits), 0);
+		mem = init_dfu(configs[c].window_size, base, base_size);
+		/* the fastest of three downloads */
+		for (r = 0, best = 1e9; r < 3; r++) {
+			t = now();
+			CHECK_EQ(download(pkg.data, pkg.size), DFU_STATUS_OK);
+			t = now() - t;
+			best = (t < best) ? t : best;
+		}
+		printf("  %-26s %6u B %5.1f%%  %3u DNLOADs  %5u B RAM  %4.0f MB/s  %s\n", configs[c].name, pkg.size,
+			   100.0 * pkg.size / size, (pkg.size + XFER_SIZE - 1) / XFER_SIZE, mem, size / best / 1e6,
+			   check_image(image, size) ? "ok" : "FAIL");
+		dfu_pkg_free(&pkg);
+	}
+}
+
+static void test_errors(const uint8_t *image, uint32_t size, const uint8_t *base, uint32_t base_size)
+{
+	DFU_PKG_BUF_T pkg;
+
+	/* parameters the device refuses are refused by the builder */
+	CHECK_EQ(dfu_pkg_build(&pkg, image, size, 0, 0, DFU_PKG_DELTA, 0, 0), -1);
+	CHECK_EQ(dfu_pkg_build(&pkg, image, size, 0, 0, DFU_PKG_LZ, 16, 4), -1);
+	CHECK_EQ(dfu_pkg_build(&pkg, image, size, 0, 0, DFU_PKG_LZ, 8, 8), -1);
+
+	/* a plain image is written as received with the decoder on */
+	init_dfu(4096, base, base_size);
+	CHECK_EQ(download(image, size), DFU_STATUS_OK);
+	check_image(image, size);
+
+	/* a package which ends early or does not match its CRC */
+	CHECK_EQ(dfu_pkg_build(&pkg, image, size, 0, 0, DFU_PKG_LZ, 12, 4), 0);
+	CHECK_EQ(download(pkg.data, pkg.size - 3000), DFU_STATUS_errNOTDONE);
+	CHECK_EQ(done_calls, 0);
+	pkg.data[12] ^= 1;
+	CHECK_EQ(download(pkg.data, pkg.size), DFU_STATUS_errVERIFY);
+	CHECK_EQ(done_calls, 0);
+	pkg.data[12] ^= 1;
+	CHECK_EQ(download(pkg.data, pkg.size), DFU_STATUS_OK);
+	check_image(image, size);
+
+	/* a window larger than window_size */
+	init_dfu(1024, base, base_size);
+	CHECK_EQ(download(pkg.data, pkg.size), DFU_STATUS_errFILE);
+	CHECK_EQ(write_calls, 0);
+	dfu_pkg_free(&pkg);
+
+	/* a delta without base_image */
+	CHECK_EQ(dfu_pkg_build(&pkg, image, size, base, base_size, DFU_PKG_DELTA, 0, 0), 0);
+	init_dfu(1024, 0, 0);
+	CHECK_EQ(download(pkg.data, pkg.size), DFU_STATUS_errTARGET);
+	CHECK_EQ(write_calls, 0);
+	dfu_pkg_free(&pkg);
+}
+
+static uint8_t *read_file(const char *name, uint32_t *size)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t *data;
+	long len;
+
+	CHECK(f != 0);
+	if (f == 0) {
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(len);
+	CHECK_EQ(fread(data, 1, len, f), len);
+	fclose(f);
+	*size = len;
+	return data;
+}
+
+/* a package made by the dfupack tool */
+static void test_file(const char *image_name, const char *base_name, const char *pkg_name)
+{
+	uint8_t *image, *base, *pkg;
+	uint32_t size, base_size, pkg_size;
+
+	image = read_file(image_name, &size);
+	base = read_file(base_name, &base_size);
+	pkg = read_file(pkg_name, &pkg_size);
+	if (!image || !base || !pkg) {
+		return;
+	}
+	free(flash);
+	flash_size = size;
+	flash = malloc(flash_size);
+	for (pipelined = 0; pipelined < 2; pipelined++) {
+		init_dfu(DFU_PKG_WIN_MAX, base, base_size);
+		CHECK_EQ(download(pkg, pkg_size), DFU_STATUS_OK);
+		check_image(image, size);
+	}
+	printf("%s: %u B for a %u B image, %s\n", pkg_name, pkg_size, size, test_failures ? "FAIL" : "ok");
+	free(image);
+	free(base);
+	free(pkg);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t base[IMAGE_SIZE], image[IMAGE_SIZE + 1024];
+	uint32_t size;
+
+	if (argc == 4) {
+		test_file(argv[1], argv[2], argv[3]);
+		return TEST_DONE();
+	}
+	make_image(base, IMAGE_SIZE);
+	size = make_update(image, base, IMAGE_SIZE);
+	flash_size = size;
+	flash = malloc(flash_size);
+	printf("base image %u B, new image %u B, wTransferSize %u\n", IMAGE_SIZE, size, XFER_SIZE);
+
+	for (pipelined = 0; pipelined < 2; pipelined++) {
+		printf("%s\n", pipelined ? "pipelined" : "synchronous");
+		test_round_trip(image, size, base, IMAGE_SIZE);
+		test_errors(image, size, base, IMAGE_SIZE);
+	}
+	free(flash);
+	return TEST_DONE();
+}
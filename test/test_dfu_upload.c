@@ -0,0 +1,237 @@
+/*
+ * DFU upload readback (user-024).
+ *
+ * A 256 KB image is read back with DFU_UPLOAD through DFU_Read() and in
+ * place from upload_base, with and without the DFU file suffix, for a size
+ * that is a multiple of wTransferSize, one whose suffix is split over two
+ * blocks and one whose last block is a multiple of bMaxPacketSize0. The
+ * host must get the image, each block in one EP0 IN transfer up to
+ * DFU_MAX_XFER_SIZE and a zero length packet only after a short block of
+ * whole packets; in place nothing is copied and the transfers point into
+ * the image. The suffix must carry the device descriptor IDs and a CRC
+ * that a bitwise CRC-32 of the file agrees with. The EP0 IN transfers and
+ * DFU_Read() bytes are checked, the time per block only printed.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dfu_host.h"
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define XFER_SIZE           4096
+#define LARGE_XFER_SIZE     20480
+#define IMAGE_SIZE          (256 * 1024)
+#define BENCH_BYTES         (256 * 1024 * 1024)
+
+static uint8_t dfu_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, USB_DEVICE_CLASS_APP, USB_DFU_SUBCLASS, 2, 0,
+	9, USB_DFU_DESCRIPTOR_TYPE, USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL,
+	0xFF, 0, XFER_SIZE & 0xFF, XFER_SIZE >> 8, 0x10, 0x01,
+};
+static uint8_t dfu_mem[2 * LARGE_XFER_SIZE + 1024] __attribute__((aligned(4)));
+static uint8_t image[IMAGE_SIZE] __attribute__((aligned(4)));
+static uint8_t file[IMAGE_SIZE + LARGE_XFER_SIZE];
+static uint32_t image_size, read_calls, read_bytes, buffered_xfers;
+static USBD_HW_API_T rec_hw;
+
+/* counts the data stage transfers which do not point into the image */
+static uint32_t rec_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt)
+{
+	if ((EPNum == 0x80) && (cnt != 0) && ((pData < image) || (pData + cnt > &image[image_size]))) {
+		buffered_xfers++;
+	}
+	return fake_hw_api.WriteEP(hUsb, EPNum, pData, cnt);
+}
+
+static uint32_t flash_read(uint32_t block, uint8_t * *dst, uint32_t len)
+{
+	uint32_t offset = block * len;
+
+	read_calls++;
+	if (offset >= image_size) {
+		return 0;
+	}
+	if (len > image_size - offset) {
+		len = image_size - offset;
+	}
+	memcpy(*dst, &image[offset], len);
+	read_bytes += len;
+	return len;
+}
+
+static uint8_t flash_write(uint32_t block, uint8_t * *src, uint32_t len, uint8_t *bwPollTimeout)
+{
+	return DFU_STATUS_OK;
+}
+
+static void flash_done(void)
+{
+}
+
+static void init_dfu(uint32_t xfer_size, uint32_t in_place, uint32_t suffix)
+{
+	USBD_DFU_INIT_PARAM_T param;
+
+	dfu_desc[14] = xfer_size & 0xFF;
+	dfu_desc[15] = xfer_size >> 8;
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) dfu_mem;
+	param.mem_size = sizeof(dfu_mem);
+	param.wTransferSize = xfer_size;
+	param.intf_desc = dfu_desc;
+	param.DFU_Write = flash_write;
+	param.DFU_Read = flash_read;
+	param.DFU_Done = flash_done;
+	if (in_place) {
+		param.upload_base = image;
+		param.upload_size = image_size;
+	}
+	param.upload_suffix = suffix;
+	CHECK_EQ(dfu_host_init(&param, DFU_STATE_dfuIDLE), LPC_OK);
+	rec_hw = fake_hw_api;
+	rec_hw.WriteEP = rec_WriteEP;
+	msc_core.hw_api = &rec_hw;
+	read_calls = read_bytes = buffered_xfers = 0;
+}
+
+/* the upload the way dfu-util does it, until a short block; returns the
+   file size, -1 on a stall */
+static int32_t upload(uint32_t xfer_size)
+{
+	uint32_t got = 0;
+	int32_t n;
+	uint16_t block = 0;
+
+	do {
+		if (got + xfer_size > sizeof(file)) {
+			return -1;
+		}
+		n = dfu_upload(block++, &file[got], xfer_size);
+		if (n < 0) {
+			return -1;
+		}
+		got += n;
+	} while ((uint32_t) n == xfer_size);
+	return got;
+}
+
+/* CRC of a DFU file suffix, bit by bit: CRC-32 without the final inversion */
+static uint32_t crc_bitwise(const uint8_t *p, uint32_t n)
+{
+	uint32_t crc = 0xFFFFFFFF, k;
+
+	while (n-- != 0) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return crc;
+}
+
+static void check_suffix(uint32_t got)
+{
+	const uint8_t *sfx = &file[got - DFU_SUFFIX_SIZE];
+	uint32_t crc;
+
+	CHECK_EQ(sfx[0] | (sfx[1] << 8), 0x0100);		/* bcdDevice */
+	CHECK_EQ(sfx[2] | (sfx[3] << 8), 0x0082);		/* idProduct */
+	CHECK_EQ(sfx[4] | (sfx[5] << 8), 0x1FC9);		/* idVendor */
+	CHECK_EQ(sfx[6] | (sfx[7] << 8), 0x0100);		/* bcdDFU, DFU 1.1 appendix B */
+	CHECK(memcmp(&sfx[8], "UFD", 3) == 0);
+	CHECK_EQ(sfx[11], DFU_SUFFIX_SIZE);
+	memcpy(&crc, &sfx[12], 4);
+	CHECK_EQ(crc, crc_bitwise(file, got - 4));
+}
+
+static void test_upload(uint32_t size, uint32_t in_place, uint32_t suffix)
+{
+	uint32_t blocks, last, xfers, zlps;
+	int32_t got;
+
+	image_size = size;
+	init_dfu(XFER_SIZE, in_place, suffix);
+	xfers = fake_ep[1].xfers;
+	got = upload(XFER_SIZE);
+	CHECK_EQ(got, size + (suffix ? DFU_SUFFIX_SIZE : 0));
+	if (got < 0) {
+		return;
+	}
+	CHECK(memcmp(file, image, size) == 0);
+	if (suffix) {
+		check_suffix(got);
+	}
+
+	/* one transfer per block, the last one empty when the file is a
+	   multiple of wTransferSize, and a ZLP after a short block of whole
+	   packets */
+	blocks = got / XFER_SIZE + 1;
+	last = got % XFER_SIZE;
+	zlps = (last != 0) && (last % 64 == 0);
+	CHECK_EQ(fake_ep[1].xfers - xfers, blocks + zlps);
+
+	if (in_place) {
+		/* only the blocks holding the suffix are put together in a buffer */
+		CHECK_EQ(read_calls, 0);
+		CHECK(buffered_xfers <= (suffix ? 2U : 0U));
+	}
+	else {
+		CHECK_EQ(read_bytes, size);
+	}
+}
+
+/* blocks larger than DFU_MAX_XFER_SIZE go in several transfers */
+static void test_large_blocks(void)
+{
+	uint32_t xfers;
+
+	image_size = IMAGE_SIZE;
+	init_dfu(LARGE_XFER_SIZE, 1, 1);
+	xfers = fake_ep[1].xfers;
+	CHECK_EQ(upload(LARGE_XFER_SIZE), IMAGE_SIZE + DFU_SUFFIX_SIZE);
+	CHECK(memcmp(file, image, IMAGE_SIZE) == 0);
+	check_suffix(IMAGE_SIZE + DFU_SUFFIX_SIZE);
+	/* 12 full blocks of 16 KB + 4 KB, then 16 KB + 16 B */
+	CHECK_EQ(fake_ep[1].xfers - xfers, 12 * 2 + 2);
+}
+
+static double bench(uint32_t in_place, uint32_t suffix)
+{
+	struct timespec t0, t1;
+	uint32_t i, n = BENCH_BYTES / IMAGE_SIZE;
+
+	image_size = IMAGE_SIZE;
+	init_dfu(XFER_SIZE, in_place, suffix);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		CHECK_EQ(upload(XFER_SIZE), IMAGE_SIZE + (suffix ? DFU_SUFFIX_SIZE : 0));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / (BENCH_BYTES / XFER_SIZE);
+}
+
+int main(void)
+{
+	static const uint32_t sizes[] = {IMAGE_SIZE, IMAGE_SIZE - 10, IMAGE_SIZE - 7 * 64};
+	uint32_t i, mode;
+
+	srand(24);
+	for (i = 0; i < IMAGE_SIZE; i++) {
+		image[i] = rand();
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (mode = 0; mode < 4; mode++) {
+			test_upload(sizes[i], mode & 1, mode >> 1);
+		}
+	}
+	test_large_blocks();
+
+	printf("device time per %u KB UPLOAD on the host:\n", XFER_SIZE / 1024);
+	printf("  DFU_Read               %6.0f ns\n", bench(0, 0));
+	printf("  DFU_Read + suffix CRC  %6.0f ns\n", bench(0, 1));
+	printf("  in place               %6.0f ns\n", bench(1, 0));
+	printf("  in place + suffix CRC  %6.0f ns\n", bench(1, 1));
+	return TEST_DONE();
+}
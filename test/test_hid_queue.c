@@ -0,0 +1,444 @@
+/*
+ * HID input report queue (user-021).
+ *
+ * Step by step on the fake controller: the parameter checks, one FIFO per
+ * report ID sent in order and full at queue_depth, the report IDs taken in
+ * turn, a coalesced report keeping only its latest value without touching
+ * the copy on the bus, and the queues dropped on bus reset and
+ * SET_CONFIGURATION. Then one second of 125 us microframes, the host
+ * taking one report per microframe, at several sensor and status rates:
+ * the reports delivered per microframe and how many updates a status report
+ * lags behind are printed. Last, a SIGALRM handler plays the host while the
+ * main loop queues as fast as it can.
+ */
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "fake_hw.h"
+#include "msc_harness.h"
+#include "mw_usbd_hid.h"
+#include "mw_usbd_hiduser.h"
+#include "test_util.h"
+
+/* class handler dispatch of the core, not in a header */
+extern ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event);
+
+#define HID_IN_EP           0x81
+#define SENSOR_ID           0
+#define EVENT_ID            1
+#define STATUS_ID           2
+#define NUM_REPORTS         3
+#define DEPTH               4
+#define SENSOR_LEN          1024
+#define STATUS_LEN          64
+#define UFRAMES             8000
+
+/* interface 0, HID descriptor, interrupt IN of 1024 bytes every microframe */
+static uint8_t hid_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, USB_DEVICE_CLASS_HUMAN_INTERFACE, 0, 0, 0,
+	9, HID_HID_DESCRIPTOR_TYPE, 0x11, 0x01, 0, 1, HID_REPORT_DESCRIPTOR_TYPE, 50, 0,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, HID_IN_EP, USB_ENDPOINT_TYPE_INTERRUPT, 0x00, 0x04, 1,
+};
+static USB_HID_REPORT_T reports[NUM_REPORTS];
+static uint8_t hid_mem[32768] __attribute__((aligned(4)));
+static uint8_t report[SENSOR_LEN];
+static USBD_HANDLE_T hHid;
+
+static ErrorCode_t get_report(USBD_HANDLE_T h, USB_SETUP_PACKET *pSetup, uint8_t * *pBuffer, uint16_t *length)
+{
+	return LPC_OK;
+}
+
+static ErrorCode_t set_report(USBD_HANDLE_T h, USB_SETUP_PACKET *pSetup, uint8_t * *pBuffer, uint16_t length)
+{
+	return LPC_OK;
+}
+
+static void default_param(USBD_HID_INIT_PARAM_T *param)
+{
+	memset(param, 0, sizeof(*param));
+	param->intf_desc = hid_desc;
+	param->max_reports = NUM_REPORTS;
+	param->report_data = reports;
+	param->HID_GetReport = get_report;
+	param->HID_SetReport = set_report;
+	param->queue_depth = DEPTH;
+	param->max_report_size = SENSOR_LEN;
+	param->coalesce_mask = 1 << STATUS_ID;
+}
+
+static ErrorCode_t init_hid(USBD_HID_INIT_PARAM_T *param, uint32_t mem_size)
+{
+	ErrorCode_t ret;
+
+	CHECK_EQ(msc_harness_init_core(USB_HIGH_SPEED, 1), LPC_OK);
+	msc_core.config_value = 1;
+
+	param->mem_base = (uint32_t) hid_mem;
+	param->mem_size = mem_size;
+	ret = mwHID_init(&msc_core, param);
+	if (ret == LPC_OK) {
+		/* the pool is used within the size GetMemSize() asked for */
+		CHECK(mem_size - param->mem_size <= mwHID_GetMemSize(param));
+		hHid = param->hHid;
+	}
+	return ret;
+}
+
+static ErrorCode_t init_default(void)
+{
+	USBD_HID_INIT_PARAM_T param;
+
+	default_param(&param);
+	return init_hid(&param, sizeof(hid_mem));
+}
+
+/* report id n: the id, a 32-bit value, then a pattern of the value */
+static uint32_t send(uint8_t id, uint32_t value, uint32_t len)
+{
+	uint32_t i;
+
+	report[0] = id;
+	memcpy(&report[1], &value, 4);
+	for (i = 5; i < len; i++) {
+		report[i] = (uint8_t) (value + i);
+	}
+	return mwHID_SendReport(hHid, id, report, len);
+}
+
+static int report_ok(const uint8_t *data, uint32_t len)
+{
+	uint32_t i, value;
+
+	memcpy(&value, &data[1], 4);
+	for (i = 5; i < len; i++) {
+		if (data[i] != (uint8_t) (value + i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* retires the report on the endpoint: (id << 24) | value, ~0 if none */
+static uint32_t take(void)
+{
+	FAKE_XFER_T *xfer = fake_hw_peek(HID_IN_EP);
+	uint32_t value;
+
+	if (xfer == 0) {
+		return ~0U;
+	}
+	memcpy(&value, &xfer->data[1], 4);
+	CHECK(report_ok(xfer->data, xfer->len));
+	value |= (uint32_t) xfer->data[0] << 24;
+	CHECK_EQ(fake_hw_complete_in(&msc_core, HID_IN_EP), LPC_OK);
+	return value;
+}
+
+static void test_init(void)
+{
+	USBD_HID_INIT_PARAM_T param;
+
+	default_param(&param);
+	param.max_report_size = 0;
+	CHECK_EQ(init_hid(&param, sizeof(hid_mem)), ERR_API_INVALID_PARAM2);
+	default_param(&param);
+	param.max_report_size = USB_HS_MAX_INT_PACKET + 1;
+	CHECK_EQ(init_hid(&param, sizeof(hid_mem)), ERR_API_INVALID_PARAM2);
+	/* a pool one word too small */
+	default_param(&param);
+	CHECK_EQ(init_hid(&param, mwHID_GetMemSize(&param) - 4), ERR_USBD_BAD_MEM_BUF);
+	default_param(&param);
+	CHECK_EQ(init_hid(&param, mwHID_GetMemSize(&param)), LPC_OK);
+	CHECK(hHid != 0);
+
+	/* wrong parameters and an unconfigured device queue nothing */
+	CHECK_EQ(send(NUM_REPORTS, 1, 8), 0);
+	CHECK_EQ(send(SENSOR_ID, 1, 0), 0);
+	CHECK_EQ(send(SENSOR_ID, 1, SENSOR_LEN + 1), 0);
+	msc_core.config_value = 0;
+	CHECK_EQ(send(SENSOR_ID, 1, 8), 0);
+	msc_core.config_value = 1;
+	CHECK(fake_hw_peek(HID_IN_EP) == 0);
+
+	/* without a queue the endpoint is left to the application */
+	default_param(&param);
+	param.queue_depth = 0;
+	CHECK_EQ(init_hid(&param, sizeof(hid_mem)), LPC_OK);
+	CHECK_EQ(send(SENSOR_ID, 1, 8), 0);
+}
+
+static void test_fifo(void)
+{
+	uint32_t i;
+
+	CHECK_EQ(init_default(), LPC_OK);
+
+	/* an idle endpoint sends at once, a whole 1024 byte report */
+	CHECK_EQ(send(SENSOR_ID, 0, SENSOR_LEN), SENSOR_LEN);
+	CHECK_EQ(fake_ep[fake_ep_index(HID_IN_EP)].count, 1);
+	CHECK_EQ(fake_hw_peek(HID_IN_EP)->len, SENSOR_LEN);
+	/* the report on the bus holds its slot until USB_EVT_IN */
+	for (i = 1; i < DEPTH; i++) {
+		CHECK_EQ(send(SENSOR_ID, i, 100), 100);
+	}
+	CHECK_EQ(send(SENSOR_ID, DEPTH, 100), 0);
+	CHECK_EQ(fake_ep[fake_ep_index(HID_IN_EP)].count, 1);
+	CHECK_EQ(take(), 0);
+	CHECK_EQ(send(SENSOR_ID, DEPTH, 100), 100);
+	for (i = 1; i <= DEPTH; i++) {
+		CHECK_EQ(take(), i);
+	}
+	CHECK_EQ(take(), ~0U);
+	/* idle again, the next report starts the endpoint */
+	CHECK_EQ(send(SENSOR_ID, 77, 10), 10);
+	CHECK_EQ(take(), 77);
+}
+
+static void test_round_robin(void)
+{
+	uint32_t i;
+
+	CHECK_EQ(init_default(), LPC_OK);
+	CHECK_EQ(send(SENSOR_ID, 0, 16), 16);
+	for (i = 1; i < DEPTH; i++) {
+		CHECK_EQ(send(SENSOR_ID, i, 16), 16);
+		CHECK_EQ(send(EVENT_ID, i, 16), 16);
+	}
+	CHECK_EQ(send(STATUS_ID, 1, STATUS_LEN), STATUS_LEN);
+
+	/* the report IDs in turn from the one after the last sent */
+	CHECK_EQ(take(), (SENSOR_ID << 24) | 0);
+	CHECK_EQ(take(), (EVENT_ID << 24) | 1);
+	CHECK_EQ(take(), (STATUS_ID << 24) | 1);
+	CHECK_EQ(take(), (SENSOR_ID << 24) | 1);
+	CHECK_EQ(take(), (EVENT_ID << 24) | 2);
+	CHECK_EQ(take(), (SENSOR_ID << 24) | 2);
+	CHECK_EQ(take(), (EVENT_ID << 24) | 3);
+	CHECK_EQ(take(), (SENSOR_ID << 24) | 3);
+	CHECK_EQ(take(), ~0U);
+}
+
+static void test_coalesce(void)
+{
+	FAKE_XFER_T *xfer;
+	uint8_t on_bus[STATUS_LEN];
+	uint32_t i;
+
+	CHECK_EQ(init_default(), LPC_OK);
+
+	/* status updates while the endpoint is busy: only the latest is sent */
+	CHECK_EQ(send(SENSOR_ID, 0, 16), 16);
+	for (i = 1; i <= 5; i++) {
+		CHECK_EQ(send(STATUS_ID, i, STATUS_LEN), STATUS_LEN);
+	}
+	CHECK_EQ(take(), (SENSOR_ID << 24) | 0);
+
+	/* updates while the status report is on the bus leave it whole */
+	xfer = fake_hw_peek(HID_IN_EP);
+	CHECK(xfer != 0);
+	if (xfer == 0) {
+		return;
+	}
+	memcpy(on_bus, xfer->data, STATUS_LEN);
+	for (i = 6; i <= 20; i++) {
+		CHECK_EQ(send(STATUS_ID, i, STATUS_LEN), STATUS_LEN);
+	}
+	CHECK(memcmp(on_bus, xfer->data, STATUS_LEN) == 0);
+	CHECK_EQ(take(), (STATUS_ID << 24) | 5);
+	CHECK_EQ(take(), (STATUS_ID << 24) | 20);
+	CHECK_EQ(take(), ~0U);
+}
+
+static void test_flush(void)
+{
+	CHECK_EQ(init_default(), LPC_OK);
+
+	/* bus reset drops the queued reports and the one on the bus */
+	CHECK_EQ(send(SENSOR_ID, 0, 16), 16);
+	CHECK_EQ(send(SENSOR_ID, 1, 16), 16);
+	CHECK_EQ(send(STATUS_ID, 1, STATUS_LEN), STATUS_LEN);
+	USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_RESET);
+	fake_hw_reset();
+	CHECK_EQ(send(SENSOR_ID, 2, 16), 16);
+	CHECK_EQ(take(), 2);
+	CHECK_EQ(take(), ~0U);
+
+	/* and so does SET_CONFIGURATION, which is left to the core */
+	CHECK_EQ(send(EVENT_ID, 3, 16), 16);
+	CHECK_EQ(send(EVENT_ID, 4, 16), 16);
+	msc_core.SetupPacket.bmRequestType.B = 0x00;
+	msc_core.SetupPacket.bRequest = USB_REQUEST_SET_CONFIGURATION;
+	msc_core.SetupPacket.wValue.W = 1;
+	msc_core.SetupPacket.wIndex.W = 0;
+	msc_core.SetupPacket.wLength = 0;
+	CHECK_EQ(USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_SETUP), ERR_USBD_UNHANDLED);
+	fake_hw_reset();
+	CHECK_EQ(send(EVENT_ID, 5, 16), 16);
+	CHECK_EQ(take(), (EVENT_ID << 24) | 5);
+	CHECK_EQ(take(), ~0U);
+}
+
+/*
+ * Host side of the rate and interrupt runs: one report per microframe at
+ * most. Sensor reports must arrive in order without gaps, status reports
+ * with increasing values.
+ */
+static volatile uint32_t in_busy, dbl_queued, data_errors;
+static uint8_t *volatile in_data;
+static volatile uint32_t in_len;
+static volatile uint32_t got_sensor, got_status, next_sensor, last_status, status_lag;
+static uint32_t sensor_seq, status_seq, sensor_dropped;
+static USBD_HW_API_T async_hw;
+
+static uint32_t async_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt)
+{
+	if (in_busy) {
+		dbl_queued++;
+	}
+	in_data = pData;
+	in_len = cnt;
+	in_busy = 1;
+	return cnt;
+}
+
+static void host_uframe(void)
+{
+	uint32_t value;
+
+	if (!in_busy) {
+		return;
+	}
+	in_busy = 0;
+	memcpy(&value, &in_data[1], 4);
+	if (!report_ok(in_data, in_len)) {
+		data_errors++;
+	}
+	if (in_data[0] == SENSOR_ID) {
+		if ((in_len != SENSOR_LEN) || (value != next_sensor)) {
+			data_errors++;
+		}
+		next_sensor = value + 1;
+		got_sensor++;
+	}
+	else if (in_data[0] == STATUS_ID) {
+		if ((in_len != STATUS_LEN) || (got_status && (value <= last_status))) {
+			data_errors++;
+		}
+		last_status = value;
+		status_lag += status_seq - value;
+		got_status++;
+	}
+	else {
+		data_errors++;
+	}
+	fake_hw_event(&msc_core, HID_IN_EP, USB_EVT_IN);
+}
+
+static void host_signal(int sig)
+{
+	host_uframe();
+}
+
+static void host_start(void)
+{
+	CHECK_EQ(init_default(), LPC_OK);
+	async_hw = fake_hw_api;
+	async_hw.WriteEP = async_WriteEP;
+	msc_core.hw_api = &async_hw;
+	in_busy = dbl_queued = data_errors = 0;
+	got_sensor = got_status = next_sensor = last_status = status_lag = 0;
+	sensor_seq = status_seq = sensor_dropped = 0;
+}
+
+static void send_sensor(void)
+{
+	if (send(SENSOR_ID, sensor_seq, SENSOR_LEN)) {
+		sensor_seq++;
+	}
+	else {
+		sensor_dropped++;
+	}
+}
+
+static void send_status(void)
+{
+	CHECK_EQ(send(STATUS_ID, ++status_seq, STATUS_LEN), STATUS_LEN);
+}
+
+/* sensor reports and status updates per 8 microframes */
+static void test_rate(uint32_t sensor_rate, uint32_t status_rate)
+{
+	uint32_t uf, i, n;
+
+	host_start();
+	for (uf = 0; uf < UFRAMES; uf++) {
+		n = ((uf + 1) * sensor_rate) / 8 - (uf * sensor_rate) / 8;
+		for (i = 0; i < n; i++) {
+			send_sensor();
+		}
+		n = ((uf + 1) * status_rate) / 8 - (uf * status_rate) / 8;
+		for (i = 0; i < n; i++) {
+			send_status();
+		}
+		host_uframe();
+	}
+	for (uf = 0; uf < 2 * DEPTH; uf++) {
+		host_uframe();
+	}
+
+	CHECK_EQ(data_errors, 0);
+	CHECK_EQ(dbl_queued, 0);
+	CHECK_EQ(got_sensor, sensor_seq);
+	/* the latest status always reaches the host */
+	CHECK_EQ(last_status, status_seq);
+	/* the endpoint never idles while something is queued */
+	if (sensor_rate + status_rate >= 8) {
+		CHECK(got_sensor + got_status >= UFRAMES - 1);
+	}
+	printf("sensor %u/8, status %u/8 per uframe: %.3f reports per uframe, %u sensor dropped, "
+		   "status %u sent, %.2f updates behind\n",
+		   sensor_rate, status_rate, (double) (got_sensor + got_status) / UFRAMES, sensor_dropped,
+		   got_status, got_status ? (double) status_lag / got_status : 0.0);
+}
+
+static void test_async(void)
+{
+	struct itimerval timer = {{0, 50}, {0, 50}};
+
+	host_start();
+	signal(SIGALRM, host_signal);
+	setitimer(ITIMER_REAL, &timer, 0);
+	while (got_sensor < 20000) {
+		send_sensor();
+		send_status();
+	}
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, 0);
+	signal(SIGALRM, SIG_DFL);
+	while (in_busy) {
+		host_uframe();
+	}
+
+	CHECK_EQ(data_errors, 0);
+	CHECK_EQ(dbl_queued, 0);
+	CHECK_EQ(got_sensor, sensor_seq);
+	CHECK_EQ(last_status, status_seq);
+	printf("interrupt run: %u sensor, %u status reports of %u updates\n", got_sensor, got_status, status_seq);
+}
+
+int main(void)
+{
+	test_init();
+	test_fifo();
+	test_round_robin();
+	test_coalesce();
+	test_flush();
+	test_rate(8, 0);
+	test_rate(7, 8);
+	test_rate(4, 32);
+	test_rate(6, 1);
+	test_async();
+	return TEST_DONE();
+}
@@ -0,0 +1,108 @@
+/*
+ * IP9028 deferred event processing (user-006).
+ *
+ * Built with USB_HW_DEFER_EVENTS set: the ISR only captures events and
+ * hwUSB_ProcessEvents runs the handlers. A setup packet is taken by the
+ * ISR, so one arriving before the dispatch does not replace it. A full
+ * event ring masks the interrupt; hwUSB_EnableEvent then updates the
+ * saved mask, which hwUSB_ProcessEvents restores.
+ */
+#include <string.h>
+#include "ip9028_model.h"
+#include "test_util.h"
+
+#define EP_IN   0x81
+
+static uint8_t buf[64];
+static uint32_t in_events, setup_events, sof_events;
+static uint32_t setup_seen[2];
+
+static ErrorCode_t ep_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	if (event == USB_EVT_IN) {
+		in_events++;
+	}
+	return LPC_OK;
+}
+
+static ErrorCode_t ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	if (event == USB_EVT_SETUP) {
+		setup_events++;
+		hwUSB_ReadSetupPkt(hUsb, 0, setup_seen);
+	}
+	return LPC_OK;
+}
+
+static ErrorCode_t sof_event(USBD_HANDLE_T hUsb)
+{
+	sof_events++;
+	return LPC_OK;
+}
+
+int main(void)
+{
+	USBD_HANDLE_T hUsb;
+	USB_CORE_CTRL_T *pCtrl;
+	USB_ENDPOINT_DESCRIPTOR ep = {sizeof(USB_ENDPOINT_DESCRIPTOR), USB_ENDPOINT_DESCRIPTOR_TYPE, EP_IN,
+								  USB_ENDPOINT_TYPE_BULK, 512, 0};
+	/* GET_DESCRIPTOR(device), then SET_ADDRESS(5) */
+	static const uint8_t first[8] = {0x80, USB_REQUEST_GET_DESCRIPTOR, 0, 1, 0, 0, 64, 0};
+	static const uint8_t second[8] = {0x00, USB_REQUEST_SET_ADDRESS, 5, 0, 0, 0, 0, 0};
+	uint32_t i, usbintr;
+
+	CHECK_EQ(ip9028_model_init(&hUsb, 2, 4), LPC_OK);
+	pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	hwUSB_ConfigEP(hUsb, &ep);
+	hwUSB_EnableEP(hUsb, EP_IN);
+	CHECK_EQ(mwUSB_RegisterEpHandler(hUsb, 3, ep_in_hdlr, 0), LPC_OK);
+	CHECK_EQ(mwUSB_RegisterEpHandler(hUsb, 0, ep0_hdlr, 0), LPC_OK);
+
+	/* completion: nothing runs in the ISR */
+	hwUSB_WriteEP(hUsb, EP_IN, buf, 64);
+	ip9028_model_take_primes();
+	ip9028_model_run(EP_IN, 8, 0, 0);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(in_events, 0);
+	CHECK_EQ(hwUSB_ProcessEvents(hUsb), 1);
+	CHECK_EQ(in_events, 1);
+	CHECK_EQ(hwUSB_ProcessEvents(hUsb), 0);
+
+	/* setup taken by the ISR; a second one lands in the dQH before the
+	   first is dispatched */
+	ip9028_model_isr_setup(hUsb, (const USB_SETUP_PACKET *) first);
+	memcpy((void *) ip9028_qh(0)->setup, second, sizeof(second));
+	CHECK_EQ(setup_events, 0);
+	CHECK_EQ(hwUSB_ProcessEvents(hUsb), 1);
+	CHECK_EQ(setup_events, 1);
+	CHECK(memcmp(setup_seen, first, sizeof(first)) == 0);
+
+	/* fill the event ring with SOFs */
+	pCtrl->USB_SOF_Event = sof_event;
+	CHECK_EQ(hwUSB_EnableEvent(hUsb, 0, USB_EVT_SOF, 1), LPC_OK);
+	usbintr = ip9028_regs.usbintr;
+	for (i = 0; i < USB_HW_EVENT_RING_SIZE; i++) {
+		ip9028_model_isr(hUsb, USBSTS_SRI);
+	}
+	CHECK_EQ(sof_events, 0);
+	CHECK_EQ(ip9028_regs.usbintr, usbintr);
+	/* one more: left pending in the controller, interrupt masked */
+	ip9028_model_isr(hUsb, USBSTS_SRI);
+	CHECK_EQ(ip9028_regs.usbintr, 0);
+	/* enabling an event meanwhile must survive the unmask */
+	CHECK_EQ(hwUSB_EnableEvent(hUsb, 0, USB_EVT_DEV_ERROR, 1), LPC_OK);
+	CHECK_EQ(ip9028_regs.usbintr, 0);
+	CHECK_EQ(hwUSB_ProcessEvents(hUsb), USB_HW_EVENT_RING_SIZE);
+	CHECK_EQ(sof_events, USB_HW_EVENT_RING_SIZE);
+	CHECK_EQ(ip9028_regs.usbintr, usbintr | USBSTS_UEI);
+	/* and disabling one */
+	for (i = 0; i < USB_HW_EVENT_RING_SIZE + 1; i++) {
+		ip9028_model_isr(hUsb, USBSTS_SRI);
+	}
+	CHECK_EQ(ip9028_regs.usbintr, 0);
+	CHECK_EQ(hwUSB_EnableEvent(hUsb, 0, USB_EVT_SOF, 0), LPC_OK);
+	CHECK_EQ(hwUSB_ProcessEvents(hUsb), USB_HW_EVENT_RING_SIZE);
+	CHECK_EQ(ip9028_regs.usbintr, (usbintr | USBSTS_UEI) & ~USBSTS_SRI);
+
+	return TEST_DONE();
+}
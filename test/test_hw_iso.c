@@ -0,0 +1,225 @@
+/*
+ * IP9028 isochronous transfers (user-025).
+ *
+ * An ISO IN dTD must carry in MultO the packets of its (micro)frame, one
+ * for a zero length frame, and a transfer of more than Mult packets must
+ * be refused; ISO OUT and bulk dTDs leave MultO at 0. GetXferLen must give
+ * the bytes moved by the dTD just retired in either direction, with the
+ * transaction and buffer error bits. Then the mwADC function runs on the
+ * driver: its ISO OUT dTDs stay queued as a ring while the controller
+ * retires them several per interrupt, without the endpoint ever being
+ * primed again, a packet flagged with a transaction error is dropped, and
+ * each retired feedback dTD is followed by a new one.
+ */
+#include <string.h>
+#include "ip9028_model.h"
+#include "mw_usbd_audio.h"
+#include "mw_usbd_adcuser.h"
+#include "test_util.h"
+
+/* stream switch of the ADC driver, not in a header */
+extern void mwADC_SetActive(USB_ADC_CTRL_T *pAdc, uint32_t on);
+
+#define NUM_EP          4
+#define DEPTH           8
+#define ISO_IN_EP       0x81
+#define ISO_OUT_EP      0x02
+#define BULK_IN_EP      0x83
+#define ADC_OUT_EP      0x01
+#define ADC_FB_EP       0x81
+#define ADC_PACKET      192				/* 48 stereo 16 bit frames */
+
+static uint8_t buf[4096];
+static uint32_t events, ev_len[16], ev_status[16];
+
+static uint8_t adc_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 0, USB_DEVICE_CLASS_AUDIO, AUDIO_SUBCLASS_AUDIOCONTROL, 0, 0,
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 1, 1, 2, USB_DEVICE_CLASS_AUDIO, AUDIO_SUBCLASS_AUDIOSTREAMING, 0, 0,
+	9, USB_ENDPOINT_DESCRIPTOR_TYPE, ADC_OUT_EP, 0x05, 200, 0, 1, 0, ADC_FB_EP,
+	9, USB_ENDPOINT_DESCRIPTOR_TYPE, ADC_FB_EP, 0x11, 3, 0, 1, 3, 0,
+};
+static uint8_t adc_mem[8192] __attribute__((aligned(4)));
+static uint8_t pcm[4 * ADC_PACKET];
+
+static ErrorCode_t ep_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	uint32_t ep_addr = (uint32_t) (uintptr_t) data;
+
+	if (((event == USB_EVT_IN) || (event == USB_EVT_OUT)) && (events < 16)) {
+		ev_len[events] = hwUSB_GetXferLen(hUsb, ep_addr, &ev_status[events]);
+		events++;
+	}
+	return LPC_OK;
+}
+
+static uint32_t multo(uint32_t ep_addr, uint32_t slot)
+{
+	return (ip9028_td(ep_addr, slot)->total_bytes >> 10) & 0x3;
+}
+
+static void config_ep(USBD_HANDLE_T hUsb, uint8_t ep_addr, uint8_t type, uint16_t max_packet)
+{
+	USB_ENDPOINT_DESCRIPTOR ep = {sizeof(USB_ENDPOINT_DESCRIPTOR), USB_ENDPOINT_DESCRIPTOR_TYPE, ep_addr,
+								  type, max_packet, 1};
+
+	hwUSB_ConfigEP(hUsb, &ep);
+	hwUSB_EnableEP(hUsb, ep_addr);
+}
+
+static void test_multo(void)
+{
+	static const uint32_t lens[] = {0, 100, 1024, 1025, 3072}, mult[] = {1, 1, 1, 2, 3};
+	USBD_HANDLE_T hUsb;
+	uint32_t i;
+
+	CHECK_EQ(ip9028_model_init(&hUsb, NUM_EP, DEPTH), LPC_OK);
+	CHECK_EQ(mwUSB_RegisterEpHandler(hUsb, 3, ep_hdlr, (void *) ISO_IN_EP), LPC_OK);
+	CHECK_EQ(mwUSB_RegisterEpHandler(hUsb, 4, ep_hdlr, (void *) ISO_OUT_EP), LPC_OK);
+
+	/* 3 x 1024 bytes per microframe */
+	config_ep(hUsb, ISO_IN_EP, USB_ENDPOINT_TYPE_ISOCHRONOUS, 1024 | (2 << 11));
+	CHECK_EQ(ip9028_qh(ISO_IN_EP)->cap >> 30, 3);
+	CHECK_EQ((ip9028_qh(ISO_IN_EP)->cap >> 16) & 0x7FF, 1024);
+	for (i = 0; i < 5; i++) {
+		CHECK_EQ(hwUSB_WriteEP(hUsb, ISO_IN_EP, buf, lens[i]), lens[i]);
+		CHECK_EQ(multo(ISO_IN_EP, i), mult[i]);
+	}
+	CHECK_EQ(hwUSB_WriteEP(hUsb, ISO_IN_EP, buf, 3073), 0);
+	CHECK_EQ(ip9028_td(ISO_IN_EP, 5)->total_bytes & TD_STATUS_ACTIVE, 0);
+	ip9028_model_take_primes();
+	CHECK_EQ(ip9028_model_run(ISO_IN_EP, DEPTH, 0, 0), 5);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(events, 5);
+	for (i = 0; i < 5; i++) {
+		CHECK_EQ(ev_len[i], lens[i]);
+		CHECK_EQ(ev_status[i], 0);
+	}
+
+	/* no MultO on OUT, nor on bulk */
+	config_ep(hUsb, ISO_OUT_EP, USB_ENDPOINT_TYPE_ISOCHRONOUS, 200);
+	CHECK_EQ(ip9028_qh(ISO_OUT_EP)->cap >> 30, 1);
+	config_ep(hUsb, BULK_IN_EP, USB_ENDPOINT_TYPE_BULK, 512);
+	CHECK_EQ(ip9028_qh(BULK_IN_EP)->cap >> 30, 0);
+	CHECK_EQ(hwUSB_WriteEP(hUsb, BULK_IN_EP, buf, 4096), 4096);
+	CHECK_EQ(multo(BULK_IN_EP, 0), 0);
+
+	/* received length and errors of the retired OUT dTD */
+	events = 0;
+	for (i = 0; i < 3; i++) {
+		CHECK_EQ(hwUSB_ReadReqEP(hUsb, ISO_OUT_EP, &buf[i * 200], 200), 200);
+		CHECK_EQ(multo(ISO_OUT_EP, i), 0);
+	}
+	ip9028_model_take_primes();
+	CHECK_EQ(ip9028_model_run(ISO_OUT_EP, 1, 196, 0), 1);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(ip9028_model_run(ISO_OUT_EP, 1, 0, 0), 1);
+	ip9028_td(ISO_OUT_EP, 1)->total_bytes |= TD_STATUS_XACT_ERR;
+	CHECK_EQ(ip9028_model_run(ISO_OUT_EP, 1, 100, 0), 1);
+	ip9028_td(ISO_OUT_EP, 2)->total_bytes |= TD_STATUS_BUFF_ERR;
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(events, 3);
+	CHECK_EQ(ev_len[0], 196);
+	CHECK_EQ(ev_status[0], 0);
+	CHECK_EQ(ev_len[1], 0);
+	CHECK_EQ(ev_status[1], USBD_XFER_ERR_XACT);
+	CHECK_EQ(ev_len[2], 100);
+	CHECK_EQ(ev_status[2], USBD_XFER_ERR_BUFF);
+	CHECK_EQ(hwUSB_GetXferLen(hUsb, ISO_OUT_EP, 0), 100);
+}
+
+static uint32_t active_dtds(uint32_t ep_addr)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < DEPTH; i++) {
+		n += (ip9028_td(ep_addr, i)->total_bytes & TD_STATUS_ACTIVE) ? 1 : 0;
+	}
+	return n;
+}
+
+static void test_adc_ring(void)
+{
+	USB_CORE_CTRL_T *pCtrl;
+	USBD_HANDLE_T hUsb, hAdc = 0;
+	USBD_ADC_INIT_PARAM_T param;
+	USBD_ADC_STATS_T st;
+	USB_ADC_CTRL_T *adc;
+	uint32_t i, slot, fb, primes = 0;
+
+	CHECK_EQ(ip9028_model_init(&hUsb, NUM_EP, DEPTH), LPC_OK);
+	pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	pCtrl->device_speed = USB_FULL_SPEED;
+	/* the streaming endpoint stands in for the MSC one the core indexed */
+	pCtrl->desc_idx[USB_FULL_SPEED].ep[2] = (USB_ENDPOINT_DESCRIPTOR *) &adc_desc[18];
+
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) adc_mem;
+	param.mem_size = sizeof(adc_mem);
+	param.ac_intf_desc = adc_desc;
+	param.as_intf_desc = &adc_desc[9];
+	param.SampleRate = 48000;
+	param.FrameSize = 4;
+	param.FifoSize = 2048;
+	param.MaxXferSize = 200;
+	param.RingDepth = DEPTH;
+	CHECK_EQ(mwADC_init(hUsb, &param, &hAdc), LPC_OK);
+	adc = (USB_ADC_CTRL_T *) hAdc;
+
+	/* what the core does on SET_INTERFACE */
+	config_ep(hUsb, ADC_OUT_EP, USB_ENDPOINT_TYPE_ISOCHRONOUS, 200);
+	config_ep(hUsb, ADC_FB_EP, USB_ENDPOINT_TYPE_ISOCHRONOUS, 3);
+	mwADC_SetActive(adc, 1);
+
+	/* the whole pool queued and linked in order */
+	CHECK_EQ(active_dtds(ADC_OUT_EP), DEPTH);
+	for (i = 0; i + 1 < DEPTH; i++) {
+		CHECK_EQ(ip9028_td(ADC_OUT_EP, i)->next_dTD, (uint32_t) ip9028_td(ADC_OUT_EP, i + 1));
+	}
+	CHECK_EQ(ip9028_td(ADC_OUT_EP, DEPTH - 1)->next_dTD, TD_NEXT_TERMINATE);
+	/* first feedback, 49.0 in 10.14 for the empty FIFO, one packet */
+	CHECK_EQ((ip9028_td(ADC_FB_EP, 0)->total_bytes >> 16) & 0x7FFF, 3);
+	CHECK_EQ(multo(ADC_FB_EP, 0), 1);
+	memcpy(&fb, (void *) ip9028_td(ADC_FB_EP, 0)->buffer0, 4);
+	CHECK_EQ(fb & 0xFFFFFF, 49 << 14);
+	/* ENDPTPRIME is write-1-to-set; in the model the feedback prime
+	   overwrote the one of the ring */
+	CHECK_EQ(ip9028_regs.endptprime, _BIT(ip9028_bit(ADC_FB_EP)));
+	ip9028_regs.endptprime |= _BIT(ip9028_bit(ADC_OUT_EP));
+	ip9028_model_take_primes();
+
+	/* three frames per interrupt, the codec taking what arrived: every
+	   slot is queued again behind the others while the endpoint runs */
+	for (i = 0; i < 100; i++) {
+		slot = (3 * i) % DEPTH;
+		CHECK_EQ(ip9028_model_run(ADC_OUT_EP, 3, ADC_PACKET, 0), 3);
+		if (i == 50) {
+			ip9028_td(ADC_OUT_EP, (slot + 1) % DEPTH)->total_bytes |= TD_STATUS_XACT_ERR;
+		}
+		ip9028_model_isr(hUsb, 0);
+		primes += (ip9028_regs.endptprime != 0);
+		CHECK_EQ(active_dtds(ADC_OUT_EP), DEPTH);
+		if (i >= 2) {
+			mwADC_ReadSamples(adc, pcm, 3 * ADC_PACKET);
+		}
+	}
+	CHECK_EQ(primes, 0);
+	mwADC_GetStats(adc, &st, 0);
+	CHECK_EQ(st.packets, 300);
+	CHECK_EQ(st.errors, 1);
+	CHECK_EQ(st.overruns, 0);
+	CHECK_EQ(st.underruns, 0);
+	CHECK_EQ(st.level, 2 * 3 * 48 - 48);
+
+	/* feedback retired, the next one queued */
+	CHECK_EQ(ip9028_model_run(ADC_FB_EP, 1, 0, 0), 1);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(ip9028_td(ADC_FB_EP, 1)->total_bytes & TD_STATUS_ACTIVE, TD_STATUS_ACTIVE);
+	CHECK_EQ(multo(ADC_FB_EP, 1), 1);
+}
+
+int main(void)
+{
+	test_multo();
+	test_adc_ring();
+	return TEST_DONE();
+}
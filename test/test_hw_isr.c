@@ -0,0 +1,127 @@
+/*
+ * IP9028 ISR dispatch by bit scan (user-005).
+ *
+ * Every endpoint with a completion or NAK bit gets exactly its own events,
+ * one per retired dTD, and bits of endpoints above max_num_ep or with the
+ * NAK interrupt disabled are ignored.
+ */
+#include <string.h>
+#include "ip9028_model.h"
+#include "test_util.h"
+
+#define NUM_EP      4
+
+static uint8_t buf[512];
+/* events seen per endpoint index */
+static uint32_t ev_in[2 * NUM_EP], ev_out[2 * NUM_EP], ev_nak[2 * NUM_EP];
+
+static ErrorCode_t ep_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	uint32_t indx = (uint32_t) (uintptr_t) data;
+
+	switch (event) {
+	case USB_EVT_IN:
+		ev_in[indx]++;
+		break;
+
+	case USB_EVT_OUT:
+		ev_out[indx]++;
+		break;
+
+	case USB_EVT_OUT_NAK:
+	case USB_EVT_IN_NAK:
+		ev_nak[indx]++;
+		break;
+
+	default:
+		break;
+	}
+	return LPC_OK;
+}
+
+static void clear_events(void)
+{
+	memset(ev_in, 0, sizeof(ev_in));
+	memset(ev_out, 0, sizeof(ev_out));
+	memset(ev_nak, 0, sizeof(ev_nak));
+}
+
+int main(void)
+{
+	USBD_HANDLE_T hUsb;
+	USB_ENDPOINT_DESCRIPTOR ep = {sizeof(USB_ENDPOINT_DESCRIPTOR), USB_ENDPOINT_DESCRIPTOR_TYPE, 0,
+								  USB_ENDPOINT_TYPE_BULK, 512, 0};
+	uint32_t i, addr;
+
+	CHECK_EQ(ip9028_model_init(&hUsb, NUM_EP, 4), LPC_OK);
+	for (i = 2; i < 2 * NUM_EP; i++) {
+		addr = (i >> 1) | ((i & 1) ? 0x80 : 0);
+		ep.bEndpointAddress = addr;
+		hwUSB_ConfigEP(hUsb, &ep);
+		hwUSB_EnableEP(hUsb, addr);
+		CHECK_EQ(mwUSB_RegisterEpHandler(hUsb, i, ep_hdlr, (void *) (uintptr_t) i), LPC_OK);
+	}
+
+	/* EP1 IN and EP3 OUT complete in the same interrupt, EP3 OUT with
+	   three dTDs retired by one completion bit */
+	hwUSB_WriteEP(hUsb, 0x81, buf, 64);
+	ip9028_model_take_primes();
+	hwUSB_ReadReqEP(hUsb, 0x03, buf, 64);
+	hwUSB_ReadReqEP(hUsb, 0x03, buf, 64);
+	hwUSB_ReadReqEP(hUsb, 0x03, buf, 64);
+	ip9028_model_take_primes();
+	CHECK_EQ(ip9028_model_run(0x81, 8, 0, 0), 1);
+	CHECK_EQ(ip9028_model_run(0x03, 8, 64, 0), 3);
+	CHECK_EQ(ip9028_regs.endptcomplete, _BIT(17) | _BIT(3));
+	ip9028_model_isr(hUsb, 0);
+	for (i = 2; i < 2 * NUM_EP; i++) {
+		CHECK_EQ(ev_in[i], (i == 3) ? 1 : 0);
+		CHECK_EQ(ev_out[i], (i == 6) ? 3 : 0);
+		CHECK_EQ(ev_nak[i], 0);
+	}
+
+	/* completion bits of endpoints the stack was not built for */
+	clear_events();
+	ip9028_regs.endptcomplete = _BIT(NUM_EP) | _BIT(16 + NUM_EP) | _BIT(31);
+	ip9028_model_isr(hUsb, 0);
+	for (i = 0; i < 2 * NUM_EP; i++) {
+		CHECK_EQ(ev_in[i] + ev_out[i] + ev_nak[i], 0);
+	}
+
+	/* NAKs: only OUT endpoints enabled by hwUSB_EnableEP report them */
+	clear_events();
+	ip9028_regs.endptnak = _BIT(1) | _BIT(2) | _BIT(17) | _BIT(NUM_EP);
+	ip9028_model_isr(hUsb, USBSTS_NAKI);
+	CHECK_EQ(ev_nak[2], 1);
+	CHECK_EQ(ev_nak[4], 1);
+	CHECK_EQ(ev_nak[3], 0);
+	CHECK_EQ(ev_nak[6], 0);
+	/* disabled NAK interrupt */
+	clear_events();
+	ip9028_regs.endptnaken &= ~_BIT(2);
+	ip9028_regs.endptnak = _BIT(1) | _BIT(2);
+	ip9028_model_isr(hUsb, USBSTS_NAKI);
+	CHECK_EQ(ev_nak[2], 1);
+	CHECK_EQ(ev_nak[4], 0);
+
+	/* all endpoints at once */
+	clear_events();
+	for (i = 2; i < 2 * NUM_EP; i++) {
+		addr = (i >> 1) | ((i & 1) ? 0x80 : 0);
+		if (addr & 0x80) {
+			hwUSB_WriteEP(hUsb, addr, buf, 32);
+		}
+		else {
+			hwUSB_ReadReqEP(hUsb, addr, buf, 32);
+		}
+		ip9028_model_take_primes();
+		ip9028_model_run(addr, 8, 32, 0);
+	}
+	ip9028_model_isr(hUsb, 0);
+	for (i = 2; i < 2 * NUM_EP; i++) {
+		CHECK_EQ(ev_in[i], (i & 1) ? 1 : 0);
+		CHECK_EQ(ev_out[i], (i & 1) ? 0 : 1);
+	}
+
+	return TEST_DONE();
+}
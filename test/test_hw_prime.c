@@ -0,0 +1,96 @@
+/*
+ * IP9028 non-blocking endpoint priming (user-004).
+ *
+ * Built with USB_HW_ASYNC_PRIME set: hwUSB_WriteEP must return with the
+ * prime still pending, transfers queued behind a pending prime must be
+ * picked up by it, and a queue the controller stopped short of (a prime
+ * that did not take, or a link made after the controller read the
+ * terminate bit) must be re-primed from its oldest active dTD.
+ */
+#include <string.h>
+#include "ip9028_model.h"
+#include "test_util.h"
+
+#define EP_IN   0x81
+
+static uint8_t buf[4][512];
+static uint32_t in_events;
+static uint32_t in_len[16];
+
+static ErrorCode_t ep_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	if ((event == USB_EVT_IN) && (in_events < 16)) {
+		in_len[in_events++] = hwUSB_GetXferLen(hUsb, EP_IN, 0);
+	}
+	return LPC_OK;
+}
+
+int main(void)
+{
+	USBD_HANDLE_T hUsb;
+	USB_ENDPOINT_DESCRIPTOR ep = {sizeof(USB_ENDPOINT_DESCRIPTOR), USB_ENDPOINT_DESCRIPTOR_TYPE, EP_IN,
+								  USB_ENDPOINT_TYPE_BULK, 512, 0};
+	uint32_t bit = _BIT(ip9028_bit(EP_IN));
+
+	CHECK_EQ(ip9028_model_init(&hUsb, 2, 4), LPC_OK);
+	hwUSB_ConfigEP(hUsb, &ep);
+	hwUSB_EnableEP(hUsb, EP_IN);
+	CHECK_EQ(mwUSB_RegisterEpHandler(hUsb, 3, ep_in_hdlr, 0), LPC_OK);
+
+	/* returns with the prime pending, nothing spins on ENDPTPRIME */
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[0], 100), 100);
+	CHECK(ip9028_regs.endptprime & bit);
+	CHECK_EQ(ip9028_qh(EP_IN)->next_dTD, (uint32_t) ip9028_td(EP_IN, 0));
+	/* queued behind the pending prime: linked, no second prime needed */
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[1], 200), 200);
+	CHECK_EQ(ip9028_td(EP_IN, 0)->next_dTD, (uint32_t) ip9028_td(EP_IN, 1));
+	CHECK_EQ(ip9028_model_take_primes(), bit);
+	CHECK_EQ(ip9028_model_run(EP_IN, 8, 0, 0), 2);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(in_events, 2);
+	CHECK_EQ(in_len[0], 100);
+	CHECK_EQ(in_len[1], 200);
+
+	/* link made too late: the controller retires the first dTD and stops;
+	   the completion handling must re-prime the second */
+	in_events = 0;
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[2], 300), 300);
+	ip9028_model_take_primes();
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[3], 400), 400);
+	CHECK_EQ(ip9028_regs.endptprime & bit, 0);
+	CHECK_EQ(ip9028_model_run(EP_IN, 1, 0, 1), 1);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(in_events, 1);
+	CHECK_EQ(in_len[0], 300);
+	CHECK(ip9028_regs.endptprime & bit);
+	CHECK_EQ(ip9028_qh(EP_IN)->next_dTD, (uint32_t) ip9028_td(EP_IN, 3));
+	ip9028_model_take_primes();
+	CHECK_EQ(ip9028_model_run(EP_IN, 8, 0, 0), 1);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(in_events, 2);
+	CHECK_EQ(in_len[1], 400);
+
+	/* a prime that did not take: the next WriteEP restarts the queue from
+	   the oldest active dTD rather than from the new one */
+	in_events = 0;
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[0], 10), 10);
+	ip9028_model_drop_prime(EP_IN);
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[1], 20), 20);
+	CHECK(ip9028_regs.endptprime & bit);
+	CHECK_EQ(ip9028_qh(EP_IN)->next_dTD, (uint32_t) ip9028_td(EP_IN, 0));
+	ip9028_model_take_primes();
+	CHECK_EQ(ip9028_model_run(EP_IN, 8, 0, 0), 2);
+	ip9028_model_isr(hUsb, 0);
+	CHECK_EQ(in_events, 2);
+	CHECK_EQ(in_len[0], 10);
+	CHECK_EQ(in_len[1], 20);
+
+	/* all dTDs of the endpoint in use */
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[0], 1), 1);
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[1], 1), 1);
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[2], 1), 1);
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[3], 1), 1);
+	CHECK_EQ(hwUSB_WriteEP(hUsb, EP_IN, buf[0], 1), 0);
+
+	return TEST_DONE();
+}
@@ -0,0 +1,472 @@
+/*
+ * MSC write-back block cache (user-009).
+ *
+ * Drives mw_usbd_msccache.c against a RAM backend and a reference copy of
+ * the medium: unit cases for run merging, LRU eviction, the bypass of whole
+ * lines, packet by packet block assembly and backend failures, then replays
+ * the write patterns of a FAT32 and an exFAT file copy, in whole blocks and
+ * in full speed packets, checking the backend against the reference after
+ * every flush and the data read through the cache at every step.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mw_usbd_msccache.h"
+#include "test_util.h"
+
+#define BLOCK_SIZE          512
+#define DISK_BLOCKS         8192
+#define FS_PACKET           64
+
+static uint8_t disk[DISK_BLOCKS * BLOCK_SIZE];
+static uint8_t ref[DISK_BLOCKS * BLOCK_SIZE];
+static uint8_t buf[64 * BLOCK_SIZE];
+static uint8_t rd[64 * BLOCK_SIZE];
+static uint32_t cache_mem[160 * 1024 / sizeof(uint32_t)];
+
+/* backend call log */
+static uint32_t be_reads, be_read_blocks, be_writes, be_write_blocks;
+static uint64_t be_last_lba;
+static uint32_t be_last_cnt;
+static uint32_t be_fail_write, be_fail_read;
+
+static ErrorCode_t be_read(uint64_t lba, uint8_t *dst, uint32_t cnt)
+{
+	be_reads++;
+	be_read_blocks += cnt;
+	if (be_fail_read || ((lba + cnt) > DISK_BLOCKS)) {
+		return ERR_FAILED;
+	}
+	memcpy(dst, &disk[lba * BLOCK_SIZE], cnt * BLOCK_SIZE);
+	return LPC_OK;
+}
+
+static ErrorCode_t be_write(uint64_t lba, const uint8_t *src, uint32_t cnt)
+{
+	be_writes++;
+	be_write_blocks += cnt;
+	be_last_lba = lba;
+	be_last_cnt = cnt;
+	if (be_fail_write || ((lba + cnt) > DISK_BLOCKS)) {
+		return ERR_FAILED;
+	}
+	memcpy(&disk[lba * BLOCK_SIZE], src, cnt * BLOCK_SIZE);
+	return LPC_OK;
+}
+
+static void be_clear(void)
+{
+	be_reads = be_read_blocks = be_writes = be_write_blocks = 0;
+}
+
+static USB_MSC_CACHE_T *cache_init(uint32_t line_blocks, uint32_t sets, uint32_t ways)
+{
+	USBD_MSC_CACHE_INIT_PARAM_T param;
+	USB_MSC_CACHE_T *hCache = 0;
+	uint32_t i;
+
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) cache_mem;
+	param.mem_size = sizeof(cache_mem);
+	param.BlockSize = BLOCK_SIZE;
+	param.LineBlocks = line_blocks;
+	param.NumSets = sets;
+	param.NumWays = ways;
+	param.ReadBlocks = be_read;
+	param.WriteBlocks = be_write;
+	CHECK_EQ(mwMSC_CacheInit(&hCache, &param), LPC_OK);
+	CHECK_EQ(sizeof(cache_mem) - param.mem_size, mwMSC_CacheGetMemSize(&param));
+
+	for (i = 0; i < sizeof(disk); i++) {
+		disk[i] = (uint8_t) (i * 7 + (i >> 9));
+	}
+	memcpy(ref, disk, sizeof(disk));
+	be_clear();
+	return hCache;
+}
+
+/* write through the cache and the reference, in pieces of at most packet bytes */
+static void cache_write(USB_MSC_CACHE_T *hCache, uint64_t offset, uint32_t len, uint32_t packet)
+{
+	uint32_t i, n;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = (uint8_t) rand();
+	}
+	memcpy(&ref[offset], buf, len);
+	for (i = 0; i < len; i += n) {
+		n = ((len - i) < packet) ? (len - i) : packet;
+		CHECK_EQ(mwMSC_CacheWrite(hCache, offset + i, &buf[i], n), LPC_OK);
+	}
+}
+
+static void check_read(USB_MSC_CACHE_T *hCache, uint64_t lba, uint32_t cnt)
+{
+	CHECK_EQ(mwMSC_CacheRead(hCache, lba * BLOCK_SIZE, rd, cnt * BLOCK_SIZE), LPC_OK);
+	CHECK(memcmp(rd, &ref[lba * BLOCK_SIZE], cnt * BLOCK_SIZE) == 0);
+}
+
+static uint32_t dirty(USB_MSC_CACHE_T *hCache)
+{
+	USBD_MSC_CACHE_STATS_T stats;
+
+	mwMSC_CacheGetStats(hCache, &stats, 0);
+	return stats.dirty;
+}
+
+static void check_flush(USB_MSC_CACHE_T *hCache)
+{
+	CHECK_EQ(mwMSC_CacheFlush(hCache), LPC_OK);
+	CHECK_EQ(dirty(hCache), 0);
+	CHECK(memcmp(disk, ref, sizeof(disk)) == 0);
+}
+
+static void test_init_params(void)
+{
+	USBD_MSC_CACHE_INIT_PARAM_T param;
+	USB_MSC_CACHE_T *hCache = 0;
+
+	memset(&param, 0, sizeof(param));
+	param.mem_base = (uint32_t) cache_mem;
+	param.mem_size = sizeof(cache_mem);
+	param.BlockSize = BLOCK_SIZE;
+	param.LineBlocks = USB_MSC_CACHE_MAX_LINE_BLOCKS + 1;
+	param.NumSets = 1;
+	param.NumWays = 1;
+	param.ReadBlocks = be_read;
+	param.WriteBlocks = be_write;
+	CHECK_EQ(mwMSC_CacheInit(&hCache, &param), ERR_API_INVALID_PARAM2);
+	param.LineBlocks = 8;
+	param.WriteBlocks = 0;
+	CHECK_EQ(mwMSC_CacheInit(&hCache, &param), ERR_API_INVALID_PARAM2);
+	param.WriteBlocks = be_write;
+	param.mem_size = mwMSC_CacheGetMemSize(&param) - 4;
+	CHECK_EQ(mwMSC_CacheInit(&hCache, &param), ERR_USBD_BAD_MEM_BUF);
+	param.mem_base += 2;
+	param.mem_size = sizeof(cache_mem) - 4;
+	CHECK_EQ(mwMSC_CacheInit(&hCache, &param), ERR_USBD_BAD_MEM_BUF);
+}
+
+/* single block writes in any order leave as one backend write per run */
+static void test_merge_runs(void)
+{
+	USB_MSC_CACHE_T *hCache = cache_init(8, 2, 2);
+	static const uint8_t order[] = {3, 0, 7, 1, 2, 6, 4, 5};
+	uint32_t i;
+
+	for (i = 0; i < sizeof(order); i++) {
+		cache_write(hCache, (64 + order[i]) * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	}
+	/* a second run in the same line, with a gap */
+	cache_write(hCache, 74 * BLOCK_SIZE, 2 * BLOCK_SIZE, BLOCK_SIZE);
+	cache_write(hCache, 77 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	CHECK_EQ(be_writes, 0);
+	CHECK_EQ(be_reads, 0);
+	CHECK_EQ(dirty(hCache), 11);
+	check_read(hCache, 64, 16);
+
+	check_flush(hCache);
+	CHECK_EQ(be_writes, 3);
+	CHECK_EQ(be_write_blocks, 11);
+	/* ascending order: the last run written is the highest */
+	CHECK_EQ(be_last_lba, 77);
+	CHECK_EQ(be_last_cnt, 1);
+}
+
+/* a set holds NumWays lines; the least recently used one is written back */
+static void test_eviction(void)
+{
+	USB_MSC_CACHE_T *hCache = cache_init(8, 2, 2);
+	USBD_MSC_CACHE_STATS_T stats;
+
+	/* lines 0, 2 and 4 share set 0 */
+	cache_write(hCache, 0 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	cache_write(hCache, 16 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	/* touching line 0 makes line 2 the victim */
+	cache_write(hCache, 1 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	CHECK_EQ(be_writes, 0);
+	cache_write(hCache, 32 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	CHECK_EQ(be_writes, 1);
+	CHECK_EQ(be_last_lba, 16);
+	CHECK_EQ(be_last_cnt, 1);
+	CHECK(memcmp(&disk[16 * BLOCK_SIZE], &ref[16 * BLOCK_SIZE], BLOCK_SIZE) == 0);
+
+	mwMSC_CacheGetStats(hCache, &stats, 1);
+	CHECK_EQ(stats.evictions, 1);
+	CHECK_EQ(stats.writebacks, 1);
+	CHECK_EQ(stats.wb_blocks, 1);
+	CHECK_EQ(stats.dirty, 3);
+	CHECK_EQ(stats.wr_hits, 1);
+	mwMSC_CacheGetStats(hCache, &stats, 0);
+	CHECK_EQ(stats.evictions, 0);
+	CHECK_EQ(stats.dirty, 3);
+
+	/* dirty blocks are read from the cache, the rest from the backend */
+	be_clear();
+	check_read(hCache, 0, 40);
+	mwMSC_CacheGetStats(hCache, &stats, 0);
+	CHECK_EQ(stats.rd_hits, 3);
+	CHECK_EQ(be_reads, 2);
+	check_flush(hCache);
+}
+
+/* whole uncached lines go to the backend in one call */
+static void test_bypass(void)
+{
+	USB_MSC_CACHE_T *hCache = cache_init(8, 2, 2);
+	USBD_MSC_CACHE_STATS_T stats;
+
+	cache_write(hCache, 256 * BLOCK_SIZE, 32 * BLOCK_SIZE, 32 * BLOCK_SIZE);
+	CHECK_EQ(be_writes, 1);
+	CHECK_EQ(be_last_cnt, 32);
+	CHECK_EQ(dirty(hCache), 0);
+
+	/* a cached line in the middle splits the run */
+	be_clear();
+	cache_write(hCache, 520 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	cache_write(hCache, 512 * BLOCK_SIZE, 24 * BLOCK_SIZE, 24 * BLOCK_SIZE);
+	CHECK_EQ(be_writes, 2);
+	mwMSC_CacheGetStats(hCache, &stats, 0);
+	CHECK_EQ(stats.wr_bypass, 48);
+	CHECK_EQ(dirty(hCache), 8);
+	check_read(hCache, 512, 24);
+	check_flush(hCache);
+}
+
+/* a block written packet by packet is not read from the backend */
+static void test_packets(void)
+{
+	USB_MSC_CACHE_T *hCache = cache_init(8, 2, 2);
+
+	cache_write(hCache, 100 * BLOCK_SIZE, 3 * BLOCK_SIZE, FS_PACKET);
+	CHECK_EQ(be_reads, 0);
+	CHECK_EQ(dirty(hCache), 3);
+
+	/* a partial block, read before the rest arrives, is merged */
+	cache_write(hCache, 200 * BLOCK_SIZE, 3 * FS_PACKET, FS_PACKET);
+	CHECK_EQ(be_reads, 0);
+	check_read(hCache, 200, 1);
+	CHECK_EQ(be_reads, 1);
+
+	/* a write inside a block not cached reads the block first */
+	be_clear();
+	cache_write(hCache, 300 * BLOCK_SIZE + 100, 20, FS_PACKET);
+	CHECK_EQ(be_reads, 1);
+	check_read(hCache, 300, 1);
+	check_flush(hCache);
+}
+
+/* a failed write-back keeps the blocks dirty for the next flush */
+static void test_backend_errors(void)
+{
+	USB_MSC_CACHE_T *hCache = cache_init(8, 2, 2);
+
+	cache_write(hCache, 8 * BLOCK_SIZE, 2 * BLOCK_SIZE, BLOCK_SIZE);
+	be_fail_write = 1;
+	CHECK_EQ(mwMSC_CacheFlush(hCache), ERR_FAILED);
+	CHECK_EQ(dirty(hCache), 2);
+	/* an eviction that cannot write back fails the write */
+	cache_write(hCache, 40 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+	memcpy(&ref[72 * BLOCK_SIZE], &disk[72 * BLOCK_SIZE], BLOCK_SIZE);
+	memset(buf, 0xA5, BLOCK_SIZE);
+	CHECK_EQ(mwMSC_CacheWrite(hCache, 72 * BLOCK_SIZE, buf, BLOCK_SIZE), ERR_FAILED);
+	be_fail_write = 0;
+	check_read(hCache, 8, 2);
+	check_flush(hCache);
+
+	be_fail_read = 1;
+	CHECK_EQ(mwMSC_CacheRead(hCache, 1000 * BLOCK_SIZE, rd, BLOCK_SIZE), ERR_FAILED);
+	be_fail_read = 0;
+}
+
+/*
+ * File system replays. The write sequences follow what a host file system
+ * does when a directory of files is copied to the volume: allocation
+ * structures and directory blocks are rewritten for every file, file data
+ * is written in large sequential requests.
+ */
+typedef struct {
+	uint32_t requests;		/* WRITE commands the host issued */
+	uint32_t meta_writes;	/* of which single block metadata updates */
+	uint32_t data_blocks;
+	uint32_t check_reads;	/* backend reads done by check_read() */
+} REPLAY_T;
+
+static void replay_check(USB_MSC_CACHE_T *hCache, REPLAY_T *r, uint32_t lba, uint32_t cnt)
+{
+	uint32_t reads = be_reads;
+
+	check_read(hCache, lba, cnt);
+	r->check_reads += be_reads - reads;
+}
+
+static void meta_write(USB_MSC_CACHE_T *hCache, REPLAY_T *r, uint32_t lba, uint32_t packet)
+{
+	cache_write(hCache, (uint64_t) lba * BLOCK_SIZE, BLOCK_SIZE, (packet == 0) ? BLOCK_SIZE : packet);
+	r->requests++;
+	r->meta_writes++;
+}
+
+static void data_write(USB_MSC_CACHE_T *hCache, REPLAY_T *r, uint32_t lba, uint32_t blocks, uint32_t packet)
+{
+	uint32_t n;
+
+	/* the host splits files in 64 block requests */
+	while (blocks) {
+		n = (blocks > 64) ? 64 : blocks;
+		cache_write(hCache, (uint64_t) lba * BLOCK_SIZE, n * BLOCK_SIZE, (packet == 0) ? n * BLOCK_SIZE : packet);
+		r->requests++;
+		r->data_blocks += n;
+		lba += n;
+		blocks -= n;
+	}
+}
+
+/* FAT32: 32 reserved blocks with FSInfo at 1, two FATs of 64 blocks,
+   4KB clusters from block 160, root directory in cluster 2 */
+#define FAT32_FSINFO        1
+#define FAT32_FAT1          32
+#define FAT32_FAT2          96
+#define FAT32_DATA          160
+#define FAT32_CLUSTER       8
+
+static void replay_fat32(USB_MSC_CACHE_T *hCache, REPLAY_T *r, uint32_t packet)
+{
+	uint32_t file, size, cluster = 3, dir_entry = 0;
+
+	memset(r, 0, sizeof(*r));
+	for (file = 0; file < 40; file++) {
+		size = 1 + (rand() % 24);
+		/* directory entry, then the cluster chain in both FATs */
+		meta_write(hCache, r, FAT32_DATA + (dir_entry * 32) / BLOCK_SIZE, packet);
+		meta_write(hCache, r, FAT32_FAT1 + (cluster * 4) / BLOCK_SIZE, packet);
+		meta_write(hCache, r, FAT32_FAT2 + (cluster * 4) / BLOCK_SIZE, packet);
+		data_write(hCache, r, FAT32_DATA + (cluster - 2) * FAT32_CLUSTER, size * FAT32_CLUSTER, packet);
+		/* size and time stamps, free cluster count */
+		meta_write(hCache, r, FAT32_DATA + (dir_entry * 32) / BLOCK_SIZE, packet);
+		meta_write(hCache, r, FAT32_FSINFO, packet);
+		cluster += size;
+		dir_entry += 3;
+
+		if ((file % 8) == 7) {
+			replay_check(hCache, r, 0, 64);
+			replay_check(hCache, r, FAT32_DATA, 64);
+		}
+	}
+}
+
+/* exFAT: boot region with the VolumeFlags at 0, FAT at 128, 32KB clusters
+   from block 256 with the allocation bitmap in cluster 2 and the root
+   directory in cluster 4; contiguous files do not use the FAT */
+#define EXFAT_BOOT          0
+#define EXFAT_FAT           128
+#define EXFAT_HEAP          256
+#define EXFAT_CLUSTER       64
+
+static void replay_exfat(USB_MSC_CACHE_T *hCache, REPLAY_T *r, uint32_t packet)
+{
+	uint32_t file, size, cluster = 5, dir_entry = 0;
+
+	memset(r, 0, sizeof(*r));
+	/* VolumeDirty set for the duration of the copy */
+	meta_write(hCache, r, EXFAT_BOOT, packet);
+	for (file = 0; file < 20; file++) {
+		size = 1 + (rand() % 3);
+		meta_write(hCache, r, EXFAT_HEAP + (4 - 2) * EXFAT_CLUSTER + (dir_entry * 32) / BLOCK_SIZE, packet);
+		meta_write(hCache, r, EXFAT_HEAP + (cluster / 8) / BLOCK_SIZE, packet);
+		data_write(hCache, r, EXFAT_HEAP + (cluster - 2) * EXFAT_CLUSTER, size * EXFAT_CLUSTER, packet);
+		meta_write(hCache, r, EXFAT_HEAP + (4 - 2) * EXFAT_CLUSTER + (dir_entry * 32) / BLOCK_SIZE, packet);
+		if (file == 10) {
+			/* a fragmented file gets a chain in the FAT */
+			meta_write(hCache, r, EXFAT_FAT + (cluster * 4) / BLOCK_SIZE, packet);
+		}
+		cluster += size;
+		dir_entry += 3;
+	}
+	meta_write(hCache, r, EXFAT_BOOT, packet);
+	replay_check(hCache, r, EXFAT_HEAP, 64);
+}
+
+static void test_replay(const char *name, void (*replay)(USB_MSC_CACHE_T *, REPLAY_T *, uint32_t), uint32_t packet)
+{
+	/* the SD card geometry, and one with room for the whole metadata */
+	static const uint32_t geometry[][2] = {{2, 2}, {8, 4}};
+	USB_MSC_CACHE_T *hCache;
+	USBD_MSC_CACHE_STATS_T stats;
+	REPLAY_T r;
+	uint32_t g;
+
+	for (g = 0; g < 2; g++) {
+		hCache = cache_init(8, geometry[g][0], geometry[g][1]);
+		srand(9);
+		replay(hCache, &r, packet);
+		check_flush(hCache);
+		mwMSC_CacheGetStats(hCache, &stats, 0);
+
+		/* rewritten metadata blocks reach the backend fewer times than
+		   the host wrote them */
+		CHECK(be_write_blocks < (r.meta_writes + r.data_blocks));
+		/* whole blocks never need a read-modify-write, packets included */
+		CHECK_EQ(be_reads, r.check_reads);
+		if (packet == 0) {
+			/* data in lines of its own bypasses the cache with its request size */
+			CHECK(stats.wr_bypass > 0);
+			CHECK(be_writes < r.requests);
+		}
+		else {
+			/* packets are collected into at least whole lines */
+			CHECK(be_writes <= (r.meta_writes + r.data_blocks / 8));
+		}
+		printf("%s, %s, %ux%u lines: host %u writes (%u metadata, %u data blocks), "
+			   "backend %u writes of %u blocks, %u evictions\n",
+			   name, packet ? "64 byte packets" : "whole requests", geometry[g][0], geometry[g][1], r.requests,
+			   r.meta_writes, r.data_blocks, be_writes, be_write_blocks, stats.evictions);
+	}
+}
+
+/* random packet writes, reads and flushes against the reference */
+static void test_random(void)
+{
+	USB_MSC_CACHE_T *hCache = cache_init(4, 4, 2);
+	uint32_t i, lba, len, packet;
+
+	srand(10);
+	for (i = 0; i < 20000; i++) {
+		lba = rand() % 256;
+		switch (rand() % 8) {
+		case 0:
+			check_read(hCache, lba, 1 + (rand() % 32));
+			break;
+
+		case 1:
+			if ((rand() % 16) == 0) {
+				check_flush(hCache);
+			}
+			break;
+
+		default:
+			len = 1 + (rand() % (16 * BLOCK_SIZE));
+			packet = ((rand() % 2) == 0) ? FS_PACKET : BLOCK_SIZE;
+			/* MSC_Write offsets start on a block, later packets follow */
+			cache_write(hCache, (uint64_t) lba * BLOCK_SIZE + (((rand() % 8) == 0) ? (rand() % BLOCK_SIZE) : 0),
+						len, packet);
+			break;
+		}
+	}
+	check_flush(hCache);
+}
+
+int main(void)
+{
+	test_init_params();
+	test_merge_runs();
+	test_eviction();
+	test_bypass();
+	test_packets();
+	test_backend_errors();
+	test_replay("FAT32", replay_fat32, 0);
+	test_replay("FAT32", replay_fat32, FS_PACKET);
+	test_replay("exFAT", replay_exfat, 0);
+	test_replay("exFAT", replay_exfat, FS_PACKET);
+	test_random();
+	return TEST_DONE();
+}
@@ -0,0 +1,253 @@
+/*
+ * MSC 16 byte CDBs and 64 bit LBAs (user-013).
+ *
+ * A 6 TiB unit with 512 byte blocks, more than 2^32 blocks, backed by a
+ * sparse store: blocks never written read back as their own LBA. READ(16),
+ * WRITE(16) and READ CAPACITY(16) must reach every block with the right
+ * 64 bit byte offset, READ CAPACITY(10) must send the host to the 16 byte
+ * commands, and out of range requests must fail instead of wrapping. A
+ * second unit without a medium must report NOT READY to READ CAPACITY.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define BLOCK_SIZE          512
+#define BIG_BLOCKS          0x300000000ULL
+#define SPARSE_SLOTS        64
+
+typedef struct {
+	uint64_t lba;
+	uint8_t used;
+	uint8_t data[BLOCK_SIZE];
+} SPARSE_BLOCK_T;
+
+static SPARSE_BLOCK_T sparse[SPARSE_SLOTS];
+static uint8_t host_buf[8 * BLOCK_SIZE], data_buf[8 * BLOCK_SIZE];
+static uint64_t first_offset, next_offset;
+static uint32_t bad_offsets;
+
+static SPARSE_BLOCK_T *sparse_find(uint64_t lba, uint8_t alloc)
+{
+	uint32_t i;
+
+	for (i = 0; i < SPARSE_SLOTS; i++) {
+		if (sparse[i].used && (sparse[i].lba == lba)) {
+			return &sparse[i];
+		}
+	}
+	for (i = 0; alloc && (i < SPARSE_SLOTS); i++) {
+		if (sparse[i].used == 0) {
+			sparse[i].used = 1;
+			sparse[i].lba = lba;
+			return &sparse[i];
+		}
+	}
+	return 0;
+}
+
+static void block_pattern(uint64_t lba, uint8_t *buf)
+{
+	memset(buf, 0, BLOCK_SIZE);
+	msc_put_be(buf, lba, 8);
+}
+
+/* the chunks of one command must continue where the previous one ended */
+static uint64_t track_offset(uint32_t offset, uint32_t length, uint32_t high_offset)
+{
+	uint64_t off = ((uint64_t) high_offset << 32) | offset;
+
+	if (next_offset == ~0ULL) {
+		first_offset = off;
+	}
+	else if (off != next_offset) {
+		bad_offsets++;
+	}
+	next_offset = off + length;
+	return off;
+}
+
+static void big_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	uint64_t lba = track_offset(offset, length, high_offset) / BLOCK_SIZE;
+	SPARSE_BLOCK_T *blk;
+	uint32_t i;
+
+	for (i = 0; i < length / BLOCK_SIZE; i++) {
+		blk = sparse_find(lba + i, 0);
+		if (blk) {
+			memcpy(*buff_adr + i * BLOCK_SIZE, blk->data, BLOCK_SIZE);
+		}
+		else {
+			block_pattern(lba + i, *buff_adr + i * BLOCK_SIZE);
+		}
+	}
+}
+
+static void big_write(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	uint64_t lba = track_offset(offset, length, high_offset) / BLOCK_SIZE;
+	SPARSE_BLOCK_T *blk;
+	uint32_t i;
+
+	for (i = 0; i < length / BLOCK_SIZE; i++) {
+		blk = sparse_find(lba + i, 1);
+		if (blk) {
+			memcpy(blk->data, *buff_adr + i * BLOCK_SIZE, BLOCK_SIZE);
+		}
+	}
+}
+
+static ErrorCode_t big_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return LPC_OK;
+}
+
+static void init_msc(void)
+{
+	static USBD_MSC_LUN_PARAM_T luns[2];
+	USBD_MSC_INIT_PARAM_T param;
+
+	memset(luns, 0, sizeof(luns));
+	luns[0].InquiryStr = (uint8_t *) "NXP     BIGDISK         1.0 ";
+	luns[0].BlockSize = BLOCK_SIZE;
+	luns[0].BlockCount = 0xFFFFFFFF;
+	luns[0].MemorySize = BIG_BLOCKS * BLOCK_SIZE;
+	/* small transfers, so a command is split across the 2^32 block line */
+	luns[0].XferBufSize = BLOCK_SIZE;
+	luns[0].XferBufCnt = 2;
+	luns[0].RxWindow = BLOCK_SIZE;
+	luns[0].MSC_Read = big_read;
+	luns[0].MSC_Write = big_write;
+	luns[0].MSC_Verify = big_verify;
+	/* no medium */
+	luns[1] = luns[0];
+	luns[1].InquiryStr = (uint8_t *) "NXP     EMPTY           1.0 ";
+	luns[1].BlockCount = 0;
+	luns[1].MemorySize = 0;
+
+	memset(&param, 0, sizeof(param));
+	param.NumLUNs = 2;
+	param.LUNs = luns;
+	CHECK_EQ(msc_harness_init(&param, USB_HIGH_SPEED, 4), LPC_OK);
+}
+
+static int rw16(uint8_t opcode, uint64_t lba, uint32_t blocks, uint8_t *data, MSC_RESULT_T *res)
+{
+	next_offset = ~0ULL;
+	bad_offsets = 0;
+	return msc_rw(0, opcode, lba, blocks, BLOCK_SIZE, data, res);
+}
+
+static void test_capacity(void)
+{
+	uint8_t cb16[16] = {SCSI_SERVICE_ACTION_IN16, SCSI_SA_READ_CAPACITY16};
+	uint8_t cb10[10] = {SCSI_READ_CAPACITY};
+	uint8_t cap[32];
+	MSC_RESULT_T res;
+
+	msc_put_be(&cb16[10], sizeof(cap), 4);
+	memset(cap, 0xEE, sizeof(cap));
+	CHECK_EQ(msc_cmd(0, cb16, sizeof(cb16), 1, cap, sizeof(cap), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.data_len, sizeof(cap));
+	CHECK_EQ(msc_get_be(&cap[0], 8), BIG_BLOCKS - 1);
+	CHECK_EQ(msc_get_be(&cap[8], 4), BLOCK_SIZE);
+
+	/* too large for READ CAPACITY(10): the host has to use the 16 byte form */
+	CHECK_EQ(msc_cmd(0, cb10, sizeof(cb10), 1, cap, 8, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(msc_get_be(&cap[0], 4), 0xFFFFFFFF);
+	CHECK_EQ(msc_get_be(&cap[4], 4), BLOCK_SIZE);
+
+	/* a unit without a medium has no last LBA */
+	CHECK_EQ(msc_cmd(1, cb16, sizeof(cb16), 1, cap, sizeof(cap), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.data_len, 0);
+	CHECK_EQ(msc_sense(1), (SCSI_SENSE_NOT_READY << 16) | (SCSI_ASC_MEDIUM_NOT_PRESENT << 8));
+	CHECK_EQ(msc_cmd(1, cb10, sizeof(cb10), 1, cap, 8, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.data_len, 0);
+	CHECK_EQ(msc_sense(1), (SCSI_SENSE_NOT_READY << 16) | (SCSI_ASC_MEDIUM_NOT_PRESENT << 8));
+}
+
+static void test_read_write(uint64_t lba, uint32_t blocks)
+{
+	MSC_RESULT_T res;
+	uint32_t i;
+
+	/* unwritten blocks carry their LBA */
+	CHECK_EQ(rw16(SCSI_READ16, lba, blocks, data_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.data_len, blocks * BLOCK_SIZE);
+	CHECK_EQ(first_offset, lba * BLOCK_SIZE);
+	CHECK_EQ(bad_offsets, 0);
+	for (i = 0; i < blocks; i++) {
+		CHECK_EQ(msc_get_be(&data_buf[i * BLOCK_SIZE], 8), lba + i);
+	}
+
+	for (i = 0; i < blocks * BLOCK_SIZE; i++) {
+		host_buf[i] = (uint8_t) rand();
+	}
+	CHECK_EQ(rw16(SCSI_WRITE16, lba, blocks, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.residue, 0);
+	CHECK_EQ(first_offset, lba * BLOCK_SIZE);
+	CHECK_EQ(bad_offsets, 0);
+
+	memset(data_buf, 0, sizeof(data_buf));
+	CHECK_EQ(rw16(SCSI_READ16, lba, blocks, data_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK(memcmp(data_buf, host_buf, blocks * BLOCK_SIZE) == 0);
+}
+
+static void test_out_of_range(uint64_t lba, uint32_t blocks)
+{
+	MSC_RESULT_T res;
+
+	CHECK_EQ(rw16(SCSI_READ16, lba, blocks, data_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.data_len, 0);
+	CHECK_EQ(res.residue, blocks * BLOCK_SIZE);
+	CHECK_EQ(next_offset, ~0ULL);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_ILLEGAL_REQUEST << 16) | (SCSI_ASC_LBA_OUT_OF_RANGE << 8));
+
+	CHECK_EQ(rw16(SCSI_WRITE16, lba, blocks, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(next_offset, ~0ULL);
+}
+
+/* READ(10) addresses the first 2^32 blocks, with offsets above 4 GB */
+static void test_read10_high(void)
+{
+	MSC_RESULT_T res;
+
+	next_offset = ~0ULL;
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 0xFFFFFFF0, 1, BLOCK_SIZE, data_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(first_offset, 0xFFFFFFF0ULL * BLOCK_SIZE);
+	CHECK_EQ(msc_get_be(data_buf, 8), 0xFFFFFFF0);
+}
+
+int main(void)
+{
+	srand(13);
+	init_msc();
+	test_capacity();
+	/* above 2^32 blocks */
+	test_read_write(0x212345678ULL, 2);
+	/* across the 2^32 block line */
+	test_read_write(0xFFFFFFFEULL, 4);
+	/* the last block */
+	test_read_write(BIG_BLOCKS - 1, 1);
+	test_read10_high();
+	/* ending one block past the medium */
+	test_out_of_range(BIG_BLOCKS - 1, 2);
+	test_out_of_range(BIG_BLOCKS, 1);
+	/* LBA + length wrapping around 2^64 */
+	test_out_of_range(0xFFFFFFFFFFFFFFFFULL, 2);
+	/* byte offset wrapping around 2^64 */
+	test_out_of_range(0x0080000000000000ULL, 1);
+	return TEST_DONE();
+}
@@ -0,0 +1,242 @@
+/*
+ * MSC class driver with two logical units (user-011).
+ *
+ * A fast RAM unit with 512 byte blocks, zero copy writes and 16 KiB
+ * transfers next to a slow card-like unit with 1 KiB blocks, copying
+ * callbacks, 4 KiB double buffered transfers, read-ahead and a cache flush.
+ * Commands are interleaved at random between the units and each unit must
+ * keep its own geometry, buffer strategy and data.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "msc_harness.h"
+#include "test_util.h"
+
+/* class request handler of the MSC function, registered with the core */
+extern ErrorCode_t mwMSC_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event);
+
+#define RAM_BLOCK_SIZE      512
+#define SD_BLOCK_SIZE       1024
+#define LUN_BLOCKS          512
+
+static uint8_t ram_disk[RAM_BLOCK_SIZE * LUN_BLOCKS], ram_ref[RAM_BLOCK_SIZE * LUN_BLOCKS];
+static uint8_t sd_disk[SD_BLOCK_SIZE * LUN_BLOCKS], sd_ref[SD_BLOCK_SIZE * LUN_BLOCKS];
+static uint8_t host_buf[128 * 1024];
+static uint32_t sd_flushes, sd_reads;
+
+static void ram_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	*buff_adr = &ram_disk[offset];
+}
+
+static void ram_write(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	*buff_adr = &ram_disk[offset + length];
+}
+
+static void ram_get_write_buf(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	*buff_adr = &ram_disk[offset];
+}
+
+static ErrorCode_t ram_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return memcmp(&ram_disk[offset], src, length) ? ERR_FAILED : LPC_OK;
+}
+
+static void sd_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	sd_reads++;
+	memcpy(*buff_adr, &sd_disk[offset], length);
+}
+
+static void sd_write(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	memcpy(&sd_disk[offset], *buff_adr, length);
+}
+
+static ErrorCode_t sd_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return memcmp(&sd_disk[offset], src, length) ? ERR_FAILED : LPC_OK;
+}
+
+static ErrorCode_t sd_flush(void)
+{
+	sd_flushes++;
+	return LPC_OK;
+}
+
+static void init_msc(void)
+{
+	static USBD_MSC_LUN_PARAM_T luns[2];
+	USBD_MSC_INIT_PARAM_T param;
+
+	memset(luns, 0, sizeof(luns));
+	luns[0].InquiryStr = (uint8_t *) "NXP     RAMDISK         1.0 ";
+	luns[0].BlockSize = RAM_BLOCK_SIZE;
+	luns[0].BlockCount = LUN_BLOCKS;
+	luns[0].MemorySize = sizeof(ram_disk);
+	luns[0].XferBufSize = 16 * 1024;
+	luns[0].RxWindow = 16 * 1024;
+	luns[0].MSC_Read = ram_read;
+	luns[0].MSC_Write = ram_write;
+	luns[0].MSC_GetWriteBuf = ram_get_write_buf;
+	luns[0].MSC_Verify = ram_verify;
+
+	luns[1].InquiryStr = (uint8_t *) "NXP     SD CARD         1.0 ";
+	luns[1].BlockSize = SD_BLOCK_SIZE;
+	luns[1].BlockCount = LUN_BLOCKS;
+	luns[1].MemorySize = sizeof(sd_disk);
+	luns[1].XferBufSize = 4 * 1024;
+	luns[1].XferBufCnt = 2;
+	luns[1].RxWindow = 4 * 1024;
+	luns[1].PrefetchBlocks = 8;
+	luns[1].MSC_Read = sd_read;
+	luns[1].MSC_Write = sd_write;
+	luns[1].MSC_Verify = sd_verify;
+	luns[1].MSC_Flush = sd_flush;
+
+	memset(&param, 0, sizeof(param));
+	param.NumLUNs = 2;
+	param.LUNs = luns;
+	CHECK_EQ(msc_harness_init(&param, USB_HIGH_SPEED, 4), LPC_OK);
+}
+
+static void test_get_max_lun(void)
+{
+	msc_core.SetupPacket.bmRequestType.B = 0xA1;
+	msc_core.SetupPacket.bRequest = MSC_REQUEST_GET_MAX_LUN;
+	msc_core.SetupPacket.wValue.W = 0;
+	msc_core.SetupPacket.wIndex.W = 0;
+	msc_core.SetupPacket.wLength = 1;
+	msc_core.EP0Buf[0] = 0xFF;
+	CHECK_EQ(mwMSC_ep0_hdlr(&msc_core, msc_harness_ctrl(), USB_EVT_SETUP), LPC_OK);
+	CHECK_EQ(msc_core.EP0Buf[0], 1);
+}
+
+static void test_identify(uint8_t lun, uint32_t block_size, const char *product)
+{
+	uint8_t cap_cb[10] = {SCSI_READ_CAPACITY};
+	uint8_t inq_cb[6] = {SCSI_INQUIRY, 0, 0, 0, 36, 0};
+	uint8_t data[36];
+	MSC_RESULT_T res;
+
+	CHECK_EQ(msc_cmd(lun, cap_cb, sizeof(cap_cb), 1, data, 8, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(msc_get_be(&data[0], 4), LUN_BLOCKS - 1);
+	CHECK_EQ(msc_get_be(&data[4], 4), block_size);
+
+	CHECK_EQ(msc_cmd(lun, inq_cb, sizeof(inq_cb), 1, data, sizeof(data), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK(memcmp(&data[16], product, 16) == 0);
+}
+
+/* each unit uses its own transfer size */
+static void test_xfer_size(void)
+{
+	MSC_RESULT_T res;
+
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 0, 128, RAM_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.in_xfers, 4);
+	CHECK_EQ(msc_rw(1, SCSI_READ10, 0, 64, SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.in_xfers, 16);
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 0, 128, RAM_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.in_xfers, 4);
+}
+
+/* a LUN above GET MAX LUN fails without touching the units */
+static void test_bad_lun(void)
+{
+	uint8_t cb[6] = {SCSI_TEST_UNIT_READY};
+	MSC_RESULT_T res;
+
+	CHECK_EQ(msc_cmd(2, cb, sizeof(cb), 0, 0, 0, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(msc_rw(5, SCSI_READ10, 0, 4, RAM_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.data_len, 0);
+	CHECK_EQ(res.residue, 4 * RAM_BLOCK_SIZE);
+	CHECK_EQ(res.stalls, 1);
+
+	/* both units still work */
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 0, 0, 0, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(msc_cmd(1, cb, sizeof(cb), 0, 0, 0, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+}
+
+static void test_interleaved(void)
+{
+	uint8_t sync_cb[10] = {SCSI_SYNC_CACHE10};
+	MSC_RESULT_T res;
+	uint32_t it, i, lun, bs, blocks, lba, sd_syncs = 0;
+	uint32_t next_lba[2] = {0, 0};
+	uint8_t *ref;
+
+	for (i = 0; i < sizeof(ram_disk); i++) {
+		ram_ref[i] = ram_disk[i] = (uint8_t) rand();
+	}
+	for (i = 0; i < sizeof(sd_disk); i++) {
+		sd_ref[i] = sd_disk[i] = (uint8_t) rand();
+	}
+	sd_flushes = 0;
+
+	for (it = 0; it < 3000; it++) {
+		lun = rand() & 1;
+		bs = lun ? SD_BLOCK_SIZE : RAM_BLOCK_SIZE;
+		ref = lun ? sd_ref : ram_ref;
+		blocks = 1 + (rand() % (lun ? 64 : 128));
+		lba = rand() % (LUN_BLOCKS - blocks + 1);
+		/* streams continue on each unit across commands to the other */
+		if (((rand() % 4) == 0) && ((next_lba[lun] + blocks) <= LUN_BLOCKS)) {
+			lba = next_lba[lun];
+		}
+		next_lba[lun] = lba + blocks;
+
+		switch (rand() % 3) {
+		case 0:
+			memset(host_buf, 0, blocks * bs);
+			CHECK_EQ(msc_rw(lun, SCSI_READ10, lba, blocks, bs, host_buf, &res), 0);
+			CHECK_EQ(res.status, CSW_CMD_PASSED);
+			CHECK_EQ(res.residue, 0);
+			CHECK(memcmp(host_buf, &ref[lba * bs], blocks * bs) == 0);
+			break;
+
+		case 1:
+			for (i = 0; i < blocks * bs; i++) {
+				host_buf[i] = (uint8_t) rand();
+			}
+			memcpy(&ref[lba * bs], host_buf, blocks * bs);
+			CHECK_EQ(msc_rw(lun, SCSI_WRITE10, lba, blocks, bs, host_buf, &res), 0);
+			CHECK_EQ(res.status, CSW_CMD_PASSED);
+			CHECK_EQ(res.residue, 0);
+			break;
+
+		default:
+			CHECK_EQ(msc_cmd(lun, sync_cb, sizeof(sync_cb), 0, 0, 0, &res), 0);
+			CHECK_EQ(res.status, CSW_CMD_PASSED);
+			sd_syncs += lun;
+			break;
+		}
+	}
+	CHECK(memcmp(ram_disk, ram_ref, sizeof(ram_disk)) == 0);
+	CHECK(memcmp(sd_disk, sd_ref, sizeof(sd_disk)) == 0);
+	/* only the unit with a cache is flushed */
+	CHECK_EQ(sd_flushes, sd_syncs);
+}
+
+int main(void)
+{
+	srand(11);
+	init_msc();
+	test_get_max_lun();
+	test_identify(0, RAM_BLOCK_SIZE, "RAMDISK         ");
+	test_identify(1, SD_BLOCK_SIZE, "SD CARD         ");
+	test_identify(0, RAM_BLOCK_SIZE, "RAMDISK         ");
+	test_xfer_size();
+	test_bad_lun();
+	test_interleaved();
+	return TEST_DONE();
+}
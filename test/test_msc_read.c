@@ -0,0 +1,114 @@
+/*
+ * MSC READ data stage: multi-packet bulk IN transfers (user-001).
+ *
+ * A 64 KiB READ(10) must go out in XferBufSize chunks, one WriteEP per
+ * chunk, instead of one 512 byte packet per IN interrupt, and the data,
+ * CSW status and residue must not depend on the chunk size.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define DISK_BLOCK_SIZE     512
+#define DISK_BLOCK_COUNT    2048
+
+static uint8_t disk[DISK_BLOCK_SIZE * DISK_BLOCK_COUNT];
+static uint8_t host_buf[128 * 1024];
+
+static void disk_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	/* zero copy, like msc_ram translate_rd */
+	*buff_adr = &disk[offset];
+}
+
+static void disk_write(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	memcpy(&disk[offset], *buff_adr, length);
+}
+
+static ErrorCode_t disk_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return memcmp(&disk[offset], src, length) ? ERR_FAILED : LPC_OK;
+}
+
+static void init_msc(uint32_t xfer_size, uint32_t xfer_cnt, uint32_t speed)
+{
+	USBD_MSC_INIT_PARAM_T param;
+
+	memset(&param, 0, sizeof(param));
+	param.InquiryStr = (uint8_t *) "NXP     RAMDISK         1.0 ";
+	param.BlockSize = DISK_BLOCK_SIZE;
+	param.BlockCount = DISK_BLOCK_COUNT;
+	param.MemorySize = sizeof(disk);
+	param.XferBufSize = xfer_size;
+	param.XferBufCnt = xfer_cnt;
+	param.MSC_Read = disk_read;
+	param.MSC_Write = disk_write;
+	param.MSC_Verify = disk_verify;
+	CHECK_EQ(msc_harness_init(&param, speed, 4), LPC_OK);
+}
+
+static void test_read(uint32_t xfer_size, uint32_t xfer_cnt, uint32_t blocks, uint32_t expect_xfers)
+{
+	MSC_RESULT_T res;
+	uint32_t lba = 5;
+
+	init_msc(xfer_size, xfer_cnt, USB_HIGH_SPEED);
+	memset(host_buf, 0, sizeof(host_buf));
+	CHECK_EQ(msc_rw(0, SCSI_READ10, lba, blocks, DISK_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.residue, 0);
+	CHECK_EQ(res.data_len, blocks * DISK_BLOCK_SIZE);
+	CHECK(memcmp(host_buf, &disk[lba * DISK_BLOCK_SIZE], blocks * DISK_BLOCK_SIZE) == 0);
+	CHECK_EQ(res.in_xfers, expect_xfers);
+	printf("xfer %5u x%u: %3u blocks in %3u IN transfers, at most %u queued\n", xfer_size, xfer_cnt, blocks,
+		   res.in_xfers, fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].max_queued);
+}
+
+int main(void)
+{
+	uint32_t i;
+	MSC_RESULT_T res;
+
+	srand(1);
+	for (i = 0; i < sizeof(disk); i++) {
+		disk[i] = (uint8_t) rand();
+	}
+
+	/* one packet per interrupt without a transfer buffer */
+	test_read(0, 1, 128, 128);
+	test_read(8192, 1, 128, 8);
+	test_read(16384, 1, 128, 4);
+	/* two buffers in flight */
+	test_read(8192, 2, 128, 8);
+	CHECK_EQ(fake_ep[fake_ep_index(MSC_HARNESS_IN_EP)].max_queued, 2);
+	/* tail shorter than a transfer buffer */
+	test_read(16384, 1, 37, 2);
+
+	/* full speed, same chunking */
+	init_msc(16384, 1, USB_FULL_SPEED);
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 100, 64, DISK_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK(memcmp(host_buf, &disk[100 * DISK_BLOCK_SIZE], 64 * DISK_BLOCK_SIZE) == 0);
+	CHECK_EQ(res.in_xfers, 2);
+
+	/* host length does not match the CDB: stall and fail with the whole
+	   length as residue, no data stage */
+	{
+		uint8_t cb[10] = {SCSI_READ10, 0, 0, 0, 0, 10, 0, 0, 8, 0};
+
+		init_msc(16384, 1, USB_HIGH_SPEED);
+		CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 1, host_buf, 16 * DISK_BLOCK_SIZE, &res), 0);
+		CHECK_EQ(res.status, CSW_CMD_FAILED);
+		CHECK_EQ(res.residue, 16 * DISK_BLOCK_SIZE);
+		CHECK_EQ(res.data_len, 0);
+		CHECK_EQ(res.stalls, 1);
+		/* and the next command runs normally */
+		CHECK_EQ(msc_rw(0, SCSI_READ10, 10, 8, DISK_BLOCK_SIZE, host_buf, &res), 0);
+		CHECK_EQ(res.status, CSW_CMD_PASSED);
+		CHECK(memcmp(host_buf, &disk[10 * DISK_BLOCK_SIZE], 8 * DISK_BLOCK_SIZE) == 0);
+	}
+
+	return TEST_DONE();
+}
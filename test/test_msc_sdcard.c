@@ -0,0 +1,276 @@
+/*
+ * SD card translate layer of usbd_mw_msc_sdcard (user-008).
+ *
+ * Builds msc_sdcard.c unchanged on top of mw_usbd_msccache.c and the MSC
+ * class driver, with the FatFs disk I/O functions backed by a temporary
+ * file and a clock the test advances. Checks that host writes are held in
+ * the write-back cache until SYNCHRONIZE CACHE or the idle flush, that
+ * reads see the cached data, that sequential reads are served from the
+ * read-ahead windows, and that card errors reach the host as MEDIUM ERROR.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "msc_harness.h"
+#include "msc_disk.h"
+#include "test_util.h"
+
+#include <fatfs_lib/diskio.h>
+#include <mcu_timing/delay.h>
+
+#define DISK_BLOCK_COUNT    4096
+#define DISK_SIZE           (DISK_BLOCK_COUNT * MSC_SD_BLOCK_SIZE)
+
+uint8_t host_sd_win1[MSC_SD_CACHE_WIN_SIZE] __attribute__((aligned(4)));
+
+static uint8_t usb_mem[64 * 1024] __attribute__((aligned(2048)));
+static uint8_t host_buf[128 * MSC_SD_BLOCK_SIZE];
+static uint8_t file_buf[128 * MSC_SD_BLOCK_SIZE];
+
+/* file-backed card */
+static int disk_fd = -1;
+static uint32_t disk_reads, disk_writes;
+static uint32_t disk_fail_read, disk_fail_write;
+static uint64_t now_us;
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+	size_t len = (size_t) count * MSC_SD_BLOCK_SIZE;
+
+	disk_reads++;
+	if (disk_fail_read || ((sector + count) > DISK_BLOCK_COUNT)) {
+		return RES_ERROR;
+	}
+	return (pread(disk_fd, buff, len, (off_t) sector * MSC_SD_BLOCK_SIZE) == (ssize_t) len) ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+	size_t len = (size_t) count * MSC_SD_BLOCK_SIZE;
+
+	disk_writes++;
+	if (disk_fail_write || ((sector + count) > DISK_BLOCK_COUNT)) {
+		return RES_ERROR;
+	}
+	return (pwrite(disk_fd, buff, len, (off_t) sector * MSC_SD_BLOCK_SIZE) == (ssize_t) len) ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+	if (cmd != GET_SECTOR_COUNT) {
+		return RES_PARERR;
+	}
+	*(DWORD *) buff = DISK_BLOCK_COUNT;
+	return RES_OK;
+}
+
+uint64_t delay_get_timestamp(void)
+{
+	return now_us;
+}
+
+uint64_t delay_calc_time_us(uint64_t start, uint64_t end)
+{
+	return end - start;
+}
+
+static void file_read(uint32_t lba, uint32_t blocks, uint8_t *buf)
+{
+	size_t len = (size_t) blocks * MSC_SD_BLOCK_SIZE;
+
+	CHECK(pread(disk_fd, buf, len, (off_t) lba * MSC_SD_BLOCK_SIZE) == (ssize_t) len);
+}
+
+static void fill(uint8_t *buf, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = (uint8_t) rand();
+	}
+}
+
+static void sync_cache(uint8_t expect_status)
+{
+	uint8_t cb[10] = {SCSI_SYNC_CACHE10};
+	MSC_RESULT_T res;
+
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 0, 0, 0, &res), 0);
+	CHECK_EQ(res.status, expect_status);
+}
+
+static void test_init(void)
+{
+	USBD_API_INIT_PARAM_T usb_param;
+	USB_CORE_DESCS_T desc;
+	uint8_t cb[10] = {SCSI_READ_CAPACITY};
+	uint8_t cap[8];
+	MSC_RESULT_T res;
+	uint8_t *zero;
+
+	zero = calloc(1, DISK_SIZE);
+	CHECK(write(disk_fd, zero, DISK_SIZE) == DISK_SIZE);
+	free(zero);
+
+	CHECK_EQ(msc_harness_init_core(USB_HIGH_SPEED, 4), LPC_OK);
+	memset(&usb_param, 0, sizeof(usb_param));
+	memset(&desc, 0, sizeof(desc));
+	usb_param.mem_base = (uint32_t) usb_mem;
+	usb_param.mem_size = sizeof(usb_mem);
+	msc_harness_set_ctrl((USB_MSC_CTRL_T *) usb_mem);
+	CHECK_EQ(mscDisk_init(&msc_core, &desc, &usb_param), LPC_OK);
+	CHECK(usb_param.mem_base > (uint32_t) usb_mem);
+
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 1, cap, sizeof(cap), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(msc_get_be(&cap[0], 4), DISK_BLOCK_COUNT - 1);
+	CHECK_EQ(msc_get_be(&cap[4], 4), MSC_SD_BLOCK_SIZE);
+}
+
+/* WRITE10 data stays in the write-back cache until SYNCHRONIZE CACHE */
+static void test_write_sync(void)
+{
+	MSC_RESULT_T res;
+	uint32_t writes;
+
+	fill(host_buf, 4 * MSC_SD_BLOCK_SIZE);
+	writes = disk_writes;
+	CHECK_EQ(msc_rw(0, SCSI_WRITE10, 40, 4, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(disk_writes, writes);
+	file_read(40, 4, file_buf);
+	CHECK(memcmp(file_buf, host_buf, 4 * MSC_SD_BLOCK_SIZE) != 0);
+
+	/* the cached blocks are what the host reads back */
+	memset(file_buf, 0, sizeof(file_buf));
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 40, 4, MSC_SD_BLOCK_SIZE, file_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK(memcmp(file_buf, host_buf, 4 * MSC_SD_BLOCK_SIZE) == 0);
+
+	sync_cache(CSW_CMD_PASSED);
+	CHECK(disk_writes > writes);
+	file_read(40, 4, file_buf);
+	CHECK(memcmp(file_buf, host_buf, 4 * MSC_SD_BLOCK_SIZE) == 0);
+
+	/* nothing left to write */
+	writes = disk_writes;
+	sync_cache(CSW_CMD_PASSED);
+	CHECK_EQ(disk_writes, writes);
+}
+
+/* a write larger than the cache reaches the card complete and in order */
+static void test_write_large(void)
+{
+	MSC_RESULT_T res;
+
+	fill(host_buf, sizeof(host_buf));
+	CHECK_EQ(msc_rw(0, SCSI_WRITE10, 1000, 128, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.residue, 0);
+	sync_cache(CSW_CMD_PASSED);
+	file_read(1000, 128, file_buf);
+	CHECK(memcmp(file_buf, host_buf, sizeof(host_buf)) == 0);
+}
+
+/* a sequential stream is read from the card a window at a time */
+static void test_read_ahead(void)
+{
+	MSC_RESULT_T res;
+	uint32_t reads, chunks = sizeof(host_buf) / MSC_USB_XFER_SIZE;
+
+	fill(file_buf, sizeof(file_buf));
+	CHECK(pwrite(disk_fd, file_buf, sizeof(file_buf), 2048 * MSC_SD_BLOCK_SIZE) == sizeof(file_buf));
+
+	reads = disk_reads;
+	/* first request of the stream */
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 2048, 16, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 2064, 112, MSC_SD_BLOCK_SIZE, host_buf + 16 * MSC_SD_BLOCK_SIZE, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.in_xfers, 112 * MSC_SD_BLOCK_SIZE / MSC_USB_XFER_SIZE);
+	CHECK(memcmp(host_buf, file_buf, sizeof(host_buf)) == 0);
+	/* one card read per window rather than one per transfer */
+	CHECK((disk_reads - reads) < chunks);
+	printf("read-ahead: %u card reads for %u transfers\n", disk_reads - reads, chunks);
+}
+
+/* dirty blocks are written back once the host stopped writing for
+   MSC_SD_IDLE_FLUSH_MS */
+static void test_idle_flush(void)
+{
+	MSC_RESULT_T res;
+	uint32_t writes;
+
+	fill(host_buf, 2 * MSC_SD_BLOCK_SIZE);
+	now_us = 1000000;
+	writes = disk_writes;
+	CHECK_EQ(msc_rw(0, SCSI_WRITE10, 300, 2, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+
+	now_us += (MSC_SD_IDLE_FLUSH_MS - 1) * 1000;
+	mscDisk_idle();
+	CHECK_EQ(disk_writes, writes);
+
+	now_us += 1000;
+	mscDisk_idle();
+	CHECK(disk_writes > writes);
+	file_read(300, 2, file_buf);
+	CHECK(memcmp(file_buf, host_buf, 2 * MSC_SD_BLOCK_SIZE) == 0);
+
+	writes = disk_writes;
+	now_us += MSC_SD_IDLE_FLUSH_MS * 1000;
+	mscDisk_idle();
+	CHECK_EQ(disk_writes, writes);
+}
+
+/* card errors fail the command with MEDIUM ERROR */
+static void test_errors(void)
+{
+	MSC_RESULT_T res;
+
+	/* read of blocks neither cached nor in a window */
+	disk_fail_read = 1;
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 3500, 8, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.data_len, 0);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_MEDIUM_ERROR << 16) | (SCSI_ASC_UNRECOVERED_READ_ERROR << 8));
+	disk_fail_read = 0;
+	CHECK_EQ(msc_rw(0, SCSI_READ10, 3500, 8, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+
+	/* write-back failure on SYNCHRONIZE CACHE, the blocks stay dirty */
+	fill(host_buf, 2 * MSC_SD_BLOCK_SIZE);
+	CHECK_EQ(msc_rw(0, SCSI_WRITE10, 500, 2, MSC_SD_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	disk_fail_write = 1;
+	sync_cache(CSW_CMD_FAILED);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_MEDIUM_ERROR << 16) | (SCSI_ASC_WRITE_ERROR << 8));
+	disk_fail_write = 0;
+	sync_cache(CSW_CMD_PASSED);
+	file_read(500, 2, file_buf);
+	CHECK(memcmp(file_buf, host_buf, 2 * MSC_SD_BLOCK_SIZE) == 0);
+}
+
+int main(void)
+{
+	char path[] = "/tmp/test_msc_sdcard.XXXXXX";
+
+	disk_fd = mkstemp(path);
+	if (disk_fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	unlink(path);
+	srand(8);
+
+	test_init();
+	test_write_sync();
+	test_write_large();
+	test_read_ahead();
+	test_idle_flush();
+	test_errors();
+
+	close(disk_fd);
+	return TEST_DONE();
+}
@@ -0,0 +1,283 @@
+/*
+ * MSC SCSI UNMAP (user-014).
+ *
+ * UNMAP parameter lists are sent through the bulk-only harness at high and
+ * full speed. MSC_Unmap() must see each freed range once, as maximal
+ * extents in ascending LBA order, however the host orders, splits and
+ * overlaps its block descriptors. Also checks the provisioning VPD pages
+ * and READ CAPACITY(16) bits, and the failure cases.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define BLOCK_SIZE          512
+#define BIG_BLOCKS          0x300000000ULL
+#define MAX_EXTENTS         2048
+/* random lists are drawn from the first MAP_BLOCKS blocks */
+#define MAP_BLOCKS          4096
+
+typedef struct {
+	uint64_t lba;
+	uint64_t blocks;
+} EXTENT_T;
+
+static EXTENT_T extents[MAX_EXTENTS];
+static uint32_t num_extents;
+static uint32_t unmap_fail;
+static uint8_t freed[MAP_BLOCKS];
+
+static void disk_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+}
+
+static void disk_write(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+}
+
+static ErrorCode_t disk_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return LPC_OK;
+}
+
+static ErrorCode_t disk_unmap(uint32_t offset, uint32_t length, uint32_t high_offset)
+{
+	uint64_t off = ((uint64_t) high_offset << 32) | offset;
+
+	CHECK_EQ(off % BLOCK_SIZE, 0);
+	CHECK_EQ(length % BLOCK_SIZE, 0);
+	if (num_extents < MAX_EXTENTS) {
+		extents[num_extents].lba = off / BLOCK_SIZE;
+		extents[num_extents].blocks = length / BLOCK_SIZE;
+	}
+	num_extents++;
+	return unmap_fail ? ERR_FAILED : LPC_OK;
+}
+
+static void init_msc(uint32_t speed, uint8_t with_unmap)
+{
+	USBD_MSC_INIT_PARAM_T param;
+
+	memset(&param, 0, sizeof(param));
+	param.InquiryStr = (uint8_t *) "NXP     THINDISK        1.0 ";
+	param.BlockSize = BLOCK_SIZE;
+	param.BlockCount = 0xFFFFFFFF;
+	param.MemorySize64 = BIG_BLOCKS * BLOCK_SIZE;
+	param.MSC_Read = disk_read;
+	param.MSC_Write = disk_write;
+	param.MSC_Verify = disk_verify;
+	param.MSC_Unmap = with_unmap ? disk_unmap : 0;
+	CHECK_EQ(msc_harness_init(&param, speed, 4), LPC_OK);
+}
+
+/* sends an UNMAP with the given descriptors, returns the CSW status */
+static uint8_t unmap(const uint64_t (*desc)[2], uint32_t cnt)
+{
+	static uint8_t list[8 + 16 * 64];
+	uint8_t cb[10] = {SCSI_UNMAP};
+	uint32_t i, len = 8 + 16 * cnt;
+	MSC_RESULT_T res;
+
+	memset(list, 0, sizeof(list));
+	msc_put_be(&list[0], len - 2, 2);
+	msc_put_be(&list[2], 16 * cnt, 2);
+	for (i = 0; i < cnt; i++) {
+		msc_put_be(&list[8 + 16 * i], desc[i][0], 8);
+		msc_put_be(&list[16 + 16 * i], desc[i][1], 4);
+	}
+	msc_put_be(&cb[7], len, 2);
+	num_extents = 0;
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 0, list, len, &res), 0);
+	if (res.status == CSW_CMD_PASSED) {
+		CHECK_EQ(res.data_len, len);
+		CHECK_EQ(res.residue, 0);
+	}
+	return res.status;
+}
+
+static void check_extent(uint32_t i, uint64_t lba, uint64_t blocks)
+{
+	CHECK_EQ(extents[i].lba, lba);
+	CHECK_EQ(extents[i].blocks, blocks);
+}
+
+static void test_vpd(uint8_t with_unmap)
+{
+	uint8_t page0[6] = {SCSI_INQUIRY, 1, 0x00, 0, 255, 0};
+	uint8_t page_b0[6] = {SCSI_INQUIRY, 1, 0xB0, 0, 255, 0};
+	uint8_t page_b2[6] = {SCSI_INQUIRY, 1, 0xB2, 0, 255, 0};
+	uint8_t page_80[6] = {SCSI_INQUIRY, 1, 0x80, 0, 255, 0};
+	uint8_t cap16[16] = {SCSI_SERVICE_ACTION_IN16, SCSI_SA_READ_CAPACITY16, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32};
+	uint8_t data[255];
+	MSC_RESULT_T res;
+
+	CHECK_EQ(msc_cmd(0, page0, sizeof(page0), 1, data, sizeof(data), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.data_len, 7);
+	CHECK_EQ(data[4], 0x00);
+	CHECK_EQ(data[5], 0xB0);
+	CHECK_EQ(data[6], 0xB2);
+
+	CHECK_EQ(msc_cmd(0, page_b0, sizeof(page_b0), 1, data, sizeof(data), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.data_len, 64);
+	CHECK_EQ(data[1], 0xB0);
+	CHECK_EQ(msc_get_be(&data[20], 4), with_unmap ? 0xFFFFFFFF : 0);
+	CHECK_EQ(msc_get_be(&data[24], 4), with_unmap ? USB_MSC_MAX_UNMAP_DESC : 0);
+
+	CHECK_EQ(msc_cmd(0, page_b2, sizeof(page_b2), 1, data, sizeof(data), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.data_len, 8);
+	CHECK_EQ(data[5] & 0x80, with_unmap ? 0x80 : 0);
+
+	CHECK_EQ(msc_cmd(0, page_80, sizeof(page_80), 1, data, sizeof(data), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.data_len, 0);
+
+	CHECK_EQ(msc_cmd(0, cap16, sizeof(cap16), 1, data, 32, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(data[14] & 0x80, with_unmap ? 0x80 : 0);
+}
+
+/* adjacent and overlapping descriptors become one extent each */
+static void test_coalesce(void)
+{
+	static const uint64_t desc[][2] = {
+		{10, 5}, {15, 5}, {18, 4}, {100, 1}, {0, 0}, {101, 2}, {BIG_BLOCKS - 16, 16},
+	};
+	static const uint64_t shuffled[][2] = {
+		{101, 2}, {BIG_BLOCKS - 16, 16}, {18, 4}, {0, 0}, {100, 1}, {15, 5}, {10, 5},
+	};
+
+	CHECK_EQ(unmap(desc, 7), CSW_CMD_PASSED);
+	CHECK_EQ(num_extents, 3);
+	check_extent(0, 10, 12);
+	check_extent(1, 100, 3);
+	check_extent(2, BIG_BLOCKS - 16, 16);
+
+	/* the order of the descriptors does not matter */
+	CHECK_EQ(unmap(shuffled, 7), CSW_CMD_PASSED);
+	CHECK_EQ(num_extents, 3);
+	check_extent(0, 10, 12);
+	check_extent(1, 100, 3);
+	check_extent(2, BIG_BLOCKS - 16, 16);
+
+	/* a descriptor covering all the others */
+	{
+		static const uint64_t covered[][2] = {{50, 2}, {40, 100}, {60, 10}, {139, 2}};
+
+		CHECK_EQ(unmap(covered, 4), CSW_CMD_PASSED);
+		CHECK_EQ(num_extents, 1);
+		check_extent(0, 40, 101);
+	}
+}
+
+/* random lists, the extents must be the runs of freed blocks */
+static void test_random(uint32_t rounds)
+{
+	uint64_t desc[USB_MSC_MAX_UNMAP_DESC][2];
+	uint32_t r, i, j, cnt, lba, n, runs;
+
+	for (r = 0; r < rounds; r++) {
+		cnt = 1 + (rand() % USB_MSC_MAX_UNMAP_DESC);
+		memset(freed, 0, sizeof(freed));
+		for (i = 0; i < cnt; i++) {
+			/* clustered, so descriptors touch and overlap often */
+			lba = (rand() % 8) * 256 + (rand() % 200);
+			n = rand() % 48;
+			desc[i][0] = lba;
+			desc[i][1] = n;
+			memset(&freed[lba], 1, n);
+		}
+		CHECK_EQ(unmap((const uint64_t (*)[2]) desc, cnt), CSW_CMD_PASSED);
+
+		runs = 0;
+		for (i = 0; i < MAP_BLOCKS; i = j) {
+			if (freed[i] == 0) {
+				j = i + 1;
+				continue;
+			}
+			for (j = i; (j < MAP_BLOCKS) && freed[j]; j++) {}
+			if (runs < num_extents) {
+				check_extent(runs, i, j - i);
+			}
+			runs++;
+		}
+		CHECK_EQ(num_extents, runs);
+	}
+}
+
+static void test_errors(void)
+{
+	static const uint64_t out_of_range[][2] = {{1, 1}, {BIG_BLOCKS, 1}};
+	static const uint64_t past_end[][2] = {{BIG_BLOCKS - 1, 2}};
+	static const uint64_t wrap[][2] = {{0xFFFFFFFFFFFFFFFFULL, 2}};
+	static const uint64_t huge[][2] = {{0, 0xFFFFFFFF}, {0xFFFFFFFF, 0xFFFFFFFF}};
+	static const uint64_t one[][2] = {{7, 1}};
+	uint8_t cb[10] = {SCSI_UNMAP, 0, 0, 0, 0, 0, 0, 0x10, 0x00, 0};
+	static uint8_t list[0x1000];
+	MSC_RESULT_T res;
+	uint64_t next;
+	uint32_t i;
+
+	/* nothing is unmapped when any descriptor is out of range */
+	CHECK_EQ(unmap(out_of_range, 2), CSW_CMD_FAILED);
+	CHECK_EQ(num_extents, 0);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_ILLEGAL_REQUEST << 16) | (SCSI_ASC_LBA_OUT_OF_RANGE << 8));
+	CHECK_EQ(unmap(past_end, 1), CSW_CMD_FAILED);
+	CHECK_EQ(num_extents, 0);
+	CHECK_EQ(unmap(wrap, 1), CSW_CMD_FAILED);
+	CHECK_EQ(num_extents, 0);
+
+	/* an extent too long for the 32-bit byte count is split, contiguously */
+	CHECK_EQ(unmap(huge, 2), CSW_CMD_PASSED);
+	CHECK(num_extents > 1);
+	CHECK(num_extents <= MAX_EXTENTS);
+	next = 0;
+	for (i = 0; (i < num_extents) && (i < MAX_EXTENTS); i++) {
+		CHECK_EQ(extents[i].lba, next);
+		next += extents[i].blocks;
+	}
+	CHECK_EQ(next, 0x1FFFFFFFEULL);
+
+	/* backend failure */
+	unmap_fail = 1;
+	CHECK_EQ(unmap(one, 1), CSW_CMD_FAILED);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_MEDIUM_ERROR << 16) | (SCSI_ASC_WRITE_ERROR << 8));
+	unmap_fail = 0;
+
+	/* a parameter list larger than the bulk buffer is refused */
+	memset(list, 0, sizeof(list));
+	num_extents = 0;
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 0, list, sizeof(list), &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+	CHECK_EQ(res.stalls, 1);
+	CHECK_EQ(num_extents, 0);
+}
+
+int main(void)
+{
+	srand(14);
+	init_msc(USB_HIGH_SPEED, 1);
+	test_vpd(1);
+	test_coalesce();
+	test_random(500);
+	test_errors();
+
+	/* full speed: a 31 descriptor list takes eight packets */
+	init_msc(USB_FULL_SPEED, 1);
+	test_coalesce();
+	test_random(500);
+
+	/* UNMAP is not offered without a callback */
+	init_msc(USB_HIGH_SPEED, 0);
+	test_vpd(0);
+	{
+		static const uint64_t one[][2] = {{7, 1}};
+
+		CHECK_EQ(unmap(one, 1), CSW_CMD_FAILED);
+		CHECK_EQ(num_extents, 0);
+	}
+	return TEST_DONE();
+}
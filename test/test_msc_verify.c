@@ -0,0 +1,285 @@
+/*
+ * VERIFY(10) at the medium and mwUSB_Crc32() (user-016).
+ *
+ * The disk keeps a CRC-32 per block, updated on every write, and checks it
+ * in MSC_VerifyRange(). VERIFY(10) with BYTCHK=0 must reach the callback
+ * with the right byte range and no data phase, report a corrupted block as
+ * MEDIUM ERROR and an out of range LBA as ILLEGAL REQUEST. mwUSB_Crc32() is
+ * checked against a bitwise CRC-32 and its throughput is printed next to a
+ * byte at a time table loop.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "msc_harness.h"
+#include "mw_usbd_crc32.h"
+#include "test_util.h"
+
+#define BLOCK_SIZE          512
+#define DISK_BLOCKS         256
+#define BENCH_BYTES         (64 * 1024 * 1024)
+
+static uint8_t disk[BLOCK_SIZE * DISK_BLOCKS];
+static uint32_t block_crc[DISK_BLOCKS];
+static uint8_t host_buf[64 * BLOCK_SIZE];
+static uint32_t verify_calls, verify_offset, verify_length, verify_high;
+
+static void disk_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	memcpy(*buff_adr, &disk[offset], length);
+}
+
+static void disk_write(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	uint32_t blk;
+
+	memcpy(&disk[offset], *buff_adr, length);
+	for (blk = offset / BLOCK_SIZE; blk < (offset + length) / BLOCK_SIZE; blk++) {
+		block_crc[blk] = mwUSB_Crc32(0, &disk[blk * BLOCK_SIZE], BLOCK_SIZE);
+	}
+}
+
+static ErrorCode_t disk_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return memcmp(&disk[offset], src, length) ? ERR_FAILED : LPC_OK;
+}
+
+static ErrorCode_t disk_verify_range(uint32_t offset, uint32_t length, uint32_t high_offset)
+{
+	uint32_t blk;
+
+	verify_calls++;
+	verify_offset = offset;
+	verify_length = length;
+	verify_high = high_offset;
+	for (blk = offset / BLOCK_SIZE; blk < (offset + length) / BLOCK_SIZE; blk++) {
+		if (mwUSB_Crc32(0, &disk[blk * BLOCK_SIZE], BLOCK_SIZE) != block_crc[blk]) {
+			return ERR_FAILED;
+		}
+	}
+	return LPC_OK;
+}
+
+static void init_msc(uint8_t with_range)
+{
+	USBD_MSC_INIT_PARAM_T param;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(disk); i++) {
+		disk[i] = (uint8_t) rand();
+	}
+	for (i = 0; i < DISK_BLOCKS; i++) {
+		block_crc[i] = mwUSB_Crc32(0, &disk[i * BLOCK_SIZE], BLOCK_SIZE);
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.InquiryStr = (uint8_t *) "NXP     CRCDISK         1.0 ";
+	param.BlockSize = BLOCK_SIZE;
+	param.BlockCount = DISK_BLOCKS;
+	param.MemorySize = sizeof(disk);
+	param.MSC_Read = disk_read;
+	param.MSC_Write = disk_write;
+	param.MSC_Verify = disk_verify;
+	param.MSC_VerifyRange = with_range ? disk_verify_range : 0;
+	CHECK_EQ(msc_harness_init(&param, USB_HIGH_SPEED, 4), LPC_OK);
+}
+
+/* VERIFY(10) without data, returns the CSW status */
+static uint8_t verify(uint32_t lba, uint32_t blocks, uint32_t data_len, MSC_RESULT_T *res)
+{
+	uint8_t cb[10] = {SCSI_VERIFY10};
+
+	msc_put_be(&cb[2], lba, 4);
+	msc_put_be(&cb[7], blocks, 2);
+	verify_calls = 0;
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 1, host_buf, data_len, res), 0);
+	CHECK_EQ(res->data_len, 0);
+	CHECK_EQ(res->residue, data_len);
+	return res->status;
+}
+
+/* bitwise CRC-32, reflected polynomial 0xEDB88320 */
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+	uint32_t i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+	crc = ~crc;
+	while (len--) {
+		crc = crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void test_crc(void)
+{
+	static uint8_t data[1024];
+	uint32_t i, off, len, crc;
+
+	CHECK_EQ(mwUSB_Crc32(0, (const uint8_t *) "123456789", 9), 0xCBF43926);
+	CHECK_EQ(mwUSB_Crc32(0, data, 0), 0);
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = (uint8_t) rand();
+	}
+	/* every alignment and every tail length */
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len <= 200; len++) {
+			CHECK_EQ(mwUSB_Crc32(0, &data[off], len), crc32_bitwise(0, &data[off], len));
+		}
+	}
+	/* split over several calls */
+	crc = 0;
+	for (off = 0; off < sizeof(data); off += len) {
+		len = 1 + (rand() % 37);
+		if (len > sizeof(data) - off) {
+			len = sizeof(data) - off;
+		}
+		crc = mwUSB_Crc32(crc, &data[off], len);
+	}
+	CHECK_EQ(crc, crc32_bitwise(0, data, sizeof(data)));
+}
+
+static double elapsed_ms(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/* 512 byte blocks, as MSC_VerifyRange() sees them; printed, not checked */
+static void bench_crc(void)
+{
+	struct timespec t0;
+	uint32_t i, j, crc, acc = 0;
+	double ms;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+		crc_table[i] = crc;
+	}
+	CHECK_EQ(crc32_bytewise(0, disk, sizeof(disk)), mwUSB_Crc32(0, disk, sizeof(disk)));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_BYTES / BLOCK_SIZE; i++) {
+		acc += crc32_bytewise(0, &disk[(i % DISK_BLOCKS) * BLOCK_SIZE], BLOCK_SIZE);
+	}
+	ms = elapsed_ms(&t0);
+	printf("byte table:  %7.0f MB/s\n", BENCH_BYTES / 1e3 / ms);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_BYTES / BLOCK_SIZE; i++) {
+		acc -= mwUSB_Crc32(0, &disk[(i % DISK_BLOCKS) * BLOCK_SIZE], BLOCK_SIZE);
+	}
+	ms = elapsed_ms(&t0);
+	printf("mwUSB_Crc32: %7.0f MB/s\n", BENCH_BYTES / 1e3 / ms);
+	CHECK_EQ(acc, 0);
+}
+
+static void test_verify_range(void)
+{
+	MSC_RESULT_T res;
+	uint32_t i;
+
+	/* the whole range reaches the callback, nothing crosses the bus */
+	CHECK_EQ(verify(10, 20, 0, &res), CSW_CMD_PASSED);
+	CHECK_EQ(res.in_xfers, 0);
+	CHECK_EQ(verify_calls, 1);
+	CHECK_EQ(verify_offset, 10 * BLOCK_SIZE);
+	CHECK_EQ(verify_length, 20 * BLOCK_SIZE);
+	CHECK_EQ(verify_high, 0);
+	CHECK_EQ(verify(0, DISK_BLOCKS, 0, &res), CSW_CMD_PASSED);
+	CHECK_EQ(verify_length, sizeof(disk));
+	CHECK_EQ(verify(DISK_BLOCKS - 1, 1, 0, &res), CSW_CMD_PASSED);
+	CHECK_EQ(verify_calls, 1);
+
+	/* zero blocks: nothing to check */
+	CHECK_EQ(verify(5, 0, 0, &res), CSW_CMD_PASSED);
+	CHECK_EQ(verify_calls, 0);
+
+	/* data written over the bus keeps its CRC */
+	for (i = 0; i < 8 * BLOCK_SIZE; i++) {
+		host_buf[i] = (uint8_t) rand();
+	}
+	CHECK_EQ(msc_rw(0, SCSI_WRITE10, 100, 8, BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(verify(96, 16, 0, &res), CSW_CMD_PASSED);
+
+	/* a block changed behind the CRC's back */
+	disk[103 * BLOCK_SIZE + 17] ^= 0x40;
+	CHECK_EQ(verify(96, 16, 0, &res), CSW_CMD_FAILED);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_MEDIUM_ERROR << 16) | (SCSI_ASC_UNRECOVERED_READ_ERROR << 8));
+	CHECK_EQ(verify(104, 8, 0, &res), CSW_CMD_PASSED);
+	CHECK_EQ(verify(103, 1, 0, &res), CSW_CMD_FAILED);
+	disk[103 * BLOCK_SIZE + 17] ^= 0x40;
+	CHECK_EQ(verify(96, 16, 0, &res), CSW_CMD_PASSED);
+
+	/* past the end of the medium */
+	CHECK_EQ(verify(DISK_BLOCKS - 1, 2, 0, &res), CSW_CMD_FAILED);
+	CHECK_EQ(verify_calls, 0);
+	CHECK_EQ(msc_sense(0), (SCSI_SENSE_ILLEGAL_REQUEST << 16) | (SCSI_ASC_LBA_OUT_OF_RANGE << 8));
+	CHECK_EQ(verify(0xFFFFFFFF, 2, 0, &res), CSW_CMD_FAILED);
+	CHECK_EQ(verify_calls, 0);
+
+	/* a host expecting data gets a stall and the full residue */
+	CHECK_EQ(verify(0, 4, 4 * BLOCK_SIZE, &res), CSW_CMD_PASSED);
+	CHECK_EQ(res.stalls, 1);
+	CHECK_EQ(verify_calls, 1);
+}
+
+/* BYTCHK=1 still compares the data sent by the host */
+static void test_verify_bytchk(void)
+{
+	uint8_t cb[10] = {SCSI_VERIFY10, 0x02, 0, 0, 0, 40, 0, 0, 4, 0};
+	MSC_RESULT_T res;
+
+	memcpy(host_buf, &disk[40 * BLOCK_SIZE], 4 * BLOCK_SIZE);
+	verify_calls = 0;
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 0, host_buf, 4 * BLOCK_SIZE, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.residue, 0);
+	CHECK_EQ(verify_calls, 0);
+
+	host_buf[3 * BLOCK_SIZE] ^= 1;
+	CHECK_EQ(msc_cmd(0, cb, sizeof(cb), 0, host_buf, 4 * BLOCK_SIZE, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_FAILED);
+}
+
+int main(void)
+{
+	srand(16);
+	test_crc();
+
+	init_msc(1);
+	bench_crc();
+	test_verify_range();
+	test_verify_bytchk();
+
+	/* without the callback BYTCHK=0 passes unchecked, as before */
+	init_msc(0);
+	{
+		MSC_RESULT_T res;
+
+		disk[0] ^= 1;
+		CHECK_EQ(verify(0, 8, 0, &res), CSW_CMD_PASSED);
+		CHECK_EQ(verify(DISK_BLOCKS, 1, 0, &res), CSW_CMD_FAILED);
+	}
+	return TEST_DONE();
+}
@@ -0,0 +1,113 @@
+/*
+ * MSC WRITE data stage: multi-packet OUT reception (user-002).
+ *
+ * WRITE(10) data must be received RxWindow bytes per ReadReqEP rather than
+ * one packet per OUT interrupt, both straight into the medium through
+ * MSC_GetWriteBuf() and through the transfer buffers with MSC_Write()
+ * copying, and the disk must end up with exactly the data the host sent.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "msc_harness.h"
+#include "test_util.h"
+
+#define DISK_BLOCK_SIZE     512
+#define DISK_BLOCK_COUNT    2048
+
+static uint8_t disk[DISK_BLOCK_SIZE * DISK_BLOCK_COUNT];
+static uint8_t host_buf[DISK_BLOCK_SIZE * DISK_BLOCK_COUNT];
+static uint32_t write_calls;
+
+static void disk_read(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	*buff_adr = &disk[offset];
+}
+
+/* zero copy, like msc_ram translate_wr */
+static void disk_write_in_place(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	write_calls++;
+	*buff_adr = &disk[offset + length];
+}
+
+static void disk_get_write_buf(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	*buff_adr = &disk[offset];
+}
+
+static void disk_write_copy(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+	write_calls++;
+	memcpy(&disk[offset], *buff_adr, length);
+}
+
+static ErrorCode_t disk_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return memcmp(&disk[offset], src, length) ? ERR_FAILED : LPC_OK;
+}
+
+static void test_write(uint32_t window, uint32_t copy, uint32_t xfer_cnt, uint32_t lba, uint32_t blocks)
+{
+	USBD_MSC_INIT_PARAM_T param;
+	MSC_RESULT_T res;
+	uint32_t i, len = blocks * DISK_BLOCK_SIZE, chunk;
+
+	memset(&param, 0, sizeof(param));
+	param.InquiryStr = (uint8_t *) "NXP     RAMDISK         1.0 ";
+	param.BlockSize = DISK_BLOCK_SIZE;
+	param.BlockCount = DISK_BLOCK_COUNT;
+	param.MemorySize = sizeof(disk);
+	param.RxWindow = window;
+	param.XferBufSize = copy ? window : 0;
+	param.XferBufCnt = xfer_cnt;
+	param.MSC_Read = disk_read;
+	param.MSC_Write = copy ? disk_write_copy : disk_write_in_place;
+	param.MSC_GetWriteBuf = copy ? 0 : disk_get_write_buf;
+	param.MSC_Verify = disk_verify;
+	CHECK_EQ(msc_harness_init(&param, USB_HIGH_SPEED, 4), LPC_OK);
+
+	memset(disk, 0, sizeof(disk));
+	for (i = 0; i < len; i++) {
+		host_buf[i] = (uint8_t) rand();
+	}
+	write_calls = 0;
+	CHECK_EQ(msc_rw(0, SCSI_WRITE10, lba, blocks, DISK_BLOCK_SIZE, host_buf, &res), 0);
+	CHECK_EQ(res.status, CSW_CMD_PASSED);
+	CHECK_EQ(res.residue, 0);
+	CHECK_EQ(res.data_len, len);
+	CHECK(memcmp(&disk[lba * DISK_BLOCK_SIZE], host_buf, len) == 0);
+	/* nothing outside the range was touched */
+	for (i = 0; i < lba * DISK_BLOCK_SIZE; i++) {
+		if (disk[i] != 0) {
+			break;
+		}
+	}
+	CHECK_EQ(i, lba * DISK_BLOCK_SIZE);
+
+	/* one OUT transfer per window, plus the CBW */
+	chunk = window ? window : USB_HS_MAX_BULK_PACKET;
+	CHECK_EQ(fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].xfers - 1, (len + chunk - 1) / chunk);
+	printf("window %5u copy %u x%u: %4u blocks in %4u OUT transfers, %4u MSC_Write calls, at most %u queued\n",
+		   window, copy, xfer_cnt, blocks, fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].xfers - 1, write_calls,
+		   fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].max_queued);
+}
+
+int main(void)
+{
+	srand(2);
+
+	/* receive straight into the medium */
+	test_write(0, 0, 1, 0, 2048);
+	test_write(8192, 0, 1, 0, 2048);
+	test_write(16384, 0, 1, 0, 2048);
+	/* window not a multiple of the transfer length */
+	test_write(16384, 0, 1, 7, 45);
+	/* through the transfer buffers */
+	test_write(8192, 1, 1, 3, 1000);
+	CHECK_EQ(write_calls, (1000 * DISK_BLOCK_SIZE + 8191) / 8192);
+	test_write(8192, 1, 2, 3, 1000);
+	CHECK_EQ(write_calls, (1000 * DISK_BLOCK_SIZE + 8191) / 8192);
+	CHECK_EQ(fake_ep[fake_ep_index(MSC_HARNESS_OUT_EP)].max_queued, 2);
+
+	return TEST_DONE();
+}
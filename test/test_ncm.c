@@ -0,0 +1,733 @@
+/*
+ * CDC-NCM NTB packing and parsing (user-020).
+ *
+ * The host side is played by an NTB16 parser for what the device sends and
+ * an NTB16 builder for what it receives. On the fake controller: datagrams
+ * queued while an NTB is on the bus go into the next one, the MaxDatagrams
+ * and NTB size limits, the padding byte in place of a ZLP, the two receive
+ * buffers, chained NDPs and malformed NTBs. The control requests are
+ * checked too: GET_NTB_PARAMETERS, and SET_NTB_INPUT_SIZE sent at alt 0
+ * still holding after the switch to alt 1 and reset by SET_CONFIGURATION
+ * and bus reset. Then a SIGALRM handler plays the controller while the
+ * main loop queues datagrams, and the datagrams per NTB are printed along
+ * with the throughput of the packing path.
+ */
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "fake_hw.h"
+#include "msc_harness.h"
+#include "mw_usbd_cdc.h"
+#include "mw_usbd_ncmuser.h"
+#include "mw_usbd_rom_api.h"
+#include "test_util.h"
+
+/* class handler dispatch of the core, not in a header */
+extern ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event);
+
+#define NCM_INT_EP          0x82
+#define NCM_IN_EP           0x81
+#define NCM_OUT_EP          0x01
+#define NTB_SIZE            16384
+#define MAX_DGS             16
+/* NTH16 and an NDP16 with MAX_DGS entries and the zero entry */
+#define TX_HDR_LEN          (12 + 8 + (MAX_DGS + 1) * 4)
+#define HOST_MAX_DGS        10
+
+/* communication interface 0 with an interrupt IN endpoint, data interface 1
+   with alt 0 empty and alt 1 holding the bulk endpoints */
+static uint8_t ncm_desc[] = {
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 0, 0, 1, CDC_COMMUNICATION_INTERFACE_CLASS, CDC_NETWORK_CONTROL_MODEL, 0, 0,
+	5, CDC_CS_INTERFACE, CDC_HEADER, 0x10, 0x01,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, NCM_INT_EP, USB_ENDPOINT_TYPE_INTERRUPT, 16, 0, 2,
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 1, 0, 0, CDC_DATA_INTERFACE_CLASS, 0, CDC_PROTOCOL_NCM_NTB, 0,
+	9, USB_INTERFACE_DESCRIPTOR_TYPE, 1, 1, 2, CDC_DATA_INTERFACE_CLASS, 0, CDC_PROTOCOL_NCM_NTB, 0,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, NCM_IN_EP, USB_ENDPOINT_TYPE_BULK, 0x00, 0x02, 0,
+	7, USB_ENDPOINT_DESCRIPTOR_TYPE, NCM_OUT_EP, USB_ENDPOINT_TYPE_BULK, 0x00, 0x02, 0,
+};
+#define DIF_ALT1            30
+
+static uint8_t ncm_mem[4 * NTB_SIZE + 4096] __attribute__((aligned(4)));
+static uint8_t host_ntb[NTB_SIZE + 4] __attribute__((aligned(4)));
+static uint8_t dg_buf[2048];
+static USBD_HANDLE_T hNcm;
+
+/* receive side: datagrams must arrive with consecutive numbers */
+static volatile uint32_t rx_seq, rx_dgs, rx_errors;
+/* send side: numbers the host parser expects next */
+static uint32_t in_seq, in_ntb_seq, in_ntb_limit;
+static uint8_t in_first;
+
+/* datagram n: 14 to 1514 bytes, its number first, then a pattern */
+static uint32_t dg_len(uint32_t n)
+{
+	return 14 + ((n * 2654435761U) >> 20) % 1501;
+}
+
+static void dg_make(uint8_t *d, uint32_t n, uint32_t len)
+{
+	uint32_t i;
+
+	memcpy(d, &n, 4);
+	for (i = 4; i < len; i++) {
+		d[i] = (uint8_t) (n + i);
+	}
+}
+
+static int dg_check(const uint8_t *d, uint32_t len, uint32_t n, uint32_t want_len)
+{
+	uint32_t i;
+
+	if ((len != want_len) || memcmp(d, &n, 4)) {
+		return 1;
+	}
+	for (i = 4; i < len; i++) {
+		if (d[i] != (uint8_t) (n + i)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void recv_datagram(USBD_HANDLE_T h, uint8_t *data, uint32_t len)
+{
+	if ((h != hNcm) || dg_check(data, len, rx_seq, dg_len(rx_seq))) {
+		rx_errors++;
+	}
+	rx_seq++;
+	rx_dgs++;
+}
+
+/* host parser: checks an IN NTB of len bytes and the datagrams in it, in
+   order from in_seq. Returns the number of datagrams, ~0 when malformed. */
+static uint32_t host_parse(const uint8_t *ntb, uint32_t len, uint32_t fixed_len)
+{
+	const NCM_NTH16 *nth = (const NCM_NTH16 *) ntb;
+	const NCM_NDP16 *ndp;
+	const NCM_DPE16 *dpe;
+	uint32_t n = 0;
+
+	if ((nth->dwSignature != NCM_NTH16_SIGNATURE) || (nth->wHeaderLength != sizeof(NCM_NTH16)) ||
+		(nth->wBlockLength != len) || (len > in_ntb_limit) || (nth->wNdpIndex & 3) ||
+		(nth->wNdpIndex + 16U > len)) {
+		return ~0U;
+	}
+	if (!in_first && (nth->wSequence != (uint16_t) (in_ntb_seq + 1))) {
+		return ~0U;
+	}
+	in_first = 0;
+	in_ntb_seq = nth->wSequence;
+
+	ndp = (const NCM_NDP16 *) (ntb + nth->wNdpIndex);
+	if ((ndp->dwSignature != NCM_NDP16_NOCRC_SIGNATURE) || (ndp->wNextNdpIndex != 0) ||
+		(nth->wNdpIndex + ndp->wLength > len)) {
+		return ~0U;
+	}
+	for (dpe = ndp->Dpe; dpe->wDatagramIndex != 0; dpe++, n++) {
+		if ((ndp->wLength < 8 + (n + 2) * sizeof(NCM_DPE16)) || (dpe->wDatagramIndex & 3) ||
+			(dpe->wDatagramIndex + dpe->wDatagramLength > len) ||
+			dg_check(ntb + dpe->wDatagramIndex, dpe->wDatagramLength, in_seq,
+					 fixed_len ? fixed_len : dg_len(in_seq))) {
+			return ~0U;
+		}
+		in_seq++;
+	}
+	return n;
+}
+
+/* host builder: an OUT NTB of count datagrams from number seq, their
+   entries spread over ndps chained NDPs. Returns the NTB length. */
+static uint32_t host_build(uint8_t *ntb, uint32_t seq, uint32_t count, uint32_t ndps)
+{
+	NCM_NTH16 *nth = (NCM_NTH16 *) ntb;
+	NCM_NDP16 *ndp;
+	uint32_t i, j, k, per, off, tab, len;
+
+	/* the tables first, then the datagrams */
+	per = (count + ndps - 1) / ndps;
+	off = sizeof(NCM_NTH16) + ndps * (8 + (per + 1) * sizeof(NCM_DPE16));
+	tab = sizeof(NCM_NTH16);
+	for (i = 0, j = 0; j < ndps; j++) {
+		ndp = (NCM_NDP16 *) (ntb + tab);
+		ndp->dwSignature = NCM_NDP16_NOCRC_SIGNATURE;
+		for (k = 0; (k < per) && (i < count); k++, i++) {
+			len = dg_len(seq + i);
+			dg_make(ntb + off, seq + i, len);
+			ndp->Dpe[k].wDatagramIndex = off;
+			ndp->Dpe[k].wDatagramLength = len;
+			off = (off + len + 3) & ~3;
+		}
+		ndp->Dpe[k].wDatagramIndex = 0;
+		ndp->Dpe[k].wDatagramLength = 0;
+		ndp->wLength = 8 + (k + 1) * sizeof(NCM_DPE16);
+		ndp->wNextNdpIndex = (j + 1 < ndps) ? tab + 8 + (per + 1) * sizeof(NCM_DPE16) : 0;
+		tab += 8 + (per + 1) * sizeof(NCM_DPE16);
+	}
+	nth->dwSignature = NCM_NTH16_SIGNATURE;
+	nth->wHeaderLength = sizeof(NCM_NTH16);
+	nth->wSequence = (uint16_t) seq;
+	nth->wBlockLength = off;
+	nth->wNdpIndex = sizeof(NCM_NTH16);
+	return off;
+}
+
+/* the core's SET_INTERFACE without the descriptor walk */
+static ErrorCode_t set_interface(USBD_HANDLE_T hUsb)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+
+	pCtrl->alt_setting[pCtrl->SetupPacket.wIndex.WB.L] = pCtrl->SetupPacket.wValue.WB.L;
+	return LPC_OK;
+}
+
+static ErrorCode_t init_ncm(uint32_t speed, uint32_t mem_size, USBD_NCM_INIT_PARAM_T *param)
+{
+	ErrorCode_t ret;
+
+	CHECK_EQ(msc_harness_init_core(speed, 1), LPC_OK);
+	/* the NCM endpoints go up to 0x82 */
+	msc_core.max_num_ep = USB_MAX_EP_NUM;
+	msc_core.config_value = 1;
+	msc_core.USB_ReqSetInterface = set_interface;
+
+	param->mem_base = (uint32_t) ncm_mem;
+	param->mem_size = mem_size;
+	ret = mwNCM_init(&msc_core, param, &hNcm);
+	if (ret == LPC_OK) {
+		/* the pool is used within the size GetMemSize() asked for */
+		CHECK(mem_size - param->mem_size <= mwNCM_GetMemSize(param));
+	}
+	rx_seq = rx_dgs = rx_errors = 0;
+	in_seq = 0;
+	in_first = 1;
+	in_ntb_limit = NTB_SIZE;
+	return ret;
+}
+
+static void default_param(USBD_NCM_INIT_PARAM_T *param)
+{
+	memset(param, 0, sizeof(*param));
+	param->cif_intf_desc = ncm_desc;
+	param->dif_intf_desc = &ncm_desc[DIF_ALT1];
+	param->NtbInSize = NTB_SIZE;
+	param->NtbOutSize = NTB_SIZE;
+	param->MaxDatagrams = MAX_DGS;
+	param->NCM_RecvDatagram = recv_datagram;
+}
+
+static ErrorCode_t init_default(uint32_t speed)
+{
+	USBD_NCM_INIT_PARAM_T param;
+
+	default_param(&param);
+	return init_ncm(speed, sizeof(ncm_mem), &param);
+}
+
+static ErrorCode_t setup(uint8_t type, uint8_t req, uint16_t value, uint16_t index, uint16_t len)
+{
+	msc_core.SetupPacket.bmRequestType.B = type;
+	msc_core.SetupPacket.bRequest = req;
+	msc_core.SetupPacket.wValue.W = value;
+	msc_core.SetupPacket.wIndex.W = index;
+	msc_core.SetupPacket.wLength = len;
+	msc_core.EP0Data.Count = len;
+	return USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_SETUP);
+}
+
+/* class request to the communication interface, with an OUT data stage
+   when data is given */
+static ErrorCode_t class_req(uint8_t req, uint16_t value, const void *data, uint16_t len)
+{
+	ErrorCode_t ret;
+
+	ret = setup(data ? 0x21 : 0xA1, req, value, 0, len);
+	if ((ret == LPC_OK) && data) {
+		memcpy(msc_core.EP0Buf, data, len);
+		ret = USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_OUT);
+	}
+	return ret;
+}
+
+static ErrorCode_t set_alt(uint8_t alt)
+{
+	return setup(0x01, USB_REQUEST_SET_INTERFACE, alt, 1, 0);
+}
+
+static uint32_t get_input_size(void)
+{
+	uint32_t size = 0;
+
+	CHECK_EQ(class_req(NCM_GET_NTB_INPUT_SIZE, 0, 0, 4), LPC_OK);
+	memcpy(&size, msc_core.EP0Buf, 4);
+	return size;
+}
+
+static uint32_t send(uint32_t n, uint32_t len)
+{
+	dg_make(dg_buf, n, len);
+	return mwNCM_SendDatagram(hNcm, dg_buf, len);
+}
+
+/* retires the queued IN NTB and parses it, returns the number of datagrams
+   or ~0 if none is queued or it is malformed */
+static uint32_t take_ntb(uint32_t fixed_len, uint32_t *ntb_len)
+{
+	FAKE_XFER_T *xfer = fake_hw_peek(NCM_IN_EP);
+	uint32_t n;
+
+	if (xfer == 0) {
+		return ~0U;
+	}
+	n = host_parse(xfer->data, xfer->len, fixed_len);
+	if (ntb_len) {
+		*ntb_len = xfer->len;
+	}
+	CHECK_EQ(fake_hw_complete_in(&msc_core, NCM_IN_EP), LPC_OK);
+	return n;
+}
+
+static void test_init(void)
+{
+	USBD_NCM_INIT_PARAM_T param;
+
+	default_param(&param);
+	/* a pool one word too small */
+	CHECK_EQ(init_ncm(USB_HIGH_SPEED, mwNCM_GetMemSize(&param) - 4, &param), ERR_USBD_BAD_MEM_BUF);
+	default_param(&param);
+	CHECK_EQ(init_ncm(USB_HIGH_SPEED, mwNCM_GetMemSize(&param), &param), LPC_OK);
+	default_param(&param);
+	param.NCM_RecvDatagram = 0;
+	CHECK_EQ(init_ncm(USB_HIGH_SPEED, sizeof(ncm_mem), &param), ERR_API_INVALID_PARAM2);
+	/* the data interface must be given at alt 1 */
+	default_param(&param);
+	param.dif_intf_desc = &ncm_desc[DIF_ALT1 - 9];
+	CHECK_EQ(init_ncm(USB_HIGH_SPEED, sizeof(ncm_mem), &param), ERR_USBD_BAD_INTF_DESC);
+	/* sizes are limited, 0 datagrams selects 16 */
+	default_param(&param);
+	param.NtbInSize = 100;
+	param.NtbOutSize = 100000;
+	param.MaxDatagrams = 0;
+	CHECK_EQ(init_ncm(USB_HIGH_SPEED, sizeof(ncm_mem), &param), LPC_OK);
+	CHECK_EQ(((USB_NCM_CTRL_T *) hNcm)->NtbInMax, NCM_NTB_MIN_SIZE);
+	CHECK_EQ(((USB_NCM_CTRL_T *) hNcm)->NtbOutSize, USB_NCM_MAX_NTB_SIZE);
+	CHECK_EQ(((USB_NCM_CTRL_T *) hNcm)->MaxDatagrams, 16);
+
+	/* ncm follows version in the API table, version keeps its offset */
+	CHECK_EQ(offsetof(USBD_API_T, version), 7 * sizeof(void *));
+	CHECK(offsetof(USBD_API_T, ncm) > offsetof(USBD_API_T, version));
+	CHECK(usb_api.ncm->SendDatagram == mwNCM_SendDatagram);
+	CHECK(usb_api.ncm->init == mwNCM_init);
+}
+
+static void test_link(void)
+{
+	FAKE_XFER_T *xfer;
+	uint32_t rate;
+
+	CHECK_EQ(init_default(USB_HIGH_SPEED), LPC_OK);
+	/* nothing is sent at alt 0 */
+	CHECK_EQ(send(0, 100), 0);
+	CHECK(fake_hw_peek(NCM_INT_EP) == 0);
+
+	/* alt 1: the link speed, then the connection */
+	CHECK_EQ(set_alt(1), LPC_OK);
+	xfer = fake_hw_peek(NCM_INT_EP);
+	CHECK(xfer && (xfer->len == 16) && (xfer->data[1] == CDC_CONNECTION_SPEED_CHANGE));
+	if (xfer) {
+		memcpy(&rate, &xfer->data[8], 4);
+		CHECK_EQ(rate, 480000000);
+	}
+	CHECK_EQ(fake_hw_complete_in(&msc_core, NCM_INT_EP), LPC_OK);
+	xfer = fake_hw_peek(NCM_INT_EP);
+	CHECK(xfer && (xfer->len == 8) && (xfer->data[1] == CDC_NOTIFICATION_NETWORK_CONNECTION) &&
+		  (xfer->data[2] == 1));
+	CHECK_EQ(fake_hw_complete_in(&msc_core, NCM_INT_EP), LPC_OK);
+	CHECK(fake_hw_peek(NCM_INT_EP) == 0);
+
+	CHECK_EQ(send(0, 100), 100);
+	CHECK_EQ(take_ntb(100, 0), 1);
+	/* back to alt 0 stops the data path */
+	CHECK_EQ(set_alt(0), LPC_OK);
+	CHECK_EQ(send(1, 100), 0);
+}
+
+static void test_in(uint32_t speed)
+{
+	uint32_t i, n, len, pkt = (speed == USB_HIGH_SPEED) ? 512 : 64;
+
+	CHECK_EQ(init_default(speed), LPC_OK);
+	CHECK_EQ(set_alt(1), LPC_OK);
+	fake_hw_reset();
+
+	/* an idle endpoint sends the first datagram at once */
+	CHECK_EQ(send(0, 100), 100);
+	CHECK_EQ(fake_ep[fake_ep_index(NCM_IN_EP)].count, 1);
+	/* the next ones are packed while it is on the bus */
+	for (i = 1; i < 6; i++) {
+		CHECK_EQ(send(i, 100), 100);
+	}
+	CHECK_EQ(fake_ep[fake_ep_index(NCM_IN_EP)].count, 1);
+	CHECK_EQ(take_ntb(100, &len), 1);
+	CHECK_EQ(len, TX_HDR_LEN + 100);
+	CHECK_EQ(take_ntb(100, 0), 5);
+	CHECK_EQ(take_ntb(100, 0), ~0U);
+
+	/* one NTB on the bus, the other full at MaxDatagrams: the next datagram
+	   waits for the bus */
+	CHECK_EQ(send(in_seq, 60), 60);
+	for (i = 1; i <= MAX_DGS; i++) {
+		CHECK_EQ(send(in_seq + i, 60), 60);
+	}
+	CHECK_EQ(send(in_seq + i, 60), 0);
+	CHECK_EQ(take_ntb(60, 0), 1);
+	CHECK_EQ(send(in_seq + MAX_DGS, 60), 60);
+	CHECK_EQ(take_ntb(60, 0), MAX_DGS);
+	CHECK_EQ(take_ntb(60, 0), 1);
+	CHECK_EQ(take_ntb(60, 0), ~0U);
+
+	/* the NTB size limits the datagrams as well: 10 of 1500 bytes fit */
+	CHECK_EQ(send(in_seq, 1500), 1500);
+	n = 1;
+	while (send(in_seq + n, 1500) == 1500) {
+		n++;
+	}
+	CHECK_EQ(n, 1 + (NTB_SIZE - TX_HDR_LEN) / 1500);
+	CHECK_EQ(take_ntb(1500, 0), 1);
+	CHECK_EQ(take_ntb(1500, &len), n - 1);
+	CHECK(len <= NTB_SIZE);
+	CHECK_EQ(take_ntb(1500, 0), ~0U);
+
+	/* an NTB of whole packets gets a padding byte instead of a ZLP */
+	CHECK_EQ(send(in_seq, 4 * pkt - TX_HDR_LEN), 4 * pkt - TX_HDR_LEN);
+	CHECK_EQ(take_ntb(4 * pkt - TX_HDR_LEN, &len), 1);
+	CHECK_EQ(len, 4 * pkt + 1);
+	CHECK_EQ(take_ntb(0, 0), ~0U);
+	/* but not when it fills the NTB size, the host stops there */
+	CHECK_EQ(send(in_seq, NTB_SIZE - TX_HDR_LEN), NTB_SIZE - TX_HDR_LEN);
+	CHECK_EQ(take_ntb(NTB_SIZE - TX_HDR_LEN, &len), 1);
+	CHECK_EQ(len, NTB_SIZE);
+	/* too large for an NTB */
+	CHECK_EQ(send(in_seq, NTB_SIZE - TX_HDR_LEN + 1), 0);
+}
+
+static void host_out(uint32_t seq, uint32_t count, uint32_t ndps)
+{
+	uint32_t len = host_build(host_ntb, seq, count, ndps);
+
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+}
+
+static void test_out(void)
+{
+	FAKE_XFER_T *xfer;
+	uint8_t *first;
+	uint32_t len;
+
+	CHECK_EQ(init_default(USB_HIGH_SPEED), LPC_OK);
+	CHECK_EQ(set_alt(1), LPC_OK);
+	fake_hw_reset();
+
+	/* primed on the first NAK, every datagram handed on in order */
+	host_out(0, 10, 1);
+	CHECK_EQ(rx_dgs, 10);
+	/* the other buffer is queued while the NTB is unpacked */
+	xfer = fake_hw_peek(NCM_OUT_EP);
+	CHECK(xfer != 0);
+	first = xfer ? xfer->data : 0;
+	host_out(10, 3, 1);
+	xfer = fake_hw_peek(NCM_OUT_EP);
+	CHECK(xfer && (xfer->data != first) && (xfer->len == NTB_SIZE));
+	/* chained NDPs */
+	host_out(13, 9, 3);
+	CHECK_EQ(rx_dgs, 22);
+	CHECK_EQ(rx_errors, 0);
+
+	/* malformed NTBs are dropped */
+	len = host_build(host_ntb, rx_seq, 4, 2);
+	((NCM_NTH16 *) host_ntb)->dwSignature ^= 1;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	len = host_build(host_ntb, rx_seq, 4, 2);
+	((NCM_NTH16 *) host_ntb)->wHeaderLength = 16;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	len = host_build(host_ntb, rx_seq, 4, 2);
+	((NCM_NTH16 *) host_ntb)->wBlockLength = len + 4;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	len = host_build(host_ntb, rx_seq, 4, 2);
+	((NCM_NTH16 *) host_ntb)->wNdpIndex = 14;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	len = host_build(host_ntb, rx_seq, 4, 2);
+	((NCM_NTH16 *) host_ntb)->wNdpIndex = len;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	len = host_build(host_ntb, rx_seq, 4, 1);
+	((NCM_NDP16 *) &host_ntb[12])->dwSignature = NCM_NDP16_CRC_SIGNATURE;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	len = host_build(host_ntb, rx_seq, 4, 1);
+	((NCM_NDP16 *) &host_ntb[12])->wLength = len;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	CHECK_EQ(rx_dgs, 22);
+	/* a bad second NDP drops the rest, the first one is handed on */
+	len = host_build(host_ntb, rx_seq, 4, 2);
+	((NCM_NDP16 *) &host_ntb[12])->wNextNdpIndex = 13;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	CHECK_EQ(rx_dgs, 24);
+	/* a datagram beyond the NTB is skipped */
+	len = host_build(host_ntb, rx_seq, 3, 1);
+	((NCM_NDP16 *) &host_ntb[12])->Dpe[1].wDatagramLength = len;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	CHECK_EQ(rx_dgs, 26);
+	CHECK_EQ(rx_errors, 1);
+	/* an NDP chain looping on itself ends */
+	rx_seq = 1000;
+	len = host_build(host_ntb, rx_seq, 1, 1);
+	((NCM_NDP16 *) &host_ntb[12])->wNextNdpIndex = 12;
+	rx_errors = 0;
+	rx_dgs = 0;
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), len);
+	CHECK(rx_dgs >= 1 && rx_dgs <= 16);
+
+	/* nothing is received at alt 0 */
+	CHECK_EQ(set_alt(0), LPC_OK);
+	fake_hw_reset();
+	rx_dgs = 0;
+	len = host_build(host_ntb, rx_seq, 2, 1);
+	CHECK_EQ(fake_hw_host_out(&msc_core, NCM_OUT_EP, host_ntb, len), 0);
+	CHECK_EQ(rx_dgs, 0);
+}
+
+static void test_ctrl(void)
+{
+	NCM_NTB_PARAMETERS prm;
+	uint32_t size, len, i;
+
+	CHECK_EQ(init_default(USB_HIGH_SPEED), LPC_OK);
+
+	CHECK_EQ(class_req(NCM_GET_NTB_PARAMETERS, 0, 0, sizeof(prm)), LPC_OK);
+	memcpy(&prm, msc_core.EP0Buf, sizeof(prm));
+	CHECK_EQ(prm.wLength, sizeof(NCM_NTB_PARAMETERS));
+	CHECK_EQ(prm.bmNtbFormatsSupported, NCM_NTB_FORMATS_16);
+	CHECK_EQ(prm.dwNtbInMaxSize, NTB_SIZE);
+	CHECK_EQ(prm.dwNtbOutMaxSize, NTB_SIZE);
+	CHECK_EQ(prm.wNdpInDivisor, 4);
+	CHECK_EQ(prm.wNdpOutAlignment, 4);
+	CHECK_EQ(get_input_size(), NTB_SIZE);
+
+	/* only the 16-bit format */
+	CHECK_EQ(class_req(NCM_SET_NTB_FORMAT, NCM_NTB_FORMAT_16, 0, 0), LPC_OK);
+	CHECK_EQ(class_req(NCM_SET_NTB_FORMAT, 1, 0, 0), ERR_USBD_STALL);
+
+	/* sizes out of range stall */
+	size = NCM_NTB_MIN_SIZE - 4;
+	CHECK_EQ(class_req(NCM_SET_NTB_INPUT_SIZE, 0, &size, 4), ERR_USBD_STALL);
+	size = NTB_SIZE + 4;
+	CHECK_EQ(class_req(NCM_SET_NTB_INPUT_SIZE, 0, &size, 4), ERR_USBD_STALL);
+	CHECK_EQ(class_req(NCM_SET_NTB_INPUT_SIZE, 0, &size, 5), ERR_USBD_STALL);
+
+	/* set at alt 0 as hosts do, still in force after the switch to alt 1 */
+	size = 4096 + 2;
+	CHECK_EQ(class_req(NCM_SET_NTB_INPUT_SIZE, 0, &size, 4), LPC_OK);
+	CHECK_EQ(get_input_size(), 4096);
+	CHECK_EQ(set_alt(1), LPC_OK);
+	fake_hw_reset();
+	CHECK_EQ(get_input_size(), 4096);
+	in_ntb_limit = 4096;
+	CHECK_EQ(send(0, 1500), 1500);
+	for (i = 1; send(i, 1500) == 1500; i++) {
+	}
+	CHECK_EQ(i, 1 + (4096 - TX_HDR_LEN) / 1500);
+	CHECK_EQ(take_ntb(1500, 0), 1);
+	CHECK_EQ(take_ntb(1500, &len), i - 1);
+	CHECK(len <= 4096);
+
+	/* SET_CONFIGURATION stops the data path and restores the size, and is
+	   left to the core */
+	CHECK_EQ(setup(0x00, USB_REQUEST_SET_CONFIGURATION, 1, 0, 0), ERR_USBD_UNHANDLED);
+	CHECK_EQ(get_input_size(), NTB_SIZE);
+	CHECK_EQ(send(i, 100), 0);
+
+	/* so does a bus reset */
+	size = 4096;
+	CHECK_EQ(class_req(NCM_SET_NTB_INPUT_SIZE, 0, &size, 4), LPC_OK);
+	CHECK_EQ(set_alt(1), LPC_OK);
+	USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_RESET);
+	CHECK_EQ(get_input_size(), NTB_SIZE);
+	CHECK_EQ(send(i, 100), 0);
+}
+
+/*
+ * Interrupt driven run. The controller model below is used from the signal
+ * handler, so it only keeps one transfer per direction in volatile state
+ * instead of the fake controller queues.
+ */
+static volatile uint32_t in_busy, out_busy, dbl_queued, data_errors;
+static uint8_t *volatile in_data, *volatile out_data;
+static volatile uint32_t in_len, out_len, out_got;
+static volatile uint32_t in_xfers, in_dgs, out_xfers, out_seq;
+static volatile uint64_t in_bytes;
+static volatile int32_t out_left;
+static USBD_HW_API_T async_hw;
+
+static uint32_t async_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt)
+{
+	if (EPNum != NCM_IN_EP) {
+		return cnt;
+	}
+	if (in_busy) {
+		dbl_queued++;
+	}
+	in_data = pData;
+	in_len = cnt;
+	in_busy = 1;
+	return cnt;
+}
+
+static uint32_t async_ReadReqEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t len)
+{
+	if (out_busy) {
+		dbl_queued++;
+	}
+	out_data = pData;
+	out_len = len;
+	out_busy = 1;
+	return len;
+}
+
+static uint32_t async_ReadEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData)
+{
+	return out_got;
+}
+
+static void async_isr(void)
+{
+	uint32_t n, count, size;
+
+	if (in_busy) {
+		in_busy = 0;
+		n = host_parse(in_data, in_len, 0);
+		if (n == ~0U) {
+			data_errors++;
+		}
+		else {
+			in_dgs += n;
+		}
+		in_bytes += in_len;
+		in_xfers++;
+		fake_hw_event(&msc_core, NCM_IN_EP, USB_EVT_IN);
+	}
+	if (out_busy) {
+		/* as many datagrams as fit the primed buffer */
+		count = 0;
+		size = sizeof(NCM_NTH16) + 8 + (HOST_MAX_DGS + 1) * sizeof(NCM_DPE16);
+		while ((count < HOST_MAX_DGS) && ((int32_t) count < out_left) &&
+			   (size + dg_len(out_seq + count) <= out_len)) {
+			size = (size + dg_len(out_seq + count) + 3) & ~3;
+			count++;
+		}
+		out_got = host_build(out_data, out_seq, count, 1);
+		out_seq += count;
+		out_left -= count;
+		out_busy = 0;
+		out_xfers++;
+		fake_hw_event(&msc_core, NCM_OUT_EP, USB_EVT_OUT);
+	}
+	else if (out_left > 0) {
+		fake_hw_event(&msc_core, NCM_OUT_EP, USB_EVT_OUT_NAK);
+	}
+}
+
+static void async_signal(int sig)
+{
+	async_isr();
+}
+
+static void async_start(uint32_t speed, int32_t out_total)
+{
+	CHECK_EQ(init_default(speed), LPC_OK);
+	CHECK_EQ(set_alt(1), LPC_OK);
+	async_hw = fake_hw_api;
+	async_hw.WriteEP = async_WriteEP;
+	async_hw.ReadReqEP = async_ReadReqEP;
+	async_hw.ReadEP = async_ReadEP;
+	msc_core.hw_api = &async_hw;
+	in_busy = out_busy = 0;
+	in_bytes = in_xfers = in_dgs = out_xfers = out_seq = 0;
+	dbl_queued = data_errors = 0;
+	out_left = out_total;
+}
+
+static void test_async(uint32_t speed, uint32_t in_total, int32_t out_total)
+{
+	struct itimerval timer = {{0, 50}, {0, 50}};
+	/* a stalled data path fails the checks below instead of hanging */
+	time_t deadline = time(0) + 10;
+	uint32_t seq = 0;
+
+	async_start(speed, out_total);
+	signal(SIGALRM, async_signal);
+	setitimer(ITIMER_REAL, &timer, 0);
+
+	while (((seq < in_total) || (rx_dgs < (uint32_t) out_total) || (in_dgs < in_total)) &&
+		   (time(0) < deadline)) {
+		if ((seq < in_total) && send(seq, dg_len(seq))) {
+			seq++;
+		}
+	}
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, 0);
+	signal(SIGALRM, SIG_DFL);
+
+	CHECK_EQ(in_dgs, in_total);
+	CHECK_EQ(rx_dgs, out_total);
+	CHECK_EQ(data_errors + rx_errors, 0);
+	CHECK_EQ(dbl_queued, 0);
+	printf("%s speed: IN %u datagrams in %u NTBs, %.1f per NTB, %.0f bytes each; OUT %u NTBs\n",
+		   (speed == USB_HIGH_SPEED) ? "high" : "full", in_dgs, in_xfers, (double) in_dgs / in_xfers,
+		   (double) in_bytes / in_xfers, out_xfers);
+}
+
+/* packing path only, completions inline; printed, not checked */
+static void bench(void)
+{
+	struct timespec t0, t1;
+	uint32_t seq = 0, total = 2000000;
+	uint64_t bytes = 0;
+	double s;
+
+	async_start(USB_HIGH_SPEED, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (seq < total) {
+		dg_make(dg_buf, seq, dg_len(seq));
+		if (mwNCM_SendDatagram(hNcm, dg_buf, dg_len(seq))) {
+			bytes += dg_len(seq);
+			seq++;
+		}
+		else {
+			async_isr();
+		}
+	}
+	while (in_busy) {
+		async_isr();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	CHECK_EQ(in_dgs, total);
+	CHECK_EQ(data_errors, 0);
+	printf("packing path: %.0f MB/s, %.1f datagrams per NTB\n", bytes / s / 1e6, (double) in_dgs / in_xfers);
+}
+
+int main(void)
+{
+	test_init();
+	test_link();
+	test_in(USB_HIGH_SPEED);
+	test_in(USB_FULL_SPEED);
+	test_out();
+	test_ctrl();
+	test_async(USB_HIGH_SPEED, 200000, 200000);
+	test_async(USB_FULL_SPEED, 50000, 50000);
+	bench();
+	return TEST_DONE();
+}
@@ -0,0 +1,307 @@
+/*
+ * Descriptor index built by mwUSB_InitCore() (user-017).
+ *
+ * A composite device with a full table of string descriptors and eight
+ * interfaces of two alternate settings each, for both speeds. Every
+ * GET_DESCRIPTOR request must return the descriptor the old linear walk
+ * found, the interface and endpoint lookups must return the alternate
+ * setting 0 descriptors, and descriptor sets which overflow the tables
+ * must be refused at init. The cost of a string request is printed next
+ * to the cost of the walk.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mw_usbd.h"
+#include "mw_usbd_core.h"
+#include "mw_usbd_desc.h"
+#include "mw_usbd_hw.h"
+#include "test_util.h"
+
+/* standard request handler of the core, not in a header */
+extern ErrorCode_t USB_ReqGetDescriptor(USBD_HANDLE_T hUsb);
+
+#define NUM_INTF            USB_MAX_IF_NUM
+#define MSC_INTF            5
+#define HID_INTF            6
+#define BENCH_REQUESTS      2000000
+
+static USB_CORE_CTRL_T core;
+static uint8_t dev_desc[USB_DEVICE_DESC_SIZE] = {
+	USB_DEVICE_DESC_SIZE, USB_DEVICE_DESCRIPTOR_TYPE, 0x01, 0x02, 0xEF, 0x02, 0x01, USB_MAX_PACKET0,
+	0xC9, 0x1F, 0x00, 0x00, 0x00, 0x01, 1, 2, 3, 1
+};
+static uint8_t qual_desc[USB_DEVICE_QUALI_SIZE] = {USB_DEVICE_QUALI_SIZE, USB_DEVICE_QUALIFIER_DESCRIPTOR_TYPE};
+static uint8_t bos_desc[] = {5, USB_BOS_TYPE, 12, 0, 1, 7, 0x10, 0x02, 0x02, 0, 0, 0, 0};
+/* one spare string for the overflow case, and the terminating zero */
+static uint8_t str_desc[(USB_MAX_STRING_NUM + 1) * 64 + 1];
+/* two configurations, for the overflow case */
+static uint8_t cfg_desc[2][2 * 1024 + 1];
+
+static uint32_t make_strings(uint32_t num)
+{
+	uint32_t i, len, pos = 0;
+
+	memset(str_desc, 0, sizeof(str_desc));
+	for (i = 0; i < num; i++) {
+		len = 2 + 2 * (1 + (i * 7) % 30);
+		str_desc[pos] = len;
+		str_desc[pos + 1] = USB_STRING_DESCRIPTOR_TYPE;
+		str_desc[pos + 2] = (uint8_t) i;
+		pos += len;
+	}
+	return pos;
+}
+
+/* alt 0 of interface i has one endpoint, IN for the first five; alt 1
+   reuses the address with another packet size */
+static uint32_t intf_ep(uint32_t i)
+{
+	return (i < 5) ? (0x81 + i) : (i - 4);
+}
+
+static uint32_t make_config(uint8_t *q, uint32_t speed, uint32_t cfg_value)
+{
+	uint32_t i, alt, o = USB_CONFIGURATION_DESC_SIZE;
+	uint32_t mps = (speed == USB_HIGH_SPEED) ? 512 : 64;
+
+	for (i = 0; i < NUM_INTF; i++) {
+		for (alt = 0; alt < 2; alt++) {
+			q[o + 0] = USB_INTERFACE_DESC_SIZE;
+			q[o + 1] = USB_INTERFACE_DESCRIPTOR_TYPE;
+			q[o + 2] = i;
+			q[o + 3] = alt;
+			q[o + 4] = 1;
+			q[o + 5] = (i == MSC_INTF) ? USB_DEVICE_CLASS_STORAGE :
+					   (i == HID_INTF) ? USB_DEVICE_CLASS_HUMAN_INTERFACE : 0xFF;
+			q[o + 8] = 4 + (i % 8);
+			o += USB_INTERFACE_DESC_SIZE;
+			/* class specific descriptor before the endpoint */
+			q[o + 0] = 5;
+			q[o + 1] = 0x24;
+			o += 5;
+			q[o + 0] = USB_ENDPOINT_DESC_SIZE;
+			q[o + 1] = USB_ENDPOINT_DESCRIPTOR_TYPE;
+			q[o + 2] = intf_ep(i);
+			q[o + 3] = USB_ENDPOINT_TYPE_BULK;
+			q[o + 4] = (uint8_t) (alt ? 8 : mps);
+			q[o + 5] = (uint8_t) ((alt ? 8 : mps) >> 8);
+			o += USB_ENDPOINT_DESC_SIZE;
+		}
+	}
+	q[0] = USB_CONFIGURATION_DESC_SIZE;
+	q[1] = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+	q[2] = (uint8_t) o;
+	q[3] = (uint8_t) (o >> 8);
+	q[4] = NUM_INTF;
+	q[5] = cfg_value;
+	q[7] = USB_CONFIG_BUS_POWERED;
+	q[8] = USB_CONFIG_POWER_MA(100);
+	return o;
+}
+
+static ErrorCode_t init_core(uint32_t num_strings, uint32_t num_configs)
+{
+	USB_CORE_DESCS_T desc;
+	USBD_API_INIT_PARAM_T param;
+	uint32_t s, len;
+
+	make_strings(num_strings);
+	memset(cfg_desc, 0, sizeof(cfg_desc));
+	for (s = 0; s < 2; s++) {
+		len = make_config(cfg_desc[s], s, 1);
+		if (num_configs > 1) {
+			make_config(&cfg_desc[s][len], s, 2);
+		}
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.max_num_ep = USB_MAX_EP_NUM;
+	memset(&desc, 0, sizeof(desc));
+	desc.device_desc = dev_desc;
+	desc.string_desc = str_desc;
+	desc.full_speed_desc = cfg_desc[USB_FULL_SPEED];
+	desc.high_speed_desc = cfg_desc[USB_HIGH_SPEED];
+	desc.device_qualifier = qual_desc;
+	desc.bos_descriptor = bos_desc;
+	return mwUSB_InitCore(&core, &desc, &param);
+}
+
+/* what USB_ReqGetDescriptor used to do: walk the list to the n-th entry */
+static uint8_t *walk(uint8_t *pD, uint32_t n, uint32_t total)
+{
+	uint32_t i;
+
+	for (i = 0; (i != n) && (pD[0] != 0); i++) {
+		pD += total ? (pD[2] | (pD[3] << 8)) : pD[0];
+	}
+	return pD[0] ? pD : NULL;
+}
+
+static ErrorCode_t get_desc(uint8_t type, uint8_t index, uint16_t length)
+{
+	core.SetupPacket.bmRequestType.B = 0x80;
+	core.SetupPacket.bRequest = USB_REQUEST_GET_DESCRIPTOR;
+	core.SetupPacket.wValue.WB.H = type;
+	core.SetupPacket.wValue.WB.L = index;
+	core.SetupPacket.wLength = length;
+	core.EP0Data.pData = NULL;
+	core.EP0Data.Count = length;
+	return USB_ReqGetDescriptor(&core);
+}
+
+static void test_requests(void)
+{
+	uint8_t *ref;
+	uint32_t speed, i;
+	ErrorCode_t ret;
+
+	for (speed = USB_FULL_SPEED; speed <= USB_HIGH_SPEED; speed++) {
+		core.device_speed = speed;
+
+		for (i = 0; i < 256; i++) {
+			ret = get_desc(USB_STRING_DESCRIPTOR_TYPE, i, 255);
+			ref = walk(str_desc, i, 0);
+			CHECK_EQ(ret == LPC_OK, ref != NULL);
+			if (ref) {
+				CHECK(core.EP0Data.pData == ref);
+				CHECK_EQ(core.EP0Data.Count, ref[0]);
+			}
+		}
+		/* short wLength clips the transfer */
+		CHECK_EQ(get_desc(USB_STRING_DESCRIPTOR_TYPE, 3, 2), LPC_OK);
+		CHECK_EQ(core.EP0Data.Count, 2);
+
+		for (i = 0; i < 4; i++) {
+			ret = get_desc(USB_CONFIGURATION_DESCRIPTOR_TYPE, i, 0xFFFF);
+			CHECK_EQ(ret == LPC_OK, i == 0);
+			if (ret == LPC_OK) {
+				CHECK(core.EP0Data.pData == cfg_desc[speed]);
+				CHECK_EQ(core.EP0Data.Count, cfg_desc[speed][2] | (cfg_desc[speed][3] << 8));
+				CHECK_EQ(core.EP0Data.pData[1], USB_CONFIGURATION_DESCRIPTOR_TYPE);
+			}
+
+			ret = get_desc(USB_OTHER_SPEED_CONFIG_DESCRIPTOR_TYPE, i, 0xFFFF);
+			CHECK_EQ(ret == LPC_OK, i == 0);
+			if (ret == LPC_OK) {
+				CHECK(core.EP0Data.pData == cfg_desc[!speed]);
+				CHECK_EQ(core.EP0Data.pData[1], USB_OTHER_SPEED_CONFIG_DESCRIPTOR_TYPE);
+			}
+		}
+		/* the other speed request patched the type, a configuration request undoes it */
+		CHECK_EQ(get_desc(USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 9), LPC_OK);
+		CHECK_EQ(get_desc(USB_OTHER_SPEED_CONFIG_DESCRIPTOR_TYPE, 0, 9), LPC_OK);
+		core.device_speed = !speed;
+		CHECK_EQ(get_desc(USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 9), LPC_OK);
+		CHECK_EQ(core.EP0Data.pData[1], USB_CONFIGURATION_DESCRIPTOR_TYPE);
+		CHECK_EQ(core.EP0Data.Count, 9);
+		core.device_speed = speed;
+
+		CHECK_EQ(get_desc(USB_BOS_TYPE, 0, 0xFFFF), LPC_OK);
+		CHECK(core.EP0Data.pData == bos_desc);
+		CHECK_EQ(core.EP0Data.Count, 12);
+		CHECK(get_desc(USB_BOS_TYPE, 1, 0xFFFF) != LPC_OK);
+
+		CHECK_EQ(get_desc(USB_DEVICE_DESCRIPTOR_TYPE, 0, 64), LPC_OK);
+		CHECK(core.EP0Data.pData == dev_desc);
+		CHECK_EQ(core.EP0Data.Count, USB_DEVICE_DESC_SIZE);
+	}
+}
+
+static void test_lookups(void)
+{
+	USB_INTERFACE_DESCRIPTOR *pIntf;
+	USB_ENDPOINT_DESCRIPTOR *pEp;
+	uint32_t speed, i, mps;
+
+	for (speed = USB_FULL_SPEED; speed <= USB_HIGH_SPEED; speed++) {
+		mps = (speed == USB_HIGH_SPEED) ? 512 : 64;
+		for (i = 0; i < NUM_INTF; i++) {
+			pIntf = mwUSB_GetIntfDesc(&core, speed, i);
+			CHECK(pIntf != NULL);
+			if (pIntf) {
+				CHECK_EQ(pIntf->bInterfaceNumber, i);
+				CHECK_EQ(pIntf->bAlternateSetting, 0);
+				CHECK_EQ(pIntf->iInterface, 4 + (i % 8));
+				CHECK((uint8_t *) pIntf > cfg_desc[speed]);
+				CHECK((uint8_t *) pIntf < cfg_desc[speed] + sizeof(cfg_desc[0]));
+			}
+
+			pEp = mwUSB_GetEpDesc(&core, speed, intf_ep(i));
+			CHECK(pEp != NULL);
+			if (pEp) {
+				CHECK_EQ(pEp->bEndpointAddress, intf_ep(i));
+				CHECK_EQ(pEp->wMaxPacketSize, mps);
+			}
+		}
+		CHECK(mwUSB_GetIntfDesc(&core, speed, NUM_INTF) == NULL);
+
+		pIntf = mwUSB_FindIntfDesc(&core, speed, USB_DEVICE_CLASS_STORAGE);
+		CHECK(pIntf == mwUSB_GetIntfDesc(&core, speed, MSC_INTF));
+		pIntf = mwUSB_FindIntfDesc(&core, speed, USB_DEVICE_CLASS_HUMAN_INTERFACE);
+		CHECK(pIntf == mwUSB_GetIntfDesc(&core, speed, HID_INTF));
+		pIntf = mwUSB_FindIntfDesc(&core, speed, 0xFF);
+		CHECK(pIntf == mwUSB_GetIntfDesc(&core, speed, 0));
+		CHECK(mwUSB_FindIntfDesc(&core, speed, USB_DEVICE_CLASS_AUDIO) == NULL);
+
+		/* addresses with no endpoint, or outside the table */
+		CHECK(mwUSB_GetEpDesc(&core, speed, 0x86) == NULL);
+		CHECK(mwUSB_GetEpDesc(&core, speed, 0x04) == NULL);
+		CHECK(mwUSB_GetEpDesc(&core, speed, 0x8F) == NULL);
+	}
+	CHECK(mwUSB_GetIntfDesc(&core, 2, 0) == NULL);
+	CHECK(mwUSB_GetEpDesc(&core, 2, 0x81) == NULL);
+}
+
+/* tables too small for the descriptors: refused, not walked past */
+static void test_overflow(void)
+{
+	CHECK_EQ(init_core(USB_MAX_STRING_NUM, 1), LPC_OK);
+	CHECK_EQ(init_core(USB_MAX_STRING_NUM + 1, 1), ERR_USBD_BAD_DESC);
+#if (USB_MAX_CONFIG_NUM == 1)
+	CHECK_EQ(init_core(USB_MAX_STRING_NUM, 2), ERR_USBD_BAD_CFG_DESC);
+#endif
+	CHECK_EQ(init_core(1, 1), LPC_OK);
+	CHECK_EQ(get_desc(USB_STRING_DESCRIPTOR_TYPE, 0, 255), LPC_OK);
+	CHECK(get_desc(USB_STRING_DESCRIPTOR_TYPE, 1, 255) != LPC_OK);
+}
+
+static double elapsed_ns(const struct timespec *t0, uint32_t n)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec)) / n;
+}
+
+/* printed, not checked */
+static void bench(void)
+{
+	struct timespec t0;
+	volatile uintptr_t sink = 0;
+	uint32_t i;
+
+	core.device_speed = USB_HIGH_SPEED;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_REQUESTS; i++) {
+		sink += (uintptr_t) walk(str_desc, i % USB_MAX_STRING_NUM, 0);
+	}
+	printf("walk:    %5.1f ns per string lookup\n", elapsed_ns(&t0, BENCH_REQUESTS));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_REQUESTS; i++) {
+		get_desc(USB_STRING_DESCRIPTOR_TYPE, i % USB_MAX_STRING_NUM, 255);
+		sink += (uintptr_t) core.EP0Data.pData;
+	}
+	printf("indexed: %5.1f ns per GET_DESCRIPTOR(STRING)\n", elapsed_ns(&t0, BENCH_REQUESTS));
+}
+
+int main(void)
+{
+	CHECK_EQ(init_core(USB_MAX_STRING_NUM, 1), LPC_OK);
+	test_requests();
+	test_lookups();
+	bench();
+	test_overflow();
+	return TEST_DONE();
+}
@@ -0,0 +1,229 @@
+/*
+ * EP0 class handler routing by interface number (user-018).
+ *
+ * An 8 interface composite: seven functions bound to interfaces 0 to 6
+ * with mwUSB_RegisterIntfHandler(), each checking wIndex the way the class
+ * drivers do, and one device level handler on the plain chain. Requests to
+ * a bound interface must reach its handler and, when it passes, only the
+ * unbound handlers; everything else must still walk the whole chain. The
+ * handler calls and time per SETUP are printed for the chain and routed
+ * cases.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "msc_harness.h"
+#include "test_util.h"
+
+/* class handler dispatch of the core, not in a header */
+extern ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event);
+
+#define NUM_FUNCS           7
+#define BENCH_SETUPS        10000000
+
+static uint32_t calls, hits[NUM_FUNCS + 1], dev_calls;
+static ErrorCode_t func_ret = LPC_OK;
+
+/* a function on interface (uint32_t) data, handling class requests only */
+static ErrorCode_t func_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	uint32_t if_num = (uint32_t) (uintptr_t) data;
+
+	calls++;
+	if ((event == USB_EVT_RESET) ||
+		(pCtrl->SetupPacket.bmRequestType.BM.Recipient != REQUEST_TO_INTERFACE) ||
+		(pCtrl->SetupPacket.bmRequestType.BM.Type != REQUEST_CLASS) ||
+		(pCtrl->SetupPacket.wIndex.WB.L != if_num)) {
+		return ERR_USBD_UNHANDLED;
+	}
+	hits[if_num]++;
+	return func_ret;
+}
+
+static ErrorCode_t dev_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	calls++;
+	dev_calls++;
+	return ERR_USBD_UNHANDLED;
+}
+
+static void init_core(uint8_t routed)
+{
+	uint32_t i;
+
+	CHECK_EQ(msc_harness_init_core(USB_HIGH_SPEED, 1), LPC_OK);
+	for (i = 0; i < NUM_FUNCS; i++) {
+		if (routed) {
+			CHECK_EQ(mwUSB_RegisterIntfHandler(&msc_core, i, func_hdlr, (void *) (uintptr_t) i), LPC_OK);
+		}
+		else {
+			CHECK_EQ(mwUSB_RegisterClassHandler(&msc_core, func_hdlr, (void *) (uintptr_t) i), LPC_OK);
+		}
+	}
+	CHECK_EQ(mwUSB_RegisterClassHandler(&msc_core, dev_hdlr, 0), LPC_OK);
+}
+
+static ErrorCode_t setup(uint8_t recipient, uint8_t type, uint8_t if_num)
+{
+	msc_core.SetupPacket.bmRequestType.B = 0;
+	msc_core.SetupPacket.bmRequestType.BM.Recipient = recipient;
+	msc_core.SetupPacket.bmRequestType.BM.Type = type;
+	msc_core.SetupPacket.wIndex.W = if_num;
+	calls = 0;
+	dev_calls = 0;
+	memset(hits, 0, sizeof(hits));
+	return USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_SETUP);
+}
+
+static void test_routing(void)
+{
+	uint32_t i;
+
+	init_core(1);
+	CHECK_EQ(msc_core.num_ep0_hdlrs, NUM_FUNCS + 1);
+
+	/* a class request goes straight to the bound function */
+	for (i = 0; i < NUM_FUNCS; i++) {
+		CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, i), LPC_OK);
+		CHECK_EQ(calls, 1);
+		CHECK_EQ(hits[i], 1);
+	}
+
+	/* not handled by the bound function: only the unbound handlers follow */
+	CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_STANDARD, 3), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, 2);
+	CHECK_EQ(dev_calls, 1);
+
+	/* an interface without a bound handler, device and endpoint requests
+	   walk the chain */
+	CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, NUM_FUNCS), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, NUM_FUNCS + 1);
+	CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, 200), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, NUM_FUNCS + 1);
+	CHECK_EQ(setup(REQUEST_TO_DEVICE, REQUEST_CLASS, 2), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, NUM_FUNCS + 1);
+	CHECK_EQ(setup(REQUEST_TO_ENDPOINT, REQUEST_CLASS, 2), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, NUM_FUNCS + 1);
+	CHECK_EQ(dev_calls, 1);
+
+	/* reset reaches every handler, whatever the last setup packet was */
+	setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, 2);
+	calls = 0;
+	CHECK_EQ(USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_RESET), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, NUM_FUNCS + 1);
+
+	/* data stage events of a routed request follow the same route */
+	setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, 5);
+	calls = 0;
+	CHECK_EQ(USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_OUT), LPC_OK);
+	CHECK_EQ(calls, 1);
+	CHECK_EQ(hits[5], 2);
+
+	/* an error from the bound handler stalls EP0 */
+	func_ret = ERR_USBD_STALL;
+	fake_ep[0].stalls = fake_ep[1].stalls = 0;
+	CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, 4), ERR_USBD_STALL);
+	CHECK_EQ(calls, 1);
+	CHECK(fake_ep[0].stalls + fake_ep[1].stalls > 0);
+	func_ret = LPC_OK;
+}
+
+static void test_register(void)
+{
+	uint32_t i;
+
+	CHECK_EQ(msc_harness_init_core(USB_HIGH_SPEED, 1), LPC_OK);
+
+	/* one function on two interfaces, like CDC, takes one slot */
+	CHECK_EQ(mwUSB_RegisterIntfHandler(&msc_core, 0, func_hdlr, (void *) 1), LPC_OK);
+	CHECK_EQ(mwUSB_RegisterIntfHandler(&msc_core, 1, func_hdlr, (void *) 1), LPC_OK);
+	CHECK_EQ(msc_core.num_ep0_hdlrs, 1);
+	CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, 0), ERR_USBD_UNHANDLED);
+	CHECK_EQ(calls, 1);
+	CHECK_EQ(setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, 1), LPC_OK);
+	CHECK_EQ(calls, 1);
+
+	CHECK_EQ(mwUSB_RegisterIntfHandler(&msc_core, USB_MAX_IF_NUM, func_hdlr, (void *) 2), ERR_API_INVALID_PARAM2);
+	CHECK_EQ(msc_core.num_ep0_hdlrs, 1);
+
+	/* the handler table is shared with RegisterClassHandler */
+	for (i = 1; i < USB_MAX_IF_NUM; i++) {
+		CHECK_EQ(mwUSB_RegisterClassHandler(&msc_core, dev_hdlr, (void *) (uintptr_t) i), LPC_OK);
+	}
+	CHECK_EQ(mwUSB_RegisterIntfHandler(&msc_core, 2, func_hdlr, (void *) 2), ERR_USBD_TOO_MANY_CLASS_HDLR);
+	CHECK_EQ(msc_core.ep0_hdlr_route[2], 0);
+}
+
+static void disk_rw(uint32_t offset, uint8_t **buff_adr, uint32_t length, uint32_t high_offset)
+{
+}
+
+static ErrorCode_t disk_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t high_offset)
+{
+	return LPC_OK;
+}
+
+/* the MSC function binds its interface */
+static void test_msc(void)
+{
+	USBD_MSC_INIT_PARAM_T param;
+
+	memset(&param, 0, sizeof(param));
+	param.InquiryStr = (uint8_t *) "NXP     ROUTE           1.0 ";
+	param.BlockSize = 512;
+	param.BlockCount = 64;
+	param.MemorySize = 64 * 512;
+	param.MSC_Read = disk_rw;
+	param.MSC_Write = disk_rw;
+	param.MSC_Verify = disk_verify;
+	CHECK_EQ(msc_harness_init(&param, USB_HIGH_SPEED, 1), LPC_OK);
+	CHECK(msc_core.ep0_hdlr_route[0] != 0);
+	CHECK_EQ(mwUSB_RegisterClassHandler(&msc_core, dev_hdlr, 0), LPC_OK);
+
+	msc_core.SetupPacket.bmRequestType.B = 0xA1;
+	msc_core.SetupPacket.bRequest = MSC_REQUEST_GET_MAX_LUN;
+	msc_core.SetupPacket.wValue.W = 0;
+	msc_core.SetupPacket.wIndex.W = 0;
+	msc_core.SetupPacket.wLength = 1;
+	msc_core.EP0Buf[0] = 0xFF;
+	dev_calls = 0;
+	CHECK_EQ(USB_InvokeEp0Hdlrs(&msc_core, USB_EVT_SETUP), LPC_OK);
+	CHECK_EQ(msc_core.EP0Buf[0], 0);
+	CHECK_EQ(dev_calls, 0);
+}
+
+static double bench(uint8_t routed, double *per_setup)
+{
+	struct timespec t0, t1;
+	uint32_t i, total = 0;
+
+	init_core(routed);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_SETUPS; i++) {
+		setup(REQUEST_TO_INTERFACE, REQUEST_CLASS, i & 7);
+		total += calls;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	*per_setup = (double) total / BENCH_SETUPS;
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / BENCH_SETUPS;
+}
+
+int main(void)
+{
+	double ns, per_setup;
+
+	test_routing();
+	test_register();
+	test_msc();
+
+	/* class requests spread over all 8 interfaces: the handler calls are
+	   checked, the times only printed */
+	ns = bench(0, &per_setup);
+	printf("chain:  %4.1f ns, %.2f handler calls per SETUP\n", ns, per_setup);
+	CHECK_EQ((uint32_t) (per_setup * 8 + 0.5), 4 * 7 + 8);
+	ns = bench(1, &per_setup);
+	printf("routed: %4.1f ns, %.2f handler calls per SETUP\n", ns, per_setup);
+	CHECK_EQ((uint32_t) (per_setup * 8 + 0.5), 7 + 8);
+	return TEST_DONE();
+}
@@ -0,0 +1,28 @@
+/*
+ * Minimal check macros for the host tests.
+ */
+#ifndef __TEST_UTIL_H_
+#define __TEST_UTIL_H_
+
+#include <stdio.h>
+
+static int test_failures;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define CHECK_EQ(a, b) do { \
+		unsigned long long _a = (unsigned long long) (a), _b = (unsigned long long) (b); \
+		if (_a != _b) { \
+			printf("%s:%d: CHECK_EQ(%s, %s) failed: %llu != %llu\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define TEST_DONE() (printf("%s: %d failure(s)\n", __FILE__, test_failures), test_failures ? 1 : 0)
+
+#endif /* __TEST_UTIL_H_ */
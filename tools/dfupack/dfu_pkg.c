@@ -0,0 +1,267 @@
+/*
+ * DFU package builder.
+ *
+ * The LZ encoder is a greedy LZSS with hash chains; the delta is bsdiff like
+ * but simpler: matches are found from 4 byte seeds, extended as long as at
+ * least half of the bytes keep matching, and stored as differences to the
+ * base, with the bytes between matches stored as they are.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mw_usbd_dfuuser.h"
+#include "mw_usbd_crc32.h"
+#include "dfu_pkg.h"
+
+#define LZ_HASH_SIZE		65536
+#define LZ_MAX_CHAIN		256
+
+#define DELTA_HASH_BITS		20
+#define DELTA_MIN_MATCH		16
+#define DELTA_STEP			16
+
+static void put8(DFU_PKG_BUF_T *buf, uint8_t b)
+{
+	if (buf->size == buf->cap) {
+		buf->cap = buf->cap ? 2 * buf->cap : 4096;
+		buf->data = realloc(buf->data, buf->cap);
+		if (buf->data == 0) {
+			abort();
+		}
+	}
+	buf->data[buf->size++] = b;
+}
+
+static void put32(DFU_PKG_BUF_T *buf, uint32_t v)
+{
+	put8(buf, v & 0xFF);
+	put8(buf, (v >> 8) & 0xFF);
+	put8(buf, (v >> 16) & 0xFF);
+	put8(buf, v >> 24);
+}
+
+static void put_bytes(DFU_PKG_BUF_T *buf, const uint8_t *p, uint32_t n)
+{
+	while (n-- != 0) {
+		put8(buf, *p++);
+	}
+}
+
+/* most significant bit first, as the decoder reads them */
+static void put_bits(DFU_PKG_BUF_T *buf, uint32_t v, uint32_t n)
+{
+	while (n-- != 0) {
+		buf->bits = (buf->bits << 1) | ((v >> n) & 1);
+		if (++buf->nbits == 8) {
+			put8(buf, buf->bits & 0xFF);
+			buf->bits = 0;
+			buf->nbits = 0;
+		}
+	}
+}
+
+static void flush_bits(DFU_PKG_BUF_T *buf)
+{
+	if (buf->nbits != 0) {
+		put8(buf, (buf->bits << (8 - buf->nbits)) & 0xFF);
+		buf->bits = 0;
+		buf->nbits = 0;
+	}
+}
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+	return ((p[0] | (p[1] << 8)) ^ (p[2] << 5)) & (LZ_HASH_SIZE - 1);
+}
+
+/*
+ * Greedy LZSS: the longest match within the window, if it is shorter in
+ * bits than its bytes as literals
+ */
+static void lz_encode(DFU_PKG_BUF_T *out, const uint8_t *in, uint32_t n, uint32_t win_bits, uint32_t len_bits)
+{
+	uint32_t win = 1UL << win_bits, max_len = 1UL << len_bits;
+	uint32_t match_bits = 1 + win_bits + len_bits;
+	int32_t *head = malloc(LZ_HASH_SIZE * sizeof(int32_t));
+	int32_t *prev = malloc((n + 1) * sizeof(int32_t));
+	uint32_t i = 0, best, dist, len, adv, chain;
+	int32_t c;
+
+	if ((head == 0) || (prev == 0)) {
+		abort();
+	}
+	memset(head, 0xFF, LZ_HASH_SIZE * sizeof(int32_t));
+	while (i < n) {
+		best = 0;
+		dist = 0;
+		if (i + 2 < n) {
+			c = head[lz_hash(&in[i])];
+			chain = LZ_MAX_CHAIN;
+			while ((c >= 0) && (i - c <= win) && (chain-- != 0)) {
+				len = 0;
+				while ((len < max_len) && (i + len < n) && (in[c + len] == in[i + len])) {
+					len++;
+				}
+				if (len > best) {
+					best = len;
+					dist = i - c;
+					if (len == max_len) {
+						break;
+					}
+				}
+				c = prev[c];
+			}
+		}
+		if (best * 9 > match_bits) {
+			put_bits(out, 0, 1);
+			put_bits(out, dist - 1, win_bits);
+			put_bits(out, best - 1, len_bits);
+			adv = best;
+		}
+		else {
+			put_bits(out, 1, 1);
+			put_bits(out, in[i], 8);
+			adv = 1;
+		}
+		while (adv-- != 0) {
+			if (i + 2 < n) {
+				prev[i] = head[lz_hash(&in[i])];
+				head[lz_hash(&in[i])] = i;
+			}
+			i++;
+		}
+	}
+	flush_bits(out);
+	free(head);
+	free(prev);
+}
+
+static uint32_t delta_hash(const uint8_t *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+
+	return (uint32_t) (v * 2654435761U) >> (32 - DELTA_HASH_BITS);
+}
+
+/* record: diff_len bytes of image at image_pos against base at base_pos,
+   then extra_len bytes copied, then the base position moves by seek */
+static void delta_record(DFU_PKG_BUF_T *out, const uint8_t *image, uint32_t image_pos,
+						 const uint8_t *base, uint32_t base_pos,
+						 uint32_t diff_len, uint32_t extra_len, int32_t seek)
+{
+	uint32_t i;
+
+	put32(out, diff_len);
+	put32(out, extra_len);
+	put32(out, (uint32_t) seek);
+	for (i = 0; i < diff_len; i++) {
+		put8(out, (image[image_pos + i] - base[base_pos + i]) & 0xFF);
+	}
+	put_bytes(out, &image[image_pos + diff_len], extra_len);
+}
+
+static void delta_encode(DFU_PKG_BUF_T *out, const uint8_t *image, uint32_t n,
+						 const uint8_t *base, uint32_t base_size)
+{
+	int32_t *table = malloc((1UL << DELTA_HASH_BITS) * sizeof(int32_t));
+	uint32_t run_image = 0, run_base = 0, run_len = 0;	/* the match being built */
+	uint32_t pos = 0, len, ext, same, k;
+	int32_t c;
+
+	if (table == 0) {
+		abort();
+	}
+	memset(table, 0xFF, (1UL << DELTA_HASH_BITS) * sizeof(int32_t));
+	for (k = 0; k + 8 <= base_size; k++) {
+		table[delta_hash(&base[k])] = k;
+	}
+
+	while (pos + 8 <= n) {
+		c = table[delta_hash(&image[pos])];
+		len = 0;
+		if (c >= 0) {
+			while ((pos + len < n) && (c + len < base_size) && (image[pos + len] == base[c + len])) {
+				len++;
+			}
+		}
+		if (len < DELTA_MIN_MATCH) {
+			pos++;
+			continue;
+		}
+		/* go on over changed bytes while at least half still match */
+		ext = len;
+		for (;;) {
+			same = 0;
+			for (k = 0; (k < DELTA_STEP) && (pos + ext + k < n) && (c + ext + k < base_size); k++) {
+				same += (image[pos + ext + k] == base[c + ext + k]);
+			}
+			if ((k < DELTA_STEP) || (same < DELTA_STEP / 2)) {
+				break;
+			}
+			ext += DELTA_STEP;
+		}
+		/* the previous match, the new bytes up to this one, then seek to it */
+		delta_record(out, image, run_image, base, run_base, run_len,
+					 pos - (run_image + run_len), (int32_t) (c - (run_base + run_len)));
+		run_image = pos;
+		run_base = c;
+		run_len = ext;
+		pos += ext;
+	}
+	delta_record(out, image, run_image, base, run_base, run_len, n - (run_image + run_len), 0);
+	free(table);
+}
+
+int dfu_pkg_build(DFU_PKG_BUF_T *out, const uint8_t *image, uint32_t size,
+				  const uint8_t *base, uint32_t base_size,
+				  uint8_t flags, uint8_t win_bits, uint8_t len_bits)
+{
+	DFU_PKG_BUF_T payload;
+
+	if ((size == 0) || (flags & ~(DFU_PKG_LZ | DFU_PKG_DELTA)) ||
+		((flags & DFU_PKG_DELTA) && (base == 0))) {
+		return -1;
+	}
+	if ((flags & DFU_PKG_LZ) &&
+		((win_bits < 4) || ((1UL << win_bits) > DFU_PKG_WIN_MAX) ||
+		 (len_bits == 0) || (len_bits >= win_bits))) {
+		return -1;
+	}
+	if ((flags & DFU_PKG_LZ) == 0) {
+		win_bits = 0;
+		len_bits = 0;
+	}
+
+	memset(out, 0, sizeof(*out));
+	put32(out, DFU_PKG_MAGIC);
+	put8(out, flags);
+	put8(out, win_bits);
+	put8(out, len_bits);
+	put8(out, 0);
+	put32(out, size);
+	put32(out, mwUSB_Crc32(0, image, size));
+
+	memset(&payload, 0, sizeof(payload));
+	if (flags & DFU_PKG_DELTA) {
+		delta_encode(&payload, image, size, base, base_size);
+	}
+	else {
+		payload.data = (uint8_t *) image;
+		payload.size = size;
+	}
+	if (flags & DFU_PKG_LZ) {
+		lz_encode(out, payload.data, payload.size, win_bits, len_bits);
+	}
+	else {
+		put_bytes(out, payload.data, payload.size);
+	}
+	if (flags & DFU_PKG_DELTA) {
+		dfu_pkg_free(&payload);
+	}
+	return 0;
+}
+
+void dfu_pkg_free(DFU_PKG_BUF_T *buf)
+{
+	free(buf->data);
+	memset(buf, 0, sizeof(*buf));
+}
@@ -0,0 +1,32 @@
+/*
+ * DFU package builder.
+ *
+ * Makes the packages the DFU class driver unpacks while they are downloaded
+ * (see DFU_PKG_MAGIC in mw_usbd_dfuuser.h): the 16 byte header, then the
+ * image, optionally as a delta to the image already on the device and
+ * optionally LZSS compressed.
+ */
+#ifndef __DFU_PKG_H_
+#define __DFU_PKG_H_
+
+#include <stdint.h>
+
+typedef struct {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t cap;
+	uint32_t bits;			/* LZ bit accumulator */
+	uint8_t nbits;			/* bits in the accumulator */
+} DFU_PKG_BUF_T;
+
+/* Package image as out; flags are DFU_PKG_LZ and/or DFU_PKG_DELTA, base
+   the image on the device for DFU_PKG_DELTA, win_bits and len_bits the LZ
+   parameters of the header. Returns 0 with the package in out, to be
+   released with dfu_pkg_free(), or -1 for parameters the device refuses. */
+int dfu_pkg_build(DFU_PKG_BUF_T *out, const uint8_t *image, uint32_t size,
+				  const uint8_t *base, uint32_t base_size,
+				  uint8_t flags, uint8_t win_bits, uint8_t len_bits);
+
+void dfu_pkg_free(DFU_PKG_BUF_T *buf);
+
+#endif /* __DFU_PKG_H_ */
@@ -0,0 +1,111 @@
+/*
+ * dfupack: make a DFU package from a firmware image.
+ *
+ *   dfupack [-z] [-w win_bits] [-l len_bits] [-b base.bin] image.bin out.dfup
+ *
+ * -z compresses with LZSS, -w and -l set its window and length bits (10 and
+ * 4 by default; the device needs a window_size of at least 2^win_bits).
+ * -b makes a delta to base.bin, the image the device runs now. The package
+ * is downloaded like any image, for example with dfu-util -D out.dfup.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mw_usbd_dfuuser.h"
+#include "dfu_pkg.h"
+
+static uint8_t *read_file(const char *name, uint32_t *size)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t *data = 0;
+	long len;
+
+	if (f == 0) {
+		perror(name);
+		return 0;
+	}
+	if ((fseek(f, 0, SEEK_END) == 0) && ((len = ftell(f)) > 0) && (fseek(f, 0, SEEK_SET) == 0)) {
+		data = malloc(len);
+		if ((data != 0) && (fread(data, 1, len, f) == (size_t) len)) {
+			*size = len;
+		}
+		else {
+			free(data);
+			data = 0;
+		}
+	}
+	if (data == 0) {
+		fprintf(stderr, "%s: cannot read\n", name);
+	}
+	fclose(f);
+	return data;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: dfupack [-z] [-w win_bits] [-l len_bits] [-b base.bin] image.bin out.dfup\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	DFU_PKG_BUF_T pkg;
+	const char *base_name = 0;
+	uint8_t *image, *base = 0;
+	uint32_t size, base_size = 0;
+	uint8_t flags = 0, win_bits = 10, len_bits = 4;
+	FILE *f;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "zw:l:b:")) != -1) {
+		switch (opt) {
+		case 'z':
+			flags |= DFU_PKG_LZ;
+			break;
+
+		case 'w':
+			win_bits = atoi(optarg);
+			break;
+
+		case 'l':
+			len_bits = atoi(optarg);
+			break;
+
+		case 'b':
+			base_name = optarg;
+			flags |= DFU_PKG_DELTA;
+			break;
+
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2) {
+		usage();
+	}
+
+	image = read_file(argv[optind], &size);
+	if ((image == 0) || (base_name && ((base = read_file(base_name, &base_size)) == 0))) {
+		return 1;
+	}
+	if (dfu_pkg_build(&pkg, image, size, base, base_size, flags, win_bits, len_bits) != 0) {
+		fprintf(stderr, "dfupack: window bits must be 4 to 15 and length bits 1 to window bits - 1\n");
+		return 1;
+	}
+
+	f = fopen(argv[optind + 1], "wb");
+	if ((f == 0) || (fwrite(pkg.data, 1, pkg.size, f) != pkg.size) || (fclose(f) != 0)) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	printf("%s: %u bytes, %u%% of %u", argv[optind + 1], pkg.size, (uint32_t) (100ULL * pkg.size / size), size);
+	if (flags & DFU_PKG_LZ) {
+		printf(", window_size >= %u", (1U << win_bits) < DFU_PKG_WIN_MIN ? DFU_PKG_WIN_MIN : (1U << win_bits));
+	}
+	printf("\n");
+	dfu_pkg_free(&pkg);
+	free(image);
+	free(base);
+	return 0;
+}
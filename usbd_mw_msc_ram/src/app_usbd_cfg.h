@@ -79,7 +79,7 @@ extern "C"
  */
 #define USB_STACK_MEM_BASE      0x20000000
 // #define USB_STACK_MEM_BASE      0x10080000
-#define USB_STACK_MEM_SIZE      0x00002000
+#define USB_STACK_MEM_SIZE      0x00008000
 
 /* USB descriptor arrays defined *_desc.c file */
 extern const uint8_t USB_DeviceDescriptor[];
@@ -88,15 +88,6 @@ extern uint8_t USB_FsConfigDescriptor[];
 extern const uint8_t USB_StringDescriptor[];
 extern const uint8_t USB_DeviceQualifier[];
 
-/**
- * @brief	Find the address of interface descriptor for given class type.
- * @param	pDesc		: Pointer to configuration descriptor in which the desired class
- *			interface descriptor to be found.
- * @param	intfClass	: Interface class type to be searched.
- * @return	If found returns the address of requested interface else returns NULL.
- */
-extern USB_INTERFACE_DESCRIPTOR *find_IntfDesc(const uint8_t *pDesc, uint32_t intfClass);
-
 /**
  * @}
  */
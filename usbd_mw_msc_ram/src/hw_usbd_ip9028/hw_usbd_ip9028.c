@@ -33,13 +33,84 @@
 #include "mw_usbd_hw.h"
 #include "hw_usbd_ip9028.h"
 
+/* Snapshot of the controller events taken by the ISR */
+typedef volatile struct
+{
+  uint32_t disr;        /* USBSTS bits enabled in USBINTR */
+  uint32_t setup;       /* acknowledged ENDPTSETUPSTAT bits */
+  uint32_t setup_pkt[2];  /* EP0 setup packet read with the ENDPTSETUPSTAT ack */
+  uint32_t complete;    /* acknowledged ENDPTCOMPLETE bits */
+  uint32_t nak;         /* acknowledged ENDPTNAK bits */
+} USBD_HW_EVENT_T;
+
+/* count leading zeros, a single instruction on Cortex-M3/M4 */
+#if defined(__GNUC__)
+#define USB_CLZ(x)    __builtin_clz(x)
+#elif defined(__ICCARM__)
+#include <intrinsics.h>
+#define USB_CLZ(x)    __CLZ(x)
+#else
+#define USB_CLZ(x)    __clz(x)
+#endif
+
+/* mask interrupts around the usbcmd and usbintr read-modify-writes that
+   the ISR also does. A build for another core may supply its own pair. */
+#ifndef USB_IRQ_SAVE
+#if defined(__GNUC__)
+static INLINE uint32_t hwUSB_IrqSave(void)
+{
+  uint32_t primask;
+
+  __asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) : : "memory");
+  return primask;
+}
+#define USB_IRQ_SAVE()            hwUSB_IrqSave()
+#define USB_IRQ_RESTORE(primask)  __asm volatile ("msr primask, %0" : : "r" (primask) : "memory")
+#elif defined(__ICCARM__)
+static INLINE uint32_t hwUSB_IrqSave(void)
+{
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_interrupt();
+  return primask;
+}
+#define USB_IRQ_SAVE()            hwUSB_IrqSave()
+#define USB_IRQ_RESTORE(primask)  __set_PRIMASK(primask)
+#else
+#define USB_IRQ_SAVE()            ((uint32_t)__disable_irq())
+#define USB_IRQ_RESTORE(primask)  do { if (!(primask)) __enable_irq(); } while (0)
+#endif
+#endif
+
+#if USB_HW_SPIN_STATS
+/* Cortex-M DWT cycle counter */
+#define DEMCR         (*(volatile uint32_t*)0xE000EDFC)
+#define DEMCR_TRCENA  _BIT(24)
+#define DWT_CTRL      (*(volatile uint32_t*)0xE0001000)
+#define DWT_CYCCNTENA _BIT(0)
+#define DWT_CYCCNT    (*(volatile uint32_t*)0xE0001004)
+#endif
+
 typedef struct __USBD_HW_DATA_T
 {
   DQH_T* ep_QH;
   DTD_T* ep_TD;
-  uint32_t ep_read_len[USB_MAX_EP_NUM];
+  uint32_t td_depth;                          /* dTDs per endpoint */
+  uint8_t ep_td_head[2 * USB_MAX_EP_NUM];     /* oldest queued dTD */
+  uint8_t ep_td_cnt[2 * USB_MAX_EP_NUM];      /* number of queued dTDs */
+  uint8_t ep_td_done[2 * USB_MAX_EP_NUM];     /* last retired dTD, read by hwUSB_ReadEP */
+  uint32_t* setup_pkt;                        /* captured setup packet being dispatched */
   USB_OTG_REGS_T* regs;
   USB_CORE_CTRL_T* pCtrl;
+#if USB_HW_SPIN_STATS
+  USBD_HW_SPIN_STATS_T spin;
+#endif
+#if USB_HW_DEFER_EVENTS
+  USBD_HW_EVENT_T ev_ring[USB_HW_EVENT_RING_SIZE];
+  volatile uint8_t ev_head;                   /* written by the ISR only */
+  volatile uint8_t ev_tail;                   /* written by hwUSB_ProcessEvents only */
+  volatile uint32_t usbintr_saved;            /* USBINTR while masked on ring overflow */
+#endif
 
 } USBD_HW_DATA_T;
 
@@ -69,6 +140,113 @@ static uint32_t EPAdr(uint32_t EPNum)
   return (val);
 }
 
+/*
+*  Get endpoint index from a bit position of the ENDPTxxx registers
+*    Parameters:      bitpos: 0..15 for OUT endpoints, 16..31 for IN endpoints
+*    Return Value:    Endpoint index. eg. EP3_IN = 7.
+*/
+
+static uint32_t EPBitIndx(uint32_t bitpos)
+{
+  return (bitpos < 16) ? (bitpos << 1) : (((bitpos - 16) << 1) + 1);
+}
+
+/*
+*  Get transfer descriptor of an endpoint
+*    Parameters:      Edpt: Endpoint index. eg. EP3_IN = 7.
+*                     i:    Slot in the endpoint's dTD pool
+*    Return Value:    Pointer to the dTD
+*/
+
+static DTD_T* EPTd(USBD_HW_DATA_T* drv, uint32_t Edpt, uint32_t i)
+{
+  return &drv->ep_TD[(Edpt * drv->td_depth) + i];
+}
+
+/*
+*  Drop all dTDs queued on an endpoint, after it has been flushed
+*    Parameters:      Edpt: Endpoint index. eg. EP3_IN = 7.
+*    Return Value:    None
+*/
+
+static void hwUSB_ClearDTDQueue(USBD_HW_DATA_T* drv, uint32_t Edpt)
+{
+  drv->ep_td_head[Edpt] = 0;
+  drv->ep_td_cnt[Edpt] = 0;
+}
+
+/*
+*  Wait until the controller clears the given bits of a command register
+*    Parameters:      reg:  ENDPTPRIME or ENDPTFLUSH register
+*                     mask: Endpoint bits to wait for
+*                     stat: Statistics updated when USB_HW_SPIN_STATS is set
+*    Return Value:    None
+*/
+
+static void hwUSB_WaitBits(volatile uint32_t* reg, uint32_t mask, USBD_HW_SPIN_STAT_T* stat)
+{
+#if USB_HW_SPIN_STATS
+  uint32_t start = DWT_CYCCNT;
+  uint32_t cycles;
+
+  while (*reg & mask);
+
+  cycles = DWT_CYCCNT - start;
+  stat->calls++;
+  stat->cycles += cycles;
+  if (cycles > stat->max)
+    stat->max = cycles;
+#else
+  while (*reg & mask);
+#endif
+}
+
+#if USB_HW_SPIN_STATS
+#define WAIT_PRIME(drv, mask)  hwUSB_WaitBits(&(drv)->regs->endptprime, (mask), &(drv)->spin.prime)
+#define WAIT_FLUSH(drv, mask)  hwUSB_WaitBits(&(drv)->regs->endptflush, (mask), &(drv)->spin.flush)
+#else
+#define WAIT_PRIME(drv, mask)  hwUSB_WaitBits(&(drv)->regs->endptprime, (mask), 0)
+#define WAIT_FLUSH(drv, mask)  hwUSB_WaitBits(&(drv)->regs->endptflush, (mask), 0)
+#endif
+
+/*
+*  Prime an endpoint with its oldest active dTD
+*   The controller is not working on the queue: dTDs it completed are
+*   skipped, the rest are still linked behind the first active one.
+*    Parameters:      Edpt: Endpoint index. eg. EP3_IN = 7.
+*                     n:    Bit position of the endpoint in the ENDPTxxx registers
+*    Return Value:    None
+*/
+
+static void hwUSB_PrimeQueue(USBD_HW_DATA_T* drv, uint32_t Edpt, uint32_t n)
+{
+  DTD_T* pDTD;
+  uint32_t i, slot = drv->ep_td_head[Edpt];
+
+  for (i = 0; i < drv->ep_td_cnt[Edpt]; i++)
+  {
+    pDTD = EPTd(drv, Edpt, slot);
+    if (pDTD->total_bytes & TD_STATUS_ACTIVE)
+    {
+#if USB_HW_ASYNC_PRIME
+      /* a flush started by hwUSB_ReadSetupPkt may still be running */
+      WAIT_FLUSH(drv, _BIT(n));
+#endif
+      drv->ep_QH[Edpt].next_dTD = (uint32_t)pDTD;
+      drv->ep_QH[Edpt].total_bytes &= ~(TD_STATUS_HALTED | TD_STATUS_ACTIVE) ;
+
+      /* prime the endpoint */
+      drv->regs->endptprime = _BIT(n) ;
+#if !USB_HW_ASYNC_PRIME
+      /* check if priming succeeded */
+      WAIT_PRIME(drv, _BIT(n));
+#endif
+      return;
+    }
+    slot = (slot + 1 == drv->td_depth) ? 0 : (slot + 1);
+  }
+}
+
 /**
  * @brief   Get Endpoint Physical Address.
  * @param [in] EPNum Endpoint Number.
@@ -150,8 +328,10 @@ void hwUSB_Reset(USBD_HANDLE_T hUsb)
   /* Zero out the Endpoint queue heads */
   memset((void*)drv->ep_QH, 0, 2 * pCtrl->max_num_ep * sizeof(DQH_T));
   /* Zero out the device transfer descriptors */
-  memset((void*)drv->ep_TD, 0, 2 * pCtrl->max_num_ep * sizeof(DTD_T));
-  memset((void*)drv->ep_read_len, 0, pCtrl->max_num_ep * sizeof(uint32_t));
+  memset((void*)drv->ep_TD, 0, 2 * pCtrl->max_num_ep * drv->td_depth * sizeof(DTD_T));
+  memset((void*)drv->ep_td_head, 0, sizeof(drv->ep_td_head));
+  memset((void*)drv->ep_td_cnt, 0, sizeof(drv->ep_td_cnt));
+  memset((void*)drv->ep_td_done, 0, sizeof(drv->ep_td_done));
   /* Configure the Endpoint List Address */
   /* make sure it in on 64 byte boundary !!! */
   /* init list address */
@@ -159,7 +339,7 @@ void hwUSB_Reset(USBD_HANDLE_T hUsb)
   /* Initialize device queue heads for non ISO endpoint only */
   for (i = 0; i < (2 * pCtrl->max_num_ep); i++)
   {
-    drv->ep_QH[i].next_dTD = (uint32_t) & drv->ep_TD[i];
+    drv->ep_QH[i].next_dTD = (uint32_t) EPTd(drv, i, 0);
   }
   /* Enable interrupts */
   drv->regs->usbintr =  USBSTS_UI
@@ -201,6 +381,21 @@ void hwUSB_WakeUp(USBD_HANDLE_T hUsb)
 }
 
 
+/*
+*  USB Get Frame Number Function
+*    Return Value:    Frame number of the last SOF, modulo 2048
+*/
+
+uint32_t hwUSB_GetFrameNumber(USBD_HANDLE_T hUsb)
+{
+  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+
+  /* FRINDEX[2:0] count the microframes at high speed */
+  return (drv->regs->frindex >> 3) & 0x7FF;
+}
+
+
 /*
 *  USB Remote Wakeup Configuration Function
 *    Parameters:      cfg:   Enable/Disable
@@ -299,8 +494,8 @@ void hwUSB_ConfigEP(USBD_HANDLE_T hUsb, USB_ENDPOINT_DESCRIPTOR *pEPD)
     drv->ep_QH[num].cap  = QH_MAXP(pEPD->wMaxPacketSize) 
 						| QH_MULT(((pEPD->wMaxPacketSize >> 11) & 0x3) + 1);
   }
-  /* The next DTD pointer is INVALID */
-  drv->ep_TD[num].next_dTD = 0x01 ;
+  /* start with an empty dTD queue */
+  hwUSB_ClearDTDQueue(drv, num);
   /* setup EP control register */
   if (pEPD->bEndpointAddress & 0x80)
   {
@@ -407,7 +602,8 @@ void hwUSB_ResetEP(USBD_HANDLE_T hUsb, uint32_t EPNum)
 
   /* flush EP buffers */
   drv->regs->endptflush = _BIT(bit_pos);
-  while (drv->regs->endptflush & _BIT(bit_pos));
+  WAIT_FLUSH(drv, _BIT(bit_pos));
+  hwUSB_ClearDTDQueue(drv, EPAdr(EPNum));
   /* reset data toggles */
   if (EPNum & 0x80)
   {
@@ -504,7 +700,7 @@ ErrorCode_t hwUSB_EnableEvent(USBD_HANDLE_T hUsb, uint32_t EPNum,
   uint32_t bitpos;
   ErrorCode_t ret = LPC_OK;
   volatile uint32_t* reg = &drv->regs->usbintr;
-  uint32_t bitmask = 0;
+  uint32_t bitmask = 0, primask;
 
   switch (event_type)
   {
@@ -535,11 +731,19 @@ ErrorCode_t hwUSB_EnableEvent(USBD_HANDLE_T hUsb, uint32_t EPNum,
       break;
 
   }
+  primask = USB_IRQ_SAVE();
+#if USB_HW_DEFER_EVENTS
+  /* while the ISR holds usbintr masked on a full event ring, change the
+     copy hwUSB_ProcessEvents restores; the register would be overwritten */
+  if ((reg == &drv->regs->usbintr) && drv->usbintr_saved)
+    reg = &drv->usbintr_saved;
+#endif
   if (enable) {
    *reg |= bitmask;
   } else {
    *reg &= ~bitmask;
   }
+  USB_IRQ_RESTORE(primask);
 
   return ret;
 }
@@ -549,37 +753,69 @@ ErrorCode_t hwUSB_EnableEvent(USBD_HANDLE_T hUsb, uint32_t EPNum,
  * @brief   Program transfer descriptors for USB Endpoint.
  * @ingroup USB Device Stack
  *
- * Program transfer descriptors for USB Endpoint.
+ * Program a transfer descriptor from the endpoint's dTD pool and add it
+ * to the endpoint's transfer queue. An idle endpoint is primed straight
+ * away. When transfers are already queued the dTD is linked behind the
+ * last one, following the controller's add-dTD-to-active-queue procedure
+ * with the ATDTW tripwire; the endpoint is re-primed only if the
+ * controller had already retired the queue before the link was made.
+ *
+ * On an isochronous endpoint each dTD carries one (micro)frame, at most
+ * Mult packets. Class drivers keep several queued so that the endpoint
+ * never runs dry, and refill each slot from the completion handler. ISO IN
+ * dTDs override the Mult of the dQH with the number of packets they hold,
+ * so a short frame is not padded with zero length packets.
  *
  * @param [in] hUsb  Handle to USBD stack instance.
  * @param [in] Edpt Endpoint index. eg. EP3_IN = 7.
  * @param [in] ptrBuff  Pointer to transfer buffer.
  * @param [in] TsfSize  Length of the transfer buffer.
  *
- * @retval  void.
+ * @retval  TsfSize when queued, 0 when all dTDs of the endpoint are in use
+ *          or an ISO IN transfer needs more than three packets.
  *
  * Example Usage:
  * @code
- *    hwUSB_ProgDTD(hUsb, 7, pdata, 64); // clear stall ep3_IN.
+ *    hwUSB_ProgDTD(hUsb, 7, pdata, 64); // queue 64 bytes on ep3_IN.
  * @endcode
  */
-void hwUSB_ProgDTD(USBD_HANDLE_T hUsb, uint32_t Edpt, uint32_t ptrBuff, uint32_t TsfSize)
+uint32_t hwUSB_ProgDTD(USBD_HANDLE_T hUsb, uint32_t Edpt, uint32_t ptrBuff, uint32_t TsfSize)
 {
   USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
   USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
   DTD_T*  pDTD ;
+  DTD_T*  pPrev ;
+  uint32_t slot, status, maxp, mult = 0, primask;
+  uint32_t n = (Edpt >> 1) + ((Edpt & 1) ? 16 : 0);
+
+  if (drv->ep_td_cnt[Edpt] >= drv->td_depth)
+    return 0;
 
-  pDTD    = (DTD_T*) & drv->ep_TD[ Edpt ];
+  /* packets sent in the (micro)frame of an ISO IN dTD */
+  if ((Edpt & 1) && (drv->ep_QH[Edpt].cap & QH_MULT_MASK))
+  {
+    maxp = (drv->ep_QH[Edpt].cap >> QH_MAX_PKT_LEN_POS) & 0x7FF;
+    mult = (TsfSize == 0) ? 1 : ((TsfSize + maxp - 1) / maxp);
+    if (mult > 3)
+      return 0;
+  }
+
+  slot = drv->ep_td_head[Edpt] + drv->ep_td_cnt[Edpt];
+  if (slot >= drv->td_depth)
+    slot -= drv->td_depth;
+  pDTD = EPTd(drv, Edpt, slot);
 
   /* Zero out the device transfer descriptors */
   memset((void*)pDTD, 0, sizeof(DTD_T));
   /* The next DTD pointer is INVALID */
-  pDTD->next_dTD = 0x01 ;
+  pDTD->next_dTD = TD_NEXT_TERMINATE ;
 
   /* Length */
   pDTD->total_bytes = ((TsfSize & 0x7fff) << 16);
   pDTD->total_bytes |= TD_IOC ;
-  pDTD->total_bytes |= 0x80 ;
+  pDTD->total_bytes |= TD_MULTO(mult) ;
+  pDTD->total_bytes |= TD_STATUS_ACTIVE ;
+  pDTD->xfer_len = TsfSize;
   
   /* convert buffer address from virtual to physical */
   if (pCtrl->virt_to_phys)
@@ -591,25 +827,51 @@ void hwUSB_ProgDTD(USBD_HANDLE_T hUsb, uint32_t Edpt, uint32_t ptrBuff, uint32_t
   pDTD->buffer3 = (ptrBuff + 0x3000) & 0xfffff000;
   pDTD->buffer4 = (ptrBuff + 0x4000) & 0xfffff000;
 
+  if (drv->ep_td_cnt[Edpt]++ != 0)
+  {
+    /* link behind the last queued dTD */
+    pPrev = EPTd(drv, Edpt, (slot == 0) ? (drv->td_depth - 1) : (slot - 1));
+    pPrev->next_dTD = (uint32_t)pDTD;
+
+    /* a pending prime will pick up the new dTD */
+    if (drv->regs->endptprime & _BIT(n))
+      return TsfSize;
+
+    /* read the endpoint status with the tripwire set, so the sample is
+       not taken while the controller is advancing the queue. The ISR's
+       SUTW read-modify-write of usbcmd must not land in between: it
+       would write back ATDTW after the controller cleared it. */
+    primask = USB_IRQ_SAVE();
+    do
+    {
+      drv->regs->usbcmd |= USBCMD_ATDTW;
+      status = drv->regs->endptstatus & _BIT(n);
+    } while (!(drv->regs->usbcmd & USBCMD_ATDTW));
+    drv->regs->usbcmd &= ~USBCMD_ATDTW;
+    USB_IRQ_RESTORE(primask);
+
+    /* still active, the controller follows the link */
+    if (status)
+      return TsfSize;
+  }
+
+  /* normally the new dTD; with USB_HW_ASYNC_PRIME an earlier prime may
+     not have taken, then the queue restarts from its oldest transfer */
+  hwUSB_PrimeQueue(drv, Edpt, n);
 
-  drv->ep_QH[Edpt].next_dTD = (uint32_t)(&drv->ep_TD[ Edpt ]);
-  drv->ep_QH[Edpt].total_bytes &= (~0xC0) ;
+  return TsfSize;
 }
 
 /*
-*  Read USB Endpoint Data
-*    Parameters:      EPNum: Endpoint Number
-*                       EPNum.0..3: Address
-*                       EPNum.7:    Dir
+*  Read the setup packet and acknowledge ENDPTSETUPSTAT
+*    Parameters:      num: Physical endpoint number
 *                     pData: Pointer to Data Buffer
 *    Return Value:    Number of bytes read
 */
-uint32_t hwUSB_ReadSetupPkt(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pData)
+
+static uint32_t hwUSB_AckSetup(USBD_HW_DATA_T* drv, uint32_t num, uint32_t *pData)
 {
-  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
-  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
   uint32_t  setup_int, cnt = 0;
-  uint32_t num = EPAdr(EPNum);
 
   setup_int = drv->regs->endptsetupstat ;
   /* Clear the setup interrupt */
@@ -643,12 +905,44 @@ uint32_t hwUSB_ReadSetupPkt(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pData)
     /* Clear the setup interrupt */
     drv->regs->endptsetupstat = setup_int;
   }
+  return cnt;
+}
+
+/*
+*  Read USB Endpoint Data
+*    Parameters:      EPNum: Endpoint Number
+*                       EPNum.0..3: Address
+*                       EPNum.7:    Dir
+*                     pData: Pointer to Data Buffer
+*    Return Value:    Number of bytes read
+*/
+uint32_t hwUSB_ReadSetupPkt(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pData)
+{
+  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t cnt;
+
+  if (drv->setup_pkt)
+  {
+    /* already read and acknowledged by hwUSB_CaptureEvents */
+    pData[0] = drv->setup_pkt[0];
+    pData[1] = drv->setup_pkt[1];
+    cnt = 8;
+  }
+  else
+  {
+    cnt = hwUSB_AckSetup(drv, EPAdr(EPNum), pData);
+  }
   /* flush any pending Control endpoint tranfers. Note, it is possible
   for the device controller to receive setup packets before previous
   control transfers complete. Existing control packets in progress must be
   flushed and the new control packet completed.  */
   drv->regs->endptflush = 0x00010001;
-  while (drv->regs->endptflush & 0x00010001);
+#if !USB_HW_ASYNC_PRIME
+  WAIT_FLUSH(drv, 0x00010001);
+#endif
+  hwUSB_ClearDTDQueue(drv, 0);
+  hwUSB_ClearDTDQueue(drv, 1);
 
   return cnt;
 }
@@ -664,24 +958,8 @@ uint32_t hwUSB_ReadSetupPkt(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pData)
 
 uint32_t hwUSB_ReadReqEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t len)
 {
-  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
-  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
-  uint32_t num = EPAdr(EPNum);
-  uint32_t n = USB_EP_BITPOS(EPNum);
-
-  if ( (drv->regs->endptstatus & _BIT(n)) == 0){
-	  hwUSB_ProgDTD(hUsb, num, (uint32_t)pData, len);
-	  drv->ep_read_len[EPNum & 0x0F] = len;
-	  /* prime the endpoint for read */
-	  drv->regs->endptprime = _BIT(n) ;
-	  /* check if priming succeeded */
-	  while (drv->regs->endptprime & _BIT(n));
-  }
-  else {
-	len = 0;
-  }
-
-  return len;
+  /* queue the dTD and prime the endpoint for read */
+  return hwUSB_ProgDTD(hUsb, EPAdr(EPNum), (uint32_t)pData, len);
 }
 
 /*
@@ -701,11 +979,11 @@ uint32_t hwUSB_ReadEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData)
   DTD_T*  pDTD ;
 
   n = EPAdr(EPNum);
-  pDTD    = (DTD_T*) &drv->ep_TD [ n ] ;
+  pDTD    = EPTd(drv, n, drv->ep_td_done[n]);
 
   /* return the total bytes read */
   cnt  = (pDTD->total_bytes >> 16) & 0x7FFF;
-  cnt = drv->ep_read_len[EPNum & 0x0F] - cnt;
+  cnt = pDTD->xfer_len - cnt;
   /* make buffer cache coherent*/
   if (pCtrl->cache_flush)
     pCtrl->cache_flush((uint32_t*)pData, (uint32_t*)(pData + cnt));
@@ -714,6 +992,40 @@ uint32_t hwUSB_ReadEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData)
 }
 
 
+/*
+*  Get the result of the last completed transfer
+*    Parameters:      EPNum: Endpoint Number
+*                       EPNum.0..3: Address
+*                       EPNum.7:    Dir
+*                     pStatus: Set to the USBD_XFER_ERR_xxx bits when not 0
+*    Return Value:    Number of bytes sent or received
+*/
+
+uint32_t hwUSB_GetXferLen(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pStatus)
+{
+  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t token, n;
+  DTD_T*  pDTD ;
+
+  n = EPAdr(EPNum);
+  pDTD = EPTd(drv, n, drv->ep_td_done[n]);
+  token = pDTD->total_bytes;
+
+  if (pStatus)
+  {
+    *pStatus = 0;
+    /* ISO packet missed in its (micro)frame or received with an error */
+    if (token & TD_STATUS_XACT_ERR)
+      *pStatus |= USBD_XFER_ERR_XACT;
+    /* controller could not keep up with the bus */
+    if (token & TD_STATUS_BUFF_ERR)
+      *pStatus |= USBD_XFER_ERR_BUFF;
+  }
+  return pDTD->xfer_len - ((token >> 16) & 0x7FFF);
+}
+
+
 /*
 *  Write USB Endpoint Data
 *    Parameters:      EPNum: Endpoint Number
@@ -727,26 +1039,13 @@ uint32_t hwUSB_ReadEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData)
 uint32_t hwUSB_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt)
 {
   USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
-  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
-  uint32_t n = USB_EP_BITPOS(EPNum);
 
   /* make buffer cache coherent*/
   if (pCtrl->cache_flush)
     pCtrl->cache_flush((uint32_t*)pData, (uint32_t*)(pData + cnt));
 
-  if ((drv->regs->endptstatus & _BIT(n)) == 0) {
-	  hwUSB_ProgDTD(hUsb, EPAdr(EPNum), (uint32_t)pData, cnt);
-	  /* prime the endpoint for transmit */
-	  drv->regs->endptprime = _BIT(n) ;
-
-	  /* check if priming succeeded */
-	  while (drv->regs->endptprime & _BIT(n));
-  }
-  else {
-	cnt = 0;
-  }
-
-  return (cnt);
+  /* queue the dTD and prime the endpoint for transmit */
+  return hwUSB_ProgDTD(hUsb, EPAdr(EPNum), (uint32_t)pData, cnt);
 }
 
 /**
@@ -763,10 +1062,11 @@ uint32_t hwUSB_WriteEP(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint3
 uint32_t hwUSB_GetMemSize(USBD_API_INIT_PARAM_T* param)
 {
   uint32_t req_len = 0;
+  uint32_t depth = param->dtd_pool_depth ? param->dtd_pool_depth : 1;
 
   /* calculate required length */
   req_len += ((2 * param->max_num_ep) * sizeof(DQH_T));  /* ep queue heads */
-  req_len += ((2 * param->max_num_ep) * sizeof(DTD_T));  /* ep transfer descriptors */
+  req_len += ((2 * param->max_num_ep) * depth * sizeof(DTD_T));  /* ep transfer descriptor pools */
   req_len += sizeof(USBD_HW_DATA_T);   /* memory for hw driver data structure */
   req_len += sizeof(USB_CORE_CTRL_T);  /* memory for USBD controller structure */
   req_len += 8; /* for alignment overhead */
@@ -787,6 +1087,7 @@ ErrorCode_t hwUSB_Init(USBD_HANDLE_T* phUsb, USB_CORE_DESCS_T* pDesc, USBD_API_I
   DTD_T* ep_TD;
   USBD_HW_DATA_T* drv;
   USB_CORE_CTRL_T* pCtrl;
+  uint32_t depth = param->dtd_pool_depth ? param->dtd_pool_depth : 1;
 
   /* check for memory alignment */
   if ((param->mem_base &  (2048 - 1)) && 
@@ -800,8 +1101,8 @@ ErrorCode_t hwUSB_Init(USBD_HANDLE_T* phUsb, USB_CORE_DESCS_T* pDesc, USBD_API_I
 
   /* allocate memory for ep_TD which should be on 32 byte alignment.*/
   ep_TD = (DTD_T*)param->mem_base;
-  param->mem_base += ((2 * param->max_num_ep) * sizeof(DTD_T));
-  param->mem_size -= ((2 * param->max_num_ep) * sizeof(DTD_T));
+  param->mem_base += ((2 * param->max_num_ep) * depth * sizeof(DTD_T));
+  param->mem_size -= ((2 * param->max_num_ep) * depth * sizeof(DTD_T));
   /* allocate memory for hardware driver data structure */
   drv = (USBD_HW_DATA_T*)param->mem_base;
   param->mem_base += sizeof(USBD_HW_DATA_T);
@@ -815,16 +1116,23 @@ ErrorCode_t hwUSB_Init(USBD_HANDLE_T* phUsb, USB_CORE_DESCS_T* pDesc, USBD_API_I
   /* align to 4 byte boundary */
   while (param->mem_base & 0x03) param->mem_base++;
 
-  /* now init USBD stack */
-  mwUSB_InitCore(pCtrl, pDesc, param);
+  /* now init USBD stack, fails if the descriptors overflow the core's index */
+  if (mwUSB_InitCore(pCtrl, pDesc, param) != LPC_OK)
+    return ERR_USBD_BAD_DESC;
 
   /* now initialize data structures */
   memset((void*)drv, 0, sizeof(USBD_HW_DATA_T));
   /* set stack control and hw control pointer */
   drv->pCtrl = pCtrl;
+  drv->td_depth = depth;
   pCtrl->hw_data = (void*)drv;
   /* set up regs */
   drv->regs  = (USB_OTG_REGS_T* )param->usb_reg_base;
+#if USB_HW_SPIN_STATS
+  /* start the cycle counter used for the busy-wait statistics */
+  DEMCR |= DEMCR_TRCENA;
+  DWT_CTRL |= DWT_CYCCNTENA;
+#endif
 
   /* check if the eP_QH are allocated in cached region. If so get the
    * uncached address value.
@@ -862,19 +1170,149 @@ ErrorCode_t hwUSB_Init(USBD_HANDLE_T* phUsb, USB_CORE_DESCS_T* pDesc, USBD_API_I
 
 
 /*
-*  USB Interrupt Service Routine
+*  Retire completed dTDs of an endpoint
+*   Walks the endpoint's queue from the oldest dTD and calls the endpoint
+*   handler once for each transfer the controller has finished. A single
+*   completion interrupt may cover several queued transfers.
+*    Parameters:      Edpt:  Endpoint index. eg. EP3_IN = 7.
+*                     event: USB_EVT_OUT or USB_EVT_IN
+*    Return Value:    None
 */
 
-void hwUSB_ISR(USBD_HANDLE_T hUsb)
+static void hwUSB_RetireDTDs(USB_CORE_CTRL_T* pCtrl, uint32_t Edpt, uint32_t event)
 {
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t head;
+#if USB_HW_ASYNC_PRIME
+  uint32_t n = (Edpt >> 1) + ((Edpt & 1) ? 16 : 0);
+#endif
+
+  while (drv->ep_td_cnt[Edpt])
+  {
+    head = drv->ep_td_head[Edpt];
+    if (EPTd(drv, Edpt, head)->total_bytes & TD_STATUS_ACTIVE)
+      break;
+
+    /* free the slot before calling the handler so that it can queue the next transfer */
+    drv->ep_td_done[Edpt] = head;
+    drv->ep_td_head[Edpt] = (head + 1 == drv->td_depth) ? 0 : (head + 1);
+    drv->ep_td_cnt[Edpt]--;
+
+    if (pCtrl->ep_event_hdlr[Edpt])
+      pCtrl->ep_event_hdlr[Edpt](pCtrl, pCtrl->ep_hdlr_data[Edpt], event);
+  }
+
+#if USB_HW_ASYNC_PRIME
+  /* nobody waited for the prime: transfers are still queued but neither a
+     prime is pending nor is the endpoint active, so the controller stopped
+     short of them. Prime is read first, it clears as the status sets. */
+  if (drv->ep_td_cnt[Edpt] &&
+      !(drv->regs->endptprime & _BIT(n)) &&
+      !(drv->regs->endptstatus & _BIT(n)))
+    hwUSB_PrimeQueue(drv, Edpt, n);
+#endif
+}
+
+/*
+*  Get busy-wait statistics
+*    Parameters:      stats: Filled with the statistics, zeroed when
+*                            USB_HW_SPIN_STATS is not set
+*                     clear: Restart counting when non-zero
+*    Return Value:    None
+*/
+
+void hwUSB_GetSpinStats(USBD_HANDLE_T hUsb, USBD_HW_SPIN_STATS_T* stats, uint32_t clear)
+{
+#if USB_HW_SPIN_STATS
   USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
   USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
-  uint32_t disr, val, n, ep_indx;
+
+  *stats = drv->spin;
+  if (clear)
+    memset((void*)&drv->spin, 0, sizeof(drv->spin));
+#else
+  memset((void*)stats, 0, sizeof(USBD_HW_SPIN_STATS_T));
+#endif
+}
+
+/*
+*  Read and acknowledge pending controller events
+*    Parameters:      ev: Filled with the event snapshot
+*    Return Value:    None
+*/
+
+static void hwUSB_CaptureEvents(USB_CORE_CTRL_T* pCtrl, USBD_HW_EVENT_T* ev)
+{
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t disr, val, ep_mask;
 
   disr = drv->regs->usbsts;                      /* Device Interrupt Status */
   drv->regs->usbsts = disr;
   /* lets handle events we are interested in */
   disr = disr & drv->regs->usbintr;
+  ev->disr = disr;
+  ev->setup = 0;
+  ev->complete = 0;
+  ev->nak = 0;
+
+  /* a reset discards everything else */
+  if (disr & USBSTS_URI)
+    return;
+
+  /* handle setup status interrupts */
+  val = drv->regs->endptsetupstat;
+  /* Only EP0 will have setup packets so call EP0 handler */
+  if (val)
+  {
+    /* Clear the endpoint complete CTRL OUT & IN when */
+    /* a Setup is received */
+    drv->regs->endptcomplete = 0x00010001;
+    /* enable NAK inetrrupts */
+    drv->regs->endptnaken |= 0x00010001;
+    /* take the packet now: a later interrupt captured before this one is
+       dispatched must not see the same setup again */
+    if (hwUSB_AckSetup(drv, 0, (uint32_t*)ev->setup_pkt))
+      ev->setup = val;
+  }
+
+  /* RX bits 0..max_num_ep-1 and TX bits 16..16+max_num_ep-1 */
+  ep_mask = (_BIT(pCtrl->max_num_ep) - 1) * 0x00010001;
+
+  /* handle completion interrupts */
+  val = drv->regs->endptcomplete & ep_mask;
+  if (val)
+  {
+    drv->regs->endptnak = val;
+    /* acknowledge all completions at once; the dTD queues are walked
+       after the ack so a transfer finishing meanwhile is not lost */
+    drv->regs->endptcomplete = val;
+    ev->complete = val;
+  }
+
+  if (disr & USBSTS_NAKI)
+  {
+    val = drv->regs->endptnak;
+    val &= drv->regs->endptnaken & ep_mask;
+    if (val)
+    {
+      drv->regs->endptnak = val;
+      ev->nak = val;
+    }
+  }
+}
+
+/*
+*  Run the stack handlers for a snapshot of controller events
+*    Parameters:      ev: Event snapshot taken by hwUSB_CaptureEvents
+*    Return Value:    None
+*/
+
+static void hwUSB_DispatchEvents(USB_CORE_CTRL_T* pCtrl, USBD_HW_EVENT_T* ev)
+{
+  USBD_HANDLE_T hUsb = (USBD_HANDLE_T)pCtrl;
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t disr = ev->disr;
+  uint32_t val, n, ep_indx;
 
   /* Device Status Interrupt (Reset, Connect change, Suspend/Resume) */
   if (disr & USBSTS_URI)                      /* Reset */
@@ -883,7 +1321,7 @@ void hwUSB_ISR(USBD_HANDLE_T hUsb)
     mwUSB_ResetCore(pCtrl);
     if (pCtrl->USB_Reset_Event)
       pCtrl->USB_Reset_Event(hUsb);
-    goto isr_end;
+    return;
   }
 
   if (disr & USBSTS_SLI)                   /* Suspend */
@@ -905,72 +1343,33 @@ void hwUSB_ISR(USBD_HANDLE_T hUsb)
       pCtrl->USB_Resume_Event(hUsb);
   }
 
-  /* handle setup status interrupts */
-  val = drv->regs->endptsetupstat;
-  /* Only EP0 will have setup packets so call EP0 handler */
-  if (val)
+  if (ev->setup)
   {
-    /* Clear the endpoint complete CTRL OUT & IN when */
-    /* a Setup is received */
-    drv->regs->endptcomplete = 0x00010001;
-    /* enable NAK inetrrupts */
-    drv->regs->endptnaken |= 0x00010001;
+    drv->setup_pkt = (uint32_t*)ev->setup_pkt;
     if (pCtrl->ep_event_hdlr[0])
       pCtrl->ep_event_hdlr[0](pCtrl, pCtrl->ep_hdlr_data[0], USB_EVT_SETUP);
+    drv->setup_pkt = 0;
   }
 
-  /* handle completion interrupts */
-  val = drv->regs->endptcomplete;
-  ep_indx = 0;
-  if (val)
+  /* visit set bits only */
+  val = ev->complete;
+  while (val)
   {
-    drv->regs->endptnak = val;
-    for (n = 0; n < pCtrl->max_num_ep; n++)
-    {
-      if (val & _BIT(n))
-      {
-        if (pCtrl->ep_event_hdlr[ep_indx])
-          pCtrl->ep_event_hdlr[ep_indx](pCtrl, pCtrl->ep_hdlr_data[ep_indx], USB_EVT_OUT);
-
-        drv->regs->endptcomplete = _BIT(n);
-      }
-      if (val & _BIT(n + 16))
-      {
-        drv->ep_TD [(n << 1) + 1 ].total_bytes &= 0xC0;
-        if (pCtrl->ep_event_hdlr[ep_indx + 1])
-          pCtrl->ep_event_hdlr[ep_indx + 1](pCtrl, pCtrl->ep_hdlr_data[ep_indx + 1], USB_EVT_IN);
-
-        drv->regs->endptcomplete = _BIT(n + 16);
-      }
-      ep_indx += 2;
-    }
+    n = 31 - USB_CLZ(val);
+    val &= ~_BIT(n);
+    hwUSB_RetireDTDs(pCtrl, EPBitIndx(n), (n >= 16) ? USB_EVT_IN : USB_EVT_OUT);
   }
 
-  if (disr & USBSTS_NAKI)
+  /* handle NAK interrupts */
+  val = ev->nak;
+  while (val)
   {
-    val = drv->regs->endptnak;
-    val &= drv->regs->endptnaken;
-    /* handle NAK interrupts */
-    ep_indx = 0;
-    if (val)
-    {
-      for (n = 0; n < pCtrl->max_num_ep; n++)
-      {
-
-        if (val & _BIT(n))
-        {
-          if (pCtrl->ep_event_hdlr[ep_indx])
-            pCtrl->ep_event_hdlr[ep_indx](pCtrl, pCtrl->ep_hdlr_data[ep_indx], USB_EVT_OUT_NAK);
-        }
-        if (val & _BIT(n + 16))
-        {
-          if (pCtrl->ep_event_hdlr[ep_indx + 1])
-            pCtrl->ep_event_hdlr[ep_indx + 1](pCtrl, pCtrl->ep_hdlr_data[ep_indx + 1], USB_EVT_IN_NAK);
-        }
-        ep_indx += 2;
-      }
-      drv->regs->endptnak = val;
-    }
+    n = 31 - USB_CLZ(val);
+    val &= ~_BIT(n);
+    ep_indx = EPBitIndx(n);
+    if (pCtrl->ep_event_hdlr[ep_indx])
+      pCtrl->ep_event_hdlr[ep_indx](pCtrl, pCtrl->ep_hdlr_data[ep_indx],
+                                    (n >= 16) ? USB_EVT_IN_NAK : USB_EVT_OUT_NAK);
   }
 
   /* Start of Frame Interrupt */
@@ -986,9 +1385,77 @@ void hwUSB_ISR(USBD_HANDLE_T hUsb)
     if (pCtrl->USB_Error_Event)
       pCtrl->USB_Error_Event(hUsb, disr);
   }
+}
+
+/*
+*  USB Interrupt Service Routine
+*   With USB_HW_DEFER_EVENTS set the ISR only queues a snapshot of the
+*   controller events; the handlers run from hwUSB_ProcessEvents.
+*/
+
+void hwUSB_ISR(USBD_HANDLE_T hUsb)
+{
+  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
+#if USB_HW_DEFER_EVENTS
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t head = drv->ev_head;
+
+  if ((uint8_t)(head - drv->ev_tail) >= USB_HW_EVENT_RING_SIZE)
+  {
+    /* ring full: leave the events pending in the controller and mask the
+       interrupt until hwUSB_ProcessEvents has made room. Meanwhile
+       hwUSB_EnableEvent updates usbintr_saved instead of usbintr. */
+    if (drv->regs->usbintr)
+    {
+      drv->usbintr_saved = drv->regs->usbintr;
+      drv->regs->usbintr = 0;
+    }
+    return;
+  }
+  hwUSB_CaptureEvents(pCtrl, &drv->ev_ring[head & (USB_HW_EVENT_RING_SIZE - 1)]);
+  /* publish the entry only after it is complete */
+  drv->ev_head = (uint8_t)(head + 1);
+#else
+  USBD_HW_EVENT_T ev;
+
+  hwUSB_CaptureEvents(pCtrl, &ev);
+  hwUSB_DispatchEvents(pCtrl, &ev);
+#endif
+}
+
+/*
+*  Run the handlers for events queued by the USB Interrupt Service Routine
+*   Called from thread mode or a low priority interrupt (eg. PendSV) when
+*   USB_HW_DEFER_EVENTS is set. Does nothing otherwise.
+*    Return Value:    Number of event snapshots processed
+*/
 
-isr_end:
-  return;
+uint32_t hwUSB_ProcessEvents(USBD_HANDLE_T hUsb)
+{
+#if USB_HW_DEFER_EVENTS
+  USB_CORE_CTRL_T* pCtrl = (USB_CORE_CTRL_T*)hUsb;
+  USBD_HW_DATA_T* drv = (USBD_HW_DATA_T*)pCtrl->hw_data;
+  uint32_t cnt = 0;
+  uint32_t tail;
+
+  while ((tail = drv->ev_tail) != drv->ev_head)
+  {
+    hwUSB_DispatchEvents(pCtrl, &drv->ev_ring[tail & (USB_HW_EVENT_RING_SIZE - 1)]);
+    /* hand the entry back to the ISR */
+    drv->ev_tail = (uint8_t)(tail + 1);
+    cnt++;
+
+    /* unmask the interrupt if the ISR found the ring full */
+    if (drv->usbintr_saved)
+    {
+      drv->regs->usbintr = drv->usbintr_saved;
+      drv->usbintr_saved = 0;
+    }
+  }
+  return cnt;
+#else
+  return 0;
+#endif
 }
 
 /**
@@ -28,6 +28,7 @@
 #define HW_USBD_IP9208_H
 
 #include <stdint.h>
+#include "mw_usbd.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -112,7 +113,7 @@ typedef volatile struct
   volatile uint32_t buffer2;
   volatile uint32_t buffer3;
   volatile uint32_t buffer4;
-  volatile uint32_t reserved;
+  volatile uint32_t xfer_len;   /* not used by the controller: length queued by the driver */
 }  DTD_T;
 
 /* dQH  Queue Head */
@@ -202,7 +203,30 @@ typedef volatile struct
 
 /* dTD field and bit defines */
 #define TD_NEXT_TERMINATE         _BIT(0)
+#define TD_MULTO(n)               _SBF(10,((n) & 0x3))
 #define TD_IOC                    _BIT(15)
+#define TD_STATUS_XACT_ERR        _BIT(3)
+#define TD_STATUS_BUFF_ERR        _BIT(5)
+#define TD_STATUS_HALTED          _BIT(6)
+#define TD_STATUS_ACTIVE          _BIT(7)
+
+/* Time spent waiting on one kind of controller register */
+typedef struct
+{
+  uint32_t calls;     /* number of waits */
+  uint32_t cycles;    /* total CPU cycles spent spinning */
+  uint32_t max;       /* longest single wait in CPU cycles */
+} USBD_HW_SPIN_STAT_T;
+
+/* Busy-wait statistics, collected when USB_HW_SPIN_STATS is set */
+typedef struct
+{
+  USBD_HW_SPIN_STAT_T prime;  /* waits on ENDPTPRIME */
+  USBD_HW_SPIN_STAT_T flush;  /* waits on ENDPTFLUSH */
+} USBD_HW_SPIN_STATS_T;
+
+/* Copy the busy-wait statistics of the driver, optionally clearing them */
+extern void hwUSB_GetSpinStats(USBD_HANDLE_T hUsb, USBD_HW_SPIN_STATS_T* stats, uint32_t clear);
 
 #ifdef __cplusplus
 }
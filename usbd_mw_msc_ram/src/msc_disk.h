@@ -45,11 +45,17 @@ extern "C"
 
 /* MSC Disk Image Definitions */
 /* Mass Storage Memory Layout */
-#define MSC_MEM_DISK_BASE               0x20004000
+#define MSC_MEM_DISK_BASE               0x20008000
 #define MSC_MEM_DISK_SIZE               ((uint32_t) (32 * 1024))
 #define MSC_MEM_DISK_BLOCK_SIZE         512
 #define MSC_MEM_DISK_BLOCK_COUNT        (MSC_MEM_DISK_SIZE / MSC_MEM_DISK_BLOCK_SIZE)
 #define MSC_USB_DISK_BLOCK_SIZE         512
+/* Bulk data buffers: READ10 data is sent in chunks of this size */
+#define MSC_USB_XFER_SIZE               (8 * 1024)
+/* Number of bulk data buffers, ie. READ10 chunks queued on the IN endpoint */
+#define MSC_USB_XFER_BUFS               2
+/* WRITE10 data is received straight into the disk in chunks of this size */
+#define MSC_USB_RX_WINDOW               (16 * 1024)
 
 /**
  * @brief	MSC disk init routine
@@ -63,38 +63,22 @@ static USBD_HANDLE_T g_hUsb;
 void USB_IRQHandler(void)
 {
 	usb_api.hw->ISR(g_hUsb);
+#if USB_HW_DEFER_EVENTS
+	/* run the stack handlers at the lowest priority */
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+#endif
 }
 
+#if USB_HW_DEFER_EVENTS
 /**
- * @brief	Find the address of interface descriptor for given class type.
- * @return	If found returns the address of requested interface else returns NULL.
+ * @brief	Run USB event handlers deferred by USB_IRQHandler
+ * @return	Nothing
  */
-USB_INTERFACE_DESCRIPTOR *find_IntfDesc(const uint8_t *pDesc, uint32_t intfClass)
+void PendSV_Handler(void)
 {
-	USB_COMMON_DESCRIPTOR *pD;
-	USB_INTERFACE_DESCRIPTOR *pIntfDesc = 0;
-	uint32_t next_desc_adr;
-
-	pD = (USB_COMMON_DESCRIPTOR *) pDesc;
-	next_desc_adr = (uint32_t) pDesc;
-
-	while (pD->bLength) {
-		/* is it interface descriptor */
-		if (pD->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) {
-
-			pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) pD;
-			/* did we find the right interface descriptor */
-			if (pIntfDesc->bInterfaceClass == intfClass) {
-				break;
-			}
-		}
-		pIntfDesc = 0;
-		next_desc_adr = (uint32_t) pD + pD->bLength;
-		pD = (USB_COMMON_DESCRIPTOR *) next_desc_adr;
-	}
-
-	return pIntfDesc;
+	usb_api.hw->ProcessEvents(g_hUsb);
 }
+#endif
 
 /**
  * @brief	main routine for blinky example
@@ -127,6 +111,8 @@ int main(void)
 	usb_param.mem_base = USB_STACK_MEM_BASE;
 	usb_param.mem_size = USB_STACK_MEM_SIZE;
 	usb_param.max_num_ep = 2;
+	/* let the MSC driver queue one transfer per bulk data buffer */
+	usb_param.dtd_pool_depth = MSC_USB_XFER_BUFS;
 
 	/* Set the USB descriptors */
 	desc.device_desc = (uint8_t *) USB_DeviceDescriptor;
@@ -142,6 +128,9 @@ int main(void)
 	if (ret == LPC_OK) {
 		ret = mscDisk_init(g_hUsb, &desc, &usb_param);
 		if (ret == LPC_OK) {
+#if USB_HW_DEFER_EVENTS
+			NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+#endif
 			/*  enable USB interrrupts */
 			NVIC_EnableIRQ(LPC_USB_IRQ);
 			/* now connect */
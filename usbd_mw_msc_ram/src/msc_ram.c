@@ -33,6 +33,7 @@
 #include "board.h"
 #include "app_usbd_cfg.h"
 #include "msc_disk.h"
+#include "mw_usbd_crc32.h"
 
 /*****************************************************************************
  * Private types/enumerations/variables
@@ -42,6 +43,8 @@ static const uint8_t g_InquiryStr[] = {'N', 'X', 'P', ' ', ' ', ' ', ' ', ' ',
 									   'L', 'P', 'C', ' ', 'M', 'e', 'm', ' ',	   \
 									   'D', 'i', 's', 'k', ' ', ' ', ' ', ' ',	   \
 									   '1', '.', '0', ' ', };
+/* CRC32 of each disk block, checked by VERIFY without data */
+static uint32_t g_blockCrc[MSC_MEM_DISK_BLOCK_COUNT];
 /*****************************************************************************
  * Public types/enumerations/variables
  ****************************************************************************/
@@ -56,9 +59,21 @@ static void translate_rd(uint32_t offset, uint8_t * *buff_adr, uint32_t length,
 	*buff_adr =  &g_memDiskArea[(((uint64_t) offset) | (((uint64_t) hi_offset) << 32))];
 }
 
+/* Recompute the CRC32 of the blocks holding a byte range */
+static void update_crc(uint32_t offset, uint32_t length)
+{
+	uint32_t blk;
+
+	for (blk = offset / MSC_MEM_DISK_BLOCK_SIZE; blk < (offset + length + MSC_MEM_DISK_BLOCK_SIZE - 1) / MSC_MEM_DISK_BLOCK_SIZE; blk++) {
+		g_blockCrc[blk] = mwUSB_Crc32(0, &g_memDiskArea[blk * MSC_MEM_DISK_BLOCK_SIZE], MSC_MEM_DISK_BLOCK_SIZE);
+	}
+}
+
 /* USB device mass storage class write callback routine */
 static void translate_wr(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t hi_offset)
 {
+	/* data is already in place, received through translate_GetWrBuf() */
+	update_crc(offset, length);
 	*buff_adr =  &g_memDiskArea[(((uint64_t) offset) | (((uint64_t) hi_offset) << 32)) + length];
 }
 
@@ -78,6 +93,20 @@ static ErrorCode_t translate_verify(uint32_t offset, uint8_t *src, uint32_t leng
 	return LPC_OK;
 }
 
+/* USB device mass storage class verify range callback routine */
+static ErrorCode_t translate_verify_range(uint32_t offset, uint32_t length, uint32_t hi_offset)
+{
+	uint32_t blk;
+
+	for (blk = offset / MSC_MEM_DISK_BLOCK_SIZE; blk < (offset + length) / MSC_MEM_DISK_BLOCK_SIZE; blk++) {
+		if (mwUSB_Crc32(0, &g_memDiskArea[blk * MSC_MEM_DISK_BLOCK_SIZE], MSC_MEM_DISK_BLOCK_SIZE) != g_blockCrc[blk]) {
+			return ERR_FAILED;
+		}
+	}
+
+	return LPC_OK;
+}
+
 /*****************************************************************************
  * Public functions
  ****************************************************************************/
@@ -96,12 +125,17 @@ ErrorCode_t mscDisk_init(USBD_HANDLE_T hUsb, USB_CORE_DESCS_T *pDesc, USBD_API_I
 	msc_param.BlockCount = MSC_MEM_DISK_BLOCK_COUNT;
 	msc_param.BlockSize = MSC_MEM_DISK_BLOCK_SIZE;
 	msc_param.MemorySize = MSC_MEM_DISK_SIZE;
+	msc_param.XferBufSize = MSC_USB_XFER_SIZE;
+	msc_param.RxWindow = MSC_USB_RX_WINDOW;
+	msc_param.XferBufCnt = MSC_USB_XFER_BUFS;
 	/* Install memory storage callback routines */
 	msc_param.MSC_Write = translate_wr;
 	msc_param.MSC_Read = translate_rd;
 	msc_param.MSC_Verify = translate_verify;
 	msc_param.MSC_GetWriteBuf = translate_GetWrBuf;
-	msc_param.intf_desc = (uint8_t *) find_IntfDesc(pDesc->high_speed_desc, USB_DEVICE_CLASS_STORAGE);
+	msc_param.MSC_VerifyRange = translate_verify_range;
+	update_crc(0, MSC_MEM_DISK_SIZE);
+	msc_param.intf_desc = (uint8_t *) usb_api.core->FindIntfDesc(hUsb, USB_HIGH_SPEED, USB_DEVICE_CLASS_STORAGE);
 
 	ret = usb_api.msc->init(hUsb, &msc_param);
 	/* update memory variables */
@@ -52,12 +52,14 @@
 #define POST_PACK   __attribute__ ((__packed__))
 #define ALIGNED(n)      __attribute__ ((aligned(n)))
 #define INLINE          inline
+#define COMPILER_BARRIER()  __asm volatile ("" ::: "memory")
 
 #elif defined(__CC_ARM)
 #define PRE_PACK    __packed
 #define POST_PACK
 #define ALIGNED(n)      __align(n)
 #define INLINE          __inline
+#define COMPILER_BARRIER()  __schedule_barrier()
 
 #elif defined(__ICCARM__)
 #define PRE_PACK                __packed
@@ -72,8 +74,13 @@
 #define PRAGMA_ALIGN_4          _Pragma("data_alignment=4")
 #define ALIGNED(n)              PRAGMA_ALIGN_ ## n
 #define INLINE                  inline
+#define COMPILER_BARRIER()      __asm volatile ("" ::: "memory")
 #endif
 
+/* COMPILER_BARRIER() keeps the compiler from moving memory accesses across it.
+   Buffers shared between the main loop and the USB interrupt of the same core
+   need nothing stronger. */
+
 /** Structure to pack lower and upper byte to form 16 bit word. */
 PRE_PACK struct POST_PACK _WB_T {
 	uint8_t L;	/**< lower byte */
@@ -1,4 +1,3 @@
-#if 0
 /***********************************************************************
  * $Id:: mw_usbd_adcuser.c 165 2011-04-14 17:41:11Z usb10131                   $
  *
@@ -22,295 +21,683 @@
  * warranty that such application will be suitable for the specified
  * use without further testing or modification.
  **********************************************************************/
+#include <string.h>	/*for memcpy */
 
-/* USB header files */
 #include "mw_usbd.h"
 #include "mw_usbd_core.h"
+#include "mw_usbd_hw.h"
 #include "mw_usbd_audio.h"
 #include "mw_usbd_adcuser.h"
 
-volatile uint16_t VolCur = 0x003D;		/* Volume Current Value */
-uint16_t VolMin = 0x0000;		/* Volume Minimum Value */
-uint16_t VolMax = 0x003F;		/* Volume Maximum Value */
-uint16_t VolRes = 0x0001;		/* Volume Resolution */
-uint32_t g_sample_rate[2] = {48000, 48000};
+#ifndef FALSE
+#define FALSE 0
+#define TRUE !FALSE
+#endif
 
 /*
- *  Audio Device Class Interface Get Request Callback
- *   Called automatically on ADC Interface Get Request
- *    Parameters:      None (global SetupPacket and EP0Buf)
- *    Return Value:    LPC_OK - Success, ERR_USBD_INVALID_REQ - Error
+ *  ADC FIFO Copy
+ *  Parameters:      pAdc: Handle to ADC structure
+ *                   pos: Free running FIFO index of the first byte.
+ *                   data: Linear buffer.
+ *                   len: Number of bytes to copy.
+ *                   to_fifo: TRUE to copy data into the FIFO, FALSE out of it.
+ *  Return Value:    None
  */
 
-ErrorCode_t ADC_IF_GetRequest(void) {
-
-	/*
-	   Interface = SetupPacket.wIndex.WB.L;
-	   EntityID  = SetupPacket.wIndex.WB.H;
-	   Request   = SetupPacket.bRequest;
-	   Value     = SetupPacket.wValue.W;
-	   ...
-	 */
-
-	if (pCtrl->SetupPacket.wIndex.W == 0x0200) {
-		/* Feature Unit: Interface = 0, ID = 2 */
-		if (pCtrl->SetupPacket.wValue.WB.L == 0) {
-			/* Master Channel */
-			switch (pCtrl->SetupPacket.wValue.WB.H) {
-			case AUDIO_MUTE_CONTROL:
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_GET_CUR:
-					pCtrl->EP0Buf[0] = Mute;
-					return LPC_OK;
-				}
-				break;
+void mwADC_FifoCopy(USB_ADC_CTRL_T *pAdc, uint32_t pos, uint8_t *data, uint32_t len, uint32_t to_fifo)
+{
+	uint32_t off = pos & pAdc->fifo_mask;
+	uint32_t n = pAdc->fifo_mask + 1 - off;
 
-			case AUDIO_VOLUME_CONTROL:
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_GET_CUR:
-					*((__packed uint16_t *) pCtrl->EP0Buf) = VolCur;
-					return LPC_OK;
+	if (n > len) {
+		n = len;
+	}
+	if (to_fifo) {
+		memcpy(pAdc->fifo + off, data, n);
+		memcpy(pAdc->fifo, data + n, len - n);
+	}
+	else {
+		memcpy(data, pAdc->fifo + off, n);
+		memcpy(data + n, pAdc->fifo, len - n);
+	}
+}
 
-				case AUDIO_REQUEST_GET_MIN:
-					*((__packed uint16_t *) pCtrl->EP0Buf) = VolMin;
-					return LPC_OK;
+/*
+ *  ADC FIFO Level
+ *  Parameters:      pAdc: Handle to ADC structure
+ *  Return Value:    Bytes of the current stream in the FIFO
+ *
+ *  Data left over from before the stream started is not counted, the next
+ *  ReadSamples() call drops it.
+ */
 
-				case AUDIO_REQUEST_GET_MAX:
-					*((__packed uint16_t *) pCtrl->EP0Buf) = VolMax;
-					return LPC_OK;
+uint32_t mwADC_Level(USB_ADC_CTRL_T *pAdc)
+{
+	uint32_t start = pAdc->start;
+	uint32_t tail = pAdc->tail;
 
-				case AUDIO_REQUEST_GET_RES:
-					*((__packed uint16_t *) pCtrl->EP0Buf) = VolRes;
-					return LPC_OK;
-				}
-				break;
-			}
+	if ((int32_t) (tail - start) < 0) {
+		tail = start;
+	}
+	return pAdc->head - tail;
+}
+
+/*
+ *  ADC Samples per ms
+ *  Parameters:      rate: Sampling frequency in Hz
+ *  Return Value:    rate / 1000 in 16.16 format
+ */
+
+uint32_t mwADC_Nominal(uint32_t rate)
+{
+	return ((rate / 1000) << 16) + (((rate % 1000) << 16) / 1000);
+}
+
+/*
+ *  ADC Set Sampling Frequency
+ *  Parameters:      pAdc: Handle to ADC structure
+ *                   rate: Sampling frequency in Hz
+ *  Return Value:    None
+ *
+ *  The codec rate is counted again from the next feedback update.
+ */
+
+void mwADC_SetRate(USB_ADC_CTRL_T *pAdc, uint32_t rate)
+{
+	pAdc->SampleRate = rate;
+	pAdc->fb_nominal = mwADC_Nominal(rate);
+	pAdc->fb_rate = pAdc->fb_nominal;
+	pAdc->fb_frames = 0;
+	pAdc->fb_bytes = 0;
+}
+
+/*
+ *  ADC Send Feedback
+ *  Parameters:      pAdc: Handle to ADC structure
+ *  Return Value:    None
+ *
+ *  Counts the audio frames the codec played since the last update against the
+ *  USB frame number. Each USB_ADC_FB_WINDOW frames this gives the codec rate
+ *  to a fraction of a sample per second, without drift from block sized
+ *  ReadSamples() calls. The FIFO level trims the rate, so the FIFO settles
+ *  near half full and any error of the counted rate is taken out as well.
+ */
+
+void mwADC_Feedback(USB_ADC_CTRL_T *pAdc)
+{
+	USB_CORE_CTRL_T *pCtrl = pAdc->pUsbCtrl;
+	uint32_t frame = pCtrl->hw_api->GetFrameNumber(pCtrl);
+	uint32_t played = pAdc->played;
+	uint32_t n, q, fb, lim, len;
+	int32_t err;
+
+	pAdc->fb_frames += (frame - pAdc->fb_frame) & 0x7FF;
+	pAdc->fb_bytes += played - pAdc->fb_played;
+	pAdc->fb_frame = frame;
+	pAdc->fb_played = played;
+
+	lim = pAdc->fb_nominal >> 3;
+	if (pAdc->fb_frames >= USB_ADC_FB_WINDOW) {
+		n = pAdc->fb_bytes / pAdc->FrameSize;
+		q = n / pAdc->fb_frames;
+		fb = (q << 16) + (((n - (q * pAdc->fb_frames)) << 16) / pAdc->fb_frames);
+		/* a codec that was not running does not give a rate */
+		if ((fb > pAdc->fb_nominal - lim) && (fb < pAdc->fb_nominal + lim)) {
+			pAdc->fb_rate = fb;
 		}
+		pAdc->fb_frames = 0;
+		pAdc->fb_bytes = 0;
+	}
+
+	/* steer the FIFO towards half full */
+	err = (int32_t) (((pAdc->fifo_mask + 1) >> 1) - mwADC_Level(pAdc)) / (int32_t) pAdc->FrameSize;
+	fb = pAdc->fb_rate + (err * (1 << (16 - USB_ADC_FB_LEVEL_SHIFT)));
+	if ((int32_t) (fb - (pAdc->fb_nominal - lim)) < 0) {
+		fb = pAdc->fb_nominal - lim;
 	}
+	else if ((int32_t) (fb - (pAdc->fb_nominal + lim)) > 0) {
+		fb = pAdc->fb_nominal + lim;
+	}
+	pAdc->fb_value = fb;
 
-	return ERR_USBD_INVALID_REQ;	/* Not Supported */
+	if (pCtrl->device_speed == USB_HIGH_SPEED) {
+		/* 16.16 samples per microframe */
+		fb >>= 3;
+		len = 4;
+	}
+	else {
+		/* 10.14 samples per frame */
+		fb >>= 2;
+		len = 3;
+	}
+	memcpy(pAdc->fb_buf, &fb, 4);
+	pCtrl->hw_api->WriteEP(pCtrl, pAdc->epfb_num, pAdc->fb_buf, len);
 }
 
 /*
- *  Audio Device Class Interface Set Request Callback
- *   Called automatically on ADC Interface Set Request
- *    Parameters:      None (global SetupPacket and EP0Buf)
- *    Return Value:    LPC_OK - Success, ERR_USBD_INVALID_REQ - Error
+ *  ADC ISO OUT Transaction Done
+ *  Parameters:      pAdc: Handle to ADC structure
+ *  Return Value:    None
+ *
+ *  Copies the audio frames of the transaction into the FIFO and queues the
+ *  slot again behind the others, so the ring never runs dry. What does not
+ *  fit in a full FIFO is dropped.
  */
 
-BOOL_32 ADC_IF_SetRequest(void) {
-
-	/*
-	   Interface = SetupPacket.wIndex.WB.L;
-	   EntityID  = SetupPacket.wIndex.WB.H;
-	   Request   = SetupPacket.bRequest;
-	   Value     = SetupPacket.wValue.W;
-	   ...
-	 */
-	if (pCtrl->SetupPacket.wIndex.W == 0x0200) {
-		/* Feature Unit: Interface = 0, ID = 2 */
-		if (SetupPacket.wValue.WB.L == 0) {
-			/* Master Channel */
-			switch (pCtrl->SetupPacket.wValue.WB.H) {
-			case AUDIO_MUTE_CONTROL:
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_SET_CUR:
-					Mute = pCtrl->EP0Buf[0];
-					return LPC_OK;
-				}
-				break;
+void mwADC_RxDone(USB_ADC_CTRL_T *pAdc)
+{
+	USB_CORE_CTRL_T *pCtrl = pAdc->pUsbCtrl;
+	uint8_t *buf = pAdc->rx_buf + (pAdc->rx_head * pAdc->rx_size);
+	uint32_t head = pAdc->head;
+	uint32_t n, space, status;
+
+	n = pCtrl->hw_api->GetXferLen(pCtrl, pAdc->epout_num, &status);
+	pAdc->packets++;
+	if (status) {
+		pAdc->errors++;
+	}
+	else {
+		n -= n % pAdc->FrameSize;
+		space = pAdc->fifo_mask + 1 - (head - pAdc->tail);
+		space -= space % pAdc->FrameSize;
+		if (n > space) {
+			pAdc->overruns += n - space;
+			n = space;
+		}
+		mwADC_FifoCopy(pAdc, head, buf, n, TRUE);
+		/* publish the data */
+		COMPILER_BARRIER();
+		pAdc->head = head + n;
+	}
 
-			case AUDIO_VOLUME_CONTROL:
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_SET_CUR:
-					I2S_set_volume(*((__packed uint16_t *) pCtrl->EP0Buf));
-					return LPC_OK;
-				}
+	pCtrl->hw_api->ReadReqEP(pCtrl, pAdc->epout_num, buf, pAdc->rx_len);
+	pAdc->rx_head = (pAdc->rx_head + 1 == pAdc->rx_cnt) ? 0 : (pAdc->rx_head + 1);
+}
+
+/*
+ *  ADC Streaming Interface Switch
+ *  Parameters:      pAdc: Handle to ADC structure
+ *                   on: TRUE when the host selects the streaming alternate setting
+ *  Return Value:    None
+ *
+ *  The core has just configured or disabled the endpoints. On start the whole
+ *  ring is queued and the first feedback value is sent.
+ */
+
+void mwADC_SetActive(USB_ADC_CTRL_T *pAdc, uint32_t on)
+{
+	USB_CORE_CTRL_T *pCtrl = pAdc->pUsbCtrl;
+	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
+	uint32_t i, maxp;
+
+	pAdc->active = FALSE;
+	if (on) {
+		/* one (micro)frame worth of transactions at the current speed */
+		pAdc->rx_len = pAdc->rx_size;
+		pEpDesc = mwUSB_GetEpDesc(pCtrl, pCtrl->device_speed, pAdc->epout_num);
+		if (pEpDesc) {
+			maxp = pEpDesc->wMaxPacketSize;
+			maxp = (maxp & 0x7FF) * (((maxp >> 11) & 0x3) + 1);
+			if (maxp < pAdc->rx_len) {
+				pAdc->rx_len = maxp;
+			}
+		}
+
+		/* ReadSamples() drops what is left of the previous stream */
+		pAdc->start = pAdc->head;
+		COMPILER_BARRIER();
+		pAdc->gen++;
+
+		pAdc->fb_rate = pAdc->fb_nominal;
+		pAdc->fb_frames = 0;
+		pAdc->fb_bytes = 0;
+		pAdc->fb_frame = pCtrl->hw_api->GetFrameNumber(pCtrl);
+		pAdc->fb_played = pAdc->played;
+
+		pAdc->active = TRUE;
+		pAdc->rx_head = 0;
+		pAdc->rx_cnt = 0;
+		for (i = 0; i < pAdc->rx_depth; i++) {
+			if (pCtrl->hw_api->ReadReqEP(pCtrl, pAdc->epout_num, pAdc->rx_buf + (i * pAdc->rx_size),
+										 pAdc->rx_len) == 0) {
+				/* dTD pool of the endpoint is smaller than RingDepth */
 				break;
 			}
+			pAdc->rx_cnt++;
 		}
+		mwADC_Feedback(pAdc);
+	}
+	if (pAdc->ADC_Stream) {
+		pAdc->ADC_Stream(pAdc, on);
 	}
-
-	return ERR_USBD_INVALID_REQ;	/* Not Supported */
 }
 
 /*
- *  Audio Device Class EndPoint Get Request Callback
- *   Called automatically on ADC EndPoint Get Request
- *    Parameters:      None (global SetupPacket and EP0Buf)
- *    Return Value:    LPC_OK - Success, ERR_USBD_INVALID_REQ - Error
+ *  ADC Read Samples
+ *  Parameters:     hAdc: Handle to ADC structure
+ *                  buffer: Destination buffer.
+ *                  len: Number of bytes wanted, whole audio frames.
+ *  Return Value:   Number of bytes taken from the FIFO, the rest is silence.
  */
 
-ErrorCode_t ADC_EP_GetRequest(void) {
-
-	/*
-	   EndPoint = SetupPacket.wIndex.WB.L;
-	   Request  = SetupPacket.bRequest;
-	   Value    = SetupPacket.wValue.W;
-	   ...
-	 */
-	int dir = CODEC_DIR_SPEAKER;
-
-	switch (pCtrl->SetupPacket.wIndex.W) {
-	case USB_ADC_IN_EP:
-		dir = CODEC_DIR_MIC;
-
-	case USB_ADC_OUT_EP:
-		/* Feature Unit: Interface = 0, ID = 2 */
-		if (pCtrl->SetupPacket.wValue.WB.L == 0) {
-			/* Master Channel */
-			if (pCtrl->SetupPacket.wValue.WB.H == AUDIO_CONTROL_SAMPLING_FREQ) {
-				if (pCtrl->SetupPacket.bRequest == AUDIO_REQUEST_GET_CUR) {
-					pCtrl->EP0Buf[0] = (uint8_t) (g_sample_rate[dir] & 0xFF);
-					pCtrl->EP0Buf[1] = (uint8_t) ((g_sample_rate[dir] >> 8) & 0xFF);
-					pCtrl->EP0Buf[2] = (uint8_t) ((g_sample_rate[dir] >> 16) & 0xFF);
-					return LPC_OK;
-				}
+uint32_t mwADC_ReadSamples(USBD_HANDLE_T hAdc, uint8_t *buffer, uint32_t len)
+{
+	USB_ADC_CTRL_T *pAdc = (USB_ADC_CTRL_T *) hAdc;
+	uint32_t tail = pAdc->tail;
+	uint32_t avail, n = 0;
+
+	if (pAdc->gen != pAdc->gen_seen) {
+		/* stream restarted */
+		pAdc->gen_seen = pAdc->gen;
+		COMPILER_BARRIER();
+		tail = pAdc->start;
+		pAdc->playing = FALSE;
+	}
+	avail = pAdc->head - tail;
+
+	/* start once the FIFO is half full, so it can absorb the jitter both ways */
+	if (!pAdc->playing && pAdc->active && (avail >= ((pAdc->fifo_mask + 1) >> 1))) {
+		pAdc->playing = TRUE;
+	}
+	if (pAdc->playing) {
+		n = (len < avail) ? len : avail;
+		COMPILER_BARRIER();
+		mwADC_FifoCopy(pAdc, tail, buffer, n, FALSE);
+		if (n < len) {
+			if (pAdc->active) {
+				pAdc->underruns++;
 			}
+			pAdc->playing = FALSE;
 		}
-		break;
+	}
+	memset(buffer + n, 0, len - n);
+	/* release the space */
+	COMPILER_BARRIER();
+	pAdc->tail = tail + n;
+	pAdc->played += len;
+
+	return n;
+}
+
+/*
+ *  ADC Get Counters
+ *  Parameters:     hAdc: Handle to ADC structure
+ *                  stats: Filled with the counters
+ *                  clear: Restart counting when non-zero
+ *  Return Value:   None
+ */
+
+void mwADC_GetStats(USBD_HANDLE_T hAdc, USBD_ADC_STATS_T *stats, uint32_t clear)
+{
+	USB_ADC_CTRL_T *pAdc = (USB_ADC_CTRL_T *) hAdc;
+
+	stats->packets = pAdc->packets;
+	stats->errors = pAdc->errors;
+	stats->overruns = pAdc->overruns;
+	stats->underruns = pAdc->underruns;
+	stats->level = mwADC_Level(pAdc) / pAdc->FrameSize;
+	stats->feedback = pAdc->fb_value;
+	if (clear) {
+		pAdc->packets = 0;
+		pAdc->errors = 0;
+		pAdc->overruns = 0;
+		pAdc->underruns = 0;
+	}
+}
+
+/*
+ *  ADC AudioControl Request
+ *  Parameters:      pAdc: Handle to ADC structure
+ *                   pCtrl: Handle to the USB device stack.
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwADC_ControlReq(USB_ADC_CTRL_T *pAdc, USB_CORE_CTRL_T *pCtrl) {
+	uint16_t len = pCtrl->SetupPacket.wLength;
+	ErrorCode_t ret;
+
+	if ((pAdc->ADC_ControlReq == 0) || (len > sizeof(pCtrl->EP0Buf))) {
+		return ERR_USBD_STALL;
+	}
+	pCtrl->EP0Data.pData = pCtrl->EP0Buf;
+	if (pCtrl->SetupPacket.bRequest & 0x80) {
+		/* GET_xxx */
+		ret = pAdc->ADC_ControlReq(pAdc, &pCtrl->SetupPacket, pCtrl->EP0Buf, len);
+		if (ret == LPC_OK) {
+			mwUSB_DataInStage(pCtrl);
+		}
+		return ret;
+	}
+	if (len == 0) {
+		ret = pAdc->ADC_ControlReq(pAdc, &pCtrl->SetupPacket, pCtrl->EP0Buf, 0);
+		if (ret == LPC_OK) {
+			mwUSB_StatusInStage(pCtrl);
+		}
+		return ret;
+	}
+	/* SET_xxx, handled in the data stage */
+	return LPC_OK;
+}
+
+/*
+ *  ADC Endpoint Request
+ *  Parameters:      pAdc: Handle to ADC structure
+ *                   pCtrl: Handle to the USB device stack.
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ *
+ *  Only the sampling frequency control of the ISO OUT endpoint is supported.
+ */
+
+ErrorCode_t mwADC_EpReq(USB_ADC_CTRL_T *pAdc, USB_CORE_CTRL_T *pCtrl) {
+	if (pCtrl->SetupPacket.wValue.WB.H != AUDIO_CONTROL_SAMPLING_FREQ) {
+		return ERR_USBD_STALL;
+	}
+	pCtrl->EP0Data.pData = pCtrl->EP0Buf;
+	switch (pCtrl->SetupPacket.bRequest) {
+	case AUDIO_REQUEST_GET_CUR:
+		pCtrl->EP0Buf[0] = (uint8_t) (pAdc->SampleRate & 0xFF);
+		pCtrl->EP0Buf[1] = (uint8_t) ((pAdc->SampleRate >> 8) & 0xFF);
+		pCtrl->EP0Buf[2] = (uint8_t) ((pAdc->SampleRate >> 16) & 0xFF);
+		if (pCtrl->EP0Data.Count > 3) {
+			pCtrl->EP0Data.Count = 3;
+		}
+		mwUSB_DataInStage(pCtrl);
+		return LPC_OK;
+
+	case AUDIO_REQUEST_SET_CUR:
+		/* handled in the data stage */
+		return (pCtrl->SetupPacket.wLength == 3) ? LPC_OK : ERR_USBD_STALL;
 
 	default:
 		break;
 	}
-	return ERR_USBD_INVALID_REQ;	/* Not Supported */
+	return ERR_USBD_STALL;
 }
 
 /*
- *  Audio Device Class EndPoint Set Request Callback
- *   Called automatically on ADC EndPoint Set Request
- *    Parameters:      None (global SetupPacket and EP0Buf)
- *    Return Value:    LPC_OK - Success, ERR_USBD_INVALID_REQ - Error
+ *  Default ADC Class Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
  */
 
-ErrorCode_t ADC_EP_SetRequest(void) {
-
-	/*
-	   EndPoint = SetupPacket.wIndex.WB.L;
-	   Request  = SetupPacket.bRequest;
-	   Value    = SetupPacket.wValue.W;
-	   ...
-	 */
-	int dir = CODEC_DIR_SPEAKER;
+ErrorCode_t mwADC_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	USB_ADC_CTRL_T *pAdc = (USB_ADC_CTRL_T *) data;
 	uint32_t rate;
+	ErrorCode_t ret = ERR_USBD_UNHANDLED;
 
-	switch (pCtrl->SetupPacket.wIndex.W) {
-	case USB_ADC_IN_EP:
-		dir = CODEC_DIR_MIC;
-
-	case USB_ADC_OUT_EP:
-		/* Feature Unit: Interface = 0, ID = 2 */
-		if (pCtrl->SetupPacket.wValue.WB.L == 0) {
-			/* Master Channel */
-			if (pCtrl->SetupPacket.wValue.WB.H == AUDIO_CONTROL_SAMPLING_FREQ) {
-				rate = pCtrl->EP0Buf[0] | (pCtrl->EP0Buf[1] << 8) | (pCtrl->EP0Buf[2] << 16);
-				if (pCtrl->SetupPacket.bRequest == AUDIO_REQUEST_SET_CUR) {
-					rate = I2S_set_sample_rate(dir, rate);
-					if (rate != 0) {
-						g_sample_rate[dir] = rate;
-						return LPC_OK;
+	switch (event) {
+	case USB_EVT_SETUP:
+		if (pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE) {
+			if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS) &&
+				(pCtrl->SetupPacket.wIndex.WB.L == pAdc->ac_num)) {
+				ret = mwADC_ControlReq(pAdc, pCtrl);
+			}
+			else if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_STANDARD) &&
+					 (pCtrl->SetupPacket.bRequest == USB_REQUEST_SET_INTERFACE) &&
+					 (pCtrl->SetupPacket.wIndex.WB.L == pAdc->as_num)) {
+				/* let the core switch the endpoints, then start or stop the stream */
+				ret = pCtrl->USB_ReqSetInterface(pCtrl);
+				if (ret == LPC_OK) {
+					mwUSB_StatusInStage(pCtrl);
+					mwADC_SetActive(pAdc, (pCtrl->alt_setting[pAdc->as_num] & 0x0F) == pAdc->as_alt);
+					if (pCtrl->USB_Interface_Event) {
+						pCtrl->USB_Interface_Event(pCtrl);
 					}
 				}
 			}
 		}
+		else if ((pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_ENDPOINT) &&
+				 (pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS) &&
+				 (pCtrl->SetupPacket.wIndex.WB.L == pAdc->epout_num)) {
+			ret = mwADC_EpReq(pAdc, pCtrl);
+		}
+		break;
+
+	case USB_EVT_OUT:
+		if ((pCtrl->SetupPacket.bmRequestType.BM.Type != REQUEST_CLASS) ||
+			(pCtrl->SetupPacket.bRequest & 0x80)) {
+			break;
+		}
+		if ((pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE) &&
+			(pCtrl->SetupPacket.wIndex.WB.L == pAdc->ac_num) && pAdc->ADC_ControlReq) {
+			ret = pAdc->ADC_ControlReq(pAdc, &pCtrl->SetupPacket, pCtrl->EP0Buf, pCtrl->SetupPacket.wLength);
+			if (ret == LPC_OK) {
+				mwUSB_StatusInStage(pCtrl);
+			}
+		}
+		else if ((pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_ENDPOINT) &&
+				 (pCtrl->SetupPacket.wIndex.WB.L == pAdc->epout_num) &&
+				 (pCtrl->SetupPacket.bRequest == AUDIO_REQUEST_SET_CUR)) {
+			rate = pCtrl->EP0Buf[0] | (pCtrl->EP0Buf[1] << 8) | (pCtrl->EP0Buf[2] << 16);
+			if ((rate < 1000) ||
+				(pAdc->ADC_SetSampleRate && (pAdc->ADC_SetSampleRate(pAdc, rate) != LPC_OK))) {
+				ret = ERR_USBD_STALL;
+				break;
+			}
+			mwADC_SetRate(pAdc, rate);
+			mwUSB_StatusInStage(pCtrl);
+			ret = LPC_OK;
+		}
+		break;
+
+	case USB_EVT_RESET:
+		mwADC_SetActive(pAdc, FALSE);
 		break;
 
 	default:
 		break;
 	}
-	return ERR_USBD_INVALID_REQ;	/* Not Supported */
+	return ret;
 }
 
-ErrorCode_t ADC_ep0_hdlr(USB_CORE_CTRL_T *pCtrl, void *data, uint32_t event)
+/*
+ *  Default ADC ISO OUT Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwADC_iso_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 {
-	ErrorCode_t ret = ERR_USBD_UNHANDLED;
-	if (pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS) {
-		switch (event) {
-		case USB_EVT_SETUP:
-			if ((pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE) &&
-				((pCtrl->SetupPacket.wIndex.WB.L == USB_ADC_CIF_NUM)  ||	/* IF number correct? */
-				 (pCtrl->SetupPacket.wIndex.WB.L == USB_ADC_SIF1_NUM) ||
-				 (pCtrl->SetupPacket.wIndex.WB.L == USB_ADC_SIF2_NUM)) ) {
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_GET_CUR:
-				case AUDIO_REQUEST_GET_MIN:
-				case AUDIO_REQUEST_GET_MAX:
-				case AUDIO_REQUEST_GET_RES:
-					if (ADC_IF_GetRequest() == LPC_OK) {
-						pCtrl->EP0Data.pData = pCtrl->EP0Buf;					/* point to data to be sent */
-						mwUSB_DataInStage(pCtrl);							/* send requested data */
-						return LPC_OK;
-					}
-					break;
+	USB_ADC_CTRL_T *pAdc = (USB_ADC_CTRL_T *) data;
 
-				case AUDIO_REQUEST_SET_CUR:
-					//                case AUDIO_REQUEST_SET_MIN:
-					//                case AUDIO_REQUEST_SET_MAX:
-					//                case AUDIO_REQUEST_SET_RES:
-					pCtrl->EP0Data.pData = pCtrl->EP0Buf;						/* data to be received */
-					return LPC_OK;
-				}
-			}
-			else if (pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_ENDPOINT) {
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_GET_CUR:
-				case AUDIO_REQUEST_GET_MIN:
-				case AUDIO_REQUEST_GET_MAX:
-				case AUDIO_REQUEST_GET_RES:
-					if (ADC_EP_GetRequest() == LPC_OK) {
-						pCtrl->EP0Data.pData = pCtrl->EP0Buf;						/* point to data to be sent */
-						mwUSB_DataInStage(pCtrl);								/* send requested data */
-						return LPC_OK;
-					}
-					break;
+	if ((event == USB_EVT_OUT) && pAdc->active) {
+		mwADC_RxDone(pAdc);
+	}
+	return LPC_OK;
+}
 
-				case AUDIO_REQUEST_SET_CUR:
-					//              case AUDIO_REQUEST_SET_MIN:
-					//              case AUDIO_REQUEST_SET_MAX:
-					//              case AUDIO_REQUEST_SET_RES:
-					pCtrl->EP0Data.pData = pCtrl->EP0Buf;							/* data to be received */
-					return LPC_OK;
-				}
-			}
-			break;
+/*
+ *  Default ADC Feedback IN Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ *
+ *  Each completion, polled by the host or dropped at the end of its frame,
+ *  queues a fresh value.
+ */
 
-		case USB_EVT_OUT:
-			if ((pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE) &&
-				((pCtrl->SetupPacket.wIndex.WB.L == USB_ADC_CIF_NUM)  ||	/* IF number correct? */
-				 (pCtrl->SetupPacket.wIndex.WB.L == USB_ADC_SIF1_NUM) ||
-				 (pCtrl->SetupPacket.wIndex.WB.L == USB_ADC_SIF2_NUM)) ) {
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_SET_CUR:
-					//                      case AUDIO_REQUEST_SET_MIN:
-					//                      case AUDIO_REQUEST_SET_MAX:
-					//                      case AUDIO_REQUEST_SET_RES:
-					if (ADC_IF_SetRequest()) {
-						mwUSB_StatusInStage(pCtrl);					/* send Acknowledge */
-						return LPC_OK;
-					}
-					break;
-				}
+ErrorCode_t mwADC_fb_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_ADC_CTRL_T *pAdc = (USB_ADC_CTRL_T *) data;
+
+	if ((event == USB_EVT_IN) && pAdc->active) {
+		mwADC_Feedback(pAdc);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Number of ISO OUT transfers requested by the application
+ *  Parameters:      param: ADC function driver initialization parameters.
+ *  Return Value:    Ring depth, 2 .. USB_ADC_MAX_RING_DEPTH.
+ */
+
+uint32_t mwADC_RingDepth(USBD_ADC_INIT_PARAM_T *param)
+{
+	if (param->RingDepth < 2) {
+		return 2;
+	}
+	return (param->RingDepth > USB_ADC_MAX_RING_DEPTH) ? USB_ADC_MAX_RING_DEPTH : param->RingDepth;
+}
+
+/**
+ * @brief   Get memory required by ADC class.
+ * @param [in/out] param parameter structure used for initialisation.
+ * @retval  Length required for ADC data structure and buffers.
+ *
+ * Example Usage:
+ * @code
+ *    mem_req = mwADC_GetMemSize(param);
+ * @endcode
+ */
+uint32_t mwADC_GetMemSize(USBD_ADC_INIT_PARAM_T *param)
+{
+	uint32_t req_len = 0;
+
+	/* calculate required length */
+	req_len += sizeof(USB_ADC_CTRL_T);	/* memory for ADC controller structure */
+	req_len += 4;	/* for alignment overhead */
+	req_len &= ~0x3;
+	req_len += param->FifoSize;	/* sample FIFO */
+	req_len += mwADC_RingDepth(param) * ((param->MaxXferSize + 3) & ~3);	/* ISO OUT ring */
+
+	return req_len;
+}
+
+/*
+ *  ADC function initialization routine
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  param: Structure containing ADC function driver module
+ *						      initialization parameters.
+ *									phAdc: Handle to ADC Control Structure
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+ErrorCode_t mwADC_init(USBD_HANDLE_T hUsb, USBD_ADC_INIT_PARAM_T *param, USBD_HANDLE_T *phAdc)
+{
+	uint32_t new_addr, i, maxp;
+	ErrorCode_t ret = LPC_OK;
+	USB_ADC_CTRL_T *pAdc;
+	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
+	USB_INTERFACE_DESCRIPTOR *pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->ac_intf_desc;
+
+	/* check for memory alignment */
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwADC_GetMemSize(param))) {
+		return ERR_USBD_BAD_MEM_BUF;
+	}
+	/* a power of 2 FIFO holding two ms of audio */
+	if ((param->FrameSize == 0) || (param->SampleRate < 1000) || (param->MaxXferSize < param->FrameSize) ||
+		(param->FifoSize & (param->FifoSize - 1)) ||
+		(param->FifoSize < (2 * param->FrameSize * ((param->SampleRate / 1000) + 1)))) {
+		return ERR_API_INVALID_PARAM2;
+	}
+
+	/* allocate memory for the control data structure */
+	pAdc = (USB_ADC_CTRL_T *) param->mem_base;
+	param->mem_base += sizeof(USB_ADC_CTRL_T);
+	param->mem_size -= sizeof(USB_ADC_CTRL_T);
+	/* align to 4 byte boundary */
+	while (param->mem_base & 0x03) {
+		param->mem_base++;
+		param->mem_size--;
+	}
+
+	/* Init control structures with passed params */
+	memset((void *) pAdc, 0, sizeof(USB_ADC_CTRL_T));
+	pAdc->pUsbCtrl = (USB_CORE_CTRL_T *) hUsb;
+	pAdc->ADC_ControlReq = param->ADC_ControlReq;
+	pAdc->ADC_SetSampleRate = param->ADC_SetSampleRate;
+	pAdc->ADC_Stream = param->ADC_Stream;
+	pAdc->FrameSize = param->FrameSize;
+	mwADC_SetRate(pAdc, param->SampleRate);
+
+	/* allocate memory for the FIFO and the ring */
+	pAdc->fifo = (uint8_t *) param->mem_base;
+	pAdc->fifo_mask = param->FifoSize - 1;
+	param->mem_base += param->FifoSize;
+	param->mem_size -= param->FifoSize;
+	pAdc->rx_buf = (uint8_t *) param->mem_base;
+	pAdc->rx_size = (param->MaxXferSize + 3) & ~3;
+	pAdc->rx_depth = mwADC_RingDepth(param);
+	param->mem_base += pAdc->rx_depth * pAdc->rx_size;
+	param->mem_size -= pAdc->rx_depth * pAdc->rx_size;
+
+	/* parse the AudioControl interface descriptor */
+	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+		(pIntfDesc->bInterfaceClass == USB_DEVICE_CLASS_AUDIO) &&
+		(pIntfDesc->bInterfaceSubClass == AUDIO_SUBCLASS_AUDIOCONTROL)) {
+		/* store interface number */
+		pAdc->ac_num = pIntfDesc->bInterfaceNumber;
+	}
+	else {
+		return ERR_USBD_BAD_INTF_DESC;
+	}
+
+	/* parse the AudioStreaming interface descriptor */
+	pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->as_intf_desc;
+	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+		(pIntfDesc->bInterfaceClass == USB_DEVICE_CLASS_AUDIO) &&
+		(pIntfDesc->bInterfaceSubClass == AUDIO_SUBCLASS_AUDIOSTREAMING) &&
+		(pIntfDesc->bAlternateSetting != 0) &&
+		(pIntfDesc->bNumEndpoints == 2) ) {
+
+		/* store interface number */
+		pAdc->as_num = pIntfDesc->bInterfaceNumber;
+		pAdc->as_alt = pIntfDesc->bAlternateSetting;
+		new_addr = (uint32_t) pIntfDesc + pIntfDesc->bLength;
+		/* skip the class specific descriptors */
+		for (i = 0; (i < pIntfDesc->bNumEndpoints) && (ret == LPC_OK); ) {
+			pEpDesc = (USB_ENDPOINT_DESCRIPTOR *) new_addr;
+			new_addr = (uint32_t) pEpDesc + pEpDesc->bLength;
+
+			if ((pEpDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) || (pEpDesc->bLength == 0)) {
+				break;
 			}
-			else if (pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_ENDPOINT) {
-				switch (pCtrl->SetupPacket.bRequest) {
-				case AUDIO_REQUEST_SET_CUR:
-					//                    case AUDIO_REQUEST_SET_MIN:
-					//                    case AUDIO_REQUEST_SET_MAX:
-					//                    case AUDIO_REQUEST_SET_RES:
-					if (ADC_EP_SetRequest() == LPC_OK) {
-						mwUSB_StatusInStage(pCtrl);						/* send Acknowledge */
-						return LPC_OK;
-					}
+			if (pEpDesc->bDescriptorType != USB_ENDPOINT_DESCRIPTOR_TYPE) {
+				continue;
+			}
+			i++;
+			if ((pEpDesc->bmAttributes & USB_ENDPOINT_TYPE_MASK) != USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+				break;
+			}
+			if (pEpDesc->bEndpointAddress & USB_ENDPOINT_DIRECTION_MASK) {
+				/* store ISO IN feedback endpoint */
+				pAdc->epfb_num = pEpDesc->bEndpointAddress;
+				ret = mwUSB_RegisterEpHandler(hUsb, ((pAdc->epfb_num & 0x0F) << 1) + 1, mwADC_fb_in_hdlr, pAdc);
+			}
+			else {
+				/* store ISO OUT data endpoint, its transactions must fit a ring slot */
+				maxp = pEpDesc->wMaxPacketSize;
+				if (((maxp & 0x7FF) * (((maxp >> 11) & 0x3) + 1)) > param->MaxXferSize) {
 					break;
 				}
+				pAdc->epout_num = pEpDesc->bEndpointAddress;
+				ret = mwUSB_RegisterEpHandler(hUsb, ((pAdc->epout_num & 0x0F) << 1), mwADC_iso_out_hdlr, pAdc);
 			}
-			break;
-
-		default:
-			break;
 		}
 	}
+	else {
+		return ERR_USBD_BAD_INTF_DESC;
+	}
+
+	if ( (pAdc->epout_num == 0) || (pAdc->epfb_num == 0) || (ret != LPC_OK) ) {
+		return ERR_USBD_BAD_EP_DESC;
+	}
+
+	/* register ep0 handler, for both interfaces */
+	ret = mwUSB_RegisterIntfHandler(hUsb, pAdc->ac_num, mwADC_ep0_hdlr, pAdc);
+	if (ret == LPC_OK) {
+		ret = mwUSB_RegisterIntfHandler(hUsb, pAdc->as_num, mwADC_ep0_hdlr, pAdc);
+	}
+	/* return the handle */
+	*phAdc = (USBD_HANDLE_T) pAdc;
+
 	return ret;
 }
-
-#endif
@@ -4,7 +4,7 @@
  * Project: USB device ROM Stack
  *
  * Description:
- *     USB Audio Device Class Definitions.
+ *     USB Audio Device Class Custom User Module definitions.
  *
  ***********************************************************************
  *   Copyright(C) 2011, NXP Semiconductor
@@ -25,6 +25,298 @@
 #ifndef __ADCUSER_H__
 #define __ADCUSER_H__
 
-/* Audio Device Class Requests Callback Functions */
+#include "error.h"
+#include "mw_usbd.h"
+#include "mw_usbd_audio.h"
+#include "mw_usbd_core.h"
+
+/** \file
+ *  \brief Audio Device Class (ADC) API structures and function prototypes.
+ *
+ *  Definition of functions exported by the audio streaming function driver.
+ *
+ */
+
+/** \ingroup Group_USBD
+ *  @defgroup USBD_ADC Audio Device Class (ADC) Function Driver
+ *  \section Sec_ADCModDescription Module Description
+ *  ADC Class Function Driver module. This module streams audio from the host to a
+ *  codec (a USB speaker) over an asynchronous isochronous OUT endpoint.
+ *
+ *  The ISO OUT endpoint is kept primed with a ring of transfers, one (micro)frame
+ *  each, refilled from the completion interrupt. Every transaction the controller
+ *  received without error is copied into a sample FIFO, which the codec drains with
+ *  ReadSamples() at its own clock.
+ *
+ *  The two clocks are matched with the ISO IN feedback endpoint of the streaming
+ *  interface. The driver counts the samples the codec consumed against the USB frame
+ *  number to learn the codec rate, and adds a small correction from the FIFO level,
+ *  so the host keeps the FIFO half full however far the codec clock drifts from the
+ *  SOF clock. The value is sent in 10.14 format at full speed and 16.16 at high speed.
+ *
+ *  Requests to the AudioControl interface (feature unit mute and volume, ...) are
+ *  handed to ADC_ControlReq(). The sampling frequency endpoint control of the ISO OUT
+ *  endpoint is handled by the driver.
+ */
+
+/** \brief Largest number of ISO OUT transfers the ADC function driver keeps queued.
+ *  \ingroup USBD_ADC
+ */
+#define USB_ADC_MAX_RING_DEPTH          32
+
+/** \brief Frames (ms) over which the codec rate is counted for the feedback value.
+ *  \ingroup USBD_ADC
+ */
+#define USB_ADC_FB_WINDOW               1024
+
+/** \brief The feedback value moves by 2^-USB_ADC_FB_LEVEL_SHIFT samples per frame for
+ *  every audio frame the FIFO level is off its target.
+ *  \ingroup USBD_ADC
+ */
+#define USB_ADC_FB_LEVEL_SHIFT          8
+
+/** \brief ADC function driver initialization parameter data structure.
+ *  \ingroup USBD_ADC
+ *
+ *  \details  This data structure is used to pass initialization parameters to the
+ *  ADC function driver's init function.
+ *
+ */
+typedef struct USBD_ADC_INIT_PARAM {
+	/* memory allocation params */
+	uint32_t mem_base;	/**< Base memory location from where the stack can allocate
+						   data and buffers. \note The memory address set in this field
+						   should be accessible by USB DMA controller. Also this value
+						   should be aligned on 4 byte boundary.
+						 */
+	uint32_t mem_size;	/**< The size of memory buffer which stack can use.
+						   \note The \em mem_size should be greater than the size
+						   returned by USBD_ADC_API::GetMemSize() routine.*/
+	/** Pointer to the AudioControl interface descriptor within the descriptor
+	 * array (\em high_speed_desc) passed to Init() through \ref USB_CORE_DESCS_T
+	 * structure.
+	 */
+	uint8_t *ac_intf_desc;
+	/** Pointer to the AudioStreaming interface alternate setting which carries the
+	 * ISO OUT data endpoint and its ISO IN feedback endpoint, within the same
+	 * descriptor array.
+	 */
+	uint8_t *as_intf_desc;
+
+	/** Sampling frequency in Hz used until the host sets one. */
+	uint32_t SampleRate;
+	/** Size in bytes of an audio frame, the number of channels times the subframe size. */
+	uint32_t FrameSize;
+	/** Size in bytes of the sample FIFO. Must be a power of 2 and hold at least two
+	 * ms of audio. The driver keeps it half full.
+	 */
+	uint32_t FifoSize;
+	/** Largest ISO OUT transaction in bytes, wMaxPacketSize times the transactions per
+	 * microframe, over the full and high speed descriptors. Each ring slot is this size.
+	 */
+	uint32_t MaxXferSize;
+	/** Number of ISO OUT transfers kept queued. Limited to 2 .. \ref USB_ADC_MAX_RING_DEPTH,
+	 * the USB stack must be initialized with a \em dtd_pool_depth of at least this value.
+	 */
+	uint32_t RingDepth;
+
+	/* user defined functions */
+	/**
+	 *  AudioControl request call-back function.
+	 *
+	 *  Called for the class requests to the AudioControl interface. A GET request
+	 *  (bit 7 of bRequest set) is passed in the setup stage and the call-back fills
+	 *  \em buffer with the value; a SET request is passed once its data stage has
+	 *  been received. The function is optional, without it the requests are stalled.
+	 *
+	 *  \param[in] hAdc Handle to ADC function driver.
+	 *  \param[in] pSetup Pointer to the setup packet, the entity ID is in wIndex.WB.H.
+	 *  \param[in,out] buffer EP0 buffer with the SET data, or for the GET data.
+	 *  \param[in] length Number of bytes in \em buffer.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success.
+	 *          \retval ERR_USBD_STALL Unsupported control or value, the request is stalled.
+	 */
+	ErrorCode_t (*ADC_ControlReq)(USBD_HANDLE_T hAdc, USB_SETUP_PACKET *pSetup, uint8_t *buffer, uint16_t length);
+
+	/**
+	 *  Optional sampling frequency call-back function.
+	 *
+	 *  Called when the host sets the sampling frequency of the ISO OUT endpoint, so
+	 *  the application can retune the codec.
+	 *
+	 *  \param[in] hAdc Handle to ADC function driver.
+	 *  \param[in] rate Sampling frequency in Hz.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success.
+	 *          \retval ERR_USBD_STALL Rate not supported, the request is stalled.
+	 */
+	ErrorCode_t (*ADC_SetSampleRate)(USBD_HANDLE_T hAdc, uint32_t rate);
+
+	/**
+	 *  Optional stream state call-back function.
+	 *
+	 *  Called from the USB interrupt when the host starts (\em on non-zero) or stops
+	 *  the stream by selecting an alternate setting of the AudioStreaming interface.
+	 *
+	 *  \param[in] hAdc Handle to ADC function driver.
+	 *  \param[in] on Non-zero when the stream starts.
+	 *  \return Nothing.
+	 */
+	void (*ADC_Stream)(USBD_HANDLE_T hAdc, uint32_t on);
+
+} USBD_ADC_INIT_PARAM_T;
+
+/** \brief ADC function driver counters.
+ *  \ingroup USBD_ADC
+ */
+typedef struct USBD_ADC_STATS {
+	uint32_t packets;		/**< ISO OUT transactions received */
+	uint32_t errors;		/**< Transactions dropped because the controller flagged them */
+	uint32_t overruns;		/**< Bytes dropped because the FIFO was full */
+	uint32_t underruns;		/**< Times ReadSamples() found the FIFO empty while playing */
+	uint32_t level;			/**< FIFO level in audio frames */
+	uint32_t feedback;		/**< Last feedback value, samples per ms in 16.16 format */
+} USBD_ADC_STATS_T;
+
+/** \brief ADC class API functions structure.
+ *  \ingroup USBD_ADC
+ *
+ *  This module exposes functions which interact directly with USB device controller hardware.
+ *
+ */
+typedef struct USBD_ADC_API {
+	/** \fn uint32_t GetMemSize(USBD_ADC_INIT_PARAM_T* param)
+	 *  Function to determine the memory required by the ADC function driver module.
+	 *
+	 *  This function is called by application layer before calling pUsbApi->adc->Init(), to allocate memory used
+	 *  by ADC function driver module. The application should allocate the memory which is accessible by USB
+	 *  controller/DMA controller.
+	 *  \note Some memory areas are not accessible by all bus masters.
+	 *
+	 *  \param[in] param Structure containing ADC function driver module initialization parameters.
+	 *  \return Returns the required memory size in bytes.
+	 */
+	uint32_t (*GetMemSize)(USBD_ADC_INIT_PARAM_T *param);
+
+	/** \fn ErrorCode_t init(USBD_HANDLE_T hUsb, USBD_ADC_INIT_PARAM_T* param, USBD_HANDLE_T* phAdc)
+	 *  Function to initialize ADC function driver module.
+	 *
+	 *  This function is called by application layer to initialize ADC function driver module.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in, out] param Structure containing ADC function driver module initialization parameters.
+	 *  \param[out] phAdc Returns the handle to the ADC function driver.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success
+	 *          \retval ERR_USBD_BAD_MEM_BUF  Memory buffer passed is not 4-byte
+	 *              aligned or smaller than required.
+	 *          \retval ERR_API_INVALID_PARAM2 FifoSize, FrameSize or SampleRate is not valid.
+	 *          \retval ERR_USBD_BAD_INTF_DESC  Wrong interface descriptor is passed.
+	 *          \retval ERR_USBD_BAD_EP_DESC  Wrong endpoint descriptor is passed.
+	 */
+	ErrorCode_t (*init)(USBD_HANDLE_T hUsb, USBD_ADC_INIT_PARAM_T *param, USBD_HANDLE_T *phAdc);
+
+	/** \fn uint32_t ReadSamples(USBD_HANDLE_T hAdc, uint8_t *buffer, uint32_t len)
+	 *  Function to take audio for the codec out of the sample FIFO.
+	 *
+	 *  Called at the codec rate, typically from its DMA interrupt. \em buffer is always
+	 *  filled: what the FIFO lacks is filled with silence. After the stream starts, and
+	 *  after an underrun, silence is returned until the FIFO is half full again. The
+	 *  function must not be called from more than one context at a time.
+	 *
+	 *  \param[in] hAdc Handle to ADC function driver.
+	 *  \param[out] buffer Destination buffer.
+	 *  \param[in] len  Number of bytes wanted, a multiple of FrameSize.
+	 *  \return Number of bytes taken from the FIFO.
+	 */
+	uint32_t (*ReadSamples)(USBD_HANDLE_T hAdc, uint8_t *buffer, uint32_t len);
+
+	/** \fn void GetStats(USBD_HANDLE_T hAdc, USBD_ADC_STATS_T *stats, uint32_t clear)
+	 *  Function to read the counters of the ADC function driver.
+	 *
+	 *  \param[in] hAdc Handle to ADC function driver.
+	 *  \param[out] stats Counters, see \ref USBD_ADC_STATS_T.
+	 *  \param[in] clear Non-zero to clear the counters after reading them.
+	 *  \return Nothing.
+	 */
+	void (*GetStats)(USBD_HANDLE_T hAdc, USBD_ADC_STATS_T *stats, uint32_t clear);
+
+} USBD_ADC_API_T;
+
+/*-----------------------------------------------------------------------------
+ *  Private functions & structures prototypes
+ *-----------------------------------------------------------------------------*/
+/** @cond  ADVANCED_API */
+
+typedef struct _ADC_CTRL_T {
+	USB_CORE_CTRL_T *pUsbCtrl;
+
+	/* sample FIFO, single producer (USB interrupt) and single consumer (codec).
+	   The indexes run freely and are masked on use. */
+	uint8_t *fifo;
+	uint32_t fifo_mask;				/* FIFO size - 1 */
+	volatile uint32_t head;			/* written by the USB interrupt */
+	volatile uint32_t tail;			/* written by ReadSamples() */
+	volatile uint32_t start;		/* head when the stream started */
+	volatile uint32_t played;		/* bytes handed to the codec, silence included */
+	volatile uint8_t gen;			/* bumped when the stream starts */
+	uint8_t gen_seen;				/* last gen handled by ReadSamples() */
+	volatile uint8_t playing;		/* ReadSamples() passes the FIFO on */
+	volatile uint8_t active;		/* streaming alternate setting selected */
+
+	/* ISO OUT ring */
+	uint8_t *rx_buf;
+	uint32_t rx_size;				/* allocated size of a ring slot */
+	uint32_t rx_len;				/* transfer length at the current speed */
+	uint8_t rx_depth;				/* allocated ring slots */
+	uint8_t rx_cnt;					/* slots queued when the stream started */
+	uint8_t rx_head;				/* slot of the oldest queued transfer */
+
+	uint8_t ac_num;					/* AudioControl interface number */
+	uint8_t as_num;					/* AudioStreaming interface number */
+	uint8_t as_alt;					/* alternate setting with the endpoints */
+	uint8_t epout_num;				/* ISO OUT data endpoint number */
+	uint8_t epfb_num;				/* ISO IN feedback endpoint number */
+	uint8_t pad[3];
+
+	uint32_t FrameSize;
+	uint32_t SampleRate;
+
+	/* feedback, all in samples per ms, 16.16 */
+	uint32_t fb_nominal;			/* SampleRate / 1000 */
+	uint32_t fb_rate;				/* codec rate counted over USB_ADC_FB_WINDOW */
+	uint32_t fb_value;				/* value sent to the host */
+	uint32_t fb_frame;				/* frame number of the last update */
+	uint32_t fb_played;				/* played at the last update */
+	uint32_t fb_frames;				/* frames counted in the current window */
+	uint32_t fb_bytes;				/* bytes played in the current window */
+	uint8_t fb_buf[4];
+
+	/* counters */
+	uint32_t packets;
+	uint32_t errors;
+	uint32_t overruns;
+	volatile uint32_t underruns;
+
+	/* user defined functions */
+	ErrorCode_t (*ADC_ControlReq)(USBD_HANDLE_T hAdc, USB_SETUP_PACKET *pSetup, uint8_t *buffer, uint16_t length);
+	ErrorCode_t (*ADC_SetSampleRate)(USBD_HANDLE_T hAdc, uint32_t rate);
+	void (*ADC_Stream)(USBD_HANDLE_T hAdc, uint32_t on);
+
+} USB_ADC_CTRL_T;
+
+/** @cond  DIRECT_API */
+extern uint32_t mwADC_GetMemSize(USBD_ADC_INIT_PARAM_T *param);
+
+extern ErrorCode_t mwADC_init(USBD_HANDLE_T hUsb, USBD_ADC_INIT_PARAM_T *param, USBD_HANDLE_T *phAdc);
+
+extern uint32_t mwADC_ReadSamples(USBD_HANDLE_T hAdc, uint8_t *buffer, uint32_t len);
+
+extern void mwADC_GetStats(USBD_HANDLE_T hAdc, USBD_ADC_STATS_T *stats, uint32_t clear);
+
+/** @endcond */
+
+/** @endcond */
 
 #endif  /* __ADCUSER_H__ */
@@ -33,6 +33,9 @@
 #define TRUE !FALSE
 #endif
 
+/* valid ring sizes: 0, or a power of 2 holding at least one HS packet */
+#define CDC_RING_SIZE_OK(n) ((((n) & ((n) - 1)) == 0) && (((n) == 0) || ((n) >= USB_HS_MAX_BULK_PACKET)))
+
 /*
  *  CDC Send Class Notification routine
  *  Parameters:     hCdc: Handle to the CDC Control Structure.
@@ -193,6 +196,316 @@ ErrorCode_t mwCDC_SetRequest(USBD_HANDLE_T hCdc, USB_SETUP_PACKET *pSetup, uint8
 	return ret;
 }
 
+/*
+ *  CDC Bulk Max Packet Size
+ *  Parameters:      pCdcCtrl: Handle to the CDC Control Structure.
+ *  Return Value:    Max packet size of the BULK endpoints at the current speed
+ */
+
+uint32_t mwCDC_MaxPacket(USB_CDC_CTRL_T *pCdcCtrl)
+{
+	return (pCdcCtrl->pUsbCtrl->device_speed == USB_HIGH_SPEED) ?
+		   USB_HS_MAX_BULK_PACKET : USB_FS_MAX_BULK_PACKET;
+}
+
+/*
+ *  CDC Ring Copy
+ *  Parameters:      ring: Ring to copy into or out of.
+ *                   pos: Free running ring index of the first byte.
+ *                   data: Linear buffer.
+ *                   len: Number of bytes to copy.
+ *                   to_ring: TRUE to copy data into the ring, FALSE out of it.
+ *  Return Value:    None
+ */
+
+void mwCDC_RingCopy(CDC_RING_T *ring, uint32_t pos, uint8_t *data, uint32_t len, uint32_t to_ring)
+{
+	uint32_t off = pos & ring->mask;
+	uint32_t n = ring->mask + 1 - off;
+
+	if (n > len) {
+		n = len;
+	}
+	if (to_ring) {
+		memcpy(ring->buf + off, data, n);
+		memcpy(ring->buf, data + n, len - n);
+	}
+	else {
+		memcpy(data, ring->buf + off, n);
+		memcpy(data + n, ring->buf, len - n);
+	}
+}
+
+/*
+ *  CDC Start BULK IN Transfer
+ *  Parameters:      pCdcCtrl: Handle to the CDC Control Structure.
+ *  Return Value:    None
+ *
+ *  Sends the data of the transmit ring up to its wrap point in one transfer.
+ *  Called with tx_state idle, from WriteData() or from the IN completion.
+ */
+
+void mwCDC_TxStart(USB_CDC_CTRL_T *pCdcCtrl)
+{
+	CDC_RING_T *ring = &pCdcCtrl->tx;
+	uint32_t tail = ring->tail;
+	uint32_t off = tail & ring->mask;
+	uint32_t n = ring->head - tail;
+
+	if (n > (ring->mask + 1 - off)) {
+		n = ring->mask + 1 - off;
+	}
+	if (n > CDC_MAX_XFER_SIZE) {
+		n = CDC_MAX_XFER_SIZE;
+	}
+	if (n == 0) {
+		pCdcCtrl->tx_state = CDC_XFER_IDLE;
+		return;
+	}
+	pCdcCtrl->tx_len = n;
+	/* busy before the transfer is queued, its completion may come at once */
+	pCdcCtrl->tx_state = CDC_XFER_BUSY;
+	if (pCdcCtrl->pUsbCtrl->hw_api->WriteEP(pCdcCtrl->pUsbCtrl, pCdcCtrl->epin_num, ring->buf + off, n) == 0) {
+		/* no free dTD, retried on the next WriteData() */
+		pCdcCtrl->tx_state = CDC_XFER_IDLE;
+	}
+}
+
+/*
+ *  CDC BULK IN Transfer Done
+ *  Parameters:      pCdcCtrl: Handle to the CDC Control Structure.
+ *  Return Value:    None
+ */
+
+void mwCDC_TxDone(USB_CDC_CTRL_T *pCdcCtrl)
+{
+	CDC_RING_T *ring = &pCdcCtrl->tx;
+	uint32_t n = pCdcCtrl->tx_len;
+
+	/* release the sent data */
+	ring->tail += n;
+	pCdcCtrl->tx_len = 0;
+
+	/* the host only sees the end of a transfer of whole packets with a ZLP */
+	if ((n != 0) && ((n & (mwCDC_MaxPacket(pCdcCtrl) - 1)) == 0) && (ring->head == ring->tail)) {
+		/* nothing else is queued on the endpoint, so the ZLP always gets a dTD */
+		pCdcCtrl->pUsbCtrl->hw_api->WriteEP(pCdcCtrl->pUsbCtrl, pCdcCtrl->epin_num, ring->buf, 0);
+		return;
+	}
+	mwCDC_TxStart(pCdcCtrl);
+}
+
+/*
+ *  CDC Start BULK OUT Transfer
+ *  Parameters:      pCdcCtrl: Handle to the CDC Control Structure.
+ *  Return Value:    None
+ *
+ *  Primes the OUT endpoint with the free space of the receive ring up to its
+ *  wrap point, in whole packets. When less than a packet fits before the wrap
+ *  point a single packet is received into the bounce buffer; when less than a
+ *  packet is free the transfer is parked until ReadData() makes room.
+ */
+
+void mwCDC_RxStart(USB_CDC_CTRL_T *pCdcCtrl)
+{
+	CDC_RING_T *ring = &pCdcCtrl->rx;
+	uint32_t head = ring->head;
+	uint32_t mps = mwCDC_MaxPacket(pCdcCtrl);
+	uint32_t space = ring->mask + 1 - (head - ring->tail);
+	uint32_t off = head & ring->mask;
+	uint32_t n = ring->mask + 1 - off;
+	uint8_t *buf = ring->buf + off;
+
+	if (!USB_IsConfigured(pCdcCtrl->pUsbCtrl)) {
+		pCdcCtrl->rx_state = CDC_XFER_IDLE;
+		return;
+	}
+	if (n > space) {
+		n = space;
+	}
+	if (n > CDC_MAX_XFER_SIZE) {
+		n = CDC_MAX_XFER_SIZE;
+	}
+	n &= ~(mps - 1);
+	if (n == 0) {
+		if (space < mps) {
+			pCdcCtrl->rx_state = CDC_XFER_PARKED;
+			return;
+		}
+		buf = pCdcCtrl->rx_bounce;
+		n = mps;
+	}
+	pCdcCtrl->rx_xfer = buf;
+	pCdcCtrl->rx_len = n;
+	pCdcCtrl->rx_state = CDC_XFER_BUSY;
+	if (pCdcCtrl->pUsbCtrl->hw_api->ReadReqEP(pCdcCtrl->pUsbCtrl, pCdcCtrl->epout_num, buf, n) == 0) {
+		/* no free dTD, retried on the next NAK */
+		pCdcCtrl->rx_state = CDC_XFER_IDLE;
+	}
+}
+
+/*
+ *  CDC BULK OUT Transfer Done
+ *  Parameters:      pCdcCtrl: Handle to the CDC Control Structure.
+ *  Return Value:    None
+ */
+
+void mwCDC_RxDone(USB_CDC_CTRL_T *pCdcCtrl)
+{
+	CDC_RING_T *ring = &pCdcCtrl->rx;
+	uint32_t n;
+
+	n = pCdcCtrl->pUsbCtrl->hw_api->ReadEP(pCdcCtrl->pUsbCtrl, pCdcCtrl->epout_num, pCdcCtrl->rx_xfer);
+	if (n > pCdcCtrl->rx_len) {
+		n = pCdcCtrl->rx_len;
+	}
+	if (pCdcCtrl->rx_xfer == pCdcCtrl->rx_bounce) {
+		mwCDC_RingCopy(ring, ring->head, pCdcCtrl->rx_bounce, n, TRUE);
+	}
+	/* publish the data */
+	COMPILER_BARRIER();
+	ring->head += n;
+	mwCDC_RxStart(pCdcCtrl);
+}
+
+/*
+ *  CDC Data Path Reset
+ *  Parameters:      pCdcCtrl: Handle to the CDC Control Structure.
+ *  Return Value:    None
+ *
+ *  Bus reset retires the queued transfers. Unsent data is dropped, received
+ *  data stays in the ring for ReadData().
+ */
+
+void mwCDC_ResetData(USB_CDC_CTRL_T *pCdcCtrl)
+{
+	pCdcCtrl->tx.tail = pCdcCtrl->tx.head;
+	pCdcCtrl->tx_len = 0;
+	pCdcCtrl->tx_state = CDC_XFER_IDLE;
+	pCdcCtrl->rx_state = CDC_XFER_IDLE;
+}
+
+/*
+ *  CDC Write Data
+ *  Parameters:     hCdc: Handle to the CDC Control Structure.
+ *                  buffer: Data to send.
+ *                  len: Length of the data.
+ *  Return Value:   Number of bytes queued in the transmit ring.
+ *
+ *  Only the USB interrupt ends a queued transfer, so the endpoint is started
+ *  here only when tx_state says nothing is queued; the interrupt cannot change
+ *  tx_state then.
+ */
+
+uint32_t mwCDC_WriteData(USBD_HANDLE_T hCdc, const uint8_t *buffer, uint32_t len)
+{
+	USB_CDC_CTRL_T *pCdcCtrl = (USB_CDC_CTRL_T *) hCdc;
+	CDC_RING_T *ring = &pCdcCtrl->tx;
+	uint32_t head = ring->head;
+	uint32_t space;
+
+	if ((ring->buf == 0) || !USB_IsConfigured(pCdcCtrl->pUsbCtrl)) {
+		return 0;
+	}
+	space = ring->mask + 1 - (head - ring->tail);
+	if (len > space) {
+		len = space;
+	}
+	mwCDC_RingCopy(ring, head, (uint8_t *) buffer, len, TRUE);
+	/* publish the data */
+	COMPILER_BARRIER();
+	ring->head = head + len;
+
+	/* a busy endpoint picks the data up on completion */
+	if (pCdcCtrl->tx_state == CDC_XFER_IDLE) {
+		mwCDC_TxStart(pCdcCtrl);
+	}
+	return len;
+}
+
+/*
+ *  CDC Read Data
+ *  Parameters:     hCdc: Handle to the CDC Control Structure.
+ *                  buffer: Destination buffer.
+ *                  len: Size of the destination buffer.
+ *  Return Value:   Number of bytes copied from the receive ring.
+ *
+ *  A parked OUT endpoint is left alone by the USB interrupt, so it is primed
+ *  again here once the ring has room.
+ */
+
+uint32_t mwCDC_ReadData(USBD_HANDLE_T hCdc, uint8_t *buffer, uint32_t len)
+{
+	USB_CDC_CTRL_T *pCdcCtrl = (USB_CDC_CTRL_T *) hCdc;
+	CDC_RING_T *ring = &pCdcCtrl->rx;
+	uint32_t tail = ring->tail;
+	uint32_t avail;
+
+	if (ring->buf == 0) {
+		return 0;
+	}
+	avail = ring->head - tail;
+	if (len > avail) {
+		len = avail;
+	}
+	COMPILER_BARRIER();
+	mwCDC_RingCopy(ring, tail, buffer, len, FALSE);
+	/* release the space */
+	COMPILER_BARRIER();
+	ring->tail = tail + len;
+
+	if (pCdcCtrl->rx_state == CDC_XFER_PARKED) {
+		mwCDC_RxStart(pCdcCtrl);
+	}
+	return len;
+}
+
+/*
+ *  Default CDC BULK IN Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *									event:  Type of endpoint event.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwCDC_bulk_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	if (event == USB_EVT_IN) {
+		mwCDC_TxDone((USB_CDC_CTRL_T *) data);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Default CDC BULK OUT Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *									event:  Type of endpoint event.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwCDC_bulk_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_CDC_CTRL_T *pCdcCtrl = (USB_CDC_CTRL_T *) data;
+
+	switch (event) {
+	case USB_EVT_OUT_NAK:
+		/* host has data and nothing is primed */
+		if (pCdcCtrl->rx_state == CDC_XFER_IDLE) {
+			mwCDC_RxStart(pCdcCtrl);
+		}
+		break;
+
+	case USB_EVT_OUT:
+		mwCDC_RxDone(pCdcCtrl);
+		break;
+
+	default:
+		break;
+	}
+	return LPC_OK;
+}
+
 /*
  *  Default CDC Class Handler
  *  Parameters:     hUsb: Handle to the USB device stack.
@@ -252,6 +565,10 @@ ErrorCode_t mwCDC_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 		}
 		break;
 
+	case USB_EVT_RESET:
+		mwCDC_ResetData(pCdcCtrl);
+		break;
+
 	default:
 		break;
 	}
@@ -275,6 +592,11 @@ uint32_t mwCDC_GetMemSize(USBD_CDC_INIT_PARAM_T *param)
 	/* calculate required length */
 	req_len += sizeof(USB_CDC_CTRL_T);	/* memory for MSC controller structure */
 	req_len += 4;	/* for alignment overhead */
+	req_len += param->tx_buf_size;		/* transmit ring */
+	if (param->rx_buf_size != 0) {
+		req_len += param->rx_buf_size;	/* receive ring */
+		req_len += USB_HS_MAX_BULK_PACKET;	/* receive bounce buffer */
+	}
 	req_len &= ~0x3;
 
 	return req_len;
@@ -295,13 +617,17 @@ ErrorCode_t mwCDC_init(USBD_HANDLE_T hUsb, USBD_CDC_INIT_PARAM_T *param, USBD_HA
 	uint32_t new_addr, i;
 	USB_CDC_CTRL_T *pCdcCtrl;
 	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
+	USB_EP_HANDLER_T pfn;
 	USB_INTERFACE_DESCRIPTOR *pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->cif_intf_desc;
 
 	/* check for memory alignment */
-	if ((param->mem_base &  0x3) &&
-		(param->mem_size < sizeof(USB_CDC_CTRL_T))) {
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwCDC_GetMemSize(param))) {
 		return ERR_USBD_BAD_MEM_BUF;
 	}
+	if (!CDC_RING_SIZE_OK(param->tx_buf_size) || !CDC_RING_SIZE_OK(param->rx_buf_size)) {
+		return ERR_API_INVALID_PARAM2;
+	}
 
 	/* allocate memory for the control data structure */
 	pCdcCtrl = (USB_CDC_CTRL_T *) param->mem_base;
@@ -328,6 +654,23 @@ ErrorCode_t mwCDC_init(USBD_HANDLE_T hUsb, USBD_CDC_INIT_PARAM_T *param, USBD_HA
 	pCdcCtrl->SendBreak = param->SendBreak;
 	pCdcCtrl->SetLineCode = param->SetLineCode;
 
+	/* allocate the data path rings */
+	if (param->tx_buf_size != 0) {
+		pCdcCtrl->tx.buf = (uint8_t *) param->mem_base;
+		pCdcCtrl->tx.mask = param->tx_buf_size - 1;
+		param->mem_base += param->tx_buf_size;
+		param->mem_size -= param->tx_buf_size;
+	}
+	if (param->rx_buf_size != 0) {
+		pCdcCtrl->rx.buf = (uint8_t *) param->mem_base;
+		pCdcCtrl->rx.mask = param->rx_buf_size - 1;
+		param->mem_base += param->rx_buf_size;
+		param->mem_size -= param->rx_buf_size;
+		pCdcCtrl->rx_bounce = (uint8_t *) param->mem_base;
+		param->mem_base += USB_HS_MAX_BULK_PACKET;
+		param->mem_size -= USB_HS_MAX_BULK_PACKET;
+	}
+
 	/* parse the control interface descriptor */
 	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
 		(pIntfDesc->bInterfaceClass == CDC_COMMUNICATION_INTERFACE_CLASS) &&
@@ -398,13 +741,27 @@ ErrorCode_t mwCDC_init(USBD_HANDLE_T hUsb, USBD_CDC_INIT_PARAM_T *param, USBD_HA
 		return ERR_USBD_BAD_EP_DESC;
 	}
 
-	/* register ep0 handler */
+	/* register the data path endpoint handlers */
+	if (pCdcCtrl->tx.buf != 0) {
+		ret = mwUSB_RegisterEpHandler(hUsb, ((pCdcCtrl->epin_num & 0x0F) << 1) + 1,
+									  mwCDC_bulk_in_hdlr, pCdcCtrl);
+	}
+	if ((pCdcCtrl->rx.buf != 0) && (ret == LPC_OK)) {
+		ret = mwUSB_RegisterEpHandler(hUsb, ((pCdcCtrl->epout_num & 0x0F) << 1),
+									  mwCDC_bulk_out_hdlr, pCdcCtrl);
+	}
+	if (ret != LPC_OK) {
+		return ret;
+	}
+
+	/* register ep0 handler, for both interfaces */
 	/* check if user wants his own handler */
-	if (param->CDC_Ep0_Hdlr == 0) {
-		ret = mwUSB_RegisterClassHandler(hUsb, mwCDC_ep0_hdlr, pCdcCtrl);
+	pfn = (param->CDC_Ep0_Hdlr == 0) ? mwCDC_ep0_hdlr : param->CDC_Ep0_Hdlr;
+	ret = mwUSB_RegisterIntfHandler(hUsb, pCdcCtrl->cif_num, pfn, pCdcCtrl);
+	if (ret == LPC_OK) {
+		ret = mwUSB_RegisterIntfHandler(hUsb, pCdcCtrl->dif_num, pfn, pCdcCtrl);
 	}
-	else {
-		ret = mwUSB_RegisterClassHandler(hUsb, param->CDC_Ep0_Hdlr, pCdcCtrl);
+	if (param->CDC_Ep0_Hdlr != 0) {
 		param->CDC_Ep0_Hdlr = mwCDC_ep0_hdlr;
 	}
 	/* return the handle */
@@ -56,6 +56,13 @@
 														/* large enough for file transfer */
 #define CDC_BUF_MASK               (CDC_BUF_SIZE - 1ul)
 
+/** \brief Largest bulk transfer queued by the CDC data path.
+ *  \ingroup USBD_CDC
+ *
+ *  One device transfer descriptor, whatever the alignment of the ring.
+ */
+#define CDC_MAX_XFER_SIZE          (16 * 1024)
+
 /** \brief Communication Device Class function driver initialization parameter data structure.
  *  \ingroup USBD_CDC
  *
@@ -378,6 +385,25 @@ typedef struct USBD_CDC_INIT_PARAM {
 	 */
 	ErrorCode_t (*CDC_Ep0_Hdlr)(USBD_HANDLE_T hUsb, void *data, uint32_t event);
 
+	/** Size in bytes of the transmit ring drained by the stack. When non-zero the stack
+	 * handles the BULK IN endpoint of the data interface itself: data queued with
+	 * USBD_CDC_API::WriteData() is sent in transfers of up to \ref CDC_MAX_XFER_SIZE
+	 * bytes, and a zero length packet ends a transfer that is a multiple of the max
+	 * packet size once the ring runs empty. \em CDC_BulkIN_Hdlr is then not used.
+	 * Must be a power of 2 and at least USB_HS_MAX_BULK_PACKET. The ring is allocated
+	 * from \em mem_base. Set to 0 to move the IN data in the application.
+	 */
+	uint32_t tx_buf_size;
+
+	/** Size in bytes of the receive ring filled by the stack. When non-zero the stack
+	 * handles the BULK OUT endpoint of the data interface itself: the endpoint is primed
+	 * with the free space of the ring, up to \ref CDC_MAX_XFER_SIZE bytes at once, and
+	 * the application takes the data with USBD_CDC_API::ReadData(). \em CDC_BulkOUT_Hdlr
+	 * is then not used. Same constraints as \em tx_buf_size. Set to 0 to move the OUT
+	 * data in the application.
+	 */
+	uint32_t rx_buf_size;
+
 } USBD_CDC_INIT_PARAM_T;
 
 /** \brief CDC class API functions structure.
@@ -445,6 +471,35 @@ typedef struct USBD_CDC_API {
 	 */
 	ErrorCode_t (*SendNotification)(USBD_HANDLE_T hCdc, uint8_t bNotification, uint16_t data);
 
+	/** \fn uint32_t WriteData(USBD_HANDLE_T hCdc, const uint8_t *buffer, uint32_t len)
+	 *  Function to queue data for the host on the BULK IN endpoint.
+	 *
+	 *  Copies as much of \em buffer as fits into the transmit ring and starts the
+	 *  endpoint when it is idle. The USB interrupt drains the ring, so the function
+	 *  is meant to be called from the main loop; it must not be called from more than
+	 *  one context at a time. Nothing is queued while the device is not configured.
+	 *
+	 *  \param[in] hCdc Handle to CDC function driver.
+	 *  \param[in] buffer Data to send.
+	 *  \param[in] len  Length of the data.
+	 *  \return Number of bytes queued, 0 when the ring is full or \em tx_buf_size is 0.
+	 */
+	uint32_t (*WriteData)(USBD_HANDLE_T hCdc, const uint8_t *buffer, uint32_t len);
+
+	/** \fn uint32_t ReadData(USBD_HANDLE_T hCdc, uint8_t *buffer, uint32_t len)
+	 *  Function to take data received from the host on the BULK OUT endpoint.
+	 *
+	 *  Copies up to \em len bytes out of the receive ring, which the USB interrupt
+	 *  fills. Once a full ring has drained below the max packet size the endpoint is
+	 *  primed again from here. Same calling rules as WriteData().
+	 *
+	 *  \param[in] hCdc Handle to CDC function driver.
+	 *  \param[out] buffer Destination buffer.
+	 *  \param[in] len  Size of the destination buffer.
+	 *  \return Number of bytes copied, 0 when nothing was received or \em rx_buf_size is 0.
+	 */
+	uint32_t (*ReadData)(USBD_HANDLE_T hCdc, uint8_t *buffer, uint32_t len);
+
 } USBD_CDC_API_T;
 
 /*-----------------------------------------------------------------------------
@@ -452,6 +507,20 @@ typedef struct USBD_CDC_API {
  *-----------------------------------------------------------------------------*/
 /** @cond  ADVANCED_API */
 
+/* Data path transfer states */
+#define CDC_XFER_IDLE              0	/* nothing queued, the next event may start one */
+#define CDC_XFER_BUSY              1	/* transfer queued on the endpoint */
+#define CDC_XFER_PARKED            2	/* receive ring full, restarted by ReadData() */
+
+/* Single producer, single consumer byte ring. The indexes run freely and are
+   masked on use; each one is written by one side only. */
+typedef struct _CDC_RING_T {
+	uint8_t *buf;
+	uint32_t mask;					/* ring size - 1 */
+	volatile uint32_t head;			/* written by the producer */
+	volatile uint32_t tail;			/* written by the consumer */
+} CDC_RING_T;
+
 typedef struct _CDC_CTRL_T {
 	USB_CORE_CTRL_T *pUsbCtrl;
 	/* notification buffer */
@@ -479,6 +548,17 @@ typedef struct _CDC_CTRL_T {
 	ErrorCode_t (*CIC_GetRequest)(USBD_HANDLE_T hHid, USB_SETUP_PACKET *pSetup, uint8_t * *pBuffer, uint16_t *length);
 	ErrorCode_t (*CIC_SetRequest)(USBD_HANDLE_T hCdc, USB_SETUP_PACKET *pSetup, uint8_t * *pBuffer, uint16_t length);
 
+	/* data path */
+	CDC_RING_T tx;					/* filled by WriteData(), drained on BULK IN */
+	CDC_RING_T rx;					/* filled on BULK OUT, drained by ReadData() */
+	uint32_t tx_len;				/* length of the queued IN transfer */
+	uint32_t rx_len;				/* length of the queued OUT transfer */
+	uint8_t *rx_xfer;				/* buffer of the queued OUT transfer */
+	uint8_t *rx_bounce;				/* one packet, used when less fits before the ring wraps */
+	volatile uint8_t tx_state;		/* CDC_XFER_xxx */
+	volatile uint8_t rx_state;		/* CDC_XFER_xxx */
+	uint8_t pad1[2];
+
 } USB_CDC_CTRL_T;
 
 /** @cond  DIRECT_API */
@@ -488,6 +568,10 @@ extern ErrorCode_t mwCDC_init(USBD_HANDLE_T hUsb, USBD_CDC_INIT_PARAM_T *param,
 
 extern ErrorCode_t mwCDC_SendNotification (USBD_HANDLE_T hCdc, uint8_t bNotification, uint16_t data);
 
+extern uint32_t mwCDC_WriteData(USBD_HANDLE_T hCdc, const uint8_t *buffer, uint32_t len);
+
+extern uint32_t mwCDC_ReadData(USBD_HANDLE_T hCdc, uint8_t *buffer, uint32_t len);
+
 /** @endcond */
 
 /** @endcond */
@@ -302,6 +302,20 @@ ErrorCode_t USB_ReqSetAddress(USB_CORE_CTRL_T *pCtrl)
 	return ERR_USBD_INVALID_REQ;
 }
 
+/*
+ *  Look up an indexed descriptor
+ *  Parameters:      idx: Index table
+ *                   cnt: Number of descriptors in the table
+ *                   n: Descriptor index
+ *  Return Value:    Pointer to the descriptor, NULL if there is none.
+ */
+
+static uint8_t *USB_IndexedDesc(uint8_t **idx, uint32_t cnt, uint32_t n)
+{
+	/* mwUSB_InitCore() refuses descriptors which don't fit the table */
+	return (n < cnt) ? idx[n] : NULL;
+}
+
 /*
  *  Get Descriptor USB Request
  *  Parameters:      hUsb: Handle to the USB device stack. (global pCtrl->SetupPacket)
@@ -311,8 +325,9 @@ ErrorCode_t USB_ReqSetAddress(USB_CORE_CTRL_T *pCtrl)
 ErrorCode_t USB_ReqGetDescriptor(USBD_HANDLE_T hUsb)
 {
 	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	USB_DESC_INDEX *pIdx;
 	uint8_t  *pD = NULL;
-	uint32_t len, n;
+	uint32_t len;
 
 	switch (pCtrl->SetupPacket.bmRequestType.BM.Recipient) {
 	case REQUEST_TO_DEVICE:
@@ -323,25 +338,16 @@ ErrorCode_t USB_ReqGetDescriptor(USBD_HANDLE_T hUsb)
 			break;
 
 		case USB_CONFIGURATION_DESCRIPTOR_TYPE:
-			if (pCtrl->device_speed == USB_HIGH_SPEED) {
-				pD = pCtrl->high_speed_desc;
-			}
-			else {
-				pD = pCtrl->full_speed_desc;
+			pIdx = &pCtrl->desc_idx[(pCtrl->device_speed == USB_HIGH_SPEED) ? USB_HIGH_SPEED : USB_FULL_SPEED];
+			pD = USB_IndexedDesc(pIdx->config, pIdx->num_configs, pCtrl->SetupPacket.wValue.WB.L);
+			if (pD == NULL) {
+				return ERR_USBD_INVALID_REQ;
 			}
 
+			/* undo an earlier OTHER_SPEED_CONFIGURATION request */
 			if (((USB_CONFIGURATION_DESCRIPTOR *) pD)->bDescriptorType != USB_CONFIGURATION_DESCRIPTOR_TYPE) {
 				((USB_CONFIGURATION_DESCRIPTOR *) pD)->bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
 			}
-
-			for (n = 0; n != pCtrl->SetupPacket.wValue.WB.L; n++) {
-				if (((USB_CONFIGURATION_DESCRIPTOR *) pD)->bLength != 0) {
-					pD += ((USB_CONFIGURATION_DESCRIPTOR *) pD)->wTotalLength;
-				}
-			}
-			if (((USB_CONFIGURATION_DESCRIPTOR *) pD)->bLength == 0) {
-				return ERR_USBD_INVALID_REQ;
-			}
 			pCtrl->EP0Data.pData = pD;
 			len = ((USB_CONFIGURATION_DESCRIPTOR *) pD)->wTotalLength;
 			break;
@@ -351,13 +357,10 @@ ErrorCode_t USB_ReqGetDescriptor(USBD_HANDLE_T hUsb)
 				/* BOS Descriptor is not supported on USB 2.0, but only supported on USB2.0x or USB 2.0 extension. */
 				return ERR_USBD_INVALID_REQ;
 			}
+			/* a device has a single BOS descriptor, requested with index 0 */
 			pD = (uint8_t *) pCtrl->bos_descriptor;
-			for (n = 0; n != pCtrl->SetupPacket.wValue.WB.L; n++) {
-				if (((USB_BOS_DESCRIPTOR *) pD)->bLength != 0) {
-					pD += ((USB_BOS_DESCRIPTOR *) pD)->wTotalLength;
-				}
-			}
-			if (((USB_BOS_DESCRIPTOR *) pD)->bLength == 0) {
+			if ((pD == NULL) || (pCtrl->SetupPacket.wValue.WB.L != 0) ||
+				(((USB_BOS_DESCRIPTOR *) pD)->bLength == 0)) {
 				return ERR_USBD_INVALID_REQ;
 			}
 			pCtrl->EP0Data.pData = pD;
@@ -371,15 +374,9 @@ ErrorCode_t USB_ReqGetDescriptor(USBD_HANDLE_T hUsb)
 				}
 			}
 			if (pD == NULL) {
-				pD = (uint8_t *) pCtrl->string_desc;
-
-				for (n = 0; n != pCtrl->SetupPacket.wValue.WB.L; n++) {
-					if (((USB_STRING_DESCRIPTOR *) pD)->bLength != 0) {
-						pD += ((USB_STRING_DESCRIPTOR *) pD)->bLength;
-					}
-				}
+				pD = USB_IndexedDesc(pCtrl->string_idx, pCtrl->num_strings, pCtrl->SetupPacket.wValue.WB.L);
 			}
-			if (((USB_STRING_DESCRIPTOR *) pD)->bLength == 0) {
+			if ((pD == NULL) || (((USB_STRING_DESCRIPTOR *) pD)->bLength == 0)) {
 				return ERR_USBD_INVALID_REQ;
 			}
 			pCtrl->EP0Data.pData = pD;
@@ -405,19 +402,9 @@ ErrorCode_t USB_ReqGetDescriptor(USBD_HANDLE_T hUsb)
 			/* This is a tricky one that, if HS is supported in configuration descriptor,
 			   then other speed descriptor should show FS is also supported, vice versa. That's
 			   why below pD pointer is swapped to show both speeds are supported. */
-			if (pCtrl->device_speed == USB_HIGH_SPEED) {
-				pD = pCtrl->full_speed_desc;
-			}
-			else {
-				pD = pCtrl->high_speed_desc;
-			}
-
-			for (n = 0; n != pCtrl->SetupPacket.wValue.WB.L; n++) {
-				if (((USB_OTHER_SPEED_CONFIGURATION *) pD)->bLength != 0) {
-					pD += ((USB_OTHER_SPEED_CONFIGURATION *) pD)->wTotalLength;
-				}
-			}
-			if (((USB_OTHER_SPEED_CONFIGURATION *) pD)->bLength == 0) {
+			pIdx = &pCtrl->desc_idx[(pCtrl->device_speed == USB_HIGH_SPEED) ? USB_FULL_SPEED : USB_HIGH_SPEED];
+			pD = USB_IndexedDesc(pIdx->config, pIdx->num_configs, pCtrl->SetupPacket.wValue.WB.L);
+			if (pD == NULL) {
 				return ERR_USBD_INVALID_REQ;
 			}
 			((USB_CONFIGURATION_DESCRIPTOR *) pD)->bDescriptorType = USB_OTHER_SPEED_CONFIG_DESCRIPTOR_TYPE;
@@ -713,12 +700,30 @@ ErrorCode_t USB_ReqSetInterface(USBD_HANDLE_T hUsb)
 
 ErrorCode_t USB_InvokeEp0Hdlrs(USB_CORE_CTRL_T *pCtrl, uint32_t event)
 {
-	uint32_t inf = 0;
+	uint32_t inf = 0, skip = 0;
 	ErrorCode_t ret = ERR_USBD_UNHANDLED;
 
+	/* requests to an interface with a bound handler go to it first, and then
+	   only to the handlers not bound to any interface */
+	if ((event != USB_EVT_RESET) &&
+		(pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE) &&
+		(pCtrl->SetupPacket.wIndex.WB.L < USB_MAX_IF_NUM) &&
+		(pCtrl->ep0_hdlr_route[pCtrl->SetupPacket.wIndex.WB.L] != 0)) {
+		inf = pCtrl->ep0_hdlr_route[pCtrl->SetupPacket.wIndex.WB.L] - 1;
+		ret = pCtrl->ep0_hdlr_cb[inf](pCtrl, pCtrl->ep0_cb_data[inf], event);
+		if (ret != ERR_USBD_UNHANDLED) {
+			if (ret != LPC_OK) {
+				/* STALL requested */
+				mwUSB_StallEp0(pCtrl);
+			}
+			return ret;
+		}
+		skip = pCtrl->ep0_hdlr_routed;
+	}
+
 	for (inf = 0; inf < pCtrl->num_ep0_hdlrs; inf++) {
 		/* check if a valid handler is installed */
-		if (pCtrl->ep0_hdlr_cb[inf] != 0) {
+		if ((pCtrl->ep0_hdlr_cb[inf] != 0) && ((skip & (1 << inf)) == 0)) {
 			/*invoke the handlers */
 			ret = pCtrl->ep0_hdlr_cb[inf](pCtrl, pCtrl->ep0_cb_data[inf], event);
 			/* if un-handled continue to next handler */
@@ -1016,16 +1021,94 @@ void USBD_cache_flush(uint32_t *start_adr, uint32_t *end_adr)
 	/* do nothing*/
 }
 
+/*
+ *  Index one set of configuration descriptors
+ *  Parameters:     pIdx: Index to fill
+ *                  pDesc: Configuration descriptors, may be NULL
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+static ErrorCode_t USB_IndexConfigs(USB_DESC_INDEX *pIdx, uint8_t *pDesc)
+{
+	USB_COMMON_DESCRIPTOR *pD;
+	uint8_t *end;
+	uint32_t alt = 0, n;
+
+	if (pDesc == NULL) {
+		return LPC_OK;
+	}
+
+	/* configurations follow each other, a zero length ends the list */
+	for (pD = (USB_COMMON_DESCRIPTOR *) pDesc;
+		 (pD->bLength != 0) && (pIdx->num_configs < USB_MAX_CONFIG_NUM);
+		 pD = (USB_COMMON_DESCRIPTOR *) ((uint8_t *) pD + ((USB_CONFIGURATION_DESCRIPTOR *) pD)->wTotalLength)) {
+		pIdx->config[pIdx->num_configs++] = (uint8_t *) pD;
+	}
+	if (pD->bLength != 0) {
+		/* more configurations than USB_MAX_CONFIG_NUM */
+		return ERR_USBD_BAD_CFG_DESC;
+	}
+
+	/* interfaces and endpoints of the first configuration */
+	end = pDesc + ((USB_CONFIGURATION_DESCRIPTOR *) pDesc)->wTotalLength;
+	for (pD = (USB_COMMON_DESCRIPTOR *) (pDesc + pDesc[0]);
+		 ((uint8_t *) pD < end) && (pD->bLength != 0);
+		 pD = (USB_COMMON_DESCRIPTOR *) ((uint8_t *) pD + pD->bLength)) {
+		switch (pD->bDescriptorType) {
+		case USB_INTERFACE_DESCRIPTOR_TYPE:
+			alt = ((USB_INTERFACE_DESCRIPTOR *) pD)->bAlternateSetting;
+			n = ((USB_INTERFACE_DESCRIPTOR *) pD)->bInterfaceNumber;
+			if ((alt == 0) && (n < USB_MAX_IF_NUM)) {
+				pIdx->intf[n] = (USB_INTERFACE_DESCRIPTOR *) pD;
+			}
+			break;
+
+		case USB_ENDPOINT_DESCRIPTOR_TYPE:
+			n = ((USB_ENDPOINT_DESCRIPTOR *) pD)->bEndpointAddress;
+			n = ((n & 0x0F) << 1) | ((n & 0x80) ? 1 : 0);
+			if ((alt == 0) && (n < (2 * USB_MAX_EP_NUM))) {
+				pIdx->ep[n] = (USB_ENDPOINT_DESCRIPTOR *) pD;
+			}
+			break;
+		}
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Build the descriptor index
+ *  Parameters:     pCtrl: Handle to Core Control Structure.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+static ErrorCode_t USB_IndexDescs(USB_CORE_CTRL_T *pCtrl)
+{
+	uint8_t *pD = pCtrl->string_desc;
+
+	while ((pD != NULL) && (pD[0] != 0) && (pCtrl->num_strings < USB_MAX_STRING_NUM)) {
+		pCtrl->string_idx[pCtrl->num_strings++] = pD;
+		pD += pD[0];
+	}
+	if ((pD != NULL) && (pD[0] != 0)) {
+		/* more string descriptors than USB_MAX_STRING_NUM */
+		return ERR_USBD_BAD_DESC;
+	}
+	if (USB_IndexConfigs(&pCtrl->desc_idx[USB_FULL_SPEED], pCtrl->full_speed_desc) != LPC_OK) {
+		return ERR_USBD_BAD_CFG_DESC;
+	}
+	return USB_IndexConfigs(&pCtrl->desc_idx[USB_HIGH_SPEED], pCtrl->high_speed_desc);
+}
+
 /*
  *  Core function initialization routine
  *  Parameters:     pCtrl: Handle to Core Control Structure.
  *                                  param: Structure containing Core function driver module
  *						      initialization parameters.
  *									pdescr: Pointer to USB descriptors
- *  Return Value:   None
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
  */
 
-void  mwUSB_InitCore(USB_CORE_CTRL_T *pCtrl, USB_CORE_DESCS_T *pdescr, USBD_API_INIT_PARAM_T *param)
+ErrorCode_t mwUSB_InitCore(USB_CORE_CTRL_T *pCtrl, USB_CORE_DESCS_T *pdescr, USBD_API_INIT_PARAM_T *param)
 {
 	COMPILE_TIME_ASSERT((offsetof(USB_CORE_CTRL_T, SetupPacket) & 0x3) == 0);
 	COMPILE_TIME_ASSERT((offsetof(USB_CORE_CTRL_T, EP0Buf) & 0x3) == 0);
@@ -1033,6 +1116,7 @@ void  mwUSB_InitCore(USB_CORE_CTRL_T *pCtrl, USB_CORE_DESCS_T *pdescr, USBD_API_
 	/* init USB controller struct */
 	memset((void *) pCtrl, 0, sizeof(USB_CORE_CTRL_T));
 	pCtrl->max_num_ep = param->max_num_ep;
+	pCtrl->dtd_pool_depth = (param->dtd_pool_depth != 0) ? param->dtd_pool_depth : 1;
 	/* assign default implementation to virtual functions*/
 	mwUSB_RegisterEpHandler(pCtrl, 0, USB_EndPoint0, pCtrl);
 	mwUSB_RegisterEpHandler(pCtrl, 1, USB_EndPoint0, pCtrl);
@@ -1073,6 +1157,7 @@ void  mwUSB_InitCore(USB_CORE_CTRL_T *pCtrl, USB_CORE_DESCS_T *pdescr, USBD_API_
 	pCtrl->device_qualifier = pdescr->device_qualifier;
 	pCtrl->bos_descriptor = pdescr->bos_descriptor;
 	pCtrl->hw_api = &hw_api;
+	return USB_IndexDescs(pCtrl);
 }
 
 /*
@@ -1100,6 +1185,44 @@ ErrorCode_t mwUSB_RegisterClassHandler(USBD_HANDLE_T hUsb, USB_EP_HANDLER_T pfn,
 	return LPC_OK;
 }
 
+/*
+ *  Function to register the EP0 event handler of an interface with USB device stack.
+ *  Parameters:     hUsb Handle to the USB device stack.
+ *                                  if_num  Interface number the handler is bound to.
+ *                                  pfn  Class specific EP0 handler function.
+ *									data Pointer to the data which will be passed when callback function is called by the stack.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwUSB_RegisterIntfHandler(USBD_HANDLE_T hUsb, uint32_t if_num, USB_EP_HANDLER_T pfn, void *data)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	uint32_t inf;
+	ErrorCode_t ret;
+
+	if (if_num >= USB_MAX_IF_NUM) {
+		return ERR_API_INVALID_PARAM2;
+	}
+
+	/* one handler may serve several interfaces */
+	for (inf = 0; inf < pCtrl->num_ep0_hdlrs; inf++) {
+		if ((pCtrl->ep0_hdlr_cb[inf] == pfn) && (pCtrl->ep0_cb_data[inf] == data)) {
+			break;
+		}
+	}
+	if (inf == pCtrl->num_ep0_hdlrs) {
+		ret = mwUSB_RegisterClassHandler(hUsb, pfn, data);
+		if (ret != LPC_OK) {
+			return ret;
+		}
+	}
+
+	pCtrl->ep0_hdlr_route[if_num] = (uint8_t) (inf + 1);
+	pCtrl->ep0_hdlr_routed |= (1 << inf);
+
+	return LPC_OK;
+}
+
 /*
  *  Function to register interrupt/event handler for the requested endpoint with USB device stack.
  *  Parameters:     hUsb Handle to the USB device stack.
@@ -1147,3 +1270,66 @@ ErrorCode_t mwUSB_GetEpHandler(USBD_HANDLE_T hUsb, uint32_t ep_index, USB_EP_HAN
 
 	return LPC_OK;
 }
+
+/*
+ *  Function to get an interface descriptor by interface number.
+ *  Parameters:     hUsb Handle to the USB device stack.
+ *                  speed USB_HIGH_SPEED or USB_FULL_SPEED descriptors.
+ *                  if_num Interface number.
+ *  Return Value:   Pointer to the descriptor, NULL if there is none.
+ */
+
+USB_INTERFACE_DESCRIPTOR *mwUSB_GetIntfDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t if_num)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+
+	if ((speed > USB_HIGH_SPEED) || (if_num >= USB_MAX_IF_NUM)) {
+		return NULL;
+	}
+	return pCtrl->desc_idx[speed].intf[if_num];
+}
+
+/*
+ *  Function to find the first interface descriptor of a class.
+ *  Parameters:     hUsb Handle to the USB device stack.
+ *                  speed USB_HIGH_SPEED or USB_FULL_SPEED descriptors.
+ *                  intfClass Interface class code.
+ *  Return Value:   Pointer to the descriptor, NULL if there is none.
+ */
+
+USB_INTERFACE_DESCRIPTOR *mwUSB_FindIntfDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t intfClass)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	USB_INTERFACE_DESCRIPTOR *pIntfDesc;
+	uint32_t n;
+
+	if (speed > USB_HIGH_SPEED) {
+		return NULL;
+	}
+	for (n = 0; n < USB_MAX_IF_NUM; n++) {
+		pIntfDesc = pCtrl->desc_idx[speed].intf[n];
+		if ((pIntfDesc != NULL) && (pIntfDesc->bInterfaceClass == intfClass)) {
+			return pIntfDesc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *  Function to get an endpoint descriptor by endpoint address.
+ *  Parameters:     hUsb Handle to the USB device stack.
+ *                  speed USB_HIGH_SPEED or USB_FULL_SPEED descriptors.
+ *                  ep_addr Endpoint address.
+ *  Return Value:   Pointer to the descriptor, NULL if there is none.
+ */
+
+USB_ENDPOINT_DESCRIPTOR *mwUSB_GetEpDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t ep_addr)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	uint32_t ep_index = ((ep_addr & 0x0F) << 1) | ((ep_addr & 0x80) ? 1 : 0);
+
+	if ((speed > USB_HIGH_SPEED) || (ep_index >= (2 * USB_MAX_EP_NUM))) {
+		return NULL;
+	}
+	return pCtrl->desc_idx[speed].ep[ep_index];
+}
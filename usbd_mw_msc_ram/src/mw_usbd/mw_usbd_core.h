@@ -165,7 +165,10 @@ typedef struct USBD_API_INIT_PARAM {
 	uint8_t high_speed_capable;	/**< Specifies USB device controller's speed capability.
 						0 : Full-speed only; 1 : High speed capable */
 	uint8_t double_buffer; /**< Specifies whether low-level HW driver to use double buffering for EP transfers.*/
-	uint8_t pad0[1];
+	uint8_t dtd_pool_depth;	/**< Number of transfer descriptors the low-level HW driver keeps
+						   per endpoint, ie. how many WriteEP()/ReadReqEP() requests can be
+						   queued on an endpoint before it reports busy. 0 is treated as 1.
+						 */
 	/* USB Device Events Callback Functions */
 	/** Event for USB interface reset. This event fires when the USB host requests that the device
 	 *  reset its interface. This event fires after the control endpoint has been automatically
@@ -492,6 +495,72 @@ typedef struct USBD_CORE_API {
 	 */
 	ErrorCode_t (*GetEpHandler)(USBD_HANDLE_T hUsb, uint32_t ep_index, USB_EP_HANDLER_T *ep_handler, void * *data);
 
+	/** \fn USB_INTERFACE_DESCRIPTOR *GetIntfDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t if_num)
+	 *  Function to get an interface descriptor by interface number.
+	 *
+	 *  The stack indexes the descriptors passed to Init() once, so this and the
+	 *  two functions below are table lookups rather than descriptor walks. Only
+	 *  the first configuration and alternate setting 0 of each interface are
+	 *  indexed, which is what the class init functions are given.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in] speed  USB_HIGH_SPEED for the high speed descriptors, USB_FULL_SPEED
+	 *                    for the full speed ones.
+	 *  \param[in] if_num  Interface number, less than USB_MAX_IF_NUM.
+	 *  \return Pointer to the interface descriptor, or NULL if there is none.
+	 */
+	USB_INTERFACE_DESCRIPTOR *(*GetIntfDesc)(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t if_num);
+
+	/** \fn USB_INTERFACE_DESCRIPTOR *FindIntfDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t intfClass)
+	 *  Function to find the first interface descriptor of a class.
+	 *
+	 *  Replaces walking the configuration descriptor when an application looks
+	 *  for the interface to pass to a class init function.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in] speed  USB_HIGH_SPEED or USB_FULL_SPEED, see GetIntfDesc().
+	 *  \param[in] intfClass  Interface class code, eg. USB_DEVICE_CLASS_STORAGE.
+	 *  \return Pointer to the interface descriptor with the lowest number of that
+	 *          class, or NULL if there is none.
+	 */
+	USB_INTERFACE_DESCRIPTOR *(*FindIntfDesc)(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t intfClass);
+
+	/** \fn USB_ENDPOINT_DESCRIPTOR *GetEpDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t ep_addr)
+	 *  Function to get an endpoint descriptor by endpoint address.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in] speed  USB_HIGH_SPEED or USB_FULL_SPEED, see GetIntfDesc().
+	 *  \param[in] ep_addr  Endpoint address, eg. 0x81 for EP1_IN.
+	 *  \return Pointer to the endpoint descriptor, or NULL if there is none.
+	 */
+	USB_ENDPOINT_DESCRIPTOR *(*GetEpDesc)(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t ep_addr);
+
+	/** \fn ErrorCode_t RegisterIntfHandler(USBD_HANDLE_T hUsb, uint32_t if_num, USB_EP_HANDLER_T pfn, void* data)
+	 *  Function to register the EP0 event handler of an interface with USB device stack.
+	 *
+	 *  Like RegisterClassHandler(), but the handler is bound to interface \em if_num.
+	 *  Requests addressed to that interface (SETUP, data and status stage events of
+	 *  requests with an interface recipient) go straight to it, without trying the
+	 *  handlers of other interfaces first. If it returns ERR_USBD_UNHANDLED, the
+	 *  handlers registered through RegisterClassHandler() are tried in turn, then
+	 *  the stack's default handling. All other events (USB reset, device and
+	 *  endpoint requests) are still offered to every handler in registration order.
+	 *  Registering the same \em pfn and \em data again for another interface adds
+	 *  a route to the existing handler, eg. for the data interface of CDC.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in] if_num  Interface number, less than USB_MAX_IF_NUM.
+	 *  \param[in] pfn  Class specific EP0 handler function.
+	 *  \param[in] data Pointer to the data which will be passed when callback function is called by the stack.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success
+	 *          \retval ERR_USBD_TOO_MANY_CLASS_HDLR(0x0004000c)  The number of class handlers registered is
+	                       greater than the number of handlers allowed by the stack.
+	 *          \retval ERR_API_INVALID_PARAM2  if_num is not less than USB_MAX_IF_NUM.
+	 *
+	 */
+	ErrorCode_t (*RegisterIntfHandler)(USBD_HANDLE_T hUsb, uint32_t if_num, USB_EP_HANDLER_T pfn, void *data);
+
 } USBD_CORE_API_T;
 
 /*-----------------------------------------------------------------------------
@@ -519,6 +588,22 @@ typedef struct _USB_EP_DATA {
 	uint16_t pad0;
 } USB_EP_DATA;
 
+/* the index counts are 8 bits wide, as are descriptor indices */
+#if (USB_MAX_STRING_NUM < 1) || (USB_MAX_STRING_NUM > 255)
+#error "USB_MAX_STRING_NUM must be 1 to 255"
+#endif
+#if (USB_MAX_CONFIG_NUM < 1) || (USB_MAX_CONFIG_NUM > 255)
+#error "USB_MAX_CONFIG_NUM must be 1 to 255"
+#endif
+
+/* Index of one descriptor set (full or high speed), built by mwUSB_InitCore() */
+typedef struct _USB_DESC_INDEX {
+	uint8_t *config[USB_MAX_CONFIG_NUM];				/* configurations by descriptor index */
+	USB_INTERFACE_DESCRIPTOR *intf[USB_MAX_IF_NUM];		/* first configuration, alt 0, by number */
+	USB_ENDPOINT_DESCRIPTOR *ep[2 * USB_MAX_EP_NUM];	/* first configuration, alt 0, by ep_index */
+	uint8_t num_configs;
+} USB_DESC_INDEX;
+
 /* USB core controller data structure */
 struct _USB_CORE_CTRL_T {
 	/* override-able function pointers ~ c++ style virtual functions*/
@@ -558,6 +643,8 @@ struct _USB_CORE_CTRL_T {
 	/* USB class handlers */
 	USB_EP_HANDLER_T  ep0_hdlr_cb[USB_MAX_IF_NUM];
 	void *ep0_cb_data[USB_MAX_IF_NUM];
+	uint8_t ep0_hdlr_route[USB_MAX_IF_NUM];	/* handler index + 1 by interface number, 0 if none */
+	uint32_t ep0_hdlr_routed;				/* bit per handler bound to an interface */
 	uint8_t num_ep0_hdlrs;
 	/* USB Core data Variables */
 	uint8_t max_num_ep;	/* max number of endpoints supported by the HW */
@@ -594,10 +681,16 @@ struct _USB_CORE_CTRL_T {
 	uint8_t *bos_descriptor;
 
 	const struct USBD_HW_API *hw_api;
+
+	/* descriptor index, so requests and lookups don't walk the descriptors */
+	uint8_t *string_idx[USB_MAX_STRING_NUM];	/* string descriptors by index */
+	uint8_t num_strings;
+	USB_DESC_INDEX desc_idx[2];					/* by USB_FULL_SPEED / USB_HIGH_SPEED */
+	uint8_t dtd_pool_depth;						/* transfers the HW driver can queue per endpoint */
 };
 
 /* USB Core Functions */
-extern void mwUSB_InitCore(USB_CORE_CTRL_T *pCtrl, USB_CORE_DESCS_T *pdescr, USBD_API_INIT_PARAM_T *param);
+extern ErrorCode_t mwUSB_InitCore(USB_CORE_CTRL_T *pCtrl, USB_CORE_DESCS_T *pdescr, USBD_API_INIT_PARAM_T *param);
 
 extern void mwUSB_ResetCore(USBD_HANDLE_T hUsb);
 
@@ -638,6 +731,14 @@ extern ErrorCode_t mwUSB_RegisterEpHandler(USBD_HANDLE_T hUsb, uint32_t ep_index
 extern ErrorCode_t mwUSB_GetEpHandler(USBD_HANDLE_T hUsb, uint32_t ep_index, USB_EP_HANDLER_T *ep_handler,
 									  void * *data);
 
+extern USB_INTERFACE_DESCRIPTOR *mwUSB_GetIntfDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t if_num);
+
+extern USB_INTERFACE_DESCRIPTOR *mwUSB_FindIntfDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t intfClass);
+
+extern USB_ENDPOINT_DESCRIPTOR *mwUSB_GetEpDesc(USBD_HANDLE_T hUsb, uint32_t speed, uint32_t ep_addr);
+
+extern ErrorCode_t mwUSB_RegisterIntfHandler(USBD_HANDLE_T hUsb, uint32_t if_num, USB_EP_HANDLER_T pfn, void *data);
+
 extern void mwUSB_SetupStage (USBD_HANDLE_T hUsb);
 
 extern void mwUSB_DataInStage(USBD_HANDLE_T hUsb);
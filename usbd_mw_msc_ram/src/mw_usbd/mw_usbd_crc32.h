@@ -0,0 +1,52 @@
+/***********************************************************************
+ * $Id:: mw_usbd_crc32.h                                                       $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     CRC-32 checksum definitions.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include "mw_usbd.h"
+
+/** \file
+ *  \brief CRC-32 function prototype.
+ *
+ *  Checksum helper for storage backends which keep a CRC per block, see
+ *  USBD_MSC_INIT_PARAM::MSC_VerifyRange.
+ *
+ */
+
+/** \brief CRC-32 (IEEE 802.3, as used by zlib and Ethernet) of a buffer.
+ *  \ingroup USBD_MSC
+ *
+ *  Slicing-by-8 implementation: eight bytes are folded per step through
+ *  8kB of constant tables, roughly a quarter of the work of the classic
+ *  byte at a time loop. The data may be split over several calls by
+ *  passing the previous result as \em crc. Needs a little endian CPU.
+ *
+ *  \param[in] crc CRC of the preceding data, 0 for the first call.
+ *  \param[in] buf Data, any alignment.
+ *  \param[in] len Number of bytes.
+ *  \return CRC-32 of the data so far.
+ */
+extern uint32_t mwUSB_Crc32(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif  /* __CRC32_H__ */
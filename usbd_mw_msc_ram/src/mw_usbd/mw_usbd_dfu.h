@@ -120,4 +120,18 @@ typedef struct _DFU_STATUS DFU_STATUS_T;
 #define DFU_FUNC_DESC_SIZE    sizeof(USB_DFU_FUNC_DESCRIPTOR)
 #define DFU_GET_STATUS_SIZE   0x6
 
+/* DFU file suffix (Appendix B, DFU Rev 1.1) */
+PRE_PACK struct POST_PACK _DFU_SUFFIX {
+	uint16_t bcdDevice;
+	uint16_t idProduct;
+	uint16_t idVendor;
+	uint16_t bcdDFU;
+	uint8_t  ucDfuSignature[3];	/* "UFD" */
+	uint8_t  bLength;
+	uint32_t dwCRC;				/* CRC-32 of the file up to here, not inverted */
+};
+typedef struct _DFU_SUFFIX DFU_SUFFIX_T;
+
+#define DFU_SUFFIX_SIZE       16
+
 #endif  /* __MW_USBD_DFU_H__ */
@@ -29,12 +29,314 @@
 #include "mw_usbd_desc.h"
 #include "mw_usbd_dfu.h"
 #include "mw_usbd_dfuuser.h"
+#include "mw_usbd_crc32.h"
+
+/* package decoder states */
+#define DFU_DEC_TAG			0
+#define DFU_DEC_LITERAL		1
+#define DFU_DEC_INDEX		2
+#define DFU_DEC_COUNT		3
+#define DFU_DEC_COPY		4
+
+#define DFU_DELTA_CTRL		0
+#define DFU_DELTA_DIFF		1
+#define DFU_DELTA_EXTRA		2
+
+static uint32_t mwDFU_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+ * Write a block of the decoded image
+ */
+static void mwDFU_dec_flush(USBD_DFU_CTRL_T *pDfuCtrl)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+	uint8_t poll[3] = {0, 0, 0};
+	uint8_t *buff = dec->out_buf;
+	uint8_t status;
+
+	dec->crc = mwUSB_Crc32(dec->crc, dec->out_buf, dec->out_len);
+	status = pDfuCtrl->DFU_Write(dec->out_block++, &buff, dec->out_len, poll);
+	dec->poll += poll[0] | (poll[1] << 8) | (poll[2] << 16);
+	dec->out_len = 0;
+	if (status != DFU_STATUS_OK) {
+		dec->status = status;
+	}
+	else if ((dec->out_total == dec->out_size) && (dec->crc != dec->crc_expect)) {
+		dec->status = DFU_STATUS_errVERIFY;
+	}
+}
+
+static void mwDFU_dec_out(USBD_DFU_CTRL_T *pDfuCtrl, uint8_t b)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+
+	dec->out_buf[dec->out_len++] = b;
+	dec->out_total++;
+	if ((dec->out_len == dec->out_max) || (dec->out_total == dec->out_size)) {
+		mwDFU_dec_flush(pDfuCtrl);
+	}
+}
+
+/*
+ * Apply a delta package, one record after the other
+ */
+static void mwDFU_dec_delta(USBD_DFU_CTRL_T *pDfuCtrl, uint8_t b)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+	uint32_t left;
+
+	switch (dec->delta_state) {
+	case DFU_DELTA_CTRL:
+		dec->ctrl[dec->ctrl_len++] = b;
+		if (dec->ctrl_len < sizeof(dec->ctrl)) {
+			break;
+		}
+		dec->ctrl_len = 0;
+		dec->diff_left = mwDFU_get32(&dec->ctrl[0]);
+		dec->extra_left = mwDFU_get32(&dec->ctrl[4]);
+		dec->seek = (int32_t) mwDFU_get32(&dec->ctrl[8]);
+		left = dec->out_size - dec->out_total;
+		if ((dec->diff_left > left) || (dec->extra_left > left - dec->diff_left)) {
+			dec->status = DFU_STATUS_errFILE;
+		}
+		else if (dec->diff_left != 0) {
+			dec->delta_state = DFU_DELTA_DIFF;
+		}
+		else if (dec->extra_left != 0) {
+			dec->delta_state = DFU_DELTA_EXTRA;
+		}
+		else {
+			dec->base_pos += dec->seek;
+		}
+		break;
+
+	case DFU_DELTA_DIFF:
+		if ((uint32_t) dec->base_pos < dec->base_size) {
+			b += dec->base[dec->base_pos];
+		}
+		dec->base_pos++;
+		if (--dec->diff_left == 0) {
+			if (dec->extra_left != 0) {
+				dec->delta_state = DFU_DELTA_EXTRA;
+			}
+			else {
+				dec->base_pos += dec->seek;
+				dec->delta_state = DFU_DELTA_CTRL;
+			}
+		}
+		mwDFU_dec_out(pDfuCtrl, b);
+		break;
+
+	default:	/* DFU_DELTA_EXTRA */
+		if (--dec->extra_left == 0) {
+			dec->base_pos += dec->seek;
+			dec->delta_state = DFU_DELTA_CTRL;
+		}
+		mwDFU_dec_out(pDfuCtrl, b);
+		break;
+	}
+}
+
+static void mwDFU_dec_emit(USBD_DFU_CTRL_T *pDfuCtrl, uint8_t b)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+
+	if (dec->flags & DFU_PKG_LZ) {
+		dec->win[dec->win_pos++ & dec->win_mask] = b;
+	}
+	if (dec->flags & DFU_PKG_DELTA) {
+		mwDFU_dec_delta(pDfuCtrl, b);
+	}
+	else {
+		mwDFU_dec_out(pDfuCtrl, b);
+	}
+}
+
+/*
+ * Decode the package data of a received block, stops at the end of the image
+ */
+static void mwDFU_dec_input(USBD_DFU_CTRL_T *pDfuCtrl, const uint8_t *buf, uint32_t len)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+	uint32_t need, v;
+
+	if ((dec->flags & DFU_PKG_LZ) == 0) {
+		while ((len-- != 0) && (dec->status == DFU_STATUS_OK) && (dec->out_total != dec->out_size)) {
+			mwDFU_dec_emit(pDfuCtrl, *buf++);
+		}
+		return;
+	}
+	while ((dec->status == DFU_STATUS_OK) && (dec->out_total != dec->out_size)) {
+		if (dec->state == DFU_DEC_COPY) {
+			mwDFU_dec_emit(pDfuCtrl, dec->win[(dec->win_pos - dec->index) & dec->win_mask]);
+			if (--dec->count == 0) {
+				dec->state = DFU_DEC_TAG;
+			}
+			continue;
+		}
+		switch (dec->state) {
+		case DFU_DEC_TAG:
+			need = 1;
+			break;
+
+		case DFU_DEC_LITERAL:
+			need = 8;
+			break;
+
+		case DFU_DEC_INDEX:
+			need = dec->win_bits;
+			break;
+
+		default:	/* DFU_DEC_COUNT */
+			need = dec->len_bits;
+			break;
+		}
+		if (dec->nbits < need) {
+			if (len == 0) {
+				break;
+			}
+			dec->bits = (dec->bits << 8) | *buf++;
+			dec->nbits += 8;
+			len--;
+			continue;
+		}
+		dec->nbits -= need;
+		v = (dec->bits >> dec->nbits) & ((1 << need) - 1);
+		switch (dec->state) {
+		case DFU_DEC_TAG:
+			dec->state = v ? DFU_DEC_LITERAL : DFU_DEC_INDEX;
+			break;
+
+		case DFU_DEC_LITERAL:
+			mwDFU_dec_emit(pDfuCtrl, v);
+			dec->state = DFU_DEC_TAG;
+			break;
+
+		case DFU_DEC_INDEX:
+			dec->index = v + 1;
+			dec->state = DFU_DEC_COUNT;
+			break;
+
+		default:	/* DFU_DEC_COUNT */
+			dec->count = v + 1;
+			dec->state = DFU_DEC_COPY;
+			break;
+		}
+	}
+}
+
+/*
+ * Check the first block of a download for a package header and set up the
+ * decoder. Returns the DFU status.
+ */
+static uint8_t mwDFU_dec_start(USBD_DFU_CTRL_T *pDfuCtrl, const uint8_t *buf, uint32_t len)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+	uint32_t flags, win_bits, len_bits;
+
+	dec->out_size = 0;
+	if ((len < DFU_PKG_HDR_SIZE) || (mwDFU_get32(&buf[0]) != DFU_PKG_MAGIC)) {
+		/* plain image */
+		return DFU_STATUS_OK;
+	}
+	flags = buf[4];
+	win_bits = buf[5];
+	len_bits = buf[6];
+	if ((flags & ~(DFU_PKG_LZ | DFU_PKG_DELTA)) || (mwDFU_get32(&buf[8]) == 0)) {
+		return DFU_STATUS_errFILE;
+	}
+	if ((flags & DFU_PKG_LZ) &&
+		((win_bits < 4) || ((1UL << win_bits) > dec->win_mask + 1) ||
+		 (len_bits == 0) || (len_bits >= win_bits))) {
+		return DFU_STATUS_errFILE;
+	}
+	if ((flags & DFU_PKG_DELTA) && (dec->base == 0)) {
+		return DFU_STATUS_errTARGET;
+	}
+	dec->flags = flags;
+	dec->win_bits = win_bits;
+	dec->len_bits = len_bits;
+	dec->out_size = mwDFU_get32(&buf[8]);
+	dec->crc_expect = mwDFU_get32(&buf[12]);
+	dec->out_total = 0;
+	dec->out_len = 0;
+	dec->out_block = 0;
+	dec->crc = 0;
+	dec->bits = 0;
+	dec->nbits = 0;
+	dec->state = DFU_DEC_TAG;
+	dec->win_pos = 0;
+	dec->delta_state = DFU_DELTA_CTRL;
+	dec->ctrl_len = 0;
+	dec->base_pos = 0;
+	dec->status = DFU_STATUS_OK;
+	memset(dec->win, 0, dec->win_mask + 1);
+	return DFU_STATUS_OK;
+}
+
+/*
+ * Package download not complete
+ */
+static uint32_t mwDFU_dec_pending(USBD_DFU_CTRL_T *pDfuCtrl)
+{
+	return (pDfuCtrl->dec.out_size != 0) && (pDfuCtrl->dec.out_total != pDfuCtrl->dec.out_size);
+}
+
+/*
+ * Store a received block, through the decoder if it belongs to a package.
+ * Returns the DFU status.
+ */
+static uint8_t mwDFU_write(USBD_DFU_CTRL_T *pDfuCtrl, uint32_t block_num, uint8_t * *src, uint32_t len,
+						   uint32_t first, uint8_t *bwPollTimeout)
+{
+	USBD_DFU_DEC_T *dec = &pDfuCtrl->dec;
+	const uint8_t *buf = *src;
+	uint8_t status;
+
+	if ((dec->win != 0) && first) {
+		status = mwDFU_dec_start(pDfuCtrl, buf, len);
+		if (status != DFU_STATUS_OK) {
+			return status;
+		}
+		if (dec->out_size != 0) {
+			buf += DFU_PKG_HDR_SIZE;
+			len -= DFU_PKG_HDR_SIZE;
+		}
+	}
+	if (dec->out_size == 0) {
+		return pDfuCtrl->DFU_Write(block_num, src, len, bwPollTimeout);
+	}
+	dec->poll = 0;
+	mwDFU_dec_input(pDfuCtrl, buf, len);
+	if (dec->poll > 0xFFFFFF) {
+		dec->poll = 0xFFFFFF;
+	}
+	bwPollTimeout[0] = dec->poll & 0xFF;
+	bwPollTimeout[1] = (dec->poll >> 8) & 0xFF;
+	bwPollTimeout[2] = (dec->poll >> 16) & 0xFF;
+	return dec->status;
+}
 
 static ErrorCode_t mwDFU_handle_dnload(USBD_DFU_CTRL_T *pDfuCtrl, uint16_t block_num, uint16_t len)
 {
+	uint32_t i = pDfuCtrl->rx_idx;
+
+	if (pDfuCtrl->pipe_buf[0] != 0) {
+		/* hand the block to Program() and receive the next one into the other buffer */
+		pDfuCtrl->pipe_block[i] = block_num;
+		pDfuCtrl->pipe_len[i] = len;
+		pDfuCtrl->pipe_first[i] = pDfuCtrl->rx_first;
+		COMPILER_BARRIER();
+		pDfuCtrl->pipe_full[i] = 1;
+		pDfuCtrl->rx_idx = i ^ 1;
+		return LPC_OK;
+	}
 	/* Store Received Data into Flash or External Memory */
-	pDfuCtrl->dfu_status = pDfuCtrl->DFU_Write(block_num, &pDfuCtrl->xfr_buf, len,
-											   &pDfuCtrl->dfu_req_get_status.bwPollTimeout[0]);
+	pDfuCtrl->dfu_status = mwDFU_write(pDfuCtrl, block_num, &pDfuCtrl->xfr_buf, len, pDfuCtrl->rx_first,
+									   &pDfuCtrl->dfu_req_get_status.bwPollTimeout[0]);
 	if (pDfuCtrl->dfu_status != DFU_STATUS_OK) {
 		pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
 		return ERR_USBD_STALL;	// RET_STALL;
@@ -42,11 +344,58 @@ static ErrorCode_t mwDFU_handle_dnload(USBD_DFU_CTRL_T *pDfuCtrl, uint16_t block
 	return LPC_OK;	// RET_ZLP;
 }
 
+/*
+ * Start a new upload
+ */
+static void mwDFU_upload_start(USBD_DFU_CTRL_T *pDfuCtrl)
+{
+	pDfuCtrl->up_offset = 0;
+	pDfuCtrl->up_crc = 0;
+	pDfuCtrl->up_eof = 0;
+	pDfuCtrl->up_sfx_sent = 0;
+}
+
+/*
+ * Add the DFU file suffix after the last image bytes of an upload. The block
+ * is put together in the transfer buffer. Returns the block length.
+ */
+static uint32_t mwDFU_upload_suffix(USBD_DFU_CTRL_T *pDfuCtrl, uint8_t *xfr_buf, uint8_t * *buff,
+									uint32_t copy_len, uint32_t len)
+{
+	USB_DEVICE_DESCRIPTOR *pDevDesc = (USB_DEVICE_DESCRIPTOR *) pDfuCtrl->pUsbCtrl->device_desc;
+	DFU_SUFFIX_T *pSuffix = (DFU_SUFFIX_T *) pDfuCtrl->up_sfx;
+	uint32_t n;
+
+	if (pDfuCtrl->up_eof == 0) {
+		pSuffix->bcdDevice = pDevDesc->bcdDevice;
+		pSuffix->idProduct = pDevDesc->idProduct;
+		pSuffix->idVendor = pDevDesc->idVendor;
+		pSuffix->bcdDFU = 0x0100;
+		pSuffix->ucDfuSignature[0] = 'U';
+		pSuffix->ucDfuSignature[1] = 'F';
+		pSuffix->ucDfuSignature[2] = 'D';
+		pSuffix->bLength = DFU_SUFFIX_SIZE;
+		pSuffix->dwCRC = ~mwUSB_Crc32(pDfuCtrl->up_crc, pDfuCtrl->up_sfx, DFU_SUFFIX_SIZE - 4);
+		pDfuCtrl->up_eof = 1;
+	}
+	if ((copy_len != 0) && (*buff != xfr_buf)) {
+		memcpy(xfr_buf, *buff, copy_len);
+	}
+	n = DFU_SUFFIX_SIZE - pDfuCtrl->up_sfx_sent;
+	if (n > len - copy_len) {
+		n = len - copy_len;
+	}
+	memcpy(xfr_buf + copy_len, &pDfuCtrl->up_sfx[pDfuCtrl->up_sfx_sent], n);
+	pDfuCtrl->up_sfx_sent += n;
+	*buff = xfr_buf;
+	return copy_len + n;
+}
+
 static ErrorCode_t mwDFU_handle_upload(USBD_DFU_CTRL_T *pDfuCtrl, uint16_t block_num, uint16_t len)
 {
 	USB_CORE_CTRL_T *pCtrl = pDfuCtrl->pUsbCtrl;
 	int32_t copy_len;
-	uint8_t *buff;
+	uint8_t *buff, *xfr_buf;
 
 	if (len > pDfuCtrl->dfu_desc->wTransferSize) {
 		/* Too big. Not that we'd really care, but it's a
@@ -56,8 +405,44 @@ static ErrorCode_t mwDFU_handle_upload(USBD_DFU_CTRL_T *pDfuCtrl, uint16_t block
 		return ERR_USBD_STALL;	// RET_STALL;
 	}
 	buff = pDfuCtrl->xfr_buf;
-	/* Fetch Data from Flash or External Memory */
-	copy_len = pDfuCtrl->DFU_Read(block_num, &buff, len);
+	if (pDfuCtrl->pipe_buf[0] != 0) {
+		/* the last block received may still wait to be written */
+		if (pDfuCtrl->pipe_full[pDfuCtrl->rx_idx]) {
+			pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
+			pDfuCtrl->dfu_status = DFU_STATUS_errSTALLEDPKT;
+			return ERR_USBD_STALL;
+		}
+		buff = pDfuCtrl->pipe_buf[pDfuCtrl->rx_idx];
+	}
+	xfr_buf = buff;
+	if (pDfuCtrl->up_eof) {
+		/* only the rest of the suffix is left */
+		copy_len = 0;
+	}
+	else if (pDfuCtrl->up_base != 0) {
+		/* memory mapped image, the data stage reads it in place */
+		copy_len = pDfuCtrl->up_size - pDfuCtrl->up_offset;
+		if (copy_len > len) {
+			copy_len = len;
+		}
+		buff = (uint8_t *) &pDfuCtrl->up_base[pDfuCtrl->up_offset];
+	}
+	else {
+		/* Fetch Data from Flash or External Memory */
+		copy_len = pDfuCtrl->DFU_Read(block_num, &buff, len);
+		if ((copy_len != 0) && (copy_len <= DFU_STATUS_errSTALLEDPKT)) {
+			pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
+			pDfuCtrl->dfu_status = (uint8_t) (copy_len & 0xFF);
+			return ERR_USBD_STALL;	// RET_STALL;
+		}
+	}
+	pDfuCtrl->up_offset += copy_len;
+	if (pDfuCtrl->up_suffix) {
+		pDfuCtrl->up_crc = mwUSB_Crc32(pDfuCtrl->up_crc, buff, copy_len);
+		if (copy_len < len) {
+			copy_len = mwDFU_upload_suffix(pDfuCtrl, xfr_buf, &buff, copy_len, len);
+		}
+	}
 	/* Send EOF file frame as short data length packet
 	 * which is less than maximum DFU transfer size
 	 */
@@ -66,11 +451,6 @@ static ErrorCode_t mwDFU_handle_upload(USBD_DFU_CTRL_T *pDfuCtrl, uint16_t block
 		pDfuCtrl->dfu_state = DFU_STATE_dfuIDLE;
 		return LPC_OK;	// RET_ZLP;
 	}
-	else if ( copy_len <= DFU_STATUS_errSTALLEDPKT) {
-		pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
-		pDfuCtrl->dfu_status = (uint8_t) (copy_len & 0xFF);
-		return ERR_USBD_STALL;	// RET_STALL;
-	}
 
 	pCtrl->EP0Data.pData = buff;
 	pCtrl->EP0Data.Count = copy_len;
@@ -85,6 +465,97 @@ static ErrorCode_t mwDFU_handle_upload(USBD_DFU_CTRL_T *pDfuCtrl, uint16_t block
 	return LPC_OK;
 }
 
+/*
+ * Queue the upload data stage in transfers of up to DFU_MAX_XFER_SIZE, the
+ * controller splits them into packets
+ */
+static void mwDFU_upload_data(USBD_DFU_CTRL_T *pDfuCtrl)
+{
+	USB_CORE_CTRL_T *pCtrl = pDfuCtrl->pUsbCtrl;
+	uint32_t cnt = pCtrl->EP0Data.Count;
+
+	if (cnt > DFU_MAX_XFER_SIZE) {
+		cnt = DFU_MAX_XFER_SIZE;
+	}
+	cnt = pCtrl->hw_api->WriteEP(pCtrl, 0x80, pCtrl->EP0Data.pData, cnt);
+	pCtrl->EP0Data.pData += cnt;
+	pCtrl->EP0Data.Count -= cnt;
+	pDfuCtrl->up_xfer = 1;
+}
+
+/*
+ * Time until the block in the oldest buffer is written, in ms
+ */
+static uint32_t mwDFU_pipe_wait(USBD_DFU_CTRL_T *pDfuCtrl)
+{
+	uint32_t wait = pDfuCtrl->prog_time;
+	uint32_t elapsed;
+
+	if (pDfuCtrl->prog_busy) {
+		elapsed = (pDfuCtrl->pUsbCtrl->hw_api->GetFrameNumber(pDfuCtrl->pUsbCtrl) - pDfuCtrl->prog_start) & 0x7FF;
+		wait = (elapsed < wait) ? (wait - elapsed) : 0;
+	}
+	return (wait != 0) ? wait : 1;
+}
+
+/*
+ * Returns the DFU Protocol Status of a pipelined download. Returns the state
+ * to report, or DFU_STATE_dfuINVALID to continue as without pipelining.
+ */
+static uint8_t mwDFU_pipe_getstatus(USBD_DFU_CTRL_T *pDfuCtrl)
+{
+	uint8_t *ptr = &pDfuCtrl->dfu_req_get_status.bwPollTimeout[0];
+	uint8_t state = DFU_STATE_dfuINVALID;
+	uint32_t tout = 0;
+
+	switch (pDfuCtrl->dfu_state) {
+	case DFU_STATE_dfuDNLOAD_SYNC:
+	case DFU_STATE_dfuDNBUSY:
+		if (pDfuCtrl->pipe_full[pDfuCtrl->rx_idx]) {
+			/* no buffer for the next block until the oldest one is written */
+			pDfuCtrl->dfu_state = DFU_STATE_dfuDNBUSY;
+			tout = mwDFU_pipe_wait(pDfuCtrl);
+		}
+		else {
+			pDfuCtrl->dfu_state = DFU_STATE_dfuDNLOAD_IDLE;
+		}
+		state = pDfuCtrl->dfu_state;
+		break;
+
+	case DFU_STATE_dfuMANIFEST_SYNC:
+		if (pDfuCtrl->pipe_full[0] || pDfuCtrl->pipe_full[1]) {
+			/* manifestation waits for the blocks still to be written */
+			tout = mwDFU_pipe_wait(pDfuCtrl);
+			if (pDfuCtrl->pipe_full[0] && pDfuCtrl->pipe_full[1]) {
+				tout += pDfuCtrl->prog_time;
+			}
+			state = DFU_STATE_dfuMANIFEST;
+		}
+		else if ((pDfuCtrl->prog_status != DFU_STATUS_OK) || mwDFU_dec_pending(pDfuCtrl)) {
+			/* the last block failed, or the package ended early */
+			if (pDfuCtrl->prog_status == DFU_STATUS_OK) {
+				pDfuCtrl->prog_status = DFU_STATUS_errNOTDONE;
+			}
+			state = DFU_STATE_dfuMANIFEST;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if ((state != DFU_STATE_dfuINVALID) && (pDfuCtrl->prog_status != DFU_STATUS_OK)) {
+		pDfuCtrl->dfu_status = pDfuCtrl->prog_status;
+		pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
+		state = DFU_STATE_dfuERROR;
+		tout = 0;
+	}
+	ptr[0] = tout & 0xFF;
+	ptr[1] = (tout >> 8) & 0xFF;
+	ptr[2] = (tout >> 16) & 0xFF;
+	return state;
+}
+
 /*
  * Returns the DFU Protocol Status
  */
@@ -94,6 +565,16 @@ static void mwDFU_handle_getstatus(USBD_DFU_CTRL_T *pDfuCtrl)
 	USB_CORE_CTRL_T *pCtrl = pDfuCtrl->pUsbCtrl;
 
 	pDfuCtrl->dfu_req_get_status.iString = 0;
+	if (pDfuCtrl->pipe_buf[0] != 0) {
+		statebc = mwDFU_pipe_getstatus(pDfuCtrl);
+		if (statebc != DFU_STATE_dfuINVALID) {
+			pDfuCtrl->dfu_req_get_status.bStatus = pDfuCtrl->dfu_status;
+			pDfuCtrl->dfu_req_get_status.bState = statebc;
+			pCtrl->EP0Data.pData = (uint8_t *) &pDfuCtrl->dfu_req_get_status;
+			pCtrl->EP0Data.Count = DFU_GET_STATUS_SIZE;
+			return;
+		}
+	}
 	switch (pDfuCtrl->dfu_state) {
 	case DFU_STATE_dfuDNLOAD_SYNC:
 	/* ***TBD *** block in progress case ???***/
@@ -224,6 +705,7 @@ ErrorCode_t mwDFU_handle_setup(USBD_DFU_CTRL_T *pDfuCtrl)
 		if (pDfuCtrl->dfu_state == DFU_STATE_dfuERROR) {
 			pDfuCtrl->dfu_state = DFU_STATE_dfuIDLE;
 			pDfuCtrl->dfu_status = DFU_STATUS_OK;
+			pDfuCtrl->prog_status = DFU_STATUS_OK;
 			ret = LPC_OK;
 		}
 		else {
@@ -268,14 +750,40 @@ ErrorCode_t mwDFU_handle_setup(USBD_DFU_CTRL_T *pDfuCtrl)
 			}
 			else {
 				/* end of transfer indicator */
+				if ((len == 0) && (pDfuCtrl->pipe_buf[0] == 0) && mwDFU_dec_pending(pDfuCtrl)) {
+					/* package ended before the image was complete */
+					pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
+					pDfuCtrl->dfu_status = DFU_STATUS_errNOTDONE;
+					ret = ERR_USBD_STALL;
+					break;
+				}
 				if (len == 0) {
 					pDfuCtrl->dfu_state = DFU_STATE_dfuMANIFEST_SYNC;
 					mwUSB_StatusInStage(pDfuCtrl->pUsbCtrl);// RET_ZLP;
 					return LPC_OK;
 				}
+				if (pDfuCtrl->pipe_buf[0] != 0) {
+					if (pDfuCtrl->pipe_full[pDfuCtrl->rx_idx] ||
+						(pDfuCtrl->prog_status != DFU_STATUS_OK)) {
+						/* host did not wait for dfuDNLOAD_IDLE, or a write failed */
+						pDfuCtrl->dfu_state = DFU_STATE_dfuERROR;
+						pDfuCtrl->dfu_status = (pDfuCtrl->prog_status != DFU_STATUS_OK) ?
+											   pDfuCtrl->prog_status : DFU_STATUS_errSTALLEDPKT;
+						ret = ERR_USBD_STALL;
+						break;
+					}
+					pDfuCtrl->xfr_buf = pDfuCtrl->pipe_buf[pDfuCtrl->rx_idx];
+				}
+				else if ((pDfuCtrl->dfu_state == DFU_STATE_dfuIDLE) || (pDfuCtrl->dec.out_size == 0)) {
+					pDfuCtrl->DFU_Write(pDfuCtrl->pUsbCtrl->SetupPacket.wValue.W,
+										&pDfuCtrl->xfr_buf, 0, &pDfuCtrl->dfu_req_get_status.bwPollTimeout[0]);
+				}
+				else {
+					/* package data goes to the decoder, not to a zero-copy buffer */
+					pDfuCtrl->xfr_buf = pDfuCtrl->dec.rx_buf;
+				}
+				pDfuCtrl->rx_first = (pDfuCtrl->dfu_state == DFU_STATE_dfuIDLE);
 				pDfuCtrl->dfu_state = DFU_STATE_dfuDNLOAD_SYNC;
-				pDfuCtrl->DFU_Write(pDfuCtrl->pUsbCtrl->SetupPacket.wValue.W,
-									&pDfuCtrl->xfr_buf, 0, &pDfuCtrl->dfu_req_get_status.bwPollTimeout[0]);
 				/* setup transfer buffer */
 				pDfuCtrl->pUsbCtrl->EP0Data.pData = pDfuCtrl->xfr_buf;
 				ret = LPC_OK;
@@ -292,6 +800,7 @@ ErrorCode_t mwDFU_handle_setup(USBD_DFU_CTRL_T *pDfuCtrl)
 		switch (pDfuCtrl->dfu_state) {
 		case DFU_STATE_dfuIDLE:
 			pDfuCtrl->dfu_state = DFU_STATE_dfuUPLOAD_IDLE;
+			mwDFU_upload_start(pDfuCtrl);
 
 		case DFU_STATE_dfuUPLOAD_IDLE:
 			/* state transition if less data then requested */
@@ -323,7 +832,39 @@ void mwDFU_reset_event(USBD_DFU_CTRL_T *pDfuCtrl)
 		pDfuCtrl->dfu_state = DFU_STATE_dfuIDLE;
 	}
 	pDfuCtrl->dfu_status = DFU_STATUS_OK;
+	pDfuCtrl->prog_status = DFU_STATUS_OK;
 	pDfuCtrl->download_done = 0;
+	pDfuCtrl->up_xfer = 0;
+}
+
+/*
+ * Write the oldest received block of a pipelined download, main loop
+ */
+void mwDFU_Program(USBD_HANDLE_T hDfu)
+{
+	USBD_DFU_CTRL_T *pDfuCtrl = (USBD_DFU_CTRL_T *) hDfu;
+	USB_CORE_CTRL_T *pCtrl = pDfuCtrl->pUsbCtrl;
+	uint32_t i = pDfuCtrl->prog_idx;
+	uint8_t poll[3];
+	uint8_t *buff;
+	uint8_t status;
+
+	if ((pDfuCtrl->pipe_buf[0] == 0) || (pDfuCtrl->pipe_full[i] == 0)) {
+		return;
+	}
+	buff = pDfuCtrl->pipe_buf[i];
+	pDfuCtrl->prog_start = pCtrl->hw_api->GetFrameNumber(pCtrl);
+	pDfuCtrl->prog_busy = 1;
+	status = mwDFU_write(pDfuCtrl, pDfuCtrl->pipe_block[i], &buff, pDfuCtrl->pipe_len[i], pDfuCtrl->pipe_first[i], poll);
+	/* whole frames elapsed, plus the one the call started in */
+	pDfuCtrl->prog_time = ((pCtrl->hw_api->GetFrameNumber(pCtrl) - pDfuCtrl->prog_start) & 0x7FF) + 1;
+	if ((status != DFU_STATUS_OK) && (pDfuCtrl->prog_status == DFU_STATUS_OK)) {
+		pDfuCtrl->prog_status = status;
+	}
+	pDfuCtrl->prog_busy = 0;
+	pDfuCtrl->prog_idx = i ^ 1;
+	COMPILER_BARRIER();
+	pDfuCtrl->pipe_full[i] = 0;
 }
 
 ErrorCode_t mwDFU_Ep0_Hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
@@ -339,15 +880,24 @@ ErrorCode_t mwDFU_Ep0_Hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 
 	switch (event) {
 	case USB_EVT_SETUP:
+		pDfuCtrl->up_xfer = 0;
 		if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS) &&
 			(pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE)) {
 			/* handle setup packets */
 			ret = mwDFU_handle_setup(pDfuCtrl);
 			if (ret == LPC_OK) {
-				if (( pCtrl->SetupPacket.bRequest == USB_REQ_DFU_GETSTATUS) ||
-					( pCtrl->SetupPacket.bRequest == USB_REQ_DFU_GETSTATE) ||
-					( pCtrl->SetupPacket.bRequest == USB_REQ_DFU_UPLOAD) ) {
-					/* send status/state/upload data to host*/
+				if ( pCtrl->SetupPacket.bRequest == USB_REQ_DFU_UPLOAD) {
+					/* send upload data to host, a zero length packet ends
+					   a short block which is a multiple of the packet size */
+					pDfuCtrl->up_zlp = (pCtrl->EP0Data.Count != 0) &&
+									   (pCtrl->EP0Data.Count < pCtrl->SetupPacket.wLength) &&
+									   ((pCtrl->EP0Data.Count %
+										 ((USB_DEVICE_DESCRIPTOR *) (pCtrl->device_desc))->bMaxPacketSize0) == 0);
+					mwDFU_upload_data(pDfuCtrl);
+				}
+				else if (( pCtrl->SetupPacket.bRequest == USB_REQ_DFU_GETSTATUS) ||
+						 ( pCtrl->SetupPacket.bRequest == USB_REQ_DFU_GETSTATE) ) {
+					/* send status/state data to host*/
 					mwUSB_DataInStage(pDfuCtrl->pUsbCtrl);
 					/* tell user if download finished */
 					if (pDfuCtrl->download_done) {
@@ -392,6 +942,24 @@ ErrorCode_t mwDFU_Ep0_Hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 		}
 		break;
 
+	case USB_EVT_IN:
+		if (pDfuCtrl->up_xfer && (pCtrl->SetupPacket.bRequest == USB_REQ_DFU_UPLOAD) &&
+			(pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS)) {
+			/* upload data stage */
+			if (pCtrl->EP0Data.Count != 0) {
+				mwDFU_upload_data(pDfuCtrl);
+			}
+			else if (pDfuCtrl->up_zlp) {
+				pDfuCtrl->up_zlp = 0;
+				pCtrl->hw_api->WriteEP(pCtrl, 0x80, pCtrl->EP0Data.pData, 0);
+			}
+			else {
+				pDfuCtrl->up_xfer = 0;
+			}
+			ret = LPC_OK;
+		}
+		break;
+
 	case USB_EVT_RESET:
 		mwDFU_reset_event(pDfuCtrl);
 		break;
@@ -419,6 +987,13 @@ uint32_t mwDFU_GetMemSize(USBD_DFU_INIT_PARAM_T *param)
 	/* calculate required length */
 	req_len += sizeof(USBD_DFU_CTRL_T);	/* memory for DFU controller structure */
 	req_len += param->wTransferSize;/* for transfer buffer */
+	if (param->pipelined) {
+		req_len += param->wTransferSize;/* second buffer */
+	}
+	if (param->window_size) {
+		req_len += param->window_size;	/* package decoder window */
+		req_len += param->wTransferSize;/* and output buffer */
+	}
 	req_len += 4;	/* for alignment overhead */
 	req_len &= ~0x3;
 
@@ -437,10 +1012,16 @@ ErrorCode_t mwDFU_init(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_
 	ErrorCode_t ret = LPC_OK;
 
 	/* check for memory alignment */
-	if ((param->mem_base &  0x3) &&
-		(param->mem_size < sizeof(USBD_DFU_CTRL_T))) {
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwDFU_GetMemSize(param))) {
 		return ERR_USBD_BAD_MEM_BUF;
 	}
+	/* check the package decoder window */
+	if ((param->window_size != 0) &&
+		((param->window_size & (param->window_size - 1)) ||
+		 (param->window_size < DFU_PKG_WIN_MIN) || (param->window_size > DFU_PKG_WIN_MAX))) {
+		return ERR_API_INVALID_PARAM2;
+	}
 
 	/* allocate memory for the control data structure */
 	pDfuCtrl = (USBD_DFU_CTRL_T *) param->mem_base;
@@ -459,6 +1040,25 @@ ErrorCode_t mwDFU_init(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_
 	pDfuCtrl->xfr_buf = (uint8_t *) param->mem_base;
 	param->mem_base += param->wTransferSize;
 	param->mem_size -= param->wTransferSize;
+	if (param->pipelined) {
+		pDfuCtrl->pipe_buf[0] = pDfuCtrl->xfr_buf;
+		pDfuCtrl->pipe_buf[1] = (uint8_t *) param->mem_base;
+		param->mem_base += param->wTransferSize;
+		param->mem_size -= param->wTransferSize;
+	}
+	if (param->window_size) {
+		pDfuCtrl->dec.win = (uint8_t *) param->mem_base;
+		pDfuCtrl->dec.win_mask = param->window_size - 1;
+		param->mem_base += param->window_size;
+		param->mem_size -= param->window_size;
+		pDfuCtrl->dec.out_buf = (uint8_t *) param->mem_base;
+		pDfuCtrl->dec.out_max = param->wTransferSize;
+		param->mem_base += param->wTransferSize;
+		param->mem_size -= param->wTransferSize;
+		pDfuCtrl->dec.rx_buf = pDfuCtrl->xfr_buf;
+		pDfuCtrl->dec.base = param->base_image;
+		pDfuCtrl->dec.base_size = param->base_size;
+	}
 
 	/* user defined functions */
 	if ((param->DFU_Write == 0) ||
@@ -472,6 +1072,9 @@ ErrorCode_t mwDFU_init(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_
 	pDfuCtrl->DFU_Done = param->DFU_Done;
 	pDfuCtrl->DFU_Detach = param->DFU_Detach;
 	pDfuCtrl->DFU_GetStatus = param->DFU_GetStatus;
+	pDfuCtrl->up_base = param->upload_base;
+	pDfuCtrl->up_size = param->upload_size;
+	pDfuCtrl->up_suffix = (param->upload_suffix != 0);
 
 	next_desc_addr = (uint32_t) param->intf_desc;
 	/* parse the interface descriptor */
@@ -505,7 +1108,8 @@ ErrorCode_t mwDFU_init(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_
 	/* store DFU descriptor pointer */
 	pDfuCtrl->dfu_desc = (USB_DFU_FUNC_DESCRIPTOR *) next_desc_addr;
 
-	/* register ep0 handler */
+	/* register ep0 handler, not bound to the interface number as that becomes 0
+	   after a detach */
 	/* check if user wants his own handler */
 	if (param->DFU_Ep0_Hdlr == 0) {
 		ret = mwUSB_RegisterClassHandler(hUsb, mwDFU_Ep0_Hdlr, pDfuCtrl);
@@ -519,6 +1123,9 @@ ErrorCode_t mwDFU_init(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_
 	pDfuCtrl->dfu_state = (init_state == DFU_STATE_dfuIDLE) ? DFU_STATE_dfuIDLE : DFU_STATE_appIDLE;
 	pDfuCtrl->dfu_status = DFU_STATUS_OK;
 	pDfuCtrl->download_done = 0;
+	pDfuCtrl->prog_status = DFU_STATUS_OK;
+	/* return the handle */
+	param->hDfu = (USBD_HANDLE_T) pDfuCtrl;
 
 	return ret;
 }
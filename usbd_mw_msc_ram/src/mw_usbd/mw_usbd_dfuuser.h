@@ -47,6 +47,48 @@
  *  Devices using the USB DFU Class.
  */
 
+/** \brief DFU package format.
+ *  \ingroup USBD_DFU
+ *
+ *  \details When USBD_DFU_INIT_PARAM::window_size is set, a download whose
+ *  first block starts with the \ref DFU_PKG_MAGIC header is a package, which
+ *  the stack unpacks while it is received. Any other download is written as
+ *  before. All multi-byte fields are little endian.
+ *
+ *  Header, \ref DFU_PKG_HDR_SIZE bytes:
+ *  - 0: \ref DFU_PKG_MAGIC, the characters "DFUP".
+ *  - 4: flags, \ref DFU_PKG_LZ and/or \ref DFU_PKG_DELTA.
+ *  - 5: log2 of the LZ window, 4 to 15, at most log2 of \em window_size.
+ *  - 6: number of LZ length bits, 1 to the window bits less one.
+ *  - 7: reserved, 0.
+ *  - 8: size of the decoded image in bytes, not 0.
+ *  - 12: CRC-32 of the decoded image, see mwUSB_Crc32().
+ *
+ *  With \ref DFU_PKG_LZ the rest of the download is an LZSS bit stream in
+ *  the style of heatshrink, read most significant bit first: a 1 bit is
+ *  followed by an 8 bit literal; a 0 bit by the distance back less one in
+ *  window bits, then the length less one in length bits. The window starts
+ *  out zero filled.
+ *
+ *  With \ref DFU_PKG_DELTA the (decompressed) stream is a list of bsdiff
+ *  style records against USBD_DFU_INIT_PARAM::base_image. Each record is a
+ *  12 byte control block of diff length, extra length and a signed seek,
+ *  followed by diff length bytes which are added to the base image bytes
+ *  starting at the current base position, and extra length bytes which are
+ *  copied. The base position starts at 0, advances with each diff byte and
+ *  moves by the seek after the extra bytes. Base bytes outside the base
+ *  image count as 0. Anything after the end of the image is ignored.
+ */
+#define DFU_PKG_MAGIC		0x50554644	/**< "DFUP" */
+#define DFU_PKG_HDR_SIZE	16			/**< Package header size */
+#define DFU_PKG_LZ			0x01		/**< Payload is LZSS compressed */
+#define DFU_PKG_DELTA		0x02		/**< Payload is a delta to the base image */
+#define DFU_PKG_WIN_MIN		256			/**< Smallest USBD_DFU_INIT_PARAM::window_size */
+#define DFU_PKG_WIN_MAX		32768		/**< Largest USBD_DFU_INIT_PARAM::window_size */
+
+/** Uploads are sent in transfers of up to this size, not a packet at a time */
+#define DFU_MAX_XFER_SIZE	(16 * 1024)
+
 /** \brief USB descriptors data structure.
  *  \ingroup USBD_DFU
  *
@@ -198,6 +240,62 @@ typedef struct USBD_DFU_INIT_PARAM {
 	 */
 	uint32_t (*DFU_GetStatus)(uint32_t *timeout, int32_t last);
 
+	/** Non-zero selects the pipelined download. The stack then allocates two
+	 *  transfer buffers and receives the next block into one while the block
+	 *  in the other is written. DFU_Write() is no longer called from the USB
+	 *  interrupt but from USBD_DFU_API::Program(), in the order the blocks were
+	 *  received, and the zero-copy call with \em length 0 is not made.
+	 *  DFU_GETSTATUS reports dfuDNBUSY only while both buffers are in use, with
+	 *  a \em bwPollTimeout worked out from how long the last DFU_Write() took;
+	 *  the value DFU_Write() returns in \em bwPollTimeout is not used.
+	 */
+	uint32_t pipelined;
+
+	USBD_HANDLE_T hDfu;	/**< Set by USBD_DFU_API::init() to the handle to pass
+						   to USBD_DFU_API::Program().
+						 */
+
+	/** LZ window size in bytes, a power of 2 from \ref DFU_PKG_WIN_MIN to
+	 *  \ref DFU_PKG_WIN_MAX, or 0 to write every download as received. When
+	 *  set, a download in the \ref DFU_PKG_MAGIC package format is decoded
+	 *  block by block with a fixed window_size plus \em wTransferSize bytes
+	 *  of memory. DFU_Write() then gets the decoded image in \em wTransferSize
+	 *  blocks numbered from 0, the last one short. Without \em pipelined the
+	 *  zero-copy call with \em length 0 is made for the first block only. One
+	 *  received block can decode to several DFU_Write() calls; without
+	 *  \em pipelined these run from the USB interrupt and their
+	 *  \em bwPollTimeout values are added up. A download that ends before the
+	 *  image is complete fails with DFU_STATUS_errNOTDONE, and an image which
+	 *  does not match the package CRC with DFU_STATUS_errVERIFY, in both cases
+	 *  after its blocks were written. DFU_Done() is only called on success.
+	 */
+	uint32_t window_size;
+
+	/** Current image which delta packages apply to, where the CPU can read
+	 *  it, for example internal flash. It must not overlap the blocks that
+	 *  DFU_Write() stores the new image to. 0 refuses delta packages with
+	 *  DFU_STATUS_errTARGET.
+	 */
+	const uint8_t *base_image;
+	uint32_t base_size;	/**< Size of \em base_image in bytes. */
+
+	/** Memory mapped image which uploads are read from, for example the
+	 *  internal flash at 0x1A000000 on LPC43xx. The data stage of each
+	 *  DFU_UPLOAD then points straight into this region and DFU_Read() is not
+	 *  called. The region must be readable by the USB controller DMA. 0 reads
+	 *  uploads through DFU_Read().
+	 */
+	const uint8_t *upload_base;
+	uint32_t upload_size;	/**< Size of \em upload_base in bytes. */
+
+	/** Non-zero appends a DFU file suffix (\ref DFU_SUFFIX_T) to uploads,
+	 *  with the vendor, product and release of the device descriptor and the
+	 *  CRC of the data, worked out as the blocks are sent. The host can check
+	 *  the uploaded file, for example with dfu-suffix -c, without reading the
+	 *  image a second time.
+	 */
+	uint32_t upload_suffix;
+
 } USBD_DFU_INIT_PARAM_T;
 
 /** \brief DFU class API functions structure.
@@ -230,7 +328,8 @@ typedef struct USBD_DFU_API {
 	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
 	 *          \retval LPC_OK On success
 	 *          \retval ERR_USBD_BAD_MEM_BUF  Memory buffer passed is not 4-byte aligned or smaller than required.
-	 *          \retval ERR_API_INVALID_PARAM2 Either DFU_Write() or DFU_Done() or DFU_Read() call-backs are not defined.
+	 *          \retval ERR_API_INVALID_PARAM2 Either DFU_Write() or DFU_Done() or DFU_Read() call-backs are not defined,
+	 *            or \em window_size is not valid.
 	 *          \retval ERR_USBD_BAD_DESC
 	 *            - USB_DFU_DESCRIPTOR_TYPE is not defined immediately after
 	 *              interface descriptor.
@@ -242,6 +341,20 @@ typedef struct USBD_DFU_API {
 	 */
 	ErrorCode_t (*init)(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_t init_state);
 
+	/** \fn void Program(USBD_HANDLE_T hDfu)
+	 *  Function to write the next received block with the pipelined download.
+	 *
+	 *  This function is called by the application from its main loop when
+	 *  USBD_DFU_INIT_PARAM::pipelined is set. It calls DFU_Write() for the
+	 *  oldest block received and not yet written, if any, and times the call.
+	 *  A DFU_Write() error is reported to the host with the next DFU_GETSTATUS.
+	 *  Blocks received before a DFU_ABORT or bus reset are still written.
+	 *
+	 *  \param[in] hDfu Handle to DFU function driver.
+	 *  \return Nothing.
+	 */
+	void (*Program)(USBD_HANDLE_T hDfu);
+
 } USBD_DFU_API_T;
 
 /*-----------------------------------------------------------------------------
@@ -249,6 +362,41 @@ typedef struct USBD_DFU_API {
  *-----------------------------------------------------------------------------*/
 /** @cond  ADVANCED_API */
 
+/* package decoder, see DFU_PKG_MAGIC */
+typedef struct _USBD_DFU_DEC_T {
+	uint8_t *win;					/* LZ window, 0 when decoding is disabled */
+	uint8_t *out_buf;				/* decoded data for DFU_Write() */
+	uint8_t *rx_buf;				/* transfer buffer before any zero-copy swap */
+	const uint8_t *base;			/* base image for delta packages */
+	uint32_t base_size;
+	uint32_t win_mask;
+	uint32_t out_size;				/* image size from the package header */
+	uint32_t out_total;				/* image bytes decoded so far */
+	uint32_t crc;					/* CRC-32 of the image written so far */
+	uint32_t crc_expect;			/* CRC-32 from the package header */
+	uint32_t poll;					/* bwPollTimeout sum for the current block */
+	uint32_t bits;					/* LZ bit accumulator */
+	uint32_t diff_left;				/* delta bytes left to add to the base */
+	uint32_t extra_left;			/* delta bytes left to copy */
+	int32_t seek;					/* base position change after the extra bytes */
+	int32_t base_pos;				/* current base position */
+	uint16_t win_pos;
+	uint16_t index;					/* back reference distance */
+	uint16_t count;					/* back reference bytes left */
+	uint16_t out_len;				/* bytes in out_buf */
+	uint16_t out_max;				/* wTransferSize */
+	uint16_t out_block;				/* next DFU_Write() block number */
+	uint8_t flags;					/* DFU_PKG_ flags, 0 for a plain download */
+	uint8_t win_bits;
+	uint8_t len_bits;
+	uint8_t nbits;					/* bits in the accumulator */
+	uint8_t state;					/* LZ decoder state */
+	uint8_t delta_state;
+	uint8_t ctrl_len;
+	uint8_t status;					/* first error */
+	uint8_t ctrl[12];				/* delta control block */
+} USBD_DFU_DEC_T;
+
 typedef struct _USBD_DFU_CTRL_T {
 	/*ALIGNED(4)*/ DFU_STATUS_T dfu_req_get_status;
 	uint16_t pad;
@@ -277,6 +425,34 @@ typedef struct _USBD_DFU_CTRL_T {
 	/* Callback called after USB_REQ_DFU_GETSTATUS */
 	uint32_t (*DFU_GetStatus)(uint32_t *timeout, int32_t last);
 
+	/* pipelined download, blocks are written in the order received */
+	uint8_t *pipe_buf[2];			/* transfer buffers, 0 when not pipelined */
+	uint32_t pipe_block[2];			/* block number in each buffer */
+	uint16_t pipe_len[2];			/* block length in each buffer */
+	volatile uint8_t pipe_full[2];	/* set by the interrupt, cleared by Program() */
+	uint8_t rx_idx;					/* buffer the next block is received into */
+	uint8_t prog_idx;				/* buffer Program() writes next */
+	volatile uint8_t prog_status;	/* first DFU_Write() error */
+	volatile uint8_t prog_busy;		/* DFU_Write() running */
+	volatile uint16_t prog_start;	/* frame number DFU_Write() was called in */
+	volatile uint16_t prog_time;	/* ms the last DFU_Write() took */
+	uint8_t pipe_first[2];			/* block starts a download */
+	uint8_t rx_first;				/* next block received starts a download */
+
+	/* upload */
+	const uint8_t *up_base;			/* memory mapped image, 0 to use DFU_Read() */
+	uint32_t up_size;
+	uint32_t up_offset;				/* image bytes sent */
+	uint32_t up_crc;				/* CRC-32 of the image bytes sent */
+	uint8_t up_suffix;				/* append a DFU file suffix */
+	uint8_t up_eof;					/* end of the image reached, suffix built */
+	uint8_t up_sfx_sent;			/* suffix bytes sent */
+	uint8_t up_xfer;				/* upload data stage queued by the DFU driver */
+	uint8_t up_zlp;					/* data stage ends with a zero length packet */
+	uint8_t up_sfx[DFU_SUFFIX_SIZE];
+
+	USBD_DFU_DEC_T dec;
+
 } USBD_DFU_CTRL_T;
 
 /** @cond  DIRECT_API */
@@ -284,6 +460,8 @@ uint32_t mwDFU_GetMemSize(USBD_DFU_INIT_PARAM_T *param);
 
 extern ErrorCode_t mwDFU_init(USBD_HANDLE_T hUsb, USBD_DFU_INIT_PARAM_T *param, uint32_t init_state);
 
+extern void mwDFU_Program(USBD_HANDLE_T hDfu);
+
 /** @endcond */
 
 /** @endcond */
@@ -29,6 +29,9 @@
 #include "mw_usbd_hid.h"
 #include "mw_usbd_hiduser.h"
 
+/* forward function declarations */
+void mwHID_QueueFlush(USB_HID_CTRL_T *pHidCtrl);
+
 /*
  *  HID Get report descriptor Request Callback
  *   Called automatically on HID Get report descriptor
@@ -137,6 +140,16 @@ ErrorCode_t mwHID_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 	uint16_t len = 0;
 	uint8_t *buff;
 
+	/* endpoints are reset, drop what was queued for the old configuration */
+	if ((event == USB_EVT_RESET) ||
+		((event == USB_EVT_SETUP) &&
+		 (pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_DEVICE) &&
+		 (pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_STANDARD) &&
+		 (pCtrl->SetupPacket.bRequest == USB_REQUEST_SET_CONFIGURATION))) {
+		mwHID_QueueFlush(pHidCtrl);
+		return ret;
+	}
+
 	/* Check if the request is for this instance of interface. IF not return immediately. */
 	if ((pCtrl->SetupPacket.wIndex.WB.L != pHidCtrl->if_num)) {
 		return ret;
@@ -265,6 +278,190 @@ ErrorCode_t mwHID_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 	return ret;
 }
 
+/*
+ *  HID Report Queue Index Increment
+ *  Parameters:      q: Report queue
+ *                   idx: head or tail of the queue
+ *  Return Value:    idx + 1, modulo twice the queue depth
+ */
+
+uint32_t mwHID_QueueNext(HID_REPORT_QUEUE_T *q, uint32_t idx) {
+	idx++;
+	return (idx == (2 * (uint32_t) q->depth)) ? 0 : idx;
+}
+
+/*
+ *  HID Send Next Report
+ *  Parameters:      pHidCtrl: Handle to the HID structure
+ *  Return Value:    None
+ *
+ *  Starts the oldest report of the first report ID with one queued, looking
+ *  from the one after the report ID sent last. Called with nothing on the
+ *  interrupt IN endpoint, either from its completion or from SendReport()
+ *  while it is idle.
+ */
+
+void mwHID_TxNext(USB_HID_CTRL_T *pHidCtrl) {
+	HID_REPORT_QUEUE_T *q;
+	uint32_t i, id, slot;
+
+	id = pHidCtrl->tx_next;
+	for (i = 0; i < pHidCtrl->max_reports; i++, id++) {
+		if (id >= pHidCtrl->max_reports) {
+			id = 0;
+		}
+		q = &pHidCtrl->queue[id];
+		if (HID_COALESCED(pHidCtrl->coalesce_mask, id)) {
+			slot = q->pending;
+			if (slot == HID_SLOT_NONE) {
+				continue;
+			}
+			q->sending = slot;
+			q->pending = HID_SLOT_NONE;
+		}
+		else {
+			if (q->head == q->tail) {
+				continue;
+			}
+			slot = q->tail;
+			if (slot >= q->depth) {
+				slot -= q->depth;
+			}
+		}
+		pHidCtrl->tx_report = id;
+		pHidCtrl->tx_next = id + 1;
+		/* busy before the report is queued, its completion may come at once */
+		pHidCtrl->tx_state = HID_XFER_BUSY;
+		pHidCtrl->pUsbCtrl->hw_api->WriteEP(pHidCtrl->pUsbCtrl, pHidCtrl->epin_adr,
+											q->buf + (slot * pHidCtrl->slot_size), q->len[slot]);
+		return;
+	}
+	pHidCtrl->tx_state = HID_XFER_IDLE;
+}
+
+/*
+ *  HID Drop Queued Reports
+ *  Parameters:      pHidCtrl: Handle to the HID structure
+ *  Return Value:    None
+ *
+ *  Called on bus reset and SET_CONFIGURATION, which also drop the transfer on
+ *  the endpoint. Only the interrupt side indexes are touched, so a report
+ *  the main loop is queueing meanwhile is either dropped or kept whole.
+ */
+
+void mwHID_QueueFlush(USB_HID_CTRL_T *pHidCtrl) {
+	HID_REPORT_QUEUE_T *q;
+	uint32_t id;
+
+	if (pHidCtrl->queue == 0) {
+		return;
+	}
+	for (id = 0; id < pHidCtrl->max_reports; id++) {
+		q = &pHidCtrl->queue[id];
+		q->tail = q->head;
+		q->pending = HID_SLOT_NONE;
+		q->sending = HID_SLOT_NONE;
+	}
+	pHidCtrl->tx_state = HID_XFER_IDLE;
+}
+
+/*
+ *  Default HID Interrupt IN Handler, used with the report queue
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwHID_ep_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_HID_CTRL_T *pHidCtrl = (USB_HID_CTRL_T *) data;
+	HID_REPORT_QUEUE_T *q;
+
+	if ((event == USB_EVT_IN) && (pHidCtrl->tx_state == HID_XFER_BUSY)) {
+		/* free the slot just sent */
+		q = &pHidCtrl->queue[pHidCtrl->tx_report];
+		if (HID_COALESCED(pHidCtrl->coalesce_mask, pHidCtrl->tx_report)) {
+			q->sending = HID_SLOT_NONE;
+		}
+		else {
+			q->tail = mwHID_QueueNext(q, q->tail);
+		}
+		mwHID_TxNext(pHidCtrl);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  HID Queue Input Report
+ *  Parameters:     hHid: Handle to the HID structure
+ *                  report_id: Report ID, selects the queue.
+ *                  data: Report to send.
+ *                  len: Length of the report.
+ *  Return Value:   len when queued, 0 otherwise.
+ */
+
+uint32_t mwHID_SendReport(USBD_HANDLE_T hHid, uint8_t report_id, const uint8_t *data, uint32_t len)
+{
+	USB_HID_CTRL_T *pHidCtrl = (USB_HID_CTRL_T *) hHid;
+	HID_REPORT_QUEUE_T *q;
+	uint32_t slot, pend, busy;
+
+	if ((pHidCtrl->queue == 0) || (report_id >= pHidCtrl->max_reports) ||
+		(len == 0) || (len > pHidCtrl->max_report_size) ||
+		!USB_IsConfigured(pHidCtrl->pUsbCtrl)) {
+		return 0;
+	}
+	q = &pHidCtrl->queue[report_id];
+
+	if (HID_COALESCED(pHidCtrl->coalesce_mask, report_id)) {
+		/* pending first: the interrupt only ever moves it to sending */
+		pend = q->pending;
+		COMPILER_BARRIER();
+		busy = q->sending;
+		for (slot = 0; (slot == pend) || (slot == busy); slot++) {}
+		memcpy(q->buf + (slot * pHidCtrl->slot_size), data, len);
+		q->len[slot] = len;
+		COMPILER_BARRIER();
+		q->pending = slot;
+	}
+	else {
+		/* full when head is depth ahead of tail */
+		slot = q->head + q->depth;
+		if (slot >= (2 * (uint32_t) q->depth)) {
+			slot -= 2 * q->depth;
+		}
+		if (slot == q->tail) {
+			return 0;
+		}
+		slot = q->head;
+		if (slot >= q->depth) {
+			slot -= q->depth;
+		}
+		memcpy(q->buf + (slot * pHidCtrl->slot_size), data, len);
+		q->len[slot] = len;
+		COMPILER_BARRIER();
+		q->head = mwHID_QueueNext(q, q->head);
+	}
+
+	if (pHidCtrl->tx_state == HID_XFER_IDLE) {
+		mwHID_TxNext(pHidCtrl);
+	}
+	return len;
+}
+
+/*
+ *  Number of report slots of a report ID
+ *  Parameters:      param: HID function driver initialization parameters.
+ *                   id: Report ID.
+ *  Return Value:    Slots to allocate for the report ID.
+ */
+
+uint32_t mwHID_QueueSlots(USBD_HID_INIT_PARAM_T *param, uint32_t id)
+{
+	return HID_COALESCED(param->coalesce_mask, id) ? HID_COALESCE_SLOTS : param->queue_depth;
+}
+
 /**
  * @brief   Get memory required by HID class.
  * @param [in/out] param parameter structure used for initialisation.
@@ -277,7 +474,7 @@ ErrorCode_t mwHID_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
  */
 uint32_t mwHID_GetMemSize(USBD_HID_INIT_PARAM_T *param)
 {
-	uint32_t req_len = 0;
+	uint32_t req_len = 0, i, n;
 
 	/* calculate required length */
 	req_len += sizeof(USB_HID_CTRL_T);	/* memory for HID controller structure */
@@ -285,6 +482,16 @@ uint32_t mwHID_GetMemSize(USBD_HID_INIT_PARAM_T *param)
 	req_len += 8;	/* for alignment overhead */
 	req_len &= ~0x7;
 
+	if (param->queue_depth != 0) {
+		/* report queues, slots and their lengths */
+		req_len += param->max_reports * sizeof(HID_REPORT_QUEUE_T);
+		for (i = 0; i < param->max_reports; i++) {
+			n = mwHID_QueueSlots(param, i);
+			req_len += n * ((param->max_report_size + 3) & ~3);
+			req_len += ((n * sizeof(uint16_t)) + 3) & ~3;
+		}
+	}
+
 	return req_len;
 }
 
@@ -298,18 +505,23 @@ uint32_t mwHID_GetMemSize(USBD_HID_INIT_PARAM_T *param)
 
 ErrorCode_t mwHID_init(USBD_HANDLE_T hUsb, USBD_HID_INIT_PARAM_T *param)
 {
-	uint32_t new_addr, i, ep_indx;
+	uint32_t new_addr, i, n, ep_indx;
 	ErrorCode_t ret = LPC_OK;
 	USB_HID_CTRL_T *pHidCtrl;
+	HID_REPORT_QUEUE_T *q;
 	HID_DESCRIPTOR *pHidDesc;
 	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
 	USB_INTERFACE_DESCRIPTOR *pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->intf_desc;
 
 	/* check for memory alignment */
-	if ((param->mem_base &  0x3) &&
-		(param->mem_size < (sizeof(USB_HID_CTRL_T) + (param->max_reports * sizeof(USB_HID_REPORT_T))))) {
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwHID_GetMemSize(param))) {
 		return ERR_USBD_BAD_MEM_BUF;
 	}
+	if ((param->queue_depth != 0) &&
+		((param->max_report_size == 0) || (param->max_report_size > USB_HS_MAX_INT_PACKET))) {
+		return ERR_API_INVALID_PARAM2;
+	}
 
 	/* allocate memory for the control data structure */
 	pHidCtrl = (USB_HID_CTRL_T *) param->mem_base;
@@ -335,6 +547,32 @@ ErrorCode_t mwHID_init(USBD_HANDLE_T hUsb, USBD_HID_INIT_PARAM_T *param)
 		memcpy(&pHidCtrl->report_data[i], &param->report_data[i], sizeof(USB_HID_REPORT_T));
 	}
 
+	/* allocate the report queues */
+	if (param->queue_depth != 0) {
+		pHidCtrl->queue = (HID_REPORT_QUEUE_T *) param->mem_base;
+		param->mem_base += param->max_reports * sizeof(HID_REPORT_QUEUE_T);
+		param->mem_size -= param->max_reports * sizeof(HID_REPORT_QUEUE_T);
+		pHidCtrl->coalesce_mask = param->coalesce_mask;
+		pHidCtrl->max_report_size = param->max_report_size;
+		pHidCtrl->slot_size = (param->max_report_size + 3) & ~3;
+		pHidCtrl->max_reports = param->max_reports;
+		for (i = 0; i < param->max_reports; i++) {
+			q = &pHidCtrl->queue[i];
+			n = mwHID_QueueSlots(param, i);
+			q->buf = (uint8_t *) param->mem_base;
+			param->mem_base += n * pHidCtrl->slot_size;
+			param->mem_size -= n * pHidCtrl->slot_size;
+			q->len = (uint16_t *) param->mem_base;
+			param->mem_base += ((n * sizeof(uint16_t)) + 3) & ~3;
+			param->mem_size -= ((n * sizeof(uint16_t)) + 3) & ~3;
+			q->head = 0;
+			q->tail = 0;
+			q->depth = n;
+			q->pending = HID_SLOT_NONE;
+			q->sending = HID_SLOT_NONE;
+		}
+	}
+
 	/* user defined functions */
 	if ((param->HID_GetReport == 0) ||
 		(param->HID_SetReport == 0) ) {
@@ -384,7 +622,10 @@ ErrorCode_t mwHID_init(USBD_HANDLE_T hUsb, USBD_HID_INIT_PARAM_T *param)
 					pHidCtrl->epin_adr = pEpDesc->bEndpointAddress;
 					ep_indx = ((pHidCtrl->epin_adr & 0x0F) << 1) + 1;
 					/* register endpoint interrupt handler if provided*/
-					if (param->HID_EpIn_Hdlr != 0) {
+					if (pHidCtrl->queue != 0) {
+						ret = mwUSB_RegisterEpHandler(hUsb, ep_indx, mwHID_ep_in_hdlr, pHidCtrl);
+					}
+					else if (param->HID_EpIn_Hdlr != 0) {
 						ret = mwUSB_RegisterEpHandler(hUsb, ep_indx, param->HID_EpIn_Hdlr, pHidCtrl);
 					}
 				}
@@ -411,12 +652,14 @@ ErrorCode_t mwHID_init(USBD_HANDLE_T hUsb, USBD_HID_INIT_PARAM_T *param)
 	/* register ep0 handler */
 	/* check if user wants his own handler */
 	if (param->HID_Ep0_Hdlr == 0) {
-		ret = mwUSB_RegisterClassHandler(hUsb, mwHID_ep0_hdlr, pHidCtrl);
+		ret = mwUSB_RegisterIntfHandler(hUsb, pHidCtrl->if_num, mwHID_ep0_hdlr, pHidCtrl);
 	}
 	else {
-		ret = mwUSB_RegisterClassHandler(hUsb, param->HID_Ep0_Hdlr, pHidCtrl);
+		ret = mwUSB_RegisterIntfHandler(hUsb, pHidCtrl->if_num, param->HID_Ep0_Hdlr, pHidCtrl);
 		param->HID_Ep0_Hdlr = mwHID_ep0_hdlr;
 	}
+	/* return the handle */
+	param->hHid = (USBD_HANDLE_T) pHidCtrl;
 
 	return ret;
 }
@@ -334,6 +334,27 @@ typedef struct USBD_HID_INIT_PARAM {
 	 */
 	ErrorCode_t (*HID_Ep0_Hdlr)(USBD_HANDLE_T hUsb, void *data, uint32_t event);
 
+	/* interrupt IN report queue */
+	uint16_t queue_depth;	/**< Number of input reports queued per report ID.
+							   Zero leaves the interrupt IN endpoint to \em HID_EpIn_Hdlr.
+							   Otherwise the stack owns the endpoint: queued reports
+							   are sent one per USB_EVT_IN, taking the report IDs in
+							   turn, and \em HID_EpIn_Hdlr is not used.
+							 */
+	uint16_t max_report_size;	/**< Largest input report in bytes, including the
+								   report ID byte. Up to USB_HS_MAX_INT_PACKET, sent in one
+								   microframe by a high speed endpoint with that
+								   wMaxPacketSize.
+								 */
+	uint32_t coalesce_mask;	/**< Bit n set makes report ID n "latest value wins":
+							   a report not yet on the bus is replaced by the next one
+							   instead of queueing behind it. Meant for status reports,
+							   \em queue_depth does not apply to them.
+							 */
+	USBD_HANDLE_T hHid;	/**< Set by USBD_HID_API::init() to the handle to pass to
+						   USBD_HID_API::SendReport().
+						 */
+
 } USBD_HID_INIT_PARAM_T;
 
 /** \brief HID class API functions structure.
@@ -379,6 +400,24 @@ typedef struct USBD_HID_API {
 	 */
 	ErrorCode_t (*init)(USBD_HANDLE_T hUsb, USBD_HID_INIT_PARAM_T *param);
 
+	/** \fn uint32_t SendReport(USBD_HANDLE_T hHid, uint8_t report_id, const uint8_t *data, uint32_t len)
+	 *  Function to queue an input report on the interrupt IN endpoint.
+	 *
+	 *  The report is copied, so \em data can be reused on return. It is sent
+	 *  at once when the endpoint is idle, otherwise from the USB_EVT_IN of the
+	 *  reports before it. Only to be called from one context, normally the
+	 *  main loop, and only when USBD_HID_INIT_PARAM::queue_depth is non-zero.
+	 *
+	 *  \param[in] hHid Handle to HID function driver.
+	 *  \param[in] report_id Report ID, below USBD_HID_INIT_PARAM::max_reports.
+	 *  \param[in] data Report, including the report ID byte if the report
+	 *      descriptor declares one.
+	 *  \param[in] len Report length, up to USBD_HID_INIT_PARAM::max_report_size.
+	 *  \return \em len when queued, 0 when the device is not configured, the
+	 *      parameters are wrong or the queue of \em report_id is full.
+	 */
+	uint32_t (*SendReport)(USBD_HANDLE_T hHid, uint8_t report_id, const uint8_t *data, uint32_t len);
+
 } USBD_HID_API_T;
 
 /*-----------------------------------------------------------------------------
@@ -386,6 +425,28 @@ typedef struct USBD_HID_API {
  *-----------------------------------------------------------------------------*/
 /** @cond  ADVANCED_API */
 
+#define HID_SLOT_NONE       0xFF	/* no slot of a coalesced report */
+#define HID_COALESCE_SLOTS  3		/* pending, on the bus and being written */
+#define HID_COALESCED(mask, id)  (((id) < 32) && ((mask) & (1UL << (id))))
+
+#define HID_XFER_IDLE       0
+#define HID_XFER_BUSY       1
+
+/* Input reports of one report ID. Queued reports are slots head back to
+   tail, counted modulo 2 * depth so that a full queue differs from an
+   empty one. A coalesced report uses three slots instead: the main loop
+   writes the one that is neither pending nor on the bus and then makes it
+   the pending one. */
+typedef struct _HID_REPORT_QUEUE_T {
+	uint8_t *buf;					/* slots of slot_size bytes */
+	uint16_t *len;					/* report length per slot */
+	volatile uint16_t head;			/* next slot to fill, main loop */
+	volatile uint16_t tail;			/* next slot to send, interrupt */
+	uint16_t depth;					/* number of slots */
+	volatile uint8_t pending;		/* coalesced: slot waiting to be sent */
+	volatile uint8_t sending;		/* coalesced: slot on the bus */
+} HID_REPORT_QUEUE_T;
+
 typedef struct _HID_CTRL_T {
 	/* pointer to controller */
 	USB_CORE_CTRL_T *pUsbCtrl;
@@ -408,6 +469,16 @@ typedef struct _HID_CTRL_T {
 	/* virtual overridable functions */
 	ErrorCode_t (*HID_GetReportDesc)(USBD_HANDLE_T hHid, USB_SETUP_PACKET *pSetup, uint8_t * *pBuf, uint16_t *length);
 
+	/* interrupt IN report queue */
+	HID_REPORT_QUEUE_T *queue;		/* one per report ID, 0 when not used */
+	uint32_t coalesce_mask;
+	uint16_t slot_size;				/* max_report_size rounded up to 4 */
+	uint16_t max_report_size;
+	uint8_t max_reports;
+	uint8_t tx_report;				/* report ID on the bus */
+	uint8_t tx_next;				/* report ID looked at first for the next report */
+	volatile uint8_t tx_state;
+
 } USB_HID_CTRL_T;
 
 /** @cond  DIRECT_API */
@@ -415,6 +486,8 @@ extern uint32_t mwHID_GetMemSize(USBD_HID_INIT_PARAM_T *param);
 
 extern ErrorCode_t mwHID_init(USBD_HANDLE_T hUsb, USBD_HID_INIT_PARAM_T *param);
 
+extern uint32_t mwHID_SendReport(USBD_HANDLE_T hHid, uint8_t report_id, const uint8_t *data, uint32_t len);
+
 /** @endcond */
 
 /** @endcond */
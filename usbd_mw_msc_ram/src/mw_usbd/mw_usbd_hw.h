@@ -65,6 +65,13 @@ enum USBD_EVENT_T {
 	USB_EVT_DEV_ERROR	/**< 17  Device error events */
 };
 
+/** \ingroup USBD_HW
+ *  Transfer error bits reported by USBD_HW_API::GetXferLen().
+ *
+ */
+#define USBD_XFER_ERR_XACT		0x01	/**< ISO packet missed or received with an error */
+#define USBD_XFER_ERR_BUFF		0x02	/**< Data buffer overrun or underrun */
+
 /**
  *  \brief Hardware API functions structure.
  *  \ingroup USBD_HW
@@ -101,6 +108,9 @@ typedef struct USBD_HW_API {
 	 *          \retval LPC_OK(0) On success
 	 *          \retval ERR_USBD_BAD_MEM_BUF(0x0004000b) When insufficient memory buffer is passed or memory
 	 *                                             is not aligned on 2048 boundary.
+	 *          \retval ERR_USBD_BAD_DESC(0x00040006) When the descriptors hold more strings than
+	 *                                             USB_MAX_STRING_NUM or more configurations than
+	 *                                             USB_MAX_CONFIG_NUM.
 	 */
 	ErrorCode_t (*Init)(USBD_HANDLE_T *phUsb, USB_CORE_DESCS_T *pDesc, USBD_API_INIT_PARAM_T *param);
 
@@ -324,7 +334,9 @@ typedef struct USBD_HW_API {
 	 *  Function to read data received on the requested endpoint.
 	 *
 	 *  This function is called by USB stack and the application layer to read the data
-	 *  received on the requested endpoint.
+	 *  received on the requested endpoint. When several read requests are queued on the
+	 *  endpoint, it reports the transfer whose completion raised the current USB_EVT_OUT
+	 *  event.
 	 *
 	 *  \param[in] hUsb Handle to the USB device stack.
 	 *  \param[in] EPNum  Endpoint number as per USB specification.
@@ -346,7 +358,8 @@ typedef struct USBD_HW_API {
 	 *  \param[in,out] pData Pointer to the data buffer where data is to be copied. This buffer
 	 *                       address should be accessible by USB DMA master.
 	 *  \param[in] len  Length of the buffer passed.
-	 *  \return Returns the length of the requested buffer.
+	 *  \return Returns the length of the requested buffer, or 0 when all transfer
+	 *          descriptors of the endpoint are in use.
 	 */
 	uint32_t (*ReadReqEP)(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t len);
 
@@ -375,7 +388,8 @@ typedef struct USBD_HW_API {
 	 *                    ie. An EP1_IN is represented by 0x81 number.
 	 *  \param[in] pData Pointer to the data buffer from where data is to be copied.
 	 *  \param[in] cnt  Number of bytes to write.
-	 *  \return Returns the number of bytes written.
+	 *  \return Returns the number of bytes written, or 0 when all transfer
+	 *          descriptors of the endpoint are in use.
 	 */
 	uint32_t (*WriteEP)(USBD_HANDLE_T hUsb, uint32_t EPNum, uint8_t *pData, uint32_t cnt);
 
@@ -411,6 +425,49 @@ typedef struct USBD_HW_API {
 	 */
 	ErrorCode_t  (*EnableEvent)(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t event_type, uint32_t enable);
 
+	/** \fn uint32_t ProcessEvents(USBD_HANDLE_T hUsb)
+	 *  Function to run the handlers of USB events deferred by the interrupt handler.
+	 *
+	 *  When the stack is built with USB_HW_DEFER_EVENTS the ISR() routine only records
+	 *  the controller events, so that slow class callbacks (ex. MSC_Read/MSC_Write on
+	 *  a storage backend) don't run at the USB interrupt priority. The application
+	 *  calls this function from its main loop or from a low priority interrupt such
+	 *  as PendSV to run the stack and class handlers. It is never called from ISR()
+	 *  context. Without USB_HW_DEFER_EVENTS the function does nothing.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \return Returns the number of recorded interrupts processed.
+	 */
+	uint32_t (*ProcessEvents)(USBD_HANDLE_T hUsb);
+
+	/** \fn uint32_t GetFrameNumber(USBD_HANDLE_T hUsb)
+	 *  Function to read the frame number of the last SOF.
+	 *
+	 *  The frame number advances every millisecond while the bus is active, so
+	 *  class drivers use it to time operations without a timer of their own.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \return Returns the 11-bit frame number.
+	 */
+	uint32_t (*GetFrameNumber)(USBD_HANDLE_T hUsb);
+
+	/** \fn uint32_t GetXferLen(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pStatus)
+	 *  Function to read the result of the transfer just completed on an endpoint.
+	 *
+	 *  Called from the USB_EVT_IN or USB_EVT_OUT handler of the endpoint. Unlike ReadEP()
+	 *  it serves both directions and reports the transfer errors. On an isochronous
+	 *  endpoint every transfer is one (micro)frame, so class drivers get the length of
+	 *  each transaction and drop the ones flagged by the controller.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in] EPNum  Endpoint number as per USB specification.
+	 *                    ie. An EP1_IN is represented by 0x81 number.
+	 *  \param[out] pStatus When not 0, set to the USBD_XFER_ERR_XACT and
+	 *                    USBD_XFER_ERR_BUFF bits of the transfer.
+	 *  \return Returns the number of bytes sent or received.
+	 */
+	uint32_t (*GetXferLen)(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pStatus);
+
 } USBD_HW_API_T;
 
 /*-----------------------------------------------------------------------------
@@ -427,6 +484,8 @@ void hwUSB_Connect(USBD_HANDLE_T hUsb, uint32_t con);
 
 void hwUSB_ISR(USBD_HANDLE_T hUsb);
 
+uint32_t hwUSB_ProcessEvents(USBD_HANDLE_T hUsb);
+
 /* USB Hardware Functions */
 extern void  hwUSB_Reset(USBD_HANDLE_T hUsb);
 
@@ -467,6 +526,10 @@ extern void  hwUSB_WakeUp(USBD_HANDLE_T hUsb);
 
 extern ErrorCode_t  hwUSB_EnableEvent(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t event_type, uint32_t enable);
 
+extern uint32_t hwUSB_GetFrameNumber(USBD_HANDLE_T hUsb);
+
+extern uint32_t hwUSB_GetXferLen(USBD_HANDLE_T hUsb, uint32_t EPNum, uint32_t *pStatus);
+
 /* TODO implement following routines
    - function to program TD and queue them to ep Qh
  */
@@ -105,9 +105,44 @@ typedef struct _MSC_CSW MSC_CSW;
 #define SCSI_READ10                     0x28
 #define SCSI_WRITE10                    0x2A
 #define SCSI_VERIFY10                   0x2F
+#define SCSI_SYNC_CACHE10               0x35
+#define SCSI_SYNC_CACHE16               0x91
+#define SCSI_UNMAP                      0x42
 #define SCSI_READ12                     0xA8
 #define SCSI_WRITE12                    0xAA
+#define SCSI_READ16                     0x88
+#define SCSI_WRITE16                    0x8A
+#define SCSI_SERVICE_ACTION_IN16        0x9E
 #define SCSI_MODE_SELECT10              0x55
 #define SCSI_MODE_SENSE10               0x5A
 
+/* SCSI Service Actions */
+#define SCSI_SA_READ_CAPACITY16         0x10
+
+/* SCSI Mode Pages */
+#define SCSI_MODE_PAGE_CACHING          0x08
+#define SCSI_MODE_PAGE_ALL              0x3F
+
+/* SCSI Vital Product Data Pages */
+#define SCSI_VPD_SUPPORTED_PAGES        0x00
+#define SCSI_VPD_BLOCK_LIMITS           0xB0
+#define SCSI_VPD_LB_PROVISIONING        0xB2
+
+/* SCSI Sense Keys */
+#define SCSI_SENSE_NO_SENSE             0x00
+#define SCSI_SENSE_NOT_READY            0x02
+#define SCSI_SENSE_MEDIUM_ERROR         0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST      0x05
+#define SCSI_SENSE_MISCOMPARE           0x0E
+
+/* SCSI Additional Sense Codes */
+#define SCSI_ASC_WRITE_ERROR            0x0C
+#define SCSI_ASC_UNRECOVERED_READ_ERROR 0x11
+#define SCSI_ASC_MISCOMPARE             0x1D
+#define SCSI_ASC_INVALID_COMMAND        0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE       0x21
+#define SCSI_ASC_INVALID_FIELD_IN_CDB   0x24
+#define SCSI_ASC_LUN_NOT_SUPPORTED      0x25
+#define SCSI_ASC_MEDIUM_NOT_PRESENT     0x3A
+
 #endif  /* __MSC_H__ */
@@ -0,0 +1,413 @@
+/***********************************************************************
+ * $Id:: mw_usbd_msccache.c                                                    $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     Mass Storage Class write-back block cache.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#include <string.h>	/*for memcpy */
+
+#include "mw_usbd_msccache.h"
+
+/* round up to 4 byte boundary */
+#define MSC_CACHE_ALIGN4(x)     (((x) + 3) & ~3)
+
+/*
+ *  Find the line holding a tag
+ *  Parameters:      pCache: Handle to cache structure
+ *                   tag: first block of the line / LineBlocks
+ *  Return Value:    Line, or 0 if the tag is not cached
+ */
+
+static MSC_CACHE_LINE_T *mwMSC_CacheLookup(USB_MSC_CACHE_T *pCache, uint64_t tag) {
+	MSC_CACHE_LINE_T *pLine = &pCache->lines[(tag % pCache->NumSets) * pCache->NumWays];
+	uint32_t i;
+
+	for (i = 0; i < pCache->NumWays; i++, pLine++) {
+		if (pLine->used && (pLine->tag == tag)) {
+			return pLine;
+		}
+	}
+	return 0;
+}
+
+/*
+ *  Complete the block being written packet by packet with the rest of
+ *  its old contents from the backend
+ *  Parameters:      pCache: Handle to cache structure
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ */
+
+static ErrorCode_t mwMSC_CacheMerge(USB_MSC_CACHE_T *pCache) {
+	MSC_CACHE_LINE_T *pLine;
+	uint32_t blk;
+
+	if (pCache->asm_active == 0) {
+		return LPC_OK;
+	}
+	pLine = mwMSC_CacheLookup(pCache, pCache->asm_lba / pCache->LineBlocks);
+	if (pLine) {
+		if (pCache->ReadBlocks(pCache->asm_lba, pCache->scratch, 1) != LPC_OK) {
+			return ERR_FAILED;
+		}
+		blk = pCache->asm_lba % pCache->LineBlocks;
+		memcpy(&pLine->data[blk * pCache->BlockSize + pCache->asm_len],
+			   &pCache->scratch[pCache->asm_len],
+			   pCache->BlockSize - pCache->asm_len);
+		pLine->valid |= (1UL << blk);
+	}
+	pCache->asm_active = 0;
+	return LPC_OK;
+}
+
+/*
+ *  Write the dirty blocks of a line back, one backend call per run of
+ *  adjacent dirty blocks
+ *  Parameters:      pCache: Handle to cache structure
+ *                   pLine: line to clean
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ */
+
+static ErrorCode_t mwMSC_CacheWriteBack(USB_MSC_CACHE_T *pCache, MSC_CACHE_LINE_T *pLine) {
+	uint64_t lba = pLine->tag * pCache->LineBlocks;
+	uint32_t i = 0;
+	uint32_t j;
+
+	if ((pCache->asm_active) && ((pCache->asm_lba / pCache->LineBlocks) == pLine->tag)) {
+		if (mwMSC_CacheMerge(pCache) != LPC_OK) {
+			return ERR_FAILED;
+		}
+	}
+
+	while (i < pCache->LineBlocks) {
+		if ((pLine->dirty & (1UL << i)) == 0) {
+			i++;
+			continue;
+		}
+		for (j = i + 1; (j < pCache->LineBlocks) && (pLine->dirty & (1UL << j)); j++) {}
+
+		if (pCache->WriteBlocks(lba + i, &pLine->data[i * pCache->BlockSize], j - i) != LPC_OK) {
+			return ERR_FAILED;
+		}
+		pLine->dirty &= ~(((j - i) < 32 ? ((1UL << (j - i)) - 1) : 0xFFFFFFFF) << i);
+		pCache->stats.writebacks++;
+		pCache->stats.wb_blocks += j - i;
+		pCache->stats.dirty -= j - i;
+		i = j;
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Get a line for a tag, replacing the least recently used line of its set
+ *  Parameters:      pCache: Handle to cache structure
+ *                   tag: first block of the line / LineBlocks
+ *  Return Value:    Empty line, or 0 if the victim could not be written back
+ */
+
+static MSC_CACHE_LINE_T *mwMSC_CacheAlloc(USB_MSC_CACHE_T *pCache, uint64_t tag) {
+	MSC_CACHE_LINE_T *pSet = &pCache->lines[(tag % pCache->NumSets) * pCache->NumWays];
+	MSC_CACHE_LINE_T *pLine = pSet;
+	uint32_t i;
+
+	for (i = 0; i < pCache->NumWays; i++) {
+		if (pSet[i].used == 0) {
+			pLine = &pSet[i];
+			break;
+		}
+		if (pSet[i].stamp < pLine->stamp) {
+			pLine = &pSet[i];
+		}
+	}
+
+	if (pLine->used) {
+		pCache->stats.evictions++;
+		if (pLine->dirty && (mwMSC_CacheWriteBack(pCache, pLine) != LPC_OK)) {
+			return 0;
+		}
+	}
+	pLine->tag = tag;
+	pLine->valid = 0;
+	pLine->dirty = 0;
+	pLine->used = 1;
+	return pLine;
+}
+
+/*
+ *  Check if a block is held by the cache
+ *  Parameters:      pCache: Handle to cache structure
+ *                   lba: block number
+ *  Return Value:    Line holding the block, or 0
+ */
+
+static MSC_CACHE_LINE_T *mwMSC_CacheHolds(USB_MSC_CACHE_T *pCache, uint64_t lba) {
+	MSC_CACHE_LINE_T *pLine = mwMSC_CacheLookup(pCache, lba / pCache->LineBlocks);
+
+	if (pLine && (pLine->valid & (1UL << (lba % pCache->LineBlocks)))) {
+		return pLine;
+	}
+	return 0;
+}
+
+ErrorCode_t mwMSC_CacheRead(USB_MSC_CACHE_T *pCache, uint64_t offset, uint8_t *buf, uint32_t length) {
+	MSC_CACHE_LINE_T *pLine;
+	uint64_t lba = offset / pCache->BlockSize;
+	uint32_t cnt = length / pCache->BlockSize;
+	uint32_t i = 0;
+	uint32_t j;
+
+	/* a block still being written is read back whole */
+	if ((pCache->asm_active) && (pCache->asm_lba >= lba) && (pCache->asm_lba < (lba + cnt))) {
+		if (mwMSC_CacheMerge(pCache) != LPC_OK) {
+			return ERR_FAILED;
+		}
+	}
+	pCache->stats.rd_blocks += cnt;
+
+	while (i < cnt) {
+		pLine = mwMSC_CacheHolds(pCache, lba + i);
+		if (pLine) {
+			memcpy(&buf[i * pCache->BlockSize],
+				   &pLine->data[((lba + i) % pCache->LineBlocks) * pCache->BlockSize],
+				   pCache->BlockSize);
+			pLine->stamp = ++pCache->clock;
+			pCache->stats.rd_hits++;
+			i++;
+			continue;
+		}
+		/* one backend read for the run of blocks not cached */
+		for (j = i + 1; (j < cnt) && (mwMSC_CacheHolds(pCache, lba + j) == 0); j++) {}
+
+		if (pCache->ReadBlocks(lba + i, &buf[i * pCache->BlockSize], j - i) != LPC_OK) {
+			return ERR_FAILED;
+		}
+		i = j;
+	}
+	return LPC_OK;
+}
+
+ErrorCode_t mwMSC_CacheWrite(USB_MSC_CACHE_T *pCache, uint64_t offset, const uint8_t *buf, uint32_t length) {
+	MSC_CACHE_LINE_T *pLine;
+	uint32_t line_bytes = pCache->LineBlocks * pCache->BlockSize;
+	uint64_t lba;
+	uint32_t off;
+	uint32_t blk;
+	uint32_t bit;
+	uint32_t n;
+	uint8_t *dst;
+
+	while (length != 0) {
+		lba = offset / pCache->BlockSize;
+		off = offset % pCache->BlockSize;
+		blk = lba % pCache->LineBlocks;
+		bit = 1UL << blk;
+		pLine = mwMSC_CacheLookup(pCache, lba / pCache->LineBlocks);
+
+		if ((pLine == 0) && (off == 0) && (blk == 0) && (length >= line_bytes)) {
+			/* whole lines not cached go straight to the backend */
+			for (n = line_bytes;
+				 ((n + line_bytes) <= length) &&
+				 (mwMSC_CacheLookup(pCache, (lba / pCache->LineBlocks) + (n / line_bytes)) == 0);
+				 n += line_bytes) {}
+
+			if (pCache->WriteBlocks(lba, buf, n / pCache->BlockSize) != LPC_OK) {
+				return ERR_FAILED;
+			}
+			pCache->stats.wr_blocks += n / pCache->BlockSize;
+			pCache->stats.wr_bypass += n / pCache->BlockSize;
+			offset += n;
+			buf += n;
+			length -= n;
+			continue;
+		}
+
+		if (pLine) {
+			pCache->stats.wr_hits++;
+		}
+		else {
+			pLine = mwMSC_CacheAlloc(pCache, lba / pCache->LineBlocks);
+			if (pLine == 0) {
+				return ERR_FAILED;
+			}
+		}
+		pLine->stamp = ++pCache->clock;
+		dst = &pLine->data[blk * pCache->BlockSize];
+
+		n = pCache->BlockSize - off;
+		if (n > length) {
+			n = length;
+		}
+
+		if (n == pCache->BlockSize) {
+			if ((pCache->asm_active) && (pCache->asm_lba == lba)) {
+				pCache->asm_active = 0;
+			}
+			pLine->valid |= bit;
+		}
+		else if ((pLine->valid & bit) == 0) {
+			if ((pCache->asm_active) && (pCache->asm_lba == lba) && (pCache->asm_len == off)) {
+				/* next packet of the block being assembled */
+				pCache->asm_len += n;
+				if (pCache->asm_len == pCache->BlockSize) {
+					pLine->valid |= bit;
+					pCache->asm_active = 0;
+				}
+			}
+			else if ((off == 0) && !((pCache->asm_active) && (pCache->asm_lba == lba))) {
+				/* first packet of a block: collect the rest before reading
+				   anything from the backend */
+				if (mwMSC_CacheMerge(pCache) != LPC_OK) {
+					return ERR_FAILED;
+				}
+				pCache->asm_active = 1;
+				pCache->asm_lba = lba;
+				pCache->asm_len = n;
+			}
+			else if ((pCache->asm_active) && (pCache->asm_lba == lba)) {
+				/* out of order packet */
+				if (mwMSC_CacheMerge(pCache) != LPC_OK) {
+					return ERR_FAILED;
+				}
+			}
+			else {
+				if (pCache->ReadBlocks(lba, dst, 1) != LPC_OK) {
+					return ERR_FAILED;
+				}
+				pLine->valid |= bit;
+			}
+		}
+		memcpy(&dst[off], buf, n);
+
+		if ((pLine->dirty & bit) == 0) {
+			pLine->dirty |= bit;
+			pCache->stats.dirty++;
+		}
+		pCache->stats.wr_blocks++;
+		offset += n;
+		buf += n;
+		length -= n;
+	}
+	return LPC_OK;
+}
+
+ErrorCode_t mwMSC_CacheFlush(USB_MSC_CACHE_T *pCache) {
+	MSC_CACHE_LINE_T *pLine;
+	MSC_CACHE_LINE_T *pNext;
+	uint32_t i;
+	uint32_t n = pCache->NumSets * pCache->NumWays;
+
+	if (mwMSC_CacheMerge(pCache) != LPC_OK) {
+		return ERR_FAILED;
+	}
+
+	/* write lines back in ascending block order, the backend sees a
+	   sequential stream where the host wrote one */
+	do {
+		pNext = 0;
+		for (i = 0, pLine = pCache->lines; i < n; i++, pLine++) {
+			if ((pLine->dirty) && ((pNext == 0) || (pLine->tag < pNext->tag))) {
+				pNext = pLine;
+			}
+		}
+		if (pNext && (mwMSC_CacheWriteBack(pCache, pNext) != LPC_OK)) {
+			return ERR_FAILED;
+		}
+	} while (pNext);
+
+	return LPC_OK;
+}
+
+void mwMSC_CacheGetStats(USB_MSC_CACHE_T *pCache, USBD_MSC_CACHE_STATS_T *stats, uint32_t clear) {
+	uint32_t dirty = pCache->stats.dirty;
+
+	*stats = pCache->stats;
+	if (clear) {
+		memset((void *) &pCache->stats, 0, sizeof(USBD_MSC_CACHE_STATS_T));
+		pCache->stats.dirty = dirty;
+	}
+}
+
+uint32_t mwMSC_CacheGetMemSize(USBD_MSC_CACHE_INIT_PARAM_T *param) {
+	uint32_t req_len = 0;
+	uint32_t n = param->NumSets * param->NumWays;
+
+	/* calculate required length */
+	req_len += MSC_CACHE_ALIGN4(sizeof(USB_MSC_CACHE_T));
+	req_len += MSC_CACHE_ALIGN4(n * sizeof(MSC_CACHE_LINE_T));
+	req_len += MSC_CACHE_ALIGN4(n * param->LineBlocks * param->BlockSize);
+	req_len += MSC_CACHE_ALIGN4(param->BlockSize);
+
+	return req_len;
+}
+
+ErrorCode_t mwMSC_CacheInit(USB_MSC_CACHE_T **phCache, USBD_MSC_CACHE_INIT_PARAM_T *param) {
+	USB_MSC_CACHE_T *pCache;
+	uint32_t n = param->NumSets * param->NumWays;
+	uint32_t size;
+	uint32_t i;
+
+	if ((param->BlockSize == 0) ||
+		(param->LineBlocks == 0) ||
+		(param->LineBlocks > USB_MSC_CACHE_MAX_LINE_BLOCKS) ||
+		(n == 0) ||
+		(param->ReadBlocks == 0) ||
+		(param->WriteBlocks == 0)) {
+		return ERR_API_INVALID_PARAM2;
+	}
+	/* check for memory alignment */
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwMSC_CacheGetMemSize(param))) {
+		return ERR_USBD_BAD_MEM_BUF;
+	}
+
+	/* allocate memory for the control data structure */
+	pCache = (USB_MSC_CACHE_T *) param->mem_base;
+	size = MSC_CACHE_ALIGN4(sizeof(USB_MSC_CACHE_T));
+	param->mem_base += size;
+	param->mem_size -= size;
+	memset((void *) pCache, 0, sizeof(USB_MSC_CACHE_T));
+
+	pCache->lines = (MSC_CACHE_LINE_T *) param->mem_base;
+	size = MSC_CACHE_ALIGN4(n * sizeof(MSC_CACHE_LINE_T));
+	param->mem_base += size;
+	param->mem_size -= size;
+	memset((void *) pCache->lines, 0, n * sizeof(MSC_CACHE_LINE_T));
+
+	for (i = 0; i < n; i++) {
+		pCache->lines[i].data = (uint8_t *) param->mem_base + i * param->LineBlocks * param->BlockSize;
+	}
+	size = MSC_CACHE_ALIGN4(n * param->LineBlocks * param->BlockSize);
+	param->mem_base += size;
+	param->mem_size -= size;
+
+	pCache->scratch = (uint8_t *) param->mem_base;
+	size = MSC_CACHE_ALIGN4(param->BlockSize);
+	param->mem_base += size;
+	param->mem_size -= size;
+
+	pCache->BlockSize = param->BlockSize;
+	pCache->LineBlocks = param->LineBlocks;
+	pCache->NumSets = param->NumSets;
+	pCache->NumWays = param->NumWays;
+	pCache->ReadBlocks = param->ReadBlocks;
+	pCache->WriteBlocks = param->WriteBlocks;
+
+	*phCache = pCache;
+	return LPC_OK;
+}
@@ -0,0 +1,195 @@
+/***********************************************************************
+ * $Id:: mw_usbd_msccache.h                                                    $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     Mass Storage Class write-back block cache definitions.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#ifndef __MSCCACHE_H__
+#define __MSCCACHE_H__
+
+#include "error.h"
+#include "mw_usbd.h"
+
+/** \file
+ *  \brief Mass Storage Class (MSC) block cache structures and function prototypes.
+ *
+ *  Optional write-back cache placed between the MSC callbacks of an application
+ *  and its storage backend.
+ *
+ */
+
+/** \ingroup USBD_MSC
+ *  @defgroup USBD_MSC_CACHE MSC block cache
+ *  \section Sec_MSCCacheModDescription Module Description
+ *  Set associative write-back cache of storage blocks. Host writes are collected
+ *  in cache lines of consecutive blocks, with byte granularity so MSC_Write() may
+ *  hand over single packets. Runs of adjacent dirty blocks are written back with
+ *  one backend call when a line is evicted or the cache is flushed. Reads are
+ *  served from the cache where it holds the blocks and from the backend otherwise,
+ *  reads do not allocate lines. Whole lines written while not cached bypass the
+ *  cache, so large sequential transfers reach the backend unsplit.
+ *
+ *  The cache does no locking, all calls for one cache must come from the same
+ *  context (or with that context masked).
+ */
+
+/** \brief Largest number of blocks in a cache line.
+ *  \ingroup USBD_MSC_CACHE
+ */
+#define USB_MSC_CACHE_MAX_LINE_BLOCKS   32
+
+/** \brief MSC block cache initialization parameter data structure.
+ *  \ingroup USBD_MSC_CACHE
+ */
+typedef struct USBD_MSC_CACHE_INIT_PARAM {
+	/* memory allocation params */
+	uint32_t mem_base;	/**< Base memory location from where the cache allocates its lines.
+						   Should be aligned on 4 byte boundary, and accessible by the
+						   DMA controller of the backend if it uses one. */
+	uint32_t mem_size;	/**< The size of memory buffer. On return this field is updated
+						   with the left over memory. */
+	uint32_t BlockSize;	/**< Block size of the backend in bytes */
+	uint32_t LineBlocks;/**< Blocks per cache line, 1..\ref USB_MSC_CACHE_MAX_LINE_BLOCKS */
+	uint32_t NumSets;	/**< Number of sets. Consecutive lines map to consecutive sets. */
+	uint32_t NumWays;	/**< Lines per set, replaced in least recently used order */
+
+	/** Backend read function: copy \em cnt blocks starting at block \em lba to \em buf.
+	 *  \return LPC_OK on success, ERR_FAILED otherwise.
+	 */
+	ErrorCode_t (*ReadBlocks)(uint64_t lba, uint8_t *buf, uint32_t cnt);
+
+	/** Backend write function: write \em cnt blocks starting at block \em lba from \em buf.
+	 *  \return LPC_OK on success, ERR_FAILED otherwise.
+	 */
+	ErrorCode_t (*WriteBlocks)(uint64_t lba, const uint8_t *buf, uint32_t cnt);
+
+} USBD_MSC_CACHE_INIT_PARAM_T;
+
+/** \brief MSC block cache statistics.
+ *  \ingroup USBD_MSC_CACHE
+ */
+typedef struct USBD_MSC_CACHE_STATS {
+	uint32_t rd_blocks;		/**< Blocks read through the cache */
+	uint32_t rd_hits;		/**< Blocks read from cache lines */
+	uint32_t wr_blocks;		/**< Blocks written through the cache, partial blocks included */
+	uint32_t wr_hits;		/**< Blocks written to lines already cached */
+	uint32_t wr_bypass;		/**< Blocks written straight to the backend */
+	uint32_t evictions;		/**< Lines replaced to make room */
+	uint32_t writebacks;	/**< Backend write calls issued for dirty blocks */
+	uint32_t wb_blocks;		/**< Dirty blocks written back */
+	uint32_t dirty;			/**< Dirty blocks currently held, not cleared */
+} USBD_MSC_CACHE_STATS_T;
+
+/* Cache line */
+typedef struct _MSC_CACHE_LINE_T {
+	uint64_t tag;			/* first block / LineBlocks */
+	uint32_t valid;			/* blocks holding data */
+	uint32_t dirty;			/* blocks not yet written back */
+	uint32_t stamp;			/* last use, for LRU replacement */
+	uint8_t *data;
+	uint8_t used;
+} MSC_CACHE_LINE_T;
+
+/* Cache control structure */
+typedef struct _MSC_CACHE_T {
+	MSC_CACHE_LINE_T *lines;	/* NumSets * NumWays lines, set major */
+	uint8_t *scratch;			/* one block, merges partially written blocks */
+	uint32_t BlockSize;
+	uint32_t LineBlocks;
+	uint32_t NumSets;
+	uint32_t NumWays;
+	uint32_t clock;				/* LRU time */
+	/* block being written packet by packet, not yet valid */
+	uint64_t asm_lba;
+	uint32_t asm_len;
+	uint8_t asm_active;
+	ErrorCode_t (*ReadBlocks)(uint64_t lba, uint8_t *buf, uint32_t cnt);
+	ErrorCode_t (*WriteBlocks)(uint64_t lba, const uint8_t *buf, uint32_t cnt);
+	USBD_MSC_CACHE_STATS_T stats;
+} USB_MSC_CACHE_T;
+
+/** \brief Memory needed by a cache.
+ *  \ingroup USBD_MSC_CACHE
+ *
+ *  \param[in] param Cache initialization parameters.
+ *  \return Returns the required memory size in bytes.
+ */
+extern uint32_t mwMSC_CacheGetMemSize(USBD_MSC_CACHE_INIT_PARAM_T *param);
+
+/** \brief Initialize a cache.
+ *  \ingroup USBD_MSC_CACHE
+ *
+ *  \param[out] phCache Returns the cache handle.
+ *  \param[in, out] param Cache initialization parameters, \em mem_base and
+ *                  \em mem_size are updated with the left over memory.
+ *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+ *          \retval LPC_OK On success
+ *          \retval ERR_USBD_BAD_MEM_BUF  Memory buffer passed is not 4-byte
+ *              aligned or smaller than required.
+ *          \retval ERR_API_INVALID_PARAM2 Bad geometry or backend functions missing.
+ */
+extern ErrorCode_t mwMSC_CacheInit(USB_MSC_CACHE_T **phCache, USBD_MSC_CACHE_INIT_PARAM_T *param);
+
+/** \brief Read bytes through the cache.
+ *  \ingroup USBD_MSC_CACHE
+ *
+ *  \param[in] hCache Cache handle.
+ *  \param[in] offset Byte offset on the medium, a multiple of the block size.
+ *  \param[out] buf Destination buffer.
+ *  \param[in] length Number of bytes, a multiple of the block size.
+ *  \return LPC_OK, or ERR_FAILED when the backend failed.
+ */
+extern ErrorCode_t mwMSC_CacheRead(USB_MSC_CACHE_T *hCache, uint64_t offset, uint8_t *buf, uint32_t length);
+
+/** \brief Write bytes through the cache.
+ *  \ingroup USBD_MSC_CACHE
+ *
+ *  Any byte range is accepted, so the call fits MSC_Write() in packet mode.
+ *
+ *  \param[in] hCache Cache handle.
+ *  \param[in] offset Byte offset on the medium.
+ *  \param[in] buf Source data.
+ *  \param[in] length Number of bytes.
+ *  \return LPC_OK, or ERR_FAILED when the backend failed.
+ */
+extern ErrorCode_t mwMSC_CacheWrite(USB_MSC_CACHE_T *hCache, uint64_t offset, const uint8_t *buf, uint32_t length);
+
+/** \brief Write all dirty blocks back, in ascending block order.
+ *  \ingroup USBD_MSC_CACHE
+ *
+ *  Call on SCSI SYNCHRONIZE CACHE (MSC_Flush()) and when the host is idle.
+ *  Lines stay cached, clean.
+ *
+ *  \param[in] hCache Cache handle.
+ *  \return LPC_OK, or ERR_FAILED when the backend failed. Blocks that could
+ *          not be written stay dirty.
+ */
+extern ErrorCode_t mwMSC_CacheFlush(USB_MSC_CACHE_T *hCache);
+
+/** \brief Copy the cache statistics, optionally clearing the counters.
+ *  \ingroup USBD_MSC_CACHE
+ *
+ *  \param[in] hCache Cache handle.
+ *  \param[out] stats Statistics.
+ *  \param[in] clear Non-zero to clear the counters, \em dirty is kept.
+ */
+extern void mwMSC_CacheGetStats(USB_MSC_CACHE_T *hCache, USBD_MSC_CACHE_STATS_T *stats, uint32_t clear);
+
+#endif  /* __MSCCACHE_H__ */
@@ -77,6 +77,10 @@ ErrorCode_t mwMSC_Reset(USB_MSC_CTRL_T *pMscCtrl) {
 	pMscCtrl->CSW.dSignature = 0;					/* invalid signature */
 
 	pMscCtrl->BulkStage = MSC_BS_CBW;
+	pMscCtrl->XferQueued = 0;
+	pMscCtrl->SenseKey = SCSI_SENSE_NO_SENSE;
+	pMscCtrl->PfLength = 0;
+	pMscCtrl->PfPending = 0;
 	return LPC_OK;
 }
 
@@ -89,10 +93,42 @@ ErrorCode_t mwMSC_Reset(USB_MSC_CTRL_T *pMscCtrl) {
 
 ErrorCode_t mwMSC_GetMaxLUN(USB_MSC_CTRL_T *pMscCtrl) {
 
-	pMscCtrl->pUsbCtrl->EP0Buf[0] = 0;				/* No LUN associated with this device */
+	pMscCtrl->pUsbCtrl->EP0Buf[0] = pMscCtrl->NumLUNs - 1;	/* Highest LUN of the device */
 	return LPC_OK;
 }
 
+/*
+ *  MSC Select Logical Unit
+ *  Loads the geometry, callbacks and buffer settings of a LUN for the
+ *  following command.
+ *  Parameters:      pMscCtrl: Handle to MSC structure
+ *                   lun: LUN, below NumLUNs
+ *  Return Value:    None
+ */
+
+void mwMSC_SelectLUN(USB_MSC_CTRL_T *pMscCtrl, uint32_t lun) {
+	MSC_LUN_T *pLun = &pMscCtrl->Luns[lun];
+
+	pMscCtrl->CurLun = lun;
+	pMscCtrl->InquiryStr = pLun->InquiryStr;
+	pMscCtrl->BlockCount = pLun->BlockCount;
+	pMscCtrl->BlockSize = pLun->BlockSize;
+	pMscCtrl->MemorySize = pLun->MemorySize;
+	pMscCtrl->XferBufSize = pLun->XferBufSize;
+	pMscCtrl->XferBufCnt = pLun->XferBufCnt;
+	pMscCtrl->XferBuf = (pLun->XferBufSize != 0) ? pMscCtrl->XferMem : pMscCtrl->BulkBuf;
+	pMscCtrl->RxWindow = pLun->RxWindow;
+	pMscCtrl->PfSize = pLun->PfSize;
+	pMscCtrl->MSC_Write = pLun->MSC_Write;
+	pMscCtrl->MSC_Read = pLun->MSC_Read;
+	pMscCtrl->MSC_Verify = pLun->MSC_Verify;
+	pMscCtrl->MSC_GetWriteBuf = pLun->MSC_GetWriteBuf;
+	pMscCtrl->MSC_Flush = pLun->MSC_Flush;
+	pMscCtrl->MSC_Unmap = pLun->MSC_Unmap;
+	pMscCtrl->MSC_VerifyRange = pLun->MSC_VerifyRange;
+	pMscCtrl->MSC_GetError = pLun->MSC_GetError;
+}
+
 /*
  *  MSC Bulk Out Read request routine
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -111,53 +147,240 @@ void mwMSC_ReadReqBulkEp(USB_MSC_CTRL_T *pMscCtrl, uint8_t *buff) {
 }
 
 /*
- *  MSC Memory Read Callback
- *  Called automatically on Memory Read Event
+ *  MSC Bulk Data Buffer
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *                   idx: Buffer index
+ *  Return Value:    Pointer to the bulk data buffer
+ */
+
+uint8_t *mwMSC_XferSlot(USB_MSC_CTRL_T *pMscCtrl, uint32_t idx) {
+	return pMscCtrl->XferBuf + (idx * pMscCtrl->XferBufSize);
+}
+
+/*
+ *  MSC Next Bulk Data Buffer
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *                   idx: Buffer index
+ *  Return Value:    Index of the buffer following idx
+ */
+
+uint8_t mwMSC_XferNextSlot(USB_MSC_CTRL_T *pMscCtrl, uint32_t idx) {
+	return (idx + 1 >= pMscCtrl->XferBufCnt) ? 0 : (idx + 1);
+}
+
+/*
+ *  MSC Bulk Out Data Read request routine
+ *  Primes the OUT endpoint for the next chunks of WRITE data. A chunk is
+ *  limited by the receive window and by the data left in the command; up to
+ *  XferBufCnt chunks are queued when data is staged in the bulk data buffers.
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
  *  Return Value:    None
  */
 
-void mwMSC_MemoryRead(USB_MSC_CTRL_T *pMscCtrl) {
-	uint32_t n;
+void mwMSC_ReadReqData(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t n, max_n, depth;
 	uint8_t *buff;
 
-	if ( pMscCtrl->pUsbCtrl->device_speed == USB_HIGH_SPEED ) {
-		if (pMscCtrl->Length > USB_HS_MAX_BULK_PACKET) {
-			n = USB_HS_MAX_BULK_PACKET;
+	if (pMscCtrl->RxWindow != 0) {
+		max_n = pMscCtrl->RxWindow;
+	}
+	else if ( pMscCtrl->pUsbCtrl->device_speed == USB_HIGH_SPEED ) {
+		max_n = USB_HS_MAX_BULK_PACKET;
+	}
+	else {
+		max_n = USB_FS_MAX_BULK_PACKET;
+	}
+	/* data received straight into the destination is handed over one chunk at a time */
+	depth = (pMscCtrl->MSC_GetWriteBuf == 0) ? pMscCtrl->XferBufCnt : 1;
+
+	while ((pMscCtrl->RxLength != 0) && (pMscCtrl->XferQueued < depth)) {
+		n = max_n;
+		if (pMscCtrl->RxLength < n) {
+			n = pMscCtrl->RxLength;
 		}
-		else {
-			n = pMscCtrl->Length;
+		buff = (depth > 1) ? mwMSC_XferSlot(pMscCtrl, pMscCtrl->XferNext) : pMscCtrl->rx_buf;
+		if (pMscCtrl->pUsbCtrl->hw_api->ReadReqEP(pMscCtrl->pUsbCtrl, pMscCtrl->epout_num, buff, n) == 0) {
+			/* endpoint busy, retried on the next completion or NAK */
+			break;
 		}
+		pMscCtrl->RxLength -= n;
+		pMscCtrl->XferQueued++;
+		pMscCtrl->XferNext = mwMSC_XferNextSlot(pMscCtrl, pMscCtrl->XferNext);
+	}
+}
+
+/*
+ *  Check the last storage access for a medium error
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    TRUE if the last MSC_Read() or MSC_Write() call failed
+ */
+
+uint32_t mwMSC_IoFailed(USB_MSC_CTRL_T *pMscCtrl) {
+	return (pMscCtrl->MSC_GetError != 0) && (pMscCtrl->MSC_GetError() != LPC_OK);
+}
+
+/*
+ *  MSC Bulk Transfer Length
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    Number of bytes to move in the next bulk data transfer
+ */
+
+uint32_t mwMSC_XferLen(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t n;
+
+	if (pMscCtrl->XferBufSize != 0) {
+		/* large transfer mode: one transfer descriptor per buffer */
+		n = pMscCtrl->XferBufSize;
+	}
+	else if ( pMscCtrl->pUsbCtrl->device_speed == USB_HIGH_SPEED ) {
+		n = USB_HS_MAX_BULK_PACKET;
 	}
 	else {
-		if (pMscCtrl->Length > USB_FS_MAX_BULK_PACKET) {
-			n = USB_FS_MAX_BULK_PACKET;
+		n = USB_FS_MAX_BULK_PACKET;
+	}
+
+	if (pMscCtrl->Length < n) {
+		n = pMscCtrl->Length;
+	}
+	return n;
+}
+
+/*
+ *  Look up READ data in the read-ahead buffer
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *                   pLen: Bytes wanted, reduced to the bytes available
+ *  Return Value:    Pointer to the buffered data, 0 if not buffered
+ */
+
+uint8_t *mwMSC_PrefetchData(USB_MSC_CTRL_T *pMscCtrl, uint32_t *pLen) {
+	uint32_t avail;
+
+	if ((pMscCtrl->PfLength == 0) ||
+		(pMscCtrl->PfLun != pMscCtrl->CurLun) ||
+		(pMscCtrl->Offset < pMscCtrl->PfOffset) ||
+		(pMscCtrl->Offset >= (pMscCtrl->PfOffset + pMscCtrl->PfLength))) {
+		return 0;
+	}
+	avail = (uint32_t) (pMscCtrl->PfOffset + pMscCtrl->PfLength - pMscCtrl->Offset);
+	if (*pLen > avail) {
+		*pLen = avail;
+	}
+	return &pMscCtrl->PfBuf[pMscCtrl->Offset - pMscCtrl->PfOffset];
+}
+
+/*
+ *  Read the blocks following a sequential READ into the read-ahead buffer
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_Prefetch(USB_MSC_CTRL_T *pMscCtrl) {
+	uint64_t offset = pMscCtrl->SeqOffset;
+	uint32_t len = pMscCtrl->PfSize;
+	uint32_t chunk = (pMscCtrl->XferBufSize != 0) ? pMscCtrl->XferBufSize : pMscCtrl->BlockSize;
+	uint32_t done, n;
+	uint8_t *buff;
+
+	pMscCtrl->PfPending = 0;
+
+	/* the previous read-ahead still covers the next READ */
+	if ((pMscCtrl->PfLength != 0) &&
+		(pMscCtrl->PfLun == pMscCtrl->CurLun) &&
+		(offset >= pMscCtrl->PfOffset) &&
+		(offset < (pMscCtrl->PfOffset + pMscCtrl->PfLength))) {
+		return;
+	}
+	pMscCtrl->PfLength = 0;
+	if (offset >= pMscCtrl->MemorySize) {
+		return;
+	}
+	if (len > (pMscCtrl->MemorySize - offset)) {
+		len = (uint32_t) (pMscCtrl->MemorySize - offset);
+	}
+
+	for (done = 0; done < len; done += n) {
+		n = ((len - done) < chunk) ? (len - done) : chunk;
+		buff = &pMscCtrl->PfBuf[done];
+		pMscCtrl->MSC_Read((uint32_t) ((offset + done) & 0xFFFFFFFF), &buff, n, ((offset + done) >> 32));
+		if (mwMSC_IoFailed(pMscCtrl)) {
+			/* nothing buffered, the READ itself reports the error */
+			return;
 		}
-		else {
-			n = pMscCtrl->Length;
+		/* keep our own copy of zero-copy data */
+		if (buff != &pMscCtrl->PfBuf[done]) {
+			memcpy(&pMscCtrl->PfBuf[done], buff, n);
 		}
 	}
+	pMscCtrl->PfLun = pMscCtrl->CurLun;
+	pMscCtrl->PfOffset = offset;
+	pMscCtrl->PfLength = len;
+}
 
-	/* MemorySize check is done in mwMSC_RWSetup */
-	/* use the default MSC buffer */
-	buff = pMscCtrl->BulkBuf;
-	/* read data from user callback. User could update buffer
-	 * pointer to his own buffer without making extra copy.
-	 */
-	pMscCtrl->MSC_Read(((uint32_t) pMscCtrl->Offset & 0xFFFFFFFF), &buff, n, (pMscCtrl->Offset >> 32));
-	/* send data to host */
-	pMscCtrl->pUsbCtrl->hw_api->WriteEP(pMscCtrl->pUsbCtrl, pMscCtrl->epin_num, buff, n);
-	pMscCtrl->Offset += n;
-	pMscCtrl->Length -= n;
+/*
+ *  MSC Memory Read Callback
+ *  Called automatically on Memory Read Event
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
 
-	pMscCtrl->CSW.dDataResidue -= n;
+void mwMSC_MemoryRead(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t n;
+	uint8_t *buff;
+	uint8_t hit;
+
+	/* fill the next buffer while the previous ones are on the bus */
+	while ((pMscCtrl->Length != 0) && (pMscCtrl->XferQueued < pMscCtrl->XferBufCnt)) {
+		n = mwMSC_XferLen(pMscCtrl);
+
+		/* MemorySize check is done in mwMSC_RWSetup */
+		buff = mwMSC_PrefetchData(pMscCtrl, &n);
+		hit = (buff != 0);
+		if (buff == 0) {
+			/* use the default MSC buffer */
+			buff = mwMSC_XferSlot(pMscCtrl, pMscCtrl->XferNext);
+			/* read data from user callback. User could update buffer
+			 * pointer to his own buffer without making extra copy.
+			 */
+			pMscCtrl->MSC_Read(((uint32_t) pMscCtrl->Offset & 0xFFFFFFFF), &buff, n, (pMscCtrl->Offset >> 32));
+			if (mwMSC_IoFailed(pMscCtrl)) {
+				/* send what is queued, then stall instead of the rest */
+				pMscCtrl->SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+				pMscCtrl->SenseAsc = SCSI_ASC_UNRECOVERED_READ_ERROR;
+				pMscCtrl->Length = 0;
+				break;
+			}
+		}
+		/* send data to host */
+		if (pMscCtrl->pUsbCtrl->hw_api->WriteEP(pMscCtrl->pUsbCtrl, pMscCtrl->epin_num, buff, n) == 0) {
+			/* endpoint busy, the chunk is read again on the next completion */
+			break;
+		}
+		/* count the blocks once they are on their way to the host */
+		if (hit) {
+			pMscCtrl->PfStats.hits += n / pMscCtrl->BlockSize;
+		}
+		else if (pMscCtrl->PfStream) {
+			pMscCtrl->PfStats.misses += n / pMscCtrl->BlockSize;
+		}
+		pMscCtrl->XferQueued++;
+		pMscCtrl->XferNext = mwMSC_XferNextSlot(pMscCtrl, pMscCtrl->XferNext);
+		pMscCtrl->Offset += n;
+		pMscCtrl->Length -= n;
+
+		pMscCtrl->CSW.dDataResidue -= n;
+	}
 
 	if (pMscCtrl->Length == 0) {
 		pMscCtrl->BulkStage = MSC_BS_DATA_IN_LAST;
 	}
 
 	if (pMscCtrl->BulkStage != MSC_BS_DATA_IN) {
-		pMscCtrl->CSW.bStatus = CSW_CMD_PASSED;
+		pMscCtrl->CSW.bStatus = (pMscCtrl->SenseKey == SCSI_SENSE_NO_SENSE) ? CSW_CMD_PASSED : CSW_CMD_FAILED;
+		if ((pMscCtrl->CSW.bStatus == CSW_CMD_FAILED) && (pMscCtrl->XferQueued == 0)) {
+			/* failed on the first chunk, no completion is coming */
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+			mwMSC_SetCSW(pMscCtrl);
+		}
 	}
 }
 
@@ -170,12 +393,23 @@ void mwMSC_MemoryRead(USB_MSC_CTRL_T *pMscCtrl) {
 
 void mwMSC_MemoryWrite(USB_MSC_CTRL_T *pMscCtrl) {
 
+	/* the oldest queued OUT transfer has completed */
+	if (pMscCtrl->XferQueued) {
+		pMscCtrl->XferQueued--;
+	}
 	/* MemorySize check is done in mwMSC_RWSetup */
-	/* write data recived to user destination through callback */
-	pMscCtrl->MSC_Write(((uint32_t) pMscCtrl->Offset & 0xFFFFFFFF),
-						&pMscCtrl->rx_buf /*pMscCtrl->BulkBuf*/,
-						pMscCtrl->BulkLen,
-						(pMscCtrl->Offset >> 32));
+	/* after a failed write the rest of the data is received and dropped */
+	if (pMscCtrl->SenseKey == SCSI_SENSE_NO_SENSE) {
+		/* write data recived to user destination through callback */
+		pMscCtrl->MSC_Write(((uint32_t) pMscCtrl->Offset & 0xFFFFFFFF),
+							&pMscCtrl->rx_buf /*pMscCtrl->BulkBuf*/,
+							pMscCtrl->BulkLen,
+							(pMscCtrl->Offset >> 32));
+		if (mwMSC_IoFailed(pMscCtrl)) {
+			pMscCtrl->SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+			pMscCtrl->SenseAsc = SCSI_ASC_WRITE_ERROR;
+		}
+	}
 
 	pMscCtrl->Offset += pMscCtrl->BulkLen;
 	pMscCtrl->Length -= pMscCtrl->BulkLen;
@@ -183,15 +417,25 @@ void mwMSC_MemoryWrite(USB_MSC_CTRL_T *pMscCtrl) {
 	pMscCtrl->CSW.dDataResidue -= pMscCtrl->BulkLen;
 
 	if ((pMscCtrl->Length == 0) || (pMscCtrl->BulkStage == MSC_BS_CSW)) {
-		pMscCtrl->CSW.bStatus = CSW_CMD_PASSED;
+		pMscCtrl->CSW.bStatus = (pMscCtrl->SenseKey == SCSI_SENSE_NO_SENSE) ? CSW_CMD_PASSED : CSW_CMD_FAILED;
+		/* FUA = 1: the data has to reach the medium before the command completes */
+		if ((pMscCtrl->CBW.CB[1] & 0x08) && (pMscCtrl->MSC_Flush) && (pMscCtrl->MSC_Flush() != LPC_OK)) {
+			pMscCtrl->SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+			pMscCtrl->SenseAsc = SCSI_ASC_WRITE_ERROR;
+			pMscCtrl->CSW.bStatus = CSW_CMD_FAILED;
+		}
 		mwMSC_SetCSW(pMscCtrl);
 		/* transfer is done revert the rx_buff to be same as BukBuf */
 		pMscCtrl->rx_buf = pMscCtrl->BulkBuf;
 	}
 	else {
+		if ((pMscCtrl->MSC_GetWriteBuf == 0) && (pMscCtrl->XferBufCnt > 1)) {
+			/* the next queued buffer completes next */
+			pMscCtrl->XferDone = mwMSC_XferNextSlot(pMscCtrl, pMscCtrl->XferDone);
+			pMscCtrl->rx_buf = mwMSC_XferSlot(pMscCtrl, pMscCtrl->XferDone);
+		}
 		/* check if more data is coming to enqueue hwUSB_ReadReqEP */
-		/* re-use queue logic present in mwMSC_BulkOutNak() function */
-		mwMSC_ReadReqBulkEp(pMscCtrl, pMscCtrl->rx_buf);
+		mwMSC_ReadReqData(pMscCtrl);
 	}
 }
 
@@ -222,6 +466,27 @@ void mwMSC_MemoryVerify(USB_MSC_CTRL_T *pMscCtrl) {
 	}
 }
 
+/*
+ *  Get Big Endian 32-bit CDB Field
+ *  Parameters:      p: Pointer to the most significant byte
+ *  Return Value:    Field value
+ */
+
+uint32_t mwMSC_GetBE32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ *  MSC Number of Blocks of the Current Unit
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    Number of whole blocks in MemorySize, which may exceed the
+ *                   32-bit BlockCount of large media
+ */
+
+uint64_t mwMSC_BlockCount64(USB_MSC_CTRL_T *pMscCtrl) {
+	return (pMscCtrl->BlockSize == 0) ? 0 : (pMscCtrl->MemorySize / pMscCtrl->BlockSize);
+}
+
 /*
  *  MSC SCSI Read/Write Setup Callback
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -229,15 +494,21 @@ void mwMSC_MemoryVerify(USB_MSC_CTRL_T *pMscCtrl) {
  */
 
 ErrorCode_t mwMSC_RWSetup(USB_MSC_CTRL_T *pMscCtrl) {
-	uint32_t n;
+	uint64_t lba;
+	uint32_t n = 0;
 
 	/* Logical Block Address of First Block */
-	n = (pMscCtrl->CBW.CB[2] << 24) |
-		(pMscCtrl->CBW.CB[3] << 16) |
-		(pMscCtrl->CBW.CB[4] <<  8) |
-		(pMscCtrl->CBW.CB[5] <<  0);
+	switch (pMscCtrl->CBW.CB[0]) {
+	case SCSI_READ16:
+	case SCSI_WRITE16:
+		lba = ((uint64_t) mwMSC_GetBE32(&pMscCtrl->CBW.CB[2]) << 32) |
+			  mwMSC_GetBE32(&pMscCtrl->CBW.CB[6]);
+		break;
 
-	pMscCtrl->Offset = n * pMscCtrl->BlockSize;
+	default:
+		lba = mwMSC_GetBE32(&pMscCtrl->CBW.CB[2]);
+		break;
+	}
 
 	/* Number of Blocks to transfer */
 	switch (pMscCtrl->CBW.CB[0]) {
@@ -250,16 +521,19 @@ ErrorCode_t mwMSC_RWSetup(USB_MSC_CTRL_T *pMscCtrl) {
 
 	case SCSI_READ12:
 	case SCSI_WRITE12:
-		n = (pMscCtrl->CBW.CB[6] << 24) |
-			(pMscCtrl->CBW.CB[7] << 16) |
-			(pMscCtrl->CBW.CB[8] <<  8) |
-			(pMscCtrl->CBW.CB[9] <<  0);
+		n = mwMSC_GetBE32(&pMscCtrl->CBW.CB[6]);
+		break;
+
+	case SCSI_READ16:
+	case SCSI_WRITE16:
+		n = mwMSC_GetBE32(&pMscCtrl->CBW.CB[10]);
 		break;
 
 	default:
 		break;
 	}
 
+	pMscCtrl->Offset = lba * pMscCtrl->BlockSize;
 	pMscCtrl->Length = n * pMscCtrl->BlockSize;
 
 	if (pMscCtrl->CBW.dDataLength == 0) {
@@ -269,8 +543,16 @@ ErrorCode_t mwMSC_RWSetup(USB_MSC_CTRL_T *pMscCtrl) {
 		return ERR_USBD_INVALID_REQ;
 	}
 
+	/* range is checked in blocks, a huge LBA would wrap the byte offset */
+	if ((lba > mwMSC_BlockCount64(pMscCtrl)) ||
+		(n > (mwMSC_BlockCount64(pMscCtrl) - lba))) {
+		pMscCtrl->SenseKey = SCSI_SENSE_ILLEGAL_REQUEST;
+		pMscCtrl->SenseAsc = SCSI_ASC_LBA_OUT_OF_RANGE;
+	}
+
 	if ( (pMscCtrl->CBW.dDataLength != pMscCtrl->Length) ||
-		 ((pMscCtrl->Offset + pMscCtrl->Length) > pMscCtrl->MemorySize) ) {
+		 (((uint64_t) n * pMscCtrl->BlockSize) != pMscCtrl->Length) ||
+		 (pMscCtrl->SenseKey != SCSI_SENSE_NO_SENSE) ) {
 		if ((pMscCtrl->CBW.bmFlags & 0x80) != 0) {	/* stall appropriate EP */
 			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
 		}
@@ -331,6 +613,30 @@ void mwMSC_DataInTransfer(USB_MSC_CTRL_T *pMscCtrl) {
 	pMscCtrl->CSW.bStatus = CSW_CMD_PASSED;
 }
 
+/*
+ *  MSC Fail the Current Command before its data phase
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *                   key: Sense key returned by the next REQUEST SENSE
+ *                   asc: Additional sense code
+ *  Return Value:    None
+ */
+
+void mwMSC_CmdFailed(USB_MSC_CTRL_T *pMscCtrl, uint8_t key, uint8_t asc) {
+
+	pMscCtrl->SenseKey = key;
+	pMscCtrl->SenseAsc = asc;
+	if (pMscCtrl->CBW.dDataLength != 0) {
+		if ((pMscCtrl->CBW.bmFlags & 0x80) != 0) {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+		}
+		else {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epout_num);
+		}
+	}
+	pMscCtrl->CSW.bStatus = CSW_CMD_FAILED;
+	mwMSC_SetCSW(pMscCtrl);
+}
+
 /*
  *  MSC SCSI Test Unit Ready Callback
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -352,6 +658,241 @@ void mwMSC_TestUnitReady(USB_MSC_CTRL_T *pMscCtrl) {
 	mwMSC_SetCSW(pMscCtrl);
 }
 
+/*
+ *  MSC SCSI Synchronize Cache Callback
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_SyncCache(USB_MSC_CTRL_T *pMscCtrl) {
+
+	if (pMscCtrl->CBW.dDataLength != 0) {
+		if ((pMscCtrl->CBW.bmFlags & 0x80) != 0) {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+		}
+		else {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epout_num);
+		}
+	}
+
+	pMscCtrl->CSW.bStatus = CSW_CMD_PASSED;
+	/* write back whatever the application caches */
+	if ((pMscCtrl->MSC_Flush) && (pMscCtrl->MSC_Flush() != LPC_OK)) {
+		pMscCtrl->SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+		pMscCtrl->SenseAsc = SCSI_ASC_WRITE_ERROR;
+		pMscCtrl->CSW.bStatus = CSW_CMD_FAILED;
+	}
+	mwMSC_SetCSW(pMscCtrl);
+}
+
+/*
+ *  MSC SCSI Verify Without Data Callback (BYTCHK = 0)
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_VerifyRange(USB_MSC_CTRL_T *pMscCtrl) {
+	uint64_t lba, blocks, offset;
+	uint32_t n;
+
+	lba = mwMSC_GetBE32(&pMscCtrl->CBW.CB[2]);
+	n = (pMscCtrl->CBW.CB[7] << 8) | pMscCtrl->CBW.CB[8];
+	blocks = mwMSC_BlockCount64(pMscCtrl);
+
+	if ((lba > blocks) || (n > (blocks - lba))) {
+		mwMSC_CmdFailed(pMscCtrl, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE);
+		return;
+	}
+	if ((n != 0) && (pMscCtrl->MSC_VerifyRange)) {
+		/* a 16-bit block count fits a 32-bit length for blocks up to 64kB */
+		offset = lba * pMscCtrl->BlockSize;
+		if (pMscCtrl->MSC_VerifyRange(((uint32_t) offset & 0xFFFFFFFF), n * pMscCtrl->BlockSize,
+									  (offset >> 32)) != LPC_OK) {
+			mwMSC_CmdFailed(pMscCtrl, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_UNRECOVERED_READ_ERROR);
+			return;
+		}
+	}
+	if (pMscCtrl->CBW.dDataLength != 0) {
+		if ((pMscCtrl->CBW.bmFlags & 0x80) != 0) {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+		}
+		else {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epout_num);
+		}
+	}
+	pMscCtrl->CSW.bStatus = CSW_CMD_PASSED;
+	mwMSC_SetCSW(pMscCtrl);
+}
+
+/*
+ *  MSC Unmap Extent
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *                   lba: First block of the extent
+ *                   n: Number of blocks
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwMSC_UnmapExtent(USB_MSC_CTRL_T *pMscCtrl, uint64_t lba, uint64_t n) {
+	uint64_t offset;
+	uint32_t max, cnt;
+
+	/* the callback takes a 32-bit byte count */
+	max = 0xFFFFFFFF / pMscCtrl->BlockSize;
+	while (n != 0) {
+		cnt = (n < max) ? (uint32_t) n : max;
+		offset = lba * pMscCtrl->BlockSize;
+		if (pMscCtrl->MSC_Unmap(((uint32_t) offset & 0xFFFFFFFF), cnt * pMscCtrl->BlockSize, (offset >> 32)) != LPC_OK) {
+			pMscCtrl->SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+			pMscCtrl->SenseAsc = SCSI_ASC_WRITE_ERROR;
+			return ERR_FAILED;
+		}
+		lba += cnt;
+		n -= cnt;
+	}
+	return LPC_OK;
+}
+
+/*
+ *  MSC SCSI Unmap Parameter List Callback
+ *  All block descriptors are range checked first and sorted by LBA, then
+ *  descriptors which touch or overlap the previous one are merged and each
+ *  resulting extent is passed to MSC_Unmap().
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    CSW status of the command
+ */
+
+uint32_t mwMSC_UnmapList(USB_MSC_CTRL_T *pMscCtrl) {
+	uint8_t *pDesc;
+	uint64_t lba, start = 0, end = 0;
+	uint32_t i, j, n, cnt;
+	uint8_t tmp[16];
+
+	if (pMscCtrl->Length < 8) {
+		return CSW_CMD_FAILED;
+	}
+	/* Block Descriptor Data Length */
+	cnt = (pMscCtrl->BulkBuf[2] << 8) | pMscCtrl->BulkBuf[3];
+	if (cnt > (pMscCtrl->Length - 8)) {
+		cnt = pMscCtrl->Length - 8;
+	}
+	cnt /= 16;
+
+	for (i = 0; i < cnt; i++) {
+		pDesc = &pMscCtrl->BulkBuf[8 + (16 * i)];
+		lba = ((uint64_t) mwMSC_GetBE32(&pDesc[0]) << 32) | mwMSC_GetBE32(&pDesc[4]);
+		n = mwMSC_GetBE32(&pDesc[8]);
+		if ((lba > mwMSC_BlockCount64(pMscCtrl)) || (n > (mwMSC_BlockCount64(pMscCtrl) - lba))) {
+			pMscCtrl->SenseKey = SCSI_SENSE_ILLEGAL_REQUEST;
+			pMscCtrl->SenseAsc = SCSI_ASC_LBA_OUT_OF_RANGE;
+			return CSW_CMD_FAILED;
+		}
+	}
+
+	/* insertion sort, the bulk buffer holds a few dozen descriptors at most.
+	   The LBA is big endian, so comparing its bytes compares the numbers. */
+	for (i = 1; i < cnt; i++) {
+		memcpy(tmp, &pMscCtrl->BulkBuf[8 + (16 * i)], 16);
+		for (j = i; j > 0; j--) {
+			pDesc = &pMscCtrl->BulkBuf[8 + (16 * (j - 1))];
+			if (memcmp(pDesc, tmp, 8) <= 0) {
+				break;
+			}
+			memcpy(pDesc + 16, pDesc, 16);
+		}
+		memcpy(&pMscCtrl->BulkBuf[8 + (16 * j)], tmp, 16);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		pDesc = &pMscCtrl->BulkBuf[8 + (16 * i)];
+		lba = ((uint64_t) mwMSC_GetBE32(&pDesc[0]) << 32) | mwMSC_GetBE32(&pDesc[4]);
+		n = mwMSC_GetBE32(&pDesc[8]);
+		if (n == 0) {
+			continue;
+		}
+		if ((end != start) && (lba >= start) && (lba <= end)) {
+			/* extend the current extent */
+			if ((lba + n) > end) {
+				end = lba + n;
+			}
+			continue;
+		}
+		if ((end != start) && (mwMSC_UnmapExtent(pMscCtrl, start, end - start) != LPC_OK)) {
+			return CSW_CMD_FAILED;
+		}
+		start = lba;
+		end = lba + n;
+	}
+	if ((end != start) && (mwMSC_UnmapExtent(pMscCtrl, start, end - start) != LPC_OK)) {
+		return CSW_CMD_FAILED;
+	}
+	return CSW_CMD_PASSED;
+}
+
+/*
+ *  MSC SCSI Unmap Callback
+ *  The parameter list is received into the bulk buffer.
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_Unmap(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t len;
+
+	/* Parameter List Length */
+	len = (pMscCtrl->CBW.CB[7] << 8) | pMscCtrl->CBW.CB[8];
+
+	if (pMscCtrl->CBW.dDataLength == 0) {
+		/* host sends no data */
+		pMscCtrl->CSW.bStatus = (len == 0) ? CSW_CMD_PASSED : CSW_CMD_FAILED;
+		mwMSC_SetCSW(pMscCtrl);
+		return;
+	}
+	if (((pMscCtrl->CBW.bmFlags & 0x80) != 0) ||
+		(pMscCtrl->CBW.dDataLength != len) ||
+		(len > sizeof(pMscCtrl->BulkBuf))) {
+		if ((pMscCtrl->CBW.bmFlags & 0x80) != 0) {	/* stall appropriate EP */
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+		}
+		else {
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epout_num);
+		}
+		pMscCtrl->CSW.bStatus = CSW_CMD_FAILED;
+		mwMSC_SetCSW(pMscCtrl);
+		return;
+	}
+
+	pMscCtrl->BulkStage = MSC_BS_DATA_OUT;
+	/* read-ahead data may be discarded */
+	pMscCtrl->PfLength = 0;
+	/* Offset counts the parameter list bytes received */
+	pMscCtrl->Offset = 0;
+	pMscCtrl->Length = len;
+	pMscCtrl->rx_buf = pMscCtrl->BulkBuf;
+}
+
+/*
+ *  MSC SCSI Unmap Data Callback
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_UnmapData(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t n = pMscCtrl->BulkLen;
+
+	if (n > (pMscCtrl->Length - pMscCtrl->Offset)) {
+		n = pMscCtrl->Length - pMscCtrl->Offset;
+	}
+	pMscCtrl->Offset += n;
+	pMscCtrl->rx_buf = &pMscCtrl->BulkBuf[pMscCtrl->Offset];
+	pMscCtrl->CSW.dDataResidue -= n;
+
+	if (pMscCtrl->Offset == pMscCtrl->Length) {
+		pMscCtrl->rx_buf = pMscCtrl->BulkBuf;
+		pMscCtrl->CSW.bStatus = mwMSC_UnmapList(pMscCtrl);
+		mwMSC_SetCSW(pMscCtrl);
+	}
+}
+
 /*
  *  MSC SCSI Request Sense Callback
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -389,11 +930,69 @@ void mwMSC_RequestSense(USB_MSC_CTRL_T *pMscCtrl) {
 	pMscCtrl->BulkBuf[7] = 0x0A;		// Additional Length
 	pMscCtrl->BulkBuf[12] = 0x30;		// ASC
 	pMscCtrl->BulkBuf[13] = 0x01;		// ASCQ
+	if (pMscCtrl->SenseKey != SCSI_SENSE_NO_SENSE) {
+		/* reason the previous command failed */
+		pMscCtrl->BulkBuf[2] = pMscCtrl->SenseKey;
+		pMscCtrl->BulkBuf[12] = pMscCtrl->SenseAsc;
+		pMscCtrl->BulkBuf[13] = 0x00;
+		pMscCtrl->SenseKey = SCSI_SENSE_NO_SENSE;
+	}
 
 	pMscCtrl->BulkLen = 18;
 	mwMSC_DataInTransfer(pMscCtrl);
 }
 
+/*
+ *  MSC SCSI Inquiry Vital Product Data Callback
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_InquiryVPD(USB_MSC_CTRL_T *pMscCtrl) {
+
+	memset((void *) &pMscCtrl->BulkBuf[0], 0, 64);
+	pMscCtrl->BulkBuf[1] = pMscCtrl->CBW.CB[2];	/* Page Code */
+
+	switch (pMscCtrl->CBW.CB[2]) {
+	case SCSI_VPD_SUPPORTED_PAGES:
+		pMscCtrl->BulkBuf[3] = 3;		/* Page Length */
+		pMscCtrl->BulkBuf[4] = SCSI_VPD_SUPPORTED_PAGES;
+		pMscCtrl->BulkBuf[5] = SCSI_VPD_BLOCK_LIMITS;
+		pMscCtrl->BulkBuf[6] = SCSI_VPD_LB_PROVISIONING;
+		pMscCtrl->BulkLen = 4 + 3;
+		break;
+
+	case SCSI_VPD_BLOCK_LIMITS:
+		pMscCtrl->BulkBuf[3] = 0x3C;	/* Page Length */
+		if (pMscCtrl->MSC_Unmap) {
+			/* Maximum Unmap LBA Count: no limit */
+			memset((void *) &pMscCtrl->BulkBuf[20], 0xFF, 4);
+			/* Maximum Unmap Block Descriptor Count */
+			pMscCtrl->BulkBuf[27] = USB_MSC_MAX_UNMAP_DESC;
+		}
+		pMscCtrl->BulkLen = 4 + 0x3C;
+		break;
+
+	case SCSI_VPD_LB_PROVISIONING:
+		pMscCtrl->BulkBuf[3] = 4;		/* Page Length */
+		if (pMscCtrl->MSC_Unmap) {
+			pMscCtrl->BulkBuf[5] = 0x80;	/* LBPU = 1: UNMAP supported */
+			pMscCtrl->BulkBuf[6] = 0x02;	/* Provisioning Type: thin */
+		}
+		pMscCtrl->BulkLen = 4 + 4;
+		break;
+
+	default:
+		/* page not supported */
+		mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+		pMscCtrl->CSW.bStatus = CSW_CMD_FAILED;
+		mwMSC_SetCSW(pMscCtrl);
+		return;
+	}
+
+	mwMSC_DataInTransfer(pMscCtrl);
+}
+
 /*
  *  MSC SCSI Inquiry Callback
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -408,10 +1007,21 @@ void mwMSC_Inquiry(USB_MSC_CTRL_T *pMscCtrl) {
 		return;
 	}
 
+	if (pMscCtrl->CBW.CB[1] & 0x01) {
+		/* EVPD = 1 */
+		mwMSC_InquiryVPD(pMscCtrl);
+		return;
+	}
+
 	pMscCtrl->BulkBuf[0] = 0x00;		/* Direct Access Device */
 	pMscCtrl->BulkBuf[1] = 0x80;		/* RMB = 1: Removable Medium */
 	pMscCtrl->BulkBuf[2] = 0x00;		/* Version: No conformance claim to standard */
 	pMscCtrl->BulkBuf[3] = 0x01;
+	if (pMscCtrl->MSC_Unmap) {
+		/* hosts look for the provisioning pages on SPC-3 devices only */
+		pMscCtrl->BulkBuf[2] = 0x05;	/* Version: SPC-3 */
+		pMscCtrl->BulkBuf[3] = 0x02;	/* Response Data Format */
+	}
 
 	pMscCtrl->BulkBuf[4] = 36 - 4;		/* Additional Length */
 	pMscCtrl->BulkBuf[5] = 0x80;		/* SCCS = 1: Storage Controller Component */
@@ -429,6 +1039,31 @@ void mwMSC_Inquiry(USB_MSC_CTRL_T *pMscCtrl) {
 	mwMSC_DataInTransfer(pMscCtrl);
 }
 
+/*
+ *  MSC SCSI Mode Pages
+ *  Only the Caching page is reported, with WCE set when MSC_Flush() is there
+ *  to write the cache back. Other pages are returned empty.
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *                   buf: Destination of the pages
+ *  Return Value:    Length of the pages in bytes
+ */
+
+uint32_t mwMSC_ModePages(USB_MSC_CTRL_T *pMscCtrl, uint8_t *buf) {
+	uint32_t page = pMscCtrl->CBW.CB[2] & 0x3F;
+
+	if ((page != SCSI_MODE_PAGE_CACHING) && (page != SCSI_MODE_PAGE_ALL)) {
+		return 0;
+	}
+	memset((void *) buf, 0, 20);
+	buf[0] = SCSI_MODE_PAGE_CACHING;	/* Page Code */
+	buf[1] = 0x12;						/* Page Length */
+	/* PC = 1 asks for the changeable values, none are */
+	if ((pMscCtrl->MSC_Flush) && ((pMscCtrl->CBW.CB[2] & 0xC0) != 0x40)) {
+		buf[2] = 0x04;					/* WCE = 1: write cache enabled */
+	}
+	return 20;
+}
+
 /*
  *  MSC SCSI Mode Sense (6-Byte) Callback
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -436,17 +1071,19 @@ void mwMSC_Inquiry(USB_MSC_CTRL_T *pMscCtrl) {
  */
 
 void mwMSC_ModeSense6(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t len;
 
 	if (mwMSC_DataInFormat(pMscCtrl) != LPC_OK) {
 		return;
 	}
 
-	pMscCtrl->BulkBuf[0] = 0x03;
+	len = mwMSC_ModePages(pMscCtrl, &pMscCtrl->BulkBuf[4]);
+	pMscCtrl->BulkBuf[0] = 0x03 + len;
 	pMscCtrl->BulkBuf[1] = 0x00;
-	pMscCtrl->BulkBuf[2] = 0x00;
+	pMscCtrl->BulkBuf[2] = (pMscCtrl->MSC_Flush) ? 0x10 : 0x00;	/* DPOFUA */
 	pMscCtrl->BulkBuf[3] = 0x00;
 
-	pMscCtrl->BulkLen = 4;
+	pMscCtrl->BulkLen = 4 + len;
 	mwMSC_DataInTransfer(pMscCtrl);
 }
 
@@ -457,6 +1094,7 @@ void mwMSC_ModeSense6(USB_MSC_CTRL_T *pMscCtrl) {
  */
 
 void mwMSC_ModeSense10(USB_MSC_CTRL_T *pMscCtrl) {
+	uint32_t len;
 
 	if (mwMSC_DataInFormat(pMscCtrl) != LPC_OK) {
 		return;
@@ -472,9 +1110,11 @@ void mwMSC_ModeSense10(USB_MSC_CTRL_T *pMscCtrl) {
 	   pMscCtrl->BulkBuf[ 7] = 0x00;
 	 */
 	memset((void *) &pMscCtrl->BulkBuf[0], 0, 8);
-	pMscCtrl->BulkBuf[1] = 0x06;
+	len = mwMSC_ModePages(pMscCtrl, &pMscCtrl->BulkBuf[8]);
+	pMscCtrl->BulkBuf[1] = 0x06 + len;
+	pMscCtrl->BulkBuf[3] = (pMscCtrl->MSC_Flush) ? 0x10 : 0x00;	/* DPOFUA */
 
-	pMscCtrl->BulkLen = 8;
+	pMscCtrl->BulkLen = 8 + len;
 	mwMSC_DataInTransfer(pMscCtrl);
 }
 
@@ -489,12 +1129,23 @@ void mwMSC_ReadCapacity(USB_MSC_CTRL_T *pMscCtrl) {
 	if (mwMSC_DataInFormat(pMscCtrl) != LPC_OK) {
 		return;
 	}
+	if (mwMSC_BlockCount64(pMscCtrl) == 0) {
+		/* no medium, there is no last LBA to report */
+		mwMSC_CmdFailed(pMscCtrl, SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT);
+		return;
+	}
 
 	/* Last Logical Block */
-	pMscCtrl->BulkBuf[0] = ((pMscCtrl->BlockCount - 1) >> 24) & 0xFF;
-	pMscCtrl->BulkBuf[1] = ((pMscCtrl->BlockCount - 1) >> 16) & 0xFF;
-	pMscCtrl->BulkBuf[2] = ((pMscCtrl->BlockCount - 1) >>  8) & 0xFF;
-	pMscCtrl->BulkBuf[3] = ((pMscCtrl->BlockCount - 1) >>  0) & 0xFF;
+	if (mwMSC_BlockCount64(pMscCtrl) > 0xFFFFFFFF) {
+		/* too large, the host has to use READ CAPACITY(16) */
+		memset((void *) &pMscCtrl->BulkBuf[0], 0xFF, 4);
+	}
+	else {
+		pMscCtrl->BulkBuf[0] = ((pMscCtrl->BlockCount - 1) >> 24) & 0xFF;
+		pMscCtrl->BulkBuf[1] = ((pMscCtrl->BlockCount - 1) >> 16) & 0xFF;
+		pMscCtrl->BulkBuf[2] = ((pMscCtrl->BlockCount - 1) >>  8) & 0xFF;
+		pMscCtrl->BulkBuf[3] = ((pMscCtrl->BlockCount - 1) >>  0) & 0xFF;
+	}
 
 	/* Block Length */
 	pMscCtrl->BulkBuf[4] = (pMscCtrl->BlockSize >> 24) & 0xFF;
@@ -506,6 +1157,48 @@ void mwMSC_ReadCapacity(USB_MSC_CTRL_T *pMscCtrl) {
 	mwMSC_DataInTransfer(pMscCtrl);
 }
 
+/*
+ *  MSC SCSI Read Capacity (16) Callback
+ *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
+ *  Return Value:    None
+ */
+
+void mwMSC_ReadCapacity16(USB_MSC_CTRL_T *pMscCtrl) {
+	uint64_t last = mwMSC_BlockCount64(pMscCtrl) - 1;
+	uint32_t alloc, i;
+
+	if (mwMSC_DataInFormat(pMscCtrl) != LPC_OK) {
+		return;
+	}
+	if (mwMSC_BlockCount64(pMscCtrl) == 0) {
+		/* no medium, there is no last LBA to report */
+		mwMSC_CmdFailed(pMscCtrl, SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT);
+		return;
+	}
+
+	memset((void *) &pMscCtrl->BulkBuf[0], 0, 32);
+
+	/* Last Logical Block */
+	for (i = 0; i < 8; i++) {
+		pMscCtrl->BulkBuf[i] = (last >> (56 - (8 * i))) & 0xFF;
+	}
+
+	/* Block Length */
+	pMscCtrl->BulkBuf[8] = (pMscCtrl->BlockSize >> 24) & 0xFF;
+	pMscCtrl->BulkBuf[9] = (pMscCtrl->BlockSize >> 16) & 0xFF;
+	pMscCtrl->BulkBuf[10] = (pMscCtrl->BlockSize >>  8) & 0xFF;
+	pMscCtrl->BulkBuf[11] = (pMscCtrl->BlockSize >>  0) & 0xFF;
+
+	if (pMscCtrl->MSC_Unmap) {
+		pMscCtrl->BulkBuf[14] = 0x80;	/* LBPME = 1: logical block provisioning */
+	}
+
+	/* Allocation Length */
+	alloc = mwMSC_GetBE32(&pMscCtrl->CBW.CB[10]);
+	pMscCtrl->BulkLen = (alloc < 32) ? alloc : 32;
+	mwMSC_DataInTransfer(pMscCtrl);
+}
+
 /*
  *  MSC SCSI Read Format Capacity Callback
  *  Parameters:      pMscCtrl: Handle to MSC structure (global variables)
@@ -553,9 +1246,12 @@ void mwMSC_GetCBW(USB_MSC_CTRL_T *pMscCtrl) {
 	}
 	if ((pMscCtrl->BulkLen == sizeof(MSC_CBW)) && (pMscCtrl->CBW.dSignature == MSC_CBW_Signature)) {
 		/* Valid CBW */
+		pMscCtrl->XferQueued = 0;
+		pMscCtrl->XferNext = 0;
+		pMscCtrl->XferDone = 0;
 		pMscCtrl->CSW.dTag = pMscCtrl->CBW.dTag;
 		pMscCtrl->CSW.dDataResidue = pMscCtrl->CBW.dDataLength;
-		if ((pMscCtrl->CBW.bLUN != 0)     ||
+		if ((pMscCtrl->CBW.bLUN >= pMscCtrl->NumLUNs) ||
 			(pMscCtrl->CBW.bCBLength < 1) ||
 			(pMscCtrl->CBW.bCBLength > 16) ) {
 fail:
@@ -569,6 +1265,13 @@ fail:
 			mwMSC_SetCSW(pMscCtrl);
 		}
 		else {
+			if (pMscCtrl->CBW.bLUN != pMscCtrl->CurLun) {
+				mwMSC_SelectLUN(pMscCtrl, pMscCtrl->CBW.bLUN);
+			}
+			/* sense data describes the last command only */
+			if (pMscCtrl->CBW.CB[0] != SCSI_REQUEST_SENSE) {
+				pMscCtrl->SenseKey = SCSI_SENSE_NO_SENSE;
+			}
 			switch (pMscCtrl->CBW.CB[0]) {
 			case SCSI_TEST_UNIT_READY:
 				mwMSC_TestUnitReady(pMscCtrl);
@@ -598,11 +1301,25 @@ fail:
 				mwMSC_ReadCapacity(pMscCtrl);
 				break;
 
+			case SCSI_SERVICE_ACTION_IN16:
+				if ((pMscCtrl->CBW.CB[1] & 0x1F) != SCSI_SA_READ_CAPACITY16) {
+					goto fail;
+				}
+				mwMSC_ReadCapacity16(pMscCtrl);
+				break;
+
 			case SCSI_READ10:
 			case SCSI_READ12:
+			case SCSI_READ16:
 				if (mwMSC_RWSetup(pMscCtrl) == LPC_OK) {
 					if ((pMscCtrl->CBW.bmFlags & 0x80) != 0) {
 						pMscCtrl->BulkStage = MSC_BS_DATA_IN;
+						/* a READ continuing the previous one makes a stream worth reading ahead */
+						pMscCtrl->PfStream = (pMscCtrl->PfSize != 0) && (pMscCtrl->CurLun == pMscCtrl->SeqLun) &&
+											 (pMscCtrl->Offset == pMscCtrl->SeqOffset);
+						pMscCtrl->PfPending = pMscCtrl->PfStream;
+						pMscCtrl->SeqLun = pMscCtrl->CurLun;
+						pMscCtrl->SeqOffset = pMscCtrl->Offset + pMscCtrl->Length;
 						mwMSC_MemoryRead(pMscCtrl);
 					}
 					else {
@@ -615,18 +1332,22 @@ fail:
 
 			case SCSI_WRITE10:
 			case SCSI_WRITE12:
+			case SCSI_WRITE16:
 				if (mwMSC_RWSetup(pMscCtrl) == LPC_OK) {
 					if ((pMscCtrl->CBW.bmFlags & 0x80) == 0) {
 						pMscCtrl->BulkStage = MSC_BS_DATA_OUT;
-						pMscCtrl->rx_buf = pMscCtrl->BulkBuf;
+						/* read-ahead data may be overwritten */
+						pMscCtrl->PfLength = 0;
+						pMscCtrl->RxLength = pMscCtrl->Length;
+						pMscCtrl->rx_buf = pMscCtrl->XferBuf;
 						/* get destination buffer */
 						if (pMscCtrl->MSC_GetWriteBuf) {
 							pMscCtrl->MSC_GetWriteBuf(((uint32_t) pMscCtrl->Offset & 0xFFFFFFFF),
 													  &pMscCtrl->rx_buf,
-													  pMscCtrl->BulkLen,
+													  pMscCtrl->Length,
 													  (pMscCtrl->Offset >> 32));
 						}
-						mwMSC_ReadReqBulkEp(pMscCtrl, pMscCtrl->rx_buf);
+						mwMSC_ReadReqData(pMscCtrl);
 					}
 					else {
 						mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
@@ -638,9 +1359,8 @@ fail:
 
 			case SCSI_VERIFY10:
 				if ((pMscCtrl->CBW.CB[1] & 0x02) == 0) {
-					// BYTCHK = 0 -> CRC Check (not implemented)
-					pMscCtrl->CSW.bStatus = CSW_CMD_PASSED;
-					mwMSC_SetCSW(pMscCtrl);
+					/* BYTCHK = 0 -> check at the medium, no data phase */
+					mwMSC_VerifyRange(pMscCtrl);
 					break;
 				}
 
@@ -657,6 +1377,18 @@ fail:
 				}
 				break;
 
+			case SCSI_SYNC_CACHE10:
+			case SCSI_SYNC_CACHE16:
+				mwMSC_SyncCache(pMscCtrl);
+				break;
+
+			case SCSI_UNMAP:
+				if (pMscCtrl->MSC_Unmap == 0) {
+					goto fail;
+				}
+				mwMSC_Unmap(pMscCtrl);
+				break;
+
 			case SCSI_FORMAT_UNIT:
 			case SCSI_START_STOP_UNIT:
 			case SCSI_MEDIA_REMOVAL:
@@ -706,6 +1438,10 @@ void mwMSC_BulkIn(USB_MSC_CTRL_T *pMscCtrl) {
 		switch (pMscCtrl->CBW.CB[0]) {
 		case SCSI_READ10:
 		case SCSI_READ12:
+		case SCSI_READ16:
+			if (pMscCtrl->XferQueued) {
+				pMscCtrl->XferQueued--;
+			}
 			mwMSC_MemoryRead(pMscCtrl);
 			break;
 
@@ -715,6 +1451,16 @@ void mwMSC_BulkIn(USB_MSC_CTRL_T *pMscCtrl) {
 		break;
 
 	case MSC_BS_DATA_IN_LAST:
+		/* wait for the last queued data transfer */
+		if (pMscCtrl->XferQueued > 1) {
+			pMscCtrl->XferQueued--;
+			break;
+		}
+		pMscCtrl->XferQueued = 0;
+		if (pMscCtrl->CSW.bStatus == CSW_CMD_FAILED) {
+			/* READ stopped on a medium error, the host expects more data */
+			mwMSC_SetStallEP(pMscCtrl, pMscCtrl->epin_num);
+		}
 		mwMSC_SetCSW(pMscCtrl);
 		break;
 
@@ -725,6 +1471,10 @@ void mwMSC_BulkIn(USB_MSC_CTRL_T *pMscCtrl) {
 
 	case MSC_BS_CSW:
 		pMscCtrl->BulkStage = MSC_BS_CBW;
+		/* read ahead while the host sends the next CBW */
+		if (pMscCtrl->PfPending) {
+			mwMSC_Prefetch(pMscCtrl);
+		}
 		break;
 
 	default:
@@ -750,6 +1500,7 @@ void mwMSC_BulkOut(USB_MSC_CTRL_T *pMscCtrl) {
 		switch (pMscCtrl->CBW.CB[0]) {
 		case SCSI_WRITE10:
 		case SCSI_WRITE12:
+		case SCSI_WRITE16:
 			mwMSC_MemoryWrite(pMscCtrl);
 			break;
 
@@ -757,6 +1508,10 @@ void mwMSC_BulkOut(USB_MSC_CTRL_T *pMscCtrl) {
 			mwMSC_MemoryVerify(pMscCtrl);
 			break;
 
+		case SCSI_UNMAP:
+			mwMSC_UnmapData(pMscCtrl);
+			break;
+
 		default:
 			break;
 		}
@@ -900,7 +1655,18 @@ ErrorCode_t mwMSC_bulk_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 	USB_MSC_CTRL_T *pMscCtrl = (USB_MSC_CTRL_T *) data;
 	switch (event) {
 	case USB_EVT_OUT_NAK:
-		mwMSC_ReadReqBulkEp(pMscCtrl, pMscCtrl->BulkBuf);
+		if ((pMscCtrl->BulkStage == MSC_BS_DATA_OUT) &&
+			((pMscCtrl->CBW.CB[0] == SCSI_WRITE10) || (pMscCtrl->CBW.CB[0] == SCSI_WRITE12) ||
+			 (pMscCtrl->CBW.CB[0] == SCSI_WRITE16))) {
+			mwMSC_ReadReqData(pMscCtrl);
+		}
+		else if ((pMscCtrl->BulkStage == MSC_BS_DATA_OUT) && (pMscCtrl->CBW.CB[0] == SCSI_UNMAP)) {
+			/* full speed parameter lists span several packets */
+			mwMSC_ReadReqBulkEp(pMscCtrl, pMscCtrl->rx_buf);
+		}
+		else {
+			mwMSC_ReadReqBulkEp(pMscCtrl, pMscCtrl->BulkBuf);
+		}
 		break;
 
 	case USB_EVT_OUT:
@@ -913,6 +1679,154 @@ ErrorCode_t mwMSC_bulk_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
 	return LPC_OK;
 }
 
+/*
+ *  Get the read-ahead counters of an MSC function
+ *  Parameters:      hUsb: Handle to the USB device stack.
+ *                   ep_in: Bulk IN endpoint address of the MSC function.
+ *                   stats: Returns the counters.
+ *                   clear: Non-zero to clear the counters.
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwMSC_GetPrefetchStats(USBD_HANDLE_T hUsb, uint32_t ep_in, USBD_MSC_PREFETCH_STATS_T *stats, uint32_t clear)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	USB_MSC_CTRL_T *pMscCtrl;
+	uint32_t ep_indx = ((ep_in & 0x0F) << 1) + 1;
+
+	if ((ep_indx >= (2 * USB_MAX_EP_NUM)) || (pCtrl->ep_event_hdlr[ep_indx] != mwMSC_bulk_in_hdlr)) {
+		return ERR_API_INVALID_PARAM2;
+	}
+	pMscCtrl = (USB_MSC_CTRL_T *) pCtrl->ep_hdlr_data[ep_indx];
+
+	*stats = pMscCtrl->PfStats;
+	if (clear) {
+		memset(&pMscCtrl->PfStats, 0, sizeof(USBD_MSC_PREFETCH_STATS_T));
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Number of logical units requested by the application
+ *  Parameters:      param: MSC function driver initialization parameters.
+ *  Return Value:    Number of LUNs, at least 1.
+ */
+
+uint32_t mwMSC_NumLUNs(USBD_MSC_INIT_PARAM_T *param)
+{
+	if ((param->NumLUNs == 0) || (param->LUNs == 0)) {
+		return 1;
+	}
+	return (param->NumLUNs > USB_MSC_MAX_LUN) ? USB_MSC_MAX_LUN : param->NumLUNs;
+}
+
+/*
+ *  Parameters of a logical unit
+ *  Parameters:      param: MSC function driver initialization parameters.
+ *                   idx: LUN
+ *                   lun: Returns the LUN parameters, taken from the single
+ *                        unit members of param when no LUN array is passed.
+ *  Return Value:    None
+ */
+
+void mwMSC_LunParam(USBD_MSC_INIT_PARAM_T *param, uint32_t idx, USBD_MSC_LUN_PARAM_T *lun)
+{
+	if ((param->NumLUNs != 0) && (param->LUNs != 0)) {
+		*lun = param->LUNs[idx];
+		return;
+	}
+	lun->InquiryStr = param->InquiryStr;
+	lun->BlockCount = param->BlockCount;
+	lun->BlockSize = param->BlockSize;
+	lun->MemorySize = (param->MemorySize == 0) ? param->MemorySize64 : param->MemorySize;
+	lun->XferBufSize = param->XferBufSize;
+	lun->RxWindow = param->RxWindow;
+	lun->XferBufCnt = param->XferBufCnt;
+	lun->PrefetchBlocks = param->PrefetchBlocks;
+	lun->MSC_Write = param->MSC_Write;
+	lun->MSC_Read = param->MSC_Read;
+	lun->MSC_Verify = param->MSC_Verify;
+	lun->MSC_GetWriteBuf = param->MSC_GetWriteBuf;
+	lun->MSC_Flush = param->MSC_Flush;
+	lun->MSC_Unmap = param->MSC_Unmap;
+	lun->MSC_VerifyRange = param->MSC_VerifyRange;
+	lun->MSC_GetError = param->MSC_GetError;
+}
+
+/*
+ *  Size of the bulk data buffer requested for a LUN
+ *  Parameters:      param: LUN parameters.
+ *  Return Value:    Buffer size in bytes, 0 for single packet mode.
+ */
+
+uint32_t mwMSC_XferBufSize(USBD_MSC_LUN_PARAM_T *param)
+{
+	uint32_t len = param->XferBufSize;
+
+	if (len > USB_MSC_MAX_XFER_SIZE) {
+		len = USB_MSC_MAX_XFER_SIZE;
+	}
+	/* whole packets only, so that a transfer never ends on a short packet */
+	return len & ~(USB_HS_MAX_BULK_PACKET - 1);
+}
+
+/*
+ *  Receive window for WRITE data requested for a LUN
+ *  Parameters:      param: LUN parameters.
+ *  Return Value:    Window size in bytes, 0 for single packet mode.
+ */
+
+uint32_t mwMSC_RxWindow(USBD_MSC_LUN_PARAM_T *param)
+{
+	uint32_t len = param->RxWindow;
+
+	if (len > USB_MSC_MAX_XFER_SIZE) {
+		len = USB_MSC_MAX_XFER_SIZE;
+	}
+	/* without MSC_GetWriteBuf the data lands in the bulk data buffer */
+	if ((param->MSC_GetWriteBuf == 0) && (len > mwMSC_XferBufSize(param))) {
+		len = mwMSC_XferBufSize(param);
+	}
+	return len & ~(USB_HS_MAX_BULK_PACKET - 1);
+}
+
+/*
+ *  Number of bulk data buffers requested for a LUN
+ *  Parameters:      param: LUN parameters.
+ *  Return Value:    Number of buffers, at least 1.
+ */
+
+uint32_t mwMSC_XferBufCnt(USBD_MSC_LUN_PARAM_T *param)
+{
+	uint32_t cnt = param->XferBufCnt;
+
+	/* the single packet mode uses BulkBuf */
+	if ((cnt == 0) || (mwMSC_XferBufSize(param) == 0)) {
+		cnt = 1;
+	}
+	if (cnt > USB_MSC_MAX_XFER_BUFS) {
+		cnt = USB_MSC_MAX_XFER_BUFS;
+	}
+	return cnt;
+}
+
+/*
+ *  Size of the read-ahead buffer requested for a LUN
+ *  Parameters:      param: LUN parameters.
+ *  Return Value:    Buffer size in bytes, 0 if read-ahead is disabled.
+ */
+
+uint32_t mwMSC_PrefetchSize(USBD_MSC_LUN_PARAM_T *param)
+{
+	if ((param->BlockSize == 0) || (param->PrefetchBlocks == 0)) {
+		return 0;
+	}
+	if (param->PrefetchBlocks > (USB_MSC_MAX_PREFETCH_SIZE / param->BlockSize)) {
+		return (USB_MSC_MAX_PREFETCH_SIZE / param->BlockSize) * param->BlockSize;
+	}
+	return param->PrefetchBlocks * param->BlockSize;
+}
+
 /**
  * @brief   Get memory required by MSC class.
  * @param [in/out] param parameter structure used for initialisation.
@@ -925,10 +1839,26 @@ ErrorCode_t mwMSC_bulk_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
  */
 uint32_t mwMSC_GetMemSize(USBD_MSC_INIT_PARAM_T *param)
 {
+	USBD_MSC_LUN_PARAM_T lun;
 	uint32_t req_len = 0;
+	uint32_t i, xfer_len = 0, pf_len = 0;
+
+	/* the buffers are shared, size them for the most demanding LUN */
+	for (i = 0; i < mwMSC_NumLUNs(param); i++) {
+		mwMSC_LunParam(param, i, &lun);
+		if (xfer_len < (mwMSC_XferBufSize(&lun) * mwMSC_XferBufCnt(&lun))) {
+			xfer_len = mwMSC_XferBufSize(&lun) * mwMSC_XferBufCnt(&lun);
+		}
+		if (pf_len < mwMSC_PrefetchSize(&lun)) {
+			pf_len = mwMSC_PrefetchSize(&lun);
+		}
+	}
 
 	/* calculate required length */
 	req_len += sizeof(USB_MSC_CTRL_T);	/* memory for MSC controller structure */
+	req_len += mwMSC_NumLUNs(param) * sizeof(MSC_LUN_T);	/* memory for LUN structures */
+	req_len += xfer_len;	/* memory for bulk data buffers */
+	req_len += (pf_len + 3) & ~0x3;	/* memory for read-ahead buffer */
 	req_len += 4;	/* for alignment overhead */
 	req_len &= ~0x3;
 
@@ -945,14 +1875,18 @@ uint32_t mwMSC_GetMemSize(USBD_MSC_INIT_PARAM_T *param)
 ErrorCode_t mwMSC_init(USBD_HANDLE_T hUsb, USBD_MSC_INIT_PARAM_T *param)
 {
 	uint32_t new_addr, i, ep_indx;
+	uint32_t xfer_len = 0, pf_len = 0;
 	ErrorCode_t ret = LPC_OK;
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
 	USB_MSC_CTRL_T *pMscCtrl;
+	USBD_MSC_LUN_PARAM_T lun;
+	MSC_LUN_T *pLun;
 	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
 	USB_INTERFACE_DESCRIPTOR *pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->intf_desc;
 
 	/* check for memory alignment */
-	if ((param->mem_base &  0x3) &&
-		(param->mem_size < sizeof(USB_MSC_CTRL_T))) {
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwMSC_GetMemSize(param))) {
 		return ERR_USBD_BAD_MEM_BUF;
 	}
 
@@ -968,23 +1902,72 @@ ErrorCode_t mwMSC_init(USBD_HANDLE_T hUsb, USBD_MSC_INIT_PARAM_T *param)
 
 	/* Init control structures with passed params */
 	memset((void *) pMscCtrl, 0, sizeof(USB_MSC_CTRL_T));
-	pMscCtrl->pUsbCtrl = (USB_CORE_CTRL_T *) hUsb;
-	pMscCtrl->InquiryStr = param->InquiryStr;
-	pMscCtrl->BlockCount = param->BlockCount;
-	pMscCtrl->BlockSize = param->BlockSize;
-	pMscCtrl->MemorySize = (param->MemorySize == 0) ? param->MemorySize64 : param->MemorySize;
-	/* user defined functions */
-	if ((param->MSC_Write == 0) ||
-		(param->MSC_Read == 0) ||
-		(param->MSC_Verify == 0)) {
+
+	if (param->NumLUNs > USB_MSC_MAX_LUN) {
 		return ERR_API_INVALID_PARAM2;
 	}
 
-	pMscCtrl->MSC_Write = param->MSC_Write;
-	pMscCtrl->MSC_Read = param->MSC_Read;
-	pMscCtrl->MSC_Verify = param->MSC_Verify;
-	pMscCtrl->MSC_GetWriteBuf = param->MSC_GetWriteBuf;
+	/* allocate memory for the LUN structures */
+	pMscCtrl->NumLUNs = mwMSC_NumLUNs(param);
+	pMscCtrl->Luns = (MSC_LUN_T *) param->mem_base;
+	param->mem_base += pMscCtrl->NumLUNs * sizeof(MSC_LUN_T);
+	param->mem_size -= pMscCtrl->NumLUNs * sizeof(MSC_LUN_T);
+
+	for (i = 0; i < pMscCtrl->NumLUNs; i++) {
+		mwMSC_LunParam(param, i, &lun);
+		/* user defined functions */
+		if ((lun.MSC_Write == 0) ||
+			(lun.MSC_Read == 0) ||
+			(lun.MSC_Verify == 0)) {
+			return ERR_API_INVALID_PARAM2;
+		}
+		pLun = &pMscCtrl->Luns[i];
+		pLun->InquiryStr = lun.InquiryStr;
+		pLun->BlockCount = lun.BlockCount;
+		pLun->BlockSize = lun.BlockSize;
+		pLun->MemorySize = lun.MemorySize;
+		pLun->XferBufSize = mwMSC_XferBufSize(&lun);
+		pLun->XferBufCnt = mwMSC_XferBufCnt(&lun);
+		/* never queue more transfers than the endpoint has descriptors for */
+		if (pLun->XferBufCnt > pCtrl->dtd_pool_depth) {
+			pLun->XferBufCnt = pCtrl->dtd_pool_depth;
+		}
+		pLun->RxWindow = mwMSC_RxWindow(&lun);
+		pLun->PfSize = mwMSC_PrefetchSize(&lun);
+		pLun->MSC_Write = lun.MSC_Write;
+		pLun->MSC_Read = lun.MSC_Read;
+		pLun->MSC_Verify = lun.MSC_Verify;
+		pLun->MSC_GetWriteBuf = lun.MSC_GetWriteBuf;
+		pLun->MSC_Flush = lun.MSC_Flush;
+		pLun->MSC_Unmap = lun.MSC_Unmap;
+		pLun->MSC_VerifyRange = lun.MSC_VerifyRange;
+		pLun->MSC_GetError = lun.MSC_GetError;
+
+		if (xfer_len < (pLun->XferBufSize * pLun->XferBufCnt)) {
+			xfer_len = pLun->XferBufSize * pLun->XferBufCnt;
+		}
+		if (pf_len < pLun->PfSize) {
+			pf_len = pLun->PfSize;
+		}
+	}
+
+	/* allocate memory for the bulk data buffers */
+	if (xfer_len != 0) {
+		pMscCtrl->XferMem = (uint8_t *) param->mem_base;
+		param->mem_base += xfer_len;
+		param->mem_size -= xfer_len;
+	}
+
+	/* allocate memory for the read-ahead buffer */
+	if (pf_len != 0) {
+		pMscCtrl->PfBuf = (uint8_t *) param->mem_base;
+		param->mem_base += (pf_len + 3) & ~0x3;
+		param->mem_size -= (pf_len + 3) & ~0x3;
+	}
+
+	pMscCtrl->pUsbCtrl = (USB_CORE_CTRL_T *) hUsb;
 	pMscCtrl->rx_buf = pMscCtrl->BulkBuf;
+	mwMSC_SelectLUN(pMscCtrl, 0);
 
 	/* parse the interface descriptor */
 	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
@@ -1033,10 +2016,10 @@ ErrorCode_t mwMSC_init(USBD_HANDLE_T hUsb, USBD_MSC_INIT_PARAM_T *param)
 	/* register ep0 handler */
 	/* check if user wants his own handler */
 	if (param->MSC_Ep0_Hdlr == 0) {
-		ret = mwUSB_RegisterClassHandler(hUsb, mwMSC_ep0_hdlr, pMscCtrl);
+		ret = mwUSB_RegisterIntfHandler(hUsb, pMscCtrl->if_num, mwMSC_ep0_hdlr, pMscCtrl);
 	}
 	else {
-		ret = mwUSB_RegisterClassHandler(hUsb, param->MSC_Ep0_Hdlr, pMscCtrl);
+		ret = mwUSB_RegisterIntfHandler(hUsb, pMscCtrl->if_num, param->MSC_Ep0_Hdlr, pMscCtrl);
 		param->MSC_Ep0_Hdlr = mwMSC_ep0_hdlr;
 	}
 
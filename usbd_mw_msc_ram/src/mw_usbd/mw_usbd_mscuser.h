@@ -47,6 +47,83 @@
  *  Devices using the USB MSC Class.
  */
 
+/** \brief Largest bulk transfer queued by the MSC function driver.
+ *  \ingroup USBD_MSC
+ *
+ *  A device transfer descriptor spans five 4KB pages, so 16KB can be
+ *  reached whatever the alignment of the data buffer.
+ */
+#define USB_MSC_MAX_XFER_SIZE           (16 * 1024)
+
+/** \brief Largest number of bulk data buffers of the MSC function driver.
+ *  \ingroup USBD_MSC
+ */
+#define USB_MSC_MAX_XFER_BUFS           4
+
+/** \brief Largest read-ahead buffer of the MSC function driver.
+ *  \ingroup USBD_MSC
+ */
+#define USB_MSC_MAX_PREFETCH_SIZE       (64 * 1024)
+
+/** \brief Read-ahead counters of the MSC function driver, in blocks.
+ *  \ingroup USBD_MSC
+ */
+typedef struct USBD_MSC_PREFETCH_STATS {
+	uint32_t hits;		/**< Blocks of sequential READs sent from the read-ahead buffer */
+	uint32_t misses;	/**< Blocks of sequential READs fetched through MSC_Read() */
+} USBD_MSC_PREFETCH_STATS_T;
+
+/** \brief Largest number of block descriptors in a SCSI UNMAP parameter list.
+ *  \ingroup USBD_MSC
+ *
+ *  The parameter list is received in one high speed packet: an 8 byte header
+ *  followed by 16 byte descriptors. Reported in the Block Limits VPD page.
+ */
+#define USB_MSC_MAX_UNMAP_DESC          ((USB_HS_MAX_BULK_PACKET - 8) / 16)
+
+/** \brief Largest number of logical units of a MSC function driver instance.
+ *  \ingroup USBD_MSC
+ */
+#define USB_MSC_MAX_LUN                 16
+
+/** \brief Mass Storage class logical unit parameter data structure.
+ *  \ingroup USBD_MSC
+ *
+ *  \details  Describes one logical unit (LUN) of a multi-LUN Mass Storage function,
+ *  see USBD_MSC_INIT_PARAM::LUNs. The members have the meaning of the members of
+ *  \ref USBD_MSC_INIT_PARAM with the same name, and apply to the commands
+ *  addressed to this unit only. The bulk data and read-ahead buffers are shared
+ *  by all units and sized for the largest request.
+ *
+ */
+typedef struct USBD_MSC_LUN_PARAM {
+	uint8_t *InquiryStr;	/**< Pointer to the 28 character Inquiry string of the unit */
+	uint32_t  BlockCount;	/**< Number of blocks of the unit */
+	uint32_t  BlockSize;	/**< Block size in number of bytes */
+	uint64_t  MemorySize;	/**< Size of the unit in number of bytes */
+	uint32_t  XferBufSize;	/**< Bulk data transfer size, 0 for single packet mode */
+	uint32_t  RxWindow;		/**< WRITE receive window, 0 to receive one packet at a time */
+	uint32_t  XferBufCnt;	/**< Number of bulk data buffers queued at once */
+	uint32_t  PrefetchBlocks;	/**< Read-ahead depth in blocks, 0 to disable */
+	/** MSC Write callback function of the unit, mandatory */
+	void (*MSC_Write)(uint32_t offset, uint8_t * *src, uint32_t length, uint32_t high_offset);
+	/** MSC Read callback function of the unit, mandatory */
+	void (*MSC_Read)(uint32_t offset, uint8_t * *dst, uint32_t length, uint32_t high_offset);
+	/** MSC Verify callback function of the unit, mandatory */
+	ErrorCode_t (*MSC_Verify)(uint32_t offset, uint8_t buf[], uint32_t length, uint32_t high_offset);
+	/** Optional MSC_GetWriteBuf callback function of the unit */
+	void (*MSC_GetWriteBuf)(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t high_offset);
+	/** Optional MSC_Flush callback function of the unit */
+	ErrorCode_t (*MSC_Flush)(void);
+	/** Optional MSC_Unmap callback function of the unit */
+	ErrorCode_t (*MSC_Unmap)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	/** Optional MSC_VerifyRange callback function of the unit */
+	ErrorCode_t (*MSC_VerifyRange)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	/** Optional MSC_GetError callback function of the unit */
+	ErrorCode_t (*MSC_GetError)(void);
+
+} USBD_MSC_LUN_PARAM_T;
+
 /** \brief Mass Storage class function driver initialization parameter data structure.
  *  \ingroup USBD_MSC
  *
@@ -139,7 +216,7 @@ typedef struct USBD_MSC_INIT_PARAM {
 	 *  Optional callback function to optimize MSC_Write buffer transfer.
 	 *
 	 *  This function is provided by the application software. This function gets called
-	 *  when host sends SCSI_WRITE10/SCSI_WRITE12 command. The callback function should
+	 *  when host sends SCSI_WRITE10/SCSI_WRITE12/SCSI_WRITE16 command. The callback function should
 	 *  update the \em buff_adr pointer so that the stack transfers the data directly
 	 *  to the target buffer. /note The updated buffer address should be accessible
 	 *  by USB DMA master. If user doesn't want to use zero-copy model, then the user
@@ -176,8 +253,143 @@ typedef struct USBD_MSC_INIT_PARAM {
 	 */
 	ErrorCode_t (*MSC_Ep0_Hdlr)(USBD_HANDLE_T hUsb, void *data, uint32_t event);
 
+	/** Memory size in number of bytes, used when \em MemorySize is 0 for media of 4GB
+	 * and above. Blocks beyond LBA 0xFFFFFFFF are reported through READ CAPACITY(16)
+	 * and reached with the 16-byte READ and WRITE commands.
+	 */
 	uint64_t  MemorySize64;
 
+	/** Size in bytes of the bulk data buffer used for READ and WRITE transfers. When non-zero
+	 * the stack moves up to this many bytes per endpoint transfer (a single transfer
+	 * descriptor) instead of one max-packet per interrupt. The value is rounded down
+	 * to a multiple of USB_HS_MAX_BULK_PACKET and limited to \ref USB_MSC_MAX_XFER_SIZE.
+	 * The buffer is allocated from \em mem_base. Set to 0 for single packet mode.
+	 */
+	uint32_t  XferBufSize;
+
+	/** Receive window for SCSI WRITE10/WRITE12 data. When non-zero the OUT endpoint
+	 * is primed for up to this many bytes at once, and MSC_Write() is called once per
+	 * received chunk instead of once per packet. The data goes straight to the buffer
+	 * returned by MSC_GetWriteBuf(); without that callback the window is limited to
+	 * \em XferBufSize. Rounded and limited like \em XferBufSize. Set to 0 to receive
+	 * one packet at a time.
+	 */
+	uint32_t  RxWindow;
+
+	/** Number of bulk data buffers of \em XferBufSize bytes each. With more than one
+	 * buffer the stack keeps several transfers queued on the bulk endpoint: READ data
+	 * for the next buffer is fetched through MSC_Read() while the previous buffers are
+	 * being sent, and, when MSC_GetWriteBuf() is not used, WRITE data is received into
+	 * one buffer while MSC_Write() drains another. This overlaps storage and bus I/O
+	 * for backends slower than RAM. Limited to \ref USB_MSC_MAX_XFER_BUFS and to the
+	 * \em dtd_pool_depth the USB stack was initialized with, ignored when
+	 * \em XferBufSize is 0. Set to 0 or 1 for a single buffer.
+	 */
+	uint32_t  XferBufCnt;
+
+	/**
+	 *  Optional callback function to write cached data to the medium.
+	 *
+	 *  When defined the function is called on SCSI SYNCHRONIZE CACHE (10) and (16),
+	 *  and before a WRITE command with the FUA bit set completes, so a write-back
+	 *  cache between MSC_Write() and the medium (see \ref USBD_MSC_CACHE) can be
+	 *  flushed when the host asks for it. The unit then reports an enabled write
+	 *  cache (WCE in the Caching mode page) and FUA support (DPOFUA), which lets
+	 *  hosts rely on those commands instead of expecting write-through. Without
+	 *  the function SYNCHRONIZE CACHE passes and FUA needs no action.
+	 *
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK If all cached data reached the medium.
+	 *          \retval ERR_FAILED If the medium could not be written. The command fails.
+	 *
+	 */
+	ErrorCode_t (*MSC_Flush)(void);
+
+	/** Read-ahead depth in blocks. When non-zero the stack detects READ10/READ12/READ16
+	 * commands which continue where the previous READ ended. After such a command
+	 * completes, the next \em PrefetchBlocks blocks are fetched through MSC_Read()
+	 * into a buffer allocated from \em mem_base, while the host sends its next
+	 * command. A following READ of those blocks is answered straight from the
+	 * buffer. Any WRITE drops the buffered data. Worth it for backends that copy
+	 * data in MSC_Read(), not for zero-copy ones. Limited to
+	 * \ref USB_MSC_MAX_PREFETCH_SIZE bytes. Set to 0 to disable read-ahead.
+	 */
+	uint32_t  PrefetchBlocks;
+
+	/** Number of logical units in the \em LUNs array, up to \ref USB_MSC_MAX_LUN.
+	 * Set to 0 for a single unit described by the members above.
+	 */
+	uint32_t  NumLUNs;
+
+	/** Pointer to an array of \em NumLUNs logical unit descriptors. Each unit has
+	 * its own geometry, callbacks and buffer strategy, so a slow unit does not
+	 * dictate the transfer sizes of a fast one. When used, the unit members above
+	 * (\em InquiryStr to \em MSC_GetWriteBuf, \em MemorySize64 to \em PrefetchBlocks,
+	 * \em MSC_Unmap to \em MSC_GetError) are ignored. The array is copied by Init().
+	 */
+	USBD_MSC_LUN_PARAM_T *LUNs;
+
+	/**
+	 *  Optional callback function to discard unused blocks.
+	 *
+	 *  When defined the unit reports logical block provisioning (the Block Limits
+	 *  and Logical Block Provisioning VPD pages, LBPME in READ CAPACITY(16)) and
+	 *  accepts SCSI UNMAP, so a flash backend learns which blocks the host file
+	 *  system freed and can drop them instead of copying them around. The block
+	 *  descriptors of a command are checked against the medium size, sorted extents
+	 *  which touch or overlap are merged, and the function is called once per
+	 *  resulting extent. The data of unmapped blocks is undefined until written.
+	 *
+	 *  \param[in] offset Destination start address.
+	 *  \param[in] length Number of bytes to discard, a multiple of the block size.
+	 *  \param[in] high_offset Upper 32 bits of the start address.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK If the blocks are discarded or left as they are.
+	 *          \retval ERR_FAILED If the medium failed. The command fails.
+	 *
+	 */
+	ErrorCode_t (*MSC_Unmap)(uint32_t offset, uint32_t length, uint32_t high_offset);
+
+	/**
+	 *  Optional callback function to verify blocks at the medium.
+	 *
+	 *  Called for SCSI VERIFY(10) with BYTCHK = 0, where the host sends no data
+	 *  and only asks whether the blocks can be read back intact. The function
+	 *  checks the range against whatever the medium keeps for that purpose, for
+	 *  instance a CRC32 stored per block (see \ref mwUSB_Crc32) or the ECC of a
+	 *  flash or SD card read, so the check costs no bus traffic. The range is
+	 *  checked against the medium size before the call. Without the function
+	 *  such a VERIFY passes unchecked.
+	 *
+	 *  \param[in] offset Start address of the blocks.
+	 *  \param[in] length Number of bytes to verify, a multiple of the block size.
+	 *  \param[in] high_offset Upper 32 bits of the start address.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK If all blocks are intact.
+	 *          \retval ERR_FAILED If a block is damaged or unreadable. The command fails.
+	 *
+	 */
+	ErrorCode_t (*MSC_VerifyRange)(uint32_t offset, uint32_t length, uint32_t high_offset);
+
+	/**
+	 *  Optional callback function to report failed MSC_Read() and MSC_Write() calls.
+	 *
+	 *  MSC_Read() and MSC_Write() return nothing. A medium that can fail, for
+	 *  instance an SD card behind a write-back cache, defines this function. The
+	 *  stack calls it after each MSC_Read() and MSC_Write() call. A READ then
+	 *  stops sending data: the data already queued goes out, the bulk IN endpoint
+	 *  is stalled and the command fails with MEDIUM ERROR / UNRECOVERED READ ERROR.
+	 *  A WRITE receives the rest of its data without writing it and fails with
+	 *  MEDIUM ERROR / WRITE ERROR. Without the function every call counts as
+	 *  successful.
+	 *
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK If the last MSC_Read() or MSC_Write() call succeeded.
+	 *          \retval ERR_FAILED If it failed.
+	 *
+	 */
+	ErrorCode_t (*MSC_GetError)(void);
+
 } USBD_MSC_INIT_PARAM_T;
 
 /** \brief MSC class API functions structure.
@@ -212,12 +424,26 @@ typedef struct USBD_MSC_API {
 	 *          \retval ERR_USBD_BAD_MEM_BUF  Memory buffer passed is not 4-byte
 	 *              aligned or smaller than required.
 	 *          \retval ERR_API_INVALID_PARAM2 Either MSC_Write() or MSC_Read() or
-	 *              MSC_Verify() callbacks are not defined.
+	 *              MSC_Verify() callbacks are not defined for a LUN, or more than
+	 *              \ref USB_MSC_MAX_LUN LUNs are requested.
 	 *          \retval ERR_USBD_BAD_INTF_DESC  Wrong interface descriptor is passed.
 	 *          \retval ERR_USBD_BAD_EP_DESC  Wrong endpoint descriptor is passed.
 	 */
 	ErrorCode_t (*init)(USBD_HANDLE_T hUsb, USBD_MSC_INIT_PARAM_T *param);
 
+	/** \fn ErrorCode_t GetPrefetchStats(USBD_HANDLE_T hUsb, uint32_t ep_in, USBD_MSC_PREFETCH_STATS_T* stats, uint32_t clear)
+	 *  Function to read the read-ahead counters of a MSC function driver instance.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in] ep_in Bulk IN endpoint address of the MSC interface.
+	 *  \param[out] stats Read-ahead counters, see \ref USBD_MSC_PREFETCH_STATS_T.
+	 *  \param[in] clear Non-zero to clear the counters after reading them.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success
+	 *          \retval ERR_API_INVALID_PARAM2 No MSC interface uses \em ep_in.
+	 */
+	ErrorCode_t (*GetPrefetchStats)(USBD_HANDLE_T hUsb, uint32_t ep_in, USBD_MSC_PREFETCH_STATS_T *stats, uint32_t clear);
+
 } USBD_MSC_API_T;
 
 /*-----------------------------------------------------------------------------
@@ -225,6 +451,26 @@ typedef struct USBD_MSC_API {
  *-----------------------------------------------------------------------------*/
 /** @cond  ADVANCED_API */
 
+/* Logical unit, as used by the data path */
+typedef struct _MSC_LUN_T {
+	uint8_t *InquiryStr;
+	uint32_t BlockCount;
+	uint32_t BlockSize;
+	uint64_t MemorySize;
+	uint32_t XferBufSize;			/* Bulk data buffer size, 0 in single packet mode */
+	uint32_t RxWindow;
+	uint32_t PfSize;				/* Read-ahead size, 0 if disabled */
+	uint8_t XferBufCnt;
+	void (*MSC_Write)(uint32_t offset, uint8_t * *src, uint32_t length, uint32_t high_offset);
+	void (*MSC_Read)(uint32_t offset, uint8_t * *dst, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_Verify)(uint32_t offset, uint8_t src[], uint32_t length, uint32_t high_offset);
+	void (*MSC_GetWriteBuf)(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_Flush)(void);
+	ErrorCode_t (*MSC_Unmap)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_VerifyRange)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_GetError)(void);
+} MSC_LUN_T;
+
 typedef struct _MSC_CTRL_T {
 	/* If it's a USB HS, the max packet is 512, if it's USB FS,
 	   the max packet is 64. Use 512 for both HS and FS. */
@@ -238,12 +484,31 @@ typedef struct _MSC_CTRL_T {
 	uint32_t Length;				/* R/W Length */
 	uint32_t BulkLen;				/* Bulk In/Out Length */
 	uint8_t *rx_buf;
+	uint8_t *XferBuf;				/* Bulk data buffer */
+	uint32_t XferBufSize;			/* Bulk data buffer size, 0 in single packet mode */
+	uint32_t RxWindow;				/* Max bytes primed per OUT transfer, 0 in single packet mode */
+	uint32_t RxLength;				/* WRITE data not yet requested from the host */
+	uint8_t XferBufCnt;				/* Number of bulk data buffers */
+	uint8_t XferNext;				/* Next bulk data buffer to queue */
+	uint8_t XferDone;				/* Oldest queued bulk data buffer */
+	uint8_t XferQueued;				/* Bulk data transfers queued on the endpoint */
+
+	uint8_t *PfBuf;					/* Read-ahead buffer */
+	uint32_t PfSize;				/* Read-ahead buffer size, 0 if disabled */
+	uint64_t PfOffset;				/* Medium offset of the read-ahead data */
+	uint32_t PfLength;				/* Valid read-ahead bytes */
+	uint64_t SeqOffset;				/* End of the last READ */
+	uint8_t PfStream;				/* Current READ continues the previous one */
+	uint8_t PfPending;				/* Read ahead once the CSW is sent */
+	USBD_MSC_PREFETCH_STATS_T PfStats;
 
 	uint8_t BulkStage;				/* Bulk Stage */
 	uint8_t if_num;					/* interface number */
 	uint8_t epin_num;				/* BULK IN endpoint number */
 	uint8_t epout_num;				/* BULK OUT endpoint number */
 	uint32_t MemOK;					/* Memory OK */
+	uint8_t SenseKey;				/* Sense key of the last failed command */
+	uint8_t SenseAsc;				/* and its additional sense code */
 
 	uint8_t *InquiryStr;
 	uint32_t  BlockCount;
@@ -255,6 +520,22 @@ typedef struct _MSC_CTRL_T {
 	ErrorCode_t (*MSC_Verify)(uint32_t offset, uint8_t src[], uint32_t length, uint32_t high_offset);
 	/* optional call back for MSC_Write optimization */
 	void (*MSC_GetWriteBuf)(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t high_offset);
+	/* optional call back for SYNCHRONIZE CACHE */
+	ErrorCode_t (*MSC_Flush)(void);
+	/* optional call back for UNMAP */
+	ErrorCode_t (*MSC_Unmap)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	/* optional call back for VERIFY without data */
+	ErrorCode_t (*MSC_VerifyRange)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	/* optional call back reporting failed MSC_Read/MSC_Write calls */
+	ErrorCode_t (*MSC_GetError)(void);
+
+	/* logical units, the members above hold a copy of the selected one */
+	struct _MSC_LUN_T *Luns;
+	uint8_t NumLUNs;
+	uint8_t CurLun;					/* LUN of the current command */
+	uint8_t SeqLun;					/* LUN of the last READ */
+	uint8_t PfLun;					/* LUN of the read-ahead data */
+	uint8_t *XferMem;				/* Bulk data buffers shared by all LUNs */
 
 } USB_MSC_CTRL_T;
 
@@ -263,6 +544,8 @@ extern uint32_t mwMSC_GetMemSize(USBD_MSC_INIT_PARAM_T *param);
 
 extern ErrorCode_t mwMSC_init(USBD_HANDLE_T hUsb, USBD_MSC_INIT_PARAM_T *param);
 
+extern ErrorCode_t mwMSC_GetPrefetchStats(USBD_HANDLE_T hUsb, uint32_t ep_in, USBD_MSC_PREFETCH_STATS_T *stats, uint32_t clear);
+
 /** @endcond */
 
 /** @endcond */
@@ -0,0 +1,141 @@
+/***********************************************************************
+ * $Id:: mw_usbd_ncm.h                                                         $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     USB CDC Network Control Model (NCM) definitions.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+
+#ifndef __NCM_H__
+#define __NCM_H__
+
+#include "mw_usbd.h"
+#include "mw_usbd_cdc.h"
+
+/** \file
+ *  \brief USB CDC Network Control Model (NCM) descriptors and transfer blocks.
+ *
+ *  Definition of NCM class descriptors, requests and the 16-bit NCM Transfer
+ *  Block (NTB) structures, based on NCM10.pdf (www.usb.org).
+ *
+ */
+
+/* NCM communication interface subclass code (NCM10.pdf, 4.2, Table 4-1) */
+#define CDC_NETWORK_CONTROL_MODEL               0x0D
+
+/* NCM data interface protocol code (NCM10.pdf, 4.7, Table 4-3) */
+#define CDC_PROTOCOL_NCM_NTB                    0x01
+
+/* Functional descriptor subtypes */
+#define CDC_ETHERNET_NETWORKING_DESCRIPTOR      0x0F
+#define CDC_NCM_DESCRIPTOR                      0x1A
+
+/* NCM class-specific request codes (NCM10.pdf, 6.2, Table 6-2) */
+#define NCM_GET_NTB_PARAMETERS                  0x80
+#define NCM_GET_NET_ADDRESS                     0x81
+#define NCM_SET_NET_ADDRESS                     0x82
+#define NCM_GET_NTB_FORMAT                      0x83
+#define NCM_SET_NTB_FORMAT                      0x84
+#define NCM_GET_NTB_INPUT_SIZE                  0x85
+#define NCM_SET_NTB_INPUT_SIZE                  0x86
+#define NCM_GET_MAX_DATAGRAM_SIZE               0x87
+#define NCM_SET_MAX_DATAGRAM_SIZE               0x88
+#define NCM_GET_CRC_MODE                        0x89
+#define NCM_SET_CRC_MODE                        0x8A
+
+/* NTB formats (bmNtbFormatsSupported, SET_NTB_FORMAT wValue) */
+#define NCM_NTB_FORMAT_16                       0x0000
+#define NCM_NTB_FORMATS_16                      0x0001
+
+/* Smallest dwNtbInMaxSize / dwNtbOutMaxSize a function may report */
+#define NCM_NTB_MIN_SIZE                        2048
+
+/* NTB signatures, "NCMH", "NCM0" and "NCM1" in little endian */
+#define NCM_NTH16_SIGNATURE                     0x484D434E
+#define NCM_NDP16_NOCRC_SIGNATURE               0x304D434E
+#define NCM_NDP16_CRC_SIGNATURE                 0x314D434E
+
+/* Ethernet networking functional descriptor (ECM120.pdf, 5.4) */
+PRE_PACK struct POST_PACK _CDC_ETHERNET_NETWORKING_DESC {
+	uint8_t  bFunctionLength;
+	uint8_t  bDescriptorType;					/* CS_INTERFACE */
+	uint8_t  bDescriptorSubtype;				/* CDC_ETHERNET_NETWORKING_DESCRIPTOR */
+	uint8_t  iMACAddress;						/* string with the 48 bit MAC address in hex */
+	uint32_t bmEthernetStatistics;
+	uint16_t wMaxSegmentSize;
+	uint16_t wNumberMCFilters;
+	uint8_t  bNumberPowerFilters;
+};
+typedef struct _CDC_ETHERNET_NETWORKING_DESC CDC_ETHERNET_NETWORKING_DESC;
+
+/* NCM functional descriptor (NCM10.pdf, 5.2.1) */
+PRE_PACK struct POST_PACK _CDC_NCM_DESC {
+	uint8_t  bFunctionLength;
+	uint8_t  bDescriptorType;					/* CS_INTERFACE */
+	uint8_t  bDescriptorSubtype;				/* CDC_NCM_DESCRIPTOR */
+	uint16_t bcdNcmVersion;						/* 0x0100 */
+	uint8_t  bmNetworkCapabilities;
+};
+typedef struct _CDC_NCM_DESC CDC_NCM_DESC;
+
+/* NTB parameter structure, returned by GET_NTB_PARAMETERS (NCM10.pdf, 6.2.1) */
+PRE_PACK struct POST_PACK _NCM_NTB_PARAMETERS {
+	uint16_t wLength;
+	uint16_t bmNtbFormatsSupported;
+	uint32_t dwNtbInMaxSize;
+	uint16_t wNdpInDivisor;
+	uint16_t wNdpInPayloadRemainder;
+	uint16_t wNdpInAlignment;
+	uint16_t wReserved;
+	uint32_t dwNtbOutMaxSize;
+	uint16_t wNdpOutDivisor;
+	uint16_t wNdpOutPayloadRemainder;
+	uint16_t wNdpOutAlignment;
+	uint16_t wNtbOutMaxDatagrams;
+};
+typedef struct _NCM_NTB_PARAMETERS NCM_NTB_PARAMETERS;
+
+/* 16-bit NTB header (NCM10.pdf, 3.2.1) */
+PRE_PACK struct POST_PACK _NCM_NTH16 {
+	uint32_t dwSignature;
+	uint16_t wHeaderLength;						/* sizeof(NCM_NTH16) */
+	uint16_t wSequence;
+	uint16_t wBlockLength;						/* length of the whole NTB */
+	uint16_t wNdpIndex;							/* offset of the first NDP */
+};
+typedef struct _NCM_NTH16 NCM_NTH16;
+
+/* 16-bit datagram pointer entry */
+PRE_PACK struct POST_PACK _NCM_DPE16 {
+	uint16_t wDatagramIndex;					/* offset of the datagram in the NTB */
+	uint16_t wDatagramLength;
+};
+typedef struct _NCM_DPE16 NCM_DPE16;
+
+/* 16-bit NCM datagram pointer table (NCM10.pdf, 3.3.1), followed by datagram
+   pointer entries ending with a zero entry */
+PRE_PACK struct POST_PACK _NCM_NDP16 {
+	uint32_t dwSignature;
+	uint16_t wLength;							/* length of the table with its entries */
+	uint16_t wNextNdpIndex;						/* offset of the next NDP, 0 for the last */
+	NCM_DPE16 Dpe[1];
+};
+typedef struct _NCM_NDP16 NCM_NDP16;
+
+#endif  /* __NCM_H__ */
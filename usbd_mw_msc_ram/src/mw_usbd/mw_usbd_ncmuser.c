@@ -0,0 +1,731 @@
+/***********************************************************************
+ * $Id:: mw_usbd_ncmuser.c                                                     $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     USB CDC Network Control Model Custom User Module.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#include <string.h>	/*for memcpy */
+
+#include "mw_usbd.h"
+#include "mw_usbd_core.h"
+#include "mw_usbd_hw.h"
+#include "mw_usbd_ncmuser.h"
+
+#ifndef FALSE
+#define FALSE 0
+#define TRUE !FALSE
+#endif
+
+/* datagrams start on 4 byte boundaries (wNdpInDivisor) */
+#define NCM_ALIGN(n)    (((n) + 3) & ~3)
+
+/* NDPs followed in one OUT NTB before it is treated as malformed */
+#define NCM_MAX_NDPS    8
+
+/*
+ *  NCM Bulk Max Packet Size
+ *  Parameters:      pNcm: Handle to NCM structure
+ *  Return Value:    Max packet size of the BULK endpoints at the current speed
+ */
+
+uint32_t mwNCM_MaxPacket(USB_NCM_CTRL_T *pNcm) {
+	return (pNcm->pUsbCtrl->device_speed == USB_HIGH_SPEED) ? USB_HS_MAX_BULK_PACKET : USB_FS_MAX_BULK_PACKET;
+}
+
+/*
+ *  NCM Send Notification
+ *  Parameters:      pNcm: Handle to NCM structure
+ *                   code: CDC_CONNECTION_SPEED_CHANGE or CDC_NOTIFICATION_NETWORK_CONNECTION
+ *  Return Value:    None
+ */
+
+void mwNCM_Notify(USB_NCM_CTRL_T *pNcm, uint8_t code) {
+	uint32_t len = 8;
+	uint32_t rate;
+
+	pNcm->notice_buf[0] = 0xA1;							/* bmRequestType */
+	pNcm->notice_buf[1] = code;
+	pNcm->notice_buf[2] = 0x00;							/* wValue */
+	pNcm->notice_buf[3] = 0x00;
+	pNcm->notice_buf[4] = pNcm->cif_num;				/* wIndex */
+	pNcm->notice_buf[5] = 0x00;
+	pNcm->notice_buf[6] = 0x00;							/* wLength */
+	pNcm->notice_buf[7] = 0x00;
+
+	if (code == CDC_CONNECTION_SPEED_CHANGE) {
+		/* DLBitRate and ULBitRate, the signalling rate of the bus */
+		rate = (pNcm->pUsbCtrl->device_speed == USB_HIGH_SPEED) ? 480000000 : 12000000;
+		pNcm->notice_buf[6] = 8;
+		memcpy(&pNcm->notice_buf[8], &rate, 4);
+		memcpy(&pNcm->notice_buf[12], &rate, 4);
+		len = 16;
+	}
+	else {
+		pNcm->notice_buf[2] = pNcm->active;				/* connected */
+	}
+	pNcm->pUsbCtrl->hw_api->WriteEP(pNcm->pUsbCtrl, pNcm->epint_num, pNcm->notice_buf, len);
+}
+
+/*
+ *  NCM Close IN NTB
+ *  Parameters:      pNcm: Handle to NCM structure
+ *                   idx: NTB to close
+ *  Return Value:    None
+ *
+ *  Writes the header and NDP for the datagrams published so far and sends the
+ *  NTB. Called with nothing on the BULK IN endpoint, either from the IN
+ *  completion or from SendDatagram() while the endpoint is idle.
+ */
+
+void mwNCM_TxSeal(USB_NCM_CTRL_T *pNcm, uint32_t idx) {
+	NCM_NTB_T *ntb = &pNcm->tx[idx];
+	NCM_NTH16 *nth = (NCM_NTH16 *) ntb->buf;
+	NCM_NDP16 *ndp = (NCM_NDP16 *) (ntb->buf + sizeof(NCM_NTH16));
+	uint32_t i, n = ntb->count;
+	uint32_t len = ntb->dg[2 * (n - 1)] + ntb->dg[2 * (n - 1) + 1];
+
+	ntb->sealed = n;
+	ntb->state = NCM_NTB_SENT;
+
+	ndp->dwSignature = NCM_NDP16_NOCRC_SIGNATURE;
+	ndp->wLength = 8 + ((n + 1) * sizeof(NCM_DPE16));
+	ndp->wNextNdpIndex = 0;
+	for (i = 0; i < n; i++) {
+		ndp->Dpe[i].wDatagramIndex = ntb->dg[2 * i];
+		ndp->Dpe[i].wDatagramLength = ntb->dg[2 * i + 1];
+	}
+	ndp->Dpe[n].wDatagramIndex = 0;
+	ndp->Dpe[n].wDatagramLength = 0;
+
+	/* a short NTB of whole packets would need a ZLP, pad it by a byte instead */
+	if (((len & (mwNCM_MaxPacket(pNcm) - 1)) == 0) && (len < pNcm->NtbInSize)) {
+		len++;
+	}
+	nth->dwSignature = NCM_NTH16_SIGNATURE;
+	nth->wHeaderLength = sizeof(NCM_NTH16);
+	nth->wSequence = pNcm->tx_seq++;
+	nth->wBlockLength = len;
+	nth->wNdpIndex = sizeof(NCM_NTH16);
+
+	pNcm->tx_sending = idx;
+	pNcm->tx_len = len;
+	/* busy before the transfer is queued, its completion may come at once */
+	pNcm->tx_state = NCM_XFER_BUSY;
+	pNcm->pUsbCtrl->hw_api->WriteEP(pNcm->pUsbCtrl, pNcm->epin_num, ntb->buf, len);
+}
+
+/*
+ *  NCM IN NTB Sent
+ *  Parameters:      pNcm: Handle to NCM structure
+ *  Return Value:    None
+ *
+ *  Frees the NTB just sent and closes the one packed meanwhile, if any.
+ */
+
+void mwNCM_TxDone(USB_NCM_CTRL_T *pNcm) {
+	uint32_t next = pNcm->tx_sending ^ 1;
+
+	pNcm->tx[pNcm->tx_sending].state = NCM_NTB_DONE;
+	if ((pNcm->tx[next].state == NCM_NTB_OPEN) && (pNcm->tx[next].count != 0)) {
+		mwNCM_TxSeal(pNcm, next);
+	}
+	else {
+		pNcm->tx_state = NCM_XFER_IDLE;
+	}
+}
+
+/*
+ *  NCM Start BULK OUT Transfer
+ *  Parameters:      pNcm: Handle to NCM structure
+ *  Return Value:    None
+ */
+
+void mwNCM_RxStart(USB_NCM_CTRL_T *pNcm) {
+	pNcm->rx_state = NCM_XFER_BUSY;
+	if (pNcm->pUsbCtrl->hw_api->ReadReqEP(pNcm->pUsbCtrl, pNcm->epout_num,
+										  pNcm->rx_buf[pNcm->rx_cur], pNcm->NtbOutSize) == 0) {
+		/* no free dTD, retried on the next NAK */
+		pNcm->rx_state = NCM_XFER_IDLE;
+	}
+}
+
+/*
+ *  NCM Unpack OUT NTB
+ *  Parameters:      pNcm: Handle to NCM structure
+ *                   buf: NTB received from the host
+ *                   len: Number of bytes received
+ *  Return Value:    None
+ *
+ *  Hands every datagram of the NTB to NCM_RecvDatagram(). A malformed NTB is
+ *  dropped from the first bad table on.
+ */
+
+void mwNCM_RxNtb(USB_NCM_CTRL_T *pNcm, uint8_t *buf, uint32_t len) {
+	NCM_NTH16 *nth = (NCM_NTH16 *) buf;
+	NCM_NDP16 *ndp;
+	NCM_DPE16 *dpe;
+	uint32_t blen, idx, end, i;
+
+	if ((len < sizeof(NCM_NTH16)) || (nth->dwSignature != NCM_NTH16_SIGNATURE) ||
+		(nth->wHeaderLength != sizeof(NCM_NTH16)) || (nth->wBlockLength > len)) {
+		return;
+	}
+	blen = nth->wBlockLength;
+	idx = nth->wNdpIndex;
+
+	for (i = 0; (idx != 0) && (i < NCM_MAX_NDPS); i++) {
+		if ((idx & 3) || (idx < sizeof(NCM_NTH16)) || ((idx + 16) > blen)) {
+			return;
+		}
+		ndp = (NCM_NDP16 *) (buf + idx);
+		end = idx + ndp->wLength;
+		if ((ndp->dwSignature != NCM_NDP16_NOCRC_SIGNATURE) || (ndp->wLength < 16) || (end > blen)) {
+			return;
+		}
+		for (dpe = ndp->Dpe; (uint8_t *) (dpe + 1) <= (buf + end); dpe++) {
+			if ((dpe->wDatagramIndex == 0) || (dpe->wDatagramLength == 0)) {
+				break;
+			}
+			if ((dpe->wDatagramIndex + dpe->wDatagramLength) <= blen) {
+				pNcm->NCM_RecvDatagram(pNcm, buf + dpe->wDatagramIndex, dpe->wDatagramLength);
+			}
+		}
+		idx = ndp->wNextNdpIndex;
+	}
+}
+
+/*
+ *  NCM BULK OUT Transfer Done
+ *  Parameters:      pNcm: Handle to NCM structure
+ *  Return Value:    None
+ *
+ *  The other receive buffer is queued before the NTB is unpacked, so the host
+ *  can send the next NTB while the datagrams are being handled.
+ */
+
+void mwNCM_RxDone(USB_NCM_CTRL_T *pNcm) {
+	uint8_t *buf = pNcm->rx_buf[pNcm->rx_cur];
+	uint32_t n;
+
+	n = pNcm->pUsbCtrl->hw_api->ReadEP(pNcm->pUsbCtrl, pNcm->epout_num, buf);
+	pNcm->rx_cur ^= 1;
+	mwNCM_RxStart(pNcm);
+	mwNCM_RxNtb(pNcm, buf, n);
+}
+
+/*
+ *  NCM Data Interface Switch
+ *  Parameters:      pNcm: Handle to NCM structure
+ *                   on: TRUE when the host selects alternate setting 1
+ *  Return Value:    None
+ *
+ *  The endpoints are reset on every switch, so a transfer on the bus is lost.
+ *  An NTB being packed is kept and sent with the next datagram.
+ */
+
+void mwNCM_SetActive(USB_NCM_CTRL_T *pNcm, uint32_t on) {
+	if (pNcm->tx_state == NCM_XFER_BUSY) {
+		pNcm->tx[pNcm->tx_sending].state = NCM_NTB_DONE;
+		pNcm->tx_state = NCM_XFER_IDLE;
+	}
+	pNcm->rx_state = NCM_XFER_IDLE;
+	pNcm->active = on;
+	pNcm->notify = 0;
+	if (on) {
+		/* link speed first, then the connection */
+		pNcm->notify = TRUE;
+		mwNCM_Notify(pNcm, CDC_CONNECTION_SPEED_CHANGE);
+	}
+}
+
+/*
+ *  NCM Queue Datagram
+ *  Parameters:     hNcm: Handle to NCM structure
+ *                  data: Datagram to send.
+ *                  len: Length of the datagram.
+ *  Return Value:   len when queued, 0 otherwise.
+ *
+ *  The interrupt may close the open NTB at any time. A datagram published
+ *  after that is not part of the NTB on the bus and is packed again into the
+ *  other NTB.
+ */
+
+uint32_t mwNCM_SendDatagram(USBD_HANDLE_T hNcm, const uint8_t *data, uint32_t len)
+{
+	USB_NCM_CTRL_T *pNcm = (USB_NCM_CTRL_T *) hNcm;
+	NCM_NTB_T *ntb;
+	uint32_t k, off;
+
+	if ((pNcm->active == 0) || (len == 0)) {
+		return 0;
+	}
+
+	for (;;) {
+		ntb = &pNcm->tx[pNcm->tx_fill];
+		if (ntb->state != NCM_NTB_OPEN) {
+			/* closed by the interrupt, go on with the other NTB */
+			ntb = &pNcm->tx[pNcm->tx_fill ^ 1];
+			if (ntb->state != NCM_NTB_DONE) {
+				return 0;
+			}
+			pNcm->tx_fill ^= 1;
+			ntb->used = pNcm->tx_hdr_len;
+			ntb->count = 0;
+			ntb->sealed = 0;
+			COMPILER_BARRIER();
+			ntb->state = NCM_NTB_OPEN;
+		}
+
+		k = ntb->count;
+		off = ntb->used;
+		if ((k >= pNcm->MaxDatagrams) || ((off + len) > pNcm->NtbInSize)) {
+			/* full, close it now when the endpoint is idle */
+			if ((k != 0) && (pNcm->tx_state == NCM_XFER_IDLE)) {
+				mwNCM_TxSeal(pNcm, pNcm->tx_fill);
+				continue;
+			}
+			return 0;
+		}
+
+		memcpy(ntb->buf + off, data, len);
+		ntb->dg[2 * k] = off;
+		ntb->dg[2 * k + 1] = len;
+		ntb->used = NCM_ALIGN(off + len);
+		/* publish the datagram */
+		COMPILER_BARRIER();
+		ntb->count = k + 1;
+
+		if ((ntb->state == NCM_NTB_OPEN) || (ntb->sealed > k)) {
+			break;
+		}
+	}
+
+	if ((pNcm->tx_state == NCM_XFER_IDLE) && (ntb->state == NCM_NTB_OPEN)) {
+		mwNCM_TxSeal(pNcm, pNcm->tx_fill);
+	}
+	return len;
+}
+
+/*
+ *  NCM Class Request
+ *  Parameters:      pNcm: Handle to NCM structure
+ *                   pCtrl: Handle to the USB device stack.
+ *  Return Value:    ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwNCM_ClassReq(USB_NCM_CTRL_T *pNcm, USB_CORE_CTRL_T *pCtrl) {
+	NCM_NTB_PARAMETERS *prm = (NCM_NTB_PARAMETERS *) pCtrl->EP0Buf;
+
+	pCtrl->EP0Data.pData = pCtrl->EP0Buf;
+	switch (pCtrl->SetupPacket.bRequest) {
+	case NCM_GET_NTB_PARAMETERS:
+		memset(prm, 0, sizeof(NCM_NTB_PARAMETERS));
+		prm->wLength = sizeof(NCM_NTB_PARAMETERS);
+		prm->bmNtbFormatsSupported = NCM_NTB_FORMATS_16;
+		prm->dwNtbInMaxSize = pNcm->NtbInMax;
+		prm->wNdpInDivisor = 4;
+		prm->wNdpInAlignment = 4;
+		prm->dwNtbOutMaxSize = pNcm->NtbOutSize;
+		prm->wNdpOutDivisor = 4;
+		prm->wNdpOutAlignment = 4;
+		if (pCtrl->EP0Data.Count > sizeof(NCM_NTB_PARAMETERS)) {
+			pCtrl->EP0Data.Count = sizeof(NCM_NTB_PARAMETERS);
+		}
+		mwUSB_DataInStage(pCtrl);
+		return LPC_OK;
+
+	case NCM_GET_NTB_INPUT_SIZE:
+		memcpy(pCtrl->EP0Buf, &pNcm->NtbInSize, 4);
+		if (pCtrl->EP0Data.Count > 4) {
+			pCtrl->EP0Data.Count = 4;
+		}
+		mwUSB_DataInStage(pCtrl);
+		return LPC_OK;
+
+	case NCM_SET_NTB_INPUT_SIZE:
+		/* handled in the data stage */
+		return ((pCtrl->SetupPacket.wLength == 4) || (pCtrl->SetupPacket.wLength == 8)) ?
+			   LPC_OK : ERR_USBD_STALL;
+
+	case NCM_GET_NTB_FORMAT:
+		pCtrl->EP0Buf[0] = 0;
+		pCtrl->EP0Buf[1] = 0;
+		if (pCtrl->EP0Data.Count > 2) {
+			pCtrl->EP0Data.Count = 2;
+		}
+		mwUSB_DataInStage(pCtrl);
+		return LPC_OK;
+
+	case NCM_SET_NTB_FORMAT:
+		if (pCtrl->SetupPacket.wValue.W != NCM_NTB_FORMAT_16) {
+			return ERR_USBD_STALL;
+		}
+		mwUSB_StatusInStage(pCtrl);
+		return LPC_OK;
+
+	case CDC_SET_ETHERNET_PACKET_FILTER:
+		/* all datagrams are passed on, the host filters */
+		mwUSB_StatusInStage(pCtrl);
+		return LPC_OK;
+
+	default:
+		break;
+	}
+	return ERR_USBD_UNHANDLED;
+}
+
+/*
+ *  Default NCM Class Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwNCM_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	USB_NCM_CTRL_T *pNcm = (USB_NCM_CTRL_T *) data;
+	uint32_t size;
+	ErrorCode_t ret = ERR_USBD_UNHANDLED;
+
+	switch (event) {
+	case USB_EVT_SETUP:
+		if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_STANDARD) &&
+			(pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_DEVICE) &&
+			(pCtrl->SetupPacket.bRequest == USB_REQUEST_SET_CONFIGURATION)) {
+			/* the data interface goes back to alt 0, and SET_NTB_INPUT_SIZE with it;
+			   left unhandled for the core */
+			mwNCM_SetActive(pNcm, FALSE);
+			pNcm->NtbInSize = pNcm->NtbInMax;
+			break;
+		}
+		if (pCtrl->SetupPacket.bmRequestType.BM.Recipient != REQUEST_TO_INTERFACE) {
+			break;
+		}
+		if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS) &&
+			(pCtrl->SetupPacket.wIndex.WB.L == pNcm->cif_num)) {
+			ret = mwNCM_ClassReq(pNcm, pCtrl);
+		}
+		else if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_STANDARD) &&
+				 (pCtrl->SetupPacket.bRequest == USB_REQUEST_SET_INTERFACE) &&
+				 (pCtrl->SetupPacket.wIndex.WB.L == pNcm->dif_num)) {
+			/* let the core switch the endpoints, then start or stop the data path */
+			ret = pCtrl->USB_ReqSetInterface(pCtrl);
+			if (ret == LPC_OK) {
+				mwUSB_StatusInStage(pCtrl);
+				mwNCM_SetActive(pNcm, (pCtrl->alt_setting[pNcm->dif_num] & 0x0F) == 1);
+				if (pCtrl->USB_Interface_Event) {
+					pCtrl->USB_Interface_Event(pCtrl);
+				}
+			}
+		}
+		break;
+
+	case USB_EVT_OUT:
+		if ((pCtrl->SetupPacket.bmRequestType.BM.Type == REQUEST_CLASS) &&
+			(pCtrl->SetupPacket.bmRequestType.BM.Recipient == REQUEST_TO_INTERFACE) &&
+			(pCtrl->SetupPacket.wIndex.WB.L == pNcm->cif_num) &&
+			(pCtrl->SetupPacket.bRequest == NCM_SET_NTB_INPUT_SIZE)) {
+			memcpy(&size, pCtrl->EP0Buf, 4);
+			if ((size < NCM_NTB_MIN_SIZE) || (size > pNcm->NtbInMax)) {
+				ret = ERR_USBD_STALL;
+				break;
+			}
+			pNcm->NtbInSize = size & ~3;
+			mwUSB_StatusInStage(pCtrl);
+			ret = LPC_OK;
+		}
+		break;
+
+	case USB_EVT_RESET:
+		mwNCM_SetActive(pNcm, FALSE);
+		pNcm->NtbInSize = pNcm->NtbInMax;
+		break;
+
+	default:
+		break;
+	}
+	return ret;
+}
+
+/*
+ *  Default NCM BULK IN Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwNCM_bulk_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_NCM_CTRL_T *pNcm = (USB_NCM_CTRL_T *) data;
+
+	if ((event == USB_EVT_IN) && (pNcm->tx_state == NCM_XFER_BUSY)) {
+		mwNCM_TxDone(pNcm);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Default NCM BULK OUT Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwNCM_bulk_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_NCM_CTRL_T *pNcm = (USB_NCM_CTRL_T *) data;
+
+	switch (event) {
+	case USB_EVT_OUT_NAK:
+		if ((pNcm->active) && (pNcm->rx_state == NCM_XFER_IDLE)) {
+			mwNCM_RxStart(pNcm);
+		}
+		break;
+
+	case USB_EVT_OUT:
+		mwNCM_RxDone(pNcm);
+		break;
+
+	default:
+		break;
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Default NCM Interrupt IN Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwNCM_int_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_NCM_CTRL_T *pNcm = (USB_NCM_CTRL_T *) data;
+
+	if ((event == USB_EVT_IN) && pNcm->notify) {
+		pNcm->notify = 0;
+		mwNCM_Notify(pNcm, CDC_NOTIFICATION_NETWORK_CONNECTION);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  NTB size requested by the application
+ *  Parameters:      size: NtbInSize or NtbOutSize init parameter.
+ *                   unit: Granularity of the size.
+ *  Return Value:    NTB size in bytes.
+ */
+
+uint32_t mwNCM_NtbSize(uint32_t size, uint32_t unit)
+{
+	if (size > USB_NCM_MAX_NTB_SIZE) {
+		size = USB_NCM_MAX_NTB_SIZE;
+	}
+	if (size < NCM_NTB_MIN_SIZE) {
+		size = NCM_NTB_MIN_SIZE;
+	}
+	return size & ~(unit - 1);
+}
+
+/*
+ *  Number of datagrams per IN NTB requested by the application
+ *  Parameters:      param: NCM function driver initialization parameters.
+ *  Return Value:    Number of datagrams, at least 1.
+ */
+
+uint32_t mwNCM_MaxDatagrams(USBD_NCM_INIT_PARAM_T *param)
+{
+	if (param->MaxDatagrams == 0) {
+		return 16;
+	}
+	return (param->MaxDatagrams > USB_NCM_MAX_DATAGRAMS) ? USB_NCM_MAX_DATAGRAMS : param->MaxDatagrams;
+}
+
+/**
+ * @brief   Get memory required by NCM class.
+ * @param [in/out] param parameter structure used for initialisation.
+ * @retval  Length required for NCM data structure and buffers.
+ *
+ * Example Usage:
+ * @code
+ *    mem_req = mwNCM_GetMemSize(param);
+ * @endcode
+ */
+uint32_t mwNCM_GetMemSize(USBD_NCM_INIT_PARAM_T *param)
+{
+	uint32_t req_len = 0;
+
+	/* calculate required length */
+	req_len += sizeof(USB_NCM_CTRL_T);	/* memory for NCM controller structure */
+	req_len += 4;	/* for alignment overhead */
+	req_len &= ~0x3;
+	req_len += 2 * mwNCM_NtbSize(param->NtbInSize, 4);	/* IN NTBs */
+	req_len += 2 * mwNCM_MaxDatagrams(param) * 2 * sizeof(uint16_t);	/* IN datagram lists */
+	req_len += 2 * mwNCM_NtbSize(param->NtbOutSize, USB_HS_MAX_BULK_PACKET);	/* OUT NTBs */
+
+	return req_len;
+}
+
+/*
+ *  NCM function initialization routine
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  param: Structure containing NCM function driver module
+ *						      initialization parameters.
+ *									phNcm: Handle to NCM Control Structure
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+ErrorCode_t mwNCM_init(USBD_HANDLE_T hUsb, USBD_NCM_INIT_PARAM_T *param, USBD_HANDLE_T *phNcm)
+{
+	uint32_t new_addr, i, n;
+	ErrorCode_t ret = LPC_OK;
+	USB_NCM_CTRL_T *pNcm;
+	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
+	USB_INTERFACE_DESCRIPTOR *pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->cif_intf_desc;
+
+	/* check for memory alignment */
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwNCM_GetMemSize(param))) {
+		return ERR_USBD_BAD_MEM_BUF;
+	}
+	if (param->NCM_RecvDatagram == 0) {
+		return ERR_API_INVALID_PARAM2;
+	}
+
+	/* allocate memory for the control data structure */
+	pNcm = (USB_NCM_CTRL_T *) param->mem_base;
+	param->mem_base += sizeof(USB_NCM_CTRL_T);
+	param->mem_size -= sizeof(USB_NCM_CTRL_T);
+	/* align to 4 byte boundary */
+	while (param->mem_base & 0x03) {
+		param->mem_base++;
+		param->mem_size--;
+	}
+
+	/* Init control structures with passed params */
+	memset((void *) pNcm, 0, sizeof(USB_NCM_CTRL_T));
+	pNcm->pUsbCtrl = (USB_CORE_CTRL_T *) hUsb;
+	pNcm->NCM_RecvDatagram = param->NCM_RecvDatagram;
+	pNcm->MaxDatagrams = mwNCM_MaxDatagrams(param);
+	pNcm->NtbInMax = mwNCM_NtbSize(param->NtbInSize, 4);
+	pNcm->NtbInSize = pNcm->NtbInMax;
+	pNcm->NtbOutSize = mwNCM_NtbSize(param->NtbOutSize, USB_HS_MAX_BULK_PACKET);
+	/* header and an NDP with room for every datagram and the terminating entry */
+	pNcm->tx_hdr_len = sizeof(NCM_NTH16) + 8 + ((pNcm->MaxDatagrams + 1) * sizeof(NCM_DPE16));
+
+	/* allocate memory for the NTBs */
+	for (i = 0; i < 2; i++) {
+		pNcm->tx[i].buf = (uint8_t *) param->mem_base;
+		param->mem_base += pNcm->NtbInMax;
+		param->mem_size -= pNcm->NtbInMax;
+		pNcm->tx[i].dg = (uint16_t *) param->mem_base;
+		n = pNcm->MaxDatagrams * 2 * sizeof(uint16_t);
+		param->mem_base += n;
+		param->mem_size -= n;
+		pNcm->rx_buf[i] = (uint8_t *) param->mem_base;
+		param->mem_base += pNcm->NtbOutSize;
+		param->mem_size -= pNcm->NtbOutSize;
+	}
+	pNcm->tx[0].used = pNcm->tx_hdr_len;
+	pNcm->tx[0].state = NCM_NTB_OPEN;
+	pNcm->tx[1].state = NCM_NTB_DONE;
+
+	/* parse the communication interface descriptor */
+	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+		(pIntfDesc->bInterfaceClass == CDC_COMMUNICATION_INTERFACE_CLASS) &&
+		(pIntfDesc->bInterfaceSubClass == CDC_NETWORK_CONTROL_MODEL) &&
+		(pIntfDesc->bNumEndpoints == 1) ) {
+
+		/* store interface number */
+		pNcm->cif_num = pIntfDesc->bInterfaceNumber;
+		new_addr = (uint32_t) pIntfDesc + pIntfDesc->bLength;
+		/* skip the functional descriptors */
+		do {
+			pEpDesc = (USB_ENDPOINT_DESCRIPTOR *) new_addr;
+			new_addr = (uint32_t) pEpDesc + pEpDesc->bLength;
+
+			if ((pEpDesc->bDescriptorType == USB_ENDPOINT_DESCRIPTOR_TYPE) &&
+				(pEpDesc->bmAttributes == USB_ENDPOINT_TYPE_INTERRUPT)) {
+				/* store INTERRUPT IN endpoint */
+				pNcm->epint_num = pEpDesc->bEndpointAddress;
+				ret = mwUSB_RegisterEpHandler(hUsb, ((pNcm->epint_num & 0x0F) << 1) + 1, mwNCM_int_in_hdlr, pNcm);
+				break;
+			}
+		} while (pEpDesc->bDescriptorType != USB_INTERFACE_DESCRIPTOR_TYPE);
+	}
+	else {
+		return ERR_USBD_BAD_INTF_DESC;
+	}
+
+	/* parse the data interface descriptor */
+	pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->dif_intf_desc;
+	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+		(pIntfDesc->bInterfaceClass == CDC_DATA_INTERFACE_CLASS) &&
+		(pIntfDesc->bInterfaceProtocol == CDC_PROTOCOL_NCM_NTB) &&
+		(pIntfDesc->bAlternateSetting == 1) ) {
+
+		/* store interface number */
+		pNcm->dif_num = pIntfDesc->bInterfaceNumber;
+		new_addr = (uint32_t) pIntfDesc + pIntfDesc->bLength;
+		/* move to next descriptor */
+		for (i = 0; (i < pIntfDesc->bNumEndpoints) && (ret == LPC_OK); i++) {
+			pEpDesc = (USB_ENDPOINT_DESCRIPTOR *) new_addr;
+			new_addr = (uint32_t) pEpDesc + pEpDesc->bLength;
+
+			/* parse endpoint descriptor */
+			if ((pEpDesc->bDescriptorType == USB_ENDPOINT_DESCRIPTOR_TYPE) &&
+				(pEpDesc->bmAttributes == USB_ENDPOINT_TYPE_BULK)) {
+
+				if (pEpDesc->bEndpointAddress & USB_ENDPOINT_DIRECTION_MASK) {
+					/* store BULK IN endpoint */
+					pNcm->epin_num = pEpDesc->bEndpointAddress;
+					ret = mwUSB_RegisterEpHandler(hUsb, ((pNcm->epin_num & 0x0F) << 1) + 1, mwNCM_bulk_in_hdlr, pNcm);
+				}
+				else {
+					/* store BULK OUT endpoint */
+					pNcm->epout_num = pEpDesc->bEndpointAddress;
+					ret = mwUSB_RegisterEpHandler(hUsb, ((pNcm->epout_num & 0x0F) << 1), mwNCM_bulk_out_hdlr, pNcm);
+				}
+			}
+		}
+	}
+	else {
+		return ERR_USBD_BAD_INTF_DESC;
+	}
+
+	if ( (pNcm->epint_num == 0) || (pNcm->epin_num == 0) || (pNcm->epout_num == 0) || (ret != LPC_OK) ) {
+		return ERR_USBD_BAD_EP_DESC;
+	}
+
+	/* register ep0 handler, for both interfaces */
+	ret = mwUSB_RegisterIntfHandler(hUsb, pNcm->cif_num, mwNCM_ep0_hdlr, pNcm);
+	if (ret == LPC_OK) {
+		ret = mwUSB_RegisterIntfHandler(hUsb, pNcm->dif_num, mwNCM_ep0_hdlr, pNcm);
+	}
+	/* return the handle */
+	*phNcm = (USBD_HANDLE_T) pNcm;
+
+	return ret;
+}
@@ -0,0 +1,254 @@
+/***********************************************************************
+ * $Id:: mw_usbd_ncmuser.h                                                     $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     USB CDC Network Control Model Custom User Module definitions.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#ifndef __NCMUSER_H__
+#define __NCMUSER_H__
+
+#include "error.h"
+#include "mw_usbd.h"
+#include "mw_usbd_ncm.h"
+#include "mw_usbd_core.h"
+
+/** \file
+ *  \brief CDC Network Control Model (NCM) API structures and function prototypes.
+ *
+ *  Definition of functions exported by the NCM function driver.
+ *
+ */
+
+/** \ingroup Group_USBD
+ *  @defgroup USBD_NCM CDC Network Control Model (NCM) Function Driver
+ *  \section Sec_NCMModDescription Module Description
+ *  NCM Class Function Driver module. This module makes the device a USB network
+ *  interface which moves Ethernet frames (datagrams) in 16-bit NCM Transfer Blocks.
+ *
+ *  Datagrams queued with SendDatagram() are packed into an NTB while the previous NTB
+ *  is on the bus, so a busy link carries many datagrams per transfer and an idle link
+ *  sends a datagram at once. Each NTB the host sends is unpacked in the USB interrupt,
+ *  and every datagram in it is handed to the NCM_RecvDatagram() callback.
+ *
+ *  The data interface has the usual two alternate settings: setting 0 without
+ *  endpoints and setting 1 with the BULK IN and OUT endpoints. The data path runs
+ *  while the host has selected setting 1; the link is then reported up with the
+ *  CONNECTION_SPEED_CHANGE and NETWORK_CONNECTION notifications.
+ */
+
+/** \brief Largest NTB handled by the NCM function driver, one transfer descriptor.
+ *  \ingroup USBD_NCM
+ */
+#define USB_NCM_MAX_NTB_SIZE            (16 * 1024)
+
+/** \brief Largest number of datagrams the NCM function driver packs in an IN NTB.
+ *  \ingroup USBD_NCM
+ */
+#define USB_NCM_MAX_DATAGRAMS           64
+
+/** \brief CDC NCM function driver initialization parameter data structure.
+ *  \ingroup USBD_NCM
+ *
+ *  \details  This data structure is used to pass initialization parameters to the
+ *  NCM function driver's init function.
+ *
+ */
+typedef struct USBD_NCM_INIT_PARAM {
+	/* memory allocation params */
+	uint32_t mem_base;	/**< Base memory location from where the stack can allocate
+						   data and buffers. \note The memory address set in this field
+						   should be accessible by USB DMA controller. Also this value
+						   should be aligned on 4 byte boundary.
+						 */
+	uint32_t mem_size;	/**< The size of memory buffer which stack can use.
+						   \note The \em mem_size should be greater than the size
+						   returned by USBD_NCM_API::GetMemSize() routine.*/
+	/** Pointer to the communication interface descriptor (subclass
+	 * \ref CDC_NETWORK_CONTROL_MODEL) within the descriptor array
+	 * (\em high_speed_desc) passed to Init() through \ref USB_CORE_DESCS_T
+	 * structure. Its interrupt endpoint carries the notifications.
+	 */
+	uint8_t *cif_intf_desc;
+	/** Pointer to alternate setting 1 of the data interface, the one with
+	 * the BULK endpoints, within the same descriptor array.
+	 */
+	uint8_t *dif_intf_desc;
+
+	/** Size in bytes of the NTBs sent to the host (dwNtbInMaxSize). Rounded down
+	 * to a multiple of 4 and limited to \ref NCM_NTB_MIN_SIZE .. \ref USB_NCM_MAX_NTB_SIZE.
+	 * Two NTBs of this size are allocated from \em mem_base.
+	 */
+	uint32_t NtbInSize;
+	/** Size in bytes of the NTBs accepted from the host (dwNtbOutMaxSize). Rounded
+	 * down to a multiple of USB_HS_MAX_BULK_PACKET and limited like \em NtbInSize.
+	 * Two NTBs of this size are allocated from \em mem_base, so one can be received
+	 * while the other is unpacked.
+	 */
+	uint32_t NtbOutSize;
+	/** Largest number of datagrams packed in one IN NTB. Limited to
+	 * \ref USB_NCM_MAX_DATAGRAMS, 0 selects 16.
+	 */
+	uint32_t MaxDatagrams;
+
+	/* user defined functions */
+	/**
+	 *  Datagram receive call-back function.
+	 *
+	 *  Called from the USB interrupt for each datagram of an NTB received from
+	 *  the host, in NTB order. The data stays valid until the call-back returns.
+	 *
+	 *  \param[in] hNcm Handle to NCM function driver.
+	 *  \param[in] data Pointer to the datagram, an Ethernet frame without FCS.
+	 *  \param[in] len  Length of the datagram.
+	 *  \return Nothing.
+	 */
+	void (*NCM_RecvDatagram)(USBD_HANDLE_T hNcm, uint8_t *data, uint32_t len);
+
+} USBD_NCM_INIT_PARAM_T;
+
+/** \brief NCM class API functions structure.
+ *  \ingroup USBD_NCM
+ *
+ *  This module exposes functions which interact directly with USB device controller hardware.
+ *
+ */
+typedef struct USBD_NCM_API {
+	/** \fn uint32_t GetMemSize(USBD_NCM_INIT_PARAM_T* param)
+	 *  Function to determine the memory required by the NCM function driver module.
+	 *
+	 *  This function is called by application layer before calling pUsbApi->ncm->Init(), to allocate memory used
+	 *  by NCM function driver module. The application should allocate the memory which is accessible by USB
+	 *  controller/DMA controller.
+	 *  \note Some memory areas are not accessible by all bus masters.
+	 *
+	 *  \param[in] param Structure containing NCM function driver module initialization parameters.
+	 *  \return Returns the required memory size in bytes.
+	 */
+	uint32_t (*GetMemSize)(USBD_NCM_INIT_PARAM_T *param);
+
+	/** \fn ErrorCode_t init(USBD_HANDLE_T hUsb, USBD_NCM_INIT_PARAM_T* param, USBD_HANDLE_T* phNcm)
+	 *  Function to initialize NCM function driver module.
+	 *
+	 *  This function is called by application layer to initialize NCM function driver module.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in, out] param Structure containing NCM function driver module initialization parameters.
+	 *  \param[out] phNcm Returns the handle to the NCM function driver.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success
+	 *          \retval ERR_USBD_BAD_MEM_BUF  Memory buffer passed is not 4-byte
+	 *              aligned or smaller than required.
+	 *          \retval ERR_API_INVALID_PARAM2 NCM_RecvDatagram() callback is not defined.
+	 *          \retval ERR_USBD_BAD_INTF_DESC  Wrong interface descriptor is passed.
+	 *          \retval ERR_USBD_BAD_EP_DESC  Wrong endpoint descriptor is passed.
+	 */
+	ErrorCode_t (*init)(USBD_HANDLE_T hUsb, USBD_NCM_INIT_PARAM_T *param, USBD_HANDLE_T *phNcm);
+
+	/** \fn uint32_t SendDatagram(USBD_HANDLE_T hNcm, const uint8_t *data, uint32_t len)
+	 *  Function to queue a datagram for the host.
+	 *
+	 *  Copies the datagram into the NTB being packed. The NTB is sent at once when
+	 *  the BULK IN endpoint is idle, otherwise when the NTB on the bus completes.
+	 *  The function is meant to be called from the main loop; it must not be called
+	 *  from more than one context at a time.
+	 *
+	 *  \param[in] hNcm Handle to NCM function driver.
+	 *  \param[in] data Datagram to send, an Ethernet frame without FCS.
+	 *  \param[in] len  Length of the datagram.
+	 *  \return \em len when queued, 0 when both NTBs are in use, the data interface
+	 *          is not active, or the datagram does not fit an NTB.
+	 */
+	uint32_t (*SendDatagram)(USBD_HANDLE_T hNcm, const uint8_t *data, uint32_t len);
+
+} USBD_NCM_API_T;
+
+/*-----------------------------------------------------------------------------
+ *  Private functions & structures prototypes
+ *-----------------------------------------------------------------------------*/
+/** @cond  ADVANCED_API */
+
+/* IN NTB states */
+#define NCM_NTB_OPEN                    0		/* Being packed by SendDatagram() */
+#define NCM_NTB_SENT                    1		/* Closed and on the bus */
+#define NCM_NTB_DONE                    2		/* Sent, free for SendDatagram() */
+
+/* Transfer states */
+#define NCM_XFER_IDLE                   0
+#define NCM_XFER_BUSY                   1
+
+/* IN NTB. The datagrams are copied behind room reserved for the header and
+   a full NDP; the header and NDP are written when the NTB is closed. */
+typedef struct _NCM_NTB_T {
+	uint8_t *buf;
+	uint16_t *dg;					/* offset and length of each datagram */
+	uint32_t used;					/* next free offset, SendDatagram() only */
+	volatile uint16_t count;		/* datagrams published by SendDatagram() */
+	volatile uint16_t sealed;		/* datagrams in the NTB when it was closed */
+	volatile uint8_t state;			/* NCM_NTB_xxx */
+	uint8_t pad[3];
+} NCM_NTB_T;
+
+typedef struct _NCM_CTRL_T {
+	USB_CORE_CTRL_T *pUsbCtrl;
+	/* notification buffer */
+	uint8_t notice_buf[16];
+
+	NCM_NTB_T tx[2];
+	uint32_t tx_hdr_len;			/* room reserved for NTH16 and NDP16 */
+	uint32_t tx_len;				/* length of the NTB on the bus */
+	uint16_t tx_seq;				/* wSequence of the next IN NTB */
+	uint8_t tx_fill;				/* NTB packed by SendDatagram() */
+	uint8_t tx_sending;				/* NTB on the bus */
+	volatile uint8_t tx_state;		/* NCM_XFER_xxx */
+	volatile uint8_t rx_state;		/* NCM_XFER_xxx */
+	uint8_t rx_cur;					/* receive buffer of the queued transfer */
+	volatile uint8_t active;		/* data interface in alternate setting 1 */
+	uint8_t notify;					/* NETWORK_CONNECTION pending behind SPEED_CHANGE */
+
+	uint8_t cif_num;				/* communication interface number */
+	uint8_t dif_num;				/* data interface number */
+	uint8_t epin_num;				/* BULK IN endpoint number */
+	uint8_t epout_num;				/* BULK OUT endpoint number */
+	uint8_t epint_num;				/* Interrupt IN endpoint number */
+	uint8_t MaxDatagrams;
+	uint8_t pad[2];
+
+	uint32_t NtbInMax;				/* dwNtbInMaxSize */
+	uint32_t NtbInSize;				/* current size set by SET_NTB_INPUT_SIZE */
+	uint32_t NtbOutSize;			/* dwNtbOutMaxSize */
+	uint8_t *rx_buf[2];
+
+	/* user defined functions */
+	void (*NCM_RecvDatagram)(USBD_HANDLE_T hNcm, uint8_t *data, uint32_t len);
+
+} USB_NCM_CTRL_T;
+
+/** @cond  DIRECT_API */
+extern uint32_t mwNCM_GetMemSize(USBD_NCM_INIT_PARAM_T *param);
+
+extern ErrorCode_t mwNCM_init(USBD_HANDLE_T hUsb, USBD_NCM_INIT_PARAM_T *param, USBD_HANDLE_T *phNcm);
+
+extern uint32_t mwNCM_SendDatagram(USBD_HANDLE_T hNcm, const uint8_t *data, uint32_t len);
+
+/** @endcond */
+
+/** @endcond */
+
+#endif  /* __NCMUSER_H__ */
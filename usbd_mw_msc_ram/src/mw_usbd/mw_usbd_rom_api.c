@@ -57,6 +57,9 @@ const  USBD_HW_API_T hw_api = {
 	hwUSB_WriteEP,
 	hwUSB_WakeUp,
 	hwUSB_EnableEvent,
+	hwUSB_ProcessEvents,
+	hwUSB_GetFrameNumber,
+	hwUSB_GetXferLen,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_hw_api_table"*/
@@ -80,6 +83,10 @@ const  USBD_CORE_API_T core_api = {
 	mwUSB_StatusOutStage,
 	mwUSB_StallEp0,
 	mwUSB_GetEpHandler,
+	mwUSB_GetIntfDesc,
+	mwUSB_FindIntfDesc,
+	mwUSB_GetEpDesc,
+	mwUSB_RegisterIntfHandler,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_core_api_table"*/
@@ -98,6 +105,7 @@ __attribute__((section(".nsec.USBD_MSC_API_TABLE")))
 const  USBD_MSC_API_T msc_api = {
 	mwMSC_GetMemSize,
 	mwMSC_init,
+	mwMSC_GetPrefetchStats,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_msc_api_table"*/
@@ -116,6 +124,7 @@ __attribute__((section(".nsec.USBD_DFU_API_TABLE")))
 const  USBD_DFU_API_T dfu_api = {
 	mwDFU_GetMemSize,
 	mwDFU_init,
+	mwDFU_Program,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_dfu_api_table"*/
@@ -134,6 +143,7 @@ __attribute__((section(".nsec.USBD_HID_API_TABLE")))
 const  USBD_HID_API_T hid_api = {
 	mwHID_GetMemSize,
 	mwHID_init,
+	mwHID_SendReport,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_hid_api_table"*/
@@ -153,11 +163,71 @@ const  USBD_CDC_API_T cdc_api = {
 	mwCDC_GetMemSize,
 	mwCDC_init,
 	mwCDC_SendNotification,
+	mwCDC_WriteData,
+	mwCDC_ReadData,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_cdc_api_table"*/
 #endif
 
+/*----------------------------------------------------------------------------
+ * USB Attached SCSI (UAS) API structures and function prototypes
+ *----------------------------------------------------------------------------*/
+#if defined (__ICCARM__)
+#pragma section = "usbd_uas_api_table"
+#elif defined ( __GNUC__ )
+__attribute__((section(".nsec.USBD_UAS_API_TABLE")))
+#elif defined ( __CC_ARM )
+#pragma arm section rodata = "usbd_uas_api_table"
+#endif
+const  USBD_UAS_API_T uas_api = {
+	mwUAS_GetMemSize,
+	mwUAS_init,
+};
+#if defined ( __CC_ARM )
+#pragma arm section /*"usbd_uas_api_table"*/
+#endif
+
+/*----------------------------------------------------------------------------
+ * Communication Device Class - Network Control Model (CDC-NCM) API structures
+ * and function prototypes
+ *----------------------------------------------------------------------------*/
+#if defined (__ICCARM__)
+#pragma section = "usbd_ncm_api_table"
+#elif defined ( __GNUC__ )
+__attribute__((section(".nsec.USBD_NCM_API_TABLE")))
+#elif defined ( __CC_ARM )
+#pragma arm section rodata = "usbd_ncm_api_table"
+#endif
+const  USBD_NCM_API_T ncm_api = {
+	mwNCM_GetMemSize,
+	mwNCM_init,
+	mwNCM_SendDatagram,
+};
+#if defined ( __CC_ARM )
+#pragma arm section /*"usbd_ncm_api_table"*/
+#endif
+
+/*----------------------------------------------------------------------------
+ * Audio Device Class (ADC) API structures and function prototypes
+ *----------------------------------------------------------------------------*/
+#if defined (__ICCARM__)
+#pragma section = "usbd_adc_api_table"
+#elif defined ( __GNUC__ )
+__attribute__((section(".nsec.USBD_ADC_API_TABLE")))
+#elif defined ( __CC_ARM )
+#pragma arm section rodata = "usbd_adc_api_table"
+#endif
+const  USBD_ADC_API_T adc_api = {
+	mwADC_GetMemSize,
+	mwADC_init,
+	mwADC_ReadSamples,
+	mwADC_GetStats,
+};
+#if defined ( __CC_ARM )
+#pragma arm section /*"usbd_adc_api_table"*/
+#endif
+
 /*----------------------------------------------------------------------------
  * Main USBD API structure
  *----------------------------------------------------------------------------*/
@@ -175,7 +245,7 @@ const  USBD_API_T usb_api = {
 	&dfu_api,
 	&hid_api,
 	&cdc_api,
-	0,
+	&uas_api,
 	0x02233405,	/* Version identifier of USB ROM stack. The version is
 				           defined as 0x0CHDMhCC where each nibble represnts version
 				           number of the corresponding component.
@@ -187,6 +257,8 @@ const  USBD_API_T usb_api = {
 				            C - 27:24 - 4bit CDC class module version number
 				            H - 31:28
 				 */
+	&ncm_api,
+	&adc_api,
 };
 #if defined ( __CC_ARM )
 #pragma arm section /*"usbd_api_table"*/
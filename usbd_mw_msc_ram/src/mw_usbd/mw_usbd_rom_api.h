@@ -38,6 +38,9 @@
 #include "mw_usbd_dfuuser.h"
 #include "mw_usbd_hiduser.h"
 #include "mw_usbd_cdcuser.h"
+#include "mw_usbd_uasuser.h"
+#include "mw_usbd_ncmuser.h"
+#include "mw_usbd_adcuser.h"
 
 /** \brief Main USBD API functions structure.
  *  \ingroup Group_USBD
@@ -67,7 +70,8 @@ typedef struct USBD_API {
 	const USBD_CDC_API_T *cdc;	/**< Pointer to function table which exposes functions
 								   provided by CDC-ACM function driver module.
 								 */
-	const uint32_t *reserved6;	/**< Reserved for future function driver module.
+	const USBD_UAS_API_T *uas;	/**< Pointer to function table which exposes functions
+								   provided by UAS function driver module.
 								 */
 	const uint32_t version;	/**< Version identifier of USB ROM stack. The version is
 							   defined as 0x0CHDMhCC where each nibble represents version
@@ -80,6 +84,13 @@ typedef struct USBD_API {
 							   C - 27:24 - 4bit CDC class module version number
 							   H - 31:28 - 4bit reserved
 							 */
+	/* modules added later follow version, so its offset stays fixed */
+	const USBD_NCM_API_T *ncm;	/**< Pointer to function table which exposes functions
+								   provided by CDC-NCM function driver module.
+								 */
+	const USBD_ADC_API_T *adc;	/**< Pointer to function table which exposes functions
+								   provided by audio streaming function driver module.
+								 */
 
 } USBD_API_T;
 
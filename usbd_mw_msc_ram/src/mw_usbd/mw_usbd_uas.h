@@ -0,0 +1,150 @@
+/***********************************************************************
+ * $Id:: mw_usbd_uas.h                                                         $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     USB Attached SCSI (UAS) definitions.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+
+#ifndef __UAS_H__
+#define __UAS_H__
+
+#include "mw_usbd.h"
+#include "mw_usbd_msc.h"
+
+/** \file
+ *  \brief USB Attached SCSI (UAS) descriptors and information units.
+ *
+ *  Definition of UAS class descriptors, information units and their bit defines.
+ *
+ */
+
+/* UAS Protocol Code */
+#define MSC_PROTOCOL_UAS                0x62
+
+/* Pipe Usage Descriptor */
+#define UAS_PIPE_USAGE_DESCRIPTOR_TYPE  0x24
+
+/* Pipe IDs */
+#define UAS_PIPE_ID_COMMAND             0x01
+#define UAS_PIPE_ID_STATUS              0x02
+#define UAS_PIPE_ID_DATA_IN             0x03
+#define UAS_PIPE_ID_DATA_OUT            0x04
+
+PRE_PACK struct POST_PACK _UAS_PIPE_USAGE_DESCRIPTOR {
+	uint8_t  bLength;
+	uint8_t  bDescriptorType;
+	uint8_t  bPipeID;
+	uint8_t  Reserved;
+};
+typedef struct _UAS_PIPE_USAGE_DESCRIPTOR UAS_PIPE_USAGE_DESCRIPTOR;
+
+/* Information Unit IDs */
+#define UAS_IU_COMMAND                  0x01
+#define UAS_IU_SENSE                    0x03
+#define UAS_IU_RESPONSE                 0x04
+#define UAS_IU_TASK_MGMT                0x05
+#define UAS_IU_READ_READY               0x06
+#define UAS_IU_WRITE_READY              0x07
+
+/* Tags and other multi-byte fields of the IUs are big endian. The stack
+   handles tags as opaque values and never converts them. */
+
+/* Command IU */
+PRE_PACK struct POST_PACK _UAS_COMMAND_IU {
+	uint8_t  bIUID;
+	uint8_t  Reserved1;
+	uint16_t wTag;
+	uint8_t  bPrioAttr;
+	uint8_t  Reserved5;
+	uint8_t  bAddCDBLength;
+	uint8_t  Reserved7;
+	uint8_t  LUN[8];
+	uint8_t  CDB[16];
+};
+typedef struct _UAS_COMMAND_IU UAS_COMMAND_IU;
+
+/* Task Management IU */
+PRE_PACK struct POST_PACK _UAS_TASK_MGMT_IU {
+	uint8_t  bIUID;
+	uint8_t  Reserved1;
+	uint16_t wTag;
+	uint8_t  bFunction;
+	uint8_t  Reserved5;
+	uint16_t wTaskTag;
+	uint8_t  LUN[8];
+};
+typedef struct _UAS_TASK_MGMT_IU UAS_TASK_MGMT_IU;
+
+/* Sense IU, with fixed format sense data */
+PRE_PACK struct POST_PACK _UAS_SENSE_IU {
+	uint8_t  bIUID;
+	uint8_t  Reserved1;
+	uint16_t wTag;
+	uint8_t  StatusQualifier[2];
+	uint8_t  bStatus;
+	uint8_t  Reserved7[7];
+	uint8_t  SenseLength[2];
+	uint8_t  SenseData[18];
+};
+typedef struct _UAS_SENSE_IU UAS_SENSE_IU;
+
+/* Response IU */
+PRE_PACK struct POST_PACK _UAS_RESPONSE_IU {
+	uint8_t  bIUID;
+	uint8_t  Reserved1;
+	uint16_t wTag;
+	uint8_t  AddResponseInfo[3];
+	uint8_t  bResponseCode;
+};
+typedef struct _UAS_RESPONSE_IU UAS_RESPONSE_IU;
+
+/* Read Ready and Write Ready IU */
+PRE_PACK struct POST_PACK _UAS_READY_IU {
+	uint8_t  bIUID;
+	uint8_t  Reserved1;
+	uint16_t wTag;
+};
+typedef struct _UAS_READY_IU UAS_READY_IU;
+
+/* Task Management Functions */
+#define UAS_TMF_ABORT_TASK              0x01
+#define UAS_TMF_ABORT_TASK_SET          0x02
+#define UAS_TMF_CLEAR_TASK_SET          0x04
+#define UAS_TMF_LOGICAL_UNIT_RESET      0x08
+#define UAS_TMF_I_T_NEXUS_RESET         0x10
+#define UAS_TMF_CLEAR_ACA               0x40
+#define UAS_TMF_QUERY_TASK              0x80
+#define UAS_TMF_QUERY_TASK_SET          0x81
+#define UAS_TMF_QUERY_ASYNC_EVENT       0x82
+
+/* Response Codes */
+#define UAS_RC_TMF_COMPLETE             0x00
+#define UAS_RC_INVALID_IU               0x02
+#define UAS_RC_TMF_NOT_SUPPORTED        0x04
+#define UAS_RC_TMF_FAILED               0x05
+#define UAS_RC_TMF_SUCCEEDED            0x08
+#define UAS_RC_INCORRECT_LUN            0x09
+#define UAS_RC_OVERLAPPED_TAG           0x0A
+
+/* SCSI Status Codes */
+#define SCSI_STATUS_GOOD                0x00
+#define SCSI_STATUS_CHECK_CONDITION     0x02
+
+#endif  /* __UAS_H__ */
@@ -0,0 +1,1275 @@
+/***********************************************************************
+ * $Id:: mw_usbd_uasuser.c                                                     $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     USB Attached SCSI Class Custom User Module.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#include <string.h>	/*for memcpy */
+
+#include "mw_usbd.h"
+#include "mw_usbd_core.h"
+#include "mw_usbd_hw.h"
+#include "mw_usbd_mscuser.h"
+#include "mw_usbd_uasuser.h"
+
+#ifndef FALSE
+#define FALSE 0
+#define TRUE !FALSE
+#endif
+
+/* forward declarations */
+void mwUAS_Run(USB_UAS_CTRL_T *pUas);
+void mwUAS_Complete(USB_UAS_CTRL_T *pUas);
+
+/*
+ *  UAS Bulk Pipe Max Packet Size
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    Max packet size of the bulk pipes at the current speed
+ */
+
+uint32_t mwUAS_MaxPacket(USB_UAS_CTRL_T *pUas) {
+	return (pUas->pUsbCtrl->device_speed == USB_HIGH_SPEED) ? USB_HS_MAX_BULK_PACKET : USB_FS_MAX_BULK_PACKET;
+}
+
+/*
+ *  UAS Data Buffer
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   idx: Buffer index
+ *  Return Value:    Pointer to the data buffer
+ */
+
+uint8_t *mwUAS_XferSlot(USB_UAS_CTRL_T *pUas, uint32_t idx) {
+	return pUas->XferBuf + (idx * pUas->XferBufSize);
+}
+
+/*
+ *  UAS Next Data Buffer
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   idx: Buffer index
+ *  Return Value:    Index of the buffer following idx
+ */
+
+uint8_t mwUAS_XferNextSlot(USB_UAS_CTRL_T *pUas, uint32_t idx) {
+	return (idx + 1 >= pUas->XferBufCnt) ? 0 : (idx + 1);
+}
+
+/*
+ *  UAS LUN Check
+ *  Parameters:      lun: 8 byte LUN field of an IU
+ *  Return Value:    TRUE for LUN 0, the only unit of the device
+ */
+
+uint32_t mwUAS_LunValid(const uint8_t *lun) {
+	uint32_t i;
+
+	for (i = 0; i < 8; i++) {
+		if (lun[i] != 0) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ *  UAS Find Command by Tag
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   wTag: Tag as sent by the host
+ *  Return Value:    Command slot, UAS_NO_CMD if no such command is outstanding
+ */
+
+uint32_t mwUAS_FindTag(USB_UAS_CTRL_T *pUas, uint16_t wTag) {
+	uint32_t i;
+
+	for (i = 0; i < pUas->MaxCmds; i++) {
+		if ((pUas->Cmds[i].State != UAS_CMD_FREE) && (pUas->Cmds[i].wTag == wTag)) {
+			return i;
+		}
+	}
+	return UAS_NO_CMD;
+}
+
+/*
+ *  UAS Find Oldest Command
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   state: Command state looked for
+ *  Return Value:    Command slot received first among those in the state,
+ *                   UAS_NO_CMD if none
+ */
+
+uint32_t mwUAS_Oldest(USB_UAS_CTRL_T *pUas, uint32_t state) {
+	uint32_t i, found = UAS_NO_CMD;
+
+	for (i = 0; i < pUas->MaxCmds; i++) {
+		if ((pUas->Cmds[i].State == state) &&
+			((found == UAS_NO_CMD) || ((int32_t) (pUas->Cmds[i].Seq - pUas->Cmds[found].Seq) < 0))) {
+			found = i;
+		}
+	}
+	return found;
+}
+
+/*
+ *  UAS Set Sense Data of a Failed Command
+ *  Parameters:      pCmd: Command slot
+ *                   key: Sense key
+ *                   asc: Additional sense code
+ *  Return Value:    None
+ */
+
+void mwUAS_SetSense(UAS_CMD_T *pCmd, uint8_t key, uint8_t asc) {
+	pCmd->Status = SCSI_STATUS_CHECK_CONDITION;
+	pCmd->SenseKey = key;
+	pCmd->Asc = asc;
+}
+
+/*
+ *  UAS Check the last storage access for a medium error
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    TRUE if the last MSC_Read() or MSC_Write() call failed
+ */
+
+uint32_t mwUAS_IoFailed(USB_UAS_CTRL_T *pUas) {
+	return (pUas->MSC_GetError != 0) && (pUas->MSC_GetError() != LPC_OK);
+}
+
+/*
+ *  UAS Queue Response IU
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   wTag: Tag of the IU answered
+ *                   code: Response code
+ *  Return Value:    None
+ */
+
+void mwUAS_Respond(USB_UAS_CTRL_T *pUas, uint16_t wTag, uint8_t code) {
+	pUas->RespTag = wTag;
+	pUas->RespCode = code;
+	pUas->RespPending = TRUE;
+}
+
+/*
+ *  UAS Command Pipe Read request routine
+ *  The command pipe is primed while a command slot is free and no RESPONSE IU
+ *  waits to be sent, which holds the host back otherwise.
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_PrimeCmd(USB_UAS_CTRL_T *pUas) {
+	uint32_t i;
+
+	if (pUas->CmdPrimed || pUas->RespPending) {
+		return;
+	}
+	for (i = 0; i < pUas->MaxCmds; i++) {
+		if (pUas->Cmds[i].State == UAS_CMD_FREE) {
+			break;
+		}
+	}
+	if (i == pUas->MaxCmds) {
+		return;
+	}
+	if (pUas->pUsbCtrl->hw_api->ReadReqEP(pUas->pUsbCtrl, pUas->cmd_ep, pUas->CmdBuf, mwUAS_MaxPacket(pUas)) != 0) {
+		pUas->CmdPrimed = TRUE;
+	}
+}
+
+/*
+ *  UAS Abort Command
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   idx: Command slot
+ *  Return Value:    FALSE if the command is moving data and can not be aborted
+ */
+
+uint32_t mwUAS_Abort(USB_UAS_CTRL_T *pUas, uint32_t idx) {
+
+	switch (pUas->Cmds[idx].State) {
+	case UAS_CMD_QUEUED:
+	case UAS_CMD_STATUS:
+		pUas->Cmds[idx].State = UAS_CMD_FREE;
+		return TRUE;
+
+	case UAS_CMD_READY:
+	case UAS_CMD_DATA:
+		return FALSE;
+
+	default:
+		/* SENSE IU already on the way */
+		return TRUE;
+	}
+}
+
+/*
+ *  UAS Data-In Read routine
+ *  Fills the free data buffers through MSC_Read() and queues them on the
+ *  data-in pipe.
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_MemoryRead(USB_UAS_CTRL_T *pUas) {
+	uint32_t n;
+	uint8_t *buff;
+
+	while ((pUas->Length != 0) && (pUas->XferQueued < pUas->XferBufCnt)) {
+		n = (pUas->Length < pUas->XferBufSize) ? pUas->Length : pUas->XferBufSize;
+		buff = mwUAS_XferSlot(pUas, pUas->XferNext);
+		/* read data from user callback. User could update buffer
+		 * pointer to his own buffer without making extra copy.
+		 */
+		pUas->MSC_Read(((uint32_t) pUas->Offset & 0xFFFFFFFF), &buff, n, (pUas->Offset >> 32));
+		if (mwUAS_IoFailed(pUas)) {
+			/* send what is queued, the SENSE IU ends the data phase */
+			mwUAS_SetSense(&pUas->Cmds[pUas->Active], SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_UNRECOVERED_READ_ERROR);
+			pUas->Length = 0;
+			break;
+		}
+		if (pUas->pUsbCtrl->hw_api->WriteEP(pUas->pUsbCtrl, pUas->din_ep, buff, n) == 0) {
+			/* pipe busy, the chunk is read again on the next completion */
+			break;
+		}
+		pUas->XferQueued++;
+		pUas->XferNext = mwUAS_XferNextSlot(pUas, pUas->XferNext);
+		pUas->Offset += n;
+		pUas->Length -= n;
+	}
+}
+
+/*
+ *  UAS Data-Out Read request routine
+ *  Primes the data-out pipe for the next chunks of WRITE or VERIFY data.
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_ReadReqData(USB_UAS_CTRL_T *pUas) {
+	uint32_t n, depth;
+	uint8_t *buff;
+
+	/* data received straight into the destination is handed over one chunk at a time */
+	depth = (pUas->RxDirect) ? 1 : pUas->XferBufCnt;
+
+	while ((pUas->Length != 0) && (pUas->XferQueued < depth)) {
+		n = (pUas->Length < pUas->XferBufSize) ? pUas->Length : pUas->XferBufSize;
+		buff = (pUas->RxDirect) ? pUas->rx_buf : mwUAS_XferSlot(pUas, pUas->XferNext);
+		if (pUas->pUsbCtrl->hw_api->ReadReqEP(pUas->pUsbCtrl, pUas->dout_ep, buff, n) == 0) {
+			/* pipe busy, retried on the next completion or NAK */
+			break;
+		}
+		pUas->Length -= n;
+		pUas->XferQueued++;
+		pUas->XferNext = mwUAS_XferNextSlot(pUas, pUas->XferNext);
+	}
+}
+
+/*
+ *  UAS Start Data Phase of the Active Command
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_StartData(USB_UAS_CTRL_T *pUas) {
+
+	if (pUas->DataIn == FALSE) {
+		mwUAS_ReadReqData(pUas);
+	}
+	else if (pUas->SmallLen != 0) {
+		pUas->pUsbCtrl->hw_api->WriteEP(pUas->pUsbCtrl, pUas->din_ep, pUas->DataBuf, pUas->SmallLen);
+		pUas->XferQueued = 1;
+	}
+	else {
+		mwUAS_MemoryRead(pUas);
+		if ((pUas->Length == 0) && (pUas->XferQueued == 0)) {
+			/* failed on the first chunk, no completion is coming */
+			mwUAS_Complete(pUas);
+		}
+	}
+}
+
+/*
+ *  UAS Complete Data Phase of the Active Command
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_Complete(USB_UAS_CTRL_T *pUas) {
+
+	pUas->Cmds[pUas->Active].State = UAS_CMD_STATUS;
+	pUas->Active = UAS_NO_CMD;
+	mwUAS_Run(pUas);
+}
+
+/*
+ *  UAS Short Data-In Setup
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   idx: Command slot
+ *                   len: Bytes prepared in DataBuf
+ *                   alloc: Allocation length of the CDB
+ *  Return Value:    None
+ */
+
+void mwUAS_SmallIn(USB_UAS_CTRL_T *pUas, uint32_t idx, uint32_t len, uint32_t alloc) {
+
+	if (alloc < len) {
+		len = alloc;
+	}
+	if (len == 0) {
+		return;
+	}
+	pUas->SmallLen = len;
+	pUas->Length = 0;
+	pUas->XferQueued = 0;
+	pUas->DataIn = TRUE;
+	pUas->Active = idx;
+	pUas->Cmds[idx].State = UAS_CMD_READY;
+}
+
+/*
+ *  Get Big Endian 32-bit CDB Field
+ *  Parameters:      p: Pointer to the most significant byte
+ *  Return Value:    Field value
+ */
+
+uint32_t mwUAS_GetBE32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ *  UAS Number of Blocks
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    Number of whole blocks in MemorySize
+ */
+
+uint64_t mwUAS_BlockCount64(USB_UAS_CTRL_T *pUas) {
+	return (pUas->BlockSize == 0) ? 0 : (pUas->MemorySize / pUas->BlockSize);
+}
+
+/*
+ *  UAS Block Command Setup (READ, WRITE, VERIFY)
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   idx: Command slot
+ *  Return Value:    None
+ */
+
+void mwUAS_BlockCmd(USB_UAS_CTRL_T *pUas, uint32_t idx) {
+	UAS_CMD_T *pCmd = &pUas->Cmds[idx];
+	uint8_t *cdb = pCmd->CDB;
+	uint64_t lba, length;
+	uint32_t n;
+
+	switch (cdb[0]) {
+	case SCSI_READ16:
+	case SCSI_WRITE16:
+		/* Logical Block Address of First Block, Number of Blocks to transfer */
+		lba = ((uint64_t) mwUAS_GetBE32(&cdb[2]) << 32) | mwUAS_GetBE32(&cdb[6]);
+		n = mwUAS_GetBE32(&cdb[10]);
+		break;
+
+	case SCSI_READ12:
+	case SCSI_WRITE12:
+		lba = mwUAS_GetBE32(&cdb[2]);
+		n = mwUAS_GetBE32(&cdb[6]);
+		break;
+
+	default:
+		lba = mwUAS_GetBE32(&cdb[2]);
+		n = (cdb[7] << 8) | cdb[8];
+		break;
+	}
+
+	/* range is checked in blocks, a huge LBA would wrap the byte offset */
+	length = (uint64_t) n * pUas->BlockSize;
+	if ((lba > mwUAS_BlockCount64(pUas)) || (n > (mwUAS_BlockCount64(pUas) - lba)) || (length > 0xFFFFFFFF)) {
+		mwUAS_SetSense(pCmd, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE);
+		return;
+	}
+	if (n == 0) {
+		return;
+	}
+	/* VERIFY with BYTCHK = 0 has no data, the medium checks itself */
+	if ((cdb[0] == SCSI_VERIFY10) && ((cdb[1] & 0x02) == 0)) {
+		if ((pUas->MSC_VerifyRange) &&
+			(pUas->MSC_VerifyRange(((uint32_t) (lba * pUas->BlockSize) & 0xFFFFFFFF), (uint32_t) length,
+								   ((lba * pUas->BlockSize) >> 32)) != LPC_OK)) {
+			mwUAS_SetSense(pCmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_UNRECOVERED_READ_ERROR);
+		}
+		return;
+	}
+
+	pUas->Offset = lba * pUas->BlockSize;
+	pUas->Length = (uint32_t) length;
+	pUas->SmallLen = 0;
+	pUas->XferQueued = 0;
+	pUas->XferNext = 0;
+	pUas->XferDone = 0;
+	pUas->MemOK = TRUE;
+	pUas->DataIn = (cdb[0] == SCSI_READ10) || (cdb[0] == SCSI_READ12) || (cdb[0] == SCSI_READ16);
+	pUas->RxDirect = (pUas->MSC_GetWriteBuf != 0) &&
+					 ((cdb[0] == SCSI_WRITE10) || (cdb[0] == SCSI_WRITE12) || (cdb[0] == SCSI_WRITE16));
+	if (pUas->DataIn == FALSE) {
+		pUas->rx_buf = pUas->XferBuf;
+		/* get destination buffer */
+		if (pUas->RxDirect) {
+			pUas->MSC_GetWriteBuf(((uint32_t) pUas->Offset & 0xFFFFFFFF), &pUas->rx_buf, pUas->Length, (pUas->Offset >> 32));
+		}
+	}
+	pUas->Active = idx;
+	pCmd->State = UAS_CMD_READY;
+}
+
+/*
+ *  UAS Mode Pages
+ *  Only the Caching page is reported, with WCE set when MSC_Flush() is there
+ *  to write the cache back. Other pages are returned empty.
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   cdb: MODE SENSE command
+ *                   buf: Destination of the pages
+ *  Return Value:    Length of the pages in bytes
+ */
+
+uint32_t mwUAS_ModePages(USB_UAS_CTRL_T *pUas, const uint8_t *cdb, uint8_t *buf) {
+	uint32_t page = cdb[2] & 0x3F;
+
+	if ((page != SCSI_MODE_PAGE_CACHING) && (page != SCSI_MODE_PAGE_ALL)) {
+		return 0;
+	}
+	memset((void *) buf, 0, 20);
+	buf[0] = SCSI_MODE_PAGE_CACHING;	/* Page Code */
+	buf[1] = 0x12;						/* Page Length */
+	/* PC = 1 asks for the changeable values, none are */
+	if ((pUas->MSC_Flush) && ((cdb[2] & 0xC0) != 0x40)) {
+		buf[2] = 0x04;					/* WCE = 1: write cache enabled */
+	}
+	return 20;
+}
+
+/*
+ *  UAS Execute Command
+ *  Commands without data complete at once, the others take the data pipes.
+ *  Parameters:      pUas: Handle to UAS structure
+ *                   idx: Command slot
+ *  Return Value:    None
+ */
+
+void mwUAS_Execute(USB_UAS_CTRL_T *pUas, uint32_t idx) {
+	UAS_CMD_T *pCmd = &pUas->Cmds[idx];
+	uint8_t *cdb = pCmd->CDB;
+	uint32_t i;
+
+	/* unless a data phase is started below */
+	pCmd->State = UAS_CMD_STATUS;
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+		break;
+
+	case SCSI_REQUEST_SENSE:
+		/* sense data is returned in the SENSE IU, nothing is pending here */
+		memset((void *) &pUas->DataBuf[0], 0, 18);
+		pUas->DataBuf[0] = 0x70;		// Response Code
+		pUas->DataBuf[7] = 0x0A;		// Additional Length
+		mwUAS_SmallIn(pUas, idx, 18, cdb[4]);
+		break;
+
+	case SCSI_INQUIRY:
+		if (cdb[1] & 0x01) {
+			/* no vital product data pages */
+			mwUAS_SetSense(pCmd, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB);
+			break;
+		}
+		pUas->DataBuf[0] = 0x00;		/* Direct Access Device */
+		pUas->DataBuf[1] = 0x80;		/* RMB = 1: Removable Medium */
+		pUas->DataBuf[2] = 0x00;		/* Version: No conformance claim to standard */
+		pUas->DataBuf[3] = 0x01;
+
+		pUas->DataBuf[4] = 36 - 4;		/* Additional Length */
+		pUas->DataBuf[5] = 0x80;		/* SCCS = 1: Storage Controller Component */
+		pUas->DataBuf[6] = 0x00;
+		pUas->DataBuf[7] = 0x02;		/* CmdQue = 1: tagged commands */
+
+		/* Vendor Identification */
+		/* Product Identification */
+		/* Product Revision Level */
+		for (i = 0; i < 28; i++) {
+			pUas->DataBuf[i + 8] = pUas->InquiryStr[i];
+		}
+		mwUAS_SmallIn(pUas, idx, 36, (cdb[3] << 8) | cdb[4]);
+		break;
+
+	case SCSI_MODE_SENSE6:
+		memset((void *) &pUas->DataBuf[0], 0, 4);
+		i = mwUAS_ModePages(pUas, cdb, &pUas->DataBuf[4]);
+		pUas->DataBuf[0] = 0x03 + i;
+		pUas->DataBuf[2] = (pUas->MSC_Flush) ? 0x10 : 0x00;	/* DPOFUA */
+		mwUAS_SmallIn(pUas, idx, 4 + i, cdb[4]);
+		break;
+
+	case SCSI_MODE_SENSE10:
+		memset((void *) &pUas->DataBuf[0], 0, 8);
+		i = mwUAS_ModePages(pUas, cdb, &pUas->DataBuf[8]);
+		pUas->DataBuf[1] = 0x06 + i;
+		pUas->DataBuf[3] = (pUas->MSC_Flush) ? 0x10 : 0x00;	/* DPOFUA */
+		mwUAS_SmallIn(pUas, idx, 8 + i, (cdb[7] << 8) | cdb[8]);
+		break;
+
+	case SCSI_READ_FORMAT_CAPACITIES:
+		pUas->DataBuf[0] = 0x00;
+		pUas->DataBuf[1] = 0x00;
+		pUas->DataBuf[2] = 0x00;
+		pUas->DataBuf[3] = 0x08;		/* Capacity List Length */
+
+		/* Block Count */
+		pUas->DataBuf[4] = (pUas->BlockCount >> 24) & 0xFF;
+		pUas->DataBuf[5] = (pUas->BlockCount >> 16) & 0xFF;
+		pUas->DataBuf[6] = (pUas->BlockCount >>  8) & 0xFF;
+		pUas->DataBuf[7] = (pUas->BlockCount >>  0) & 0xFF;
+
+		/* Block Length */
+		pUas->DataBuf[8] = 0x02;		/* Descriptor Code: Formatted Media */
+		pUas->DataBuf[9] = (pUas->BlockSize >> 16) & 0xFF;
+		pUas->DataBuf[10] = (pUas->BlockSize >>  8) & 0xFF;
+		pUas->DataBuf[11] = (pUas->BlockSize >>  0) & 0xFF;
+		mwUAS_SmallIn(pUas, idx, 12, (cdb[7] << 8) | cdb[8]);
+		break;
+
+	case SCSI_READ_CAPACITY:
+		if (mwUAS_BlockCount64(pUas) == 0) {
+			/* no medium, there is no last LBA to report */
+			mwUAS_SetSense(pCmd, SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT);
+			break;
+		}
+		/* Last Logical Block */
+		if (mwUAS_BlockCount64(pUas) > 0xFFFFFFFF) {
+			/* too large, the host has to use READ CAPACITY(16) */
+			memset((void *) &pUas->DataBuf[0], 0xFF, 4);
+		}
+		else {
+			pUas->DataBuf[0] = ((pUas->BlockCount - 1) >> 24) & 0xFF;
+			pUas->DataBuf[1] = ((pUas->BlockCount - 1) >> 16) & 0xFF;
+			pUas->DataBuf[2] = ((pUas->BlockCount - 1) >>  8) & 0xFF;
+			pUas->DataBuf[3] = ((pUas->BlockCount - 1) >>  0) & 0xFF;
+		}
+
+		/* Block Length */
+		pUas->DataBuf[4] = (pUas->BlockSize >> 24) & 0xFF;
+		pUas->DataBuf[5] = (pUas->BlockSize >> 16) & 0xFF;
+		pUas->DataBuf[6] = (pUas->BlockSize >>  8) & 0xFF;
+		pUas->DataBuf[7] = (pUas->BlockSize >>  0) & 0xFF;
+		mwUAS_SmallIn(pUas, idx, 8, 8);
+		break;
+
+	case SCSI_SERVICE_ACTION_IN16:
+		if ((cdb[1] & 0x1F) != SCSI_SA_READ_CAPACITY16) {
+			mwUAS_SetSense(pCmd, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND);
+			break;
+		}
+		if (mwUAS_BlockCount64(pUas) == 0) {
+			/* no medium, there is no last LBA to report */
+			mwUAS_SetSense(pCmd, SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT);
+			break;
+		}
+		memset((void *) &pUas->DataBuf[0], 0, 32);
+		/* Last Logical Block */
+		for (i = 0; i < 8; i++) {
+			pUas->DataBuf[i] = ((mwUAS_BlockCount64(pUas) - 1) >> (56 - (8 * i))) & 0xFF;
+		}
+		/* Block Length */
+		pUas->DataBuf[8] = (pUas->BlockSize >> 24) & 0xFF;
+		pUas->DataBuf[9] = (pUas->BlockSize >> 16) & 0xFF;
+		pUas->DataBuf[10] = (pUas->BlockSize >>  8) & 0xFF;
+		pUas->DataBuf[11] = (pUas->BlockSize >>  0) & 0xFF;
+		mwUAS_SmallIn(pUas, idx, 32, mwUAS_GetBE32(&cdb[10]));
+		break;
+
+	case SCSI_READ10:
+	case SCSI_READ12:
+	case SCSI_READ16:
+	case SCSI_WRITE10:
+	case SCSI_WRITE12:
+	case SCSI_WRITE16:
+	case SCSI_VERIFY10:
+		mwUAS_BlockCmd(pUas, idx);
+		break;
+
+	case SCSI_SYNC_CACHE10:
+	case SCSI_SYNC_CACHE16:
+		/* write back whatever the application caches */
+		if ((pUas->MSC_Flush) && (pUas->MSC_Flush() != LPC_OK)) {
+			mwUAS_SetSense(pCmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+		}
+		break;
+
+	case SCSI_FORMAT_UNIT:
+	case SCSI_START_STOP_UNIT:
+	case SCSI_MEDIA_REMOVAL:
+	case SCSI_MODE_SELECT10:
+	case SCSI_MODE_SELECT6:
+	default:
+		mwUAS_SetSense(pCmd, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND);
+		break;
+	}
+}
+
+/*
+ *  UAS Command Scheduler
+ *  Starts the queued commands in arrival order while the data pipes are free,
+ *  then sends the next IU on the status pipe: a RESPONSE IU first, then the
+ *  READ/WRITE READY IU of the active command, then the SENSE IU of the oldest
+ *  completed command.
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_Run(USB_UAS_CTRL_T *pUas) {
+	UAS_CMD_T *pCmd;
+	UAS_SENSE_IU *pSense = (UAS_SENSE_IU *) pUas->StatBuf;
+	uint32_t i, len;
+
+	while (pUas->Active == UAS_NO_CMD) {
+		i = mwUAS_Oldest(pUas, UAS_CMD_QUEUED);
+		if (i == UAS_NO_CMD) {
+			break;
+		}
+		mwUAS_Execute(pUas, i);
+	}
+
+	if (pUas->StatBusy) {
+		return;
+	}
+
+	if (pUas->RespPending) {
+		UAS_RESPONSE_IU *pResp = (UAS_RESPONSE_IU *) pUas->StatBuf;
+
+		memset((void *) pResp, 0, sizeof(UAS_RESPONSE_IU));
+		pResp->bIUID = UAS_IU_RESPONSE;
+		pResp->wTag = pUas->RespTag;
+		pResp->bResponseCode = pUas->RespCode;
+		pUas->RespPending = FALSE;
+		pUas->StatCmd = UAS_NO_CMD;
+		pUas->StatBusy = TRUE;
+		pUas->pUsbCtrl->hw_api->WriteEP(pUas->pUsbCtrl, pUas->stat_ep, pUas->StatBuf, sizeof(UAS_RESPONSE_IU));
+		return;
+	}
+
+	if ((pUas->Active != UAS_NO_CMD) && (pUas->Cmds[pUas->Active].State == UAS_CMD_READY)) {
+		UAS_READY_IU *pReady = (UAS_READY_IU *) pUas->StatBuf;
+
+		pCmd = &pUas->Cmds[pUas->Active];
+		pReady->bIUID = (pUas->DataIn) ? UAS_IU_READ_READY : UAS_IU_WRITE_READY;
+		pReady->Reserved1 = 0;
+		pReady->wTag = pCmd->wTag;
+		pCmd->State = UAS_CMD_DATA;
+		pUas->StatCmd = UAS_NO_CMD;
+		pUas->StatBusy = TRUE;
+		pUas->pUsbCtrl->hw_api->WriteEP(pUas->pUsbCtrl, pUas->stat_ep, pUas->StatBuf, sizeof(UAS_READY_IU));
+		/* the host moves the data once it has seen the READY IU */
+		mwUAS_StartData(pUas);
+		return;
+	}
+
+	i = mwUAS_Oldest(pUas, UAS_CMD_STATUS);
+	if (i != UAS_NO_CMD) {
+		pCmd = &pUas->Cmds[i];
+		memset((void *) pSense, 0, sizeof(UAS_SENSE_IU));
+		pSense->bIUID = UAS_IU_SENSE;
+		pSense->wTag = pCmd->wTag;
+		pSense->bStatus = pCmd->Status;
+		len = sizeof(UAS_SENSE_IU) - sizeof(pSense->SenseData);
+		if (pCmd->Status != SCSI_STATUS_GOOD) {
+			pSense->SenseLength[1] = sizeof(pSense->SenseData);
+			pSense->SenseData[0] = 0x70;		// Response Code
+			pSense->SenseData[2] = pCmd->SenseKey;	// Sense Key
+			pSense->SenseData[7] = 0x0A;		// Additional Length
+			pSense->SenseData[12] = pCmd->Asc;	// ASC
+			len = sizeof(UAS_SENSE_IU);
+		}
+		pCmd->State = UAS_CMD_SENDING;
+		pUas->StatCmd = i;
+		pUas->StatBusy = TRUE;
+		pUas->pUsbCtrl->hw_api->WriteEP(pUas->pUsbCtrl, pUas->stat_ep, pUas->StatBuf, len);
+	}
+}
+
+/*
+ *  UAS Command IU Callback
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_CommandIU(USB_UAS_CTRL_T *pUas) {
+	UAS_COMMAND_IU *pIU = (UAS_COMMAND_IU *) pUas->CmdBuf;
+	UAS_CMD_T *pCmd;
+	uint32_t i;
+
+	if (mwUAS_FindTag(pUas, pIU->wTag) != UAS_NO_CMD) {
+		mwUAS_Respond(pUas, pIU->wTag, UAS_RC_OVERLAPPED_TAG);
+		return;
+	}
+	/* the command pipe is only primed with a free slot */
+	for (i = 0; i < pUas->MaxCmds; i++) {
+		if (pUas->Cmds[i].State == UAS_CMD_FREE) {
+			break;
+		}
+	}
+	if (i == pUas->MaxCmds) {
+		return;
+	}
+
+	pCmd = &pUas->Cmds[i];
+	pCmd->wTag = pIU->wTag;
+	pCmd->Seq = pUas->Seq++;
+	pCmd->Status = SCSI_STATUS_GOOD;
+	pCmd->SenseKey = SCSI_SENSE_NO_SENSE;
+	pCmd->Asc = 0;
+	memcpy(pCmd->CDB, pIU->CDB, sizeof(pCmd->CDB));
+	pCmd->State = UAS_CMD_QUEUED;
+
+	if (!mwUAS_LunValid(pIU->LUN)) {
+		mwUAS_SetSense(pCmd, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LUN_NOT_SUPPORTED);
+		pCmd->State = UAS_CMD_STATUS;
+	}
+}
+
+/*
+ *  UAS Task Management IU Callback
+ *  Commands which have not started moving data can be aborted, the data
+ *  phase of the active command runs to completion.
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_TaskMgmtIU(USB_UAS_CTRL_T *pUas) {
+	UAS_TASK_MGMT_IU *pIU = (UAS_TASK_MGMT_IU *) pUas->CmdBuf;
+	uint8_t code = UAS_RC_TMF_COMPLETE;
+	uint32_t i;
+
+	if ((pIU->bFunction != UAS_TMF_I_T_NEXUS_RESET) && !mwUAS_LunValid(pIU->LUN)) {
+		mwUAS_Respond(pUas, pIU->wTag, UAS_RC_INCORRECT_LUN);
+		return;
+	}
+
+	switch (pIU->bFunction) {
+	case UAS_TMF_ABORT_TASK:
+		i = mwUAS_FindTag(pUas, pIU->wTaskTag);
+		if ((i != UAS_NO_CMD) && !mwUAS_Abort(pUas, i)) {
+			code = UAS_RC_TMF_FAILED;
+		}
+		break;
+
+	case UAS_TMF_ABORT_TASK_SET:
+	case UAS_TMF_CLEAR_TASK_SET:
+	case UAS_TMF_LOGICAL_UNIT_RESET:
+	case UAS_TMF_I_T_NEXUS_RESET:
+		for (i = 0; i < pUas->MaxCmds; i++) {
+			if ((pUas->Cmds[i].State != UAS_CMD_FREE) && !mwUAS_Abort(pUas, i)) {
+				code = UAS_RC_TMF_FAILED;
+			}
+		}
+		break;
+
+	case UAS_TMF_QUERY_TASK:
+		if (mwUAS_FindTag(pUas, pIU->wTaskTag) != UAS_NO_CMD) {
+			code = UAS_RC_TMF_SUCCEEDED;
+		}
+		break;
+
+	default:
+		code = UAS_RC_TMF_NOT_SUPPORTED;
+		break;
+	}
+	mwUAS_Respond(pUas, pIU->wTag, code);
+}
+
+/*
+ *  UAS Command Pipe Out Callback
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_CmdOut(USB_UAS_CTRL_T *pUas) {
+	uint32_t len;
+
+	len = pUas->pUsbCtrl->hw_api->ReadEP(pUas->pUsbCtrl, pUas->cmd_ep, pUas->CmdBuf);
+	pUas->CmdPrimed = FALSE;
+
+	if (len >= sizeof(UAS_READY_IU)) {
+		switch (pUas->CmdBuf[0]) {
+		case UAS_IU_COMMAND:
+			if (len >= sizeof(UAS_COMMAND_IU)) {
+				mwUAS_CommandIU(pUas);
+				break;
+			}
+			mwUAS_Respond(pUas, ((UAS_COMMAND_IU *) pUas->CmdBuf)->wTag, UAS_RC_INVALID_IU);
+			break;
+
+		case UAS_IU_TASK_MGMT:
+			if (len >= sizeof(UAS_TASK_MGMT_IU)) {
+				mwUAS_TaskMgmtIU(pUas);
+				break;
+			}
+			mwUAS_Respond(pUas, ((UAS_COMMAND_IU *) pUas->CmdBuf)->wTag, UAS_RC_INVALID_IU);
+			break;
+
+		default:
+			mwUAS_Respond(pUas, ((UAS_COMMAND_IU *) pUas->CmdBuf)->wTag, UAS_RC_INVALID_IU);
+			break;
+		}
+	}
+
+	mwUAS_Run(pUas);
+	mwUAS_PrimeCmd(pUas);
+}
+
+/*
+ *  UAS Status Pipe In Callback
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_StatusIn(USB_UAS_CTRL_T *pUas) {
+
+	pUas->StatBusy = FALSE;
+	/* the SENSE IU ends the command */
+	if (pUas->StatCmd != UAS_NO_CMD) {
+		pUas->Cmds[pUas->StatCmd].State = UAS_CMD_FREE;
+		pUas->StatCmd = UAS_NO_CMD;
+	}
+	mwUAS_Run(pUas);
+	mwUAS_PrimeCmd(pUas);
+}
+
+/*
+ *  UAS Data-In Pipe Callback
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_DataInDone(USB_UAS_CTRL_T *pUas) {
+
+	if ((pUas->Active == UAS_NO_CMD) || (pUas->DataIn == FALSE)) {
+		return;
+	}
+	if (pUas->XferQueued) {
+		pUas->XferQueued--;
+	}
+	/* refill the buffer just sent */
+	mwUAS_MemoryRead(pUas);
+
+	if ((pUas->Length == 0) && (pUas->XferQueued == 0)) {
+		mwUAS_Complete(pUas);
+	}
+}
+
+/*
+ *  UAS Data-Out Pipe Callback
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_DataOutDone(USB_UAS_CTRL_T *pUas) {
+	UAS_CMD_T *pCmd;
+	uint32_t len;
+
+	if ((pUas->Active == UAS_NO_CMD) || (pUas->DataIn != FALSE)) {
+		return;
+	}
+	pCmd = &pUas->Cmds[pUas->Active];
+	len = pUas->pUsbCtrl->hw_api->ReadEP(pUas->pUsbCtrl, pUas->dout_ep, pUas->rx_buf);
+	if (pUas->XferQueued) {
+		pUas->XferQueued--;
+	}
+
+	if (pCmd->CDB[0] == SCSI_VERIFY10) {
+		if (pUas->MSC_Verify(((uint32_t) pUas->Offset & 0xFFFFFFFF), pUas->rx_buf, len, (pUas->Offset >> 32)) != LPC_OK) {
+			pUas->MemOK = FALSE;
+		}
+	}
+	/* after a failed write the rest of the data is received and dropped */
+	else if (pCmd->Status == SCSI_STATUS_GOOD) {
+		/* write data recived to user destination through callback */
+		pUas->MSC_Write(((uint32_t) pUas->Offset & 0xFFFFFFFF), &pUas->rx_buf, len, (pUas->Offset >> 32));
+		if (mwUAS_IoFailed(pUas)) {
+			mwUAS_SetSense(pCmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+		}
+	}
+	pUas->Offset += len;
+
+	if (pUas->RxDirect == FALSE) {
+		/* the next queued buffer completes next */
+		pUas->XferDone = mwUAS_XferNextSlot(pUas, pUas->XferDone);
+		pUas->rx_buf = mwUAS_XferSlot(pUas, pUas->XferDone);
+	}
+
+	if ((pUas->Length == 0) && (pUas->XferQueued == 0)) {
+		if (!pUas->MemOK) {
+			mwUAS_SetSense(pCmd, SCSI_SENSE_MISCOMPARE, SCSI_ASC_MISCOMPARE);
+		}
+		/* FUA = 1: the data has to reach the medium before the command completes */
+		else if ((pCmd->Status == SCSI_STATUS_GOOD) && (pCmd->CDB[0] != SCSI_VERIFY10) && (pCmd->CDB[1] & 0x08) &&
+				 (pUas->MSC_Flush) && (pUas->MSC_Flush() != LPC_OK)) {
+			mwUAS_SetSense(pCmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+		}
+		mwUAS_Complete(pUas);
+	}
+	else {
+		mwUAS_ReadReqData(pUas);
+	}
+}
+
+/*
+ *  UAS Reset
+ *  Drops all commands, called on USB bus reset.
+ *  Parameters:      pUas: Handle to UAS structure
+ *  Return Value:    None
+ */
+
+void mwUAS_Reset(USB_UAS_CTRL_T *pUas) {
+	uint32_t i;
+
+	for (i = 0; i < pUas->MaxCmds; i++) {
+		pUas->Cmds[i].State = UAS_CMD_FREE;
+	}
+	pUas->Active = UAS_NO_CMD;
+	pUas->StatCmd = UAS_NO_CMD;
+	pUas->StatBusy = FALSE;
+	pUas->CmdPrimed = FALSE;
+	pUas->RespPending = FALSE;
+	pUas->XferQueued = 0;
+}
+
+/*
+ *  Default UAS Class Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwUAS_ep0_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_UAS_CTRL_T *pUas = (USB_UAS_CTRL_T *) data;
+
+	/* UAS has no class requests */
+	if (event == USB_EVT_RESET) {
+		mwUAS_Reset(pUas);
+	}
+	return ERR_USBD_UNHANDLED;
+}
+
+/*
+ *  UAS Command Pipe Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwUAS_cmd_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_UAS_CTRL_T *pUas = (USB_UAS_CTRL_T *) data;
+
+	switch (event) {
+	case USB_EVT_OUT_NAK:
+		mwUAS_PrimeCmd(pUas);
+		break;
+
+	case USB_EVT_OUT:
+		mwUAS_CmdOut(pUas);
+		break;
+
+	default:
+		break;
+	}
+	return LPC_OK;
+}
+
+/*
+ *  UAS Status Pipe Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwUAS_status_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_UAS_CTRL_T *pUas = (USB_UAS_CTRL_T *) data;
+
+	if (event == USB_EVT_IN) {
+		mwUAS_StatusIn(pUas);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  UAS Data-In Pipe Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwUAS_data_in_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_UAS_CTRL_T *pUas = (USB_UAS_CTRL_T *) data;
+
+	if (event == USB_EVT_IN) {
+		mwUAS_DataInDone(pUas);
+	}
+	return LPC_OK;
+}
+
+/*
+ *  UAS Data-Out Pipe Handler
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  data: Pointer to the data which will be passed when callback function is called by the stack.
+ *                                  event:  Type of endpoint event. See \ref USBD_EVENT_T for more details.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+
+ErrorCode_t mwUAS_data_out_hdlr(USBD_HANDLE_T hUsb, void *data, uint32_t event)
+{
+	USB_UAS_CTRL_T *pUas = (USB_UAS_CTRL_T *) data;
+
+	switch (event) {
+	case USB_EVT_OUT_NAK:
+		if ((pUas->Active != UAS_NO_CMD) && (pUas->DataIn == FALSE) &&
+			(pUas->Cmds[pUas->Active].State == UAS_CMD_DATA)) {
+			mwUAS_ReadReqData(pUas);
+		}
+		break;
+
+	case USB_EVT_OUT:
+		mwUAS_DataOutDone(pUas);
+		break;
+
+	default:
+		break;
+	}
+	return LPC_OK;
+}
+
+/*
+ *  Size of each data buffer requested by the application
+ *  Parameters:      param: UAS function driver initialization parameters.
+ *  Return Value:    Buffer size in bytes, at least one packet.
+ */
+
+uint32_t mwUAS_XferBufSize(USBD_UAS_INIT_PARAM_T *param)
+{
+	uint32_t len = param->XferBufSize;
+
+	if (len > USB_MSC_MAX_XFER_SIZE) {
+		len = USB_MSC_MAX_XFER_SIZE;
+	}
+	/* whole packets only, so that a transfer never ends on a short packet */
+	len &= ~(USB_HS_MAX_BULK_PACKET - 1);
+	return (len == 0) ? USB_HS_MAX_BULK_PACKET : len;
+}
+
+/*
+ *  Number of data buffers requested by the application
+ *  Parameters:      param: UAS function driver initialization parameters.
+ *  Return Value:    Number of buffers, at least 1.
+ */
+
+uint32_t mwUAS_XferBufCnt(USBD_UAS_INIT_PARAM_T *param)
+{
+	if (param->XferBufCnt == 0) {
+		return 1;
+	}
+	return (param->XferBufCnt > USB_MSC_MAX_XFER_BUFS) ? USB_MSC_MAX_XFER_BUFS : param->XferBufCnt;
+}
+
+/*
+ *  Number of command slots requested by the application
+ *  Parameters:      param: UAS function driver initialization parameters.
+ *  Return Value:    Number of slots, at least 1.
+ */
+
+uint32_t mwUAS_MaxCmds(USBD_UAS_INIT_PARAM_T *param)
+{
+	if (param->MaxCmds == 0) {
+		return 1;
+	}
+	return (param->MaxCmds > USB_UAS_MAX_CMDS) ? USB_UAS_MAX_CMDS : param->MaxCmds;
+}
+
+/**
+ * @brief   Get memory required by UAS class.
+ * @param [in/out] param parameter structure used for initialisation.
+ * @retval  Length required for UAS data structure and buffers.
+ *
+ * Example Usage:
+ * @code
+ *    mem_req = mwUAS_GetMemSize(param);
+ * @endcode
+ */
+uint32_t mwUAS_GetMemSize(USBD_UAS_INIT_PARAM_T *param)
+{
+	uint32_t req_len = 0;
+
+	/* calculate required length */
+	req_len += sizeof(USB_UAS_CTRL_T);	/* memory for UAS controller structure */
+	req_len += mwUAS_MaxCmds(param) * sizeof(UAS_CMD_T);	/* memory for command slots */
+	req_len += mwUAS_XferBufSize(param) * mwUAS_XferBufCnt(param);	/* memory for data buffers */
+	req_len += 4;	/* for alignment overhead */
+	req_len &= ~0x3;
+
+	return req_len;
+}
+
+/*
+ *  UAS function initialization routine
+ *  Parameters:     hUsb: Handle to the USB device stack.
+ *                                  param: Structure containing UAS function driver module
+ *						      initialization parameters.
+ *  Return Value:   ErrorCode_t type to indicate success or error condition.
+ */
+ErrorCode_t mwUAS_init(USBD_HANDLE_T hUsb, USBD_UAS_INIT_PARAM_T *param)
+{
+	uint32_t new_addr, i, ep_indx;
+	ErrorCode_t ret = LPC_OK;
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+	USB_UAS_CTRL_T *pUas;
+	USB_ENDPOINT_DESCRIPTOR *pEpDesc;
+	UAS_PIPE_USAGE_DESCRIPTOR *pPipeDesc;
+	USB_INTERFACE_DESCRIPTOR *pIntfDesc = (USB_INTERFACE_DESCRIPTOR *) param->intf_desc;
+
+	/* check for memory alignment */
+	if ((param->mem_base &  0x3) ||
+		(param->mem_size < mwUAS_GetMemSize(param))) {
+		return ERR_USBD_BAD_MEM_BUF;
+	}
+
+	/* allocate memory for the control data structure */
+	pUas = (USB_UAS_CTRL_T *) param->mem_base;
+	param->mem_base += sizeof(USB_UAS_CTRL_T);
+	param->mem_size -= sizeof(USB_UAS_CTRL_T);
+	/* align to 4 byte boundary */
+	while (param->mem_base & 0x03) {
+		param->mem_base++;
+		param->mem_size--;
+	}
+
+	/* Init control structures with passed params */
+	memset((void *) pUas, 0, sizeof(USB_UAS_CTRL_T));
+
+	/* allocate memory for the command slots */
+	pUas->MaxCmds = mwUAS_MaxCmds(param);
+	pUas->Cmds = (UAS_CMD_T *) param->mem_base;
+	param->mem_base += pUas->MaxCmds * sizeof(UAS_CMD_T);
+	param->mem_size -= pUas->MaxCmds * sizeof(UAS_CMD_T);
+
+	/* allocate memory for the data buffers */
+	pUas->XferBufSize = mwUAS_XferBufSize(param);
+	pUas->XferBufCnt = mwUAS_XferBufCnt(param);
+	/* never queue more transfers than a pipe has descriptors for */
+	if (pUas->XferBufCnt > pCtrl->dtd_pool_depth) {
+		pUas->XferBufCnt = pCtrl->dtd_pool_depth;
+	}
+	pUas->XferBuf = (uint8_t *) param->mem_base;
+	param->mem_base += pUas->XferBufSize * pUas->XferBufCnt;
+	param->mem_size -= pUas->XferBufSize * pUas->XferBufCnt;
+
+	pUas->pUsbCtrl = (USB_CORE_CTRL_T *) hUsb;
+	pUas->InquiryStr = param->InquiryStr;
+	pUas->BlockCount = param->BlockCount;
+	pUas->BlockSize = param->BlockSize;
+	pUas->MemorySize = param->MemorySize;
+	/* user defined functions */
+	if ((param->MSC_Write == 0) ||
+		(param->MSC_Read == 0) ||
+		(param->MSC_Verify == 0)) {
+		return ERR_API_INVALID_PARAM2;
+	}
+
+	pUas->MSC_Write = param->MSC_Write;
+	pUas->MSC_Read = param->MSC_Read;
+	pUas->MSC_Verify = param->MSC_Verify;
+	pUas->MSC_GetWriteBuf = param->MSC_GetWriteBuf;
+	pUas->MSC_Flush = param->MSC_Flush;
+	pUas->MSC_VerifyRange = param->MSC_VerifyRange;
+	pUas->MSC_GetError = param->MSC_GetError;
+	mwUAS_Reset(pUas);
+
+	/* parse the interface descriptor */
+	if ((pIntfDesc->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+		(pIntfDesc->bInterfaceClass == USB_DEVICE_CLASS_STORAGE) &&
+		(pIntfDesc->bInterfaceSubClass == MSC_SUBCLASS_SCSI) &&
+		(pIntfDesc->bInterfaceProtocol == MSC_PROTOCOL_UAS) &&
+		(pIntfDesc->bNumEndpoints >= 4) ) {
+
+		/* store interface number */
+		pUas->if_num = pIntfDesc->bInterfaceNumber;
+		new_addr = (uint32_t) pIntfDesc + pIntfDesc->bLength;
+		/* move to next descriptor */
+		for (i = 0; i < pIntfDesc->bNumEndpoints; i++) {
+			pEpDesc = (USB_ENDPOINT_DESCRIPTOR *) new_addr;
+			new_addr = (uint32_t) pEpDesc + pEpDesc->bLength;
+
+			/* each endpoint descriptor is followed by its pipe usage descriptor */
+			pPipeDesc = (UAS_PIPE_USAGE_DESCRIPTOR *) new_addr;
+			if ((pEpDesc->bDescriptorType != USB_ENDPOINT_DESCRIPTOR_TYPE) ||
+				(pEpDesc->bmAttributes != USB_ENDPOINT_TYPE_BULK) ||
+				(pPipeDesc->bDescriptorType != UAS_PIPE_USAGE_DESCRIPTOR_TYPE)) {
+				continue;
+			}
+			new_addr = (uint32_t) pPipeDesc + pPipeDesc->bLength;
+
+			ep_indx = ((pEpDesc->bEndpointAddress & 0x0F) << 1);
+			if (pEpDesc->bEndpointAddress & USB_ENDPOINT_DIRECTION_MASK) {
+				ep_indx++;
+				if (pPipeDesc->bPipeID == UAS_PIPE_ID_STATUS) {
+					pUas->stat_ep = pEpDesc->bEndpointAddress;
+					ret = mwUSB_RegisterEpHandler(hUsb, ep_indx, mwUAS_status_hdlr, pUas);
+				}
+				else if (pPipeDesc->bPipeID == UAS_PIPE_ID_DATA_IN) {
+					pUas->din_ep = pEpDesc->bEndpointAddress;
+					ret = mwUSB_RegisterEpHandler(hUsb, ep_indx, mwUAS_data_in_hdlr, pUas);
+				}
+			}
+			else {
+				if (pPipeDesc->bPipeID == UAS_PIPE_ID_COMMAND) {
+					pUas->cmd_ep = pEpDesc->bEndpointAddress;
+					ret = mwUSB_RegisterEpHandler(hUsb, ep_indx, mwUAS_cmd_hdlr, pUas);
+				}
+				else if (pPipeDesc->bPipeID == UAS_PIPE_ID_DATA_OUT) {
+					pUas->dout_ep = pEpDesc->bEndpointAddress;
+					ret = mwUSB_RegisterEpHandler(hUsb, ep_indx, mwUAS_data_out_hdlr, pUas);
+				}
+			}
+			if (ret != LPC_OK) {
+				break;
+			}
+		}
+
+	}
+	else {
+		return ERR_USBD_BAD_INTF_DESC;
+	}
+
+	if ( (pUas->cmd_ep == 0) || (pUas->stat_ep == 0) || (pUas->din_ep == 0) || (pUas->dout_ep == 0) ||
+		 (ret != LPC_OK) ) {
+		return ERR_USBD_BAD_EP_DESC;
+	}
+
+	/* register ep0 handler for bus reset */
+	return mwUSB_RegisterIntfHandler(hUsb, pUas->if_num, mwUAS_ep0_hdlr, pUas);
+}
@@ -0,0 +1,266 @@
+/***********************************************************************
+ * $Id:: mw_usbd_uasuser.h                                                     $
+ *
+ * Project: USB device ROM Stack
+ *
+ * Description:
+ *     USB Attached SCSI Class Custom User Module definitions.
+ *
+ ***********************************************************************
+ *   Copyright(C) 2011, NXP Semiconductor
+ *   All rights reserved.
+ *
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * products. This software is supplied "AS IS" without any warranties.
+ * NXP Semiconductors assumes no responsibility or liability for the
+ * use of the software, conveys no license or title under any patent,
+ * copyright, or mask work right to the product. NXP Semiconductors
+ * reserves the right to make changes in the software without
+ * notification. NXP Semiconductors also make no representation or
+ * warranty that such application will be suitable for the specified
+ * use without further testing or modification.
+ **********************************************************************/
+#ifndef __UASUSER_H__
+#define __UASUSER_H__
+
+#include "error.h"
+#include "mw_usbd.h"
+#include "mw_usbd_uas.h"
+#include "mw_usbd_core.h"
+
+/** \file
+ *  \brief USB Attached SCSI (UAS) API structures and function prototypes.
+ *
+ *  Definition of functions exported by the UAS function driver.
+ *
+ */
+
+/** \ingroup Group_USBD
+ *  @defgroup USBD_UAS USB Attached SCSI (UAS) Function Driver
+ *  \section Sec_UASModDescription Module Description
+ *  UAS Class Function Driver module. This module contains an internal implementation
+ *  of the USB Attached SCSI protocol for a single logical unit, using the command,
+ *  status, data-in and data-out pipes. Full and high speed are both supported; the
+ *  packet size follows the speed the device enumerated at.
+ *
+ *  Unlike the bulk-only transport of \ref USBD_MSC, the host may queue several tagged
+ *  commands on the command pipe while an earlier command moves data. Queued commands
+ *  are executed in arrival order; the data phase of each is announced to the host
+ *  with a READ READY or WRITE READY IU on the status pipe (the USB 2.0 protocol, no
+ *  bulk streams), and its completion with a SENSE IU. The storage callbacks have the
+ *  same contract as those of \ref USBD_MSC, so a MSC application backend can be used
+ *  unchanged.
+ *
+ *  The interface descriptor passed to Init() should have protocol code
+ *  \ref MSC_PROTOCOL_UAS and four bulk endpoints, each followed by its pipe usage
+ *  descriptor.
+ */
+
+/** \brief Largest number of commands a UAS function driver instance accepts ahead.
+ *  \ingroup USBD_UAS
+ */
+#define USB_UAS_MAX_CMDS                32
+
+/** \brief USB Attached SCSI class function driver initialization parameter data structure.
+ *  \ingroup USBD_UAS
+ *
+ *  \details  This data structure is used to pass initialization parameters to the
+ *  UAS class function driver's init function.
+ *
+ */
+typedef struct USBD_UAS_INIT_PARAM {
+	/* memory allocation params */
+	uint32_t mem_base;	/**< Base memory location from where the stack can allocate
+						   data and buffers. \note The memory address set in this field
+						   should be accessible by USB DMA controller. Also this value
+						   should be aligned on 4 byte boundary.
+						 */
+	uint32_t mem_size;	/**< The size of memory buffer which stack can use.
+						   \note The \em mem_size should be greater than the size
+						   returned by USBD_UAS_API::GetMemSize() routine.*/
+	/* mass storage params */
+	uint8_t *InquiryStr;/**< Pointer to the 28 character string. This string is
+						   sent in response to the SCSI Inquiry command. \note The data
+						   pointed by the pointer should be of global scope.
+						 */
+	uint32_t  BlockCount;	/**< Number of blocks present in the mass storage device */
+	uint32_t  BlockSize;	/**< Block size in number of bytes */
+	uint64_t  MemorySize;	/**< Memory size in number of bytes */
+	/** Pointer to the UAS interface descriptor within the descriptor
+	 * array (\em high_speed_desc) passed to Init() through \ref USB_CORE_DESCS_T
+	 * structure.
+	 */
+	uint8_t *intf_desc;
+
+	/** Size in bytes of each data buffer. READ and WRITE data moves through the
+	 * data pipes in transfers of this size. The value is rounded down to a multiple
+	 * of USB_HS_MAX_BULK_PACKET, limited to \ref USB_MSC_MAX_XFER_SIZE and raised to
+	 * one packet. The buffers are allocated from \em mem_base.
+	 */
+	uint32_t  XferBufSize;
+	/** Number of data buffers queued at once on a data pipe, see
+	 * USBD_MSC_INIT_PARAM::XferBufCnt. Limited to \ref USB_MSC_MAX_XFER_BUFS and to
+	 * the \em dtd_pool_depth the USB stack was initialized with.
+	 */
+	uint32_t  XferBufCnt;
+	/** Number of commands the device accepts ahead of the one being executed,
+	 * including it. The command pipe is not primed while all are in use, which
+	 * holds the host back. Limited to \ref USB_UAS_MAX_CMDS, 0 selects 1.
+	 */
+	uint32_t  MaxCmds;
+
+	/* user defined functions */
+	/** MSC Write callback function, see USBD_MSC_INIT_PARAM::MSC_Write */
+	void (*MSC_Write)(uint32_t offset, uint8_t * *src, uint32_t length, uint32_t high_offset);
+	/** MSC Read callback function, see USBD_MSC_INIT_PARAM::MSC_Read */
+	void (*MSC_Read)(uint32_t offset, uint8_t * *dst, uint32_t length, uint32_t high_offset);
+	/** MSC Verify callback function, see USBD_MSC_INIT_PARAM::MSC_Verify */
+	ErrorCode_t (*MSC_Verify)(uint32_t offset, uint8_t buf[], uint32_t length, uint32_t high_offset);
+	/** Optional zero-copy write buffer callback, see USBD_MSC_INIT_PARAM::MSC_GetWriteBuf */
+	void (*MSC_GetWriteBuf)(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t high_offset);
+	/** Optional flush callback, see USBD_MSC_INIT_PARAM::MSC_Flush */
+	ErrorCode_t (*MSC_Flush)(void);
+	/** Optional medium verify callback, see USBD_MSC_INIT_PARAM::MSC_VerifyRange */
+	ErrorCode_t (*MSC_VerifyRange)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	/** Optional error report callback, see USBD_MSC_INIT_PARAM::MSC_GetError. A READ
+	 * stops sending data and completes with MEDIUM ERROR / UNRECOVERED READ ERROR
+	 * sense, a WRITE drops the rest of its data and completes with MEDIUM ERROR /
+	 * WRITE ERROR sense.
+	 */
+	ErrorCode_t (*MSC_GetError)(void);
+
+} USBD_UAS_INIT_PARAM_T;
+
+/** \brief UAS class API functions structure.
+ *  \ingroup USBD_UAS
+ *
+ *  This module exposes functions which interact directly with USB device controller hardware.
+ *
+ */
+typedef struct USBD_UAS_API {
+	/** \fn uint32_t GetMemSize(USBD_UAS_INIT_PARAM_T* param)
+	 *  Function to determine the memory required by the UAS function driver module.
+	 *
+	 *  This function is called by application layer before calling pUsbApi->uas->Init(), to allocate memory used
+	 *  by UAS function driver module. The application should allocate the memory which is accessible by USB
+	 *  controller/DMA controller.
+	 *  \note Some memory areas are not accessible by all bus masters.
+	 *
+	 *  \param[in] param Structure containing UAS function driver module initialization parameters.
+	 *  \return Returns the required memory size in bytes.
+	 */
+	uint32_t (*GetMemSize)(USBD_UAS_INIT_PARAM_T *param);
+
+	/** \fn ErrorCode_t init(USBD_HANDLE_T hUsb, USBD_UAS_INIT_PARAM_T* param)
+	 *  Function to initialize UAS function driver module.
+	 *
+	 *  This function is called by application layer to initialize UAS function driver module.
+	 *
+	 *  \param[in] hUsb Handle to the USB device stack.
+	 *  \param[in, out] param Structure containing UAS function driver module initialization parameters.
+	 *  \return Returns \ref ErrorCode_t type to indicate success or error condition.
+	 *          \retval LPC_OK On success
+	 *          \retval ERR_USBD_BAD_MEM_BUF  Memory buffer passed is not 4-byte
+	 *              aligned or smaller than required.
+	 *          \retval ERR_API_INVALID_PARAM2 Either MSC_Write() or MSC_Read() or
+	 *              MSC_Verify() callbacks are not defined.
+	 *          \retval ERR_USBD_BAD_INTF_DESC  Wrong interface descriptor is passed.
+	 *          \retval ERR_USBD_BAD_EP_DESC  Wrong endpoint or pipe usage descriptor is passed.
+	 */
+	ErrorCode_t (*init)(USBD_HANDLE_T hUsb, USBD_UAS_INIT_PARAM_T *param);
+
+} USBD_UAS_API_T;
+
+/*-----------------------------------------------------------------------------
+ *  Private functions & structures prototypes
+ *-----------------------------------------------------------------------------*/
+/** @cond  ADVANCED_API */
+
+/* Command states */
+#define UAS_CMD_FREE                    0		/* Slot unused */
+#define UAS_CMD_QUEUED                  1		/* Received, waiting for execution */
+#define UAS_CMD_READY                   2		/* READ/WRITE READY IU to send */
+#define UAS_CMD_DATA                    3		/* Data phase */
+#define UAS_CMD_STATUS                  4		/* SENSE IU to send */
+#define UAS_CMD_SENDING                 5		/* SENSE IU on the status pipe */
+
+#define UAS_NO_CMD                      0xFF
+
+/* Command slot */
+typedef struct _UAS_CMD_T {
+	uint32_t Seq;					/* Arrival order */
+	uint16_t wTag;					/* Tag as sent by the host */
+	uint8_t State;
+	uint8_t Status;					/* SCSI status */
+	uint8_t SenseKey;
+	uint8_t Asc;
+	uint8_t CDB[16];
+} UAS_CMD_T;
+
+typedef struct _UAS_CTRL_T {
+	/* If it's a USB HS, the max packet is 512, if it's USB FS,
+	   the max packet is 64. Use 512 for both HS and FS. */
+	/*ALIGNED(4)*/ uint8_t  CmdBuf[USB_HS_MAX_BULK_PACKET];	/* Command pipe buffer */
+	/*ALIGNED(4)*/ uint8_t  StatBuf[36];		/* Status pipe buffer, largest IU is SENSE */
+	/*ALIGNED(4)*/ uint8_t  DataBuf[36];		/* Data-in buffer of the non-block commands */
+
+	USB_CORE_CTRL_T *pUsbCtrl;
+
+	UAS_CMD_T *Cmds;
+	uint32_t Seq;					/* Arrival counter */
+	uint8_t MaxCmds;
+	uint8_t Active;					/* Command owning the data pipes */
+	uint8_t StatCmd;				/* Command whose SENSE IU is on the status pipe */
+	uint8_t StatBusy;				/* An IU is on the status pipe */
+	uint8_t CmdPrimed;				/* Command pipe is primed */
+	uint8_t RespPending;			/* RESPONSE IU to send */
+	uint8_t RespCode;
+	uint16_t RespTag;
+
+	/* data phase of the active command */
+	uint64_t Offset;				/* R/W Offset */
+	uint32_t Length;				/* Bytes not yet queued */
+	uint32_t SmallLen;				/* Length of DataBuf data, 0 for block data */
+	uint8_t *rx_buf;
+	uint8_t *XferBuf;				/* Data buffers */
+	uint32_t XferBufSize;
+	uint8_t XferBufCnt;
+	uint8_t XferNext;				/* Next data buffer to queue */
+	uint8_t XferDone;				/* Oldest queued data buffer */
+	uint8_t XferQueued;				/* Data transfers queued on the pipe */
+	uint8_t DataIn;					/* Direction of the data phase */
+	uint8_t MemOK;					/* VERIFY compare result */
+	uint8_t RxDirect;				/* Data-out received straight into the MSC_GetWriteBuf() buffer */
+
+	uint8_t if_num;					/* interface number */
+	uint8_t cmd_ep;					/* Command pipe endpoint */
+	uint8_t stat_ep;				/* Status pipe endpoint */
+	uint8_t din_ep;					/* Data-in pipe endpoint */
+	uint8_t dout_ep;				/* Data-out pipe endpoint */
+
+	uint8_t *InquiryStr;
+	uint32_t  BlockCount;
+	uint32_t  BlockSize;
+	uint64_t  MemorySize;
+	/* user defined functions */
+	void (*MSC_Write)(uint32_t offset, uint8_t * *src, uint32_t length, uint32_t high_offset);
+	void (*MSC_Read)(uint32_t offset, uint8_t * *dst, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_Verify)(uint32_t offset, uint8_t src[], uint32_t length, uint32_t high_offset);
+	void (*MSC_GetWriteBuf)(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_Flush)(void);
+	ErrorCode_t (*MSC_VerifyRange)(uint32_t offset, uint32_t length, uint32_t high_offset);
+	ErrorCode_t (*MSC_GetError)(void);
+
+} USB_UAS_CTRL_T;
+
+/** @cond  DIRECT_API */
+extern uint32_t mwUAS_GetMemSize(USBD_UAS_INIT_PARAM_T *param);
+
+extern ErrorCode_t mwUAS_init(USBD_HANDLE_T hUsb, USBD_UAS_INIT_PARAM_T *param);
+
+/** @endcond */
+
+/** @endcond */
+
+#endif  /* __UASUSER_H__ */
@@ -23,9 +23,37 @@
 #define USB_MAX_IF_NUM              8
 #define USB_MAX_EP_NUM              6
 #define USB_MAX_PACKET0             64
+/* String descriptors and configurations the core indexes. Init fails with
+   ERR_USBD_BAD_DESC when the descriptors hold more. */
+#define USB_MAX_STRING_NUM          16
+#define USB_MAX_CONFIG_NUM          1
 /* Max In/Out Packet Size */
 #define USB_FS_MAX_BULK_PACKET      64
 #define USB_HS_MAX_BULK_PACKET      512
+/* Max Interrupt Packet Size, one packet per (micro)frame */
+#define USB_FS_MAX_INT_PACKET       64
+#define USB_HS_MAX_INT_PACKET       1024
+
+/* IP9028 driver: don't wait for endpoint prime/flush to complete. The wait is
+   deferred until the same endpoint is primed again, by when it has normally
+   finished. */
+#ifndef USB_HW_ASYNC_PRIME
+#define USB_HW_ASYNC_PRIME          0
+#endif
+/* IP9028 driver: count CPU cycles spent waiting on endpoint prime/flush.
+   Uses the Cortex-M DWT cycle counter, see hwUSB_GetSpinStats(). */
+#ifndef USB_HW_SPIN_STATS
+#define USB_HW_SPIN_STATS           0
+#endif
+/* IP9028 driver: the ISR only queues controller events, the stack and class
+   handlers run when the application calls pUsbApi->hw->ProcessEvents(). */
+#ifndef USB_HW_DEFER_EVENTS
+#define USB_HW_DEFER_EVENTS         0
+#endif
+/* Depth of the deferred event ring, a power of 2 no larger than 128 */
+#ifndef USB_HW_EVENT_RING_SIZE
+#define USB_HW_EVENT_RING_SIZE      8
+#endif
 
 // #define DFU_BOOT_XFER_BLOCK_SIZE    (2 * 1024)
 // #define DFU_BOOT_MEM_BASE           0x20000000
@@ -0,0 +1,7 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+void board_setup(void);
+
+#endif
+
@@ -0,0 +1,14 @@
+#ifndef BOARD_GPIO_ID_H
+#define BOARD_GPIO_ID_H
+
+enum GPIO_ID {
+    GPIO_ID_LED_ERR,
+    GPIO_ID_LED_BLUE,
+    GPIO_ID_LED_GREEN,
+    GPIO_ID_LED_WARN,
+
+    GPIO_ID_MAX // This should be last: it is used to count
+};
+
+#endif
+
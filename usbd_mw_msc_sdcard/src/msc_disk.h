@@ -0,0 +1,105 @@
+/*
+ * @brief Programming API used with MSC disk
+ *
+ * @note
+ * Copyright(C) NXP Semiconductors, 2012
+ * All rights reserved.
+ *
+ * @par
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * LPC products.  This software is supplied "AS IS" without any warranties of
+ * any kind, and NXP Semiconductors and its licensor disclaim any and
+ * all warranties, express or implied, including all implied warranties of
+ * merchantability, fitness for a particular purpose and non-infringement of
+ * intellectual property rights.  NXP Semiconductors assumes no responsibility
+ * or liability for the use of the software, conveys no license or rights under any
+ * patent, copyright, mask work right, or any other intellectual property rights in
+ * or to any products. NXP Semiconductors reserves the right to make changes
+ * in the software without notification. NXP Semiconductors also makes no
+ * representation or warranty that such application will be suitable for the
+ * specified use without further testing or modification.
+ *
+ * @par
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation is hereby granted, under NXP Semiconductors' and its
+ * licensor's relevant copyrights in the software, without fee, provided that it
+ * is used in conjunction with NXP Semiconductors microcontrollers.  This
+ * copyright, permission, and disclaimer notice must appear in all copies of
+ * this code.
+ */
+
+#ifndef __MSC_DISK_H_
+#define __MSC_DISK_H_
+
+#include "mw_usbd_rom_api.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** @ingroup EXAMPLES_USBDROM_18XX43XX_MSC_SDCARD
+ * @{
+ */
+
+/* MSC Disk Definitions */
+/* SD card sector size, the card is exported with the same block size */
+#define MSC_SD_BLOCK_SIZE               512
+/* Sector cache: two read-ahead windows, together sized to the 64KB
+   READ10 requests typical for hosts. Window 0 is a static buffer which
+   link.ld places in the local SRAM bank, window 1 lives in the AHB SRAM
+   above the USB stack memory. */
+#ifndef MSC_SD_CACHE_WIN1_BASE
+#define MSC_SD_CACHE_WIN1_BASE          0x20008000
+#endif
+#define MSC_SD_CACHE_WIN_SIZE           ((uint32_t) (32 * 1024))
+#define MSC_SD_CACHE_WIN_BLOCKS         (MSC_SD_CACHE_WIN_SIZE / MSC_SD_BLOCK_SIZE)
+/* Write-back cache between the host and the card: 2 sets of 2 lines of
+   4KB, small FAT and directory updates are merged before reaching the
+   card. Dirty lines are written back on SYNCHRONIZE CACHE and after the
+   host has not written for MSC_SD_IDLE_FLUSH_MS. */
+#define MSC_SD_WB_LINE_BLOCKS           8
+#define MSC_SD_WB_SETS                  2
+#define MSC_SD_WB_WAYS                  2
+#define MSC_SD_WB_MEM_SIZE              ((uint32_t) (18 * 1024))
+#define MSC_SD_IDLE_FLUSH_MS            500
+/* Bulk data buffers: READ10 data is sent in chunks of this size */
+#define MSC_USB_XFER_SIZE               (8 * 1024)
+/* Number of bulk data buffers. WRITE10 chunks are received into one buffer
+   while the previous one is written to the card. */
+#define MSC_USB_XFER_BUFS               2
+/* Largest WRITE10 chunk requested from the host at once */
+#define MSC_USB_RX_WINDOW               MSC_USB_XFER_SIZE
+
+/**
+ * @brief	MSC disk init routine
+ * @param	hUsb		: Handle to USBD stack instance
+ * @param	pDesc		: Pointer to configuration descriptor
+ * @param	pUsbParam	: Pointer USB param structure returned by previous init call
+ * @return	Returns LPC_OK, or ERR_FAILED when the SD card size can not be read.
+ */
+ErrorCode_t mscDisk_init (USBD_HANDLE_T hUsb, USB_CORE_DESCS_T *pDesc, USBD_API_INIT_PARAM_T *pUsbParam);
+
+/**
+ * @brief	Write cached data back once the host stopped writing
+ * @return	Nothing
+ * @note	Call from the main loop, at least every MSC_SD_IDLE_FLUSH_MS.
+ */
+void mscDisk_idle (void);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MSC_DISK_H_ */
+
+
+
+
+
+
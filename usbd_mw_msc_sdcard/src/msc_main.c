@@ -0,0 +1,187 @@
+/*
+ * @brief This file contains a USB MSC SD card example using USB ROM Drivers.
+ *
+ * @note
+ * Copyright(C) NXP Semiconductors, 2013
+ * All rights reserved.
+ *
+ * @par
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * LPC products.  This software is supplied "AS IS" without any warranties of
+ * any kind, and NXP Semiconductors and its licensor disclaim any and
+ * all warranties, express or implied, including all implied warranties of
+ * merchantability, fitness for a particular purpose and non-infringement of
+ * intellectual property rights.  NXP Semiconductors assumes no responsibility
+ * or liability for the use of the software, conveys no license or rights under any
+ * patent, copyright, mask work right, or any other intellectual property rights in
+ * or to any products. NXP Semiconductors reserves the right to make changes
+ * in the software without notification. NXP Semiconductors also makes no
+ * representation or warranty that such application will be suitable for the
+ * specified use without further testing or modification.
+ *
+ * @par
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation is hereby granted, under NXP Semiconductors' and its
+ * licensor's relevant copyrights in the software, without fee, provided that it
+ * is used in conjunction with NXP Semiconductors microcontrollers.  This
+ * copyright, permission, and disclaimer notice must appear in all copies of
+ * this code.
+ */
+
+#include "board.h"
+#include "board_GPIO_ID.h"
+#include <chip.h>
+#include <lpc_tools/boardconfig.h>
+#include <lpc_tools/GPIO_HAL.h>
+#include <lpc_tools/clock.h>
+#include <mcu_timing/delay.h>
+#include <mcu_sdcard/sdcard.h>
+
+#include <stdio.h>
+#include <string.h>
+#include "app_usbd_cfg.h"
+#include "msc_disk.h"
+
+#define CPU_FREQ_HZ (60000000)
+
+// Wakes the main loop to check for idle time
+#define SYSTICK_RATE_HZ (10)
+
+// startup code needs this
+unsigned int stack_value = 0xA5A55A5A;
+
+/*****************************************************************************
+ * Public types/enumerations/variables
+ ****************************************************************************/
+
+static USBD_HANDLE_T g_hUsb;
+
+/*****************************************************************************
+ * Public functions
+ ****************************************************************************/
+
+/**
+ * @brief	Handle interrupt from SysTick timer
+ * @return	Nothing
+ */
+void SysTick_Handler(void)
+{
+}
+
+/**
+ * @brief	Handle interrupt from USB0
+ * @return	Nothing
+ */
+void USB_IRQHandler(void)
+{
+	usb_api.hw->ISR(g_hUsb);
+#if USB_HW_DEFER_EVENTS
+	/* run the stack handlers at the lowest priority */
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+#endif
+}
+
+#if USB_HW_DEFER_EVENTS
+/**
+ * @brief	Run USB event handlers deferred by USB_IRQHandler
+ * @return	Nothing
+ */
+void PendSV_Handler(void)
+{
+	usb_api.hw->ProcessEvents(g_hUsb);
+}
+#endif
+
+/**
+ * @brief	main routine for blinky example
+ * @return	Function should not exit.
+ */
+int main(void)
+{
+	board_setup();
+    board_setup_NVIC();
+    board_setup_pins();
+
+    // fpu & system clock setup
+    fpuInit();
+    clock_set_frequency(CPU_FREQ_HZ);
+
+	USBD_API_INIT_PARAM_T usb_param;
+	USB_CORE_DESCS_T desc;
+	ErrorCode_t ret = LPC_OK;
+
+	/* Initialize board and chip */
+	// SystemCoreClockUpdate();
+	// Board_Init();
+
+	/* the SD card driver needs the delay timer */
+	delay_init();
+
+	const GPIO *led_err = board_get_GPIO(GPIO_ID_LED_ERR);
+	const GPIO *led_warn = board_get_GPIO(GPIO_ID_LED_WARN);
+
+	GPIO_HAL_set(led_err, LOW);
+	GPIO_HAL_set(led_warn, LOW);
+
+	sdcard_init(NULL, NULL, NULL);
+	int retries = 0;
+	const enum SDCardStatus status = sdcard_enable(&retries);
+
+	if (status == SDCARD_NOT_FOUND) {
+		/* no card: place an SD card and reset the board */
+		GPIO_HAL_set(led_warn, HIGH);
+		while (1) {}
+	}
+	if (status == SDCARD_ERROR) {
+		GPIO_HAL_set(led_err, HIGH);
+		while (1) {}
+	}
+
+	/* enable clocks and pinmux */
+	USB_init_pin_clk();
+
+	/* initialize call back structures */
+	memset((void *) &usb_param, 0, sizeof(USBD_API_INIT_PARAM_T));
+	usb_param.usb_reg_base = LPC_USB_BASE;
+	usb_param.mem_base = USB_STACK_MEM_BASE;
+	usb_param.mem_size = USB_STACK_MEM_SIZE;
+	usb_param.max_num_ep = 2;
+	/* let the MSC driver queue one transfer per bulk data buffer */
+	usb_param.dtd_pool_depth = MSC_USB_XFER_BUFS;
+
+	/* Set the USB descriptors */
+	desc.device_desc = (uint8_t *) USB_DeviceDescriptor;
+	desc.string_desc = (uint8_t *) USB_StringDescriptor;
+
+	desc.high_speed_desc = USB_HsConfigDescriptor;
+	desc.full_speed_desc = USB_FsConfigDescriptor;
+	desc.device_qualifier = (uint8_t *) USB_DeviceQualifier;
+
+
+	/* USB Initialization */
+	ret = usb_api.hw->Init(&g_hUsb, &desc, &usb_param);
+	if (ret == LPC_OK) {
+		ret = mscDisk_init(g_hUsb, &desc, &usb_param);
+		if (ret == LPC_OK) {
+#if USB_HW_DEFER_EVENTS
+			NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+#endif
+			/*  enable USB interrrupts */
+			NVIC_EnableIRQ(LPC_USB_IRQ);
+			/* now connect */
+			usb_api.hw->Connect(g_hUsb, 1);
+		}
+	}
+	if (ret != LPC_OK) {
+		GPIO_HAL_set(led_err, HIGH);
+	}
+	SysTick_Config(SystemCoreClock / SYSTICK_RATE_HZ);
+
+	while (1) {
+		/* Sleep until next IRQ happens */
+		__WFI();
+		mscDisk_idle();
+	}
+}
+
@@ -0,0 +1,303 @@
+/*
+ * @brief File contains callback to MSC driver backed by an SD card.
+ *
+ * @note
+ * Copyright(C) NXP Semiconductors, 2013
+ * All rights reserved.
+ *
+ * @par
+ * Software that is described herein is for illustrative purposes only
+ * which provides customers with programming information regarding the
+ * LPC products.  This software is supplied "AS IS" without any warranties of
+ * any kind, and NXP Semiconductors and its licensor disclaim any and
+ * all warranties, express or implied, including all implied warranties of
+ * merchantability, fitness for a particular purpose and non-infringement of
+ * intellectual property rights.  NXP Semiconductors assumes no responsibility
+ * or liability for the use of the software, conveys no license or rights under any
+ * patent, copyright, mask work right, or any other intellectual property rights in
+ * or to any products. NXP Semiconductors reserves the right to make changes
+ * in the software without notification. NXP Semiconductors also makes no
+ * representation or warranty that such application will be suitable for the
+ * specified use without further testing or modification.
+ *
+ * @par
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation is hereby granted, under NXP Semiconductors' and its
+ * licensor's relevant copyrights in the software, without fee, provided that it
+ * is used in conjunction with NXP Semiconductors microcontrollers.  This
+ * copyright, permission, and disclaimer notice must appear in all copies of
+ * this code.
+ */
+
+#include <string.h>
+#include <chip.h>
+#include "board.h"
+#include "app_usbd_cfg.h"
+#include "msc_disk.h"
+#include "mw_usbd_msccache.h"
+
+#include <mcu_sdcard/sdcard.h>
+#include <fatfs_lib/diskio.h>
+#include <mcu_timing/delay.h>
+
+/*****************************************************************************
+ * Private types/enumerations/variables
+ ****************************************************************************/
+
+/* FatFs physical drive number of the SD card */
+#define MSC_SD_DRIVE        0
+#define MSC_SD_CACHE_WINS   2
+
+/* Read-ahead window: a run of consecutive card sectors */
+typedef struct {
+	uint8_t *buf;
+	uint64_t lba;
+	uint32_t cnt;		/* number of valid sectors, 0 if empty */
+} MSC_SD_WIN_T;
+
+/* window 0 is reserved in the local SRAM bank by the .msc_sd_cache section of link.ld */
+static uint8_t g_cacheWin0[MSC_SD_CACHE_WIN_SIZE] __attribute__((section(".msc_sd_cache"), aligned(4)));
+static MSC_SD_WIN_T g_cacheWin[MSC_SD_CACHE_WINS] = {
+	{g_cacheWin0, 0, 0},
+	{(uint8_t *) MSC_SD_CACHE_WIN1_BASE, 0, 0},
+};
+/* window holding the sectors handed out last, they may still be on the bus */
+static uint32_t g_lastWin;
+/* sector following the last read, used to detect sequential streams */
+static uint64_t g_nextLba;
+static uint64_t g_blockCount;
+
+/* write-back cache, see msc_disk.h */
+static USB_MSC_CACHE_T *g_hCache;
+static uint32_t g_cacheMem[MSC_SD_WB_MEM_SIZE / sizeof(uint32_t)];
+static uint64_t g_lastWrite;
+/* result of the last read or write callback, see translate_error() */
+static ErrorCode_t g_ioError;
+
+static const uint8_t g_InquiryStr[] = {'N', 'X', 'P', ' ', ' ', ' ', ' ', ' ',	   \
+									   'L', 'P', 'C', ' ', 'S', 'D', ' ', 'C',	   \
+									   'a', 'r', 'd', ' ', ' ', ' ', ' ', ' ',	   \
+									   '1', '.', '0', ' ', };
+/*****************************************************************************
+ * Public types/enumerations/variables
+ ****************************************************************************/
+
+/*****************************************************************************
+ * Private functions
+ ****************************************************************************/
+
+static uint64_t sd_lba(uint32_t offset, uint32_t hi_offset)
+{
+	return (((uint64_t) offset) | (((uint64_t) hi_offset) << 32)) / MSC_SD_BLOCK_SIZE;
+}
+
+/* Cache backend: multi-block SDIO transfers */
+static ErrorCode_t sd_read_blocks(uint64_t lba, uint8_t *buf, uint32_t cnt)
+{
+	return (disk_read(MSC_SD_DRIVE, buf, (DWORD) lba, cnt) == RES_OK) ? LPC_OK : ERR_FAILED;
+}
+
+static ErrorCode_t sd_write_blocks(uint64_t lba, const uint8_t *buf, uint32_t cnt)
+{
+	return (disk_write(MSC_SD_DRIVE, buf, (DWORD) lba, cnt) == RES_OK) ? LPC_OK : ERR_FAILED;
+}
+
+/* Return the cached copy of the given sectors, reading them from the card
+   on a miss. Sequential streams fill a whole window in one multi-block
+   transfer so the following chunks of the request are served from RAM.
+   Returns 0 if the card read failed. */
+static uint8_t *sd_cache_read(uint64_t lba, uint32_t cnt)
+{
+	MSC_SD_WIN_T *pWin;
+	uint32_t i;
+	uint32_t fill;
+
+	for (i = 0; i < MSC_SD_CACHE_WINS; i++) {
+		pWin = &g_cacheWin[i];
+		if ((pWin->cnt != 0) && (lba >= pWin->lba) && ((lba + cnt) <= (pWin->lba + pWin->cnt))) {
+			g_lastWin = i;
+			g_nextLba = lba + cnt;
+			return &pWin->buf[(lba - pWin->lba) * MSC_SD_BLOCK_SIZE];
+		}
+	}
+
+	/* miss: never refill the window which may still be transmitting */
+	i = (g_lastWin + 1) % MSC_SD_CACHE_WINS;
+	pWin = &g_cacheWin[i];
+
+	fill = cnt;
+	if (lba == g_nextLba) {
+		fill = MSC_SD_CACHE_WIN_BLOCKS;
+	}
+	if (fill > (g_blockCount - lba)) {
+		fill = g_blockCount - lba;
+	}
+
+	/* blocks written by the host may still sit in the write-back cache */
+	if (mwMSC_CacheRead(g_hCache, lba * MSC_SD_BLOCK_SIZE, pWin->buf, fill * MSC_SD_BLOCK_SIZE) != LPC_OK) {
+		/* nothing valid in the window, and no stream to continue */
+		pWin->cnt = 0;
+		g_nextLba = g_blockCount;
+		return 0;
+	}
+	pWin->lba = lba;
+	pWin->cnt = fill;
+
+	g_lastWin = i;
+	g_nextLba = lba + cnt;
+	return pWin->buf;
+}
+
+/* Drop cached copies of sectors overwritten by the host */
+static void sd_cache_invalidate(uint64_t lba, uint32_t cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i < MSC_SD_CACHE_WINS; i++) {
+		if ((lba < (g_cacheWin[i].lba + g_cacheWin[i].cnt)) && (g_cacheWin[i].lba < (lba + cnt))) {
+			g_cacheWin[i].cnt = 0;
+		}
+	}
+}
+
+/* USB device mass storage class read callback routine */
+static void translate_rd(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t hi_offset)
+{
+	uint8_t *buf = sd_cache_read(sd_lba(offset, hi_offset), length / MSC_SD_BLOCK_SIZE);
+
+	if (buf == 0) {
+		/* reported through translate_error(), the data is not sent */
+		g_ioError = ERR_FAILED;
+		return;
+	}
+	*buff_adr = buf;
+}
+
+/* USB device mass storage class write callback routine */
+static void translate_wr(uint32_t offset, uint8_t * *buff_adr, uint32_t length, uint32_t hi_offset)
+{
+	uint64_t lba = sd_lba(offset, hi_offset);
+
+	sd_cache_invalidate(lba, (length + MSC_SD_BLOCK_SIZE - 1) / MSC_SD_BLOCK_SIZE);
+	/* the next chunk is already being received into the other bulk buffer */
+	if (mwMSC_CacheWrite(g_hCache, ((uint64_t) offset) | (((uint64_t) hi_offset) << 32), *buff_adr, length) != LPC_OK) {
+		/* a write-back of an evicted line failed */
+		g_ioError = ERR_FAILED;
+	}
+	g_lastWrite = delay_get_timestamp();
+}
+
+/* USB device mass storage class error callback routine, called after each
+   read and write callback */
+static ErrorCode_t translate_error(void)
+{
+	ErrorCode_t ret = g_ioError;
+
+	g_ioError = LPC_OK;
+	return ret;
+}
+
+/* USB device mass storage class flush callback routine */
+static ErrorCode_t translate_flush(void)
+{
+	return mwMSC_CacheFlush(g_hCache);
+}
+
+/* USB device mass storage class verify callback routine */
+static ErrorCode_t translate_verify(uint32_t offset, uint8_t *src, uint32_t length, uint32_t hi_offset)
+{
+	uint64_t lba = sd_lba(offset, hi_offset);
+	uint32_t skip = offset % MSC_SD_BLOCK_SIZE;
+	uint32_t cnt = (skip + length + MSC_SD_BLOCK_SIZE - 1) / MSC_SD_BLOCK_SIZE;
+	uint8_t *buf = sd_cache_read(lba, cnt);
+
+	if ((buf == 0) || memcmp(buf + skip, src, length)) {
+		return ERR_FAILED;
+	}
+
+	return LPC_OK;
+}
+
+/*****************************************************************************
+ * Public functions
+ ****************************************************************************/
+
+/* SD card based MSC_Disk init routine */
+ErrorCode_t mscDisk_init(USBD_HANDLE_T hUsb, USB_CORE_DESCS_T *pDesc, USBD_API_INIT_PARAM_T *pUsbParam)
+{
+	USBD_MSC_INIT_PARAM_T msc_param;
+	USBD_MSC_CACHE_INIT_PARAM_T cache_param;
+	ErrorCode_t ret = LPC_OK;
+	DWORD count = 0;
+
+	if ((disk_ioctl(MSC_SD_DRIVE, GET_SECTOR_COUNT, &count) != RES_OK) || (count == 0)) {
+		return ERR_FAILED;
+	}
+	g_blockCount = count;
+
+	memset((void *) &cache_param, 0, sizeof(USBD_MSC_CACHE_INIT_PARAM_T));
+	cache_param.mem_base = (uint32_t) g_cacheMem;
+	cache_param.mem_size = sizeof(g_cacheMem);
+	cache_param.BlockSize = MSC_SD_BLOCK_SIZE;
+	cache_param.LineBlocks = MSC_SD_WB_LINE_BLOCKS;
+	cache_param.NumSets = MSC_SD_WB_SETS;
+	cache_param.NumWays = MSC_SD_WB_WAYS;
+	cache_param.ReadBlocks = sd_read_blocks;
+	cache_param.WriteBlocks = sd_write_blocks;
+	ret = mwMSC_CacheInit(&g_hCache, &cache_param);
+	if (ret != LPC_OK) {
+		return ret;
+	}
+
+	memset((void *) &msc_param, 0, sizeof(USBD_MSC_INIT_PARAM_T));
+	msc_param.mem_base = pUsbParam->mem_base;
+	msc_param.mem_size = pUsbParam->mem_size;
+	/* mass storage paramas */
+	msc_param.InquiryStr = (uint8_t *) g_InquiryStr;
+	msc_param.BlockCount = count;
+	msc_param.BlockSize = MSC_SD_BLOCK_SIZE;
+	/* cards above 4GB do not fit MemorySize */
+	msc_param.MemorySize = 0;
+	msc_param.MemorySize64 = g_blockCount * MSC_SD_BLOCK_SIZE;
+	msc_param.XferBufSize = MSC_USB_XFER_SIZE;
+	msc_param.RxWindow = MSC_USB_RX_WINDOW;
+	msc_param.XferBufCnt = MSC_USB_XFER_BUFS;
+	/* Install SD card callback routines. There is no MSC_GetWriteBuf: WRITE10
+	   data is received into the bulk buffers so reception overlaps the card
+	   write of the previous chunk. */
+	msc_param.MSC_Write = translate_wr;
+	msc_param.MSC_Read = translate_rd;
+	msc_param.MSC_Verify = translate_verify;
+	msc_param.MSC_Flush = translate_flush;
+	msc_param.MSC_GetError = translate_error;
+	msc_param.intf_desc = (uint8_t *) usb_api.core->FindIntfDesc(hUsb, USB_HIGH_SPEED, USB_DEVICE_CLASS_STORAGE);
+
+	ret = usb_api.msc->init(hUsb, &msc_param);
+	/* update memory variables */
+	pUsbParam->mem_base = msc_param.mem_base;
+	pUsbParam->mem_size = msc_param.mem_size;
+
+	return ret;
+}
+
+/* Write cached data back once the host stopped writing */
+void mscDisk_idle(void)
+{
+	USBD_MSC_CACHE_STATS_T stats;
+	uint32_t basepri;
+
+	if (g_hCache == 0) {
+		return;
+	}
+	/* the cache is used from the USB interrupt, or from PendSV at the lowest
+	   priority with USB_HW_DEFER_EVENTS. Mask both; the SD card and delay
+	   timer interrupts above them keep running during the flush. */
+	basepri = __get_BASEPRI();
+	__set_BASEPRI(NVIC_GetPriority(LPC_USB_IRQ) << (8 - __NVIC_PRIO_BITS));
+	mwMSC_CacheGetStats(g_hCache, &stats, 0);
+	if ((stats.dirty != 0) &&
+		((delay_calc_time_us(g_lastWrite, delay_get_timestamp()) / 1000) >= MSC_SD_IDLE_FLUSH_MS)) {
+		mwMSC_CacheFlush(g_hCache);
+	}
+	__set_BASEPRI(basepri);
+}